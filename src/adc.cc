@@ -24,12 +24,30 @@
 
 #include "adc.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
 
 #include "common/logging.h"
+#include "common/string-util.h"
 
 static const char kSysNode[] = "/sys/bus/iio/devices/iio:device0";
+static const char kDevice[] = "/dev/iio:device0";
+
+// Number of scans the kernel buffers for us.
+#define ADC_BUFFER_LENGTH 128
+
+// Weight of a new sample in the exponential moving average is 1/this.
+#define ADC_FILTER_WEIGHT 8
+
+// Fraction bits of the filtered values.
+#define ADC_FILTER_SHIFT 4
 
 int arc_read_raw(int chan) {
   if (chan < 0 || chan > 7) {
@@ -54,3 +72,195 @@ int arc_read_raw(int chan) {
 
   return atoi(buf);
 }
+
+static bool WriteSysfs(const std::string &path, const char *value) {
+  FILE *fp = fopen(path.c_str(), "w");
+  if (!fp) {
+    Log_error("ADC: unable to open %s: %s", path.c_str(), strerror(errno));
+    return false;
+  }
+  const bool success = (fputs(value, fp) >= 0);
+  return (fclose(fp) == 0) && success;
+}
+
+static bool ReadSysfs(const std::string &path, char *buf, size_t size) {
+  FILE *fp = fopen(path.c_str(), "r");
+  if (!fp) {
+    Log_error("ADC: unable to open %s: %s", path.c_str(), strerror(errno));
+    return false;
+  }
+  const bool success = (fgets(buf, size, fp) != NULL);
+  fclose(fp);
+  return success;
+}
+
+ADCSampler::ADCSampler() : ADCSampler(kSysNode, kDevice) {}
+
+ADCSampler::ADCSampler(const char *sysfs_dir, const char *device)
+  : sysfs_dir_(sysfs_dir), device_(device), fd_(-1), running_(false),
+    channel_count_(0), scan_bytes_(0) {
+  for (std::atomic<int32_t> &f : filtered_) f = -1;
+}
+
+ADCSampler::~ADCSampler() {
+  Stop();
+}
+
+bool ADCSampler::SetBufferEnable(bool enable) {
+  return WriteSysfs(sysfs_dir_ + "/buffer/enable", enable ? "1" : "0");
+}
+
+bool ADCSampler::Start(uint8_t channel_mask) {
+  if (running_ || !channel_mask) return false;
+  SetBufferEnable(false);  // Channels can only be changed while disabled.
+
+  channel_count_ = 0;
+  for (int chan = 0; chan < 8; ++chan) {
+    const bool enable = channel_mask & (1 << chan);
+    const std::string prefix =
+      StringPrintf("%s/scan_elements/in_voltage%d_", sysfs_dir_.c_str(), chan);
+    if (!WriteSysfs(prefix + "en", enable ? "1" : "0"))
+      return false;
+    if (!enable) continue;
+
+    // The type is given as e.g. "le:u12/16>>0"
+    char type[32], index[32];
+    ChannelFormat format;
+    char endian, sign;
+    if (!ReadSysfs(prefix + "type", type, sizeof(type))
+        || sscanf(type, "%ce:%c%d/%d>>%d", &endian, &sign, &format.bits,
+                  &format.storage_bytes, &format.shift) != 5
+        || !ReadSysfs(prefix + "index", index, sizeof(index))) {
+      Log_error("ADC: can't determine format of channel %d", chan);
+      return false;
+    }
+    format.index = atoi(index);
+    format.big_endian = (endian == 'b');
+    format.is_signed = (sign == 's');
+    format.storage_bytes /= 8;
+    if ((format.storage_bytes != 2 && format.storage_bytes != 4)
+        || format.bits < 1
+        || format.bits > std::min(24, 8 * format.storage_bytes)) {
+      Log_error("ADC: unsupported format %s of channel %d", type, chan);
+      return false;
+    }
+
+    // Keep in scan order.
+    int pos = channel_count_++;
+    for (; pos > 0 && formats_[pos-1].index > format.index; --pos) {
+      channels_[pos] = channels_[pos-1];
+      formats_[pos] = formats_[pos-1];
+    }
+    channels_[pos] = chan;
+    formats_[pos] = format;
+  }
+  // There might be a timestamp, which we don't need.
+  const std::string timestamp = sysfs_dir_ + "/scan_elements/in_timestamp_en";
+  if (access(timestamp.c_str(), F_OK) == 0) WriteSysfs(timestamp, "0");
+
+  // Each element is aligned to its size within a scan.
+  scan_bytes_ = 0;
+  int alignment = 1;
+  for (int i = 0; i < channel_count_; ++i) {
+    const int size = formats_[i].storage_bytes;
+    scan_bytes_ = (scan_bytes_ + size - 1) / size * size + size;
+    alignment = std::max(alignment, size);
+  }
+  scan_bytes_ = (scan_bytes_ + alignment - 1) / alignment * alignment;
+
+  if (!WriteSysfs(sysfs_dir_ + "/buffer/length",
+                  StringPrintf("%d", ADC_BUFFER_LENGTH).c_str())
+      || !SetBufferEnable(true)) {
+    return false;
+  }
+  fd_ = open(device_.c_str(), O_RDONLY | O_NONBLOCK);
+  if (fd_ < 0) {
+    Log_error("ADC: unable to open %s: %s", device_.c_str(), strerror(errno));
+    SetBufferEnable(false);
+    return false;
+  }
+
+  running_ = true;
+  if (pthread_create(&thread_, NULL, &ThreadMain, this) != 0) {
+    running_ = false;
+    close(fd_);
+    fd_ = -1;
+    SetBufferEnable(false);
+    return false;
+  }
+  return true;
+}
+
+void ADCSampler::Stop() {
+  if (fd_ < 0) return;
+  running_ = false;
+  pthread_join(thread_, NULL);
+  close(fd_);
+  fd_ = -1;
+  SetBufferEnable(false);
+}
+
+int ADCSampler::Read(int chan) const {
+  if (chan < 0 || chan > 7) return -1;
+  const int32_t value = filtered_[chan];
+  if (value < 0) return -1;
+  return (value + (1 << (ADC_FILTER_SHIFT - 1))) >> ADC_FILTER_SHIFT;
+}
+
+void *ADCSampler::ThreadMain(void *self) {
+  reinterpret_cast<ADCSampler*>(self)->ReadSamples();
+  return NULL;
+}
+
+void ADCSampler::ReadSamples() {
+  uint8_t buffer[ADC_BUFFER_LENGTH * 8 * 4];
+  const int max_read = sizeof(buffer) / scan_bytes_ * scan_bytes_;
+  int fill = 0;   // Bytes of a partial scan at the beginning of the buffer.
+  struct pollfd pfd = { fd_, POLLIN, 0 };
+  while (running_) {
+    // Wake up regularly to see if we should stop.
+    if (poll(&pfd, 1, 100) <= 0) continue;
+    const ssize_t r = read(fd_, buffer + fill, max_read - fill);
+    if (r == 0) break;   // The device went away.
+    if (r < 0) {
+      if (errno == EAGAIN || errno == EINTR) continue;
+      Log_error("ADC: reading samples: %s", strerror(errno));
+      break;
+    }
+    fill += r;
+    const int scans = fill / scan_bytes_;
+    for (int i = 0; i < scans; ++i) {
+      ProcessScan(buffer + i * scan_bytes_);
+    }
+    const int processed = scans * scan_bytes_;
+    memmove(buffer, buffer + processed, fill - processed);
+    fill -= processed;
+  }
+}
+
+void ADCSampler::ProcessScan(const uint8_t *scan) {
+  int offset = 0;
+  for (int i = 0; i < channel_count_; ++i) {
+    const ChannelFormat &f = formats_[i];
+    offset = (offset + f.storage_bytes - 1) / f.storage_bytes * f.storage_bytes;
+    uint32_t raw = 0;
+    for (int b = 0; b < f.storage_bytes; ++b) {
+      const int byte = f.big_endian ? b : f.storage_bytes - 1 - b;
+      raw = (raw << 8) | scan[offset + byte];
+    }
+    offset += f.storage_bytes;
+    raw = (raw >> f.shift) & ((1u << f.bits) - 1);
+    int32_t sample = raw;
+    if (f.is_signed && (raw & (1u << (f.bits - 1))))
+      sample -= (1 << f.bits);
+    sample = std::max(sample, 0);   // Negative values mark absent ones.
+
+    // Exponential moving average against noise.
+    std::atomic<int32_t> &filtered = filtered_[channels_[i]];
+    const int32_t scaled = sample << ADC_FILTER_SHIFT;
+    const int32_t previous = filtered;
+    filtered = (previous < 0)
+      ? scaled
+      : previous + (scaled - previous) / ADC_FILTER_WEIGHT;
+  }
+}
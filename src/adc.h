@@ -20,6 +20,67 @@
 #ifndef BEAGLEG_ADC_
 #define BEAGLEG_ADC_
 
+#include <pthread.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <string>
+
+// Reads a single value of an ADC channel through sysfs. Slow: opens the
+// file for every call.
 int arc_read_raw(int chan);
 
+// Continuous sampling of ADC channels through the IIO buffer. A thread
+// reads the samples as the ADC produces them and keeps a low-pass filtered
+// value per channel, so reading the latest value doesn't need a system call.
+class ADCSampler {
+public:
+  // Sampler of the ADC of the BeagleBone.
+  ADCSampler();
+
+  // Sampler of the IIO device with the given sysfs directory and character
+  // device.
+  ADCSampler(const char *sysfs_dir, const char *device);
+  ~ADCSampler();
+
+  // Start sampling the channels 0..7 in "channel_mask". Returns false if
+  // the buffered interface is not available.
+  bool Start(uint8_t channel_mask);
+
+  // Stop sampling. The last values remain available.
+  void Stop();
+
+  // Filtered value of the given channel. -1 if there is no sample yet.
+  int Read(int chan) const;
+
+private:
+  struct ChannelFormat {
+    int index;          // Order in a scan.
+    bool big_endian;
+    bool is_signed;
+    int bits;
+    int storage_bytes;
+    int shift;
+  };
+
+  static void *ThreadMain(void *self);
+  void ReadSamples();
+  void ProcessScan(const uint8_t *scan);
+  bool SetBufferEnable(bool enable);
+
+  const std::string sysfs_dir_;
+  const std::string device_;
+  int fd_;
+  pthread_t thread_;
+  std::atomic<bool> running_;
+
+  int channel_count_;
+  int channels_[8];                // Channels in scan order.
+  ChannelFormat formats_[8];       // Of the channels in scan order.
+  int scan_bytes_;
+
+  // Filtered value per channel in 1/16, -1 if none.
+  std::atomic<int32_t> filtered_[8];
+};
+
 #endif  // BEAGLEG_ADC_
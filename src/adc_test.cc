@@ -0,0 +1,145 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 H Hartley Sweeten <hsweeten@visionengravers.com>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "adc.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <string>
+#include <gtest/gtest.h>
+
+#include "common/logging.h"
+#include "common/string-util.h"
+
+namespace {
+// An IIO device in /tmp with a FIFO as character device.
+class FakeIIODevice {
+public:
+  FakeIIODevice() : writer_(-1) {
+    char name[] = "/tmp/adc-test.XXXXXX";
+    dir_ = mkdtemp(name);
+    mkdir((dir_ + "/scan_elements").c_str(), 0700);
+    mkdir((dir_ + "/buffer").c_str(), 0700);
+    for (int chan = 0; chan < 8; ++chan) {
+      const std::string prefix =
+        StringPrintf("%s/scan_elements/in_voltage%d_", dir_.c_str(), chan);
+      Write(prefix + "en", "0\n");
+      Write(prefix + "type", "le:u12/16>>0\n");
+      Write(prefix + "index", StringPrintf("%d\n", chan));
+    }
+    Write(dir_ + "/buffer/enable", "0\n");
+    Write(dir_ + "/buffer/length", "0\n");
+    EXPECT_EQ(0, mkfifo(device().c_str(), 0600));
+  }
+  ~FakeIIODevice() {
+    if (writer_ >= 0) close(writer_);
+    system(("rm -rf " + dir_).c_str());
+  }
+
+  std::string dir() const { return dir_; }
+  std::string device() const { return dir_ + "/device"; }
+
+  std::string Read(const std::string &file) const {
+    char buf[32] = {};
+    FILE *fp = fopen((dir_ + "/" + file).c_str(), "r");
+    if (!fp) return "";
+    fgets(buf, sizeof(buf), fp);
+    fclose(fp);
+    return buf;
+  }
+
+  // Send scans of two 16 bit little endian values.
+  void SendScans(int count, uint16_t first, uint16_t second) {
+    if (writer_ < 0) writer_ = open(device().c_str(), O_WRONLY);
+    const uint8_t scan[4] = { (uint8_t)(first & 0xff), (uint8_t)(first >> 8),
+                              (uint8_t)(second & 0xff), (uint8_t)(second >> 8) };
+    for (int i = 0; i < count; ++i) {
+      // Split a scan across writes now and then.
+      if (i % 7 == 3) {
+        ASSERT_EQ(1, write(writer_, scan, 1));
+        ASSERT_EQ(3, write(writer_, scan + 1, 3));
+      } else {
+        ASSERT_EQ(4, write(writer_, scan, 4));
+      }
+    }
+  }
+
+private:
+  static void Write(const std::string &file, const std::string &content) {
+    FILE *fp = fopen(file.c_str(), "w");
+    fputs(content.c_str(), fp);
+    fclose(fp);
+  }
+
+  std::string dir_;
+  int writer_;
+};
+
+// Wait up to a second for the sampler to have read a particular value.
+bool WaitForValue(const ADCSampler &sampler, int chan, int value) {
+  const struct timespec ms = { 0, 1000000 };
+  for (int i = 0; i < 1000 && sampler.Read(chan) != value; ++i)
+    nanosleep(&ms, NULL);
+  return sampler.Read(chan) == value;
+}
+}  // namespace
+
+TEST(ADCSampler, FilteredValuesOfEnabledChannels) {
+  FakeIIODevice device;
+  ADCSampler sampler(device.dir().c_str(), device.device().c_str());
+  EXPECT_EQ(-1, sampler.Read(2));
+  ASSERT_TRUE(sampler.Start((1 << 2) | (1 << 5)));
+  EXPECT_EQ("1", device.Read("buffer/enable"));
+  EXPECT_EQ("128", device.Read("buffer/length"));
+  EXPECT_EQ("1", device.Read("scan_elements/in_voltage2_en"));
+  EXPECT_EQ("0", device.Read("scan_elements/in_voltage3_en"));
+
+  device.SendScans(20, 1000, 4000);
+  EXPECT_TRUE(WaitForValue(sampler, 2, 1000));
+  EXPECT_TRUE(WaitForValue(sampler, 5, 4000));
+  EXPECT_EQ(-1, sampler.Read(3));
+
+  // A single outlier is smoothed out; the filter follows a new level.
+  device.SendScans(1, 1800, 4000);
+  EXPECT_TRUE(WaitForValue(sampler, 2, 1100));
+  device.SendScans(100, 2000, 12);
+  EXPECT_TRUE(WaitForValue(sampler, 2, 2000));
+  EXPECT_TRUE(WaitForValue(sampler, 5, 12));
+
+  sampler.Stop();
+  EXPECT_EQ("0", device.Read("buffer/enable"));
+  EXPECT_EQ(2000, sampler.Read(2));   // Still there.
+}
+
+TEST(ADCSampler, FailsWithoutDevice) {
+  ADCSampler sampler("/nonexistent/iio", "/nonexistent/device");
+  EXPECT_FALSE(sampler.Start(0xff));
+  EXPECT_EQ(-1, sampler.Read(0));
+}
+
+int main(int argc, char *argv[]) {
+  Log_init("/dev/stderr");
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -24,6 +24,7 @@
 #include <string.h>
 #include <assert.h>
 #include <initializer_list>
+#include <atomic>
 
 // Fixed array of POD types (that can be zeroed with bzero()).
 // Allows to have the index be a specific type (typically an enum instad of int).
@@ -121,6 +122,41 @@ private:
   T buffer_[CAPACITY];
 };
 
+// A fixed size, compile-time allocated lock-free queue to hand over elements
+// from exactly one producer thread to exactly one consumer thread.
+// Like the RingDeque, it can hold up to CAPACITY - 1 elements.
+template <typename T, int CAPACITY>
+class SPSCQueue {
+public:
+  SPSCQueue() : write_pos_(0), read_pos_(0) {}
+
+  // Only call from the producer thread. Returns false if queue is full.
+  bool TryPush(const T &value) {
+    const unsigned pos = write_pos_.load(std::memory_order_relaxed);
+    const unsigned next = (pos + 1) % CAPACITY;
+    if (next == read_pos_.load(std::memory_order_acquire))
+      return false;
+    buffer_[pos] = value;
+    write_pos_.store(next, std::memory_order_release);
+    return true;
+  }
+
+  // Only call from the consumer thread. Returns false if queue is empty.
+  bool TryPop(T *value) {
+    const unsigned pos = read_pos_.load(std::memory_order_relaxed);
+    if (pos == write_pos_.load(std::memory_order_acquire))
+      return false;
+    *value = buffer_[pos];
+    read_pos_.store((pos + 1) % CAPACITY, std::memory_order_release);
+    return true;
+  }
+
+private:
+  std::atomic<unsigned> write_pos_;
+  std::atomic<unsigned> read_pos_;
+  T buffer_[CAPACITY];
+};
+
 
 // This class provides a way to iterate over enumeration values. Assumes enum
 // values to be contiguous.
@@ -22,7 +22,8 @@
 #include <errno.h>
 #include <signal.h>
 #include <string.h>
-#include <sys/select.h>
+#include <sys/timerfd.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <algorithm>
@@ -64,55 +65,201 @@ static void disarm_signal_handler() {
   signal(SIGFPE, SIG_DFL);
 }
 
+// Events we get per epoll_wait(). If more are ready, we get the rest in the
+// next cycle.
+#define MAX_EVENTS_PER_CYCLE 16
+
+// The generation of the registration goes along with the fd in the event
+// data, so that we can recognize events of file descriptors that have been
+// closed and re-registered within the same cycle.
+static uint64_t EventKey(int fd, uint32_t generation) {
+  return ((uint64_t)generation << 32) | (uint32_t)fd;
+}
+
+// Event key of our timer_fd_; no generation of a registration gets there.
+#define TIMER_EVENT_KEY UINT64_MAX
+
+#define NANOS_PER_MILLI 1000000LL
+
+static int64_t MonotonicNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+FDMultiplexer::FDMultiplexer(unsigned idle_ms, bool edge_triggered)
+  : idle_ms_(idle_ms), edge_trigger_flag_(edge_triggered ? EPOLLET : 0),
+    epoll_fd_(epoll_create1(EPOLL_CLOEXEC)), handler_count_(0),
+    events_(MAX_EVENTS_PER_CYCLE),
+    timer_fd_(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) {
+  if (epoll_fd_ < 0) {
+    Log_error("epoll_create1(): %s", strerror(errno));
+  }
+  struct epoll_event ev = {};
+  ev.events = EPOLLIN;
+  ev.data.u64 = TIMER_EVENT_KEY;
+  if (timer_fd_ < 0
+      || epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, timer_fd_, &ev) < 0) {
+    Log_error("Can't set up timers: %s", strerror(errno));
+  }
+}
+
+FDMultiplexer::~FDMultiplexer() {
+  for (const Registration &r : registrations_) {
+    delete r.on_read;
+    delete r.on_write;
+  }
+  for (const Timer &t : timers_) {
+    delete t.handler;
+  }
+  if (timer_fd_ >= 0) close(timer_fd_);
+  if (epoll_fd_ >= 0) close(epoll_fd_);
+}
+
 bool FDMultiplexer::RunOnReadable(int fd, const Handler &handler) {
-  return read_handlers_.insert({ fd, handler }).second;
+  return Register(fd, handler, false);
 }
 
 bool FDMultiplexer::RunOnWritable(int fd, const Handler &handler) {
-  return write_handlers_.insert({ fd, handler }).second;
+  return Register(fd, handler, true);
 }
 
 void FDMultiplexer::RunOnIdle(const Handler &handler) {
   idle_handlers_.push_back(handler);
 }
 
-void FDMultiplexer::CallHandlers(fd_set *to_call_fd_set, int *available_fds,
-                                 HandlerMap *handlers) {
-  for (auto it = handlers->begin(); *available_fds && it != handlers->end(); ) {
-    bool keep_handler = true;
-    if (FD_ISSET(it->first, to_call_fd_set)) {
-      --*available_fds;
-      keep_handler = it->second();
+void FDMultiplexer::RunEvery(unsigned period_ms, const Handler &handler) {
+  AddTimer(period_ms, period_ms > 0 ? period_ms : 1, handler);
+}
+
+void FDMultiplexer::RunAfter(unsigned delay_ms, const Handler &handler) {
+  AddTimer(delay_ms, 0, handler);
+}
+
+void FDMultiplexer::AddTimer(unsigned delay_ms, unsigned period_ms,
+                             const Handler &handler) {
+  Timer timer;
+  timer.due_ns = MonotonicNanos() + delay_ms * NANOS_PER_MILLI;
+  timer.period_ns = period_ms * NANOS_PER_MILLI;
+  timer.handler = new Handler(handler);
+  timers_.push_back(timer);
+  std::push_heap(timers_.begin(), timers_.end(), LaterTimer);
+  ArmTimer();
+}
+
+void FDMultiplexer::ArmTimer() {
+  struct itimerspec spec = {};  // All zero: disarm.
+  if (!timers_.empty()) {
+    const int64_t due = timers_.front().due_ns;
+    spec.it_value.tv_sec = due / 1000000000LL;
+    spec.it_value.tv_nsec = due % 1000000000LL;
+    if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0)
+      spec.it_value.tv_nsec = 1;  // Zero would disarm.
+  }
+  timerfd_settime(timer_fd_, TFD_TIMER_ABSTIME, &spec, NULL);
+}
+
+void FDMultiplexer::RunDueTimers() {
+  uint64_t expirations;
+  if (read(timer_fd_, &expirations, sizeof(expirations)) < 0) {
+    // Not due yet or already handled; we look at the clock anyway.
+  }
+  const int64_t now = MonotonicNanos();
+  while (!timers_.empty() && timers_.front().due_ns <= now) {
+    std::pop_heap(timers_.begin(), timers_.end(), LaterTimer);
+    Timer timer = timers_.back();
+    timers_.pop_back();
+    // The handler might add timers, so it is not in the heap while running.
+    const bool keep = (*timer.handler)();
+    if (keep && timer.period_ns > 0) {
+      // If we're late, skip the periods we missed instead of catching up.
+      const int64_t missed = (now - timer.due_ns) / timer.period_ns;
+      timer.due_ns += (missed + 1) * timer.period_ns;
+      timers_.push_back(timer);
+      std::push_heap(timers_.begin(), timers_.end(), LaterTimer);
+    } else {
+      delete timer.handler;
     }
-    it = keep_handler ? std::next(it) : handlers->erase(it);
   }
+  ArmTimer();
 }
 
-bool FDMultiplexer::SingleCycle(unsigned int timeout_ms) {
-  fd_set read_fds;
-  fd_set write_fds;
+bool FDMultiplexer::Register(int fd, const Handler &handler, bool writable) {
+  if (fd < 0) return false;
+  if (fd >= (int)registrations_.size()) registrations_.resize(fd + 1);
+  Registration &r = registrations_[fd];
+  Handler *&slot = writable ? r.on_write : r.on_read;
+  if (slot != NULL) return false;
+  slot = new Handler(handler);
+  ++handler_count_;
+  UpdateEvents(fd);
+  return true;
+}
 
-  struct timeval timeout;
-  timeout.tv_sec = timeout_ms / 1000;
-  timeout.tv_usec = (timeout_ms % 1000) * 1000;
+void FDMultiplexer::UpdateEvents(int fd) {
+  Registration &r = registrations_[fd];
+  const uint32_t wanted = ((r.on_read ? EPOLLIN : 0)
+                          | (r.on_write ? EPOLLOUT : 0));
+  if (wanted == 0) {
+    // If the handler already closed the fd, it is gone from epoll anyway.
+    if (r.in_epoll) epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, NULL);
+    if (r.always_ready) {
+      always_ready_.erase(std::find(always_ready_.begin(),
+                                    always_ready_.end(), fd));
+    }
+    r.in_epoll = r.always_ready = false;
+    ++r.generation;
+    return;
+  }
+  if (r.always_ready)
+    return;
+  struct epoll_event ev = {};
+  ev.events = wanted | edge_trigger_flag_;
+  ev.data.u64 = EventKey(fd, r.generation);
+  if (epoll_ctl(epoll_fd_, r.in_epoll ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+                fd, &ev) == 0) {
+    r.in_epoll = true;
+  } else if (errno == EPERM) {
+    // Regular files and such. They never block, so they are always ready,
+    // just like select() would report them.
+    r.always_ready = true;
+    always_ready_.push_back(fd);
+  } else {
+    Log_error("Can't watch fd %d: %s", fd, strerror(errno));
+  }
+}
 
-  int maxfd = -1;
-  FD_ZERO(&read_fds);
-  FD_ZERO(&write_fds);
+void FDMultiplexer::CallHandler(int fd, bool writable) {
+  Handler *handler = writable
+    ? registrations_[fd].on_write : registrations_[fd].on_read;
+  // The handler might register other file descriptors, which can move
+  // registrations_ around, but the Handler itself stays in place.
+  if ((*handler)())
+    return;
+  Registration &r = registrations_[fd];
+  (writable ? r.on_write : r.on_read) = NULL;
+  delete handler;
+  --handler_count_;
+  UpdateEvents(fd);
+}
 
-  // Readers
-  for (const auto &it : read_handlers_) {
-    maxfd = std::max(maxfd, it.first);
-    FD_SET(it.first, &read_fds);
+void FDMultiplexer::Dispatch(int fd, uint32_t generation, uint32_t events) {
+  // Errors and hangups are reported to the handlers as readiness; they'll
+  // see them in their next read() or write(). Same as select().
+  const uint32_t kReadable = EPOLLIN | EPOLLHUP | EPOLLERR;
+  const uint32_t kWritable = EPOLLOUT | EPOLLHUP | EPOLLERR;
+  if ((events & kReadable) && registrations_[fd].generation == generation
+      && registrations_[fd].on_read) {
+    CallHandler(fd, false);
   }
-
-  // Writers
-  for (const auto &it : write_handlers_) {
-    maxfd = std::max(maxfd, it.first);
-    FD_SET(it.first, &write_fds);
+  if ((events & kWritable) && registrations_[fd].generation == generation
+      && registrations_[fd].on_write) {
+    CallHandler(fd, true);
   }
+}
 
-  if (maxfd < 0) {
+bool FDMultiplexer::SingleCycle(unsigned int timeout_ms) {
+  if (handler_count_ == 0) {
     // file descriptors only can be registred from within handlers
     // or before running the Loop(). So if no filedesctiptors are left,
     // there is no chance for any to re-appear, so we can exit.
@@ -120,25 +267,56 @@ bool FDMultiplexer::SingleCycle(unsigned int timeout_ms) {
     return false;
   }
 
-  int fds_ready = select(maxfd + 1, &read_fds, &write_fds, nullptr, &timeout);
-  if (fds_ready < 0) {
-    if (!caught_signal)
-      perror("select() failed");
-    return false;
-  }
+  const int64_t deadline = MonotonicNanos() + timeout_ms * NANOS_PER_MILLI;
+  for (;;) {
+    // If we have file descriptors that are always ready, we only check
+    // what else is there.
+    int wait_ms = 0;
+    if (always_ready_.empty()) {
+      const int64_t remaining = deadline - MonotonicNanos();
+      if (remaining > 0)
+        wait_ms = (remaining + NANOS_PER_MILLI - 1) / NANOS_PER_MILLI;
+    }
+    const int events = epoll_wait(epoll_fd_, events_.data(), events_.size(),
+                                  wait_ms);
+    if (events < 0) {
+      if (!caught_signal)
+        perror("epoll_wait() failed");
+      return false;
+    }
 
-  if (fds_ready == 0) {             // No FDs ready: timeout situation.
-    for (auto it = idle_handlers_.begin(); it != idle_handlers_.end(); /**/) {
-      const bool keep_handler = (*it)();
-      it = keep_handler ? std::next(it) : idle_handlers_.erase(it);
+    bool any_fd_ready = false;
+    for (int i = 0; i < events; ++i) {
+      const uint64_t key = events_[i].data.u64;
+      if (key == TIMER_EVENT_KEY) {
+        RunDueTimers();
+        continue;
+      }
+      Dispatch((int)(uint32_t)key, key >> 32, events_[i].events);
+      any_fd_ready = true;
     }
-    return true;
-  }
 
-  CallHandlers(&read_fds, &fds_ready, &read_handlers_);
-  CallHandlers(&write_fds, &fds_ready, &write_handlers_);
+    if (!always_ready_.empty()) {
+      // Handlers can change the list while we're iterating.
+      always_ready_copy_ = always_ready_;
+      for (const int fd : always_ready_copy_) {
+        Dispatch(fd, registrations_[fd].generation, EPOLLIN | EPOLLOUT);
+      }
+      any_fd_ready = true;
+    }
 
-  return true;
+    if (any_fd_ready)
+      return true;
+
+    if (MonotonicNanos() >= deadline) {  // Timeout situation.
+      for (auto it = idle_handlers_.begin(); it != idle_handlers_.end(); /**/) {
+        const bool keep_handler = (*it)();
+        it = keep_handler ? std::next(it) : idle_handlers_.erase(it);
+      }
+      return true;
+    }
+    // Woken up by a timer only; continue to wait for the rest of the time.
+  }
 }
 
 int FDMultiplexer::Loop() {
@@ -20,16 +20,22 @@
 #ifndef FD_MUX_H_
 #define FD_MUX_H_
 
-#include <map>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+
 #include <functional>
 #include <list>
-
-#include <sys/select.h>
+#include <vector>
 
 // This needs a better name.
 class FDMultiplexer {
 public:
-  FDMultiplexer(unsigned idle_ms = 50) : idle_ms_(idle_ms) {}
+  // If "edge_triggered" is set, a file descriptor only becomes ready again
+  // once new data arrives, so handlers have to consume everything that is
+  // available (until EAGAIN) when called.
+  FDMultiplexer(unsigned idle_ms = 50, bool edge_triggered = false);
+  ~FDMultiplexer();
 
   // Handlers for events from this multiplexer.
   // Returns true if we want to continue to be called in the future or false
@@ -39,39 +45,88 @@ public:
   // These can only be set before Loop() is called or from a
   // running handler itself.
   // Returns false if that filedescriptor is already registered.
+  // File descriptors that can't be polled, such as regular files, are
+  // always ready.
   bool RunOnReadable(int fd, const Handler &handler);
   bool RunOnWritable(int fd, const Handler &handler);
 
   // Handler called regularly every idle_ms in case there's nothing to do.
   void RunOnIdle(const Handler &handler);
 
+  // Call "handler" every "period_ms" milliseconds until it returns false.
+  // Timers are independent of how busy the file descriptors are; they
+  // don't keep Loop() running once all file descriptors are gone.
+  void RunEvery(unsigned period_ms, const Handler &handler);
+
+  // Call "handler" once after "delay_ms" milliseconds. The return value
+  // of the handler is ignored.
+  void RunAfter(unsigned delay_ms, const Handler &handler);
+
   // Run the main loop. Blocks while there is still a filedescriptor
   // registered (return 0) or until a signal is triggered (return 1).
   int Loop();
 
 protected:
-  // Run a single cycle resulting in exactly one call of a handler function.
-  // This means that one of these happened:
-  //   (1) The next file descriptor became ready and its Handler is called
-  //   (2) We encountered a timeout and the idle-Handler has been called.
-  //   (3) Signal received or select() issue. Returns false in this case.
+  // Run a single cycle, waiting at most "timeout_ms" for file descriptors
+  // to become ready. Then one of these happened:
+  //   (1) The handlers of all file descriptors that are ready are called.
+  //   (2) We encountered a timeout and the idle-Handlers have been called.
+  //   (3) Signal received or epoll_wait() issue. Returns false in this case.
+  // Timers that become due while waiting are called in any case.
   //
   // This is broken out to make it simple to test steps in unit tests.
   bool SingleCycle(unsigned timeout_ms);
 
 private:
-  typedef std::map<int, Handler> HandlerMap;
+  // Everything registered for one file descriptor; indexed by fd.
+  struct Registration {
+    Registration() : on_read(NULL), on_write(NULL), generation(0),
+                     in_epoll(false), always_ready(false) {}
+    Handler *on_read;
+    Handler *on_write;
+    uint32_t generation;  // Incremented when the fd is unregistered.
+    bool in_epoll;
+    bool always_ready;    // Not pollable; see always_ready_.
+  };
+
+  bool Register(int fd, const Handler &handler, bool writable);
+
+  // Tell epoll about the handlers now registered for "fd".
+  void UpdateEvents(int fd);
+
+  // Call handlers of "fd" for "events" if the registration is still the
+  // "generation" the events were reported for.
+  void Dispatch(int fd, uint32_t generation, uint32_t events);
+
+  // Call the read or write handler of "fd"; remove it if it returns false.
+  void CallHandler(int fd, bool writable);
 
-  // Call all the handlers available in fd_set, removing the ones that
-  // return 'false'. "available_fds" is an optimizatin that tells CallHandlers
-  // how many fds there are in the first place.
-  void CallHandlers(fd_set *to_call_fd_set, int *available_fds,
-                    HandlerMap *handlers);
+  // A timer in the timers_ heap.
+  struct Timer {
+    int64_t due_ns;     // CLOCK_MONOTONIC
+    int64_t period_ns;  // 0 for one-shot timers.
+    Handler *handler;
+  };
+  // Orders the heap so that the earliest timer is on top.
+  static bool LaterTimer(const Timer &a, const Timer &b) {
+    return a.due_ns > b.due_ns;
+  }
+  void AddTimer(unsigned delay_ms, unsigned period_ms, const Handler &handler);
+  // Call the timers that are due and arm timer_fd_ for the next one.
+  void RunDueTimers();
+  void ArmTimer();
 
   const unsigned idle_ms_;
-  HandlerMap read_handlers_;
-  HandlerMap write_handlers_;
+  const uint32_t edge_trigger_flag_;
+  const int epoll_fd_;
+  int handler_count_;
+  std::vector<Registration> registrations_;
+  std::vector<int> always_ready_;
+  std::vector<int> always_ready_copy_;      // Iterated while dispatching.
+  std::vector<struct epoll_event> events_;  // Received in epoll_wait().
   std::list<Handler> idle_handlers_;
+  const int timer_fd_;         // Fires when the earliest timer is due.
+  std::vector<Timer> timers_;  // Heap ordered by LaterTimer().
 };
 
 #endif // FD_MUX_H_
@@ -0,0 +1,189 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "fd-mux.h"
+
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <gtest/gtest.h>
+
+// Gives access to single cycles.
+class TestMultiplexer : public FDMultiplexer {
+public:
+  using FDMultiplexer::SingleCycle;
+};
+
+class Pipe {
+public:
+  Pipe() { EXPECT_EQ(0, pipe(fd_)); }
+  ~Pipe() { CloseWriter(); CloseReader(); }
+
+  int reader() const { return fd_[0]; }
+  int writer() const { return fd_[1]; }
+  void Send() { EXPECT_EQ(1, write(fd_[1], "x", 1)); }
+  void Receive() { char c; EXPECT_EQ(1, read(fd_[0], &c, 1)); }
+  void CloseWriter() { if (fd_[1] >= 0) close(fd_[1]); fd_[1] = -1; }
+  void CloseReader() { if (fd_[0] >= 0) close(fd_[0]); fd_[0] = -1; }
+
+private:
+  int fd_[2];
+};
+
+TEST(FDMultiplexer, AllReadyHandlersCalledInOneCycle) {
+  TestMultiplexer mux;
+  Pipe a, b, c;
+  int calls[3] = {0, 0, 0};
+  Pipe *pipes[3] = {&a, &b, &c};
+  for (int i = 0; i < 3; ++i) {
+    mux.RunOnReadable(pipes[i]->reader(), [&, i]() {
+        pipes[i]->Receive();
+        calls[i]++;
+        return true;
+      });
+  }
+  EXPECT_FALSE(mux.RunOnReadable(a.reader(), []() { return true; }));
+
+  a.Send();
+  c.Send();
+  EXPECT_TRUE(mux.SingleCycle(0));
+  EXPECT_EQ(1, calls[0]);
+  EXPECT_EQ(0, calls[1]);
+  EXPECT_EQ(1, calls[2]);
+
+  EXPECT_TRUE(mux.SingleCycle(0));  // Nothing new.
+  EXPECT_EQ(2, calls[0] + calls[1] + calls[2]);
+}
+
+TEST(FDMultiplexer, IdleOnlyIfNothingReady) {
+  TestMultiplexer mux;
+  Pipe p;
+  int idle_calls = 0;
+  mux.RunOnIdle([&]() { idle_calls++; return true; });
+  mux.RunOnReadable(p.reader(), [&]() { p.Receive(); return true; });
+  EXPECT_TRUE(mux.SingleCycle(0));
+  EXPECT_EQ(1, idle_calls);
+  p.Send();
+  EXPECT_TRUE(mux.SingleCycle(0));
+  EXPECT_EQ(1, idle_calls);
+}
+
+TEST(FDMultiplexer, HandlerRemovedAndReRegistered) {
+  TestMultiplexer mux;
+  Pipe p;
+  int first_calls = 0, second_calls = 0;
+  const int fd = p.reader();
+  mux.RunOnReadable(fd, [&]() {
+      first_calls++;
+      // Register a new handler for the same fd while we're going away.
+      mux.RunOnWritable(p.writer(), [&]() {
+          mux.RunOnReadable(fd, [&]() {
+              second_calls++;
+              p.Receive();
+              return true;
+            });
+          return false;
+        });
+      return false;
+    });
+  p.Send();
+  EXPECT_TRUE(mux.SingleCycle(0));
+  EXPECT_EQ(1, first_calls);
+  EXPECT_EQ(0, second_calls);
+  EXPECT_TRUE(mux.SingleCycle(0));   // Writable handler re-registers reader.
+  EXPECT_TRUE(mux.SingleCycle(0));   // Still one byte in the pipe.
+  EXPECT_EQ(1, first_calls);
+  EXPECT_EQ(1, second_calls);
+}
+
+TEST(FDMultiplexer, HangupIsReadable) {
+  TestMultiplexer mux;
+  Pipe p;
+  bool saw_eof = false;
+  mux.RunOnReadable(p.reader(), [&]() {
+      char c;
+      saw_eof = (read(p.reader(), &c, 1) == 0);
+      return !saw_eof;
+    });
+  p.CloseWriter();
+  EXPECT_TRUE(mux.SingleCycle(0));
+  EXPECT_TRUE(saw_eof);
+  EXPECT_FALSE(mux.SingleCycle(0));  // No file descriptors left.
+}
+
+TEST(FDMultiplexer, RegularFilesAreAlwaysReady) {
+  TestMultiplexer mux;
+  FILE *tmp = tmpfile();
+  int calls = 0;
+  int idle_calls = 0;
+  mux.RunOnIdle([&]() { idle_calls++; return true; });
+  mux.RunOnReadable(fileno(tmp), [&]() { return ++calls < 3; });
+  EXPECT_TRUE(mux.SingleCycle(1000));
+  EXPECT_TRUE(mux.SingleCycle(1000));
+  EXPECT_TRUE(mux.SingleCycle(1000));
+  EXPECT_EQ(3, calls);
+  EXPECT_EQ(0, idle_calls);
+  EXPECT_FALSE(mux.SingleCycle(0));
+  fclose(tmp);
+}
+
+static int64_t NowMillis() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+TEST(FDMultiplexer, TimersRunWhileWaiting) {
+  TestMultiplexer mux;
+  Pipe p;
+  mux.RunOnReadable(p.reader(), [&]() { p.Receive(); return true; });
+  int every_calls = 0, after_calls = 0, idle_calls = 0;
+  mux.RunEvery(10, [&]() { return ++every_calls < 3; });
+  mux.RunAfter(5, [&]() { after_calls++; return true; });
+  mux.RunOnIdle([&]() { idle_calls++; return true; });
+
+  // A cycle with nothing to do waits the full time; the timers are called
+  // in between.
+  const int64_t start = NowMillis();
+  EXPECT_TRUE(mux.SingleCycle(100));
+  EXPECT_GE(NowMillis() - start, 100);
+  EXPECT_EQ(3, every_calls);  // Stopped after returning false.
+  EXPECT_EQ(1, after_calls);
+  EXPECT_EQ(1, idle_calls);
+}
+
+TEST(FDMultiplexer, TimersRunWhenBusy) {
+  TestMultiplexer mux;
+  FILE *tmp = tmpfile();  // Always ready; we never get to idle.
+  mux.RunOnReadable(fileno(tmp), []() { return true; });
+  int calls = 0;
+  mux.RunEvery(5, [&]() { calls++; return true; });
+  const int64_t start = NowMillis();
+  while (NowMillis() - start < 50) {
+    EXPECT_TRUE(mux.SingleCycle(1000));
+  }
+  EXPECT_GE(calls, 5);
+  EXPECT_LE(calls, 11);
+  fclose(tmp);
+}
+
+int main(int argc, char *argv[]) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
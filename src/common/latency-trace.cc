@@ -0,0 +1,144 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "latency-trace.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <atomic>
+
+#include "logging.h"
+
+static const char kLatencyTraceMagic[8] = { 'B', 'G', 'L', 'A', 'T', 'E',
+                                             'N', 'C' };
+
+// File layout: this header, followed by the events of each stage with
+// events[stage] entries each.
+struct LatencyTraceFileHeader {
+  char magic[8];
+  uint32_t stages;
+  uint32_t event_size;
+  uint32_t events[LATENCY_STAGE_COUNT];
+};
+
+namespace {
+struct StageRing {
+  std::atomic<uint32_t> write_count;
+  LatencyEvent events[LATENCY_TRACE_EVENTS];
+};
+}  // namespace
+
+// Zero initialized and only touched if trace points are compiled in.
+static StageRing stage_rings[LATENCY_STAGE_COUNT];
+static __thread int current_line = 0;
+
+const char *LatencyStageName(LatencyStage stage) {
+  switch (stage) {
+  case LATENCY_RECEIVE:   return "receive";
+  case LATENCY_PARSE:     return "parse";
+  case LATENCY_LOOKAHEAD: return "lookahead";
+  case LATENCY_SEGMENT:   return "segment";
+  case LATENCY_PRU_WAIT:  return "pru-wait";
+  case LATENCY_STAGE_COUNT: break;
+  }
+  return "?";
+}
+
+uint64_t LatencyTraceNow() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void LatencyTraceRecord(LatencyStage stage, uint64_t start_ns,
+                        int gcode_line) {
+  const uint64_t duration = LatencyTraceNow() - start_ns;
+  StageRing *ring = &stage_rings[stage];
+  // Stages can be hit from different threads; each gets its own slot.
+  const uint32_t pos = ring->write_count.fetch_add(1,
+                                                   std::memory_order_relaxed);
+  LatencyEvent *event = &ring->events[pos % LATENCY_TRACE_EVENTS];
+  event->start_ns = start_ns;
+  event->duration_ns = duration > UINT32_MAX ? UINT32_MAX : duration;
+  event->gcode_line = gcode_line;
+}
+
+int LatencyTraceLine() { return current_line; }
+void LatencyTraceSetLine(int gcode_line) { current_line = gcode_line; }
+
+bool LatencyTraceWrite(FILE *out) {
+  LatencyTraceFileHeader header;
+  memcpy(header.magic, kLatencyTraceMagic, sizeof(header.magic));
+  header.stages = LATENCY_STAGE_COUNT;
+  header.event_size = sizeof(LatencyEvent);
+  uint32_t first[LATENCY_STAGE_COUNT];
+  for (int s = 0; s < LATENCY_STAGE_COUNT; ++s) {
+    const uint32_t count = stage_rings[s].write_count.load();
+    header.events[s] = count < LATENCY_TRACE_EVENTS
+      ? count : LATENCY_TRACE_EVENTS;
+    first[s] = count - header.events[s];
+  }
+  bool success = fwrite(&header, sizeof(header), 1, out) == 1;
+  for (int s = 0; s < LATENCY_STAGE_COUNT && success; ++s) {
+    for (uint32_t i = 0; i < header.events[s] && success; ++i) {
+      const LatencyEvent &event
+        = stage_rings[s].events[(first[s] + i) % LATENCY_TRACE_EVENTS];
+      success = fwrite(&event, sizeof(event), 1, out) == 1;
+    }
+  }
+  if (fflush(out) != 0) success = false;
+  if (!success)
+    Log_error("Writing latency trace failed: %s", strerror(errno));
+  return success;
+}
+
+bool ReadLatencyTrace(
+  const char *filename,
+  const std::function<void(LatencyStage, const LatencyEvent&)> &callback) {
+  FILE *in = fopen(filename, "rb");
+  if (in == NULL) {
+    Log_error("Can't open latency trace %s: %s", filename, strerror(errno));
+    return false;
+  }
+  LatencyTraceFileHeader header;
+  if (fread(&header, sizeof(header), 1, in) != 1
+      || memcmp(header.magic, kLatencyTraceMagic, sizeof(header.magic)) != 0
+      || header.stages != LATENCY_STAGE_COUNT
+      || header.event_size != sizeof(LatencyEvent)) {
+    Log_error("%s: not a latency trace of this version.", filename);
+    fclose(in);
+    return false;
+  }
+  bool success = true;
+  for (int s = 0; s < LATENCY_STAGE_COUNT && success; ++s) {
+    for (uint32_t i = 0; i < header.events[s]; ++i) {
+      LatencyEvent event;
+      if (fread(&event, sizeof(event), 1, in) != 1) {
+        Log_error("%s: truncated latency trace.", filename);
+        success = false;
+        break;
+      }
+      callback((LatencyStage) s, event);
+    }
+  }
+  fclose(in);
+  return success;
+}
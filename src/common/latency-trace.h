@@ -0,0 +1,91 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _BEAGLEG_LATENCY_TRACE_H_
+#define _BEAGLEG_LATENCY_TRACE_H_
+
+// Latency trace points along the path of a line from the socket to the
+// PRU. Each stage keeps a ring of the most recent events, with start time,
+// duration and the G-code line the work belongs to. They are written to a
+// file with LatencyTraceWrite(), to be looked at with latency-trace-dump.
+//
+// The trace points cost a clock_gettime() each, so they are only compiled
+// in with -DBEAGLEG_LATENCY_TRACE (e.g. CONFIG_FLAGS=-DBEAGLEG_LATENCY_TRACE).
+//
+// The line is passed along the pipeline in a thread-local variable: the
+// parser sets it, the planner remembers it with each move in its look-ahead
+// buffer and sets it again when the move is sent to the motors. Moves
+// merged by the planner are attributed to the line of the last one, and
+// segments the motor operations had to put into their backlog to the line
+// being parsed when they leave it.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <functional>
+
+enum LatencyStage {
+  LATENCY_RECEIVE,     // GCodeStreamer reading data from the connection.
+  LATENCY_PARSE,       // Parsing and executing a line.
+  LATENCY_LOOKAHEAD,   // A move waiting in the planner look-ahead buffer.
+  LATENCY_SEGMENT,     // Motor operations creating the motion segments.
+  LATENCY_PRU_WAIT,    // Waiting for a free slot in the PRU queue.
+  LATENCY_STAGE_COUNT
+};
+
+enum {
+  LATENCY_TRACE_EVENTS = 16384   // Per stage; needs to be a power of two.
+};
+
+struct LatencyEvent {
+  uint64_t start_ns;     // CLOCK_MONOTONIC
+  uint32_t duration_ns;
+  int32_t gcode_line;
+};
+
+const char *LatencyStageName(LatencyStage stage);
+
+uint64_t LatencyTraceNow();
+
+// Record an event for "stage" that started at "start_ns" and ends now.
+void LatencyTraceRecord(LatencyStage stage, uint64_t start_ns, int gcode_line);
+
+// The G-code line the current thread is working on.
+int LatencyTraceLine();
+void LatencyTraceSetLine(int gcode_line);
+
+// Write all recorded events to "out". Does not close it.
+bool LatencyTraceWrite(FILE *out);
+
+// Read a file written by LatencyTraceWrite() and call "callback" for each
+// event, stage by stage, oldest first. Returns false if it can't be read.
+bool ReadLatencyTrace(
+  const char *filename,
+  const std::function<void(LatencyStage, const LatencyEvent&)> &callback);
+
+#ifdef BEAGLEG_LATENCY_TRACE
+#  define LATENCY_TRACE_START(var) const uint64_t var = LatencyTraceNow()
+#  define LATENCY_TRACE_END(stage, var) \
+  LatencyTraceRecord(stage, var, LatencyTraceLine())
+#  define LATENCY_TRACE_SET_LINE(line) LatencyTraceSetLine(line)
+#else
+#  define LATENCY_TRACE_START(var) do {} while (0)
+#  define LATENCY_TRACE_END(stage, var) do {} while (0)
+#  define LATENCY_TRACE_SET_LINE(line) do {} while (0)
+#endif
+
+#endif  // _BEAGLEG_LATENCY_TRACE_H_
@@ -0,0 +1,93 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "latency-trace.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <thread>
+#include <vector>
+#include <gtest/gtest.h>
+
+// Events of all stages; all tests share the global rings, so they only
+// look at the stages they use.
+static std::vector<LatencyEvent> WriteAndRead(LatencyStage stage) {
+  char name[] = "/tmp/latency-trace-test.XXXXXX";
+  FILE *out = fdopen(mkstemp(name), "wb");
+  EXPECT_TRUE(LatencyTraceWrite(out));
+  fclose(out);
+  std::vector<LatencyEvent> result;
+  EXPECT_TRUE(ReadLatencyTrace(name, [&](LatencyStage s,
+                                         const LatencyEvent &e) {
+        if (s == stage) result.push_back(e);
+      }));
+  unlink(name);
+  return result;
+}
+
+TEST(LatencyTrace, EventsAreWrittenAndRead) {
+  const uint64_t start = LatencyTraceNow();
+  usleep(1000);
+  LatencyTraceRecord(LATENCY_PARSE, start, 17);
+  LatencyTraceRecord(LATENCY_PARSE, LatencyTraceNow(), 18);
+  std::vector<LatencyEvent> events = WriteAndRead(LATENCY_PARSE);
+  ASSERT_EQ(2u, events.size());
+  EXPECT_EQ(start, events[0].start_ns);
+  EXPECT_GE(events[0].duration_ns, 1000000u);
+  EXPECT_EQ(17, events[0].gcode_line);
+  EXPECT_EQ(18, events[1].gcode_line);
+  EXPECT_GE(events[1].start_ns, events[0].start_ns);
+}
+
+TEST(LatencyTrace, RingKeepsMostRecentEvents) {
+  for (int i = 0; i < LATENCY_TRACE_EVENTS + 100; ++i) {
+    LatencyTraceRecord(LATENCY_SEGMENT, LatencyTraceNow(), i);
+  }
+  std::vector<LatencyEvent> events = WriteAndRead(LATENCY_SEGMENT);
+  ASSERT_EQ((size_t)LATENCY_TRACE_EVENTS, events.size());
+  EXPECT_EQ(100, events.front().gcode_line);
+  EXPECT_EQ(LATENCY_TRACE_EVENTS + 99, events.back().gcode_line);
+}
+
+TEST(LatencyTrace, LineIsPerThread) {
+  LatencyTraceSetLine(42);
+  int other_line = -1;
+  std::thread other([&other_line]() {
+      other_line = LatencyTraceLine();
+      LatencyTraceSetLine(7);
+    });
+  other.join();
+  EXPECT_EQ(0, other_line);
+  EXPECT_EQ(42, LatencyTraceLine());
+}
+
+TEST(LatencyTrace, RejectsOtherFiles) {
+  char name[] = "/tmp/latency-trace-test.XXXXXX";
+  const int fd = mkstemp(name);
+  EXPECT_EQ(5, write(fd, "hello", 5));
+  close(fd);
+  EXPECT_FALSE(ReadLatencyTrace(name, [](LatencyStage,
+                                         const LatencyEvent&) {}));
+  unlink(name);
+}
+
+int main(int argc, char *argv[]) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
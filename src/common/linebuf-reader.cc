@@ -17,24 +17,110 @@
  * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include "linebuf-reader.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "logging.h"
 #include "string-util.h"
 
+static size_t RoundToPages(size_t size) {
+  const size_t page = sysconf(_SC_PAGESIZE);
+  return (size + page - 1) / page * page;
+}
+
+// A file that can be mapped shared, but is not visible in the file system.
+static int CreateAnonymousFile(size_t size) {
+  int fd = -1;
+#ifdef MFD_CLOEXEC
+  fd = memfd_create("linebuf-reader", MFD_CLOEXEC);
+#endif
+  if (fd < 0) {
+    char tmpl[] = "/dev/shm/linebuf-reader.XXXXXX";
+    fd = mkstemp(tmpl);
+    if (fd >= 0) unlink(tmpl);
+  }
+  if (fd >= 0 && ftruncate(fd, size) != 0) {
+    close(fd);
+    fd = -1;
+  }
+  return fd;
+}
+
+// Map "size" bytes twice in a row, so that reading or writing past the
+// end of the first mapping continues at its beginning. Returns NULL if
+// that is not possible.
+static char *MapMirroredRing(size_t size) {
+  const int fd = CreateAnonymousFile(size);
+  if (fd < 0) return NULL;
+  // Reserve the address range for both, then place the mappings in there.
+  char *base = (char*) mmap(NULL, 2 * size, PROT_NONE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  bool success = (base != MAP_FAILED);
+  for (int i = 0; success && i < 2; ++i) {
+    success = mmap(base + i * size, size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_FIXED, fd, 0) != MAP_FAILED;
+  }
+  close(fd);  // The mappings keep the memory.
+  if (!success) {
+    if (base != MAP_FAILED) munmap(base, 2 * size);
+    return NULL;
+  }
+  return base;
+}
+
+size_t LinebufReader::CapacityFor(size_t buffer_size) {
+  // One extra byte for the newline appended in IncompleteLine().
+  return RoundToPages(buffer_size + 1) - 1;
+}
+
 LinebufReader::LinebufReader(size_t buf_size)
-  : len_(buf_size),
-    buffer_start_(new char [len_]), buffer_end_(buffer_start_ + len_),
-    content_start_(buffer_start_), content_end_(buffer_start_),
-    cr_seen_(false) {
+  : len_(CapacityFor(buf_size) + 1), mirrored_(true),
+    buffer_start_(MapMirroredRing(len_)),
+    cr_seen_(false), skip_overlong_(false), overlong_lines_(0) {
+  if (buffer_start_ == NULL) {
+    Log_info("Can't map line buffer as ring (%s); using plain buffer.",
+             strerror(errno));
+    mirrored_ = false;
+    buffer_start_ = new char [len_];
+  }
+  content_start_ = content_end_ = buffer_start_;
+}
+
+LinebufReader::~LinebufReader() {
+  if (mirrored_) {
+    munmap(buffer_start_, 2 * len_);
+  } else {
+    delete [] buffer_start_;
+  }
 }
-LinebufReader::~LinebufReader() { delete [] buffer_start_; }
 
 int LinebufReader::Update(ReadFun read_fun) {
-  if (content_start_ - buffer_start_ > (int)(len_ / 2)) {
-    const size_t copy_len = size();
-    memmove(buffer_start_, content_start_, copy_len);
+  const size_t content_len = size();
+  if (mirrored_) {
+    // Going past the end continues at the beginning in the mirrored mapping,
+    // so we only need to keep our pointers in the first copy.
+    if (content_start_ >= buffer_start_ + len_) {
+      content_start_ -= len_;
+      content_end_ -= len_;
+    }
+  } else if (content_start_ - buffer_start_ > (int)(len_ / 2)
+             || content_end_ - buffer_start_ == (int)capacity()) {
+    // Compact if we are past the middle or there is no space left at the end.
+    memmove(buffer_start_, content_start_, content_len);
     content_start_ = buffer_start_;
-    content_end_ = buffer_start_ + copy_len;
+    content_end_ = buffer_start_ + content_len;
+  }
+  if (content_len == capacity()) {
+    // Full without a complete line: we can't store it.
+    content_start_ = content_end_;
+    skip_overlong_ = true;
   }
-  ssize_t r = read_fun(content_end_, buffer_end_ - content_end_);
+  const char *const free_end = mirrored_
+    ? content_start_ + capacity() : buffer_start_ + capacity();
+  ssize_t r = read_fun(content_end_, free_end - content_end_);
   // TODO(hzeller): if we get zero, we should consider this as end-of-stream
   // and potentially regard the buffer as 'complete' even if it doesn't have a
   // full line yet.
@@ -43,25 +129,52 @@ int LinebufReader::Update(ReadFun read_fun) {
 }
 
 const char* LinebufReader::IncompleteLine() {
+  if (skip_overlong_) {
+    // Rest of an overlong line.
+    Flush();
+    ++overlong_lines_;
+    return "";
+  }
   *content_end_ = '\n';
   content_end_++;
   return ReadLine();
 }
 
+const char *LinebufReader::RawData() {
+  if (cr_seen_ && content_start_ < content_end_) {
+    cr_seen_ = false;
+    if (*content_start_ == '\n') ++content_start_;
+  }
+  return content_start_;
+}
+
 const char* LinebufReader::ReadLine() {
   for (char *i = content_start_; i < content_end_; ++i) {
-    if (cr_seen_ && *i == '\n') {
+    // A \r directly followed by \n is one line end.
+    if (cr_seen_) {
       cr_seen_ = false;
-      content_start_ = i + 1;
-      continue;
+      if (*i == '\n') {
+        content_start_ = i + 1;
+        continue;
+      }
     }
     if (*i == '\r' || *i == '\n') {
       cr_seen_ = (*i == '\r') ? true : false;
       *i = '\0';
       const char *line = content_start_;
       content_start_ = i + 1;
+      if (skip_overlong_) {
+        skip_overlong_ = false;
+        ++overlong_lines_;
+        return "";
+      }
       return line;
     }
   }
+  if (size() == capacity()) {
+    // We'll never see the end of this line in the buffer.
+    content_start_ = content_end_;
+    skip_overlong_ = true;
+  }
   return NULL;
 }
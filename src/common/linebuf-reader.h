@@ -26,6 +26,11 @@
 // A reader to be used in conjunction with file descriptor event management
 // such as select() or poll(). Whenever a file descriptor is readable, it can
 // be used to udpate this LinebufReader.
+//
+// The buffer is a ring that is mapped twice in a row in memory, so the
+// content as well as the free space are always one contiguous range: lines
+// are returned in place and the data is never moved. (If that mapping can't
+// be set up, we fall back to a plain buffer that is compacted when needed.)
 class LinebufReader {
 public:
   // A function to read from some data source. Similar to read(2), it gets
@@ -35,13 +40,13 @@ public:
   // and a negative number to indicate error.
   typedef std::function<ssize_t(char *buf, size_t size)> ReadFun;
 
-  // The "buffer_size" determines the longest line we expect at maximum.
-  // TODO(hzeller): right now, we don't gracefully deal with overlong lines.
+  // The "buffer_size" determines the longest line we expect at maximum; it
+  // is rounded up to a multiple of the page size.
   LinebufReader(size_t buffer_size = 16384);
   ~LinebufReader();
 
-  // Update content. It will be calling the ReadFun exactly once and updates
-  // its internal buffer.
+  // Update content. It will be calling the ReadFun exactly once with all the
+  // free space in the buffer and updates its internal buffer.
   // After this, you may call ReadLine() to extract as many lines as had
   // been waiting.
   // If you made sure that there is data available before calling Update(),
@@ -61,28 +66,50 @@ public:
   // If there is no current line pending, or it is incomplete, returns NULL.
   // It is a good idea to call this after a call to Update() in a loop until
   // you reach NULL to empty the buffer before the next Update() comes in.
+  //
+  // Lines longer than capacity() can't be stored. They are skipped up to
+  // their newline and returned as an empty line; overlong_lines() counts them.
   const char* ReadLine();
 
   // TODO(hzeller): maybe a function to get the remaining buffer when we
   // are closing the connection ? There might be some incomplete line in there.
   const char* IncompleteLine();
 
+  // The raw bytes following the last line returned by ReadLine(), for
+  // streams that continue in a binary format after some text; there are
+  // size() of them. A '\n' completing a "\r\n" line end is skipped.
+  // Consume() removes the first "n" bytes after they have been handled.
+  const char *RawData();
+  void Consume(size_t n) { content_start_ += n; }
+
   void Flush() {
     content_start_ = buffer_start_;
     content_end_ = buffer_start_;
+    skip_overlong_ = false;
   }
 
   // Currently stored in buffer.
   size_t size() const { return content_end_ - content_start_; }
 
+  // Maximum that can be stored. Lines need to be shorter than this.
+  size_t capacity() const { return len_ - 1; }
+
+  // The capacity() of a reader constructed with "buffer_size".
+  static size_t CapacityFor(size_t buffer_size);
+
+  // Number of overlong lines skipped so far.
+  int overlong_lines() const { return overlong_lines_; }
+
 private:
-  const size_t len_;
-  char *const buffer_start_;
-  const char *const buffer_end_;
+  const size_t len_;     // Size of the ring.
+  bool mirrored_;        // Ring is mapped a second time right after it.
+  char *buffer_start_;
   char *content_start_;
   char *content_end_;
 
   bool cr_seen_;
+  bool skip_overlong_;   // Dropping input up to the next newline.
+  int overlong_lines_;
 };
 
 #endif  // _BEAGLEG_LINEBUF_READER_H
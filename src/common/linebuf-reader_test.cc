@@ -19,7 +19,9 @@
 
 #include "linebuf-reader.h"
 
+#include <algorithm>
 #include <string>
+#include <vector>
 #include <memory>
 #include <gtest/gtest.h>
 
@@ -139,9 +141,91 @@ INSTANTIATE_TEST_CASE_P(PortableEndLineTests,
                         LinebufReaderTest,
                         ::testing::Values("\n", "\r", "\r\n"));
 
+TEST(LinebufReaderTest, CarriageReturnFollowedByLine) {
+  LinebufReader reader;
+  const char input[] = "a\rb\n";
+  reader.Update([&input](char *buf, size_t size) {
+      memcpy(buf, input, strlen(input));
+      return (ssize_t) strlen(input);
+    });
+  EXPECT_EQ(std::string("a"), reader.ReadLine());
+  EXPECT_EQ(std::string("b"), reader.ReadLine());
+  EXPECT_EQ(NULL, reader.ReadLine());
+}
+
+TEST(LinebufReaderTest, RawDataAfterLine) {
+  LinebufReader reader;
+  const char input[] = "header\r\n\x01\x02";
+  reader.Update([&input](char *buf, size_t size) {
+      memcpy(buf, input, sizeof(input) - 1);
+      return (ssize_t) sizeof(input) - 1;
+    });
+  EXPECT_EQ(std::string("header"), reader.ReadLine());
+  const char *raw = reader.RawData();  // Skips the \n of the line end.
+  ASSERT_EQ(2u, reader.size());
+  EXPECT_EQ(0x01, raw[0]);
+  reader.Consume(1);
+  EXPECT_EQ(0x02, reader.RawData()[0]);
+  EXPECT_EQ(1u, reader.size());
+}
+
+// Reads everything from "input" in chunks of "chunk" bytes, collecting
+// all lines.
+static std::vector<std::string> ReadAllLines(LinebufReader *reader,
+                                             const std::string &input,
+                                             size_t chunk) {
+  std::vector<std::string> result;
+  size_t pos = 0;
+  while (pos < input.size()) {
+    reader->Update([&](char *buf, size_t size) {
+        const size_t len = std::min(chunk, std::min(size, input.size() - pos));
+        memcpy(buf, input.data() + pos, len);
+        pos += len;
+        return (ssize_t) len;
+      });
+    const char *line;
+    while ((line = reader->ReadLine())) result.push_back(line);
+  }
+  return result;
+}
+
+TEST(LinebufReaderTest, LinesAcrossRingBoundary) {
+  LinebufReader reader(4096);
+  // Line lengths that don't divide the buffer size, so that lines wrap
+  // around the end of the ring many times.
+  std::string input;
+  std::vector<std::string> expected;
+  for (int i = 0; i < 5000; ++i) {
+    expected.push_back(std::string(i % 97, 'a' + i % 26));
+    input += expected.back() + "\n";
+  }
+  EXPECT_EQ(expected, ReadAllLines(&reader, input, 1000));
+  EXPECT_EQ(0, reader.overlong_lines());
+}
+
+TEST(LinebufReaderTest, BurstIsReadInOneUpdate) {
+  LinebufReader reader(65536);
+  // After consuming some, all the free space is available in one read.
+  const std::string first(1000, 'x');
+  ReadAllLines(&reader, first + "\n" + "partial", 100000);
+  size_t offered = 0;
+  reader.Update([&](char *buf, size_t size) {
+      offered = size;
+      return (ssize_t) 0;
+    });
+  EXPECT_EQ(reader.capacity() - strlen("partial"), offered);
+}
+
+TEST(LinebufReaderTest, OverlongLinesAreSkipped) {
+  LinebufReader reader(4096);
+  const std::string input = "before\n" + std::string(10000, 'x') + "\r\n"
+    + "after\n";
+  const std::vector<std::string> expected = { "before", "", "after" };
+  EXPECT_EQ(expected, ReadAllLines(&reader, input, 3000));
+  EXPECT_EQ(1, reader.overlong_lines());
+}
+
 // TODO(hzeller): more testing
-//   - Implementation of a more graceful handling if our buffer is too small
-//     to hold a full line.
 int main(int argc, char *argv[]) {
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
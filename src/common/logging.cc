@@ -19,7 +19,9 @@
 #include "logging.h"
 
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -31,6 +33,17 @@
 #include <time.h>
 #include <unistd.h>
 
+#include <atomic>
+
+// Number of records in the asynchronous ring; needs to be a power of two.
+#define LOG_RING_SIZE 512
+// Longer messages are truncated in asynchronous mode.
+#define LOG_MAX_MESSAGE_LEN 244
+// How often the background thread looks for new messages.
+#define LOG_DRAIN_INTERVAL_MS 10
+
+LogLevel log_min_level_ = LOG_LEVEL_DEBUG;
+
 static int log_fd = 2;  // Allow logging before Log_init().
 
 static const char *const kInfoHighlight  = "\033[1mINFO  ";
@@ -64,59 +77,209 @@ void Log_init(const char *filename) {
   }
 }
 
-static void Log_internal(int fd, const char *markup_start,
-                         const char *format, va_list ap) {
-  struct timeval now;
-  gettimeofday(&now, NULL);
+void Log_set_level(LogLevel level) { log_min_level_ = level; }
+
+// Write a formatted message to the log sink.
+static void WriteMessage(LogLevel level, const struct timeval &time,
+                         const char *msg, size_t len) {
+  if (log_fd < 0) {
+    if (level == LOG_LEVEL_DEBUG) return;  // Not for syslog.
+    syslog(level == LOG_LEVEL_ERROR ? LOG_ERR : LOG_INFO, "%.*s",
+           (int)len, msg);
+    return;
+  }
+  const char *markup_start = (level == LOG_LEVEL_ERROR ? error_markup_start_
+                              : level == LOG_LEVEL_INFO ? info_markup_start_
+                              : debug_markup_start_);
   struct tm time_breakdown;
-  localtime_r(&now.tv_sec, &time_breakdown);
+  localtime_r(&time.tv_sec, &time_breakdown);
   char fmt_buf[128];
   strftime(fmt_buf, sizeof(fmt_buf), "%F %T", &time_breakdown);
+  char prefix[256];
   struct iovec parts[3];
-  parts[0].iov_len = asprintf((char**) &parts[0].iov_base,
-                              "%s[%s.%06ld]%s ",
-                              markup_start, fmt_buf, now.tv_usec,
+  parts[0].iov_base = prefix;
+  parts[0].iov_len = snprintf(prefix, sizeof(prefix), "%s[%s.%06ld]%s ",
+                              markup_start, fmt_buf, (long)time.tv_usec,
                               markup_end_);
-  parts[1].iov_len = vasprintf((char**) &parts[1].iov_base, format, ap);
+  parts[1].iov_base = (void*) msg;
+  parts[1].iov_len = len;
   parts[2].iov_base = (void*) "\n";
   parts[2].iov_len = 1;
-  int already_newline
-    = (parts[1].iov_len > 0 &&
-       ((const char*)parts[1].iov_base)[parts[1].iov_len-1] == '\n');
-  if (writev(fd, parts, already_newline ? 2 : 3) < 0) {
+  const bool already_newline = (len > 0 && msg[len-1] == '\n');
+  if (writev(log_fd, parts, already_newline ? 2 : 3) < 0) {
     // Logging trouble. Ignore.
   }
+}
+
+// -- Asynchronous logging.
+// The ring is a bounded multi-producer queue (D. Vyukov's design): each
+// record has a sequence number telling if it is free for the producer
+// at a particular position or ready for the consumer. Producers claim a
+// position with a compare-and-swap; the single background thread is the
+// only consumer.
+namespace {
+struct LogRecord {
+  std::atomic<uint32_t> sequence;
+  LogLevel level;
+  struct timeval time;
+  uint16_t len;
+  char message[LOG_MAX_MESSAGE_LEN];
+};
+
+struct AsyncLog {
+  LogRecord ring[LOG_RING_SIZE];
+  std::atomic<uint32_t> enqueue_pos;
+  uint32_t dequeue_pos;            // Only touched by the background thread.
+  std::atomic<uint32_t> dropped;
+  std::atomic<bool> running;
+  pthread_t thread;
+};
+}  // namespace
 
-  free(parts[0].iov_base);
-  free(parts[1].iov_base);
+static AsyncLog *async_log = NULL;
+static std::atomic<bool> async_active(false);
+
+static bool EnqueueRecord(LogLevel level, const char *format, va_list ap) {
+  AsyncLog *const q = async_log;
+  uint32_t pos = q->enqueue_pos.load(std::memory_order_relaxed);
+  LogRecord *record;
+  for (;;) {
+    record = &q->ring[pos % LOG_RING_SIZE];
+    const uint32_t seq = record->sequence.load(std::memory_order_acquire);
+    const int32_t diff = (int32_t)(seq - pos);
+    if (diff == 0) {
+      if (q->enqueue_pos.compare_exchange_weak(pos, pos + 1,
+                                               std::memory_order_relaxed))
+        break;
+    } else if (diff < 0) {
+      q->dropped.fetch_add(1, std::memory_order_relaxed);
+      return false;  // Full.
+    } else {
+      pos = q->enqueue_pos.load(std::memory_order_relaxed);
+    }
+  }
+  record->level = level;
+  gettimeofday(&record->time, NULL);
+  const int len = vsnprintf(record->message, sizeof(record->message),
+                            format, ap);
+  record->len = (len < 0) ? 0 : ((size_t)len >= sizeof(record->message)
+                                 ? sizeof(record->message) - 1 : len);
+  record->sequence.store(pos + 1, std::memory_order_release);
+  return true;
+}
+
+// Write all records that are ready. Returns number of records written.
+static int DrainRecords(AsyncLog *q) {
+  int count = 0;
+  for (;;) {
+    LogRecord *record = &q->ring[q->dequeue_pos % LOG_RING_SIZE];
+    const uint32_t seq = record->sequence.load(std::memory_order_acquire);
+    if (seq != q->dequeue_pos + 1)
+      break;
+    WriteMessage(record->level, record->time, record->message, record->len);
+    record->sequence.store(q->dequeue_pos + LOG_RING_SIZE,
+                           std::memory_order_release);
+    q->dequeue_pos++;
+    count++;
+  }
+  const uint32_t dropped = q->dropped.exchange(0);
+  if (dropped > 0) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    char msg[64];
+    const int len = snprintf(msg, sizeof(msg),
+                             "Log overflow: dropped %u messages", dropped);
+    WriteMessage(LOG_LEVEL_ERROR, now, msg, len);
+  }
+  return count;
+}
+
+static void *LogThread(void *arg) {
+  AsyncLog *q = (AsyncLog*) arg;
+  const struct timespec wait = { 0, LOG_DRAIN_INTERVAL_MS * 1000000 };
+  while (q->running.load()) {
+    if (DrainRecords(q) == 0)
+      nanosleep(&wait, NULL);
+  }
+  DrainRecords(q);  // Remaining.
+  return NULL;
 }
 
+bool Log_start_async() {
+  if (async_log != NULL) return true;
+  AsyncLog *q = new AsyncLog();
+  for (uint32_t i = 0; i < LOG_RING_SIZE; ++i) {
+    q->ring[i].sequence.store(i);
+  }
+  q->enqueue_pos.store(0);
+  q->dequeue_pos = 0;
+  q->dropped.store(0);
+  q->running.store(true);
+  if (pthread_create(&q->thread, NULL, &LogThread, q) != 0) {
+    delete q;
+    Log_error("Can't start logging thread; logging synchronously.");
+    return false;
+  }
+  async_log = q;
+  async_active.store(true);
+  static bool atexit_registered = false;
+  if (!atexit_registered) {
+    atexit(&Log_stop_async);
+    atexit_registered = true;
+  }
+  return true;
+}
+
+void Log_stop_async() {
+  if (async_log == NULL) return;
+  // New messages go directly to the sink; the thread writes what's left.
+  async_active.store(false);
+  async_log->running.store(false);
+  pthread_join(async_log->thread, NULL);
+  delete async_log;
+  async_log = NULL;
+}
+
+static void Log_internal(LogLevel level, const char *format, va_list ap) {
+  if (async_active.load(std::memory_order_relaxed)) {
+    EnqueueRecord(level, format, ap);
+    return;
+  }
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  if (log_fd < 0) {
+    if (level == LOG_LEVEL_DEBUG) return;
+    vsyslog(level == LOG_LEVEL_ERROR ? LOG_ERR : LOG_INFO, format, ap);
+    return;
+  }
+  char *msg;
+  const int len = vasprintf(&msg, format, ap);
+  if (len < 0) return;
+  WriteMessage(level, now, msg, len);
+  free(msg);
+}
+
+#ifndef BEAGLEG_NO_DEBUG_LOG
 void Log_debug(const char *format, ...) {
-  if (log_fd < 0) return;
+  if (log_fd < 0 || !Log_enabled(LOG_LEVEL_DEBUG)) return;
   va_list ap;
   va_start(ap, format);
-  Log_internal(log_fd, debug_markup_start_, format, ap);
+  Log_internal(LOG_LEVEL_DEBUG, format, ap);
   va_end(ap);
 }
+#endif
 
 void Log_info(const char *format, ...) {
+  if (!Log_enabled(LOG_LEVEL_INFO)) return;
   va_list ap;
   va_start(ap, format);
-  if (log_fd < 0) {
-    vsyslog(LOG_INFO, format, ap);
-  } else {
-    Log_internal(log_fd, info_markup_start_, format, ap);
-  }
+  Log_internal(LOG_LEVEL_INFO, format, ap);
   va_end(ap);
 }
 
 void Log_error(const char *format, ...) {
   va_list ap;
   va_start(ap, format);
-  if (log_fd < 0) {
-    vsyslog(LOG_ERR, format, ap);
-  } else {
-    Log_internal(log_fd, error_markup_start_, format, ap);
-  }
+  Log_internal(LOG_LEVEL_ERROR, format, ap);
   va_end(ap);
 }
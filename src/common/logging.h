@@ -26,11 +26,40 @@
 // If filename is NULL, info and errors are logged to syslog.
 void Log_init(const char *filename);
 
+// Switch to asynchronous logging: the Log_*() functions only format the
+// message into a lock-free ring and return; a background thread writes
+// them to the file or syslog. So a slow log sink can't delay the caller.
+// If the ring is full, messages are dropped and the number of dropped
+// messages is reported later.
+// Threads don't survive fork(), so call this after becoming a daemon.
+// Pending messages are written at exit or with Log_stop_async().
+bool Log_start_async();
+void Log_stop_async();
+
+enum LogLevel { LOG_LEVEL_DEBUG, LOG_LEVEL_INFO, LOG_LEVEL_ERROR };
+
+// Messages below the given level are discarded before they are formatted.
+// Default is LOG_LEVEL_DEBUG.
+void Log_set_level(LogLevel level);
+
+// Cheap check if messages of the given level are logged at all. Useful to
+// avoid assembling expensive arguments for messages nobody sees.
+inline bool Log_enabled(LogLevel level) {
+  extern LogLevel log_min_level_;
+  return level >= log_min_level_;
+}
+
 // Define this with empty, if you're not using gcc.
 #define PRINTF_FMT_CHECK(fmt_pos, args_pos)             \
   __attribute__ ((format (printf, fmt_pos, args_pos)))
 
+#ifdef BEAGLEG_NO_DEBUG_LOG
+// Compiled out entirely.
+inline void Log_debug(const char *format, ...) PRINTF_FMT_CHECK(1, 2);
+inline void Log_debug(const char *format, ...) {}
+#else
 void Log_debug(const char *format, ...) PRINTF_FMT_CHECK(1, 2);
+#endif
 void Log_info(const char *format, ...) PRINTF_FMT_CHECK(1, 2);
 void Log_error(const char *format, ...) PRINTF_FMT_CHECK(1, 2);
 
@@ -0,0 +1,137 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "logging.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+#include <gtest/gtest.h>
+
+namespace {
+// Logs to a temporary file, removed at the end of the test.
+class LogFile {
+public:
+  LogFile() {
+    char name[] = "/tmp/logging-test.XXXXXX";
+    close(mkstemp(name));
+    filename_ = name;
+    Log_init(filename_.c_str());
+  }
+  ~LogFile() {
+    Log_init("/dev/stderr");
+    unlink(filename_.c_str());
+  }
+
+  // Return the messages logged so far, without level and timestamp.
+  std::vector<std::string> Messages() {
+    std::vector<std::string> result;
+    FILE *f = fopen(filename_.c_str(), "r");
+    char buffer[1024];
+    while (fgets(buffer, sizeof(buffer), f)) {
+      const char *msg = strstr(buffer, "] ");
+      std::string line = msg ? msg + 2 : buffer;
+      if (!line.empty() && line[line.size()-1] == '\n')
+        line.resize(line.size() - 1);
+      result.push_back(line);
+    }
+    fclose(f);
+    return result;
+  }
+
+private:
+  std::string filename_;
+};
+}  // namespace
+
+TEST(Logging, SynchronousMessagesAreWrittenImmediately) {
+  LogFile log;
+  Log_info("hello %d", 42);
+  Log_error("trouble\n");   // No extra newline.
+  std::vector<std::string> messages = log.Messages();
+  ASSERT_EQ(2u, messages.size());
+  EXPECT_EQ("hello 42", messages[0]);
+  EXPECT_EQ("trouble", messages[1]);
+}
+
+TEST(Logging, LevelFilter) {
+  LogFile log;
+  EXPECT_TRUE(Log_enabled(LOG_LEVEL_DEBUG));
+  Log_set_level(LOG_LEVEL_INFO);
+  EXPECT_FALSE(Log_enabled(LOG_LEVEL_DEBUG));
+  Log_debug("not seen");
+  Log_info("info");
+  Log_set_level(LOG_LEVEL_ERROR);
+  Log_info("not seen");
+  Log_error("error");
+  Log_set_level(LOG_LEVEL_DEBUG);
+  Log_debug("debug");
+  std::vector<std::string> messages = log.Messages();
+  ASSERT_EQ(3u, messages.size());
+  EXPECT_EQ("info", messages[0]);
+  EXPECT_EQ("error", messages[1]);
+  EXPECT_EQ("debug", messages[2]);
+}
+
+TEST(Logging, AsyncMessagesArriveInOrder) {
+  LogFile log;
+  ASSERT_TRUE(Log_start_async());
+  for (int i = 0; i < 100; ++i) {
+    Log_info("message %d", i);
+  }
+  Log_stop_async();
+  std::vector<std::string> messages = log.Messages();
+  ASSERT_EQ(100u, messages.size());
+  for (int i = 0; i < 100; ++i) {
+    char expected[32];
+    snprintf(expected, sizeof(expected), "message %d", i);
+    EXPECT_EQ(expected, messages[i]);
+  }
+}
+
+TEST(Logging, AsyncOverflowIsReported) {
+  LogFile log;
+  ASSERT_TRUE(Log_start_async());
+  // Many more than fit into the ring, faster than the thread drains them.
+  const int kMessages = 100000;
+  for (int i = 0; i < kMessages; ++i) {
+    Log_info("message %d", i);
+  }
+  Log_stop_async();
+  Log_info("synchronous again");
+  std::vector<std::string> messages = log.Messages();
+  int logged = 0, dropped = 0;
+  for (const std::string &m : messages) {
+    unsigned int count;
+    if (sscanf(m.c_str(), "Log overflow: dropped %u messages", &count) == 1)
+      dropped += count;
+    else
+      logged++;
+  }
+  EXPECT_EQ(kMessages + 1, logged + dropped);
+  EXPECT_EQ("synchronous again", messages.back());
+}
+
+int main(int argc, char *argv[]) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,145 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "metrics.h"
+
+#include <pthread.h>
+#include <time.h>
+
+#include "string-util.h"
+
+static int64_t NowUsec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void RenderHeader(const Metric *metric, const char *type,
+                         std::string *out) {
+  *out += StringPrintf("# HELP %s %s\n# TYPE %s %s\n",
+                       metric->name(), metric->help(), metric->name(), type);
+}
+
+Metric::Metric(const char *name, const char *help)
+  : name_(name), help_(help) {
+  MetricsRegistry::Global()->Register(this);
+}
+
+Metric::~Metric() {
+  MetricsRegistry::Global()->Unregister(this);
+}
+
+void MetricCounter::Render(std::string *out) const {
+  RenderHeader(this, "counter", out);
+  *out += StringPrintf("%s %llu\n", name(), (unsigned long long) value());
+}
+
+void MetricGauge::Render(std::string *out) const {
+  RenderHeader(this, "gauge", out);
+  *out += StringPrintf("%s %lld\n", name(), (long long) value());
+}
+
+MetricHistogram::MetricHistogram(const char *name, const char *help,
+                                 const uint64_t *bounds, int count)
+  : Metric(name, help), bounds_(bounds, bounds + count),
+    buckets_(new std::atomic<uint64_t>[count + 1]), count_(0), sum_(0) {
+  for (int i = 0; i <= count; ++i) buckets_[i].store(0);
+}
+
+MetricHistogram::~MetricHistogram() {
+  delete [] buckets_;
+}
+
+void MetricHistogram::Observe(uint64_t value) {
+  size_t i = 0;
+  while (i < bounds_.size() && value > bounds_[i])
+    ++i;
+  buckets_[i].fetch_add(1, std::memory_order_relaxed);
+  sum_.fetch_add(value, std::memory_order_relaxed);
+  count_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void MetricHistogram::Render(std::string *out) const {
+  RenderHeader(this, "histogram", out);
+  // Prometheus buckets are cumulative.
+  uint64_t cumulative = 0;
+  for (size_t i = 0; i < bounds_.size(); ++i) {
+    cumulative += bucket(i);
+    *out += StringPrintf("%s_bucket{le=\"%llu\"} %llu\n", name(),
+                         (unsigned long long) bounds_[i],
+                         (unsigned long long) cumulative);
+  }
+  cumulative += bucket(bounds_.size());
+  *out += StringPrintf("%s_bucket{le=\"+Inf\"} %llu\n", name(),
+                       (unsigned long long) cumulative);
+  *out += StringPrintf("%s_sum %llu\n%s_count %llu\n",
+                       name(), (unsigned long long) sum(),
+                       name(), (unsigned long long) count());
+}
+
+// Registration happens rarely, mostly during static initialization, so a
+// plain mutex is good enough.
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+struct MetricsRegistry::Lock {
+  Lock() { pthread_mutex_lock(&registry_mutex); }
+  ~Lock() { pthread_mutex_unlock(&registry_mutex); }
+};
+
+MetricsRegistry::MetricsRegistry() : start_usec_(NowUsec()) {}
+
+MetricsRegistry *MetricsRegistry::Global() {
+  // Never deleted, so that static metrics can unregister in any order.
+  static MetricsRegistry *registry = new MetricsRegistry();
+  return registry;
+}
+
+void MetricsRegistry::Register(Metric *metric) {
+  Lock l;
+  metrics_.push_back(metric);
+}
+
+void MetricsRegistry::Unregister(Metric *metric) {
+  Lock l;
+  for (size_t i = 0; i < metrics_.size(); ++i) {
+    if (metrics_[i] == metric) {
+      metrics_.erase(metrics_.begin() + i);
+      return;
+    }
+  }
+}
+
+const Metric *MetricsRegistry::Find(const std::string &name) const {
+  Lock l;
+  for (const Metric *metric : metrics_) {
+    if (name == metric->name()) return metric;
+  }
+  return NULL;
+}
+
+std::string MetricsRegistry::RenderText() const {
+  std::string result;
+  result += "# HELP beagleg_uptime_seconds Time since start.\n"
+    "# TYPE beagleg_uptime_seconds gauge\n";
+  result += StringPrintf("beagleg_uptime_seconds %.3f\n",
+                         (NowUsec() - start_usec_) / 1e6);
+  Lock l;
+  for (const Metric *metric : metrics_) {
+    metric->Render(&result);
+  }
+  return result;
+}
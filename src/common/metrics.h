@@ -0,0 +1,143 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _BEAGLEG_METRICS_H_
+#define _BEAGLEG_METRICS_H_
+
+#include <stdint.h>
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+// Counters, gauges and histograms that describe how the machine is doing,
+// such as lines parsed or time spent waiting for the motion queue. They are
+// usually defined as static objects in the module they describe; they
+// register themselves with the global MetricsRegistry, which renders all of
+// them in the Prometheus text format.
+//
+// Updates are single relaxed atomic operations, so they are cheap enough
+// for the motion path and can be done from any thread.
+
+class Metric {
+public:
+  virtual ~Metric();
+
+  const char *name() const { return name_; }
+  const char *help() const { return help_; }
+
+  // Append the metric in the Prometheus text format to "out".
+  virtual void Render(std::string *out) const = 0;
+
+protected:
+  // "name" and "help" need to be string literals or otherwise outlive us.
+  Metric(const char *name, const char *help);
+
+private:
+  const char *const name_;
+  const char *const help_;
+};
+
+// Monotonically increasing count of events.
+class MetricCounter : public Metric {
+public:
+  MetricCounter(const char *name, const char *help)
+    : Metric(name, help), value_(0) {}
+
+  void Increment(uint64_t n = 1) {
+    value_.fetch_add(n, std::memory_order_relaxed);
+  }
+  uint64_t value() const { return value_.load(std::memory_order_relaxed); }
+
+  void Render(std::string *out) const;
+
+private:
+  std::atomic<uint64_t> value_;
+};
+
+// A value that goes up and down, e.g. a queue depth.
+class MetricGauge : public Metric {
+public:
+  MetricGauge(const char *name, const char *help)
+    : Metric(name, help), value_(0) {}
+
+  void Set(int64_t value) { value_.store(value, std::memory_order_relaxed); }
+  void Add(int64_t n) { value_.fetch_add(n, std::memory_order_relaxed); }
+  int64_t value() const { return value_.load(std::memory_order_relaxed); }
+
+  void Render(std::string *out) const;
+
+private:
+  std::atomic<int64_t> value_;
+};
+
+// Distribution of observed values in a fixed set of buckets. Bucket i
+// counts values up to and including bounds[i]; larger values end up in an
+// overflow bucket.
+class MetricHistogram : public Metric {
+public:
+  // "bounds" are "count" increasing upper bounds; they are copied.
+  MetricHistogram(const char *name, const char *help,
+                  const uint64_t *bounds, int count);
+  ~MetricHistogram();
+
+  void Observe(uint64_t value);
+
+  uint64_t count() const { return count_.load(std::memory_order_relaxed); }
+  uint64_t sum() const { return sum_.load(std::memory_order_relaxed); }
+
+  // Number of observations in bucket "i" (not cumulative); bucket
+  // bounds().size() is the overflow bucket.
+  uint64_t bucket(int i) const {
+    return buckets_[i].load(std::memory_order_relaxed);
+  }
+  const std::vector<uint64_t> &bounds() const { return bounds_; }
+
+  void Render(std::string *out) const;
+
+private:
+  const std::vector<uint64_t> bounds_;
+  std::atomic<uint64_t> *const buckets_;
+  std::atomic<uint64_t> count_;
+  std::atomic<uint64_t> sum_;
+};
+
+class MetricsRegistry {
+public:
+  // The registry all metrics register with.
+  static MetricsRegistry *Global();
+
+  void Register(Metric *metric);
+  void Unregister(Metric *metric);
+
+  // Find a metric by name. Returns NULL if there is none.
+  const Metric *Find(const std::string &name) const;
+
+  // All metrics in the Prometheus text exposition format, preceded by the
+  // process uptime as beagleg_uptime_seconds.
+  std::string RenderText() const;
+
+private:
+  MetricsRegistry();
+
+  struct Lock;
+  const int64_t start_usec_;
+  std::vector<Metric*> metrics_;
+};
+
+#endif  // _BEAGLEG_METRICS_H_
@@ -0,0 +1,93 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "metrics.h"
+
+#include <string>
+#include <thread>
+#include <vector>
+#include <gtest/gtest.h>
+
+TEST(Metrics, CounterAndGauge) {
+  MetricCounter counter("test_events_total", "Events.");
+  MetricGauge gauge("test_depth", "Depth.");
+  counter.Increment();
+  counter.Increment(41);
+  gauge.Set(10);
+  gauge.Add(-3);
+  EXPECT_EQ(42u, counter.value());
+  EXPECT_EQ(7, gauge.value());
+
+  const std::string text = MetricsRegistry::Global()->RenderText();
+  EXPECT_NE(std::string::npos, text.find("# TYPE test_events_total counter\n"
+                                         "test_events_total 42\n"));
+  EXPECT_NE(std::string::npos, text.find("# TYPE test_depth gauge\n"
+                                         "test_depth 7\n"));
+  EXPECT_NE(std::string::npos, text.find("\nbeagleg_uptime_seconds "));
+}
+
+TEST(Metrics, MetricsUnregisterWhenGone) {
+  {
+    MetricCounter counter("test_short_lived", "Gone soon.");
+    EXPECT_EQ(&counter, MetricsRegistry::Global()->Find("test_short_lived"));
+  }
+  EXPECT_TRUE(MetricsRegistry::Global()->Find("test_short_lived") == NULL);
+  EXPECT_EQ(std::string::npos,
+            MetricsRegistry::Global()->RenderText().find("test_short_lived"));
+}
+
+TEST(Metrics, HistogramBuckets) {
+  const uint64_t bounds[] = { 10, 100 };
+  MetricHistogram histogram("test_wait_usec", "Wait.", bounds, 2);
+  histogram.Observe(0);
+  histogram.Observe(10);
+  histogram.Observe(11);
+  histogram.Observe(1000);
+  EXPECT_EQ(2u, histogram.bucket(0));
+  EXPECT_EQ(1u, histogram.bucket(1));
+  EXPECT_EQ(1u, histogram.bucket(2));
+  EXPECT_EQ(4u, histogram.count());
+  EXPECT_EQ(1021u, histogram.sum());
+
+  std::string text;
+  histogram.Render(&text);
+  EXPECT_EQ("# HELP test_wait_usec Wait.\n"
+            "# TYPE test_wait_usec histogram\n"
+            "test_wait_usec_bucket{le=\"10\"} 2\n"
+            "test_wait_usec_bucket{le=\"100\"} 3\n"
+            "test_wait_usec_bucket{le=\"+Inf\"} 4\n"
+            "test_wait_usec_sum 1021\n"
+            "test_wait_usec_count 4\n", text);
+}
+
+TEST(Metrics, ConcurrentUpdates) {
+  MetricCounter counter("test_concurrent_total", "Concurrent events.");
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; ++t) {
+    threads.push_back(std::thread([&counter]() {
+          for (int i = 0; i < 10000; ++i) counter.Increment();
+        }));
+  }
+  for (std::thread &t : threads) t.join();
+  EXPECT_EQ(40000u, counter.value());
+}
+
+int main(int argc, char *argv[]) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
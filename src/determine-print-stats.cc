@@ -29,6 +29,7 @@
 #include "gcode-machine-control.h"
 #include "motor-operations.h"
 #include "hardware-mapping.h"
+#include "pru-cycle-model.h"
 #include "spindle-control.h"
 
 namespace {
@@ -76,6 +77,9 @@ public:
   const char *unprocessed(char letter, float value, const char *remain) final {
     return delegatee_->unprocessed(letter, value, remain);
   }
+  float arc_max_chord_error() final {
+    return delegatee_->arc_max_chord_error();
+  }
 
 private:
   static inline void set_min_max(float value, float *min, float *max) {
@@ -125,7 +129,8 @@ private:
 
 bool determine_print_stats(int input_fd, const MachineControlConfig &config,
                            FILE *msg_out,
-                           struct BeagleGPrintStats *result) {
+                           struct BeagleGPrintStats *result,
+                           int lex_threads, bool pru_cycle_model) {
   bzero(result, sizeof(*result));
   result->x_min = 1e7;
   result->y_min = 1e7;
@@ -137,8 +142,22 @@ bool determine_print_stats(int input_fd, const MachineControlConfig &config,
   // We do that by intercepting the motor operations by replacing the
   // implementation with our own.
   StatsMotorOperations stats_motor_ops(result);
+
+  // Or the real motor operations creating segments for the PRU model.
+  PruCycleModelQueue pru_model;
+  MotionQueueMotorOperations pru_motor_ops(&hardware, &pru_model);
+  if (pru_cycle_model) {
+    pru_motor_ops.SetSCurveAcceleration(config.s_curve_acceleration);
+    for (const GCodeParserAxis axis : AllAxes()) {
+      pru_motor_ops.PrecomputeAcceleration(config.acceleration[axis]
+                                           * config.steps_per_mm[axis]);
+    }
+  }
   GCodeMachineControl *machine_control
-    = GCodeMachineControl::Create(config, &stats_motor_ops,
+    = GCodeMachineControl::Create(config,
+                                  pru_cycle_model
+                                  ? (MotorOperations*) &pru_motor_ops
+                                  : &stats_motor_ops,
                                   &hardware, &spindle, NULL);
   if (!machine_control)
     return false;
@@ -151,8 +170,23 @@ bool determine_print_stats(int input_fd, const MachineControlConfig &config,
   GCodeParser::Config::ParamMap parameters;
   parser_cfg.parameters = &parameters;
   GCodeParser parser(parser_cfg, &stats_event_receiver, false);
-  const bool success = parser.ParseStream(input_fd, msg_out) == 0
+  const bool success = parser.ParseFile(input_fd, msg_out, lex_threads) == 0
     && parser.error_count() == 0;
   delete machine_control;
+  if (pru_cycle_model)  // Dwells are already accounted for.
+    result->total_time_seconds += pru_model.elapsed_seconds();
   return success;
 }
+
+void configure_for_print_stats(MachineControlConfig *config) {
+  config->range_check = false;  // don't care about clipping.
+  config->require_homing = false;
+  for (int i = 0; i < GCODE_NUM_AXES; ++i) {
+    config->homing_trigger[i] = HardwareMapping::TRIGGER_NONE;
+  }
+  config->acknowledge_lines = false;
+  config->debug_print = false;
+  config->synchronous = false;
+  config->threaded_planner = false;
+  config->queue_low_watermark = 0;
+}
@@ -35,9 +35,23 @@ struct BeagleGPrintStats {
 
 // Given the input file-descriptor (which is read to EOF and then closed)
 // and the given constraints, determine statistics about the gcode-file.
+// Regular files are lexed with "lex_threads" helper threads, see
+// GCodeParser::ParseFile().
+// The time is determined from the speeds planned for each segment, or, with
+// "pru_cycle_model", by counting the cycles the PRU firmware needs for the
+// resulting motion segments (see PruCycleModelQueue); slower, but this
+// includes all the firmware overhead and rounding.
 // Returns true on success.
+// Uses its own parser and planner, so it can be called from multiple
+// threads at once as long as each thread has its own "msg_out".
 bool determine_print_stats(int input_fd,
                            const MachineControlConfig &config,
                            FILE *msg_out,
-                           struct BeagleGPrintStats *result);
+                           struct BeagleGPrintStats *result,
+                           int lex_threads = -1,
+                           bool pru_cycle_model = false);
+
+// Adapt the machine "config" to determining print stats: the files are
+// not run on a real machine, so no homing, range checks or acknowledgement.
+void configure_for_print_stats(MachineControlConfig *config);
 #endif // _BEAGLEG_DETERMINE_PRINT_STATS_H
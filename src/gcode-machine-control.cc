@@ -34,6 +34,8 @@
 #include <unistd.h>
 #include <time.h>
 
+#include <algorithm>
+
 #include "common/container.h"
 #include "common/logging.h"
 #include "common/string-util.h"
@@ -50,6 +52,11 @@
 // In case we get a zero feedrate, send this frequency to motors instead.
 #define ZERO_FEEDRATE_OVERRIDE_HZ 5
 
+// While waiting for input, we only bring the path to a halt once the motion
+// queued is less than the time needed to stop plus this margin, which
+// covers the time until input_idle() is called again.
+#define IDLE_HALT_MARGIN_SECONDS 0.1f
+
 #define VERSION_STRING "PROTOCOL_VERSION:0.1 FIRMWARE_NAME:BeagleG "    \
   "CAPE:" CAPE_NAME " FIRMWARE_URL:http%3A//github.com/hzeller/beagleg"
 
@@ -61,6 +68,66 @@ enum HomingState {
   HOMING_STATE_HOMED
 };
 
+namespace {
+// Motor operations for the planner that hold back motion while the spindle
+// is still starting, reversing or stopping. The spindle does not block while changing
+// state, so the following moves are parsed and planned meanwhile; only the
+// first one to be sent to the motors has to wait until the spindle is ready.
+// Called from the planner thread if it has one.
+class SpindleSynchronizedMotorOperations : public MotorOperations {
+public:
+  SpindleSynchronizedMotorOperations(MotorOperations *delegate,
+                                     Spindle *spindle)
+    : delegate_(delegate), spindle_(spindle) {}
+
+  void Enqueue(const LinearSegmentSteps &segment) final {
+    spindle_->WaitReadyForMotion();
+    delegate_->Enqueue(segment);
+  }
+  void MotorEnable(bool on) final { delegate_->MotorEnable(on); }
+  void WaitQueueEmpty() final { delegate_->WaitQueueEmpty(); }
+  void Dwell(float milliseconds) final {
+    spindle_->WaitReadyForMotion();
+    delegate_->Dwell(milliseconds);
+  }
+  bool GetPhysicalStatus(PhysicalStatus *status) final {
+    return delegate_->GetPhysicalStatus(status);
+  }
+  void SetExternalPosition(int axis, int steps) final {
+    delegate_->SetExternalPosition(axis, steps);
+  }
+  bool GetQueuedSeconds(float *seconds) final {
+    return delegate_->GetQueuedSeconds(seconds);
+  }
+  void RunAtQueuePosition(const std::function<void()> &action) final {
+    delegate_->RunAtQueuePosition(action);
+  }
+  void RunDueActions() final { delegate_->RunDueActions(); }
+  bool MoveUntilInput(const LinearSegmentSteps &segment, float acceleration,
+                      uint32_t gpio_def, bool level,
+                      int *trigger_steps, int *total_steps) final {
+    spindle_->WaitReadyForMotion();
+    return delegate_->MoveUntilInput(segment, acceleration, gpio_def, level,
+                                     trigger_steps, total_steps);
+  }
+  bool FeedHold(bool hold, float ramp_seconds) final {
+    return delegate_->FeedHold(hold, ramp_seconds);
+  }
+  bool IsHeld() final { return delegate_->IsHeld(); }
+  bool SetSpeedOverride(float factor, float ramp_seconds) final {
+    return delegate_->SetSpeedOverride(factor, ramp_seconds);
+  }
+  bool SetVelocityPWM(float duty) final {
+    spindle_->WaitReadyForMotion();  // A stop of the spindle is done.
+    return delegate_->SetVelocityPWM(duty);
+  }
+
+private:
+  MotorOperations *const delegate_;
+  Spindle *const spindle_;
+};
+}  // namespace
+
 // The GCode control implementation. Essentially we are a state machine
 // driven by the events we get from the gcode parsing.
 // We implement the event receiver interface directly.
@@ -79,11 +146,14 @@ public:
 
   ~Impl() {
     delete planner_;
+    delete spindle_motor_ops_;
+    delete adc_sampler_;
   }
 
   const MachineControlConfig &config() const { return cfg_; }
   void set_msg_stream(FILE *msg) { msg_stream_ = msg; }
   void GetCurrentPosition(AxesRegister *pos);
+  void GetStatus(GCodeMachineControl::Status *status);
 
   // -- GCodeParser::Events interface implementation --
   void gcode_start(GCodeParser *parser) final;
@@ -104,14 +174,35 @@ public:
   void dwell(float time_ms) final;              // G4: dwell for milliseconds.
   void motors_enable(bool enable) final;        // M17,M84,M18: Switch on/off motors
   bool coordinated_move(float feed_mm_p_sec, const AxesRegister &target) final;
+  bool coordinated_moves(const Move *moves, int count) final;
   bool rapid_move(float feed_mm_p_sec, const AxesRegister &target) final;
+  void arc_move(float feed_mm_p_sec, GCodeParserAxis normal_axis,
+                bool clockwise, const AxesRegister &start,
+                const AxesRegister &center, const AxesRegister &end) final;
   const char *unprocessed(char letter, float value, const char *) final;
+  float arc_max_chord_error() final { return cfg_.arc_chord_error; }
 
 private:
   bool check_for_pause();
+  void check_feed_hold();
   void issue_motor_move_if_possible();
   bool test_homing_status_ok();
   bool test_within_machine_limits(const AxesRegister &axes);
+
+  // Feedrate for the next G1 move with all factors and limits applied.
+  float effective_feedrate() const {
+    const float feedrate = prog_speed_factor_ * current_feedrate_mm_per_sec_;
+    if (arc_speed_limit_ > 0 && feedrate > arc_speed_limit_)
+      return arc_speed_limit_;
+    return feedrate;
+  }
+  // Lowest acceleration of the two axes spanning a plane; 0 if unknown.
+  float plane_acceleration(GCodeParserAxis a, GCodeParserAxis b) const {
+    float accel = cfg_.acceleration[a];
+    if (cfg_.acceleration[b] > 0 && (accel <= 0 || cfg_.acceleration[b] < accel))
+      accel = cfg_.acceleration[b];
+    return accel > 0 ? accel : 0;
+  }
   void mprint_endstop_status();
   void mprint_current_position();
   const char *aux_bit_commands(char letter, float value, const char *);
@@ -120,14 +211,17 @@ private:
                               enum GCodeParserAxis defining_axis);
   int move_to_endstop(enum GCodeParserAxis axis,
                       float feedrate, HardwareMapping::AxisTrigger trigger);
+  bool approach_endstop(enum GCodeParserAxis axis, float feedrate, int dir,
+                        uint32_t gpio_def, bool level, int *total_movement);
   int move_to_probe(enum GCodeParserAxis axis, float feedrate, const int dir,
-                    int max_steps);
+                    int max_steps, int *trigger_steps);
   void home_axis(enum GCodeParserAxis axis);
   void set_output_flags(HardwareMapping::LogicOutput out, bool is_on);
   void handle_M105();
   // Parse GCode spindle M3/M4 block.
   const char *set_spindle_on(bool is_ccw, const char *);
   void set_spindle_off();
+  void flush_spindle_queue();
 
   // Print to msg_stream.
   void mprintf(const char *format, ...);
@@ -138,19 +232,24 @@ private:
   Planner *planner_;
   HardwareMapping *const hardware_mapping_;
   Spindle *const spindle_;
+  MotorOperations *spindle_motor_ops_;   // Motion waiting for the spindle.
+  ADCSampler *adc_sampler_;              // NULL if not sampled continuously.
   FILE *msg_stream_;
   GCodeParser *parser_;
 
   // Derived configuration
   float g0_feedrate_mm_per_sec_;         // Highest of all axes; used for G0
                                          // (will be trimmed if needed)
+  float feed_hold_seconds_;              // Longest time to stop of all axes.
   // Current machine configuration
   AxesRegister coordinate_display_origin_; // parser tells us
   float current_feedrate_mm_per_sec_;    // Set via Fxxx and remembered
   float prog_speed_factor_;              // Speed factor set by program (M220)
+  float arc_speed_limit_;                // Centripetal limit in arc. 0: none.
   time_t next_auto_disable_motor_;
   time_t next_auto_disable_fan_;
   bool pause_enabled_;                  // Enabled via M120, disabled via M121
+  bool dwell_queued_;                   // Immediate outputs wait for it.
 
   enum HomingState homing_state_;
 };
@@ -164,15 +263,21 @@ GCodeMachineControl::Impl::Impl(const MachineControlConfig &config,
                                 FILE *msg_stream)
   : cfg_(config),
     motor_ops_(motor_ops),
+    planner_(NULL),
     hardware_mapping_(hardware_mapping),
     spindle_(spindle),
+    spindle_motor_ops_(NULL),
+    adc_sampler_(NULL),
     msg_stream_(msg_stream),
     parser_(NULL),
     g0_feedrate_mm_per_sec_(-1),
+    feed_hold_seconds_(0),
     current_feedrate_mm_per_sec_(-1),
     prog_speed_factor_(1),
+    arc_speed_limit_(0),
     homing_state_(HOMING_STATE_NEVER_HOMED) {
     pause_enabled_ = cfg_.enable_pause;
+    dwell_queued_ = false;
     next_auto_disable_motor_ = -1;
     next_auto_disable_fan_ = -1;
 }
@@ -207,6 +312,13 @@ bool GCodeMachineControl::Impl::Init() {
     if (cfg_.max_feedrate[axis] > g0_feedrate_mm_per_sec_) {
       g0_feedrate_mm_per_sec_ = cfg_.max_feedrate[axis];
     }
+    // A feed hold slows down all axes at once, so it takes as long as the
+    // one needing the longest to stop at full speed.
+    if (cfg_.acceleration[axis] > 0) {
+      feed_hold_seconds_ = std::max(feed_hold_seconds_,
+                                    cfg_.max_feedrate[axis]
+                                    / cfg_.acceleration[axis]);
+    }
   }
   prog_speed_factor_ = 1.0f;
 
@@ -291,7 +403,21 @@ bool GCodeMachineControl::Impl::Init() {
   if (error_count)
     return false;
 
-  planner_ = new Planner(&cfg_, hardware_mapping_, motor_ops_);
+  if (spindle_) {
+    spindle_motor_ops_ = new SpindleSynchronizedMotorOperations(motor_ops_,
+                                                                spindle_);
+  }
+  planner_ = new Planner(&cfg_, hardware_mapping_,
+                         spindle_ ? spindle_motor_ops_ : motor_ops_);
+
+  if (!hardware_mapping_->IsHardwareSimulated()) {
+    adc_sampler_ = new ADCSampler();
+    if (!adc_sampler_->Start(0xff)) {
+      Log_info("ADC: no buffered sampling; reading single values.");
+      delete adc_sampler_;
+      adc_sampler_ = NULL;
+    }
+  }
   return true;
 }
 
@@ -312,12 +438,16 @@ void GCodeMachineControl::Impl::wait_temperature() {
 }
 void GCodeMachineControl::Impl::motors_enable(bool b) {
   planner_->BringPathToHalt();
+  planner_->WaitIdle();
   motor_ops_->MotorEnable(b);
   if (!b && homing_state_ == HOMING_STATE_HOMED) {
     homing_state_ = HOMING_STATE_HOMED_BUT_MOTORS_UNPOWERED;
   }
 }
 void GCodeMachineControl::Impl::gcode_command_done(char l, float v) {
+  motor_ops_->RunDueActions();       // Outputs switching along the path.
+  if (spindle_) spindle_->Update();  // Progress of a spindle ramp.
+  check_feed_hold();
   if (cfg_.acknowledge_lines) mprintf("ok\n");
 }
 void GCodeMachineControl::Impl::inform_origin_offset(const AxesRegister &o) {
@@ -327,9 +457,13 @@ void GCodeMachineControl::Impl::inform_origin_offset(const AxesRegister &o) {
 void GCodeMachineControl::Impl::set_fanspeed(float speed) {
   if (speed < 0.0 || speed > 255.0) return;
   float duty_cycle = speed / 255.0;
-  // The fan can be mapped to an aux and/or pwm signal
+  // The fan can be mapped to an aux and/or pwm signal. The aux bit travels
+  // with the moves; the pwm value is switched at the same position.
   set_output_flags(HardwareMapping::OUT_FAN, duty_cycle > 0.0);
-  hardware_mapping_->SetPWMOutput(HardwareMapping::OUT_FAN, duty_cycle);
+  HardwareMapping *const hardware = hardware_mapping_;
+  planner_->RunAtPathPosition([hardware, duty_cycle]() {
+      hardware->SetPWMOutput(HardwareMapping::OUT_FAN, duty_cycle);
+    });
 }
 
 // number of checks to ensure the pause switch is inactive
@@ -369,10 +503,24 @@ bool GCodeMachineControl::Impl::check_for_pause() {
   return hardware_mapping_->TestPauseSwitch();
 }
 
+// With the pause switch pressed while the motors are moving, hold the feed
+// right away in the motion backend. We continue along the queued path, so
+// there is nothing to plan again once the start switch is pressed.
+// Without a backend supporting this, we pause at the next dwell.
+void GCodeMachineControl::Impl::check_feed_hold() {
+  if (!pause_enabled_ || !check_for_pause())
+    return;
+  if (!motor_ops_->FeedHold(true, feed_hold_seconds_))
+    return;
+  mprintf("// BeagleG: feed hold\n");
+  wait_for_start();
+  motor_ops_->FeedHold(false, feed_hold_seconds_);
+}
+
 void GCodeMachineControl::Impl::handle_M105() {
   mprintf("// ");
   for (int chan = 0; chan < 8; chan++) {
-    int raw = arc_read_raw(chan);
+    int raw = adc_sampler_ ? adc_sampler_->Read(chan) : arc_read_raw(chan);
     mprintf("RAW%d:%d ", chan, raw);
   }
   mprintf("\n");
@@ -386,8 +534,6 @@ const char *GCodeMachineControl::Impl::set_spindle_on(bool is_ccw,
   char letter;
   float value;
 
-  // Ensure that the PRU queue is flushed before turning on the spindle.
-  planner_->BringPathToHalt();
   for (;;) {
     after_pair = parser_->ParsePair(remaining, &letter, &value, msg_stream_);
     if (after_pair == NULL) break;
@@ -395,14 +541,48 @@ const char *GCodeMachineControl::Impl::set_spindle_on(bool is_ccw,
     else break;
     remaining = after_pair;
   }
-  if (spindle_rpm >= 0) spindle_->On(is_ccw, spindle_rpm);
+  if (spindle_rpm < 0 || !spindle_) return remaining;
+  if (spindle_->IsOn(is_ccw)) {
+    // Only the speed changes: no need to stop, it is switched at this
+    // position in the path.
+    Spindle *const spindle = spindle_;
+    planner_->RunAtPathPosition([spindle, is_ccw, spindle_rpm]() {
+        spindle->On(is_ccw, spindle_rpm);
+      });
+    if (spindle_->HasVelocityPWM()) {
+      // The duty travels with the segments enqueued after this position.
+      MotorOperations *const ops = spindle_motor_ops_;
+      const float duty = spindle_->DutyCycle(spindle_rpm);
+      planner_->RunWhenIssued([ops, duty]() { ops->SetVelocityPWM(duty); });
+    }
+  } else {
+    // Starting or reversing: stop here; the following moves wait for the
+    // spindle to be up to speed.
+    flush_spindle_queue();
+    spindle_->On(is_ccw, spindle_rpm);
+    if (spindle_->HasVelocityPWM()
+        && !spindle_motor_ops_->SetVelocityPWM(
+          spindle_->DutyCycle(spindle_rpm))) {
+      Log_error("Spindle velocity-pwm not supported by motor backend.");
+    }
+  }
   return remaining;
 }
 
 void GCodeMachineControl::Impl::set_spindle_off() {
-  // Ensure that the PRU queue is flushed before turning off the spindle.
-  planner_->BringPathToHalt();
+  if (!spindle_) return;
+  flush_spindle_queue();
   spindle_->Off();
+  if (spindle_->HasVelocityPWM()) spindle_motor_ops_->SetVelocityPWM(0);
+}
+
+// Bring the machine to a stop before the spindle changes state. This also
+// runs all changes pending at positions along the path, so they can't be
+// applied after the one we're going to make.
+void GCodeMachineControl::Impl::flush_spindle_queue() {
+  planner_->BringPathToHalt();
+  planner_->WaitIdle();
+  motor_ops_->WaitQueueEmpty();
 }
 
 const char *GCodeMachineControl::Impl::unprocessed(char letter, float value,
@@ -431,7 +611,7 @@ const char *GCodeMachineControl::Impl::special_commands(char letter, float value
     remaining = aux_bit_commands(letter, value, remaining);
     break;
   case 400:
-    dwell(0);
+    dwell(0);  // Zero length: wait for all motion to finish.
     break;
   case 80:
   case 81:
@@ -497,6 +677,11 @@ const char *GCodeMachineControl::Impl::aux_bit_commands(char letter, float value
         hardware_mapping_->UpdateAuxBits(pin, bit_value == 1);
 
         if (m_code == 64 || m_code == 65) {    // update the AUX pin immediately
+          // ... but not before a preceding dwell is over.
+          if (dwell_queued_) {
+            motor_ops_->WaitQueueEmpty();
+            dwell_queued_ = false;
+          }
           hardware_mapping_->SetAuxOutputs();
         }
       }
@@ -536,6 +721,14 @@ void GCodeMachineControl::Impl::GetCurrentPosition(AxesRegister *pos) {
   }
 }
 
+void GCodeMachineControl::Impl::GetStatus(GCodeMachineControl::Status *status) {
+  GetCurrentPosition(&status->position);
+  status->feedrate = (current_feedrate_mm_per_sec_ < 0)
+    ? -1 : effective_feedrate();
+  status->aux_bits = hardware_mapping_->GetAuxBits();
+  status->gcode_line = parser_ ? parser_->line_number() : 0;
+}
+
 void GCodeMachineControl::Impl::mprint_current_position() {
   AxesRegister current_pos;
   planner_->GetCurrentPosition(&current_pos);
@@ -609,6 +802,7 @@ void GCodeMachineControl::Impl::gcode_start(GCodeParser *parser) {
 void GCodeMachineControl::Impl::gcode_finished(bool end_of_stream) {
   planner_->BringPathToHalt();
   set_spindle_off();
+  if (spindle_) spindle_->WaitReady();
   if (end_of_stream && cfg_.auto_motor_disable_seconds > 0)
     motors_enable(false);
 }
@@ -682,11 +876,75 @@ bool GCodeMachineControl::Impl::coordinated_move(float feed,
     return false;
   }
 
-  float feedrate = prog_speed_factor_ * current_feedrate_mm_per_sec_;
-  planner_->Enqueue(axis, feedrate);
+  planner_->Enqueue(axis, effective_feedrate());
   return true;
 }
 
+// Same as coordinated_move() for each, but hands all valid moves to the
+// planner at once. Moves along a curve are limited to the speed at which the
+// centripetal acceleration v^2 * curvature stays within what X and Y can do.
+bool GCodeMachineControl::Impl::coordinated_moves(const Move *moves,
+                                                  int count) {
+  if (!test_homing_status_ok())
+    return false;
+  const float curve_accel = plane_acceleration(AXIS_X, AXIS_Y);
+  AxesRegister targets[MAX_MOVE_BATCH];
+  float speeds[MAX_MOVE_BATCH];
+  bool all_success = true;
+  while (count > 0) {
+    int valid = 0;
+    const int chunk = count < MAX_MOVE_BATCH ? count : MAX_MOVE_BATCH;
+    for (const Move *m = moves; m < moves + chunk; ++m) {
+      if (!test_within_machine_limits(m->absolute_pos)) {
+        all_success = false;
+        continue;
+      }
+      if (m->feed_mm_p_sec > 0) {
+        current_feedrate_mm_per_sec_ = cfg_.speed_factor * m->feed_mm_p_sec;
+      }
+      if (current_feedrate_mm_per_sec_ <= 0) {
+        mprintf("// Error: No feedrate set yet.\n");
+        all_success = false;
+        continue;
+      }
+      targets[valid] = m->absolute_pos;
+      speeds[valid] = effective_feedrate();
+      if (m->curvature > 0 && curve_accel > 0) {
+        const float limit = sqrtf(curve_accel / m->curvature);
+        if (speeds[valid] > limit) speeds[valid] = limit;
+      }
+      ++valid;
+    }
+    planner_->Enqueue(targets, speeds, valid);
+    moves += chunk;
+    count -= chunk;
+  }
+  return all_success;
+}
+
+// Arcs are linearized by the default implementation, but we travel them at
+// a constant speed that does not exceed the centripetal acceleration the
+// axes in the plane can provide: a = v^2 / r.
+void GCodeMachineControl::Impl::arc_move(float feed,
+                                         GCodeParserAxis normal_axis,
+                                         bool clockwise,
+                                         const AxesRegister &start,
+                                         const AxesRegister &center,
+                                         const AxesRegister &end) {
+  GCodeParserAxis plane_0, plane_1;
+  switch (normal_axis) {
+  case AXIS_X: plane_0 = AXIS_Y; plane_1 = AXIS_Z; break;
+  case AXIS_Y: plane_0 = AXIS_X; plane_1 = AXIS_Z; break;
+  default:     plane_0 = AXIS_X; plane_1 = AXIS_Y; break;
+  }
+  const float accel = plane_acceleration(plane_0, plane_1);
+  const float radius = hypotf(center[plane_0] - start[plane_0],
+                              center[plane_1] - start[plane_1]);
+  arc_speed_limit_ = (accel > 0) ? sqrtf(accel * radius) : 0;
+  EventReceiver::arc_move(feed, normal_axis, clockwise, start, center, end);
+  arc_speed_limit_ = 0;
+}
+
 bool GCodeMachineControl::Impl::rapid_move(float feed,
                                            const AxesRegister &axis) {
   if (!test_homing_status_ok())
@@ -704,8 +962,15 @@ bool GCodeMachineControl::Impl::rapid_move(float feed,
 
 void GCodeMachineControl::Impl::dwell(float value) {
   planner_->BringPathToHalt();
-  motor_ops_->WaitQueueEmpty();
-  usleep((int) (value * 1000));
+  planner_->WaitIdle();
+  if (spindle_) spindle_->WaitReady();  // Dwell starts once it is up to speed.
+  if (value > 0) {
+    motor_ops_->Dwell(value);  // Executed in line with the motion.
+    dwell_queued_ = true;
+  } else {
+    motor_ops_->WaitQueueEmpty();
+    dwell_queued_ = false;
+  }
 
   if (pause_enabled_ && check_for_pause()) {
     Log_debug("Pause input detected, waiting for Start");
@@ -714,12 +979,21 @@ void GCodeMachineControl::Impl::dwell(float value) {
 }
 
 void GCodeMachineControl::Impl::input_idle(bool is_first) {
-  planner_->BringPathToHalt();
+  motor_ops_->RunDueActions();
+  if (spindle_) spindle_->Update();
+  check_feed_hold();
+  // Short gaps in the input should not result in stopping on the part: keep
+  // planning ahead as long as there is enough motion queued.
+  float queued_seconds;
+  const bool still_moving = motor_ops_->GetQueuedSeconds(&queued_seconds)
+    && queued_seconds > planner_->StoppingTime() + IDLE_HALT_MARGIN_SECONDS;
+  if (!still_moving)
+    planner_->BringPathToHalt();
   if (cfg_.auto_motor_disable_seconds > 0) {
     if (is_first) {
       next_auto_disable_motor_ = time(NULL) + cfg_.auto_motor_disable_seconds;
       next_auto_disable_fan_ = -1;
-    } else if (next_auto_disable_motor_ != -1 &&
+    } else if (!still_moving && next_auto_disable_motor_ != -1 &&
                time(NULL) >= next_auto_disable_motor_) {
       motors_enable(false);
       next_auto_disable_motor_ = -1;
@@ -743,7 +1017,16 @@ void GCodeMachineControl::Impl::set_speed_factor(float value) {
             100.0f * value);
     return;
   }
-  prog_speed_factor_ = value;
+  // Up to what the planner left room for, apply the factor in real time to
+  // all motion including the queued one. Beyond that, only later moves
+  // are planned faster.
+  const float max_override = std::max(1.0f, cfg_.max_speed_override);
+  const float override = std::min(value, max_override);
+  if (motor_ops_->SetSpeedOverride(override, feed_hold_seconds_)) {
+    prog_speed_factor_ = value / override;
+  } else {
+    prog_speed_factor_ = value;
+  }
 }
 
 // Moves to endstop and returns how many steps it moved in the process.
@@ -760,9 +1043,18 @@ int GCodeMachineControl::Impl::move_to_endstop(enum GCodeParserAxis axis,
   const int dir = trigger == HardwareMapping::TRIGGER_MIN ? -1 : 1;
   float v0 = 0;
   float v1 = feedrate;
-  while (!hardware_mapping_->TestAxisSwitch(axis, trigger)) {
-    total_movement += planner_->DirectDrive(axis, dir * kHomingMM, v0, v1);
-    v0 = v1;  // TODO: possibly acceleration over multiple segments.
+  uint32_t gpio_def;
+  bool level;
+  if (hardware_mapping_->GetAxisSwitchInput(axis, trigger, &gpio_def, &level)
+      && approach_endstop(axis, feedrate, dir, gpio_def, level,
+                          &total_movement)) {
+    v0 = feedrate;  // Switch is triggered; only back off from here.
+  } else {
+    // Can't watch the switch while moving; check it after each bit.
+    while (!hardware_mapping_->TestAxisSwitch(axis, trigger)) {
+      total_movement += planner_->DirectDrive(axis, dir * kHomingMM, v0, v1);
+      v0 = v1;  // TODO: possibly acceleration over multiple segments.
+    }
   }
 
   // Go back until switch is not triggered anymore.
@@ -773,12 +1065,98 @@ int GCodeMachineControl::Impl::move_to_endstop(enum GCodeParserAxis axis,
   return total_movement;
 }
 
+// Approach the endstop with moves that the motion backend stops as soon as
+// the switch triggers: first fast, as fast as we can while still stopping
+// within kOvershootMM, then, after backing off, slowly for a precise
+// position. Returns false if the backend can't watch the switch.
+bool GCodeMachineControl::Impl::approach_endstop(enum GCodeParserAxis axis,
+                                                 float feedrate, int dir,
+                                                 uint32_t gpio_def, bool level,
+                                                 int *total_movement) {
+  const float kOvershootMM = 2.0;     // TODO: make configurable?
+  const float kBackoffMM = 1.0;
+  // Long enough to get to the switch from anywhere.
+  const float search_mm = (cfg_.move_range_mm[axis] > 0)
+    ? 1.5f * cfg_.move_range_mm[axis]
+    : 1000.0f;
+  const float steps_per_mm = cfg_.steps_per_mm[axis];
+
+  // v^2 = 2 * a * s: the speed from which we stop within the overshoot.
+  float fast_speed = feedrate;
+  if (cfg_.acceleration[axis] > 0) {
+    fast_speed = std::min(sqrtf(2 * cfg_.acceleration[axis] * kOvershootMM),
+                          cfg_.max_feedrate[axis]);
+    fast_speed = std::max(fast_speed, feedrate);
+  }
+
+  int trigger_steps, stop_steps;
+  if (!planner_->DirectDriveUntilInput(axis, dir * search_mm, fast_speed,
+                                       gpio_def, level,
+                                       &trigger_steps, &stop_steps)) {
+    return false;
+  }
+  *total_movement += dir * stop_steps;
+  if (trigger_steps < 0) {
+    mprintf("// BeagleG: endstop %c not reached\n",
+            gcodep_axis2letter(axis));
+    return true;
+  }
+
+  // Back off to before where the switch triggered and make sure it is
+  // released, then touch it again slowly.
+  const float back_mm = (stop_steps - trigger_steps) / steps_per_mm
+    + kBackoffMM;
+  *total_movement += planner_->DirectDrive(axis, -dir * back_mm,
+                                           feedrate, feedrate);
+  while (hardware_mapping_->TestAxisSwitch(axis,
+                                           dir < 0
+                                           ? HardwareMapping::TRIGGER_MIN
+                                           : HardwareMapping::TRIGGER_MAX)) {
+    *total_movement += planner_->DirectDrive(axis, -dir * kBackoffMM,
+                                             feedrate, feedrate);
+  }
+  if (!planner_->DirectDriveUntilInput(axis, dir * (back_mm + kOvershootMM),
+                                       feedrate, gpio_def, level,
+                                       &trigger_steps, &stop_steps)) {
+    return false;
+  }
+  *total_movement += dir * stop_steps;
+  if (trigger_steps < 0) {
+    mprintf("// BeagleG: endstop %c not reached\n",
+            gcodep_axis2letter(axis));
+  }
+  return true;
+}
+
+// Moves towards the probe until it triggers and returns how many steps it
+// moved in the process. The steps until the probe triggered are stored in
+// "trigger_steps"; with the probe watched while moving, the motor only comes
+// to a stop a bit later.
 int GCodeMachineControl::Impl::move_to_probe(enum GCodeParserAxis axis,
                                              float feedrate, const int dir,
-                                             int max_steps) {
+                                             int max_steps,
+                                             int *trigger_steps) {
+  *trigger_steps = 0;
   if (hardware_mapping_->IsHardwareSimulated())
     return 0;  // There are no switches to trigger, so pretend we stopped.
 
+  uint32_t gpio_def;
+  bool level;
+  int triggered, total;
+  if (hardware_mapping_->GetProbeSwitchInput(&gpio_def, &level)
+      && planner_->DirectDriveUntilInput(axis, dir * max_steps
+                                         / cfg_.steps_per_mm[axis],
+                                         feedrate, gpio_def, level,
+                                         &triggered, &total)) {
+    if (triggered < 0) {
+      mprintf("// G30: max probe reached\n");
+      triggered = total;
+    }
+    *trigger_steps = dir * triggered;
+    return dir * total;
+  }
+
+  // Can't watch the probe while moving; check it after each bit.
   const float kProbeMM = 0.05;                   // TODO: make configurable?
 
   int total_movement = 0;
@@ -789,10 +1167,11 @@ int GCodeMachineControl::Impl::move_to_probe(enum GCodeParserAxis axis,
     v0 = v1;  // TODO: possibly acceleration over multiple segments.
     if (abs(total_movement) > max_steps) {
       mprintf("// G30: max probe reached\n");
-      return total_movement;
+      break;
     }
   }
 
+  *trigger_steps = total_movement;
   return total_movement;
 }
 
@@ -847,12 +1226,14 @@ bool GCodeMachineControl::Impl::probe_axis(float feedrate,
 
   if (feedrate <= 0) feedrate = 20;
   int max_steps = abs(cfg_.move_range_mm[axis] * cfg_.steps_per_mm[axis]);
-  int total_steps = move_to_probe(axis, feedrate, dir, max_steps);
+  int trigger_steps;
+  int total_steps = move_to_probe(axis, feedrate, dir, max_steps,
+                                  &trigger_steps);
   float distance_moved = total_steps / cfg_.steps_per_mm[axis];
 
   const float new_pos = machine_pos[axis] + distance_moved;
   planner_->SetExternalPosition(axis, new_pos);
-  *probe_result = new_pos;
+  *probe_result = machine_pos[axis] + trigger_steps / cfg_.steps_per_mm[axis];
   return true;
 }
 
@@ -891,6 +1272,10 @@ void GCodeMachineControl::GetCurrentPosition(AxesRegister *pos) {
   impl_->GetCurrentPosition(pos);
 }
 
+void GCodeMachineControl::GetStatus(Status *status) {
+  impl_->GetStatus(status);
+}
+
 GCodeParser::EventReceiver *GCodeMachineControl::ParseEventReceiver() {
   return impl_;
 }
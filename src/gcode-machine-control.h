@@ -48,7 +48,13 @@ struct MachineControlConfig {
   FloatAxisConfig acceleration;   // Max acceleration for axis (mm/s^2)
 
   float speed_factor;         // Multiply feed with. Should be 1.0 by default.
-  float threshold_angle;      // Threshold angle to ignore speed changes
+  float max_speed_override;   // Max real-time M220 factor planned for. >= 1.
+  float threshold_angle;      // Threshold angle to ignore speed changes.
+                              // Only used if junction_deviation is 0.
+  float junction_deviation;   // Max deviation from corner in mm when cornering.
+  int lookahead_segments;     // Number of segments the planner looks ahead.
+  float coalesce_tolerance;   // Merge moves deviating less (mm). 0: off.
+  float arc_chord_error;      // Max deviation of arc segments from arc (mm).
 
   std::string home_order;        // Order in which axes are homed.
 
@@ -63,6 +69,14 @@ struct MachineControlConfig {
   bool debug_print;             // Print step-tuples to output_fd if 1.
   bool synchronous;             // Don't queue, wait for command to finish if 1.
   bool enable_pause;            // Enable pause switch detection. Default 0.
+  bool threaded_planner;        // Run planner in its own thread. Default 0.
+  int queue_low_watermark;      // Feed motion queue from event loop if > 0.
+  bool s_curve_acceleration;    // Jerk-limited ramps. Default 0.
+
+  // Real-time setup of the process; threads started later inherit it.
+  int realtime_priority;        // SCHED_FIFO priority if > 0.
+  bool lock_memory;             // mlockall() and prefault stack and heap.
+  int realtime_cpu;             // Run on this CPU if >= 0.
 };
 
 // A class that controls a machine via gcode.
@@ -96,6 +110,16 @@ class GCodeMachineControl {
   // Can only be called in the same thread that also handles gcode updates.
   void GetCurrentPosition(AxesRegister *pos);
 
+  // Snapshot of the machine state for status reports.
+  struct Status {
+    AxesRegister position;   // As GetCurrentPosition()
+    float feedrate;          // Feedrate of G1 moves in mm/s; -1 if none yet.
+    HardwareMapping::AuxBitmap aux_bits;  // Current state of aux outputs.
+    int gcode_line;          // Last line handed to us by the parser.
+  };
+  // Like GetCurrentPosition(), only in the thread handling gcode updates.
+  void GetStatus(Status *status);
+
  private:
   class Impl;
 
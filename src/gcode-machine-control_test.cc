@@ -9,16 +9,24 @@
  */
 #include "gcode-machine-control.h"
 
+#include <math.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
 
 #include <gtest/gtest.h>
 
 #include "gcode-parser/gcode-parser.h"
 #include "common/logging.h"
 
+#include "config-parser.h"
 #include "hardware-mapping.h"
 #include "motor-operations.h"
+#include "spindle-control.h"
 
 #define END_SENTINEL 0x42
 
@@ -35,6 +43,7 @@ static void init_test_config(struct MachineControlConfig *c,
 }
 
 namespace {
+// Expects the given sequence of segments. Without, only collects them.
 class MockMotorOps : public MotorOperations {
 public:
   MockMotorOps(const LinearSegmentSteps *expected)
@@ -43,20 +52,38 @@ public:
   ~MockMotorOps() {
     EXPECT_EQ(0, errors_);
     // Did we walk through all states ?
-    EXPECT_EQ(END_SENTINEL, current_->aux_bits);  // reached end ?
+    if (expect_) EXPECT_EQ(END_SENTINEL, current_->aux_bits);  // reached end ?
   }
 
   void Enqueue(const LinearSegmentSteps &param) final {
-    const int number = (int)(current_ - expect_);
-    EXPECT_NE(END_SENTINEL, current_->aux_bits);
-    ExpectEq(current_, param, number);
-    ++current_;
+    if (expect_) {
+      const int number = (int)(current_ - expect_);
+      EXPECT_NE(END_SENTINEL, current_->aux_bits);
+      ExpectEq(current_, param, number);
+      ++current_;
+    }
+    segments.push_back(param);
+    events += 'E';
+    last_aux_bits = param.aux_bits;
+    for (int i = 0; i < BEAGLEG_NUM_MOTORS; ++i) pos_steps_[i] += param.steps[i];
   }
 
   void MotorEnable(bool on) final {}
-  void WaitQueueEmpty() final {}
-  bool GetPhysicalStatus(PhysicalStatus *status) final { return false; }
-  void SetExternalPosition(int axis, int steps) final { }
+  void WaitQueueEmpty() final { events += 'W'; }
+  void Dwell(float milliseconds) final { events += 'D'; }
+  // Segments are executed as soon as they are enqueued.
+  bool GetPhysicalStatus(PhysicalStatus *status) final {
+    for (int i = 0; i < BEAGLEG_NUM_MOTORS; ++i)
+      status->pos_steps[i] = pos_steps_[i];
+    status->aux_bits = last_aux_bits;
+    return true;
+  }
+  void SetExternalPosition(int axis, int steps) final { pos_steps_[axis] = steps; }
+
+  // In order: 'E'nqueue, 'W'aitQueueEmpty, 'D'well.
+  std::string events;
+  std::vector<LinearSegmentSteps> segments;
+  unsigned short last_aux_bits = 0;
 
 private:
   // Helpers to compare and print MotorMovements.
@@ -85,6 +112,7 @@ private:
   const LinearSegmentSteps *current_;
 
   int errors_;
+  int pos_steps_[BEAGLEG_NUM_MOTORS] = {};
 };
 }
 
@@ -92,13 +120,15 @@ class Harness {
  public:
   // Initialize harness with the expected sequence of motor movements
   // and return the callback struct to receive simulated gcode calls.
-  Harness(const LinearSegmentSteps *expected) : expect_motor_ops_(expected) {
+  Harness(const LinearSegmentSteps *expected, Spindle *spindle = NULL,
+          FILE *msg_stream = NULL)
+    : expect_motor_ops_(expected) {
     struct MachineControlConfig config;
     init_test_config(&config, &hardware_);
     machine_control = GCodeMachineControl::Create(config, &expect_motor_ops_,
                                                   &hardware_,
-                                                  NULL,   // spindle
-                                                  NULL);  // msg-stream
+                                                  spindle,
+                                                  msg_stream);
     assert(machine_control != NULL);
   }
 
@@ -214,6 +244,208 @@ TEST(GCodeMachineControlTest, straight_segments_speed_change) {
   harness.gcode_emit()->motors_enable(false);  // finish movement.
 }
 
+// Moves along a curve don't go faster than the centripetal acceleration
+// allows: with 1000mm/s^2 and a curvature of 0.4/mm, that is 50mm/s.
+TEST(GCodeMachineControlTest, curvature_limits_speed) {
+  static const struct LinearSegmentSteps expected[] = {
+    { /*v0*/    0.0, /*v1*/ 5000.0, 0, /*steps*/ { 125}},  // accel
+    { /*v0*/ 5000.0, /*v1*/ 5000.0, 0, /*steps*/ {9875}},  // @50mm/s
+    { /*v0*/ 5000.0, /*v1*/ 5000.0, 0, /*steps*/ {9875}},
+    { /*v0*/ 5000.0, /*v1*/    0.0, 0, /*steps*/ { 125}},  // decel
+    { 0.0, 0.0, END_SENTINEL, {}},
+  };
+  Harness harness(expected);
+
+  GCodeParser::EventReceiver::Move moves[2] = {};
+  moves[0].feed_mm_p_sec = 100;
+  moves[0].absolute_pos[AXIS_X] = 100;
+  moves[0].curvature = 0.4;
+  moves[1] = moves[0];
+  moves[1].absolute_pos[AXIS_X] = 200;
+  EXPECT_TRUE(harness.gcode_emit()->coordinated_moves(moves, 2));
+
+  harness.gcode_emit()->motors_enable(false);  // finish movement.
+}
+
+static int64_t NowMillis() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Switching on the spindle does not block; the following moves are planned
+// meanwhile, but only sent to the motors once the spindle is up to speed.
+TEST(GCodeMachineControlTest, moves_wait_for_spindle) {
+  static const struct LinearSegmentSteps expected[] = {
+    { /*v0*/     0.0, /*v1*/ 10000.0, 0, /*steps*/ { 500}},
+    { /*v0*/ 10000.0, /*v1*/ 10000.0, 0, /*steps*/ {9500}},
+    { /*v0*/ 10000.0, /*v1*/ 10000.0, 0, /*steps*/ {9500}},
+    { /*v0*/ 10000.0, /*v1*/     0.0, 0, /*steps*/ { 500}},
+    { 0.0, 0.0, END_SENTINEL, {}},
+  };
+  ConfigParser config;
+  config.SetContent("[spindle]\non-delay-msec = 200\n");
+  Spindle spindle;
+  ASSERT_TRUE(spindle.ConfigureFromFile(&config));
+  HardwareMapping spindle_hardware;
+  ASSERT_TRUE(spindle.Init(&spindle_hardware));
+
+  Harness harness(expected, &spindle);
+  GCodeParser parser(GCodeParser::Config(), harness.gcode_emit(), false);
+  harness.gcode_emit()->gcode_start(&parser);
+
+  const int64_t start = NowMillis();
+  parser.ParseLine("M3 S1000", NULL);
+  parser.ParseLine("G1 X100 F6000", NULL);
+  parser.ParseLine("G1 X200", NULL);
+  EXPECT_LT(NowMillis() - start, 100);
+  EXPECT_GT(spindle.Update(), 0);
+
+  harness.gcode_emit()->motors_enable(false);  // finish movement.
+  EXPECT_GE(NowMillis() - start, 200);
+  EXPECT_EQ(0, spindle.Update());
+}
+
+// Changing the speed of the running spindle is done along the path; the
+// motion does not stop for it.
+TEST(GCodeMachineControlTest, spindle_speed_change_does_not_stop) {
+  static const struct LinearSegmentSteps expected[] = {
+    { /*v0*/     0.0, /*v1*/ 10000.0, 0, /*steps*/ { 500}},
+    { /*v0*/ 10000.0, /*v1*/ 10000.0, 0, /*steps*/ {9500}},
+    { /*v0*/ 10000.0, /*v1*/ 10000.0, 0, /*steps*/ {9500}},
+    { /*v0*/ 10000.0, /*v1*/     0.0, 0, /*steps*/ { 500}},
+    { 0.0, 0.0, END_SENTINEL, {}},
+  };
+  ConfigParser config;
+  config.SetContent("[spindle]\n");
+  Spindle spindle;
+  ASSERT_TRUE(spindle.ConfigureFromFile(&config));
+  HardwareMapping spindle_hardware;
+  ASSERT_TRUE(spindle.Init(&spindle_hardware));
+
+  Harness harness(expected, &spindle);
+  GCodeParser parser(GCodeParser::Config(), harness.gcode_emit(), false);
+  harness.gcode_emit()->gcode_start(&parser);
+
+  parser.ParseLine("M3 S1000", NULL);
+  parser.ParseLine("G1 X100 F6000", NULL);
+  parser.ParseLine("M3 S2000", NULL);
+  parser.ParseLine("G1 X200", NULL);
+  harness.gcode_emit()->motors_enable(false);  // finish movement.
+  EXPECT_TRUE(spindle.IsOn(false));
+}
+
+// Moving 100mm in X from standstill with F6000.
+#define MOVE_100MM_SEGMENTS                                 \
+    { /*v0*/     0.0, /*v1*/ 10000.0, 0, /*steps*/ { 500}}, \
+    { /*v0*/ 10000.0, /*v1*/ 10000.0, 0, /*steps*/ {9000}}, \
+    { /*v0*/ 10000.0, /*v1*/     0.0, 0, /*steps*/ { 500}}
+
+// M400 and G4 without time wait until the motion is done.
+TEST(GCodeMachineControlTest, zero_dwell_waits_for_motion) {
+  static const struct LinearSegmentSteps expected[] = {
+    MOVE_100MM_SEGMENTS,
+    { 0.0, 0.0, END_SENTINEL, {}},
+  };
+  for (const char *wait : { "M400", "G4 P0" }) {
+    Harness harness(expected);
+    GCodeParser parser(GCodeParser::Config(), harness.gcode_emit(), false);
+    harness.gcode_emit()->gcode_start(&parser);
+    harness.expect_motor_ops_.events.clear();
+    parser.ParseLine("G1 X100 F6000", NULL);
+    parser.ParseLine(wait, NULL);
+    EXPECT_EQ("EEEW", harness.expect_motor_ops_.events) << wait;
+  }
+}
+
+// A dwell is queued in line; outputs set after it travel with the next
+// move, immediate ones wait until the dwell is over.
+TEST(GCodeMachineControlTest, dwell_before_aux_outputs) {
+  static const struct LinearSegmentSteps expected[] = {
+    MOVE_100MM_SEGMENTS,
+    MOVE_100MM_SEGMENTS,
+    { 0.0, 0.0, END_SENTINEL, {}},
+  };
+  Harness harness(expected);
+  GCodeParser parser(GCodeParser::Config(), harness.gcode_emit(), false);
+  harness.gcode_emit()->gcode_start(&parser);
+  harness.expect_motor_ops_.events.clear();
+  parser.ParseLine("G1 X100 F6000", NULL);
+  parser.ParseLine("G4 P500", NULL);
+  parser.ParseLine("M42 P1 S1", NULL);
+  EXPECT_EQ("EEED", harness.expect_motor_ops_.events);
+  parser.ParseLine("G1 X200", NULL);
+  parser.ParseLine("G4 P500", NULL);
+  EXPECT_EQ("EEEDEEED", harness.expect_motor_ops_.events);
+  EXPECT_EQ(0x1, harness.expect_motor_ops_.last_aux_bits);
+  parser.ParseLine("M64 P2", NULL);
+  EXPECT_EQ("EEEDEEEDW", harness.expect_motor_ops_.events);
+  EXPECT_EQ(1, harness.hardware_.GetAuxBit(2));
+}
+
+// While dwelling, the machine stands at the end of the previous move.
+TEST(GCodeMachineControlTest, dwell_before_position_report) {
+  static const struct LinearSegmentSteps expected[] = {
+    MOVE_100MM_SEGMENTS,
+    { 0.0, 0.0, END_SENTINEL, {}},
+  };
+  char *output = NULL;
+  size_t output_size = 0;
+  FILE *msg_stream = open_memstream(&output, &output_size);
+  {
+    Harness harness(expected, NULL, msg_stream);
+    GCodeParser parser(GCodeParser::Config(), harness.gcode_emit(), false);
+    harness.gcode_emit()->gcode_start(&parser);
+    harness.expect_motor_ops_.events.clear();
+    parser.ParseLine("G1 X100 F6000", NULL);
+    parser.ParseLine("G4 P500", NULL);
+    parser.ParseLine("M114", NULL);
+    EXPECT_EQ("EEED", harness.expect_motor_ops_.events);
+  }
+  fclose(msg_stream);
+  EXPECT_NE(nullptr, strstr(output, "X:100.000 Y:0.000")) << output;
+  free(output);
+}
+
+// Highest speed in mm/s of the axis defining the speed of a segment. Where
+// an arc is parallel to an axis, this is the speed along the path.
+static float MaxAxisSpeed(const std::vector<LinearSegmentSteps> &segments) {
+  float result = 0;
+  for (const LinearSegmentSteps &s : segments)
+    result = std::max(result, std::max(s.v0, s.v1));
+  return result / 100;  // steps/mm in init_test_config()
+}
+
+// The feed in arcs is limited so that the centripetal acceleration stays
+// within that of the axes.
+TEST(GCodeMachineControlTest, arc_feed_capped_by_centripetal_acceleration) {
+  const float kFeed = 500;                          // mm/s; F30000
+  const float kSmallRadius = 10;
+  const float kLimit = sqrtf(1000 * kSmallRadius);  // sqrt(a * r)
+  {
+    Harness harness(NULL);
+    GCodeParser parser(GCodeParser::Config(), harness.gcode_emit(), false);
+    harness.gcode_emit()->gcode_start(&parser);
+    parser.ParseLine("G1 X0 Y0 F30000", NULL);
+    parser.ParseLine("G2 X20 Y0 I10 J0", NULL);
+    harness.gcode_emit()->motors_enable(false);  // finish movement.
+    const float max_speed = MaxAxisSpeed(harness.expect_motor_ops_.segments);
+    EXPECT_LE(max_speed, kLimit * 1.01);
+    EXPECT_GT(max_speed, kLimit * 0.9);
+  }
+  {
+    // sqrt(a * r) is well above the feed.
+    Harness harness(NULL);
+    GCodeParser parser(GCodeParser::Config(), harness.gcode_emit(), false);
+    harness.gcode_emit()->gcode_start(&parser);
+    parser.ParseLine("G1 X0 Y0 F30000", NULL);
+    parser.ParseLine("G2 X2000 Y0 I1000 J0", NULL);
+    harness.gcode_emit()->motors_enable(false);
+    const float max_speed = MaxAxisSpeed(harness.expect_motor_ops_.segments);
+    EXPECT_NEAR(kFeed, max_speed, kFeed * 0.02);
+  }
+}
+
 int main(int argc, char *argv[]) {
   Log_init("/dev/stderr");
   ::testing::InitGoogleTest(&argc, argv);
@@ -0,0 +1,279 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2015 H Hartley Sweeten <hsweeten@visionengravers.com>
+ *    and author who implemented Smoothieware Robot::append_arc()
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _BEAGLEG_GCODE_PARSER_ARC_GEN_H_
+#define _BEAGLEG_GCODE_PARSER_ARC_GEN_H_
+
+// Linearization of arcs and splines into line segments. The segment output
+// is a template parameter, so it is inlined into the generator; it can e.g.
+// fill a buffer of moves for EventReceiver::coordinated_moves().
+//
+// Both choose the length of the segments so that they deviate at most a
+// given chord error from the true curve.
+
+#include <math.h>
+
+#if 0
+#  include "logging.h"
+#endif
+
+#include "gcode-parser.h"
+
+// Arc generation based on smoothieware implementation
+// https://github.com/Smoothieware/Smoothieware.git
+// src/modules/robot/Robot.cpp - Robot::append_arc()
+//
+// The number of segments is chosen so that the chord of each segment
+// deviates at most max_chord_error from the true arc. So large arcs get
+// long segments, small arcs short ones.
+//
+// The radius vector is advanced with a rotation matrix; to not accumulate
+// rounding errors, it is re-calculated exactly every ARC_CORRECTION_INTERVAL
+// segments.
+//
+// Normal axis is the axis perpendicular to the plane the arc is
+// created in.
+#define ARC_CORRECTION_INTERVAL 16
+
+// Largest angle we cover with one segment, even if the chord error would
+// allow more (tiny arcs).
+#define MAX_ARC_SEGMENT_ANGLE   (M_PI / 4)
+
+// Generate an arc. The end point of each line segment is handed to
+// segment_output(const AxesRegister &pos).
+template <typename SegmentOutput>
+void arc_gen(enum GCodeParserAxis normal_axis,  // Normal axis
+             bool is_cw,                        // 0 CCW, 1 CW
+             float max_chord_error,             // mm
+             AxesRegister *position_out,   // start position. Will be updated.
+             const AxesRegister &center,     // Offset to center.
+             const AxesRegister &target,     // Target position.
+             SegmentOutput &segment_output) {
+  // Depending on the normal vector, pre-calc plane
+  enum GCodeParserAxis plane[3];
+  switch (normal_axis) {
+  case AXIS_Z: plane[0] = AXIS_X; plane[1] = AXIS_Y; plane[2] = AXIS_Z; break;
+  case AXIS_X: plane[0] = AXIS_Y; plane[1] = AXIS_Z; plane[2] = AXIS_X; break;
+  case AXIS_Y: plane[0] = AXIS_X; plane[1] = AXIS_Z; plane[2] = AXIS_Y; break;
+  default:
+    return;   // Invalid axis.
+  }
+
+  // Alias reference for readable use with [] operator
+  AxesRegister &position = *position_out;
+  AxesRegister offset;
+  offset[AXIS_X] = center[AXIS_X] - position[AXIS_X];
+  offset[AXIS_Y] = center[AXIS_Y] - position[AXIS_Y];
+  offset[AXIS_Z] = center[AXIS_Z] - position[AXIS_Z];
+  const float radius = sqrtf(offset[plane[0]] * offset[plane[0]] +
+                             offset[plane[1]] * offset[plane[1]]);
+  const float center_0 = position[plane[0]] + offset[plane[0]];
+  const float center_1 = position[plane[1]] + offset[plane[1]];
+  const float linear_travel = target[plane[2]] - position[plane[2]];
+  const float rt_0 = target[plane[0]] - center_0;
+  const float rt_1 = target[plane[1]] - center_1;
+
+  float r_0 = -offset[plane[0]]; // Radius vector from center to current location
+  float r_1 = -offset[plane[1]];
+
+#if 0
+  Log_debug("arc from %c,%c: %.3f,%.3f to %.3f,%.3f (radius:%.3f) helix %c:%.3f\n",
+            gcodep_axis2letter(plane[0]), gcodep_axis2letter(plane[1]),
+            position[plane[0]], position[plane[1]],
+            target[plane[0]], target[plane[1]], radius,
+            gcodep_axis2letter(plane[2]), linear_travel);
+#endif
+
+  // CCW angle between position and target from circle center.
+  float angular_travel = atan2(r_0*rt_1 - r_1*rt_0, r_0*rt_0 + r_1*rt_1);
+  if (is_cw) {
+    if (angular_travel >= 0) angular_travel -= 2*M_PI;
+  } else {
+    if (angular_travel <= 0) angular_travel += 2*M_PI;
+  }
+
+  // Find the distance for this gcode in the axes we care.
+  const float mm_of_travel = hypotf(angular_travel*radius, fabs(linear_travel));
+
+  // We don't care about non-XYZ moves (e.g. extruder)
+  if (mm_of_travel < 0.00001)
+    return;
+
+  // Figure out how many segments for this gcode. The chord of a segment
+  // spanning angle theta deviates radius * (1 - cos(theta/2)) from the arc.
+  float max_theta = MAX_ARC_SEGMENT_ANGLE;
+  if (max_chord_error < radius) {
+    const float theta = 2 * acosf(1 - max_chord_error / radius);
+    if (theta < max_theta) max_theta = theta;
+  }
+  int segments = ceilf(fabsf(angular_travel) / max_theta);
+  if (segments < 1) segments = 1;
+
+  const float theta_per_segment = angular_travel / segments;
+  const float linear_per_segment = linear_travel / segments;
+  const float cos_T = cosf(theta_per_segment);
+  const float sin_T = sinf(theta_per_segment);
+
+  for (int i = 1; i < segments; i++) { // Increment (segments-1)
+    if (i % ARC_CORRECTION_INTERVAL == 0) {
+      const float cos_Ti = cosf(i * theta_per_segment);
+      const float sin_Ti = sinf(i * theta_per_segment);
+      r_0 = -offset[plane[0]] * cos_Ti + offset[plane[1]] * sin_Ti;
+      r_1 = -offset[plane[0]] * sin_Ti - offset[plane[1]] * cos_Ti;
+    } else {
+      const float rotated_0 = r_0 * cos_T - r_1 * sin_T;
+      r_1 = r_0 * sin_T + r_1 * cos_T;
+      r_0 = rotated_0;
+    }
+
+    // Update arc_target location
+    position[plane[0]] = center_0 + r_0;
+    position[plane[1]] = center_1 + r_1;
+    position[plane[2]] += linear_per_segment;
+
+    // Emit
+    segment_output(position);
+  }
+
+  // Ensure last segment arrives at target location.
+  for (int axis = AXIS_X; axis <= AXIS_Z; axis++) {
+    position[(GCodeParserAxis)axis] = target[(GCodeParserAxis)axis];
+  }
+  segment_output(position);
+}
+
+// Point at "t" of the cubic bezier curve in the XY plane. Only X and Y of
+// "p" are set.
+inline void calc_bezier_point(float t,
+                              const AxesRegister &p0,
+                              const AxesRegister &p1,
+                              const AxesRegister &p2,
+                              const AxesRegister &p3,
+                              AxesRegister *p) {
+  const float u = 1.0f - t;
+  const float uu = u * u;
+  const float tt = t * t;
+  const float uuu = uu * u;
+  const float ttt = tt * t;
+
+  (*p)[AXIS_X] = uuu * p0[AXIS_X];               // first term
+  (*p)[AXIS_Y] = uuu * p0[AXIS_Y];
+  (*p)[AXIS_X] += (3.0f * uu * t * p1[AXIS_X]);  // second term
+  (*p)[AXIS_Y] += (3.0f * uu * t * p1[AXIS_Y]);
+  (*p)[AXIS_X] += (3.0f * u * tt * p2[AXIS_X]);  // third term
+  (*p)[AXIS_Y] += (3.0f * u * tt * p2[AXIS_Y]);
+  (*p)[AXIS_X] += (ttt * p3[AXIS_X]);            // forth term
+  (*p)[AXIS_Y] += (ttt * p3[AXIS_Y]);
+}
+
+// Curvature (1/mm) at "t" of the cubic bezier curve in the XY plane.
+// The length of the first derivative, i.e. mm per unit of t, is stored in
+// "speed". Where that is zero, the curve has no defined direction; we
+// report a curvature of zero then.
+inline float calc_bezier_curvature(float t,
+                                   const AxesRegister &p0,
+                                   const AxesRegister &p1,
+                                   const AxesRegister &p2,
+                                   const AxesRegister &p3,
+                                   float *speed) {
+  const float u = 1.0f - t;
+  float d1[2], d2[2];   // First and second derivative.
+  for (int i = 0; i < 2; ++i) {
+    const GCodeParserAxis a = (GCodeParserAxis) (AXIS_X + i);
+    d1[i] = 3.0f * (u * u * (p1[a] - p0[a]) + 2.0f * u * t * (p2[a] - p1[a])
+                    + t * t * (p3[a] - p2[a]));
+    d2[i] = 6.0f * (u * (p2[a] - 2.0f * p1[a] + p0[a])
+                    + t * (p3[a] - 2.0f * p2[a] + p1[a]));
+  }
+  *speed = hypotf(d1[0], d1[1]);
+  if (*speed < 1e-6f) return 0;
+  return fabsf(d1[0] * d2[1] - d1[1] * d2[0]) / (*speed * *speed * *speed);
+}
+
+// Largest and smallest fraction of the curve covered by one spline
+// segment. The upper bound keeps the shape even if the curvature looks
+// small at the points we probe.
+#define MAX_SPLINE_SEGMENT_T  0.125f
+#define MIN_SPLINE_SEGMENT_T  0.001f
+
+// Generate a cubic spline in the XY plane, handing the end point of each line
+// segment to segment_output(const AxesRegister &pos, float curvature), with
+// the highest curvature (1/mm) at the ends of the segment. That allows to
+// limit the speed to what the centripetal acceleration permits. The other
+// axes keep their start values until the target.
+//
+// On a curve with curvature k, a chord of length s deviates about
+// k * s^2 / 8 from it, so where the curve bends tightly, segments get short;
+// nearly straight stretches get long ones.
+template <typename SegmentOutput>
+void spline_gen(const AxesRegister &start,
+                const AxesRegister &cp1,
+                const AxesRegister &cp2,
+                const AxesRegister &target,
+                float max_chord_error,      // mm
+                SegmentOutput &segment_output) {
+#if 0
+  Log_debug("spline_gen: start:%.3f,%.3f cp1:%.3f,%.3f cp2:%.3f,%.3f end:%.3f,%.3f\n",
+            start[AXIS_X], start[AXIS_Y],
+            cp1[AXIS_X], cp1[AXIS_Y],
+            cp2[AXIS_X], cp2[AXIS_Y],
+            target[AXIS_X], target[AXIS_Y]);
+#endif
+
+  // Step in t at a place with the given curvature and speed.
+  auto step_at = [max_chord_error](float curvature, float speed) {
+    if (curvature <= 0 || speed <= 0) return MAX_SPLINE_SEGMENT_T;
+    const float dt = sqrtf(8 * max_chord_error / curvature) / speed;
+    if (dt > MAX_SPLINE_SEGMENT_T) return MAX_SPLINE_SEGMENT_T;
+    if (dt < MIN_SPLINE_SEGMENT_T) return MIN_SPLINE_SEGMENT_T;
+    return dt;
+  };
+
+  AxesRegister point = start;
+  float speed;
+  float curvature = calc_bezier_curvature(0, start, cp1, cp2, target, &speed);
+  float t = 0;
+  while (t < 1) {
+    // If the curve bends more tightly ahead, take the shorter step.
+    float dt = step_at(curvature, speed);
+    float ahead_speed;
+    const float ahead_curvature
+      = calc_bezier_curvature(t + dt < 1 ? t + dt : 1,
+                              start, cp1, cp2, target, &ahead_speed);
+    const float ahead_dt = step_at(ahead_curvature, ahead_speed);
+    if (ahead_dt < dt) dt = ahead_dt;
+
+    float next_t = t + dt;
+    if (next_t > 1 - MIN_SPLINE_SEGMENT_T) next_t = 1;
+    const float next_curvature
+      = calc_bezier_curvature(next_t, start, cp1, cp2, target, &speed);
+    const float segment_curvature
+      = (next_curvature > curvature) ? next_curvature : curvature;
+    if (next_t < 1) {
+      calc_bezier_point(next_t, start, cp1, cp2, target, &point);
+      segment_output(point, segment_curvature);
+    } else {
+      segment_output(target, segment_curvature);
+    }
+    t = next_t;
+    curvature = next_curvature;
+  }
+}
+
+#endif  // _BEAGLEG_GCODE_PARSER_ARC_GEN_H_
@@ -17,9 +17,12 @@
  * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include "gcode-parser.h"
+#include "arc-gen.h"
 
 #include <math.h>
+#include <algorithm>
 #include <iostream>
+#include <vector>
 #include <gtest/gtest.h>
 
 // Going around the circle for start-points with this step.
@@ -186,6 +189,249 @@ TEST(ArcGenerator, FullTurn_CCW) {
   testFullTurn(false);
 }
 
+// Records how far the segment midpoints and end points are off the circle
+// around the origin.
+class ChordErrorCollector : public GCodeParser::EventReceiver {
+public:
+  ChordErrorCollector(const AxesRegister &start, float radius, float error)
+    : last_(start), radius_(radius),
+      allowed_error_(error), max_error_(0), segments_(0) {}
+
+  void gcode_start(GCodeParser *parser) final {}
+  void go_home(AxisBitmap_t axis_bitmap) final {}
+  void set_speed_factor(float factor) final {}
+  void set_fanspeed(float value) final {}
+  void set_temperature(float degrees_c) final {}
+  void wait_temperature() final {}
+  void dwell(float time_ms) final {}
+  void motors_enable(bool enable) final {}
+  bool rapid_move(float feed_mm_p_sec,
+                  const AxesRegister &absolute_pos) final { return true; }
+  const char *unprocessed(char letter, float value,
+                                  const char *rest_of_line) final {
+    return nullptr;
+  }
+
+  bool coordinated_move(float feed, const AxesRegister &pos) final {
+    const float mid_x = (pos[AXIS_X] + last_[AXIS_X]) / 2;
+    const float mid_y = (pos[AXIS_Y] + last_[AXIS_Y]) / 2;
+    record(radius_ - hypotf(mid_x, mid_y));
+    record(radius_ - hypotf(pos[AXIS_X], pos[AXIS_Y]));
+    last_ = pos;
+    ++segments_;
+    return true;
+  }
+  float arc_max_chord_error() final { return allowed_error_; }
+
+  float max_error() const { return max_error_; }
+  int segments() const { return segments_; }
+
+private:
+  void record(float err) { if (fabsf(err) > max_error_) max_error_ = fabsf(err); }
+
+  AxesRegister last_;
+  const float radius_;
+  const float allowed_error_;
+  float max_error_;
+  int segments_;
+};
+
+static int testChordError(float radius, float allowed_error) {
+  AxesRegister start, center, target;
+  start[AXIS_X] = radius;
+  target[AXIS_X] = -radius;
+  ChordErrorCollector collect(start, radius, allowed_error);
+  collect.arc_move(100, AXIS_Z, false, start, center, target);
+  EXPECT_LE(collect.max_error(), allowed_error * 1.01 + radius * 1e-6)
+    << "radius " << radius;
+  return collect.segments();
+}
+
+TEST(ArcGenerator, SegmentsAdaptToChordError) {
+  // A large arc needs relatively fewer segments than a small one.
+  const int small_arc = testChordError(1, 0.001);
+  const int large_arc = testChordError(100, 0.001);
+  EXPECT_LT(large_arc, 100 * small_arc / 5);
+  EXPECT_LT(large_arc, 100 * M_PI / 0.1);  // Less than fixed 0.1mm pieces.
+
+  // Tighter tolerance results in more segments.
+  EXPECT_GT(testChordError(100, 0.0001), large_arc);
+}
+
+// Receiver that handles batches; records their sizes.
+class BatchCollector : public ChordErrorCollector {
+public:
+  BatchCollector(const AxesRegister &start, float radius)
+    : ChordErrorCollector(start, radius, 0.0001) {}
+
+  bool coordinated_moves(const Move *moves, int count) final {
+    batch_sizes.push_back(count);
+    return EventReceiver::coordinated_moves(moves, count);  // Delegate.
+  }
+
+  std::vector<int> batch_sizes;
+};
+
+TEST(ArcGenerator, SegmentsAreEmittedInBatches) {
+  const float radius = 100;
+  AxesRegister start, center, target;
+  start[AXIS_X] = radius;
+  target[AXIS_X] = -radius;
+  BatchCollector collect(start, radius);
+  collect.arc_move(100, AXIS_Z, false, start, center, target);
+  ASSERT_GT(collect.batch_sizes.size(), 1u);
+  int total = 0;
+  for (int size : collect.batch_sizes) {
+    EXPECT_GT(size, 0);
+    EXPECT_LE(size, GCodeParser::EventReceiver::MAX_MOVE_BATCH);
+    total += size;
+  }
+  EXPECT_EQ(total, collect.segments());  // Default passes all on.
+}
+
+// The generators can be used directly, e.g. to fill a buffer; they emit the
+// same segments as the default arc_move() and spline_move().
+class SegmentRecorder : public TestArcAccumulator {
+public:
+  SegmentRecorder() : TestArcAccumulator(AxesRegister()) {}
+  bool coordinated_moves(const Move *moves, int count) final {
+    for (int i = 0; i < count; ++i) segments.push_back(moves[i].absolute_pos);
+    return true;
+  }
+  std::vector<AxesRegister> segments;
+};
+
+TEST(ArcGenerator, GeneratorsIntoBuffer) {
+  AxesRegister start, center, target;
+  start[AXIS_X] = 10;
+  start[AXIS_Z] = 1;
+  target[AXIS_X] = -10;
+  target[AXIS_Z] = 3;
+
+  struct Buffer {
+    void operator()(const AxesRegister &pos, float curvature = 0) {
+      segments.push_back(pos);
+    }
+    std::vector<AxesRegister> segments;
+  } buffer;
+  AxesRegister position = start;
+  arc_gen(AXIS_Z, true, 0.001, &position, center, target, buffer);
+  SegmentRecorder receiver;
+  receiver.arc_move(100, AXIS_Z, true, start, center, target);
+  ASSERT_EQ(receiver.segments.size(), buffer.segments.size());
+  for (size_t i = 0; i < buffer.segments.size(); ++i) {
+    for (GCodeParserAxis axis : AllAxes()) {
+      EXPECT_EQ(receiver.segments[i][axis], buffer.segments[i][axis]);
+    }
+  }
+  EXPECT_EQ(target[AXIS_Z], position[AXIS_Z]);
+
+  AxesRegister cp1, cp2;
+  cp1[AXIS_Y] = 5;
+  cp2[AXIS_X] = -10;
+  cp2[AXIS_Y] = 5;
+  buffer.segments.clear();
+  spline_gen(start, cp1, cp2, target, 0.001, buffer);
+  receiver.segments.clear();
+  receiver.spline_move(100, start, cp1, cp2, target);
+  ASSERT_EQ(receiver.segments.size(), buffer.segments.size());
+  for (size_t i = 0; i < buffer.segments.size(); ++i) {
+    EXPECT_EQ(receiver.segments[i][AXIS_X], buffer.segments[i][AXIS_X]);
+    EXPECT_EQ(receiver.segments[i][AXIS_Y], buffer.segments[i][AXIS_Y]);
+  }
+  EXPECT_EQ(start[AXIS_Z], buffer.segments.front()[AXIS_Z]);
+  EXPECT_EQ(target[AXIS_Z], buffer.segments.back()[AXIS_Z]);
+}
+
+// Collects the segments of a spline and their curvature.
+struct SplineSegments {
+  void operator()(const AxesRegister &pos, float curvature) {
+    points.push_back(pos);
+    curvatures.push_back(curvature);
+  }
+  std::vector<AxesRegister> points;
+  std::vector<float> curvatures;
+};
+
+static float PolylineLength(const AxesRegister &start,
+                            const std::vector<AxesRegister> &polyline) {
+  float len = 0;
+  AxesRegister from = start;
+  for (const AxesRegister &to : polyline) {
+    len += hypotf(to[AXIS_X] - from[AXIS_X], to[AXIS_Y] - from[AXIS_Y]);
+    from = to;
+  }
+  return len;
+}
+
+// Largest distance of the spline from the polyline approximating it.
+static float SplineChordError(const AxesRegister &p0, const AxesRegister &p1,
+                              const AxesRegister &p2, const AxesRegister &p3,
+                              const std::vector<AxesRegister> &polyline) {
+  float max_error = 0;
+  AxesRegister curve;
+  for (int i = 0; i <= 2000; ++i) {
+    calc_bezier_point(i / 2000.0f, p0, p1, p2, p3, &curve);
+    float closest = 1e9;
+    AxesRegister from = p0;
+    for (const AxesRegister &to : polyline) {
+      const float dx = to[AXIS_X] - from[AXIS_X];
+      const float dy = to[AXIS_Y] - from[AXIS_Y];
+      const float len2 = dx * dx + dy * dy;
+      float t = 0;
+      if (len2 > 0) {
+        t = ((curve[AXIS_X] - from[AXIS_X]) * dx
+             + (curve[AXIS_Y] - from[AXIS_Y]) * dy) / len2;
+        t = std::max(0.0f, std::min(1.0f, t));
+      }
+      const float dist = hypotf(from[AXIS_X] + t * dx - curve[AXIS_X],
+                                from[AXIS_Y] + t * dy - curve[AXIS_Y]);
+      closest = std::min(closest, dist);
+      from = to;
+    }
+    max_error = std::max(max_error, closest);
+  }
+  return max_error;
+}
+
+TEST(ArcGenerator, SplineSegmentsAdaptToCurvature) {
+  AxesRegister start, cp1, cp2, target;
+  // A gentle, long S-curve.
+  cp1[AXIS_X] = 50;  cp1[AXIS_Y] = 10;
+  cp2[AXIS_X] = 50;  cp2[AXIS_Y] = -10;
+  target[AXIS_X] = 100;
+  SplineSegments gentle;
+  spline_gen(start, cp1, cp2, target, 0.01, gentle);
+  EXPECT_LE(SplineChordError(start, cp1, cp2, target, gentle.points), 0.015);
+  EXPECT_EQ(target[AXIS_X], gentle.points.back()[AXIS_X]);
+  EXPECT_LT(gentle.points.size(), 50u);
+
+  // A tight loop needs much shorter segments, and they report the higher
+  // curvature.
+  SplineSegments tight;
+  AxesRegister tight_cp1, tight_cp2, tight_target;
+  tight_cp1[AXIS_X] = 10;   tight_cp1[AXIS_Y] = 10;
+  tight_cp2[AXIS_X] = -10;  tight_cp2[AXIS_Y] = 10;
+  tight_target[AXIS_X] = 1;
+  spline_gen(start, tight_cp1, tight_cp2, tight_target, 0.01, tight);
+  EXPECT_LE(SplineChordError(start, tight_cp1, tight_cp2, tight_target,
+                             tight.points), 0.015);
+  EXPECT_LT(PolylineLength(start, tight.points) / tight.points.size(),
+            PolylineLength(start, gentle.points) / gentle.points.size() / 2);
+  EXPECT_GT(*std::max_element(tight.curvatures.begin(), tight.curvatures.end()),
+            10 * *std::max_element(gentle.curvatures.begin(),
+                                   gentle.curvatures.end()));
+
+  // Straight lines are not cut into many pieces and have no curvature.
+  SplineSegments straight;
+  AxesRegister straight_cp1, straight_cp2;
+  straight_cp1[AXIS_X] = 30;
+  straight_cp2[AXIS_X] = 70;
+  spline_gen(start, straight_cp1, straight_cp2, target, 0.01, straight);
+  EXPECT_LE(straight.points.size(), 1 / MAX_SPLINE_SEGMENT_T + 1);
+  for (float c : straight.curvatures) EXPECT_EQ(0, c);
+}
+
 int main(int argc, char *argv[]) {
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
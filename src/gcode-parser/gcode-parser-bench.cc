@@ -0,0 +1,267 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Throughput of GCodeParser::ParseLine() with an event receiver that does
+// nothing. Runs over a synthetic corpus, which is the same on every run, and
+// over the files given on the command line.
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <string>
+#include <vector>
+
+#include "common/string-util.h"
+#include "gcode-parser/gcode-parser.h"
+
+namespace {
+class NullReceiver : public GCodeParser::EventReceiver {
+public:
+  void gcode_start(GCodeParser *parser) final {}
+  void go_home(AxisBitmap_t axis_bitmap) final {}
+  bool probe_axis(float feed_mm_p_sec, enum GCodeParserAxis axis,
+                  float *probed_position) final {
+    *probed_position = 0;
+    return true;
+  }
+  void set_speed_factor(float factor) final {}
+  void set_fanspeed(float value) final {}
+  void set_temperature(float degrees_c) final {}
+  void wait_temperature() final {}
+  void dwell(float time_ms) final {}
+  void motors_enable(bool enable) final {}
+  bool coordinated_move(float feed_mm_p_sec, const AxesRegister &) final {
+    return true;
+  }
+  bool rapid_move(float feed_mm_p_sec, const AxesRegister &) final {
+    return true;
+  }
+  void arc_move(float feed_mm_p_sec, GCodeParserAxis normal_axis,
+                bool clockwise, const AxesRegister &start,
+                const AxesRegister &center, const AxesRegister &end) final {}
+  void spline_move(float feed_mm_p_sec, const AxesRegister &start,
+                   const AxesRegister &cp1, const AxesRegister &cp2,
+                   const AxesRegister &end) final {}
+  const char *unprocessed(char letter, float value, const char *) final {
+    return NULL;
+  }
+};
+
+struct Corpus {
+  std::string name;
+  std::vector<std::string> lines;
+};
+
+// Simple linear congruential generator, so that the corpus does not depend
+// on the libc in use.
+class Random {
+public:
+  Random() : state_(42) {}
+  int Next(int range) {
+    state_ = state_ * 1103515245 + 12345;
+    return (state_ >> 16) % range;
+  }
+  float NextCoordinate() { return Next(200000) / 1000.0f; }
+
+private:
+  uint32_t state_;
+};
+
+static const int kSyntheticLines = 100000;
+
+Corpus DenseMoves() {
+  Corpus c = { "synthetic-g1-moves", {} };
+  Random rnd;
+  for (int i = 0; i < kSyntheticLines; ++i) {
+    c.lines.push_back(StringPrintf("G1 X%.3f Y%.3f Z%.3f F%d",
+                                   rnd.NextCoordinate(), rnd.NextCoordinate(),
+                                   rnd.NextCoordinate(), 1000 + rnd.Next(3000)));
+  }
+  return c;
+}
+
+Corpus Expressions() {
+  Corpus c = { "synthetic-expressions", {} };
+  Random rnd;
+  c.lines.push_back("#1=0");
+  c.lines.push_back("#<radius>=12.5");
+  for (int i = 0; i < kSyntheticLines; ++i) {
+    switch (i % 3) {
+    case 0:
+      c.lines.push_back(StringPrintf("#1=[#1 + %d] * 0.5", rnd.Next(100)));
+      break;
+    case 1:
+      c.lines.push_back(StringPrintf("#2=SIN[#1] * #<radius> + %.2f",
+                                     rnd.NextCoordinate()));
+      break;
+    case 2:
+      c.lines.push_back("G1 X[#2 + 1] Y[COS[#1] * #<radius>] F[1000 + #1]");
+      break;
+    }
+  }
+  return c;
+}
+
+Corpus WhileLoops() {
+  Corpus c = { "synthetic-while-loops", {} };
+  for (int i = 0; i < kSyntheticLines / 100; ++i) {
+    c.lines.push_back("#1=0");
+    c.lines.push_back("WHILE [#1 < 30] DO");
+    c.lines.push_back("G1 X[#1] Y[#1 * 2] F1000");
+    c.lines.push_back("#1++");
+    c.lines.push_back("END");
+  }
+  return c;
+}
+
+Corpus Arcs() {
+  Corpus c = { "synthetic-arcs", {} };
+  Random rnd;
+  for (int i = 0; i < kSyntheticLines; ++i) {
+    c.lines.push_back(StringPrintf("G%d X%.3f Y%.3f I%.3f J%.3f F2000",
+                                   2 + i % 2,
+                                   rnd.NextCoordinate(), rnd.NextCoordinate(),
+                                   rnd.NextCoordinate(), rnd.NextCoordinate()));
+  }
+  return c;
+}
+
+Corpus Comments() {
+  Corpus c = { "synthetic-comments", {} };
+  Random rnd;
+  for (int i = 0; i < kSyntheticLines; ++i) {
+    if (i % 2) {
+      c.lines.push_back(StringPrintf("(move %d to the next position) G1 X%.3f"
+                                     " ; and a trailing comment", i,
+                                     rnd.NextCoordinate()));
+    } else {
+      c.lines.push_back("; a line with just a comment on it");
+    }
+  }
+  return c;
+}
+
+bool ReadFileCorpus(const char *filename, Corpus *corpus) {
+  FILE *f = fopen(filename, "r");
+  if (f == NULL) {
+    perror(filename);
+    return false;
+  }
+  corpus->name = filename;
+  char buffer[8192];
+  while (fgets(buffer, sizeof(buffer), f)) {
+    corpus->lines.push_back(buffer);
+  }
+  fclose(f);
+  return true;
+}
+
+double now_seconds() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+struct Result {
+  uint64_t lines;
+  double seconds;
+};
+
+// Parse the corpus repeatedly with a fresh parser until at least
+// "min_seconds" have passed.
+Result RunCorpus(const Corpus &corpus, double min_seconds, FILE *msg_out) {
+  Result result = { 0, 0 };
+  NullReceiver receiver;
+  do {
+    GCodeParser::Config::ParamMap params;
+    GCodeParser::Config config;
+    config.parameters = &params;
+    GCodeParser parser(config, &receiver, false);
+    const double start = now_seconds();
+    for (const std::string &line : corpus.lines) {
+      parser.ParseLine(line.c_str(), msg_out);
+    }
+    result.seconds += now_seconds() - start;
+    result.lines += corpus.lines.size();
+  } while (result.seconds < min_seconds);
+  return result;
+}
+
+int usage(const char *progname) {
+  fprintf(stderr, "Usage: %s [options] [<gcode-file>...]\n"
+          "Options:\n"
+          "  -j         : Output as JSON.\n"
+          "  -t <secs>  : Minimum time to run each corpus (Default: 1).\n"
+          "  -S         : Skip synthetic corpus.\n", progname);
+  return 1;
+}
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  bool json = false;
+  bool synthetic = true;
+  double min_seconds = 1.0;
+  int opt;
+  while ((opt = getopt(argc, argv, "jt:S")) != -1) {
+    switch (opt) {
+    case 'j': json = true; break;
+    case 't': min_seconds = atof(optarg); break;
+    case 'S': synthetic = false; break;
+    default: return usage(argv[0]);
+    }
+  }
+
+  std::vector<Corpus> corpora;
+  if (synthetic) {
+    corpora.push_back(DenseMoves());
+    corpora.push_back(Expressions());
+    corpora.push_back(WhileLoops());
+    corpora.push_back(Arcs());
+    corpora.push_back(Comments());
+  }
+  for (int i = optind; i < argc; ++i) {
+    Corpus corpus;
+    if (!ReadFileCorpus(argv[i], &corpus))
+      return 1;
+    corpora.push_back(corpus);
+  }
+
+  // Parser messages, such as the info after each WHILE loop, are not timed.
+  FILE *msg_out = fopen("/dev/null", "w");
+  if (json) printf("[\n");
+  for (size_t i = 0; i < corpora.size(); ++i) {
+    const Result r = RunCorpus(corpora[i], min_seconds, msg_out);
+    const double lines_per_sec = r.lines / r.seconds;
+    const double ns_per_line = 1e9 * r.seconds / r.lines;
+    if (json) {
+      printf("  {\"corpus\":\"%s\", \"lines\":%llu, \"lines_per_sec\":%.0f, "
+             "\"ns_per_line\":%.1f}%s\n", corpora[i].name.c_str(),
+             (unsigned long long) r.lines, lines_per_sec, ns_per_line,
+             i + 1 < corpora.size() ? "," : "");
+    } else {
+      printf("%-40s %12.0f lines/s %10.1f ns/line\n", corpora[i].name.c_str(),
+             lines_per_sec, ns_per_line);
+    }
+  }
+  if (json) printf("]\n");
+  fclose(msg_out);
+  return 0;
+}
@@ -19,55 +19,203 @@
 
 #include "gcode-parser.h"
 
+#include <fcntl.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <stdio.h>
+#include <string.h>
+
+#include <string>
+#include <utility>
+#include <vector>
 
 #include "common/logging.h"
 
-bool GCodeParser::Config::LoadParams() {
-  if (paramfile.empty())
-    return false;
-  if (parameters == NULL) {
-    Log_error("No parameters to load into.");
-    return false;
-  }
+// After this many journaled changes, the parameter file is rewritten.
+#define PARAM_JOURNAL_COMPACT_ENTRIES 256
 
-  (*parameters)["5220"] = 1.0f;  // Only non-zero default.
+// What we know to be in the parameter file and its journal.
+struct GCodeParser::Config::Persisted {
+  Persisted() : known(false), journal_entries(0) {}
 
-  FILE *fp = fopen(paramfile.c_str(), "r");
-  if (!fp) {
-    Log_error("Unable to read param file %s (%s)",
-              paramfile.c_str(), strerror(errno));
-    return false;
+  bool known;                          // Loaded or saved before.
+  std::map<std::string, float> values;
+  int journal_entries;
+};
+
+namespace {
+// Parameters that are persisted by name, in the order they are written to
+// the parameter file: the numeric ones in numerical order, then the global
+// named ones. Includes the ones that are zero.
+typedef std::vector<std::pair<std::string, float> > ParamList;
+}
+
+static void CollectPersistentParams(const GCodeParser::Config::ParamMap &params,
+                                    ParamList *out) {
+  // Numbers beyond the range of the numbered parameters end up as names,
+  // sorted alphanumerically, which is not the same as numerically. So we
+  // simply copy all of them to a temporary structure that sorts them
+  // numerically.
+  std::map<int, float> numeric_params;
+  for (int i = 0; i < GCodeParser::Config::ParamMap::kNumberedParams; ++i) {
+    float value;
+    if (params.Lookup(i, &value))
+      numeric_params[i] = value;
   }
+  for (const auto &name_value : params.named()) {
+    if (!isdigit(name_value.first[0]))
+      break;
+    numeric_params[atoi(name_value.first.c_str())] = name_value.second;
+  }
+  for (const auto num_value : numeric_params) {
+    if (num_value.first == 0)
+      continue;  // Never write this parameter. It should always be zero
+    char name[16];
+    snprintf(name, sizeof(name), "%i", num_value.first);
+    out->push_back(std::make_pair(name, num_value.second));
+  }
+  for (const auto &name_value : params.named()) {
+    if (isdigit(name_value.first[0])) continue;  // Numeric: already there.
+    if (name_value.first[0] != '_') continue;    // Only write global parameters
+    out->push_back(name_value);
+  }
+}
 
+// Read "name value" lines into "params". If "complete_lines_only", a line
+// without newline at the end of the file - from an interrupted append - is
+// ignored. Returns number of parameters read.
+static int ReadParamLines(FILE *fp, bool complete_lines_only,
+                          GCodeParser::Config::ParamMap *params) {
   int pcount = 0;
   char line[256];
   while (fgets(line, sizeof(line), fp)) {
+    if (complete_lines_only && line[strlen(line) - 1] != '\n')
+      break;
     char name[256];
     float value;
     if (sscanf(line, "%s %f", name, &value) == 2) {
       // Technically, we should ignore parameters which are not coming in
       // order according to RS274NGC. But that sounds like a non-userfriendly
       // restriction.
-      (*parameters)[name] = value;
+      (*params)[name] = value;
       ++pcount;
     }
   }
-  Log_debug("Loaded %d parameters from %s", pcount, paramfile.c_str());
-  fclose(fp);
+  return pcount;
+}
+
+static std::string JournalFilename(const std::string &paramfile) {
+  return paramfile + ".journal";
+}
+
+GCodeParser::Config::Config(const std::string &filename)
+  : parameters(NULL), paramfile(filename), persisted_(new Persisted()) {}
+
+GCodeParser::Config::ParamMap::ParamMap() {
+  for (int i = 0; i < kNumberedParams; ++i) {
+    numbered_[i] = 0.0f;
+    is_set_[i] = false;
+  }
+}
+
+int GCodeParser::Config::ParamMap::NumberFromName(const std::string &name) {
+  if (name.empty() || name.length() > 4)
+    return -1;
+  int result = 0;
+  for (const char c : name) {
+    if (c < '0' || c > '9') return -1;
+    result = 10 * result + (c - '0');
+  }
+  return result < kNumberedParams ? result : -1;
+}
+
+float &GCodeParser::Config::ParamMap::operator[](const std::string &name) {
+  const int number = NumberFromName(name);
+  if (number >= 0)
+    return (*this)[number];
+  return named_[name];
+}
+
+bool GCodeParser::Config::ParamMap::Lookup(int number, float *value) const {
+  *value = numbered_[number];
+  return is_set_[number];
+}
+
+bool GCodeParser::Config::ParamMap::Lookup(const std::string &name,
+                                           float *value) const {
+  const int number = NumberFromName(name);
+  if (number >= 0)
+    return Lookup(number, value);
+  NamedMap::const_iterator found = named_.find(name);
+  if (found == named_.end()) {
+    *value = 0;
+    return false;
+  }
+  *value = found->second;
   return true;
 }
 
-bool GCodeParser::Config::SaveParams() const {
+bool GCodeParser::Config::LoadParams() {
   if (paramfile.empty())
     return false;
   if (parameters == NULL) {
-    Log_error("No parameters to save.");
+    Log_error("No parameters to load into.");
     return false;
   }
 
+  (*parameters)["5220"] = 1.0f;  // Only non-zero default.
+
+  FILE *fp = fopen(paramfile.c_str(), "r");
+  if (!fp) {
+    Log_error("Unable to read param file %s (%s)",
+              paramfile.c_str(), strerror(errno));
+    return false;
+  }
+  const int pcount = ReadParamLines(fp, false, parameters);
+  fclose(fp);
+
+  // Changes since the parameter file was written.
+  int journal_entries = 0;
+  const std::string journal = JournalFilename(paramfile);
+  fp = fopen(journal.c_str(), "r");
+  if (fp) {
+    journal_entries = ReadParamLines(fp, true, parameters);
+    fclose(fp);
+  }
+  Log_debug("Loaded %d parameters from %s and %d changes from journal",
+            pcount, paramfile.c_str(), journal_entries);
+
+  ParamList persistent;
+  CollectPersistentParams(*parameters, &persistent);
+  persisted_->values.clear();
+  persisted_->values.insert(persistent.begin(), persistent.end());
+  persisted_->journal_entries = journal_entries;
+  persisted_->known = true;
+  return true;
+}
+
+// Append the changes to the journal with a single write.
+static bool AppendJournal(const std::string &journal, const ParamList &changes) {
+  std::string content;
+  for (const auto &name_value : changes) {
+    char line[256];
+    snprintf(line, sizeof(line), "%s\t%f\n",
+             name_value.first.c_str(), name_value.second);
+    content += line;
+  }
+  const int fd = open(journal.c_str(), O_WRONLY|O_APPEND|O_CREAT, 0644);
+  if (fd < 0)
+    return false;
+  const bool success =
+    write(fd, content.data(), content.size()) == (ssize_t)content.size()
+    && fdatasync(fd) == 0;
+  return close(fd) == 0 && success;
+}
+
+// Write all non-zero parameters to a new parameter file that replaces the
+// old one when complete.
+static bool WriteParamFile(const std::string &paramfile,
+                           const ParamList &persistent) {
   const std::string tmp_name = paramfile + ".tmp";
   // create new param file
   FILE *fp = fopen(tmp_name.c_str(), "w");
@@ -84,37 +232,15 @@ bool GCodeParser::Config::SaveParams() const {
     return false;
   }
 
+  // The numeric parameters need to be stored in numerical order, followed
+  // by all the alphanumeric fields.
   int pcount = 0;
-  // We have to go through the list twice. The numeric parameters need to be
-  // stored in numerical order, followed by all the alphanumeric fields.
-  //
-  // Given that we are using a string-key in the map, the numeric fields are
-  // sorted alphanumerically, which is not the same as numerically. So we
-  // simply copy them to a temporary structure that sorts them numerically.
-  std::map<int, float> numeric_params;
-  for (const auto name_value : *parameters) {
-    if (!isdigit(name_value.first[0]))
-      break;
-    numeric_params[atoi(name_value.first.c_str())] = name_value.second;
-  }
-
-  for (const auto num_value : numeric_params) {
-    if (num_value.first == 0)
-      continue;  // Never write this parameter. It should always be zero
-    if (num_value.second != 0) {
-      fprintf(fp, "%i\t%f\n", num_value.first, num_value.second);
-      ++pcount;
-    }
-  }
-
-  // Now, all the non-numeric parmeters
-  int start_alpha = pcount;
-  for (const auto name_value : *parameters) {
-    if (isdigit(name_value.first[0])) continue;  // Numeric: already written
-    if (name_value.first[0] != '_') continue;    // Only write global parameters
+  bool alpha_started = false;
+  for (const auto &name_value : persistent) {
     if (name_value.second == 0) continue;        // Don't write boring zeroes.
-    if (pcount == start_alpha) {
+    if (!isdigit(name_value.first[0]) && !alpha_started) {
       fprintf(fp, "\n# Alphanumeric global parameters\n");
+      alpha_started = true;
     }
     fprintf(fp, "%s\t%f\n", name_value.first.c_str(), name_value.second);
     ++pcount;
@@ -130,3 +256,53 @@ bool GCodeParser::Config::SaveParams() const {
             strerror(errno));
   return false;
 }
+
+bool GCodeParser::Config::SaveParams() const {
+  if (paramfile.empty())
+    return false;
+  if (parameters == NULL) {
+    Log_error("No parameters to save.");
+    return false;
+  }
+
+  ParamList persistent;
+  CollectPersistentParams(*parameters, &persistent);
+  ParamList changes;
+  for (const auto &name_value : persistent) {
+    const auto found = persisted_->values.find(name_value.first);
+    const float before = (found == persisted_->values.end()) ? 0 : found->second;
+    if (!persisted_->known || before != name_value.second)
+      changes.push_back(name_value);
+  }
+  if (persisted_->known && changes.empty())
+    return true;
+
+  // The journal always gets the changes first: replaying it on top of the
+  // new parameter file does no harm if we're interrupted before it is
+  // removed. If we don't know what is in there, it is only relevant if
+  // it exists.
+  const std::string journal = JournalFilename(paramfile);
+  bool rewrite = !persisted_->known
+    || persisted_->journal_entries + (int)changes.size()
+    >= PARAM_JOURNAL_COMPACT_ENTRIES;
+  if (persisted_->known || access(journal.c_str(), F_OK) == 0) {
+    if (AppendJournal(journal, changes)) {
+      persisted_->journal_entries += changes.size();
+    } else {
+      Log_error("Trouble appending to parameter journal %s (%s)",
+                journal.c_str(), strerror(errno));
+      rewrite = true;
+    }
+  }
+
+  if (rewrite) {
+    if (!WriteParamFile(paramfile, persistent))
+      return false;
+    unlink(journal.c_str());
+    persisted_->journal_entries = 0;
+  }
+  persisted_->values.clear();
+  persisted_->values.insert(persistent.begin(), persistent.end());
+  persisted_->known = true;
+  return true;
+}
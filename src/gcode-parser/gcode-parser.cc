@@ -29,6 +29,7 @@
 #include <ctype.h>
 #include <errno.h>
 #include <math.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
@@ -36,14 +37,27 @@
 #include <string.h>
 #include <strings.h>
 #include <sys/select.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <unordered_map>
+#include <vector>
+
+#include "common/latency-trace.h"
+#include "common/linebuf-reader.h"
 #include "common/logging.h"
+#include "common/metrics.h"
 #include "common/string-util.h"
 
 #include "simple-lexer.h"
 
+static MetricCounter gcode_lines_metric("beagleg_gcode_lines_total",
+                                        "G-code lines and moves executed.");
+static MetricCounter gcode_errors_metric("beagleg_gcode_errors_total",
+                                         "G-code syntax and semantic errors.");
+
 const AxisBitmap_t kAllAxesBitmap =
   ((1 << AXIS_X) | (1 << AXIS_Y) | (1 << AXIS_Z) |
    (1 << AXIS_A) | (1 << AXIS_B) | (1 << AXIS_C) |
@@ -85,6 +99,32 @@ enum GCodeParserAxis gcodep_letter2axis(char letter) {
   return GCODE_NUM_AXES;
 }
 
+// A letter/number pair as found by the lexical pre-pass. Parsing the line
+// at "start" results in this pair and the remaining line at "end".
+struct LexedWord {
+  const char *start;
+  const char *end;
+  char letter;
+  float value;
+};
+
+// Lines need to be shorter than the capacity of the stream reader. Longer
+// ones are skipped the same way whether they come from a stream or a file.
+#define LINE_BUFFER_SIZE 65536
+
+// Stands in for an overlong line in a lexed chunk.
+static const char kOverlongLine[] = "";
+
+// The lexed lines of a chunk of a file.
+struct LexedChunk {
+  char *begin;                     // Text of all lines in this chunk.
+  char *end;
+  std::vector<const char*> lines;  // Start of each line.
+  std::vector<LexedWord> words;    // Words of all lines in order.
+  std::string last_line;           // Unterminated last line of the file.
+  size_t line_capacity;            // Lines need to be shorter than this.
+};
+
 // We keep the implementation with all its unnecessary details for the user
 // in this implementation.
 class GCodeParser::Impl {
@@ -94,13 +134,25 @@ public:
   ~Impl();
 
   void ParseLine(GCodeParser *owner, const char *line, FILE *err_stream);
+  // Parse a line of the input; an overlong one arrives empty and is
+  // reported.
+  void ParseInputLine(GCodeParser *owner, const char *line, bool overlong,
+                      FILE *err_stream);
   int ParseStream(GCodeParser *owner, int input_fd, FILE *err_stream);
+  int ParseFile(GCodeParser *owner, int input_fd, FILE *err_stream,
+                int lex_threads);
   const char *gcodep_parse_pair_with_linenumber(int line_num,
                                                 const char *line,
                                                 char *letter,
                                                 float *value,
                                                 FILE *err_stream);
   int error_count() const { return error_count_; }
+  int line_number() const { return line_number_; }
+  bool GetModalState(GCodeParser::ModalState *state) const;
+  void SetModalState(const GCodeParser::ModalState &state);
+  bool ExecuteMove(GCodeParser *owner, int line_number, bool rapid,
+                   float feedrate, AxisBitmap_t axes,
+                   const AxesRegister &values, FILE *err_stream);
 
 private:
   enum DebugLevel {
@@ -123,8 +175,9 @@ private:
 
     last_spline_cp2_ = kZeroOffset;
     have_first_spline_ = false;
+    pending_feedrate_ = -1;
 
-    do_while_ = false;
+    gcodep_while_reset();
 
     // Some initial machine states emitted as events.
     callbacks->set_speed_factor(1.0);
@@ -166,6 +219,18 @@ private:
     callbacks->inform_origin_offset(visible_origin);
   }
 
+  // Returns the feedrate to use for a coordinated move given "feedrate"
+  // from the F parameter, or -1 if there was none.
+  float coordinated_feedrate(float feedrate) {
+    if (feedrate >= 0) {
+      feedrate_ = feedrate;
+    } else {
+      feedrate = pending_feedrate_;
+    }
+    pending_feedrate_ = -1;
+    return feedrate;
+  }
+
   void finish_program_and_reset() {
     callbacks->gcode_finished(false);
 
@@ -198,6 +263,7 @@ private:
   }
 
   bool execute_unary(float *value, Operation op);
+  void execute_atan(float *value, float value2);
   const char *gcodep_atan(const char *line, float *value);
   const char *gcodep_operation_unary(const char *line, Operation *op);
   const char *gcodep_unary(const char *line, float *value);
@@ -205,6 +271,8 @@ private:
   bool execute_binary(float *left, Operation op, float *right);
   const char *gcodep_operation(const char *line, Operation *op);
 
+  // Evaluate expression after the opening '['. Expressions are compiled
+  // on first use and then looked up by their text.
   const char *gcodep_expression(const char *line, float *value);
 
   const char *gcodep_value(const char *line, float *value);
@@ -213,9 +281,11 @@ private:
 
   void gcodep_conditional(const char *line);
 
-  void gcodep_while_end();
+  struct WhileLoop;
+  void gcodep_while_execute(const WhileLoop &loop);
   void gcodep_while_do(const char *line);
   void gcodep_while_start(const char *line);
+  void gcodep_while_reset();
 
   const char *gparse_pair(const char *line, char *letter, float *value) {
     return gcodep_parse_pair_with_linenumber(line_number_, line,
@@ -235,6 +305,7 @@ private:
   void handle_G90_G91(float value);
   const char *handle_G92(float sub_command, const char *line);
   const char *handle_move(const char *line, bool force_change);
+  void emit_move(float feedrate, const AxesRegister &new_pos);
   const char *handle_arc(const char *line, bool is_cw);
   const char *handle_spline(float sub_command, const char *line);
   const char *handle_z_probe(const char *line);
@@ -249,41 +320,114 @@ private:
 
   const char *gcodep_parameter(const char *line, float *value);
 
+  // A parameter as referenced in the program. Numbered parameters are
+  // addressed by their number, all others by name.
+  struct ParamRef {
+    int number;        // -1 if this is a named parameter.
+    std::string name;
+
+    // Numbers beyond the numbered parameters can't be stored, but we
+    // still read them (as zero), so they are kept as names.
+    void SetNumber(int n) {
+      if (n >= 0 && n < Config::ParamMap::kNumberedParams) {
+        number = n;
+      } else {
+        number = -1;
+        name = StringPrintf("%d", n);
+      }
+    }
+
+    std::string ToString() const {
+      return number >= 0 ? StringPrintf("%d", number) : name;
+    }
+  };
+
   // Read name of parameter (after #) which is either a number or a
   // non-alphanumeric character.
-  const char *read_param_name(const char *line, std::string *result);
+  const char *read_param_name(const char *line, ParamRef *result);
 
-  // Read parameter. Do range check.
-  bool read_parameter(StringPiece param_name, float *result) const {
-    if (config.parameters == NULL)
+  // Read numbered parameter; 0 <= number < ParamMap::kNumberedParams.
+  bool read_parameter(int number, float *result) const {
+    if (config.parameters == NULL) {
+      *result = 0;
       return false;
-    param_name = TrimWhitespace(param_name);
-    Config::ParamMap::const_iterator found
-      = config.parameters->find(ToLower(param_name));
-    if (found != config.parameters->end()) {
-      *result = found->second;
-      return true;
-    } else {
+    }
+    return config.parameters->Lookup(number, result);
+  }
+
+  // Read parameter.
+  bool read_parameter(const ParamRef &param, float *result) const {
+    if (param.number >= 0)
+      return read_parameter(param.number, result);
+    if (config.parameters == NULL) {
       *result = 0;
       return false;
     }
+    return config.parameters->Lookup(ToLower(param.name), result);
   }
 
-  // Read parameter. Do range check.
-  bool store_parameter(StringPiece param_name, float value) {
+  // Store numbered parameter. Do range check.
+  bool store_parameter(int number, float value) {
     if (config.parameters == NULL)
       return false;
-    param_name = TrimWhitespace(param_name);
     // zero parameter can never be written.
-    if (param_name == "0" || atoi(param_name.ToString().c_str()) >= 5400) {
+    if (number <= 0 || number >= Config::ParamMap::kNumberedParams) {
+      gprintf(GLOG_SEMANTIC_ERR, "writing unsupported parameter number (%d)\n",
+              number);
+      return false;
+    }
+    (*config.parameters)[number] = value;
+    return true;
+  }
+
+  // Store parameter. Do range check.
+  bool store_parameter(const ParamRef &param, float value) {
+    if (param.number >= 0)
+      return store_parameter(param.number, value);
+    if (config.parameters == NULL)
+      return false;
+    if (atoi(param.name.c_str()) >= Config::ParamMap::kNumberedParams) {
       gprintf(GLOG_SEMANTIC_ERR, "writing unsupported parameter number (%s)\n",
-              param_name.ToString().c_str());
+              param.name.c_str());
       return false;
     }
-    (*config.parameters)[ToLower(param_name)] = value;
+    (*config.parameters)[ToLower(param.name)] = value;
     return true;
   }
 
+  // An expression compiled into the sequence of values and operations in
+  // the order they are evaluated (postfix). Operations work on the topmost
+  // values of the evaluation stack.
+  struct ExpressionOp {
+    enum Kind {
+      PUSH_VALUE,           // push value.
+      PUSH_PARAM,           // push parameter param.
+      PUSH_INDIRECT_PARAM,  // replace top with parameter of that number.
+      UNARY,                // replace top with op(top).
+      ATAN,                 // replace top two with ATAN[a]/[b]
+      BINARY,               // replace top two with a op b
+    };
+    Kind kind;
+    Operation op;
+    float value;
+    ParamRef param;
+  };
+  struct CompiledExpression {
+    std::string source;  // Text after '[' up to including the closing ']'.
+    std::vector<ExpressionOp> code;
+    int max_depth;       // Maximum size of evaluation stack.
+  };
+
+  // The compile_*() functions parse like their gcodep_*() counterparts,
+  // but append the operations to "expr" instead of evaluating.
+  const char *compile_expression(const char *line, CompiledExpression *expr);
+  const char *compile_value(const char *line, CompiledExpression *expr);
+  const char *compile_parameter(const char *line, CompiledExpression *expr);
+  const char *compile_unary(const char *line, CompiledExpression *expr);
+  void push_op(CompiledExpression *expr, ExpressionOp::Kind kind,
+               Operation op = NO_OPERATION, float value = 0.0f);
+  bool evaluate_expression(const CompiledExpression &expr, float *value);
+
   const AxesRegister &current_origin() const { return *current_origin_; }
   const AxesRegister &current_global_offset() const { return *current_global_offset_; }
 
@@ -348,14 +492,45 @@ private:
 
   enum GCodeParserAxis arc_normal_;  // normal vector of arcs.
 
+  // Last feedrate seen, only kept to report in GetModalState().
+  float feedrate_;
+  // Feedrate from SetModalState(), to be passed with the next coordinated
+  // move that doesn't come with a feedrate of its own.
+  float pending_feedrate_;
+
   AxesRegister last_spline_cp2_;
   bool have_first_spline_;
 
+  // Lexical pre-pass of the text we're currently parsing in ParseFile().
+  const LexedChunk *lexed_chunk_;
+  const LexedWord *lexed_next_;   // Next word we might encounter.
+  const LexedWord *lexed_end_;
+
+  // Compiled expressions by hash of their source.
+  std::unordered_map<uint32_t, CompiledExpression> expression_cache_;
+  CompiledExpression uncached_expression_;
+  std::vector<float> eval_stack_;
+
+  // A WHILE loop as collected up to its END. The body is kept as separate
+  // lines and nested loops, so that iterations don't need to split or copy
+  // any text.
+  struct WhileLoop {
+    struct Statement {
+      std::string line;
+      WhileLoop *loop;   // Non-NULL if this is a nested loop.
+    };
+    ~WhileLoop() {
+      for (const Statement &s : body) delete s.loop;
+    }
+    std::string condition;  // Expression after the opening '['.
+    std::vector<Statement> body;
+  };
+
   GCodeParser *while_owner_;
   FILE *while_err_stream_;
   bool do_while_;
-  std::string while_condition_;
-  std::string while_loop_;
+  WhileLoop *while_loop_;               // Outermost loop being collected.
+  std::vector<WhileLoop*> while_nest_;  // Innermost loop being collected last.
 
   unsigned int debug_level_;  // OR-ed bits from DebugLevel enum
   bool allow_m111_;
@@ -390,7 +565,9 @@ GCodeParser::Impl::Impl(const GCodeParser::Config &parse_config,
     current_origin_(&home_position_),
     current_global_offset_(&kZeroOffset),
     arc_normal_(AXIS_Z),
-    while_err_stream_(NULL), do_while_(false),
+    feedrate_(-1), pending_feedrate_(-1),
+    lexed_chunk_(NULL), lexed_next_(NULL), lexed_end_(NULL),
+    while_err_stream_(NULL), do_while_(false), while_loop_(NULL),
     debug_level_(DEBUG_NONE), allow_m111_(allow_m111), error_count_(0)
 {
   assert(callbacks);  // otherwise, this is not very useful.
@@ -435,6 +612,7 @@ GCodeParser::Impl::Impl(const GCodeParser::Config &parse_config,
 }
 
 GCodeParser::Impl::~Impl() {
+  gcodep_while_reset();
 }
 
 // gcode-printf. Prints message to stream or stderr.
@@ -458,10 +636,12 @@ void GCodeParser::Impl::gprintf(enum GCodePrintLevel level,
   case GLOG_SYNTAX_ERR:
     fprintf(stream, "// Line %d: G-Code Syntax Error: ", line_number_);
     ++error_count_;
+    gcode_errors_metric.Increment();
     break;
   case GLOG_SEMANTIC_ERR:
     fprintf(stream, "// Line %d: G-Code Error: ", line_number_);
     ++error_count_;
+    gcode_errors_metric.Increment();
     break;
   }
   va_list ap;
@@ -476,14 +656,14 @@ static const char *skip_white(const char *line) {
   return line;
 }
 
-// Parse number from "line" and store in "value". Returns the position in the
-// string after the value had been parsed; if there was an error parsing,
-// returns the beginning of the line.
-static const char *ParseGcodeNumber(const char *line, float *value) {
-  line = skip_white(line);
+// Maximum length of a number; longer numbers are split.
+#define MAX_NUMBER_LEN 39
+
+// Parse number with strtof(), which is exact for any number of digits.
+static const char *ParseGcodeNumberStrtof(const char *line, float *value) {
   // We need to copy the number into a temporary buffer as strtof() does
   // not accept an end-limiter.
-  char buffer[40];
+  char buffer[MAX_NUMBER_LEN + 1];
   const char *src = line;
   char *dst = buffer;
   const char *end = buffer + sizeof(buffer) - 1;
@@ -506,12 +686,57 @@ static const char *ParseGcodeNumber(const char *line, float *value) {
   return (parsed_end == dst) ? src : line;
 }
 
+// Parse number from "line" and store in "value". Returns the position in the
+// string after the value had been parsed; if there was an error parsing,
+// returns the beginning of the line.
+//
+// Typical G-code numbers have few digits, so they can be converted in a
+// single pass: with less than 2^24 as digits and at most 10 fractional
+// digits, both the digits and the power of ten are exact floats, and a
+// single division rounds correctly - just like strtof(). Everything else is
+// left to strtof().
+static const char *ParseGcodeNumber(const char *line, float *value) {
+  static const float kPow10[] = { 1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f,
+                                  1e6f, 1e7f, 1e8f, 1e9f, 1e10f };
+  line = skip_white(line);
+  const char *src = line;
+  const bool negative = (*src == '-');
+  if (*src == '+' || *src == '-') ++src;
+  uint32_t digits = 0;
+  int digit_count = 0;
+  int fraction_digits = -1;   // Negative while no decimal point seen.
+  bool fits = true;
+  for (;; ++src) {
+    if (*src >= '0' && *src <= '9') {
+      digits = digits * 10 + (*src - '0');
+      fits &= (digits < (1 << 24));
+      ++digit_count;
+      if (fraction_digits >= 0) ++fraction_digits;
+    } else if (*src == '.' && fraction_digits < 0) {
+      fraction_digits = 0;
+    } else {
+      break;
+    }
+  }
+  if (fraction_digits < 0) fraction_digits = 0;
+  if (!fits || fraction_digits > 10 || src - line > MAX_NUMBER_LEN)
+    return ParseGcodeNumberStrtof(line, value);
+
+  if (digit_count == 0) {  // Nothing or only sign and/or point.
+    *value = 0;
+    return (src == line) ? src : line;
+  }
+  const float result = (float)digits / kPow10[fraction_digits];
+  *value = negative ? -result : result;
+  return src;
+}
+
 // Parameter/variable names can be simple integers (traditional NIST), or
 // a named one.
 // Returns the remainder of the line or NULL if parameter name could not
 // be parsed.
 const char* GCodeParser::Impl::read_param_name(const char *line,
-                                               std::string *result) {
+                                               ParamRef *result) {
   line = skip_white(line);
   if (*line == '\0') {
     gprintf(GLOG_SYNTAX_ERR, "expected value after '#'\n");
@@ -539,9 +764,11 @@ const char* GCodeParser::Impl::read_param_name(const char *line,
       return NULL;
     }
     line = endptr;
-    *result = StringPrintf("%d", (int) index);
+    result->SetNumber((int) index);
+    return skip_white(line);
   } else {
-    result->clear();
+    result->number = -1;
+    result->name.clear();
     // Allowing alpha-numeric parameters.
     while (*line
            && ((*line >= '0' && *line <= '9')
@@ -550,7 +777,7 @@ const char* GCodeParser::Impl::read_param_name(const char *line,
                || *line == '_'
                || (bracketed && isspace(*line)))) {
       if (!isspace(*line)) {
-        result->append(1, *line);
+        result->name.append(1, *line);
       }
       ++line;
     }
@@ -559,17 +786,17 @@ const char* GCodeParser::Impl::read_param_name(const char *line,
   if (bracketed) {
     if (*line != '>') {
       gprintf(GLOG_SYNTAX_ERR, "Missed closing bracket for parameter <%s>\n",
-              result->c_str());
+              result->name.c_str());
       return NULL;
     }
     ++line;
   }
 
-  return result->empty() ? NULL : skip_white(line);
+  return result->name.empty() ? NULL : skip_white(line);
 }
 
 const char *GCodeParser::Impl::gcodep_parameter(const char *line, float *value) {
-  std::string param_name;
+  ParamRef param_name;
   line = read_param_name(line, &param_name);
   if (line == NULL) return NULL;
 
@@ -665,11 +892,15 @@ const char *GCodeParser::Impl::gcodep_atan(const char *line, float *value) {
   }
   line = endptr;
 
+  execute_atan(value, value2);
+  return line;
+}
+
+void GCodeParser::Impl::execute_atan(float *value, float value2) {
   float val = (atan2f(*value, value2) * 180.0f) / M_PI;
   gprintf(GLOG_EXPRESSION, "%s[%f]/[%f] -> %f\n",
           op_parse_.AsString(ATAN), *value, value2, val);
   *value = val;
-  return line;
 }
 
 const char *GCodeParser::Impl::gcodep_operation_unary(const char *line,
@@ -804,18 +1035,148 @@ const char *GCodeParser::Impl::gcodep_operation(const char *line,
   }
 }
 
+void GCodeParser::Impl::push_op(CompiledExpression *expr,
+                                ExpressionOp::Kind kind,
+                                Operation op, float value) {
+  ExpressionOp result;
+  result.kind = kind;
+  result.op = op;
+  result.value = value;
+  result.param.number = -1;
+  expr->code.push_back(result);
+}
+
+// Same as gcodep_parameter(), but only the numeric index is an expression.
+const char *GCodeParser::Impl::compile_parameter(const char *line,
+                                                 CompiledExpression *expr) {
+  const char *start = skip_white(line);
+  if (*start != '#' && !isdigit(*start)) {
+    // Plain named parameter or syntax error: nothing to evaluate.
+    push_op(expr, ExpressionOp::PUSH_PARAM);
+    ParamRef *param = &expr->code.back().param;
+    line = read_param_name(line, param);
+    param->name = ToLower(param->name);  // Ready for lookup.
+    return line;
+  }
+
+  const char *endptr;
+  if (*start == '#') {  // Indirect: number is the value of a parameter.
+    endptr = compile_value(start, expr);
+    if (endptr != NULL) push_op(expr, ExpressionOp::PUSH_INDIRECT_PARAM);
+  } else {
+    float index;
+    endptr = ParseGcodeNumber(start, &index);
+    if (endptr == start) endptr = NULL;
+    if (endptr != NULL) {
+      push_op(expr, ExpressionOp::PUSH_PARAM);
+      expr->code.back().param.SetNumber((int) index);
+    }
+  }
+  if (endptr == NULL) {
+    gprintf(GLOG_SYNTAX_ERR,
+            "'#' is not followed by a number but '%s'\n", start);
+    return NULL;
+  }
+  return skip_white(endptr);
+}
+
+const char *GCodeParser::Impl::compile_unary(const char *line,
+                                             CompiledExpression *expr) {
+  Operation op;
+  const char *endptr;
+
+  endptr = gcodep_operation_unary(line, &op);
+  if (endptr == NULL) {
+    gprintf(GLOG_SYNTAX_ERR, "unknown unary got '%s'\n", line);
+    return NULL;
+  }
+  line = endptr;
+
+  if (*line != '[') {
+    gprintf(GLOG_SYNTAX_ERR, "expected '[' got '%s'\n", line);
+    return NULL;
+  }
+  line = skip_white(line + 1);
+
+  endptr = compile_expression(line, expr);
+  if (endptr == NULL) {
+    gprintf(GLOG_SYNTAX_ERR, "expected value got '%s'\n", line);
+    return NULL;
+  }
+  line = skip_white(endptr);
+
+  if (op != ATAN) {
+    push_op(expr, ExpressionOp::UNARY, op);
+    return line;
+  }
+
+  if (*line != '/') {
+    gprintf(GLOG_SYNTAX_ERR, "expected '/' after ATAN got '%s'\n", line);
+    return NULL;
+  }
+  line++;
+  if (*line != '[') {
+    gprintf(GLOG_SYNTAX_ERR, "expected '[' after ATAN/ got '%s'\n", line);
+    return NULL;
+  }
+  line++;
+  endptr = compile_expression(line, expr);
+  if (endptr == NULL) {
+    gprintf(GLOG_SYNTAX_ERR, "expected value got '%s'\n", line);
+    return NULL;
+  }
+  push_op(expr, ExpressionOp::ATAN, ATAN);
+  return skip_white(endptr);
+}
+
+const char *GCodeParser::Impl::compile_value(const char *line,
+                                             CompiledExpression *expr) {
+  char c = toupper(*line);
+  if (isalpha(c)) c = 'U';  // indicates a unary in the switch below
+
+  const char *endptr;
+  float value;
+  switch (c) {
+  case '\0':
+    endptr = NULL;
+    break;
+  case '[':
+    endptr = compile_expression(line + 1, expr);
+    break;
+  case '#':
+    endptr = compile_parameter(line + 1, expr);
+    break;
+  case 'U':
+    endptr = compile_unary(line, expr);
+    break;
+  default:
+    endptr = ParseGcodeNumber(line, &value);
+    if (endptr != NULL && endptr != line)
+      push_op(expr, ExpressionOp::PUSH_VALUE, NO_OPERATION, value);
+    break;
+  }
+  if (line == endptr || endptr == NULL)
+    return NULL;
+
+  return skip_white(endptr);
+}
+
 // the expression stack needs to be at least one greater than the max precedence
 #define MAX_STACK   6
 
-const char *GCodeParser::Impl::gcodep_expression(const char *line, float *value) {
-  float vals[MAX_STACK];
+// Operator precedence is resolved with a stack of pending operations. The
+// values on that stack are the values the code evaluates to at runtime
+// at the end of the evaluation stack, so we emit the operations when they
+// would be executed.
+const char *GCodeParser::Impl::compile_expression(const char *line,
+                                                  CompiledExpression *expr) {
   Operation ops[MAX_STACK];
   int stack = 0;
   const char *endptr;
   line = skip_white(line);
 
   for (ops[0] = NO_OPERATION; ops[0] != RIGHT_BRACKET; ) {
-    endptr = gcodep_value(line, &vals[stack]);
+    endptr = compile_value(line, expr);
     if (endptr == NULL) {
       if (*line == '-') {
         line = skip_white(line+1);
@@ -824,9 +1185,13 @@ const char *GCodeParser::Impl::gcodep_expression(const char *line, float *value)
           return NULL;
         }
         // make [-expression] work like [-1 * expression]
-        vals[stack] = -1.0f;
+        push_op(expr, ExpressionOp::PUSH_VALUE, NO_OPERATION, -1.0f);
         ops[stack] = TIMES;
         stack++;
+        if (stack >= MAX_STACK) {
+          gprintf(GLOG_SYNTAX_ERR, "stack overflow\n");
+          return NULL;
+        }
         continue;
       }
       gprintf(GLOG_SYNTAX_ERR, "expected value got '%s'\n", line);
@@ -857,8 +1222,7 @@ const char *GCodeParser::Impl::gcodep_expression(const char *line, float *value)
       }
     } else {  // precedence of latest operator is <= previous precedence
       for ( ; precedence(ops[stack]) <= precedence(ops[stack - 1]); ) {
-        if (!execute_binary(&vals[stack - 1], ops[stack - 1], &vals[stack]))
-          return NULL;
+        push_op(expr, ExpressionOp::BINARY, ops[stack - 1]);
 
         ops[stack - 1] = ops[stack];
         if (stack > 1 && precedence(ops[stack - 1]) <= precedence(ops[stack - 2]))
@@ -868,11 +1232,133 @@ const char *GCodeParser::Impl::gcodep_expression(const char *line, float *value)
       }
     }
   }
-  *value = vals[0];
 
   return line;
 }
 
+bool GCodeParser::Impl::evaluate_expression(const CompiledExpression &expr,
+                                            float *value) {
+  if ((int)eval_stack_.size() < expr.max_depth)
+    eval_stack_.resize(expr.max_depth);
+  float *const stack = eval_stack_.data();
+  int top = -1;
+  for (const ExpressionOp &op : expr.code) {
+    switch (op.kind) {
+    case ExpressionOp::PUSH_VALUE:
+      stack[++top] = op.value;
+      break;
+    case ExpressionOp::PUSH_PARAM:
+      ++top;
+      if (op.param.number >= 0)
+        read_parameter(op.param.number, &stack[top]);
+      else if (config.parameters != NULL)
+        config.parameters->Lookup(op.param.name, &stack[top]);  // lower-case
+      else
+        stack[top] = 0;
+      break;
+    case ExpressionOp::PUSH_INDIRECT_PARAM: {
+      ParamRef param;
+      param.SetNumber((int) stack[top]);
+      read_parameter(param, &stack[top]);
+      break;
+    }
+    case ExpressionOp::UNARY:
+      if (!execute_unary(&stack[top], op.op)) {
+        gprintf(GLOG_SYNTAX_ERR, "unary operation failed\n");
+        return false;
+      }
+      break;
+    case ExpressionOp::ATAN:
+      execute_atan(&stack[top - 1], stack[top]);
+      --top;
+      break;
+    case ExpressionOp::BINARY:
+      if (!execute_binary(&stack[top - 1], op.op, &stack[top]))
+        return false;
+      --top;
+      break;
+    }
+  }
+  *value = stack[0];
+  return true;
+}
+
+// Maximum number of different expressions we keep. If generated programs
+// have a lot of them, we start over.
+#define MAX_CACHED_EXPRESSIONS 1024
+
+const char *GCodeParser::Impl::gcodep_expression(const char *line, float *value) {
+  // The expression ends with the matching closing bracket.
+  const char *end = line;
+  for (int nesting = 0; *end; ++end) {
+    if (*end == '[') {
+      ++nesting;
+    } else if (*end == ']') {
+      if (nesting == 0) break;
+      --nesting;
+    }
+  }
+  if (*end != ']') end = NULL;  // Will result in a syntax error below.
+
+  CompiledExpression *expr = &uncached_expression_;
+  uint32_t hash = 2166136261u;  // FNV-1a
+  if (end != NULL) {
+    for (const char *c = line; c <= end; ++c) {
+      hash = (hash ^ (uint8_t)*c) * 16777619u;
+    }
+    const StringPiece source(line, end - line + 1);
+    auto found = expression_cache_.find(hash);
+    if (found != expression_cache_.end()) {
+      if (StringPiece(found->second.source) == source) {
+        if (!evaluate_expression(found->second, value))
+          return NULL;
+        return skip_white(end + 1);
+      }
+      // Hash collision: just don't cache this one.
+    } else {
+      if (expression_cache_.size() >= MAX_CACHED_EXPRESSIONS)
+        expression_cache_.clear();
+      expr = &expression_cache_[hash];
+      expr->source.assign(line, end - line + 1);
+    }
+  }
+
+  expr->code.clear();
+  const char *endptr = compile_expression(line, expr);
+  if (endptr == NULL || end == NULL || endptr != skip_white(end + 1)) {
+    // Errors or not ending where we expect: don't keep it.
+    if (expr != &uncached_expression_) {
+      if (endptr != NULL) uncached_expression_ = *expr;
+      expression_cache_.erase(hash);
+      expr = &uncached_expression_;
+    }
+    if (endptr == NULL) return NULL;
+  }
+
+  // Determine size of evaluation stack.
+  int depth = 0;
+  expr->max_depth = 1;
+  for (const ExpressionOp &op : expr->code) {
+    switch (op.kind) {
+    case ExpressionOp::PUSH_VALUE:
+    case ExpressionOp::PUSH_PARAM:
+      ++depth;
+      break;
+    case ExpressionOp::ATAN:
+    case ExpressionOp::BINARY:
+      --depth;
+      break;
+    default:
+      break;
+    }
+    if (depth > expr->max_depth) expr->max_depth = depth;
+  }
+
+  if (!evaluate_expression(*expr, value))
+    return NULL;
+  return endptr;
+}
+
 // Parse a value out of the line.
 // The value may be a number, a parameter value, a unary function, or an
 // expression.
@@ -906,10 +1392,14 @@ const char *GCodeParser::Impl::gcodep_value(const char *line, float *value) {
 }
 
 const char *GCodeParser::Impl::gcodep_set_parameter(const char *line) {
-  std::string param_name;
+  ParamRef param_name;
   line = read_param_name(line, &param_name);
   if (line == NULL) return NULL;
-  const char *log_name = param_name.c_str();
+  // Don't format the name of numbered parameters for every assignment,
+  // only if we actually log expressions.
+  const std::string log_name_buffer = (debug_level_ & DEBUG_EXPRESSION)
+    ? param_name.ToString() : "";
+  const char *log_name = log_name_buffer.c_str();
 
   float value;
   if (*line     == '+' &&
@@ -954,11 +1444,11 @@ const char *GCodeParser::Impl::gcodep_set_parameter(const char *line) {
     if (*line == '\0') {
       value = 0.0;
       read_parameter(param_name, &value);
-      gprintf(GLOG_INFO, "#%s = %f\n", log_name, value);
+      gprintf(GLOG_INFO, "#%s = %f\n", param_name.ToString().c_str(), value);
     } else {
       gprintf(GLOG_SYNTAX_ERR,
               "gcodep_set_parameter: expected '=' after '#%s' got '%s'\n",
-              log_name, line);
+              param_name.ToString().c_str(), line);
     }
     return NULL;
   }
@@ -969,7 +1459,7 @@ const char *GCodeParser::Impl::gcodep_set_parameter(const char *line) {
   if (endptr == NULL) {
     gprintf(GLOG_SYNTAX_ERR,
             "gcodep_set_parameter: expected value after '#%s=' got '%s'\n",
-            log_name, line);
+            param_name.ToString().c_str(), line);
     return NULL;
   }
   line = skip_white(endptr);
@@ -990,7 +1480,7 @@ const char *GCodeParser::Impl::gcodep_set_parameter(const char *line) {
       if (endptr == NULL) {
         gprintf(GLOG_SYNTAX_ERR,
                 "gcodep_set_parameter: expected value after '#%s=[%d] ? ' got '%s'\n",
-                log_name, line, condition);
+                param_name.ToString().c_str(), line, condition);
         return NULL;
       }
       line = skip_white(endptr);
@@ -1002,7 +1492,7 @@ const char *GCodeParser::Impl::gcodep_set_parameter(const char *line) {
         if (endptr == NULL) {
           gprintf(GLOG_SYNTAX_ERR,
                   "gcodep_set_parameter: expected value after '#%s=[%d] ? %f :' got '%s'\n",
-                  log_name, line, condition, true_value);
+                  param_name.ToString().c_str(), line, condition, true_value);
           return NULL;
         }
         line = skip_white(endptr);
@@ -1012,7 +1502,7 @@ const char *GCodeParser::Impl::gcodep_set_parameter(const char *line) {
       } else {
         gprintf(GLOG_SYNTAX_ERR,
                 "gcodep_set_parameter: expected ':' after '#%s=[%d] ? %f' got '%s'\n",
-                log_name, line, condition, true_value);
+                param_name.ToString().c_str(), line, condition, true_value);
         return NULL;
       }
     }
@@ -1093,49 +1583,73 @@ void GCodeParser::Impl::gcodep_conditional(const char *line) {
   }
 }
 
-void GCodeParser::Impl::gcodep_while_end() {
-    int loops = 0;
-    while (1) {
-      const char *line = while_condition_.c_str();
-      const char *endptr;
-      float value;
-      // the '[' was already parsed
-      endptr = gcodep_expression(line, &value);
-      if (endptr == NULL) {
-        gprintf(GLOG_SYNTAX_ERR, "expected value got '%s'\n", line);
-        return;
-      }
-      if (value == 0.0f)
-        break;
+void GCodeParser::Impl::gcodep_while_execute(const WhileLoop &loop) {
+  int loops = 0;
+  while (1) {
+    const char *line = loop.condition.c_str();
+    const char *endptr;
+    float value;
+    // the '[' was already parsed
+    endptr = gcodep_expression(line, &value);
+    if (endptr == NULL) {
+      gprintf(GLOG_SYNTAX_ERR, "expected value got '%s'\n", line);
+      return;
+    }
+    if (value == 0.0f)
+      break;
 
-      line = skip_white(endptr);
-      if (control_parse_.ExpectNext(&line, CK_DO)) {
-        std::vector<StringPiece> piece = SplitString(while_loop_, "\n");
-        for (size_t i=0; i < piece.size(); i++)
-          ParseLine(while_owner_, piece[i].ToString().c_str(),
-                    while_err_stream_);
-      } else {
-        gprintf(GLOG_SYNTAX_ERR, "expected DO got '%s'\n", line);
-        return;
-      }
-      loops++;
+    line = skip_white(endptr);
+    if (!control_parse_.ExpectNext(&line, CK_DO)) {
+      gprintf(GLOG_SYNTAX_ERR, "expected DO got '%s'\n", line);
+      return;
     }
-    gprintf(GLOG_INFO, "Executed %d loops\n", loops);
+    for (const WhileLoop::Statement &statement : loop.body) {
+      if (statement.loop)
+        gcodep_while_execute(*statement.loop);
+      else
+        ParseLine(while_owner_, statement.line.c_str(), while_err_stream_);
+    }
+    loops++;
+  }
+  gprintf(GLOG_INFO, "Executed %d loops\n", loops);
 }
 
 void GCodeParser::Impl::gcodep_while_do(const char *line) {
   if (control_parse_.ExpectNext(&line, CK_END)) {
+    while_nest_.pop_back();
+    if (!while_nest_.empty())
+      return;  // End of a nested loop; still collecting the outer one.
     do_while_ = false;
-    gcodep_while_end();
+    WhileLoop *loop = while_loop_;
+    while_loop_ = NULL;
+    gcodep_while_execute(*loop);
+    delete loop;
     return;
   }
 
-  while_loop_ += line;
+  WhileLoop::Statement statement;
+  statement.loop = NULL;
+  const char *nested = line;
+  if (control_parse_.ExpectNext(&nested, CK_WHILE)) {
+    nested = skip_white(nested);
+    if (*nested != '[') {
+      gprintf(GLOG_SYNTAX_ERR, "expected '[' after WHILE got '%s'\n", nested);
+      return;
+    }
+    statement.loop = new WhileLoop();
+    statement.loop->condition = skip_white(nested + 1);
+    while_nest_.back()->body.push_back(statement);
+    while_nest_.push_back(statement.loop);
+    return;
+  }
+  statement.line = line;
+  while_nest_.back()->body.push_back(statement);
 }
 
 // WHILE [conditionalexpression is true] DO
 // ...
 // END
+// Loops can be nested.
 void GCodeParser::Impl::gcodep_while_start(const char *line) {
   if (*line != '[') {
     gprintf(GLOG_SYNTAX_ERR, "expected '[' after WHILE got '%s'\n", line);
@@ -1143,11 +1657,21 @@ void GCodeParser::Impl::gcodep_while_start(const char *line) {
   }
   line = skip_white(line+1);
 
-  while_condition_ = line;
-  while_loop_ = "";
+  gcodep_while_reset();
+  while_loop_ = new WhileLoop();
+  while_loop_->condition = line;
+  while_nest_.push_back(while_loop_);
   do_while_= true;
 }
 
+// Discard any loop that we are still collecting.
+void GCodeParser::Impl::gcodep_while_reset() {
+  delete while_loop_;
+  while_loop_ = NULL;
+  while_nest_.clear();
+  do_while_ = false;
+}
+
 // Parse next letter/number pair.
 // Returns the remaining line or NULL if end reached.
 const char *GCodeParser::Impl::gcodep_parse_pair_with_linenumber(
@@ -1158,6 +1682,19 @@ const char *GCodeParser::Impl::gcodep_parse_pair_with_linenumber(
   // TODO: error callback when we have errors with messages.
   if (line == NULL)
     return NULL;
+
+  if (lexed_next_ != lexed_end_ && !do_while_
+      && line >= lexed_chunk_->begin && line < lexed_chunk_->end) {
+    // We're in text that has been lexed already.
+    while (lexed_next_ != lexed_end_ && lexed_next_->start < line)
+      ++lexed_next_;
+    if (lexed_next_ != lexed_end_ && lexed_next_->start == line) {
+      *letter = lexed_next_->letter;
+      *value = lexed_next_->value;
+      return lexed_next_->end;
+    }
+  }
+
   line = skip_white(line);
 
   if (*line == '\0' || *line == ';' || *line == '%')
@@ -1256,7 +1793,7 @@ void GCodeParser::Impl::InitCoordSystems() {
     value = 0.0;
     std::string coords = "";
     for (GCodeParserAxis axis : AllAxes()) {
-      read_parameter(StringPrintf("%d", 5221 + offset + axis), &value);
+      read_parameter(5221 + offset + axis, &value);
       coord_system_[i][axis] = value;
       if (axis <= AXIS_Y || value)
         coords += StringPrintf(" %c:%.3f", gcodep_axis2letter(axis), value);
@@ -1267,7 +1804,7 @@ void GCodeParser::Impl::InitCoordSystems() {
                 set ? coords.c_str() : " undefined");
     }
   }
-  if (read_parameter("5220", &value)) {
+  if (read_parameter(5220, &value)) {
     const int coord_system = (int)value;
     if (value >= 1 && value <= 9) {
       current_origin_ = &coord_system_[coord_system-1];
@@ -1315,7 +1852,7 @@ const char *GCodeParser::Impl::handle_G10(const char *line) {
     // Now update the parameters
     int offset = (p_val-1) * 20;
     for (GCodeParserAxis a : AllAxes()) {
-      store_parameter(StringPrintf("%d", 5221 + offset + a), coords[a]);
+      store_parameter(5221 + offset + a, coords[a]);
     }
   } else {
     gprintf(GLOG_SYNTAX_ERR, "handle_G10: invalid L or P value\n");
@@ -1352,7 +1889,7 @@ void GCodeParser::Impl::change_coord_system(float sub_command) {
     gprintf(GLOG_SYNTAX_ERR, "invalid coordinate system\n");
     return;
   }
-  store_parameter("5220", coord_system);
+  store_parameter(5220, coord_system);
   current_origin_ = &coord_system_[coord_system-1];
   inform_origin_offset_change();
 }
@@ -1433,18 +1970,25 @@ const char *GCodeParser::Impl::handle_move(const char *line, bool force_change)
     line = remaining_line;
   }
 
-  bool did_move = false;
   if (any_change) {
-    if (modal_g0_g1_) {
-      did_move = callbacks->coordinated_move(feedrate, new_pos);
-    } else {
-      did_move = callbacks->rapid_move(feedrate, new_pos);
-    }
+    emit_move(feedrate, new_pos);
+  }
+  return line;
+}
+
+// Send a G0/G1 move (depending on the modal state) to "new_pos".
+void GCodeParser::Impl::emit_move(float feedrate, const AxesRegister &new_pos) {
+  bool did_move;
+  if (modal_g0_g1_) {
+    did_move = callbacks->coordinated_move(coordinated_feedrate(feedrate),
+                                           new_pos);
+  } else {
+    if (feedrate > 0 && feedrate_ < 0) feedrate_ = feedrate;
+    did_move = callbacks->rapid_move(feedrate, new_pos);
   }
   if (did_move) {
     axes_pos_ = new_pos;
   }
-  return line;
 }
 
 // The algorithm used here is based on finding the midpoint M of the line
@@ -1596,7 +2140,7 @@ const char *GCodeParser::Impl::handle_arc(const char *line, bool is_cw) {
   absolute_center[AXIS_X] += offset[AXIS_X];
   absolute_center[AXIS_Y] += offset[AXIS_Y];
   absolute_center[AXIS_Z] += offset[AXIS_Z];
-  callbacks->arc_move(feedrate, arc_normal_, is_cw,
+  callbacks->arc_move(coordinated_feedrate(feedrate), arc_normal_, is_cw,
                       axes_pos_, absolute_center, target);
   axes_pos_ = target;
   return line;
@@ -1807,7 +2351,13 @@ void GCodeParser::Impl::ParseLine(GCodeParser *owner,
   }
 
   ++line_number_;
+  gcode_lines_metric.Increment();
+  LATENCY_TRACE_SET_LINE(line_number_);
+  FILE *const outer_err_msg = err_msg_;  // Set if we're in a WHILE loop.
   err_msg_ = err_stream;  // remember as 'instance' variable.
+  // WHILE loop bodies are parsed with the same owner and error stream.
+  while_owner_ = owner;
+  while_err_stream_ = err_stream;
   char letter;
   float value;
   while ((line = gparse_pair(line, &letter, &value))) {
@@ -1886,7 +2436,8 @@ void GCodeParser::Impl::ParseLine(GCodeParser *owner,
     else if (letter == 'F') {
       // Feedrate is sometimes used in absence of a move command.
       const float unit_value = value * unit_to_mm_factor_;
-      const float feedrate = f_param_to_feedrate(unit_value);
+      const float feedrate =
+        coordinated_feedrate(f_param_to_feedrate(unit_value));
       callbacks->coordinated_move(feedrate, axes_pos_);  // No move, just feed
     }
     else if (letter == 'N') {
@@ -1912,7 +2463,7 @@ void GCodeParser::Impl::ParseLine(GCodeParser *owner,
       callbacks->gcode_command_done(letter, value);
     }
   }
-  err_msg_ = NULL;
+  err_msg_ = outer_err_msg;
 }
 
 // It is usually good to shut down gracefully, otherwise the PRU keeps running.
@@ -1950,6 +2501,18 @@ static void disarm_signal_handler() {
   signal(SIGFPE, SIG_DFL);
 }
 
+void GCodeParser::Impl::ParseInputLine(GCodeParser *owner, const char *line,
+                                       bool overlong, FILE *err_stream) {
+  ParseLine(owner, line, err_stream);
+  if (overlong) {
+    FILE *const outer_err_msg = err_msg_;
+    err_msg_ = err_stream;
+    gprintf(GLOG_SYNTAX_ERR, "Line longer than %d bytes ignored.\n",
+            (int)LinebufReader::CapacityFor(LINE_BUFFER_SIZE));
+    err_msg_ = outer_err_msg;
+  }
+}
+
 // Public facade function.
 int GCodeParser::Impl::ParseStream(GCodeParser *owner,
                                    int input_fd, FILE *err_stream) {
@@ -1958,11 +2521,13 @@ int GCodeParser::Impl::ParseStream(GCodeParser *owner,
     setvbuf(err_stream, NULL, _IONBF, 0);
   }
 
-  FILE *gcode_stream = fdopen(input_fd, "r");
-  if (gcode_stream == NULL) {
+  struct stat st;
+  if (fstat(input_fd, &st) < 0) {
     Log_error("While opening stream from fd %d: %s", input_fd, strerror(errno));
     return 1;
   }
+  // Regular files never block, so there is no need to watch for idle times.
+  const bool may_wait_for_input = !S_ISREG(st.st_mode);
 
   bool is_processing = true;
   fd_set read_fds;
@@ -1972,38 +2537,377 @@ int GCodeParser::Impl::ParseStream(GCodeParser *owner,
   wait_time.tv_usec = 50 * 1000;
   FD_ZERO(&read_fds);
 
-  while_owner_ = owner;
-  while_err_stream_ = err_stream;
-
   arm_signal_handler();
-  char buffer[8192];
+  // Lines are parsed in place from the buffer; we only go back to reading
+  // once all complete lines of a previous read are handled.
+  LinebufReader reader(LINE_BUFFER_SIZE);
+  int overlong_lines = 0;
+  auto parse = [&](const char *line) {
+    // The reader skips overlong lines; we only get an empty line.
+    const bool overlong = (reader.overlong_lines() != overlong_lines);
+    overlong_lines = reader.overlong_lines();
+    ParseInputLine(owner, line, overlong, err_stream);
+  };
+  const char *line;
   while (!caught_signal) {
-    // Read with timeout. If we don't get anything on our input, but it
-    // is not finished yet, we tell our
-    FD_SET(input_fd, &read_fds);
-    // When we're already in idle mode, we're not interested in change.
-    wait_time.tv_usec = 50 * 1000;
-    select_ret = select(input_fd + 1, &read_fds, NULL, NULL, &wait_time);
-    if (select_ret < 0)  { // Broken stream.
-      Log_error("select(): %s", strerror(errno));
-      break;
+    while (!caught_signal && (line = reader.ReadLine()) != NULL) {
+      parse(line);
     }
+    if (caught_signal)
+      break;
 
-    if (select_ret == 0) {  // Timeout. Regularly call.
-      callbacks->input_idle(is_processing);
-      is_processing = false;
-      continue;
+    if (may_wait_for_input) {
+      // Read with timeout. If we don't get anything on our input, but it
+      // is not finished yet, we tell our event receiver that we're idle.
+      FD_SET(input_fd, &read_fds);
+      wait_time.tv_usec = 50 * 1000;
+      select_ret = select(input_fd + 1, &read_fds, NULL, NULL, &wait_time);
+      if (select_ret < 0)  { // Broken stream.
+        if (errno == EINTR) continue;
+        Log_error("select(): %s", strerror(errno));
+        break;
+      }
+
+      if (select_ret == 0) {  // Timeout. Regularly call.
+        callbacks->input_idle(is_processing);
+        is_processing = false;
+        continue;
+      }
     }
 
     is_processing = true;
 
-    // Filedescriptor readable. Now wait for a line to finish.
-    if (fgets(buffer, sizeof(buffer), gcode_stream) == NULL)
+    const int read_result = reader.Update(input_fd);
+    if (read_result < 0) {
+      if (errno == EINTR) continue;
+      Log_error("read(): %s", strerror(errno));
+      break;
+    }
+    if (read_result == 0) {
+      // End of stream. There might be a last line without newline.
+      if (reader.size() > 0) {
+        parse(reader.IncompleteLine());
+      }
+      break;
+    }
+  }
+  disarm_signal_handler();
+
+  if (caught_signal)
+    return 2;
+
+  if (err_stream) {
+    fflush(err_stream);
+  }
+  close(input_fd);
+
+  // always call gcode_finished() to disable motors at end of stream
+  callbacks->gcode_finished(true);
+
+  return 0;
+}
+
+// -- Lexical pre-pass of files.
+//
+// Finding the letter/number pairs of a line does not depend on any parser
+// state as long as the values are plain numbers. So we can do that in
+// separate threads ahead of time. The parser then picks up the pairs when
+// it arrives at their position in the text, and parses everything else,
+// such as expressions, as usual.
+
+// Same as gcodep_parse_pair_with_linenumber(), but stops at the first
+// thing that might depend on the parser state or is a syntax error.
+static void LexLine(const char *line, std::vector<LexedWord> *words) {
+  for (;;) {
+    LexedWord word;
+    word.start = line;
+    line = skip_white(line);
+    if (*line == '\0' || *line == ';' || *line == '%')
+      return;
+    if (*line == '(') {
+      while (*line && *line != ')')
+        line++;
+      line = skip_white(line + 1);
+      if (*line == '\0') return;
+    }
+    if (*line == '#')
+      return;
+    word.letter = toupper(*line++);
+    if (*line == '\0' || word.letter == '*')
+      return;
+    line = skip_white(line);
+    // Expressions, parameters, unaries and keywords are for the parser.
+    if (*line == '\0' || *line == '[' || *line == '#' || isalpha(*line))
+      return;
+    const char *endptr = ParseGcodeNumber(line, &word.value);
+    if (endptr == NULL || endptr == line)
+      return;
+    line = skip_white(endptr);
+    word.end = line;
+    words->push_back(word);
+  }
+}
+
+// Terminate the lines in the chunk and lex them.
+static void LexChunk(LexedChunk *chunk, bool is_file_end) {
+  char *pos = chunk->begin;
+  while (pos < chunk->end) {
+    char *end = pos;
+    while (end < chunk->end && *end != '\n' && *end != '\r')
+      ++end;
+    const bool overlong = ((size_t)(end - pos) >= chunk->line_capacity);
+    if (end == chunk->end && is_file_end) {
+      // Last line without newline; we can't terminate it in the mapping.
+      if (overlong) {
+        chunk->lines.push_back(kOverlongLine);
+      } else {
+        chunk->last_line.assign(pos, end - pos);
+        chunk->lines.push_back(chunk->last_line.c_str());
+      }
       break;
+    }
+    const bool crlf = (*end == '\r' && end + 1 < chunk->end && end[1] == '\n');
+    if (overlong) {
+      chunk->lines.push_back(kOverlongLine);
+    } else {
+      *end = '\0';
+      chunk->lines.push_back(pos);
+      LexLine(pos, &chunk->words);
+    }
+    pos = end + (crlf ? 2 : 1);
+  }
+}
+
+// Splits the text into chunks lexed by a number of threads. The chunks
+// are handed out in sequence; only a limited number is lexed ahead.
+class LexPipeline {
+public:
+  // With zero threads, chunks are lexed when requested.
+  LexPipeline(char *data, size_t size, size_t line_capacity, int threads)
+    : window_(2 * threads + 1), next_to_lex_(0), consumed_(0), quit_(false) {
+    static const size_t kChunkSize = 1 << 20;
+    char *const data_end = data + size;
+    while (data < data_end) {
+      char *end = data + kChunkSize;
+      if (end >= data_end) {
+        end = data_end;
+      } else {
+        // Chunks end after a newline. \r\n stay together.
+        char *nl = (char*) memchr(end, '\n', data_end - end);
+        end = nl ? nl + 1 : data_end;
+      }
+      LexedChunk *chunk = new LexedChunk();
+      chunk->begin = data;
+      chunk->end = end;
+      chunk->line_capacity = line_capacity;
+      chunks_.push_back(chunk);
+      data = end;
+    }
+    lexed_.resize(chunks_.size(), false);
+    pthread_mutex_init(&mutex_, NULL);
+    pthread_cond_init(&cond_, NULL);
+    threads_.resize(threads);
+    for (pthread_t &t : threads_) {
+      pthread_create(&t, NULL, &ThreadMain, this);
+    }
+  }
+
+  ~LexPipeline() {
+    pthread_mutex_lock(&mutex_);
+    quit_ = true;
+    pthread_cond_broadcast(&cond_);
+    pthread_mutex_unlock(&mutex_);
+    for (pthread_t &t : threads_) {
+      pthread_join(t, NULL);
+    }
+    pthread_cond_destroy(&cond_);
+    pthread_mutex_destroy(&mutex_);
+    for (LexedChunk *chunk : chunks_) delete chunk;
+  }
+
+  // Get the next chunk in order or NULL if there are no more. Frees the
+  // previous chunk, so its lines and words must not be used anymore.
+  const LexedChunk *Next() {
+    pthread_mutex_lock(&mutex_);
+    if (consumed_ > 0) {
+      delete chunks_[consumed_ - 1];
+      chunks_[consumed_ - 1] = NULL;
+    }
+    if (consumed_ == chunks_.size()) {
+      pthread_mutex_unlock(&mutex_);
+      return NULL;
+    }
+    const size_t index = consumed_++;
+    pthread_cond_broadcast(&cond_);  // Window moved.
+    if (threads_.empty()) {
+      next_to_lex_ = consumed_;
+      pthread_mutex_unlock(&mutex_);
+      LexChunk(chunks_[index], index == chunks_.size() - 1);
+      return chunks_[index];
+    }
+    while (!lexed_[index])
+      pthread_cond_wait(&cond_, &mutex_);
+    pthread_mutex_unlock(&mutex_);
+    return chunks_[index];
+  }
 
-    ParseLine(owner, buffer, err_stream);
+private:
+  static void *ThreadMain(void *arg) {
+    reinterpret_cast<LexPipeline*>(arg)->Run();
+    return NULL;
+  }
+
+  void Run() {
+    pthread_mutex_lock(&mutex_);
+    for (;;) {
+      while (!quit_ && next_to_lex_ < chunks_.size()
+             && next_to_lex_ >= consumed_ + window_) {
+        pthread_cond_wait(&cond_, &mutex_);
+      }
+      if (quit_ || next_to_lex_ >= chunks_.size())
+        break;
+      const size_t index = next_to_lex_++;
+      pthread_mutex_unlock(&mutex_);
+      LexChunk(chunks_[index], index == chunks_.size() - 1);
+      pthread_mutex_lock(&mutex_);
+      lexed_[index] = true;
+      pthread_cond_broadcast(&cond_);
+    }
+    pthread_mutex_unlock(&mutex_);
+  }
+
+  const size_t window_;  // Maximum number of chunks lexed ahead.
+  std::vector<LexedChunk*> chunks_;
+  std::vector<bool> lexed_;
+  size_t next_to_lex_;
+  size_t consumed_;
+  bool quit_;
+  std::vector<pthread_t> threads_;
+  pthread_mutex_t mutex_;
+  pthread_cond_t cond_;
+};
+
+bool GCodeParser::Impl::GetModalState(GCodeParser::ModalState *state) const {
+  if (while_loop_ != NULL)
+    return false;  // Loop body not executed yet.
+  state->line_number = line_number_;
+  state->modal_g0_g1 = modal_g0_g1_;
+  state->unit_to_mm_factor = unit_to_mm_factor_;
+  for (GCodeParserAxis a : AllAxes()) {
+    state->axis_is_absolute[a] = axis_is_absolute_[a];
+  }
+  state->arc_normal = arc_normal_;
+  state->coord_system = 0;
+  for (int i = 0; i < 9; ++i) {
+    if (current_origin_ == &coord_system_[i]) state->coord_system = i + 1;
+  }
+  state->origin = *current_origin_;
+  state->g92_active = (current_global_offset_ == &global_offset_g92_);
+  state->g92_offset = global_offset_g92_;
+  state->feedrate = (pending_feedrate_ >= 0) ? pending_feedrate_ : feedrate_;
+  state->position = axes_pos_;
+  return true;
+}
+
+void GCodeParser::Impl::SetModalState(const GCodeParser::ModalState &state) {
+  gcodep_while_reset();
+  line_number_ = state.line_number;
+  modal_g0_g1_ = state.modal_g0_g1;
+  unit_to_mm_factor_ = state.unit_to_mm_factor;
+  for (GCodeParserAxis a : AllAxes()) {
+    axis_is_absolute_[a] = state.axis_is_absolute[a];
+  }
+  arc_normal_ = state.arc_normal;
+  if (state.coord_system >= 1 && state.coord_system <= 9) {
+    coord_system_[state.coord_system - 1] = state.origin;
+    current_origin_ = &coord_system_[state.coord_system - 1];
+  } else {
+    current_origin_ = &home_position_;
+  }
+  global_offset_g92_ = state.g92_offset;
+  set_current_offset(state.g92_active ? global_offset_g92_ : kZeroOffset);
+  feedrate_ = state.feedrate;
+  pending_feedrate_ = state.feedrate;
+  axes_pos_ = state.position;
+  last_spline_cp2_ = kZeroOffset;
+  have_first_spline_ = false;
+}
+
+bool GCodeParser::Impl::ExecuteMove(GCodeParser *owner, int line_number,
+                                    bool rapid, float feedrate,
+                                    AxisBitmap_t axes,
+                                    const AxesRegister &values,
+                                    FILE *err_stream) {
+  line_number_ = (line_number > 0) ? line_number : line_number_ + 1;
+  gcode_lines_metric.Increment();
+  LATENCY_TRACE_SET_LINE(line_number_);
+  FILE *const outer_err_msg = err_msg_;
+  err_msg_ = err_stream;
+  if (while_loop_ != NULL) {
+    gprintf(GLOG_SEMANTIC_ERR, "binary move while collecting WHILE loop\n");
+    err_msg_ = outer_err_msg;
+    return false;
+  }
+  if (!program_in_progress_) {
+    callbacks->gcode_start(owner);
+    program_in_progress_ = true;
+  }
+  have_first_spline_ = false;
+  modal_g0_g1_ = rapid ? 0 : 1;
+  AxesRegister new_pos = axes_pos_;
+  for (GCodeParserAxis axis : AllAxes()) {
+    if (axes & (1 << axis))
+      new_pos[axis] = abs_axis_pos(axis, values[axis] * unit_to_mm_factor_);
+  }
+  emit_move(feedrate >= 0
+            ? f_param_to_feedrate(feedrate * unit_to_mm_factor_) : -1,
+            new_pos);
+  callbacks->gcode_command_done('G', modal_g0_g1_);
+  err_msg_ = outer_err_msg;
+  return true;
+}
+
+int GCodeParser::Impl::ParseFile(GCodeParser *owner, int input_fd,
+                                 FILE *err_stream, int lex_threads) {
+  struct stat st;
+  if (fstat(input_fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+    return ParseStream(owner, input_fd, err_stream);
+  char *const data = (char*) mmap(NULL, st.st_size, PROT_READ|PROT_WRITE,
+                                  MAP_PRIVATE, input_fd, 0);
+  if (data == MAP_FAILED)
+    return ParseStream(owner, input_fd, err_stream);
+  madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+  if (err_stream) {
+    // Output needs to be unbuffered, otherwise they'll never make it.
+    setvbuf(err_stream, NULL, _IONBF, 0);
+  }
+  if (lex_threads < 0) {
+    // The parser itself is busy on one core.
+    lex_threads = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+    if (lex_threads < 1) lex_threads = 1;  // Still useful to overlap I/O
+  }
+
+  arm_signal_handler();
+  {
+    LexPipeline pipeline(data, st.st_size,
+                         LinebufReader::CapacityFor(LINE_BUFFER_SIZE),
+                         lex_threads);
+    const LexedChunk *chunk;
+    while (!caught_signal && (chunk = pipeline.Next()) != NULL) {
+      lexed_chunk_ = chunk;
+      lexed_next_ = chunk->words.data();
+      lexed_end_ = lexed_next_ + chunk->words.size();
+      for (const char *line : chunk->lines) {
+        if (caught_signal) break;
+        ParseInputLine(owner, line, line == kOverlongLine, err_stream);
+      }
+    }
+    lexed_chunk_ = NULL;
+    lexed_next_ = lexed_end_ = NULL;
   }
   disarm_signal_handler();
+  munmap(data, st.st_size);
 
   if (caught_signal)
     return 2;
@@ -2011,7 +2915,7 @@ int GCodeParser::Impl::ParseStream(GCodeParser *owner,
   if (err_stream) {
     fflush(err_stream);
   }
-  fclose(gcode_stream);
+  close(input_fd);
 
   // always call gcode_finished() to disable motors at end of stream
   callbacks->gcode_finished(true);
@@ -2027,12 +2931,33 @@ GCodeParser::~GCodeParser() {
   delete impl_;
 }
 void GCodeParser::ParseLine(const char *line, FILE *err_stream) {
+  LATENCY_TRACE_START(trace_start);
   impl_->ParseLine(this, line, err_stream);
+  LATENCY_TRACE_END(LATENCY_PARSE, trace_start);
 }
 int GCodeParser::ParseStream(int input_fd, FILE *err_stream) {
   return impl_->ParseStream(this, input_fd, err_stream);
 }
+int GCodeParser::ParseFile(int input_fd, FILE *err_stream, int lex_threads) {
+  return impl_->ParseFile(this, input_fd, err_stream, lex_threads);
+}
+bool GCodeParser::GetModalState(ModalState *state) const {
+  return impl_->GetModalState(state);
+}
+void GCodeParser::SetModalState(const ModalState &state) {
+  impl_->SetModalState(state);
+}
+bool GCodeParser::ExecuteMove(int line_number, bool rapid, float feedrate,
+                              AxisBitmap_t axes, const AxesRegister &values,
+                              FILE *err_stream) {
+  LATENCY_TRACE_START(trace_start);
+  const bool result = impl_->ExecuteMove(this, line_number, rapid, feedrate,
+                                         axes, values, err_stream);
+  LATENCY_TRACE_END(LATENCY_PARSE, trace_start);
+  return result;
+}
 int GCodeParser::error_count() const { return impl_->error_count(); }
+int GCodeParser::line_number() const { return impl_->line_number(); }
 
 const char *GCodeParser::ParsePair(const char *line,
                                    char *letter, float *value,
@@ -30,6 +30,7 @@
 #include <stdint.h>
 #include <stdio.h>
 
+#include <memory>
 #include <string>
 #include <map>
 
@@ -139,6 +140,23 @@ public:
     virtual bool rapid_move(float feed_mm_p_sec,
                             const AxesRegister &absolute_pos) = 0;        // G0
 
+    // A coordinated move as handed to coordinated_moves().
+    struct Move {
+      float feed_mm_p_sec;
+      AxesRegister absolute_pos;
+      // Curvature (1/mm) in the XY plane along this move if it is part of a
+      // curve such as a spline; 0 for straight moves.
+      float curvature;
+    };
+    enum { MAX_MOVE_BATCH = 64 };   // Max moves in one coordinated_moves()
+
+    // A sequence of "count" coordinated moves, e.g. the line segments of a
+    // linearized arc or spline.
+    // The default implementation calls coordinated_move() for each of them;
+    // receivers that can handle a whole batch at once might want to
+    // override this. Returns true if all moves were successful.
+    virtual bool coordinated_moves(const Move *moves, int count);
+
     // G2, G3
     // Arc in a circular motion from current position around the "center"
     // coordinate to the "end" coordinate. These coordinates are absolute.
@@ -146,7 +164,7 @@ public:
     // Movement outside the axes orthogonal to the normal axis are linearly
     // interpolated from their current position (e.g. creating a spiral).
     //
-    // The default implementation linearlizes it and calls coordinated_move()
+    // The default implementation linearlizes it and calls coordinated_moves()
     // with small line segments.
     //
     // TODO(hzeller): We could probably generalize this by having a
@@ -158,11 +176,16 @@ public:
                           const AxesRegister &center,
                           const AxesRegister &end);
 
+    // Maximum distance in mm the line segments generated by the default
+    // arc_move() and spline_move() implementations may deviate from the
+    // true curve.
+    virtual float arc_max_chord_error() { return 0.001; }
+
     // G5, G5.1
     // Move in a cubic spine from absolute "start" to "end" given the absolute
     // control points "cp1" and "cp2".
-    // The default implementation linearlizes curve and calls coordinated_move()
-    // with the segments.
+    // The default implementation linearlizes curve and calls
+    // coordinated_moves() with the segments, which carry the curvature.
     virtual void spline_move(float feed_mm_p_sec,
                              const AxesRegister &start,
                              const AxesRegister &cp1, const AxesRegister &cp2,
@@ -182,11 +205,56 @@ public:
 
   // Configuration for the parser.
   struct Config {
-    typedef std::map<std::string, float> ParamMap;
+    // The NIST-RS274NGC parameters/variables.
+    // The original RS274 only supports integer variables; these are kept in
+    // an array so that accessing them does not involve any string handling.
+    // We also allow arbitrary variable names, which are kept in a map.
+    class ParamMap {
+    public:
+      enum { kNumberedParams = 5400 };
+      ParamMap();
+
+      // Access parameter by name, creating it if it does not exist yet.
+      // Names that are a number in the range of the numbered parameters,
+      // refer to these.
+      float &operator[](const std::string &name);
+
+      // Access numbered parameter 0 <= number < kNumberedParams.
+      float &operator[](int number) {
+        is_set_[number] = true;
+        return numbered_[number];
+      }
+
+      // Lookup parameter. Returns false if it has never been set.
+      bool Lookup(int number, float *value) const;
+      bool Lookup(const std::string &name, float *value) const;
+
+      // Return number of a parameter name or -1 if it is not a numbered one.
+      static int NumberFromName(const std::string &name);
+
+      // Iteration over all parameters that have been set: the numbered
+      // parameters in numerical order, the named ones in alphabetical order.
+      bool IsSet(int number) const { return is_set_[number]; }
+      typedef std::map<std::string, float> NamedMap;
+      const NamedMap &named() const { return named_; }
+
+    private:
+      float numbered_[kNumberedParams];
+      bool is_set_[kNumberedParams];
+      NamedMap named_;
+    };
+
     Config() : parameters(NULL) {}
-    Config(const std::string &filename) : parameters(NULL), paramfile(filename) {}
+    Config(const std::string &filename);
 
+    // Load the parameter file and replay the journal of changes since.
     bool LoadParams();
+
+    // Persist the parameters. Only the changes since the last load or save
+    // are appended to a journal next to the parameter file, so this is
+    // cheap to call often. Every couple of changes, or if nothing is known
+    // about the files yet, the parameter file is rewritten and the journal
+    // removed. Copies of this Config share what has been persisted.
     bool SaveParams() const;
 
     // The machine origin. This is where the end-switches are. Typically,
@@ -195,12 +263,13 @@ public:
     AxesRegister machine_origin;
 
     // The NIST-RS274NGC parameters/variables.
-    // This maps the name to the value of the parameter. The original RS274
-    // only supports integer variables, but we allow arbitrary variable names.
     ParamMap *parameters;
 
   private:
+    struct Persisted;
+
     const std::string paramfile;
+    std::shared_ptr<Persisted> persisted_;
   };
 
 public:
@@ -220,6 +289,13 @@ public:
   // The input file descriptor is closed.
   int ParseStream(int input_fd, FILE *err_stream);
 
+  // Like ParseStream(), but for regular files. The file is memory mapped
+  // and its letter/number pairs are found in a pre-pass using "lex_threads"
+  // threads (negative: one less than available CPUs, but at least one;
+  // zero: no threads), while the main thread is parsing.
+  // Other file descriptors are handed to ParseStream().
+  int ParseFile(int input_fd, FILE *err_stream, int lex_threads = -1);
+
   // Utility function: Parses next pair in the line of G-code (e.g. 'P123' is
   // a pair of the letter 'P' and the value '123').
   // Takes care of skipping whitespace, comments etc.
@@ -236,6 +312,43 @@ public:
   // Returns the remainder of the line or NULL if no pair has been found and the
   // end-of-string has been reached.
   //
+  // The modal state of the parser: everything needed to continue a program
+  // in the middle, e.g. to resume an interrupted job at a particular line.
+  // Parameters set by the program itself are not part of it.
+  struct ModalState {
+    int line_number;                      // Lines parsed so far.
+    int modal_g0_g1;                      // 0: G0; 1: G1
+    float unit_to_mm_factor;              // G21: 1.0; G20: 25.4
+    bool axis_is_absolute[GCODE_NUM_AXES];  // G90 or G91 per axis.
+    GCodeParserAxis arc_normal;           // G17, G18, G19
+    int coord_system;                     // 0: machine; 1..9: G54..G59.3
+    AxesRegister origin;                  // Absolute origin of coord_system.
+    bool g92_active;                      // G92 offset applied (not G92.2)
+    AxesRegister g92_offset;
+    float feedrate;                       // mm/s; negative if none seen yet.
+    AxesRegister position;                // Absolute machine position.
+  };
+
+  // Get the modal state after the last parsed line. Returns false if it
+  // can't be represented, that is if we're in the middle of a WHILE loop.
+  bool GetModalState(ModalState *state) const;
+
+  // Set the modal state, so that parsing continues as if all lines up to
+  // state.line_number had been parsed. The event receiver is informed about
+  // the origin; the feedrate is passed with the next coordinated move.
+  void SetModalState(const ModalState &state);
+
+  // Execute a G0 ("rapid") or G1 move that is already in binary form, as if
+  // it was a line with the given "line_number" (0: the next line), without
+  // parsing text. Only the "axes" set in the bitmap are taken from "values";
+  // like the axis letters and "feedrate" (F, negative if none) in a G-code
+  // line, they are in the current units and coordinate system.
+  // Returns false if the move can't be executed right now, i.e. while
+  // a WHILE loop is being collected.
+  bool ExecuteMove(int line_number, bool rapid, float feedrate,
+                   AxisBitmap_t axes, const AxesRegister &values,
+                   FILE *err_stream);
+
   // Resolves variables.
   const char *ParsePair(const char *line, char *letter, float *value,
                         FILE *err_stream);
@@ -243,6 +356,9 @@ public:
   // Number of errors seen.
   int error_count() const;
 
+  // Number of the line currently or last parsed, starting with 1.
+  int line_number() const;
+
 private:
   class Impl;
   Impl *impl_;
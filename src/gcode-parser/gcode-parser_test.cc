@@ -7,6 +7,7 @@
 #include <string.h>
 #include <strings.h>
 #include <math.h>
+#include <unistd.h>
 
 #include <gtest/gtest.h>
 
@@ -62,6 +63,51 @@ public:
     return parser_->error_count() == errors_before;
   }
 
+  // Parse the content from a file or, if "use_pipe", a pipe.
+  int TestParseStream(const std::string &content, bool use_pipe) {
+    int fd;
+    if (use_pipe) {
+      int pipefd[2];
+      EXPECT_EQ(0, pipe(pipefd));
+      // Small enough to fit into the pipe buffer.
+      EXPECT_EQ((ssize_t)content.size(),
+                write(pipefd[1], content.data(), content.size()));
+      close(pipefd[1]);
+      fd = pipefd[0];
+    } else {
+      FILE *tmp = tmpfile();
+      fwrite(content.data(), 1, content.size(), tmp);
+      fflush(tmp);
+      fd = dup(fileno(tmp));
+      fclose(tmp);
+      lseek(fd, 0, SEEK_SET);
+    }
+    return parser_->ParseStream(fd, stderr);
+  }
+
+  // Parse the content from a file with ParseFile().
+  int TestParseFile(const std::string &content, int lex_threads) {
+    FILE *tmp = tmpfile();
+    fwrite(content.data(), 1, content.size(), tmp);
+    fflush(tmp);
+    const int fd = dup(fileno(tmp));
+    fclose(tmp);
+    return parser_->ParseFile(fd, stderr, lex_threads);
+  }
+
+  int error_count() const { return parser_->error_count(); }
+  int line_number() const { return parser_->line_number(); }
+  GCodeParser *parser() { return parser_; }
+
+  // Parse the number as part of a word and return the remaining line.
+  const char *TestParseNumber(const char *number, float *value) {
+    const std::string word = std::string("X") + number;
+    char letter;
+    const char *rest = parser_->ParsePair(word.c_str(), &letter, value, NULL);
+    if (rest == NULL) return NULL;
+    return number + (rest - word.c_str() - 1);
+  }
+
   // -- gcode parser callbacks
   void gcode_start(GCodeParser *) final { Count(CALL_gcode_start); }
   void gcode_finished(bool) final { Count(CALL_gcode_finished); }
@@ -81,10 +127,12 @@ public:
     Count(CALL_coordinated_move);
     abs_pos = axes;
     feedrate = feed_mm_p_sec;
+    RecordPath(axes);
     return true;
   }
   bool rapid_move(float feed_mm_p_sec, const AxesRegister &axes) final {
     Count(CALL_rapid_move);
+    RecordPath(axes);
     abs_pos = axes;
     feedrate = feed_mm_p_sec;
     return true;
@@ -107,9 +155,15 @@ public:
   AxesRegister abs_pos;         // last coordinates we got from a move.
   AxesRegister parser_offset;   // current offset in the parser
   float feedrate;
+  double path_checksum = 0;     // All positions we moved to.
 
 private:
   void Count(int what) { call_count[what]++; }
+  void RecordPath(const AxesRegister &axes) {
+    for (int i = 0; i < GCODE_NUM_AXES; ++i) {
+      path_checksum = path_checksum * 1.0001 + axes[(GCodeParserAxis)i];
+    }
+  }
   GCodeParser::Config::ParamMap parameters_;
   GCodeParser *parser_;
 };
@@ -884,6 +938,476 @@ TEST(GCodeParserTest, WhileLoop) {
   EXPECT_EQ(1024, counter.get_parameter(2));
 }
 
+TEST(GCodeParserTest, ParseStream) {
+  for (bool use_pipe : { false, true }) {
+    ParseTester counter;
+    // Mixed line endings; the last line is not terminated.
+    EXPECT_EQ(0, counter.TestParseStream("G1 X1\nG1 X2\r\n\nG1 X3\rG1 X4 Y5",
+                                         use_pipe));
+    EXPECT_EQ(4, counter.call_count[CALL_coordinated_move]);
+    EXPECT_EQ(HOME_X + 4, counter.abs_pos[AXIS_X]);
+    EXPECT_EQ(HOME_Y + 5, counter.abs_pos[AXIS_Y]);
+    EXPECT_EQ(1, counter.call_count[CALL_gcode_finished]);
+  }
+}
+
+TEST(GCodeParserTest, ParseStreamLargeFile) {
+  ParseTester counter;
+  std::string content;
+  for (int i = 1; i <= 20000; ++i) {
+    content.append(StringPrintf("G1 X%d ; some comment to make it longer\n", i));
+  }
+  EXPECT_EQ(0, counter.TestParseStream(content, false));
+  EXPECT_EQ(20000, counter.call_count[CALL_coordinated_move]);
+  EXPECT_EQ(HOME_X + 20000, counter.abs_pos[AXIS_X]);
+}
+
+// A bit of everything, long enough to be split into multiple chunks.
+static std::string MixedProgram() {
+  std::string result = "#<_scale>=2\n";
+  for (int i = 0; i < 100000; ++i) {
+    switch (i % 10) {
+    case 0: result += StringPrintf("G1 X%d Y%d.5 F1000\n", i % 100, i % 77);
+      break;
+    case 1: result += StringPrintf("G0 X [%d * #<_scale>] (comment) Y-%d\r\n",
+                                   i % 50, i % 33); break;
+    case 2: result += StringPrintf("#1=%d\nX#1 Y[#1/2]\n", i % 20); break;
+    case 3: result += "WHILE [#1 > 0] DO\nG1 X#1\n#1--\nEND\n"; break;
+    case 4: result += StringPrintf("g1x%dy%d\rG1 Z-.%d\n", i % 9, i % 13, i);
+      break;
+    case 5: result += "IF [#1 == 0] THEN #2=[#2+1]\n"; break;
+    case 6: result += StringPrintf("N%d G1 X%d *42\n", i, i % 7); break;
+    case 7: result += (i % 10000 == 7)   // Occasional error.
+        ? "G1 X1 Y ; trailing comment\n\n" : "G1 X1 ; trailing comment\n\n";
+      break;
+    case 8: result += StringPrintf("G2 X%d Y0 I5 J0\n", i % 10); break;
+    case 9: result += (i % 10000 == 9) ? "M3 S100 G1 X--3\n" : "M5\n"; break;
+    }
+  }
+  return result + "G1 X42 Y23";  // Last line without newline.
+}
+
+TEST(GCodeParserTest, ParseFileSameAsParseStream) {
+  const std::string program = MixedProgram();
+  ASSERT_GT(program.size(), 1u << 20);  // Multiple chunks.
+  ParseTester expected;
+  EXPECT_EQ(0, expected.TestParseStream(program, false));
+  for (int threads : { 0, 1, 3 }) {
+    ParseTester counter;
+    EXPECT_EQ(0, counter.TestParseFile(program, threads));
+    for (int i = 0; i < NUM_COUNTED_CALLS; ++i) {
+      EXPECT_EQ(expected.call_count[i], counter.call_count[i])
+        << "call " << i << "; threads=" << threads;
+    }
+    EXPECT_EQ(expected.path_checksum, counter.path_checksum);
+    EXPECT_EQ(expected.error_count(), counter.error_count());
+    EXPECT_EQ(expected.line_number(), counter.line_number());
+    EXPECT_EQ(expected.get_parameter(2), counter.get_parameter(2));
+    EXPECT_EQ(HOME_X + 42, counter.abs_pos[AXIS_X]);
+  }
+}
+
+TEST(GCodeParserTest, ParseFileSkipsOverlongLines) {
+  const std::string overlong = "G1 X5 ; " + std::string(100000, 'x');
+  const std::string program = "G1 X1\n" + overlong + "\nG1 X2\n" + overlong;
+  ParseTester expected;
+  EXPECT_EQ(0, expected.TestParseStream(program, false));
+  EXPECT_EQ(2, expected.error_count());
+  for (int threads : { 0, 1 }) {
+    ParseTester counter;
+    EXPECT_EQ(0, counter.TestParseFile(program, threads));
+    EXPECT_EQ(2, counter.error_count()) << "threads=" << threads;
+    EXPECT_EQ(expected.line_number(), counter.line_number());
+    EXPECT_EQ(expected.call_count[CALL_coordinated_move],
+              counter.call_count[CALL_coordinated_move]);
+    EXPECT_EQ(HOME_X + 2, counter.abs_pos[AXIS_X]);
+  }
+}
+
+TEST(GCodeParserTest, WhileLoopMultipleStatements) {
+  ParseTester counter;
+
+  EXPECT_TRUE(counter.TestParseLine("#1=0"));
+  EXPECT_TRUE(counter.TestParseLine("WHILE [#1 < 10] DO"));
+  EXPECT_TRUE(counter.TestParseLine("G1 X[#1] F1000"));
+  EXPECT_TRUE(counter.TestParseLine("#1++"));
+  EXPECT_TRUE(counter.TestParseLine("END"));
+  EXPECT_EQ(10, counter.get_parameter(1));
+  EXPECT_EQ(10, counter.call_count[CALL_coordinated_move]);
+  EXPECT_EQ(HOME_X + 9, counter.abs_pos[AXIS_X]);
+}
+
+TEST(GCodeParserTest, NestedWhileLoop) {
+  ParseTester counter;
+
+  EXPECT_TRUE(counter.TestParseLine("#1=0"));
+  EXPECT_TRUE(counter.TestParseLine("#3=0"));
+  EXPECT_TRUE(counter.TestParseLine("WHILE [#1 < 3] DO"));
+  EXPECT_TRUE(counter.TestParseLine("#2=0"));
+  EXPECT_TRUE(counter.TestParseLine("WHILE [#2 < 4] DO"));
+  EXPECT_TRUE(counter.TestParseLine("G1 X[#1] Y[#2] F1000"));
+  EXPECT_TRUE(counter.TestParseLine("#2++"));
+  EXPECT_TRUE(counter.TestParseLine("END"));
+  EXPECT_EQ(0, counter.call_count[CALL_coordinated_move]);  // Not yet.
+  EXPECT_TRUE(counter.TestParseLine("#3 += #2"));
+  EXPECT_TRUE(counter.TestParseLine("#1++"));
+  EXPECT_TRUE(counter.TestParseLine("END"));
+  EXPECT_EQ(3, counter.get_parameter(1));
+  EXPECT_EQ(12, counter.get_parameter(3));
+  EXPECT_EQ(12, counter.call_count[CALL_coordinated_move]);
+  EXPECT_EQ(HOME_X + 2, counter.abs_pos[AXIS_X]);
+  EXPECT_EQ(HOME_Y + 3, counter.abs_pos[AXIS_Y]);
+
+  // After the loop, we're back to regular parsing.
+  EXPECT_TRUE(counter.TestParseLine("G1 X42"));
+  EXPECT_EQ(13, counter.call_count[CALL_coordinated_move]);
+}
+
+TEST(GCodeParserTest, RepeatedExpressions) {
+  ParseTester counter;
+  // Same expression text, different parameter values each time.
+  EXPECT_TRUE(counter.TestParseLine("#<_foo>=2"));
+  for (int i = 1; i <= 3; ++i) {
+    EXPECT_TRUE(counter.TestParseLine(StringPrintf("#1=%d", i).c_str()));
+    EXPECT_TRUE(counter.TestParseLine("#2=[#1 * #<_FOO> + ##3 - -1]"));
+    EXPECT_EQ(2 * i + 1, counter.get_parameter(2));
+  }
+  EXPECT_TRUE(counter.TestParseLine("#3=1"));  // ##3 is #1 now.
+  EXPECT_TRUE(counter.TestParseLine("#2=[#1 * #<_FOO> + ##3 - -1]"));
+  EXPECT_EQ(3 * 2 + 3 + 1, counter.get_parameter(2));
+
+  EXPECT_TRUE(counter.TestParseLine("#4=[ATAN[1]/[1] + SQRT[[#1 + 1] * 4]]"));
+  EXPECT_FLOAT_EQ(45 + 4, counter.get_parameter(4));
+  EXPECT_TRUE(counter.TestParseLine("#4=[ATAN[1]/[1] + SQRT[[#1 + 1] * 4]]"));
+  EXPECT_FLOAT_EQ(45 + 4, counter.get_parameter(4));
+
+  // Errors at evaluation time are reported every time.
+  EXPECT_TRUE(counter.TestParseLine("#5=0"));
+  EXPECT_FALSE(counter.TestParseLine("#6=[1 / #5]"));
+  EXPECT_FALSE(counter.TestParseLine("#6=[1 / #5]"));
+  EXPECT_TRUE(counter.TestParseLine("#5=4"));
+  EXPECT_TRUE(counter.TestParseLine("#6=[1 / #5]"));
+  EXPECT_EQ(0.25, counter.get_parameter(6));
+
+  // Syntax errors are never cached.
+  EXPECT_FALSE(counter.TestParseLine("#6=[1 + ]"));
+  EXPECT_FALSE(counter.TestParseLine("#6=[1 + ]"));
+}
+
+TEST(GCodeParserTest, ManyDifferentExpressions) {
+  ParseTester counter;
+  // More different expressions than we keep.
+  for (int i = 0; i < 3000; ++i) {
+    EXPECT_TRUE(counter.TestParseLine(
+                  StringPrintf("#1=[%d + %d]", i, i % 7).c_str()));
+    EXPECT_EQ(i + i % 7, counter.get_parameter(1));
+  }
+}
+
+// Numbers are exactly as strtof() parses them.
+static void ExpectNumberLikeStrtof(ParseTester *tester, const char *number) {
+  float value;
+  const char *rest = tester->TestParseNumber(number, &value);
+  ASSERT_TRUE(rest != NULL) << number;
+  char *expected_rest;
+  const float expected = strtof(number, &expected_rest);
+  EXPECT_EQ(expected_rest, rest) << number;
+  EXPECT_EQ(0, memcmp(&expected, &value, sizeof(float)))
+    << number << " expected " << expected << " got " << value;
+}
+
+// Binary moves are the same as the corresponding G-code lines.
+TEST(GCodeParserTest, ExecuteMoveLikeParsedLine) {
+  ParseTester parsed, binary;
+  for (ParseTester *t : { &parsed, &binary }) {
+    EXPECT_TRUE(t->TestParseLine("G20 G56"));
+  }
+  EXPECT_TRUE(parsed.TestParseLine("G1 X1 Y2 F100"));
+  const float parsed_feedrate = parsed.feedrate;
+  EXPECT_TRUE(parsed.TestParseLine("G91 G0 Y0.5"));
+
+  AxesRegister values;
+  values[AXIS_X] = 1;
+  values[AXIS_Y] = 2;
+  values[AXIS_Z] = 42;  // Not in bitmap, ignored.
+  ASSERT_TRUE(binary.parser()->ExecuteMove(0, false, 100,
+                                           (1 << AXIS_X) | (1 << AXIS_Y),
+                                           values, stderr));
+  EXPECT_FLOAT_EQ(parsed_feedrate, binary.feedrate);
+  EXPECT_TRUE(binary.TestParseLine("G91"));
+  values[AXIS_Y] = 0.5;
+  ASSERT_TRUE(binary.parser()->ExecuteMove(42, true, -1, 1 << AXIS_Y,
+                                           values, stderr));
+  EXPECT_EQ(42, binary.line_number());
+  EXPECT_EQ(parsed.feedrate, binary.feedrate);
+  for (GCodeParserAxis a : AllAxes()) {
+    EXPECT_FLOAT_EQ(parsed.abs_pos[a], binary.abs_pos[a]);
+  }
+  EXPECT_EQ(parsed.call_count[CALL_coordinated_move],
+            binary.call_count[CALL_coordinated_move]);
+  EXPECT_EQ(parsed.call_count[CALL_rapid_move],
+            binary.call_count[CALL_rapid_move]);
+}
+
+TEST(GCodeParserTest, ModalStateRestored) {
+  ParseTester original;
+  EXPECT_TRUE(original.TestParseLine("G10 L2 P2 X10 Y20"));
+  EXPECT_TRUE(original.TestParseLine("G20 G55 G18"));
+  EXPECT_TRUE(original.TestParseLine("G1 X1 Y1 F100"));
+  EXPECT_TRUE(original.TestParseLine("G92 X0"));
+  EXPECT_TRUE(original.TestParseLine("G91"));
+  GCodeParser::ModalState state;
+  ASSERT_TRUE(original.parser()->GetModalState(&state));
+  EXPECT_EQ(5, state.line_number);
+  EXPECT_EQ(2, state.coord_system);
+  EXPECT_EQ(AXIS_Y, state.arc_normal);
+  EXPECT_FLOAT_EQ(100 * 25.4 / 60, state.feedrate);
+
+  ParseTester resumed;
+  resumed.parser()->SetModalState(state);
+  EXPECT_EQ(5, resumed.line_number());
+  for (int i = 0; i < AXIS_Z; ++i) {
+    const GCodeParserAxis a = (GCodeParserAxis) i;
+    EXPECT_EQ(original.parser_offset[a], resumed.parser_offset[a]);
+  }
+
+  // The next relative move ends up in the same place; the resumed parser
+  // also passes on the restored feedrate as it has not been sent yet.
+  EXPECT_TRUE(original.TestParseLine("X1 Y-1"));
+  EXPECT_TRUE(resumed.TestParseLine("X1 Y-1"));
+  EXPECT_EQ(original.abs_pos[AXIS_X], resumed.abs_pos[AXIS_X]);
+  EXPECT_EQ(original.abs_pos[AXIS_Y], resumed.abs_pos[AXIS_Y]);
+  EXPECT_EQ(-1, original.feedrate);
+  EXPECT_FLOAT_EQ(100 * 25.4 / 60, resumed.feedrate);
+  EXPECT_TRUE(resumed.TestParseLine("X1"));
+  EXPECT_EQ(-1, resumed.feedrate);
+  EXPECT_EQ(7, resumed.line_number());
+
+  // No consistent state while we collect a loop.
+  EXPECT_TRUE(original.TestParseLine("WHILE [1 EQ 0] DO"));
+  EXPECT_FALSE(original.parser()->GetModalState(&state));
+  EXPECT_TRUE(original.TestParseLine("END"));
+  EXPECT_TRUE(original.parser()->GetModalState(&state));
+}
+
+TEST(GCodeParserTest, ParamMapNumberedAndNamed) {
+  GCodeParser::Config::ParamMap params;
+  float value;
+  EXPECT_FALSE(params.Lookup(5220, &value));
+  params["5220"] = 2;
+  EXPECT_TRUE(params.Lookup(5220, &value));
+  EXPECT_EQ(2, value);
+  EXPECT_EQ(2, params[5220]);
+  EXPECT_TRUE(params.named().empty());  // Numbers don't end up in the map.
+
+  params["_foo"] = 3;
+  params["6000"] = 4;                   // Beyond the numbered parameters.
+  EXPECT_TRUE(params.Lookup("_foo", &value));
+  EXPECT_EQ(3, value);
+  EXPECT_EQ(2u, params.named().size());
+  EXPECT_FALSE(params.Lookup("bar", &value));
+  EXPECT_EQ(0, value);
+}
+
+TEST(GCodeParserTest, SaveAndLoadParams) {
+  char tmpl[] = "/tmp/gcode-params.XXXXXX";
+  const int fd = mkstemp(tmpl);
+  ASSERT_GE(fd, 0);
+  close(fd);
+  {
+    GCodeParser::Config config(tmpl);
+    GCodeParser::Config::ParamMap params;
+    config.parameters = &params;
+    params[5221] = 10;
+    params[31] = 3.5;
+    params[100] = 0;           // Zeroes are not written.
+    params["_global"] = 42;
+    params["local"] = 17;      // Only global parameters are written.
+    EXPECT_TRUE(config.SaveParams());
+  }
+
+  FILE *fp = fopen(tmpl, "r");
+  ASSERT_TRUE(fp != NULL);
+  char buf[1024];
+  const size_t len = fread(buf, 1, sizeof(buf) - 1, fp);
+  fclose(fp);
+  buf[len] = '\0';
+  // Numeric parameters sorted numerically, followed by the named ones.
+  EXPECT_EQ("31\t3.500000\n"
+            "5221\t10.000000\n"
+            "\n# Alphanumeric global parameters\n"
+            "_global\t42.000000\n",
+            std::string(buf));
+
+  GCodeParser::Config config(tmpl);
+  GCodeParser::Config::ParamMap params;
+  config.parameters = &params;
+  EXPECT_TRUE(config.LoadParams());
+  float value;
+  EXPECT_TRUE(params.Lookup(5220, &value));
+  EXPECT_EQ(1, value);                 // Default coordinate system.
+  EXPECT_TRUE(params.Lookup(5221, &value));
+  EXPECT_EQ(10, value);
+  EXPECT_TRUE(params.Lookup(31, &value));
+  EXPECT_EQ(3.5, value);
+  EXPECT_FALSE(params.Lookup(100, &value));
+  EXPECT_TRUE(params.Lookup("_global", &value));
+  EXPECT_EQ(42, value);
+  EXPECT_FALSE(params.Lookup("local", &value));
+  unlink(tmpl);
+  unlink((std::string(tmpl) + ".bak").c_str());
+}
+
+static std::string FileContent(const std::string &filename) {
+  std::string result;
+  FILE *fp = fopen(filename.c_str(), "r");
+  if (!fp) return result;
+  char buf[1024];
+  size_t len;
+  while ((len = fread(buf, 1, sizeof(buf), fp)) > 0)
+    result.append(buf, len);
+  fclose(fp);
+  return result;
+}
+
+static float LoadedParam(const char *paramfile, int number) {
+  GCodeParser::Config config(paramfile);
+  GCodeParser::Config::ParamMap params;
+  config.parameters = &params;
+  EXPECT_TRUE(config.LoadParams());
+  float value;
+  params.Lookup(number, &value);
+  return value;
+}
+
+TEST(GCodeParserTest, ParamChangesAreJournaled) {
+  char tmpl[] = "/tmp/gcode-params.XXXXXX";
+  close(mkstemp(tmpl));
+  const std::string journal = std::string(tmpl) + ".journal";
+  GCodeParser::Config config(tmpl);
+  GCodeParser::Config::ParamMap params;
+  config.parameters = &params;
+  params[5221] = 10;
+  params["_global"] = 42;
+  EXPECT_TRUE(config.SaveParams());    // Nothing known: full file.
+  const std::string full_file = FileContent(tmpl);
+  EXPECT_EQ("", FileContent(journal));
+
+  params[5221] = 11;
+  params[31] = 2;
+  params["local"] = 5;
+  EXPECT_TRUE(config.SaveParams());
+  EXPECT_EQ(full_file, FileContent(tmpl));
+  EXPECT_EQ("31\t2.000000\n5221\t11.000000\n", FileContent(journal));
+
+  // Copies share what has been written.
+  GCodeParser::Config copy = config;
+  params[5221] = 0;
+  EXPECT_TRUE(copy.SaveParams());
+  EXPECT_TRUE(config.SaveParams());
+  EXPECT_EQ("31\t2.000000\n5221\t11.000000\n5221\t0.000000\n",
+            FileContent(journal));
+
+  EXPECT_EQ(0, LoadedParam(tmpl, 5221));
+  EXPECT_EQ(2, LoadedParam(tmpl, 31));
+
+  // A change that was not completely written before power went out.
+  FILE *fp = fopen(journal.c_str(), "a");
+  fprintf(fp, "31\t7.0");
+  fclose(fp);
+  EXPECT_EQ(2, LoadedParam(tmpl, 31));
+
+  unlink(tmpl);
+  unlink((std::string(tmpl) + ".bak").c_str());
+  unlink(journal.c_str());
+}
+
+TEST(GCodeParserTest, ParamJournalIsCompacted) {
+  char tmpl[] = "/tmp/gcode-params.XXXXXX";
+  close(mkstemp(tmpl));
+  const std::string journal = std::string(tmpl) + ".journal";
+  {
+    GCodeParser::Config config(tmpl);
+    GCodeParser::Config::ParamMap params;
+    config.parameters = &params;
+    EXPECT_TRUE(config.LoadParams());
+    bool compacted = false;
+    for (int i = 1; i <= 1000; ++i) {
+      params[31] = i;
+      EXPECT_TRUE(config.SaveParams());
+      if (i > 1 && FileContent(journal).empty()) compacted = true;
+    }
+    EXPECT_TRUE(compacted);
+    EXPECT_LT(FileContent(journal).size(), 256 * strlen("31\t1000.000000\n"));
+  }
+  EXPECT_EQ(1000, LoadedParam(tmpl, 31));
+
+  // Interrupted after writing the new parameter file, but before removing
+  // the journal: replaying it does not change anything.
+  const std::string old_journal = FileContent(journal);
+  {
+    GCodeParser::Config config(tmpl);
+    GCodeParser::Config::ParamMap params;
+    config.parameters = &params;
+    EXPECT_TRUE(config.LoadParams());
+    params[31] = 1001;
+    EXPECT_TRUE(config.SaveParams());
+  }
+  {
+    // Journal had everything.
+    FILE *fp = fopen(journal.c_str(), "w");
+    fprintf(fp, "%s31\t1001.000000\n", old_journal.c_str());
+    fclose(fp);
+  }
+  EXPECT_EQ(1001, LoadedParam(tmpl, 31));
+
+  unlink(tmpl);
+  unlink((std::string(tmpl) + ".bak").c_str());
+  unlink(journal.c_str());
+}
+
+TEST(GCodeParserTest, NumbersExact) {
+  ParseTester counter;
+  for (const char *number : { "0", "-0", "+0", "1", "-1", "1.", "-.5", "+.5",
+          "007", "0.000001", "123.456", "1.2.3", "1-2", "16777215",
+          "16777216", "16777217", "123456789012", "0.1234567890123",
+          "000000000000000000000000000000000000012" }) {
+    ExpectNumberLikeStrtof(&counter, number);
+  }
+
+  // All numbers with up to six digits, with and without sign, with the
+  // decimal point in all possible places.
+  char buffer[16];
+  for (int i = 0; i < 1000000; i += (i < 10000) ? 1 : 7) {
+    for (int point = 0; point <= 6; ++point) {
+      const int len = snprintf(buffer, sizeof(buffer), "-%06d", i);
+      memmove(buffer + 1 + point + 1, buffer + 1 + point, len - point);
+      buffer[1 + point] = '.';
+      ExpectNumberLikeStrtof(&counter, buffer);
+      ExpectNumberLikeStrtof(&counter, buffer + 1);
+    }
+  }
+}
+
+// No exponent in G-code numbers; that is the next word.
+TEST(GCodeParserTest, NumbersEndOfWord) {
+  ParseTester counter;
+  float value;
+  EXPECT_EQ(std::string("E5"), counter.TestParseNumber("1E5", &value));
+  EXPECT_EQ(1.0f, value);
+  EXPECT_EQ(std::string("Y1"), counter.TestParseNumber("-4.25 Y1", &value));
+  EXPECT_EQ(-4.25f, value);
+}
+
+TEST(GCodeParserTest, NumbersInvalid) {
+  ParseTester counter;
+  float value;
+  EXPECT_EQ(NULL, counter.TestParseNumber(".", &value));
+  EXPECT_EQ(NULL, counter.TestParseNumber("-", &value));
+  EXPECT_EQ(NULL, counter.TestParseNumber("-.", &value));
+  EXPECT_EQ(NULL, counter.TestParseNumber("", &value));
+}
+
 int main(int argc, char *argv[]) {
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
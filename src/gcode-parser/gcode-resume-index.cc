@@ -0,0 +1,358 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "gcode-resume-index.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <initializer_list>
+
+#include "common/logging.h"
+
+#define INDEX_HEADER "# BeagleG resume index"
+
+namespace {
+// Swallows all events; we're only interested in the parser state.
+class NullReceiver : public GCodeParser::EventReceiver {
+public:
+  void gcode_start(GCodeParser *parser) final {}
+  void go_home(AxisBitmap_t axis_bitmap) final {}
+  void set_speed_factor(float factor) final {}
+  void set_fanspeed(float value) final {}
+  void set_temperature(float degrees_c) final {}
+  void wait_temperature() final {}
+  void dwell(float time_ms) final {}
+  void motors_enable(bool enable) final {}
+  bool coordinated_move(float feed, const AxesRegister &pos) final {
+    return true;
+  }
+  bool rapid_move(float feed, const AxesRegister &pos) final { return true; }
+  void arc_move(float feed, GCodeParserAxis normal_axis, bool clockwise,
+                const AxesRegister &start, const AxesRegister &center,
+                const AxesRegister &end) final {}
+  void spline_move(float feed, const AxesRegister &start,
+                   const AxesRegister &cp1, const AxesRegister &cp2,
+                   const AxesRegister &end) final {}
+  const char *unprocessed(char letter, float value,
+                          const char *rest_of_line) final {
+    return NULL;
+  }
+};
+
+// A parser that doesn't execute anything and works on a copy of the
+// parameters. Without a parameter file, M500 doesn't write anything.
+// Errors are reported once the lines are executed, so they are not
+// shown here.
+class ScratchParser {
+public:
+  ScratchParser(const GCodeParser::Config &config)
+    : quiet_(fopen("/dev/null", "w")) {
+    scratch_config_.machine_origin = config.machine_origin;
+    if (config.parameters) parameters_ = *config.parameters;
+    scratch_config_.parameters = &parameters_;
+    parser_ = new GCodeParser(scratch_config_, &receiver_, false);
+  }
+  ~ScratchParser() {
+    delete parser_;
+    if (quiet_) fclose(quiet_);
+  }
+
+  void ParseLine(const std::string &line) {
+    parser_->ParseLine(line.c_str(), quiet_);
+  }
+  GCodeParser *operator->() { return parser_; }
+
+private:
+  FILE *const quiet_;
+  GCodeParser::Config scratch_config_;
+  GCodeParser::Config::ParamMap parameters_;
+  NullReceiver receiver_;
+  GCodeParser *parser_;
+};
+
+// Read-only memory mapping of a G-code file.
+class MappedFile {
+public:
+  MappedFile(const char *filename) : data_(NULL), size_(0), mtime_(0) {
+    const int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+      Log_error("Can't open %s: %s", filename, strerror(errno));
+      return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+      void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (data != MAP_FAILED) {
+        madvise(data, st.st_size, MADV_SEQUENTIAL);
+        data_ = (const char*) data;
+        size_ = st.st_size;
+        mtime_ = st.st_mtime;
+      }
+    }
+    if (!data_) {
+      Log_error("%s: can only index non-empty regular files.", filename);
+    }
+    close(fd);
+  }
+  ~MappedFile() {
+    if (data_) munmap((void*) data_, size_);
+  }
+
+  bool ok() const { return data_ != NULL; }
+  uint64_t size() const { return size_; }
+  int64_t mtime() const { return mtime_; }
+
+  // Copy line starting at "*pos" to "line" and advance "*pos" to the next
+  // one. Line endings are the same as in GCodeStreamer::ConnectFile().
+  // Returns false if there are no more lines.
+  bool ReadLine(uint64_t *pos, std::string *line) const {
+    if (*pos >= size_) return false;
+    const char *start = data_ + *pos;
+    const size_t remaining = size_ - *pos;
+    const char *end = (const char*) memchr(start, '\n', remaining);
+    const char *cr = (const char*) memchr(start, '\r',
+                                          end ? end - start : remaining);
+    if (cr) end = cr;
+    if (end == NULL) {
+      line->assign(start, remaining);
+      *pos = size_;
+      return true;
+    }
+    line->assign(start, end - start);
+    *pos = end - data_ + 1;
+    if (*end == '\r' && *pos < size_ && data_[*pos] == '\n')
+      ++*pos;
+    return true;
+  }
+
+private:
+  const char *data_;
+  uint64_t size_;
+  int64_t mtime_;
+};
+
+bool FileStat(const char *filename, uint64_t *size, int64_t *mtime) {
+  struct stat st;
+  if (stat(filename, &st) != 0) return false;
+  *size = st.st_size;
+  *mtime = st.st_mtime;
+  return true;
+}
+}  // namespace
+
+GCodeResumeIndex::GCodeResumeIndex() : file_size_(0), file_mtime_(0) {}
+
+std::string GCodeResumeIndex::IndexFilename(const std::string &gcode_file) {
+  return gcode_file + ".resume-index";
+}
+
+bool GCodeResumeIndex::Build(const char *gcode_file,
+                             const GCodeParser::Config &config,
+                             int interval) {
+  snapshots_.clear();
+  MappedFile file(gcode_file);
+  if (!file.ok()) return false;
+  gcode_file_ = gcode_file;
+  file_size_ = file.size();
+  file_mtime_ = file.mtime();
+  if (interval < 1) interval = 1;
+
+  ScratchParser parser(config);
+  std::string line;
+  uint64_t pos = 0;
+  int line_number = 1;  // The line we're about to parse.
+  int next_snapshot = 1;
+  Snapshot snapshot;
+  while (pos < file.size()) {
+    if (line_number >= next_snapshot
+        && parser->GetModalState(&snapshot.state)) {
+      snapshot.state.line_number = line_number - 1;
+      snapshot.offset = pos;
+      snapshots_.push_back(snapshot);
+      next_snapshot = line_number + interval;
+    }
+    file.ReadLine(&pos, &line);
+    parser.ParseLine(line);
+    ++line_number;
+  }
+  Log_debug("%s: %d lines, %d resume snapshots.", gcode_file,
+            line_number - 1, (int)snapshots_.size());
+  return true;
+}
+
+// Each snapshot is one line of text with its line number, offset and the
+// modal state. The floats are written with enough digits to read back
+// exactly the same value.
+bool GCodeResumeIndex::Save(const char *index_file) const {
+  const std::string tmp_name = std::string(index_file) + ".tmp";
+  FILE *fp = fopen(tmp_name.c_str(), "w");
+  if (!fp) {
+    Log_error("Can't write %s: %s", tmp_name.c_str(), strerror(errno));
+    return false;
+  }
+  fprintf(fp, "%s\n", INDEX_HEADER);
+  fprintf(fp, "source %llu %lld\n", (unsigned long long)file_size_,
+          (long long)file_mtime_);
+  for (const Snapshot &s : snapshots_) {
+    const GCodeParser::ModalState &m = s.state;
+    AxisBitmap_t absolute = 0;
+    for (GCodeParserAxis a : AllAxes()) {
+      if (m.axis_is_absolute[a]) absolute |= (1 << a);
+    }
+    fprintf(fp, "snapshot %d %llu %d %.9g %u %d %d %d %.9g",
+            m.line_number, (unsigned long long)s.offset,
+            m.modal_g0_g1, m.unit_to_mm_factor, (unsigned)absolute,
+            m.arc_normal, m.coord_system, m.g92_active, m.feedrate);
+    for (const AxesRegister *reg : { &m.origin, &m.g92_offset, &m.position }) {
+      for (GCodeParserAxis a : AllAxes()) {
+        fprintf(fp, " %.9g", (*reg)[a]);
+      }
+    }
+    fprintf(fp, "\n");
+  }
+  const bool success = (fclose(fp) == 0);
+  if (!success || rename(tmp_name.c_str(), index_file) != 0) {
+    Log_error("Can't write %s: %s", index_file, strerror(errno));
+    unlink(tmp_name.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool GCodeResumeIndex::Load(const char *index_file, const char *gcode_file) {
+  snapshots_.clear();
+  uint64_t size;
+  int64_t mtime;
+  if (!FileStat(gcode_file, &size, &mtime)) {
+    Log_error("Can't stat %s: %s", gcode_file, strerror(errno));
+    return false;
+  }
+  FILE *fp = fopen(index_file, "r");
+  if (!fp) return false;
+
+  bool success = false;
+  char buffer[2048];
+  unsigned long long index_size;
+  long long index_mtime;
+  if (fgets(buffer, sizeof(buffer), fp) == NULL
+      || strncmp(buffer, INDEX_HEADER, strlen(INDEX_HEADER)) != 0
+      || fgets(buffer, sizeof(buffer), fp) == NULL
+      || sscanf(buffer, "source %llu %lld", &index_size, &index_mtime) != 2) {
+    Log_error("%s: not a resume index.", index_file);
+  } else if (index_size != size || index_mtime != mtime) {
+    Log_info("%s: outdated for %s.", index_file, gcode_file);
+  } else {
+    success = true;
+    int line = 2;
+    while (success && fgets(buffer, sizeof(buffer), fp)) {
+      ++line;
+      Snapshot s;
+      GCodeParser::ModalState &m = s.state;
+      unsigned long long offset;
+      unsigned absolute;
+      int arc_normal, g92_active, consumed;
+      success = (sscanf(buffer, "snapshot %d %llu %d %f %u %d %d %d %f%n",
+                        &m.line_number, &offset, &m.modal_g0_g1,
+                        &m.unit_to_mm_factor, &absolute, &arc_normal,
+                        &m.coord_system, &g92_active, &m.feedrate,
+                        &consumed) == 9)
+        && arc_normal >= 0 && arc_normal < GCODE_NUM_AXES
+        && (snapshots_.empty()
+            || m.line_number > snapshots_.back().state.line_number);
+      const char *pos = buffer + (success ? consumed : 0);
+      for (AxesRegister *reg : { &m.origin, &m.g92_offset, &m.position }) {
+        for (GCodeParserAxis a : AllAxes()) {
+          if (!success) break;
+          char *end;
+          (*reg)[a] = strtof(pos, &end);
+          success = (end != pos);
+          pos = end;
+        }
+      }
+      if (!success) {
+        Log_error("%s:%d: invalid snapshot.", index_file, line);
+        break;
+      }
+      s.offset = offset;
+      for (GCodeParserAxis a : AllAxes()) {
+        m.axis_is_absolute[a] = (absolute & (1 << a)) != 0;
+      }
+      m.arc_normal = (GCodeParserAxis) arc_normal;
+      m.g92_active = g92_active;
+      snapshots_.push_back(s);
+    }
+  }
+  fclose(fp);
+  if (success) {
+    gcode_file_ = gcode_file;
+    file_size_ = size;
+    file_mtime_ = mtime;
+  } else {
+    snapshots_.clear();
+  }
+  return success;
+}
+
+bool GCodeResumeIndex::Seek(int line, const GCodeParser::Config &config,
+                            Snapshot *result) const {
+  // Last snapshot before the line.
+  const Snapshot *start = NULL;
+  for (const Snapshot &s : snapshots_) {
+    if (s.state.line_number >= line) break;
+    start = &s;
+  }
+  if (start == NULL) {
+    Log_error("Line %d is not in the resume index.", line);
+    return false;
+  }
+  MappedFile file(gcode_file_.c_str());
+  if (!file.ok()) return false;
+  if (file.size() != file_size_ || file.mtime() != file_mtime_) {
+    Log_error("%s has changed since it was indexed.", gcode_file_.c_str());
+    return false;
+  }
+
+  ScratchParser parser(config);
+  parser->SetModalState(start->state);
+  std::string text;
+  uint64_t pos = start->offset;
+  for (int n = start->state.line_number + 1; n < line; ++n) {
+    file.ReadLine(&pos, &text);
+    parser.ParseLine(text);
+  }
+  if (pos >= file.size()) {
+    Log_error("%s: there is no line %d.", gcode_file_.c_str(), line);
+    return false;
+  }
+  if (!parser->GetModalState(&result->state)) {
+    Log_error("%s: line %d is inside a WHILE loop; can't resume there.",
+              gcode_file_.c_str(), line);
+    return false;
+  }
+  result->state.line_number = line - 1;
+  result->offset = pos;
+  return true;
+}
@@ -0,0 +1,79 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _BEAGLEG_GCODE_RESUME_INDEX_H_
+#define _BEAGLEG_GCODE_RESUME_INDEX_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "gcode-parser.h"
+
+// Index of a G-code file to resume an interrupted job at any line without
+// executing everything before it. Every couple of lines, it records the byte
+// offset of the line and the modal parser state before it. To resume, we
+// start at the closest of these snapshots and only parse the few lines up to
+// the requested one.
+//
+// The index is kept in a sidecar file next to the G-code file and is
+// rebuilt if the G-code file changes.
+class GCodeResumeIndex {
+public:
+  // Where to continue with a particular line.
+  struct Snapshot {
+    uint64_t offset;                   // Start of line state.line_number + 1
+    GCodeParser::ModalState state;     // Modal state before that line.
+  };
+
+  GCodeResumeIndex();
+
+  // Name of the sidecar index file for the given G-code file.
+  static std::string IndexFilename(const std::string &gcode_file);
+
+  // Build the index by parsing "gcode_file" without executing it. A snapshot
+  // is recorded every "interval" lines, or at the next line outside a WHILE
+  // loop. The machine origin and parameters are taken from "config", which
+  // is not modified.
+  bool Build(const char *gcode_file, const GCodeParser::Config &config,
+             int interval);
+
+  // Load index from "index_file". Returns false if it does not exist,
+  // can't be read or is not up to date with "gcode_file".
+  bool Load(const char *index_file, const char *gcode_file);
+
+  // Write index to "index_file".
+  bool Save(const char *index_file) const;
+
+  // Determine where to continue for the given "line" of the G-code file
+  // and the modal state before it. Parameters changed by the program itself
+  // are not known, so they are taken from "config" as in Build().
+  // Returns false if the line does not exist or is inside a WHILE loop.
+  bool Seek(int line, const GCodeParser::Config &config,
+            Snapshot *result) const;
+
+  const std::vector<Snapshot> &snapshots() const { return snapshots_; }
+
+private:
+  std::string gcode_file_;
+  uint64_t file_size_;
+  int64_t file_mtime_;
+  std::vector<Snapshot> snapshots_;
+};
+
+#endif  // _BEAGLEG_GCODE_RESUME_INDEX_H_
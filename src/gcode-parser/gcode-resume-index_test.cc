@@ -0,0 +1,182 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "gcode-resume-index.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+#include <gtest/gtest.h>
+
+#include "common/string-util.h"
+
+namespace {
+// A G-code file in /tmp, removed at the end of the test.
+class TempFile {
+public:
+  TempFile(const std::string &content) {
+    char name[] = "/tmp/resume-index-test.XXXXXX";
+    const int fd = mkstemp(name);
+    EXPECT_EQ((ssize_t)content.size(),
+              write(fd, content.data(), content.size()));
+    close(fd);
+    filename_ = name;
+  }
+  ~TempFile() {
+    unlink(filename_.c_str());
+    unlink(GCodeResumeIndex::IndexFilename(filename_).c_str());
+  }
+  const char *filename() const { return filename_.c_str(); }
+
+private:
+  std::string filename_;
+};
+
+// Program with a healthy mix of modal changes. Line i (counting from 1)
+// starts at offset (*offsets)[i-1].
+std::string ModalProgram(int lines, std::vector<uint64_t> *offsets) {
+  std::string result;
+  for (int i = 0; i < lines; ++i) {
+    offsets->push_back(result.size());
+    switch (i % 11) {
+    case 0:
+      result += StringPrintf("G1 X%d Y%d F%d\n", i % 7, i % 5, 100 + i);
+      break;
+    case 1:  result += (i % 2) ? "G91\n" : "G90\n"; break;
+    case 2:  result += StringPrintf("X%d.5\r\n", i % 3); break;
+    case 3:  result += (i % 3) ? "G20\n" : "G21\n"; break;
+    case 4:  result += StringPrintf("G0 Z%d\n", i % 4); break;
+    case 5:  result += StringPrintf("G92 X%d\n", i % 9); break;
+    case 6:  result += StringPrintf("G%d\n", 54 + i % 3); break;
+    case 7:  result += (i % 4) ? "G92.2\n" : "G92.3\n"; break;
+    case 8:  result += StringPrintf("G%d\n", 17 + i % 3); break;
+    case 9:  result += StringPrintf("G17 G2 X1 Y1 I%d J0\n", 1 + i % 2); break;
+    default: result += "; just a comment\n"; break;
+    }
+  }
+  return result;
+}
+
+void ExpectSameState(const GCodeParser::ModalState &a,
+                     const GCodeParser::ModalState &b) {
+  EXPECT_EQ(a.line_number, b.line_number);
+  EXPECT_EQ(a.modal_g0_g1, b.modal_g0_g1);
+  EXPECT_EQ(a.unit_to_mm_factor, b.unit_to_mm_factor);
+  EXPECT_EQ(a.arc_normal, b.arc_normal);
+  EXPECT_EQ(a.coord_system, b.coord_system);
+  EXPECT_EQ(a.g92_active, b.g92_active);
+  EXPECT_EQ(a.feedrate, b.feedrate);
+  for (GCodeParserAxis axis : AllAxes()) {
+    EXPECT_EQ(a.axis_is_absolute[axis], b.axis_is_absolute[axis]);
+    EXPECT_EQ(a.origin[axis], b.origin[axis]);
+    EXPECT_EQ(a.g92_offset[axis], b.g92_offset[axis]);
+    EXPECT_EQ(a.position[axis], b.position[axis]) << a.line_number;
+  }
+}
+}  // namespace
+
+TEST(GCodeResumeIndex, SeekGivesSameStateAsParsingAllLines) {
+  std::vector<uint64_t> offsets;
+  TempFile gcode(ModalProgram(500, &offsets));
+  GCodeParser::Config config;
+  config.machine_origin[AXIS_Z] = 100;
+
+  // With an interval of one, every line has an exact snapshot.
+  GCodeResumeIndex every_line;
+  ASSERT_TRUE(every_line.Build(gcode.filename(), config, 1));
+  ASSERT_EQ(offsets.size(), every_line.snapshots().size());
+
+  GCodeResumeIndex index;
+  ASSERT_TRUE(index.Build(gcode.filename(), config, 64));
+  EXPECT_EQ(8u, index.snapshots().size());
+
+  for (int line = 1; line <= (int)offsets.size(); ++line) {
+    GCodeResumeIndex::Snapshot snapshot;
+    ASSERT_TRUE(index.Seek(line, config, &snapshot));
+    EXPECT_EQ(offsets[line-1], snapshot.offset);
+    ExpectSameState(every_line.snapshots()[line-1].state, snapshot.state);
+  }
+  GCodeResumeIndex::Snapshot snapshot;
+  EXPECT_FALSE(index.Seek(0, config, &snapshot));
+  EXPECT_FALSE(index.Seek(offsets.size() + 1, config, &snapshot));
+}
+
+TEST(GCodeResumeIndex, SaveAndLoad) {
+  std::vector<uint64_t> offsets;
+  TempFile gcode(ModalProgram(100, &offsets));
+  const std::string index_file =
+    GCodeResumeIndex::IndexFilename(gcode.filename());
+  GCodeParser::Config config;
+  GCodeResumeIndex index;
+  EXPECT_FALSE(index.Load(index_file.c_str(), gcode.filename()));
+  ASSERT_TRUE(index.Build(gcode.filename(), config, 10));
+  ASSERT_TRUE(index.Save(index_file.c_str()));
+
+  GCodeResumeIndex loaded;
+  ASSERT_TRUE(loaded.Load(index_file.c_str(), gcode.filename()));
+  ASSERT_EQ(index.snapshots().size(), loaded.snapshots().size());
+  for (size_t i = 0; i < index.snapshots().size(); ++i) {
+    EXPECT_EQ(index.snapshots()[i].offset, loaded.snapshots()[i].offset);
+    ExpectSameState(index.snapshots()[i].state, loaded.snapshots()[i].state);
+  }
+
+  GCodeResumeIndex::Snapshot from_built, from_loaded;
+  ASSERT_TRUE(index.Seek(42, config, &from_built));
+  ASSERT_TRUE(loaded.Seek(42, config, &from_loaded));
+  EXPECT_EQ(from_built.offset, from_loaded.offset);
+  ExpectSameState(from_built.state, from_loaded.state);
+
+  // Once the G-code file changes, the index is outdated.
+  FILE *f = fopen(gcode.filename(), "a");
+  fprintf(f, "G1 X1\n");
+  fclose(f);
+  EXPECT_FALSE(loaded.Load(index_file.c_str(), gcode.filename()));
+}
+
+TEST(GCodeResumeIndex, NoResumeInsideWhileLoop) {
+  TempFile gcode("G1 X1 F100\n"
+                 "#1=0\n"
+                 "WHILE [#1 LT 3] DO\n"
+                 "  G1 X#1\n"
+                 "  #1=[#1+1]\n"
+                 "END\n"
+                 "G1 Y2\n");
+  GCodeParser::Config config;
+  GCodeResumeIndex index;
+  ASSERT_TRUE(index.Build(gcode.filename(), config, 1));
+  // No snapshots for the lines in the loop.
+  EXPECT_EQ(4u, index.snapshots().size());
+
+  GCodeResumeIndex::Snapshot snapshot;
+  EXPECT_TRUE(index.Seek(3, config, &snapshot));
+  EXPECT_FALSE(index.Seek(4, config, &snapshot));
+  EXPECT_FALSE(index.Seek(6, config, &snapshot));
+  ASSERT_TRUE(index.Seek(7, config, &snapshot));
+  EXPECT_EQ(2, snapshot.state.position[AXIS_X]);  // Loop was executed.
+  EXPECT_EQ(6, snapshot.state.line_number);
+}
+
+int main(int argc, char *argv[]) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -18,14 +18,24 @@
 */
 #include "gcode-streamer.h"
 
+#include <errno.h>
 #include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
+#include <string>
+
+#include "common/latency-trace.h"
 #include "common/logging.h"
 
 GCodeStreamer::GCodeStreamer(FDMultiplexer *event_server, GCodeParser *parser,
                              GCodeParser::EventReceiver *parse_events)
   : event_server_(event_server), parser_(parser), parse_events_(parse_events),
-    is_processing_(false), connection_fd_(-1) {
+    is_processing_(false), connection_fd_(-1), ack_window_(0),
+    binary_mode_(false), overlong_lines_(0),
+    file_data_(NULL), file_size_(0), file_pos_(0),
+    have_file_progress_(false), first_line_(1) {
   // Let's start the input idle tasklet
   // TODO: the lifetime implications are a bit problematic as we need to
   // outlive the Loop() of the event server.
@@ -45,6 +55,9 @@ bool GCodeStreamer::ConnectStream(int fd, FILE *msg_stream) {
 
   msg_stream_ = msg_stream;
   connection_fd_ = fd;
+  binary_mode_ = false;
+  if (msg_stream_ && ack_window_ > 0)
+    fprintf(msg_stream_, "// ack-window %d\n", ack_window_);
 
   event_server_->RunOnReadable(connection_fd_, [this](){
     return ReadData();
@@ -52,10 +65,120 @@ bool GCodeStreamer::ConnectStream(int fd, FILE *msg_stream) {
   return true;
 }
 
+bool GCodeStreamer::ConnectFile(const char *filename, FILE *msg_stream,
+                                uint64_t start_offset, int start_line) {
+  if (connection_fd_ >= 0) {
+    return false;  // Alrady connected.
+  }
+  const int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    Log_error("Can't open %s: %s", filename, strerror(errno));
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0
+      || (uint64_t)st.st_size > UINT32_MAX) {
+    if (start_offset > 0) {
+      Log_error("%s: can only start in the middle of a regular file.",
+                filename);
+      close(fd);
+      return false;
+    }
+    return ConnectStream(fd, msg_stream);
+  }
+  if (start_offset >= (uint64_t)st.st_size) {
+    Log_error("%s: start offset %llu beyond end of file.", filename,
+              (unsigned long long)start_offset);
+    close(fd);
+    return false;
+  }
+  // Private writable mapping: we terminate the lines in place.
+  void *data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                    fd, 0);
+  if (data == MAP_FAILED && start_offset == 0) {
+    Log_info("Can't mmap() %s (%s); reading it instead.",
+             filename, strerror(errno));
+    return ConnectStream(fd, msg_stream);
+  }
+  if (data == MAP_FAILED) {
+    Log_error("Can't mmap() %s: %s", filename, strerror(errno));
+    close(fd);
+    return false;
+  }
+  madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+  if (msg_stream) setvbuf(msg_stream, NULL, _IONBF, 0);
+  msg_stream_ = msg_stream;
+  connection_fd_ = fd;
+  file_data_ = (char*) data;
+  file_size_ = st.st_size;
+  file_pos_ = start_offset;
+  have_file_progress_ = true;
+  first_line_ = start_line;
+  line_offsets_.clear();
+
+  // A regular file is always readable, so this is called in every cycle.
+  event_server_->RunOnReadable(connection_fd_, [this](){
+    return ReadFileData();
+  });
+  return true;
+}
+
+bool GCodeStreamer::GetFileProgress(uint64_t *bytes_done,
+                                    uint64_t *bytes_total) const {
+  if (!have_file_progress_) return false;
+  *bytes_done = file_pos_;
+  *bytes_total = file_size_;
+  return true;
+}
+
+int64_t GCodeStreamer::GetLineOffset(int line) const {
+  const int index = line - first_line_;
+  if (index < 0 || index >= (int)line_offsets_.size()) return -1;
+  return line_offsets_[index];
+}
+
+// Parse the next couple of lines from the mapped file. We only handle a
+// limited number per call to give other handlers in the event loop a chance.
+bool GCodeStreamer::ReadFileData() {
+  static const int kLinesPerCycle = 256;
+  is_processing_ = true;
+  for (int i = 0; i < kLinesPerCycle && file_pos_ < file_size_; ++i) {
+    char *const line = file_data_ + file_pos_;
+    const size_t remaining = file_size_ - file_pos_;
+    line_offsets_.push_back(file_pos_);
+    char *end = (char*) memchr(line, '\n', remaining);
+    char *cr = (char*) memchr(line, '\r', end ? end - line : remaining);
+    if (cr) end = cr;  // Old Mac line ending or \r\n.
+    if (end == NULL) {
+      // Last line without newline; we can't terminate it in the mapping.
+      const std::string last_line(line, remaining);
+      file_pos_ = file_size_;
+      parser_->ParseLine(last_line.c_str(), msg_stream_);
+      break;
+    }
+    file_pos_ = end - file_data_ + 1;
+    if (*end == '\r' && file_pos_ < file_size_ && file_data_[file_pos_] == '\n')
+      ++file_pos_;
+    *end = '\0';
+    parser_->ParseLine(line, msg_stream_);
+  }
+
+  if (file_pos_ < file_size_)
+    return true;
+
+  Log_info("Reached EOF.");
+  return FinishStream();
+}
+
 void GCodeStreamer::CloseStream() {
   if (msg_stream_) {
     fflush(msg_stream_);
   }
+  if (file_data_) {
+    munmap(file_data_, file_size_);
+    file_data_ = NULL;
+  }
   close(connection_fd_);
   connection_fd_ = -1;
 }
@@ -63,35 +186,136 @@ void GCodeStreamer::CloseStream() {
 // New data to be fed into the linebuffer
 bool GCodeStreamer::ReadData() {
   // Update buffer
-  if (reader_.Update(connection_fd_) == 0) {
+  LATENCY_TRACE_START(trace_start);
+  const int got = reader_.Update(connection_fd_);
+#ifdef BEAGLEG_LATENCY_TRACE
+  // Attributed to the first line in the new data.
+  LatencyTraceRecord(LATENCY_RECEIVE, trace_start, parser_->line_number() + 1);
+#endif
+  if (got == 0) {
     Log_info("Reached EOF.");
 
-    // Parse any potentially remaining gcode from previous connections.
-    const char *line = reader_.IncompleteLine();
-    if (line) {
-      parser_->ParseLine(line, msg_stream_);
+    if (binary_mode_) {
+      if (reader_.size() > 0)
+        Log_error("Incomplete binary record at end of stream.");
+      reader_.Flush();
+    } else {
+      // Parse any potentially remaining gcode from previous connections.
+      const char *line = reader_.IncompleteLine();
+      if (line) {
+        parser_->ParseLine(line, msg_stream_);
+      }
     }
-
-    // always call gcode_finished() to disable motors at end of stream
-    parse_events_->gcode_finished(true);
-    CloseStream();
-    is_processing_ = false;
-    return false;  // We're done processing, remove us from fd-mux
+    return FinishStream();
   }
 
   is_processing_ = true;
   const char *line;
-  while ((line = reader_.ReadLine())) {
+  int lines_done = 0;
+  while (!binary_mode_ && (line = reader_.ReadLine())) {
+    ++lines_done;
+    if (strcmp(line, GCODE_BINARY_REQUEST) == 0) {
+      binary_mode_ = true;
+      if (msg_stream_) fprintf(msg_stream_, GCODE_BINARY_REPLY "\n");
+      break;
+    }
     // NOTE:(important)
     // This should return true or false in case the line was movement or not
     // and only if is, reset the timer.
     parser_->ParseLine(line, msg_stream_);
+    if (reader_.overlong_lines() != overlong_lines_) {
+      overlong_lines_ = reader_.overlong_lines();
+      Log_error("Line %d: longer than %d bytes; ignored.",
+                parser_->line_number(), (int)reader_.capacity());
+      if (msg_stream_)
+        fprintf(msg_stream_, "// Line %d: longer than %d bytes; ignored.\n",
+                parser_->line_number(), (int)reader_.capacity());
+    }
+  }
+  if (binary_mode_ && !ReadRecords(&lines_done)) {
+    if (msg_stream_)
+      fprintf(msg_stream_, "// Invalid binary record; closing connection.\n");
+    reader_.Flush();  // Can't find the next record anymore.
+    return FinishStream();
   }
+  if (msg_stream_ && ack_window_ > 0 && lines_done > 0)
+    fprintf(msg_stream_, "ok %d\n", lines_done);
 
   // Loop again
   return true;
 }
 
+// End of the current stream. Returns false to be removed from the fd-mux.
+bool GCodeStreamer::FinishStream() {
+  CloseStream();
+  is_processing_ = false;
+  if (next_job_) {
+    // We're still in the handler of the old file descriptor, which might
+    // have the same number as the one of the next job. So connect that
+    // in a separate step.
+    event_server_->RunAfter(0, [this]() {
+        if (!next_job_()) parse_events_->gcode_finished(true);
+        return false;
+      });
+  } else {
+    // always call gcode_finished() to disable motors at end of stream
+    parse_events_->gcode_finished(true);
+  }
+  return false;
+}
+
+// Handle all complete binary records in the buffer. Returns false on
+// records we can't understand.
+bool GCodeStreamer::ReadRecords(int *records_done) {
+  for (;;) {
+    // Records are not aligned in the buffer, so we copy them out.
+    const char *const data = reader_.RawData();
+    const size_t available = reader_.size();
+    if (available == 0) return true;
+    const uint8_t type = data[0];
+    size_t record_size;
+    if (type == GCODE_RECORD_G0 || type == GCODE_RECORD_G1) {
+      GCodeBinaryMove move;
+      if (available < sizeof(move)) return true;
+      memcpy(&move, data, sizeof(move));
+      if (move.axes >> GCODE_NUM_AXES) {
+        Log_error("Binary move with unknown axes 0x%x", move.axes);
+        return false;
+      }
+      record_size = sizeof(move)
+        + __builtin_popcount(move.axes) * sizeof(float);
+      if (available < record_size) return true;
+      AxesRegister values;
+      const char *value_data = data + sizeof(move);
+      for (GCodeParserAxis axis : AllAxes()) {
+        if (!(move.axes & (1 << axis))) continue;
+        memcpy(&values[axis], value_data, sizeof(float));
+        value_data += sizeof(float);
+      }
+      reader_.Consume(record_size);
+      parser_->ExecuteMove(move.line, type == GCODE_RECORD_G0, move.feedrate,
+                           move.axes, values, msg_stream_);
+    } else if (type == GCODE_RECORD_TEXT) {
+      GCodeBinaryText text;
+      if (available < sizeof(text)) return true;
+      memcpy(&text, data, sizeof(text));
+      record_size = sizeof(text) + text.length;
+      if (record_size > reader_.capacity()) {
+        Log_error("Binary text record of %d bytes too long.", text.length);
+        return false;
+      }
+      if (available < record_size) return true;
+      text_record_.assign(data + sizeof(text), text.length);
+      reader_.Consume(record_size);
+      parser_->ParseLine(text_record_.c_str(), msg_stream_);
+    } else {
+      Log_error("Unknown binary record type 0x%02x", type);
+      return false;
+    }
+    ++*records_done;
+  }
+}
+
 // We didn't receive a line within x milliseconds.
 bool GCodeStreamer::Timeout() {
   parse_events_->input_idle(is_processing_);
@@ -19,10 +19,51 @@
 #ifndef FD_GCODE_STREAMER_H_
 #define FD_GCODE_STREAMER_H_
 
+#include <stdint.h>
+#include <functional>
+#include <string>
+#include <vector>
+
 #include "common/fd-mux.h"
 #include "common/linebuf-reader.h"
 #include "gcode-parser/gcode-parser.h"
 
+// Binary framing a sender can switch to on a stream, e.g. a CAM program that
+// has exact coordinates already: moves are then not formatted as text only
+// to be parsed again.
+// The sender asks with the line GCODE_BINARY_REQUEST, which older versions
+// ignore as a comment. If we reply with GCODE_BINARY_REPLY, everything after
+// the request line are records in little endian byte order, each starting
+// with its GCodeBinaryRecordType.
+#define GCODE_BINARY_REQUEST "(beagleg-binary)"
+#define GCODE_BINARY_REPLY   "// binary-mode"
+
+enum GCodeBinaryRecordType {
+  GCODE_RECORD_G0   = 0x80,   // GCodeBinaryMove: rapid move.
+  GCODE_RECORD_G1   = 0x81,   // GCodeBinaryMove: coordinated move.
+  GCODE_RECORD_TEXT = 0x82,   // GCodeBinaryText: any other G-code line.
+};
+
+// Move, followed by one float for each axis in "axes", in the order of
+// GCodeParserAxis. Like in a G-code line, values are in the current units
+// and coordinate system.
+struct GCodeBinaryMove {
+  uint8_t type;         // GCODE_RECORD_G0 or GCODE_RECORD_G1
+  uint8_t reserved;
+  uint16_t axes;        // Bit (1 << axis) for each GCodeParserAxis given.
+  uint32_t line;        // Line number for messages; 0: count lines.
+  float feedrate;       // As F parameter; negative if not given.
+};
+static_assert(sizeof(GCodeBinaryMove) == 12, "binary move record layout");
+
+// Text line, followed by "length" bytes G-code without newline.
+struct GCodeBinaryText {
+  uint8_t type;         // GCODE_RECORD_TEXT
+  uint8_t reserved;
+  uint16_t length;
+};
+static_assert(sizeof(GCodeBinaryText) == 4, "binary text record layout");
+
 class GCodeStreamer {
 public:
   // GCodeStreamer needs to outlive FDMultiplexer.
@@ -31,15 +72,52 @@ public:
 
   // Reads GCode lines from "fd" and feeds them to the GCodeParser.
   // Error messages are sent to "err_stream" if non-NULL.
-  // Reads until EOF.
+  // Reads until EOF. On request, switches to binary records (see above).
   // The input file descriptor is closed.
   bool ConnectStream(int fd, FILE *msg_stream);
 
+  // Reads GCode from a file. Regular files are memory mapped and the lines
+  // are handed to the parser in place, without copying; everything else is
+  // read like a stream.
+  // If "start_offset" is given, streaming of a regular file starts at that
+  // byte offset, which is the beginning of line "start_line"; this is used
+  // to resume a job (see GCodeResumeIndex).
+  // Returns false if the file can't be opened or we are already streaming.
+  bool ConnectFile(const char *filename, FILE *msg_stream,
+                   uint64_t start_offset = 0, int start_line = 1);
+
+  // Progress of the last file mapped in ConnectFile(): bytes parsed so far
+  // and total size. Returns false if there was no such file.
+  bool GetFileProgress(uint64_t *bytes_done, uint64_t *bytes_total) const;
+
+  // Byte offset of the given line (counting from 1) of the last file mapped
+  // in ConnectFile(). Returns -1 if that line has not been reached yet.
+  int64_t GetLineOffset(int line) const;
+
+  // Acknowledge received lines in batches instead of per command. The sender
+  // may keep up to "lines" unacknowledged lines in flight. When a stream is
+  // connected, the window is announced with "// ack-window <lines>"; after
+  // processing the lines (or binary records) of each read, we report
+  // "ok <n>" for the n lines handled since. As parsing blocks while the
+  // planner queue is full, the acknowledgements are held back as needed.
+  // With zero (default), acknowledgement is left to the event receiver.
+  void SetAckWindow(int lines) { ack_window_ = lines; }
+
+  // Called at the end of each stream. If it connects the next job, e.g.
+  // with ConnectFile(), and returns true, parsing continues with that one
+  // without finishing the program, so the machine keeps moving.
+  void SetNextJobSource(const std::function<bool()> &next_job) {
+    next_job_ = next_job;
+  }
+
   // Returns true if we are already connected to a stream.
   bool IsStreaming() { return connection_fd_ >= 0; }
 
 private:
   void CloseStream();
+  bool FinishStream();
+  bool ReadFileData();
+  bool ReadRecords(int *records_done);
 
   FDMultiplexer *const event_server_;
   GCodeParser *const parser_;
@@ -50,6 +128,21 @@ private:
 
   FILE *msg_stream_;
   int connection_fd_;
+  int ack_window_;
+  bool binary_mode_;
+  int overlong_lines_;    // Overlong lines of reader_ reported so far.
+  std::function<bool()> next_job_;
+  std::string text_record_;
+
+  // Memory mapped file; NULL if we are not streaming from a file.
+  char *file_data_;
+  uint64_t file_size_;
+  uint64_t file_pos_;
+  bool have_file_progress_;
+  // Start of each line, counting from line first_line_. Files are mapped
+  // in memory, so 32 bit offsets are sufficient on our platform.
+  int first_line_;
+  std::vector<uint32_t> line_offsets_;
 
   bool ReadData();
   bool Timeout();
@@ -22,6 +22,8 @@
 #include <string.h>
 
 #include <memory>
+#include <string>
+#include <vector>
 #include <gtest/gtest.h>
 #include <gmock/gmock.h>
 
@@ -42,6 +44,7 @@ public:
   ~MockStream() {}
 
   int GetReceiverFiledescriptor() { return fd_[RECEIVING_FD]; }
+  int GetSenderFiledescriptor() { return fd_[SENDING_FD]; }
   int SendData(const char *data) {
     // Feed data in the pipe
     return write(fd_[SENDING_FD], data, strlen(data));
@@ -61,12 +64,27 @@ public:
       streamer_(new GCodeStreamer(&event_server_, parser_.get(), this)),
       stream_mock_(NULL) {}
 
-  bool OpenStream() {
+  bool OpenStream(FILE *msg_stream = NULL) {
     assert(stream_mock_ == NULL);
     stream_mock_ = new MockStream();
-    return streamer_->ConnectStream(stream_mock_->GetReceiverFiledescriptor(), NULL);
+    return streamer_->ConnectStream(stream_mock_->GetReceiverFiledescriptor(),
+                                    msg_stream);
   }
 
+  bool OpenFile(const char *content, uint64_t start_offset = 0,
+                int start_line = 1) {
+    char filename[] = "/tmp/gcode-streamer-test.XXXXXX";
+    const int fd = mkstemp(filename);
+    EXPECT_EQ((ssize_t)strlen(content), write(fd, content, strlen(content)));
+    close(fd);
+    const bool result = streamer_->ConnectFile(filename, NULL,
+                                               start_offset, start_line);
+    unlink(filename);
+    return result;
+  }
+
+  GCodeStreamer *streamer() { return streamer_.get(); }
+
   void CloseStream() {
     stream_mock_->CloseSender();
     delete stream_mock_;
@@ -77,6 +95,12 @@ public:
     stream_mock_->SendData(line);
   }
 
+  void SendBytes(const std::string &data) {
+    EXPECT_EQ((ssize_t)data.size(),
+              write(stream_mock_->GetSenderFiledescriptor(),
+                    data.data(), data.size()));
+  }
+
   void Cycle() {
     event_server_.SingleCycle(0);
   }
@@ -174,6 +198,170 @@ TEST(Streaming, basic_stream) {
   tester.Cycle(); // Wait the stream to close
 }
 
+// Everything written to "f" so far.
+static std::string ReadMessages(FILE *f) {
+  std::string result;
+  char buf[256];
+  rewind(f);
+  while (fgets(buf, sizeof(buf), f)) result += buf;
+  fseek(f, 0, SEEK_END);  // Continue writing at the end.
+  return result;
+}
+
+// With an acknowledge window, all the lines of a read are acknowledged with
+// a single response.
+TEST(Streaming, windowed_acknowledge) {
+  StreamTester tester;
+  EXPECT_CALL(tester, gcode_start(_)).Times(1);
+  EXPECT_CALL(tester, coordinated_move(FloatEq(1000.0 / 60), _)).Times(4);
+  EXPECT_CALL(tester, gcode_finished(_)).Times(1);
+  FILE *msg = tmpfile();
+  tester.streamer()->SetAckWindow(16);
+  tester.OpenStream(msg);
+  EXPECT_EQ("// ack-window 16\n", ReadMessages(msg));
+
+  tester.SendString("G1X1F1000\nG1X2F1000\nG1X3F1000\nG1X4");
+  tester.Cycle();
+  EXPECT_EQ("// ack-window 16\nok 3\n", ReadMessages(msg));
+
+  tester.SendString("F1000\n");  // Completes the line.
+  tester.Cycle();
+  EXPECT_EQ("// ack-window 16\nok 3\nok 1\n", ReadMessages(msg));
+  tester.CloseStream();
+  tester.Cycle();
+  fclose(msg);
+}
+
+static std::string BinaryMove(bool rapid, float feedrate, AxisBitmap_t axes,
+                              const std::vector<float> &values) {
+  GCodeBinaryMove move = {};
+  move.type = rapid ? GCODE_RECORD_G0 : GCODE_RECORD_G1;
+  move.axes = axes;
+  move.feedrate = feedrate;
+  std::string result((const char*)&move, sizeof(move));
+  result.append((const char*)values.data(), values.size() * sizeof(float));
+  return result;
+}
+
+static std::string BinaryText(const std::string &line) {
+  GCodeBinaryText text = {};
+  text.type = GCODE_RECORD_TEXT;
+  text.length = line.size();
+  return std::string((const char*)&text, sizeof(text)) + line;
+}
+
+// After switching to binary mode, moves are sent as records.
+TEST(Streaming, binary_records) {
+  StreamTester tester;
+  EXPECT_CALL(tester, gcode_start(_)).Times(1);
+  {
+    InSequence s;
+    EXPECT_CALL(tester, coordinated_move(FloatEq(600.0 / 60), _))
+      .WillOnce(Return(true));
+    // Y only; X from the previous move.
+    EXPECT_CALL(tester, coordinated_move(
+                  FloatEq(-1), Truly([](const AxesRegister &p) {
+                      return p[AXIS_X] == 1 && p[AXIS_Y] == 3;
+                    })))
+      .WillOnce(Return(true));
+    EXPECT_CALL(tester, coordinated_move(FloatEq(1200.0 / 60), _))
+      .WillOnce(Return(true));
+  }
+  EXPECT_CALL(tester, gcode_finished(_)).Times(1);
+  FILE *msg = tmpfile();
+  tester.streamer()->SetAckWindow(8);
+  tester.OpenStream(msg);
+  tester.SendString(GCODE_BINARY_REQUEST "\r\n");
+  tester.Cycle();
+  EXPECT_EQ("// ack-window 8\n" GCODE_BINARY_REPLY "\nok 1\n",
+            ReadMessages(msg));
+
+  // Records can be split across reads.
+  const std::string records = BinaryMove(false, 600,
+                                         (1 << AXIS_X) | (1 << AXIS_Y),
+                                         { 1, 2 })
+    + BinaryMove(false, -1, 1 << AXIS_Y, { 3 })
+    + BinaryText("G1 X5 F1200");
+  tester.SendBytes(records.substr(0, 20));
+  tester.Cycle();
+  tester.SendBytes(records.substr(20));
+  tester.Cycle();
+  EXPECT_EQ("// ack-window 8\n" GCODE_BINARY_REPLY "\nok 1\nok 1\nok 2\n",
+            ReadMessages(msg));
+
+  // Garbage closes the connection.
+  tester.SendBytes("G1 X1\n");
+  tester.Cycle();
+  EXPECT_FALSE(tester.streamer()->IsStreaming());
+  tester.CloseStream();
+  fclose(msg);
+}
+
+// Files are parsed from a memory mapping.
+TEST(Streaming, mapped_file) {
+  StreamTester tester;
+  EXPECT_CALL(tester, gcode_start(_)).Times(1);
+  EXPECT_CALL(tester, coordinated_move(FloatEq(1000.0 / 60), _)).Times(4);
+  EXPECT_CALL(tester, input_idle(_)).Times(0);
+  EXPECT_CALL(tester, gcode_finished(true)).Times(1);
+  const char kContent[] = "G1X1F1000\nG1X2F1000\r\n\nG1X3F1000\rG1X4F1000";
+  ASSERT_TRUE(tester.OpenFile(kContent));
+  EXPECT_TRUE(tester.streamer()->IsStreaming());
+  tester.Cycle();
+  EXPECT_FALSE(tester.streamer()->IsStreaming());
+
+  uint64_t done, total;
+  ASSERT_TRUE(tester.streamer()->GetFileProgress(&done, &total));
+  EXPECT_EQ(strlen(kContent), total);
+  EXPECT_EQ(total, done);
+  EXPECT_EQ(0, tester.streamer()->GetLineOffset(1));
+  EXPECT_EQ(10, tester.streamer()->GetLineOffset(2));
+  EXPECT_EQ(21, tester.streamer()->GetLineOffset(3));
+  EXPECT_EQ(22, tester.streamer()->GetLineOffset(4));
+  EXPECT_EQ(32, tester.streamer()->GetLineOffset(5));
+  EXPECT_EQ(-1, tester.streamer()->GetLineOffset(6));
+}
+
+// Resuming a job starts in the middle of the file.
+TEST(Streaming, mapped_file_start_offset) {
+  StreamTester tester;
+  EXPECT_CALL(tester, gcode_start(_)).Times(1);
+  EXPECT_CALL(tester, coordinated_move(FloatEq(1000.0 / 60), _)).Times(2);
+  EXPECT_CALL(tester, gcode_finished(true)).Times(1);
+  const char kContent[] = "G1X1F1000\nG1X2F1000\nG1X3F1000\nG1X4F1000\n";
+  ASSERT_TRUE(tester.OpenFile(kContent, 20, 3));
+  tester.Cycle();
+  EXPECT_FALSE(tester.streamer()->IsStreaming());
+  EXPECT_EQ(-1, tester.streamer()->GetLineOffset(2));
+  EXPECT_EQ(20, tester.streamer()->GetLineOffset(3));
+  EXPECT_EQ(30, tester.streamer()->GetLineOffset(4));
+
+  EXPECT_FALSE(tester.OpenFile(kContent, strlen(kContent), 5));
+}
+
+// Large files take multiple cycles; progress is visible in between.
+TEST(Streaming, mapped_file_progress) {
+  StreamTester tester;
+  std::string content;
+  for (int i = 0; i < 1000; ++i) {
+    content.append("G1X200F1000\n");
+  }
+  EXPECT_CALL(tester, gcode_start(_)).Times(1);
+  EXPECT_CALL(tester, coordinated_move(FloatEq(1000.0 / 60), _)).Times(1000);
+  EXPECT_CALL(tester, gcode_finished(true)).Times(1);
+  ASSERT_TRUE(tester.OpenFile(content.c_str()));
+  tester.Cycle();
+  uint64_t done, total;
+  ASSERT_TRUE(tester.streamer()->GetFileProgress(&done, &total));
+  EXPECT_GT(done, 0u);
+  EXPECT_LT(done, total);
+  while (tester.streamer()->IsStreaming()) {
+    tester.Cycle();
+  }
+  ASSERT_TRUE(tester.streamer()->GetFileProgress(&done, &total));
+  EXPECT_EQ(total, done);
+}
+
 int main(int argc, char *argv[]) {
   Log_init("/dev/stderr");
   ::testing::InitGoogleTest(&argc, argv);
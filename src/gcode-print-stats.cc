@@ -19,6 +19,7 @@
 
 #include <fcntl.h>
 #include <getopt.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -26,9 +27,12 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <vector>
+
 #include "common/logging.h"
 
 #include "determine-print-stats.h"
+#include "print-stats-cache.h"
 #include "gcode-machine-control.h"
 #include "config-parser.h"
 
@@ -36,18 +40,35 @@ int usage(const char *prog) {
   fprintf(stderr, "Usage: %s [options] <gcode-file> [<gcode-file> ..]\n"
           "Options:\n"
           "\t-c <config>       : Machine config\n"
+          "\t-C <cache-file>   : Remember results in this file; unchanged "
+          "files with the same config are not processed again.\n"
           "\t-f <factor>       : Speedup-factor for feedrate.\n"
           "\t-H                : Toggle print header line\n"
+          "\t-j <workers>      : Process files with this many workers in "
+          "parallel (Default: 1; 0: one per CPU).\n"
+          "\t-P                : Determine time with a cycle model of the "
+          "PRU firmware.\n"
           "Use filename '-' for stdin.\n", prog);
   return 1;
 }
 
-static void print_file_stats(const char *filename, int indentation,
-                             FILE *msg_out,
-                             const MachineControlConfig &config) {
+static int open_gcode_file(const char *filename) {
+  return strcmp(filename, "-") == 0 ? STDIN_FILENO : open(filename, O_RDONLY);
+}
+
+namespace {
+struct FileStats {
+  const char *filename;
+  bool success;
   struct BeagleGPrintStats result;
-  int fd = strcmp(filename, "-") == 0 ? STDIN_FILENO : open(filename, O_RDONLY);
-  if (determine_print_stats(fd, config, msg_out, &result)) {
+  bool done;
+};
+}
+
+static void print_file_stats(const char *filename, int indentation,
+                             bool success,
+                             const struct BeagleGPrintStats &result) {
+  if (success) {
     // Filament length looks a bit high, is this input or extruded ?
     printf("%-*s %10.0f %7.1f %7.1f %7.1f %7.1f %7.1f %7.1f %7.1f %7.1f",
            indentation, filename,
@@ -63,19 +84,101 @@ static void print_file_stats(const char *filename, int indentation,
   }
 }
 
+// Determines the stats of all files with a number of worker threads, each
+// with its own copy of the configuration and its own parser and planner.
+// The results are printed in the order of the files as they become
+// available.
+class StatsWorkerPool {
+public:
+  StatsWorkerPool(const MachineControlConfig &config, PrintStatsCache *cache,
+                  bool pru_cycle_model, std::vector<FileStats> *files)
+    : config_(config), cache_(cache), pru_cycle_model_(pru_cycle_model),
+      files_(files), next_file_(0) {
+    pthread_mutex_init(&mutex_, NULL);
+    pthread_cond_init(&file_done_, NULL);
+  }
+  ~StatsWorkerPool() {
+    pthread_cond_destroy(&file_done_);
+    pthread_mutex_destroy(&mutex_);
+  }
+
+  void Run(int workers, int indentation) {
+    std::vector<pthread_t> threads(workers);
+    for (pthread_t &t : threads) {
+      pthread_create(&t, NULL, &ThreadMain, this);
+    }
+    pthread_mutex_lock(&mutex_);
+    for (const FileStats &file : *files_) {
+      while (!file.done)
+        pthread_cond_wait(&file_done_, &mutex_);
+      print_file_stats(file.filename, indentation, file.success, file.result);
+    }
+    pthread_mutex_unlock(&mutex_);
+    for (pthread_t &t : threads) {
+      pthread_join(t, NULL);
+    }
+  }
+
+private:
+  static void *ThreadMain(void *arg) {
+    reinterpret_cast<StatsWorkerPool*>(arg)->Work();
+    return NULL;
+  }
+
+  void Work() {
+    const MachineControlConfig config = config_;
+    FILE *msg_out = fopen("/dev/null", "w");
+    for (;;) {
+      pthread_mutex_lock(&mutex_);
+      const size_t index = next_file_++;
+      pthread_mutex_unlock(&mutex_);
+      if (index >= files_->size())
+        break;
+      FileStats *const file = &(*files_)[index];
+      // The workers keep all CPUs busy, so no extra lexing threads.
+      struct BeagleGPrintStats result;
+      const int fd = open_gcode_file(file->filename);
+      const bool success = determine_print_stats_cached(fd, config, msg_out,
+                                                        cache_, &result, 0,
+                                                        pru_cycle_model_);
+      pthread_mutex_lock(&mutex_);
+      file->success = success;
+      file->result = result;
+      file->done = true;
+      pthread_cond_broadcast(&file_done_);
+      pthread_mutex_unlock(&mutex_);
+    }
+    fclose(msg_out);
+  }
+
+  const MachineControlConfig &config_;
+  PrintStatsCache *const cache_;
+  const bool pru_cycle_model_;
+  std::vector<FileStats> *const files_;
+  size_t next_file_;
+  pthread_mutex_t mutex_;
+  pthread_cond_t file_done_;
+};
+
 int main(int argc, char *argv[]) {
   struct MachineControlConfig config;
 
   float factor = 1.0;        // print speed factor.
   char print_header = 1;
   const char *config_file = NULL;
+  const char *cache_file = NULL;
+  int workers = 1;
+  bool pru_cycle_model = false;
 
   int opt;
-  while ((opt = getopt(argc, argv, "c:f:H")) != -1) {
+  while ((opt = getopt(argc, argv, "c:C:f:Hj:P")) != -1) {
     switch (opt) {
     case 'c':
       config_file = strdup(optarg);
       break;
+    case 'C':
+      cache_file = strdup(optarg);
+      break;
     case 'f':
       factor = (float)atof(optarg);
       if (factor <= 0) return usage(argv[0]);
@@ -83,6 +186,14 @@ int main(int argc, char *argv[]) {
     case 'H':
       print_header = !print_header;
       break;
+    case 'j':
+      workers = atoi(optarg);
+      if (workers < 0) return usage(argv[0]);
+      if (workers == 0) workers = sysconf(_SC_NPROCESSORS_ONLN);
+      break;
+    case 'P':
+      pru_cycle_model = true;
+      break;
     default:
       return usage(argv[0]);
     }
@@ -110,12 +221,15 @@ int main(int argc, char *argv[]) {
   }
 
   config.speed_factor = factor;
-  config.range_check = false;  // don't care about clipping.
+  configure_for_print_stats(&config);  // Not connected to any machine.
 
-  // This is not connected to any machine. Don't assume homing.
-  config.require_homing = false;
-  for (int i = 0; i < GCODE_NUM_AXES; ++i) {
-    config.homing_trigger[i] = HardwareMapping::TRIGGER_NONE;
+  PrintStatsCache *cache = NULL;
+  if (cache_file) {
+    cache = new PrintStatsCache(cache_file);
+    if (!cache->IsOpen()) {
+      fprintf(stderr, "Cannot open cache file '%s'\n", cache_file);
+      return 1;
+    }
   }
 
   int longest_filename = strlen("#[filename]"); // table header
@@ -129,9 +243,28 @@ int main(int argc, char *argv[]) {
            "min_x", "max_x", "min_y", "max_y", "min_z", "max_z",
            "z-last", "filament-mm");
   }
-  for (int i = optind; i < argc; ++i) {
-    print_file_stats(argv[i], longest_filename, msg_out, config);
+  const int file_count = argc - optind;
+  if (workers > file_count) workers = file_count;
+  if (workers <= 1) {
+    for (int i = optind; i < argc; ++i) {
+      struct BeagleGPrintStats result;
+      const int fd = open_gcode_file(argv[i]);
+      const bool success = determine_print_stats_cached(fd, config, msg_out,
+                                                        cache, &result, -1,
+                                                        pru_cycle_model);
+      print_file_stats(argv[i], longest_filename, success, result);
+    }
+  } else {
+    std::vector<FileStats> files(file_count);
+    for (int i = 0; i < file_count; ++i) {
+      files[i].filename = argv[optind + i];
+      files[i].success = false;
+      files[i].done = false;
+    }
+    StatsWorkerPool pool(config, cache, pru_cycle_model, &files);
+    pool.Run(workers, longest_filename);
   }
   fclose(msg_out);
+  delete cache;
   return 0;
 }
@@ -32,11 +32,14 @@
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #include <algorithm>
+#include <string>
+#include <vector>
 
 #include "common/logging.h"
 #include "gcode-parser/gcode-parser.h"
@@ -56,12 +59,118 @@ extern const char *measureLinePS;
 enum class ProcessingStep {
   Init,
   Preprocess,
-  GenerateOutput
+  GenerateOutput,
+  Streaming        // Single pass, decimated output.
+};
+
+// Points of a polyline written at once.
+#define DECIMATE_MAX_POLYLINE 256
+
+// Max points merged into one straight segment; keeps the check cheap.
+#define DECIMATE_MAX_RUN 64
+
+// Speed colors when decimating. Fewer than the 256 of the full output, so
+// that small speed jitter doesn't break up the path.
+#define DECIMATE_COLOR_LEVELS 32
+
+// Writes a path as PostScript polylines, leaving out details below the
+// output resolution: points that don't deviate more than the resolution
+// from a straight line are merged into one segment, which also drops all
+// sub-pixel segments.
+// Each polyline is written with absolute coordinates and its own style, so
+// it does not depend on anything else written to the file.
+class DecimatingPathWriter {
+public:
+  DecimatingPathWriter(FILE *file, float resolution)
+    : file_(file), resolution_(resolution) {}
+  ~DecimatingPathWriter() { Flush(); }
+
+  // PostScript setting the line width and color of the following path.
+  void SetStyle(const std::string &style) {
+    if (style == style_) return;
+    Flush();
+    style_ = style;
+  }
+
+  void MoveTo(float x, float y) {
+    Flush();
+    pos_ = { x, y };
+  }
+
+  void LineTo(float x, float y) {
+    ++input_points_;
+    if (polyline_.empty()) polyline_.push_back(pos_);
+    pos_ = { x, y };
+    if (run_.size() >= DECIMATE_MAX_RUN || !RunStaysOnLineTo(pos_)) {
+      CommitRun();
+    }
+    run_.push_back(pos_);
+  }
+
+  void Flush() {
+    if (!run_.empty()) CommitRun();
+    WritePolyline();
+    polyline_.clear();
+  }
+
+  unsigned long input_points() const { return input_points_; }
+  unsigned long output_points() const { return output_points_; }
+
+private:
+  struct Point { float x, y; };
+
+  // Are all points in the current run close enough to the straight line
+  // from the last polyline point to "to" ?
+  bool RunStaysOnLineTo(const Point &to) const {
+    const Point &from = polyline_.back();
+    const float dx = to.x - from.x;
+    const float dy = to.y - from.y;
+    const float len2 = dx*dx + dy*dy;
+    for (const Point &p : run_) {
+      float t = len2 > 0 ? ((p.x - from.x)*dx + (p.y - from.y)*dy) / len2 : 0;
+      t = std::max(0.0f, std::min(1.0f, t));
+      if (hypotf(from.x + t*dx - p.x, from.y + t*dy - p.y) > resolution_)
+        return false;
+    }
+    return true;
+  }
+
+  // The end of the current run becomes the next point of the polyline.
+  void CommitRun() {
+    polyline_.push_back(run_.back());
+    run_.clear();
+    if (polyline_.size() >= DECIMATE_MAX_POLYLINE) {
+      WritePolyline();
+      polyline_.erase(polyline_.begin(), polyline_.end() - 1);
+    }
+  }
+
+  void WritePolyline() {
+    if (polyline_.size() < 2) return;
+    fprintf(file_, "%s %.3f %.3f moveto\n", style_.c_str(),
+            polyline_[0].x, polyline_[0].y);
+    for (size_t i = 1; i < polyline_.size(); ++i) {
+      fprintf(file_, "%.3f %.3f lineto\n", polyline_[i].x, polyline_[i].y);
+    }
+    fprintf(file_, "stroke\n");
+    output_points_ += polyline_.size() - 1;
+  }
+
+  FILE *const file_;
+  const float resolution_;
+  std::string style_;
+  Point pos_ = { 0, 0 };
+  std::vector<Point> polyline_;  // Points to write; last is start of run_.
+  std::vector<Point> run_;       // Points merged into one segment.
+  unsigned long input_points_ = 0;
+  unsigned long output_points_ = 0;
 };
 
 // Simple gcode visualizer. Takes the gcode and shows its range.
 // Takes two passes: first determines the bounding box to show axes, second
-// draws within these.
+// draws within these. Or, streaming, a single pass writing the decimated
+// path and passing all events on to the machine; the range is only known
+// at the end then.
 class GCodePrintVisualizer : public GCodeParser::EventReceiver {
 public:
   GCodePrintVisualizer(FILE *file, bool show_ijk, float scale)
@@ -71,34 +180,60 @@ public:
   // Pass 1 - preparation, pass 2 - writing.
   void SetPass(ProcessingStep p) { pass_ = p; }
 
-  void set_speed_factor(float f) final {}
-  void set_temperature(float f) final {}
-  void set_fanspeed(float speed) final {}
-  void wait_temperature() final {}
-  void motors_enable(bool b) final {}
+  // Single pass: draw to "path" and forward all events to "delegatee",
+  // which can be NULL.
+  void SetStreaming(DecimatingPathWriter *path,
+                    GCodeParser::EventReceiver *delegatee) {
+    pass_ = ProcessingStep::Streaming;
+    path_ = path;
+    delegatee_ = delegatee;
+    path_->SetStyle("0.1 setlinewidth 0 0 0 setrgbcolor");
+  }
+
+  void set_speed_factor(float f) final {
+    if (delegatee_) delegatee_->set_speed_factor(f);
+  }
+  void set_temperature(float f) final {
+    if (delegatee_) delegatee_->set_temperature(f);
+  }
+  void set_fanspeed(float speed) final {
+    if (delegatee_) delegatee_->set_fanspeed(speed);
+  }
+  void wait_temperature() final {
+    if (delegatee_) delegatee_->wait_temperature();
+  }
+  void motors_enable(bool b) final {
+    if (delegatee_) delegatee_->motors_enable(b);
+  }
   void go_home(AxisBitmap_t axes) final {
     // TODO: this might actually be a different corner of machine.
     if (pass_ == ProcessingStep::GenerateOutput) {
       fprintf(file_, "stroke 0 0 moveto  %% G28\n");
+    } else if (pass_ == ProcessingStep::Streaming) {
+      path_->MoveTo(0, 0);
     }
+    if (delegatee_) delegatee_->go_home(axes);
+  }
+  void inform_origin_offset(const AxesRegister& axes) final {
+    if (delegatee_) delegatee_->inform_origin_offset(axes);
+  }
+  void input_idle(bool is_first) final {
+    if (delegatee_) delegatee_->input_idle(is_first);
+  }
+  void dwell(float value) final {
+    if (delegatee_) delegatee_->dwell(value);
   }
-  void inform_origin_offset(const AxesRegister& axes) final {}
-  void dwell(float value) final { }
   bool rapid_move(float feed, const AxesRegister &axes) final {
-    return coordinated_move(feed, axes);
+    Draw(axes);
+    return delegatee_ ? delegatee_->rapid_move(feed, axes) : true;
   }
   bool coordinated_move(float feed, const AxesRegister &axes) final {
-    if (pass_ == ProcessingStep::Preprocess) {
-      RememberMinMax(axes);
-    } else {
-      ++segment_count_;
-      fprintf(file_, "%f %f lineto\n", axes[AXIS_X], axes[AXIS_Y]);
-      if (segment_count_ % 256 == 0) {
-        // Flush graphic context.
-        fprintf(file_, "currentpoint\nstroke\nmoveto\n");
-      }
-    }
-    return true;
+    Draw(axes);
+    return delegatee_ ? delegatee_->coordinated_move(feed, axes) : true;
+  }
+  float arc_max_chord_error() final {
+    return delegatee_ ? delegatee_->arc_max_chord_error()
+      : EventReceiver::arc_max_chord_error();
   }
 
   void arc_move(float feed_mm_p_sec,
@@ -134,6 +269,7 @@ public:
   }
 
   void gcode_command_done(char letter, float val) final {
+    if (delegatee_) delegatee_->gcode_command_done(letter, val);
     // Remember if things were set to inch or metric, so that we can
     // show dimensions in preferred units.
     if (letter == 'G') {
@@ -146,10 +282,11 @@ public:
   }
 
   const char *unprocessed(char letter, float value, const char *remain) final {
-    return NULL;
+    return delegatee_ ? delegatee_->unprocessed(letter, value, remain) : NULL;
   }
 
   void gcode_start(GCodeParser *parser) final {
+    if (delegatee_) delegatee_->gcode_start(parser);
     if (pass_ == ProcessingStep::GenerateOutput) {
       fprintf(file_, "\n%% -- Path generated from GCode.\n");
       fprintf(file_, "0.1 setlinewidth 0 0 0 setrgbcolor\n0 0 moveto\n");
@@ -160,6 +297,8 @@ public:
     if (pass_ == ProcessingStep::GenerateOutput && end_of_stream) {
       fprintf(file_, "stroke\n");
     }
+    if (pass_ == ProcessingStep::Streaming) path_->Flush();
+    if (delegatee_) delegatee_->gcode_finished(end_of_stream);
   }
 
   void GetDimensions(float *x, float *y, float *width, float *height) {
@@ -224,15 +363,51 @@ public:
   }
 
   void PrintPostscriptBoundingBox(float margin_x, float margin_y) {
+    fprintf(file_, "%%!PS-Adobe-3.0 EPSF-3.0\n");
+    PrintBoundingBoxComment(margin_x, margin_y);
+  }
+
+  // When streaming, the range is only known in the end.
+  void PrintPostscriptBoundingBoxAtEnd() {
     fprintf(file_, "%%!PS-Adobe-3.0 EPSF-3.0\n"
-            "%%%%BoundingBox: %d %d %d %d\n",
+            "%%%%BoundingBox: (atend)\n");
+  }
+  void PrintPostscriptTrailer(float margin_x, float margin_y) {
+    fprintf(file_, "%%%%Trailer\n");
+    PrintBoundingBoxComment(margin_x, margin_y);
+  }
+
+private:
+  void Draw(const AxesRegister &axes) {
+    switch (pass_) {
+    case ProcessingStep::Init:
+      break;
+    case ProcessingStep::Preprocess:
+      RememberMinMax(axes);
+      break;
+    case ProcessingStep::GenerateOutput:
+      ++segment_count_;
+      fprintf(file_, "%f %f lineto\n", axes[AXIS_X], axes[AXIS_Y]);
+      if (segment_count_ % 256 == 0) {
+        // Flush graphic context.
+        fprintf(file_, "currentpoint\nstroke\nmoveto\n");
+      }
+      break;
+    case ProcessingStep::Streaming:
+      RememberMinMax(axes);
+      path_->LineTo(axes[AXIS_X], axes[AXIS_Y]);
+      break;
+    }
+  }
+
+  void PrintBoundingBoxComment(float margin_x, float margin_y) {
+    fprintf(file_, "%%%%BoundingBox: %d %d %d %d\n",
             ToPoint(scale_ * (min_[AXIS_X] - 10)),
             ToPoint(scale_ * (min_[AXIS_Y] - 10)),
             ToPoint(scale_ * (max_[AXIS_X] + 10 + margin_x)),
             ToPoint(scale_ * (max_[AXIS_Y] + 10 + margin_y)));
   }
 
-private:
   void RememberMinMax(const AxesRegister &axes) {
     if (axes[AXIS_X] < min_[AXIS_X]) min_[AXIS_X] = axes[AXIS_X];
     if (axes[AXIS_Y] < min_[AXIS_Y]) min_[AXIS_Y] = axes[AXIS_Y];
@@ -255,6 +430,8 @@ private:
   unsigned int segment_count_ = 0;
   ProcessingStep pass_ = ProcessingStep::Init;
   bool prefer_inch_display_ = false;
+  DecimatingPathWriter *path_ = NULL;
+  GCodeParser::EventReceiver *delegatee_ = NULL;
 };
 
 // Taking the low-level motor operations and visualize them. Uses color
@@ -284,6 +461,16 @@ public:
     fprintf(file_, "stroke %% Finished Machine Pathstroke\n");
   }
 
+  // Single pass: the colors span speeds from zero to "max_speed", the
+  // path is drawn to "path" as it comes.
+  void SetStreaming(DecimatingPathWriter *path, float max_speed) {
+    pass_ = ProcessingStep::Streaming;
+    path_ = path;
+    min_color_range_ = 0;
+    max_color_range_ = max_speed;
+    path_->SetStyle("tool-diameter setlinewidth 0.6 0.6 0.6 setrgbcolor");
+  }
+
   void SetPass(ProcessingStep p) {
     pass_ = p;
     if (pass_ == ProcessingStep::GenerateOutput) {
@@ -312,6 +499,9 @@ public:
 
     switch (pass_) {
     case ProcessingStep::Init: assert(false); break;
+    case ProcessingStep::Streaming:
+      PrintDecimatedSegment(param, dominant_axis);
+      break;
     case ProcessingStep::Preprocess: {
       // A very short diagnoal move, quantized to steps has a speed of sqrt(2);
       // let's not include these in the min/max calculation.
@@ -405,13 +595,42 @@ public:
     }
   }
 
+  // Segment to the decimating path writer; colored with its average speed.
+  void PrintDecimatedSegment(const LinearSegmentSteps &param,
+                             int dominant_axis) {
+    const float dx_mm = param.steps[AXIS_X] / config_.steps_per_mm[AXIS_X];
+    const float dy_mm = param.steps[AXIS_Y] / config_.steps_per_mm[AXIS_Y];
+    const float dz_mm = param.steps[AXIS_Z] / config_.steps_per_mm[AXIS_Z];
+    x_mm_ += dx_mm;
+    y_mm_ += dy_mm;
+    if (show_speeds_) {
+      const float segment_len = sqrtf(dx_mm*dx_mm + dy_mm*dy_mm + dz_mm*dz_mm);
+      const float segment_speed_factor = segment_len /
+        (abs(param.steps[dominant_axis]) / config_.steps_per_mm[dominant_axis]);
+      const float v = segment_speed_factor * (param.v0 + param.v1) / 2
+        / config_.steps_per_mm[dominant_axis];
+      RememberMinMax(v);
+      const int level = (v < max_color_range_)
+        ? roundf((DECIMATE_COLOR_LEVELS - 1) * v / max_color_range_)
+        : DECIMATE_COLOR_LEVELS - 1;
+      const int col_idx = level * 255 / (DECIMATE_COLOR_LEVELS - 1);
+      if (col_idx != last_color_index_) {
+        path_->SetStyle(std::string("tool-diameter setlinewidth ")
+                        + viridis_colors[col_idx] + " setrgbcolor");
+        last_color_index_ = col_idx;
+      }
+    }
+    path_->LineTo(x_mm_, y_mm_);
+  }
+
   void MotorEnable(bool on) final {}
   void WaitQueueEmpty() final {}
   bool GetPhysicalStatus(PhysicalStatus *status) final { return false; }
   void SetExternalPosition(int axis, int pos) final {}
 
   void PrintColorLegend(float x, float y, float width) {
-    assert(pass_ == ProcessingStep::GenerateOutput);
+    assert(pass_ == ProcessingStep::GenerateOutput
+           || pass_ == ProcessingStep::Streaming);
     if (min_color_range_ >= max_color_range_)
       return;
     const float barheight = std::min(8.0, 0.05 * width);
@@ -475,9 +694,246 @@ private:
   float min_color_range_;   // These are set in pass==2
   float max_color_range_;
 
+  DecimatingPathWriter *path_ = NULL;   // When streaming.
+  float x_mm_ = 0;
+  float y_mm_ = 0;
+
   MotorOperationsPrinter(const MotorOperationsPrinter &);
 };
 
+// What a heatmap shows.
+enum class HeatmapMode {
+  Time,    // Where the machine spends its time.
+  Speed    // Achieved speed relative to the commanded speed.
+};
+
+// Pixels of the heatmap sampled per pixel length of a line.
+#define HEATMAP_SAMPLES_PER_PIXEL 2
+
+// Raster of the machine area. Lines are accumulated into pixels, so the
+// memory and output size only depend on the resolution, not on the number
+// of segments.
+class Heatmap {
+public:
+  // Covers x/y width/height in mm with "width_px" pixels horizontally.
+  Heatmap(float x, float y, float width, float height, int width_px)
+    : x_(x), y_(y),
+      pixels_per_mm_(width_px / std::max(width, 1.0f)),
+      width_px_(width_px),
+      height_px_(std::max(1, (int)ceilf(height * pixels_per_mm_))),
+      actual_(width_px_ * height_px_), commanded_(width_px_ * height_px_) {}
+
+  // Record "seconds" the machine took from (x0,y0) to (x1,y1).
+  void AddActual(float x0, float y0, float x1, float y1, float seconds) {
+    AddLine(x0, y0, x1, y1, seconds, &actual_);
+  }
+  // Record "seconds" the move would take at commanded speed.
+  void AddCommanded(float x0, float y0, float x1, float y1, float seconds) {
+    AddLine(x0, y0, x1, y1, seconds, &commanded_);
+  }
+
+  double total_actual() const { return Sum(actual_); }
+  double total_commanded() const { return Sum(commanded_); }
+
+  // Write a binary PPM image with the heatmap in "mode", top row first.
+  void WritePPM(FILE *out, HeatmapMode mode) const {
+    unsigned char colors[256][3];
+    for (int i = 0; i < 256; ++i) {
+      float r, g, b;
+      sscanf(viridis_colors[i], "%f %f %f", &r, &g, &b);
+      colors[i][0] = roundf(255 * r);
+      colors[i][1] = roundf(255 * g);
+      colors[i][2] = roundf(255 * b);
+    }
+    const float max_time = *std::max_element(actual_.begin(), actual_.end());
+    fprintf(out, "P6\n%d %d\n255\n", width_px_, height_px_);
+    std::vector<unsigned char> row(3 * width_px_);
+    for (int py = height_px_ - 1; py >= 0; --py) {
+      for (int px = 0; px < width_px_; ++px) {
+        const float actual = actual_[py * width_px_ + px];
+        unsigned char *const rgb = &row[3 * px];
+        if (actual <= 0) {
+          rgb[0] = rgb[1] = rgb[2] = 255;  // Nothing happened here.
+          continue;
+        }
+        float value;   // 0..1
+        if (mode == HeatmapMode::Time) {
+          // Logarithmic; three orders of magnitude below the maximum.
+          value = 1 + log10f(actual / max_time) / 3;
+        } else {
+          // The commanded path is not quantized to motor steps, so it can
+          // be off by a pixel; compare the neighborhood.
+          value = Neighborhood(commanded_, px, py)
+            / Neighborhood(actual_, px, py);
+        }
+        const int index = roundf(255 * std::max(0.0f, std::min(1.0f, value)));
+        memcpy(rgb, colors[index], 3);
+      }
+      fwrite(row.data(), 1, row.size(), out);
+    }
+  }
+
+private:
+  // Distribute "value" evenly along the line.
+  void AddLine(float x0, float y0, float x1, float y1, float value,
+               std::vector<float> *raster) {
+    const float len_px = hypotf(x1 - x0, y1 - y0) * pixels_per_mm_;
+    const int samples = std::max(1, (int)(len_px * HEATMAP_SAMPLES_PER_PIXEL));
+    for (int i = 0; i < samples; ++i) {
+      const float t = (i + 0.5f) / samples;
+      const int px = floorf((x0 + t * (x1 - x0) - x_) * pixels_per_mm_);
+      const int py = floorf((y0 + t * (y1 - y0) - y_) * pixels_per_mm_);
+      if (px < 0 || px >= width_px_ || py < 0 || py >= height_px_)
+        continue;
+      (*raster)[py * width_px_ + px] += value / samples;
+    }
+  }
+
+  float Neighborhood(const std::vector<float> &raster, int px, int py) const {
+    float result = 0;
+    const int x_end = std::min(width_px_ - 1, px + 1);
+    const int y_end = std::min(height_px_ - 1, py + 1);
+    for (int y = std::max(0, py - 1); y <= y_end; ++y) {
+      for (int x = std::max(0, px - 1); x <= x_end; ++x) {
+        result += raster[y * width_px_ + x];
+      }
+    }
+    return result;
+  }
+
+  static double Sum(const std::vector<float> &v) {
+    double result = 0;
+    for (float f : v) result += f;
+    return result;
+  }
+
+  const float x_, y_;
+  const float pixels_per_mm_;
+  const int width_px_;
+  const int height_px_;
+  std::vector<float> actual_;      // Seconds the machine spent per pixel.
+  std::vector<float> commanded_;   // Seconds at commanded speed per pixel.
+};
+
+// Records the time the motor segments take into a heatmap.
+class HeatmapMotorOperations : public MotorOperations {
+public:
+  HeatmapMotorOperations(const MachineControlConfig &config, Heatmap *heatmap)
+    : config_(config), heatmap_(heatmap) {}
+
+  void SetPosition(float x, float y) { x_ = x; y_ = y; }
+
+  void Enqueue(const LinearSegmentSteps &param) final {
+    int max_steps = 0;
+    for (int i = 0; i < BEAGLEG_NUM_MOTORS; ++i) {
+      max_steps = std::max(max_steps, abs(param.steps[i]));
+    }
+    if (max_steps == 0 || param.v0 + param.v1 <= 0)
+      return;
+    const float x = x_ + param.steps[AXIS_X] / config_.steps_per_mm[AXIS_X];
+    const float y = y_ + param.steps[AXIS_Y] / config_.steps_per_mm[AXIS_Y];
+    // Same as in determine_print_stats()
+    heatmap_->AddActual(x_, y_, x, y, 2 * max_steps / (param.v0 + param.v1));
+    x_ = x;
+    y_ = y;
+  }
+
+  void MotorEnable(bool on) final {}
+  void WaitQueueEmpty() final {}
+  bool GetPhysicalStatus(PhysicalStatus *status) final { return false; }
+  void SetExternalPosition(int axis, int pos) final {}
+
+private:
+  const MachineControlConfig &config_;
+  Heatmap *const heatmap_;
+  float x_ = 0;
+  float y_ = 0;
+};
+
+// Records the time moves would take at the commanded speed into a heatmap,
+// then passes the events on to the machine.
+class HeatmapEventDelegator : public GCodeParser::EventReceiver {
+public:
+  HeatmapEventDelegator(const MachineControlConfig &config,
+                        GCodeMachineControl *machine,
+                        HeatmapMotorOperations *motor_ops, Heatmap *heatmap)
+    : config_(config), machine_(machine),
+      delegatee_(machine->ParseEventReceiver()),
+      motor_ops_(motor_ops), heatmap_(heatmap) {
+    SyncPosition();
+  }
+
+  void gcode_start(GCodeParser *p) final { delegatee_->gcode_start(p); }
+  void gcode_finished(bool eos) final { delegatee_->gcode_finished(eos); }
+  void gcode_command_done(char l, float v) final {
+    delegatee_->gcode_command_done(l, v);
+  }
+  void set_speed_factor(float f) final { delegatee_->set_speed_factor(f); }
+  void set_temperature(float f) final { delegatee_->set_temperature(f); }
+  void set_fanspeed(float speed) final { delegatee_->set_fanspeed(speed); }
+  void wait_temperature() final { delegatee_->wait_temperature(); }
+  void motors_enable(bool b) final { delegatee_->motors_enable(b); }
+  void dwell(float value) final { delegatee_->dwell(value); }
+  void inform_origin_offset(const AxesRegister& axes) final {
+    delegatee_->inform_origin_offset(axes);
+  }
+  void go_home(AxisBitmap_t axes) final {
+    delegatee_->go_home(axes);
+    SyncPosition();   // Homing does not go through the motor operations.
+  }
+  const char *unprocessed(char letter, float value, const char *remain) final {
+    return delegatee_->unprocessed(letter, value, remain);
+  }
+  float arc_max_chord_error() final {
+    return delegatee_->arc_max_chord_error();
+  }
+
+  bool rapid_move(float feed, const AxesRegister &axes) final {
+    AddCommanded(-1, axes);
+    return delegatee_->rapid_move(feed, axes);
+  }
+  bool coordinated_move(float feed, const AxesRegister &axes) final {
+    if (feed > 0) feed_ = feed;   // Otherwise, the previous one continues.
+    AddCommanded(feed_, axes);
+    return delegatee_->coordinated_move(feed, axes);
+  }
+
+private:
+  void SyncPosition() {
+    machine_->GetCurrentPosition(&pos_);
+    motor_ops_->SetPosition(pos_[AXIS_X], pos_[AXIS_Y]);
+  }
+
+  // The commanded speed, limited by what the axes can do at most.
+  void AddCommanded(float feed, const AxesRegister &axes) {
+    float len2 = 0;
+    for (const GCodeParserAxis axis : { AXIS_X, AXIS_Y, AXIS_Z }) {
+      len2 += (axes[axis] - pos_[axis]) * (axes[axis] - pos_[axis]);
+    }
+    const float len = sqrtf(len2);
+    float speed = feed > 0 ? feed * config_.speed_factor : 1e10;
+    for (const GCodeParserAxis axis : { AXIS_X, AXIS_Y, AXIS_Z }) {
+      const float d = fabsf(axes[axis] - pos_[axis]);
+      if (d > 0 && config_.max_feedrate[axis] > 0) {
+        speed = std::min(speed, config_.max_feedrate[axis] * len / d);
+      }
+    }
+    if (len > 0 && speed < 1e10) {
+      heatmap_->AddCommanded(pos_[AXIS_X], pos_[AXIS_Y],
+                             axes[AXIS_X], axes[AXIS_Y], len / speed);
+    }
+    pos_ = axes;
+  }
+
+  const MachineControlConfig &config_;
+  GCodeMachineControl *const machine_;
+  GCodeParser::EventReceiver *const delegatee_;
+  HeatmapMotorOperations *const motor_ops_;
+  Heatmap *const heatmap_;
+  AxesRegister pos_;
+  float feed_ = -1;
+};
+
 static int usage(const char *progname) {
   fprintf(stderr, "Usage: %s [options] <gcode-file>\n"
           "Options:\n"
@@ -489,6 +945,14 @@ static int usage(const char *progname) {
           "\t-D                : show dimensions\n"
           "\t-S<factor>        : Scale the output (e.g. to fit on page)\n"
           "\t-i                : Toggle show IJK control lines\n"
+          "\t-F <resolution>   : Fast single pass for huge files: leave out\n"
+          "\t                    details smaller than this many mm in the\n"
+          "\t                    output (e.g. 0.1); no IJK lines. Use\n"
+          "\t                    filename '-' for stdin.\n"
+          "\t-H <time|speed>   : Instead of PostScript, write a PPM heatmap\n"
+          "\t                    of the time spent, or of the achieved vs.\n"
+          "\t                    commanded speed. Needs -c.\n"
+          "\t-W <pixels>       : Width of the heatmap (Default 1024).\n"
           "Without config, only GCode path is shown; with config also the\n"
           "actual machine path.\n", progname);
   return 1;
@@ -509,6 +973,203 @@ static bool ParseFile(GCodeParser *parser, const char *filename, bool do_reset)
   return true;
 }
 
+static bool ReadMachineConfig(const char *config_file, float threshold_angle,
+                              bool range_check,
+                              MachineControlConfig *machine_config,
+                              GCodeParser::Config *parser_cfg) {
+  ConfigParser config_parser;
+  if (!config_parser.SetContentFromFile(config_file)) {
+    fprintf(stderr, "Cannot read config file '%s'\n", config_file);
+    return false;
+  }
+  if (!machine_config->ConfigureFromFile(&config_parser)) {
+    fprintf(stderr, "Exiting. Parse error in configuration file '%s'\n",
+            config_file);
+    return false;
+  }
+  machine_config->threshold_angle = threshold_angle;
+
+  // This is not connected to any machine. Don't assume homing, but
+  // at least extract the home position from the config.
+  machine_config->require_homing = false;
+  for (const GCodeParserAxis axis : AllAxes()) {
+    HardwareMapping::AxisTrigger trigger = machine_config->homing_trigger[axis];
+    parser_cfg->machine_origin[axis] =
+      (trigger & HardwareMapping::TRIGGER_MAX)
+      ? machine_config->move_range_mm[axis]
+      : 0;
+  }
+
+  machine_config->acknowledge_lines = false;
+  machine_config->range_check = range_check;
+  return true;
+}
+
+// Single pass over the G-code, so that it also works with stdin. The
+// paths are decimated to the output "resolution" in mm. As the range is not
+// known beforehand, the bounding box and dimensions come at the end.
+// The G-code path is collected in a temporary file, so that it
+// can be drawn on top of the machine path.
+static int RenderStreaming(const char *filename, FILE *output_file,
+                           const char *config_file, float threshold_angle,
+                           bool range_check, float tool_diameter_mm,
+                           bool show_dimensions, bool show_speeds,
+                           float scale, float resolution) {
+  const float printMargin = 2 + tool_diameter_mm/2;
+  const int fd = strcmp(filename, "-") == 0
+    ? STDIN_FILENO
+    : open(filename, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Cannot open %s\n", filename);
+    return 1;
+  }
+  FILE *gcode_path_file = tmpfile();
+  if (gcode_path_file == NULL) {
+    fprintf(stderr, "Cannot create temporary file.\n");
+    return 1;
+  }
+
+  GCodeParser::Config parser_cfg;
+  GCodeParser::Config::ParamMap parameters;
+  parser_cfg.parameters = &parameters;
+  struct MachineControlConfig machine_config;
+  if (config_file &&
+      !ReadMachineConfig(config_file, threshold_angle, range_check,
+                         &machine_config, &parser_cfg)) {
+    return 1;
+  }
+
+  GCodePrintVisualizer gcode_printer(output_file, false, scale);
+  gcode_printer.PrintPostscriptBoundingBoxAtEnd();
+  fprintf(output_file, "72 25.4 div dup scale  %% Numbers mean millimeter\n");
+  if (scale != 1.0f) {
+    fprintf(output_file, "%f %f scale  %% Scale for page fit\n", scale, scale);
+  }
+
+  // Resolution is in output mm, the drawing is scaled.
+  DecimatingPathWriter gcode_path(gcode_path_file, resolution / scale);
+  DecimatingPathWriter machine_path(output_file, resolution / scale);
+
+  HardwareMapping hardware;
+  Spindle spindle;
+  MotorOperationsPrinter *motor_printer = NULL;
+  GCodeMachineControl *machine_control = NULL;
+  if (config_file) {
+    motor_printer = new MotorOperationsPrinter(output_file, machine_config,
+                                               tool_diameter_mm, show_speeds);
+    machine_control = GCodeMachineControl::Create(machine_config,
+                                                  motor_printer,
+                                                  &hardware, &spindle, stderr);
+    if (!machine_control) {
+      Log_init("/dev/stderr");
+      Log_error("Cannot initialize machine:");
+      GCodeMachineControl::Create(machine_config, motor_printer,
+                                  &hardware, &spindle, stderr);
+      return 1;
+    }
+    float max_speed = 0;
+    for (const GCodeParserAxis axis : { AXIS_X, AXIS_Y, AXIS_Z }) {
+      max_speed = std::max(max_speed, machine_config.max_feedrate[axis]);
+    }
+    motor_printer->SetStreaming(&machine_path, max_speed);
+  }
+  gcode_printer.SetStreaming(&gcode_path,
+                             machine_control
+                             ? machine_control->ParseEventReceiver() : NULL);
+
+  GCodeParser parser(parser_cfg, &gcode_printer, false);
+  parser.ParseStream(fd, stderr);
+  if (fd != STDIN_FILENO) close(fd);
+
+  machine_path.Flush();
+  if (show_speeds && motor_printer) {
+    float x, y, w, h;
+    gcode_printer.GetDimensions(&x, &y, &w, &h);
+    motor_printer->PrintColorLegend(x, y + h + 15, w);
+  }
+  delete machine_control;
+  delete motor_printer;
+
+  gcode_printer.ShowHomePos();  // On top of machine path to be visible.
+  gcode_path.Flush();
+  fprintf(output_file, "\n%% -- Path generated from GCode.\n");
+  rewind(gcode_path_file);
+  char buffer[65536];
+  size_t r;
+  while ((r = fread(buffer, 1, sizeof(buffer), gcode_path_file)) > 0) {
+    fwrite(buffer, 1, r, output_file);
+  }
+  fclose(gcode_path_file);
+
+  if (show_dimensions) {
+    gcode_printer.PrintShowRange(printMargin);
+  }
+  fprintf(output_file, "\nshowpage\n");
+  gcode_printer.PrintPostscriptTrailer(printMargin,
+                                       printMargin + (show_speeds ? 15 : 0));
+  fclose(output_file);
+
+  fprintf(stderr, "Decimated %lu G-code and %lu machine segments "
+          "to %lu and %lu.\n",
+          gcode_path.input_points(), machine_path.input_points(),
+          gcode_path.output_points(), machine_path.output_points());
+  return parser.error_count() == 0 ? 0 : 1;
+}
+
+// Instead of PostScript, write a PPM image of where the machine spends its
+// time, or how close it gets to the commanded speed. The first pass only
+// determines the range.
+static int RenderHeatmap(const char *filename, FILE *output_file,
+                         const char *config_file, float threshold_angle,
+                         HeatmapMode mode, int width_px) {
+  GCodeParser::Config parser_cfg;
+  GCodeParser::Config::ParamMap parameters;
+  parser_cfg.parameters = &parameters;
+  struct MachineControlConfig machine_config;
+  if (!ReadMachineConfig(config_file, threshold_angle, false,
+                         &machine_config, &parser_cfg)) {
+    return 1;
+  }
+
+  GCodePrintVisualizer range_finder(output_file, false, 1.0f);
+  range_finder.SetPass(ProcessingStep::Preprocess);
+  {
+    GCodeParser range_parser(parser_cfg, &range_finder, false);
+    if (!ParseFile(&range_parser, filename, false))
+      return 1;
+  }
+  float x, y, w, h;
+  range_finder.GetDimensions(&x, &y, &w, &h);
+  Heatmap heatmap(x, y, w, h, width_px);
+
+  HardwareMapping hardware;
+  Spindle spindle;
+  HeatmapMotorOperations motor_ops(machine_config, &heatmap);
+  GCodeMachineControl *machine_control
+    = GCodeMachineControl::Create(machine_config, &motor_ops,
+                                  &hardware, &spindle, stderr);
+  if (!machine_control) {
+    Log_init("/dev/stderr");
+    Log_error("Cannot initialize machine:");
+    GCodeMachineControl::Create(machine_config, &motor_ops,
+                                &hardware, &spindle, stderr);
+    return 1;
+  }
+  HeatmapEventDelegator delegator(machine_config, machine_control,
+                                  &motor_ops, &heatmap);
+  GCodeParser parser(parser_cfg, &delegator, false);
+  ParseFile(&parser, filename, false);
+  delete machine_control;
+
+  heatmap.WritePPM(output_file, mode);
+  fclose(output_file);
+  fprintf(stderr, "Machine time %.1fs; %.1fs at commanded speed (%.0f%%).\n",
+          heatmap.total_actual(), heatmap.total_commanded(),
+          100 * heatmap.total_commanded()
+          / std::max(heatmap.total_actual(), 1e-6));
+  return parser.error_count() == 0 ? 0 : 1;
+}
+
 int main(int argc, char *argv[]) {
   const char *config_file = NULL;
   FILE *output_file = stdout;
@@ -519,9 +1180,13 @@ int main(int argc, char *argv[]) {
   bool range_check = false;
   bool show_ijk = true;
   float scale = 1.0f;
+  float stream_resolution = -1;
+  bool heatmap = false;
+  HeatmapMode heatmap_mode = HeatmapMode::Time;
+  int heatmap_width = 1024;
 
   int opt;
-  while ((opt = getopt(argc, argv, "o:c:T:Dt:srS:i")) != -1) {
+  while ((opt = getopt(argc, argv, "o:c:T:Dt:srS:iF:H:W:")) != -1) {
     switch (opt) {
     case 'o':
       output_file = fopen(optarg, "w");
@@ -550,6 +1215,20 @@ int main(int argc, char *argv[]) {
     case 'r':
       range_check = true;
       break;
+    case 'H':
+      heatmap = true;
+      if (strcmp(optarg, "time") == 0) heatmap_mode = HeatmapMode::Time;
+      else if (strcmp(optarg, "speed") == 0) heatmap_mode = HeatmapMode::Speed;
+      else return usage(argv[0]);
+      break;
+    case 'W':
+      heatmap_width = atoi(optarg);
+      if (heatmap_width <= 0) return usage(argv[0]);
+      break;
+    case 'F':
+      stream_resolution = atof(optarg);
+      if (stream_resolution <= 0) return usage(argv[0]);
+      break;
     default:
       return usage(argv[0]);
     }
@@ -567,8 +1246,21 @@ int main(int argc, char *argv[]) {
 
   Log_init("/dev/null");
 
-  // TODO(hzeller): only parse the file once, so that we can read from stdin.
   const char *filename = argv[optind];
+  if (heatmap) {
+    if (!config_file) {
+      fprintf(stderr, "Heatmap needs the machine config -c <config>\n");
+      return 1;
+    }
+    return RenderHeatmap(filename, output_file, config_file, threshold_angle,
+                         heatmap_mode, heatmap_width);
+  }
+  if (stream_resolution > 0) {
+    return RenderStreaming(filename, output_file, config_file,
+                           threshold_angle, range_check, tool_diameter_mm,
+                           show_dimensions, show_speeds, scale,
+                           stream_resolution);
+  }
 
   GCodeParser::Config parser_cfg;
   GCodeParser::Config::ParamMap parameters;  // TODO: read from file ?
@@ -592,31 +1284,10 @@ int main(int argc, char *argv[]) {
 
   if (config_file) {
     struct MachineControlConfig machine_config;
-    ConfigParser config_parser;
-    if (!config_parser.SetContentFromFile(config_file)) {
-      fprintf(stderr, "Cannot read config file '%s'\n", config_file);
-      return 1;
-    }
-    if (!machine_config.ConfigureFromFile(&config_parser)) {
-      fprintf(stderr, "Exiting. Parse error in configuration file '%s'\n",
-              config_file);
+    if (!ReadMachineConfig(config_file, threshold_angle, range_check,
+                           &machine_config, &parser_cfg)) {
       return 1;
     }
-    machine_config.threshold_angle = threshold_angle;
-
-    // This is not connected to any machine. Don't assume homing, but
-    // at least extract the home position from the config.
-    machine_config.require_homing = false;
-    for (const GCodeParserAxis axis : AllAxes()) {
-      HardwareMapping::AxisTrigger trigger = machine_config.homing_trigger[axis];
-      parser_cfg.machine_origin[axis] =
-        (trigger & HardwareMapping::TRIGGER_MAX)
-        ? machine_config.move_range_mm[axis]
-        : 0;
-    }
-
-    machine_config.acknowledge_lines = false;
-    machine_config.range_check = range_check;
 
     // We never initialize the hardware mapping from the config file, so
     // we have a convenient mapping of gcode-axis == motor-number
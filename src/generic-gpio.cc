@@ -95,6 +95,20 @@ static void set_gpio_mask(uint32_t *mask, uint32_t gpio_def) {
   }
 }
 
+void add_gpio_to_batch(struct GPIOOutputBatch *batch, uint32_t gpio_def,
+                       bool on) {
+  set_gpio_mask(on ? batch->set_mask : batch->clr_mask, gpio_def);
+}
+
+void write_gpio_batch(const struct GPIOOutputBatch *batch) {
+  volatile uint32_t *const ports[4] = { gpio_0, gpio_1, gpio_2, gpio_3 };
+  for (int i = 0; i < 4; ++i) {
+    if (!ports[i]) continue;
+    if (batch->set_mask[i]) ports[i][GPIO_SETDATAOUT/4] = batch->set_mask[i];
+    if (batch->clr_mask[i]) ports[i][GPIO_CLEARDATAOUT/4] = batch->clr_mask[i];
+  }
+}
+
 static void cfg_gpio_io() {
   uint32_t output_mask[4] = { 0, 0, 0, 0 };
 
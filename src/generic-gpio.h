@@ -27,6 +27,19 @@ int get_gpio(uint32_t gpio_def);
 void set_gpio(uint32_t gpio_def);
 void clr_gpio(uint32_t gpio_def);
 
+// Outputs to change at once, gathered per GPIO bank. Writing them takes one
+// GPIO_SETDATAOUT and one GPIO_CLEARDATAOUT access per bank involved,
+// instead of one per pin. Zero-initialize before use.
+struct GPIOOutputBatch {
+  uint32_t set_mask[4];
+  uint32_t clr_mask[4];
+};
+
+// Add output "gpio_def" to be switched on or off. Unmapped ones are ignored.
+void add_gpio_to_batch(struct GPIOOutputBatch *batch, uint32_t gpio_def,
+                       bool on);
+void write_gpio_batch(const struct GPIOOutputBatch *batch);
+
 bool map_gpio();
 void unmap_gpio();
 
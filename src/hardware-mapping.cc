@@ -34,6 +34,7 @@ HardwareMapping::HardwareMapping()
   : estop_input_(0), pause_input_(0), start_input_(0), probe_input_(0),
     aux_bits_(0),
     is_hardware_initialized_(false) {
+  pthread_mutex_init(&aux_mutex_, NULL);
 }
 
 HardwareMapping::~HardwareMapping() {
@@ -42,6 +43,7 @@ HardwareMapping::~HardwareMapping() {
     unmap_gpio();
     pwm_timers_unmap();
   }
+  pthread_mutex_destroy(&aux_mutex_);
 }
 
 bool HardwareMapping::AddAuxMapping(LogicOutput output, int aux) {
@@ -173,7 +175,9 @@ bool HardwareMapping::InitializeHardware() {
 
 void HardwareMapping::ResetHardware() {
   if (!is_hardware_initialized_) return;
+  pthread_mutex_lock(&aux_mutex_);
   aux_bits_ = 0;
+  pthread_mutex_unlock(&aux_mutex_);
   SetAuxOutputs();
   EnableMotors(false);
   for (int i = 0; i < NUM_PWM_OUTPUTS; ++i) {
@@ -191,29 +195,42 @@ void HardwareMapping::EnableMotors(bool on) {
 }
 
 HardwareMapping::AuxBitmap HardwareMapping::GetAuxBits() {
-  return aux_bits_;
+  pthread_mutex_lock(&aux_mutex_);
+  const AuxBitmap result = aux_bits_;
+  pthread_mutex_unlock(&aux_mutex_);
+  return result;
 }
 
 int HardwareMapping::GetAuxBit(int pin) {
-  return (aux_bits_ >> (pin - 1)) & 1;
+  return (GetAuxBits() >> (pin - 1)) & 1;
 }
 
 void HardwareMapping::UpdateAuxBits(int pin, bool is_on) {
+  pthread_mutex_lock(&aux_mutex_);
   if (is_on) aux_bits_ |= (1 << (pin - 1));
   else       aux_bits_ &= ~(1 << (pin - 1));
+  pthread_mutex_unlock(&aux_mutex_);
 }
 
 void HardwareMapping::UpdateAuxBitmap(LogicOutput type, bool is_on) {
+  pthread_mutex_lock(&aux_mutex_);
   if (is_on) aux_bits_ |= output_to_aux_bits_[type];
   else       aux_bits_ &= ~output_to_aux_bits_[type];
+  pthread_mutex_unlock(&aux_mutex_);
 }
 
 void HardwareMapping::SetAuxOutputs() {
   if (!is_hardware_initialized_) return;
+  // Writing under the lock: a concurrent caller can't overwrite the outputs
+  // with bits older than ours.
+  pthread_mutex_lock(&aux_mutex_);
+  struct GPIOOutputBatch batch = {};
   for (int i = 0; i < NUM_BOOL_OUTPUTS; ++i) {
-    if (aux_bits_ & (1 << i)) set_gpio(get_aux_bit_gpio_descriptor(i + 1));
-    else                      clr_gpio(get_aux_bit_gpio_descriptor(i + 1));
+    add_gpio_to_batch(&batch, get_aux_bit_gpio_descriptor(i + 1),
+                      aux_bits_ & (1 << i));
   }
+  write_gpio_batch(&batch);
+  pthread_mutex_unlock(&aux_mutex_);
 }
 
 void HardwareMapping::SetPWMOutput(LogicOutput type, float value) {
@@ -231,6 +248,19 @@ void HardwareMapping::SetPWMOutput(LogicOutput type, float value) {
 #endif
 }
 
+bool HardwareMapping::StartExternalPWM(LogicOutput type,
+                                       uint32_t *match_register,
+                                       uint32_t *duty_zero,
+                                       uint32_t *full_ticks) {
+#ifdef _DISABLE_PWM_TIMERS
+  return false;
+#else
+  if (!is_hardware_initialized_) return false;
+  return pwm_timer_start_external(output_to_pwm_gpio_[type], match_register,
+                                  duty_zero, full_ticks);
+#endif
+}
+
 std::string HardwareMapping::DebugMotorString(LogicAxis axis) {
   const MotorBitmap motormap_for_axis = axis_to_driver_[axis];
   std::string result;
@@ -296,6 +326,31 @@ bool HardwareMapping::TestAxisSwitch(LogicAxis axis, AxisTrigger requested_trigg
   return result;
 }
 
+bool HardwareMapping::GetAxisSwitchInput(LogicAxis axis, AxisTrigger trigger,
+                                         uint32_t *gpio_def,
+                                         bool *trigger_level) {
+  if (!is_hardware_initialized_) return false;
+  int switch_number = 0;
+  if (trigger == TRIGGER_MIN) switch_number = axis_to_min_endstop_[axis];
+  if (trigger == TRIGGER_MAX) switch_number = axis_to_max_endstop_[axis];
+  return GetSwitchInput(switch_number, gpio_def, trigger_level);
+}
+
+bool HardwareMapping::GetProbeSwitchInput(uint32_t *gpio_def,
+                                          bool *trigger_level) {
+  if (!is_hardware_initialized_) return false;
+  return GetSwitchInput(probe_input_, gpio_def, trigger_level);
+}
+
+bool HardwareMapping::GetSwitchInput(int switch_number, uint32_t *gpio_def,
+                                     bool *trigger_level) {
+  const GPIODefinition def = get_endstop_gpio_descriptor(switch_number);
+  if (def == GPIO_NOT_MAPPED) return false;
+  *gpio_def = def;
+  *trigger_level = trigger_level_[switch_number-1];
+  return true;
+}
+
 bool HardwareMapping::TestEStopSwitch() {
   return TestSwitch(estop_input_, false);
 }
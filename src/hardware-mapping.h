@@ -20,6 +20,7 @@
 #ifndef BEAGLEG_HARDWARE_MAPPING_
 #define BEAGLEG_HARDWARE_MAPPING_
 
+#include <pthread.h>
 #include <stdint.h>
 
 #include "gcode-parser/gcode-parser.h"  // For GCodeParserAxis
@@ -159,6 +160,8 @@ public:
   bool IsHardwareSimulated() { return !is_hardware_initialized_; }
 
   // -- Boolean and PWM outputs.
+  // The aux bits can be changed from any thread; the spindle switches its
+  // outputs from the planner thread while holding back motion.
 
   // Enable motors.
   void EnableMotors(bool on);
@@ -188,6 +191,13 @@ public:
   // Set PWM value for given output immediately.
   void SetPWMOutput(LogicOutput type, float value);
 
+  // Start the PWM of the given output at 0% duty, for the duty to be
+  // written directly to the timer's match register from then on. Returns
+  // its physical address, the value for 0% and the ticks to add for 100%.
+  // Returns false if the output is not mapped to a PWM timer.
+  bool StartExternalPWM(LogicOutput type, uint32_t *match_register,
+                        uint32_t *duty_zero, uint32_t *full_ticks);
+
   // -- Motor outputs
 
   // Given the logic axis, return a mask of the physical output drivers.
@@ -216,6 +226,12 @@ public:
   // this will always return false.
   bool TestAxisSwitch(LogicAxis axis, AxisTrigger requested_trigger);
 
+  // Get the GPIO of the endstop for the given axis and trigger (MIN or MAX)
+  // and the level it reads when triggered, so that it can be watched by the
+  // motion backend. Returns false if there is no such switch.
+  bool GetAxisSwitchInput(LogicAxis axis, AxisTrigger trigger,
+                          uint32_t *gpio_def, bool *trigger_level);
+
   // Returns true if the E-Stop input is active.
   bool TestEStopSwitch();
 
@@ -228,6 +244,9 @@ public:
   // Returns true if the probe input is active (or it's not available)
   bool TestProbeSwitch();
 
+  // Like GetAxisSwitchInput(), but for the probe input.
+  bool GetProbeSwitchInput(uint32_t *gpio_def, bool *trigger_level);
+
   bool HasProbeSwitch(LogicAxis axis) const {
     if (axis == AXIS_Z) return probe_input_ != 0;
     return false;
@@ -259,6 +278,8 @@ private:
   // Test current state of given switch number; if not configured, return
   // default result.
   bool TestSwitch(const int switch_number, bool default_result);
+  bool GetSwitchInput(int switch_number, uint32_t *gpio_def,
+                      bool *trigger_level);
 
   void ResetHardware();  // Initialize to a safe state.
 
@@ -281,6 +302,7 @@ private:
   int start_input_;
   int probe_input_;
 
+  pthread_mutex_t aux_mutex_;  // Guards aux_bits_ and writing them out.
   AuxBitmap aux_bits_;       // Set via M42 or various other settings.
 
   bool is_hardware_initialized_;
@@ -0,0 +1,70 @@
+;; -*- asm -*-
+;;
+;; (c) 2016 Henner Zeller <h.zeller@acm.org>
+;;
+;; This file is part of BeagleG. http://github.com/hzeller/beagleg
+;;
+;; BeagleG is free software: you can redistribute it and/or modify
+;; it under the terms of the GNU General Public License as published by
+;; the Free Software Foundation, either version 3 of the License, or
+;; (at your option) any later version.
+;;
+;; BeagleG is distributed in the hope that it will be useful,
+;; but WITHOUT ANY WARRANTY; without even the implied warranty of
+;; MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+;; GNU General Public License for more details.
+;;
+;; You should have received a copy of the GNU General Public License
+;; along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+
+;;; Firmware for the second PRU, used if compiled with BEAGLEG_PRU1_AUX=1.
+;;; The step generating PRU0 only writes the aux bits of each segment to
+;;; its data RAM; we pick them up from there and set the GPIOs, so that
+;;; this does not take time between segments on PRU0.
+
+#include "motor-interface-constants.h"
+
+.origin 0
+.entrypoint INIT
+
+;; Seen from PRU1, the constant table entry for the data RAM of the other PRU.
+#define CONST_PRU0_DRAM C25
+
+;; The io routines also contain SetSteps, which refers to the motor state
+;; of motor-interface-pru.p. We never call it, but it needs to assemble.
+.struct MotorState
+	.u32 m1
+	.u32 m2
+	.u32 m3
+	.u32 m4
+	.u32 m5
+	.u32 m6
+	.u32 m7
+	.u32 m8
+.ends
+.assign MotorState, r21, r28, mstate
+
+INIT:
+	;; Clear STANDBY_INIT in SYSCFG register.
+	LBCO r0, C4, 4, 4
+	CLR r0, r0, 4
+	SBCO r0, C4, 4, 4
+
+	;; Start with all aux bits off.
+	ZERO &r2, 4			; aux bits currently set.
+	ZERO &r3, 4
+	CALL SetAuxBits
+
+	;; Registers
+	;; r2 = aux bits currently set
+	;; r3 = aux bits requested; parameter for SetAuxBits
+	;; scratch: r4..r6
+AUX_LOOP:
+	LBCO r3, CONST_PRU0_DRAM, QUEUE_AUX_OFFSET, 4
+	QBEQ AUX_LOOP, r3, r2
+	MOV r2, r3
+	CALL SetAuxBits
+	JMP AUX_LOOP
+
+;;; Same io routines as used in motor-interface-pru.p
+#include <pru-io-routines.hp>
@@ -0,0 +1,108 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "job-spooler.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "common/fd-mux.h"
+#include "common/logging.h"
+#include "common/string-util.h"
+#include "gcode-machine-control.h"
+#include "gcode-parser/gcode-streamer.h"
+
+// Bytes read from a connection at once.
+#define SPOOL_READ_SIZE 65536
+
+JobSpooler::JobSpooler(const std::string &spool_dir,
+                       FDMultiplexer *event_server, GCodeStreamer *streamer,
+                       GCodeMachineControl *machine, FILE *msg_stream)
+  : spool_dir_(spool_dir), event_server_(event_server), streamer_(streamer),
+    machine_(machine), msg_stream_(msg_stream),
+    next_job_number_(1), receiving_(0), buffer_(SPOOL_READ_SIZE) {
+  streamer_->SetNextJobSource([this]() { return StartNextJob(); });
+}
+
+void JobSpooler::Receive(int fd) {
+  const int job = next_job_number_++;
+  const std::string filename = StringPrintf("%s/job-%06d.gcode",
+                                            spool_dir_.c_str(), job);
+  const int out = open(filename.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+  if (out < 0) {
+    Log_error("Can't create spool file %s: %s",
+              filename.c_str(), strerror(errno));
+    dprintf(fd, "// Machine busy and can't spool job: %s\n", strerror(errno));
+    close(fd);
+    return;
+  }
+  dprintf(fd, "// Machine busy; spooling as job %d (%d waiting).\n",
+          job, queued_jobs() + receiving_);
+  ++receiving_;
+  event_server_->RunOnReadable(fd, [this, fd, out, filename]() {
+      return ReadJobData(fd, out, filename);
+    });
+}
+
+bool JobSpooler::ReadJobData(int fd, int out, const std::string &filename) {
+  const ssize_t r = read(fd, buffer_.data(), buffer_.size());
+  if (r < 0 && (errno == EAGAIN || errno == EINTR))
+    return true;
+  if (r > 0) {
+    if (write(out, buffer_.data(), r) == r)
+      return true;
+    Log_error("Writing spool file %s: %s", filename.c_str(), strerror(errno));
+  }
+  close(fd);
+  --receiving_;
+  if (close(out) != 0 || r != 0) {
+    if (r < 0) Log_error("Receiving job: %s", strerror(errno));
+    unlink(filename.c_str());
+    return false;
+  }
+  if (spooled_callback_) spooled_callback_(filename);
+  jobs_.push_back(filename);
+  Log_info("Spooled %s; %d job(s) waiting.", filename.c_str(), queued_jobs());
+  if (!streamer_->IsStreaming()) {
+    // Machine is idle. Start it once we're out of this handler, as the job
+    // file might get the same file descriptor.
+    event_server_->RunAfter(0, [this]() { StartNextJob(); return false; });
+  }
+  return false;
+}
+
+bool JobSpooler::StartNextJob() {
+  if (streamer_->IsStreaming())
+    return true;   // Already started by someone else.
+  while (!jobs_.empty()) {
+    const std::string filename = jobs_.front();
+    jobs_.pop_front();
+    if (machine_) machine_->SetMsgOut(msg_stream_);
+    const bool started = streamer_->ConnectFile(filename.c_str(), msg_stream_);
+    unlink(filename.c_str());   // Still open while streaming.
+    if (started) {
+      Log_info("Starting spooled job %s; %d more waiting.",
+               filename.c_str(), queued_jobs());
+      return true;
+    }
+  }
+  return false;
+}
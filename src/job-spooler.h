@@ -0,0 +1,80 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _BEAGLEG_JOB_SPOOLER_H_
+#define _BEAGLEG_JOB_SPOOLER_H_
+
+#include <stdio.h>
+
+#include <deque>
+#include <functional>
+#include <string>
+#include <vector>
+
+class FDMultiplexer;
+class GCodeMachineControl;
+class GCodeStreamer;
+
+// Queue of G-code jobs waiting for the machine. While a job is running, the
+// next ones are received at full network speed into files in a spool
+// directory. When the running job reaches its end, the next one continues
+// right away without bringing the machine to a halt in between.
+class JobSpooler {
+public:
+  // Jobs are stored in "spool_dir", which has to exist. Messages of spooled
+  // jobs go to "msg_stream"; if "machine" is non-NULL, its messages as
+  // well. The JobSpooler needs to outlive the Loop() of the event server.
+  JobSpooler(const std::string &spool_dir, FDMultiplexer *event_server,
+             GCodeStreamer *streamer, GCodeMachineControl *machine,
+             FILE *msg_stream);
+
+  // Receive a job from connection "fd" until EOF, then queue it. The
+  // connection is closed.
+  void Receive(int fd);
+
+  // Called with the spool file name of each job received completely,
+  // before it is queued.
+  void SetSpooledCallback(
+    const std::function<void(const std::string &filename)> &callback) {
+    spooled_callback_ = callback;
+  }
+
+  // Number of jobs received completely and waiting to run.
+  int queued_jobs() const { return jobs_.size(); }
+
+  // Number of jobs still being received.
+  int receiving_jobs() const { return receiving_; }
+
+private:
+  bool ReadJobData(int fd, int out, const std::string &filename);
+  bool StartNextJob();
+
+  const std::string spool_dir_;
+  FDMultiplexer *const event_server_;
+  GCodeStreamer *const streamer_;
+  GCodeMachineControl *const machine_;
+  FILE *const msg_stream_;
+
+  int next_job_number_;
+  int receiving_;
+  std::deque<std::string> jobs_;        // Spool files in order of arrival.
+  std::vector<char> buffer_;
+  std::function<void(const std::string &)> spooled_callback_;
+};
+
+#endif  // _BEAGLEG_JOB_SPOOLER_H_
@@ -0,0 +1,177 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "job-spooler.h"
+
+#include <dirent.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+#include <gtest/gtest.h>
+
+#include "common/fd-mux.h"
+#include "gcode-parser/gcode-parser.h"
+#include "gcode-parser/gcode-streamer.h"
+
+namespace {
+class TestMultiplexer : public FDMultiplexer {
+public:
+  using FDMultiplexer::SingleCycle;
+};
+
+// Records the X coordinate of all moves and when the program finished.
+class MoveRecorder : public GCodeParser::EventReceiver {
+public:
+  void gcode_start(GCodeParser *parser) final {}
+  void gcode_finished(bool end_of_stream) final { events.push_back(-1); }
+  void go_home(AxisBitmap_t axis_bitmap) final {}
+  void set_speed_factor(float factor) final {}
+  void set_fanspeed(float value) final {}
+  void set_temperature(float degrees_c) final {}
+  void wait_temperature() final {}
+  void dwell(float time_ms) final {}
+  void motors_enable(bool enable) final {}
+  bool coordinated_move(float feed, const AxesRegister &pos) final {
+    events.push_back(pos[AXIS_X]);
+    return true;
+  }
+  bool rapid_move(float feed, const AxesRegister &pos) final { return true; }
+  const char *unprocessed(char letter, float value, const char *) final {
+    return NULL;
+  }
+
+  std::vector<float> events;   // X of each move; -1 for gcode_finished()
+};
+
+class JobSpoolerTest : public ::testing::Test {
+protected:
+  JobSpoolerTest()
+    : parser_(GCodeParser::Config(), &recorder_, false),
+      streamer_(&event_server_, &parser_, &recorder_) {
+    char tmpl[] = "/tmp/job-spooler-test.XXXXXX";
+    spool_dir_ = mkdtemp(tmpl);
+    // Like the listening socket in the server, this keeps the event
+    // server running.
+    EXPECT_EQ(0, pipe(listener_));
+    event_server_.RunOnReadable(listener_[0], []() { return true; });
+  }
+  ~JobSpoolerTest() {
+    close(listener_[0]);
+    close(listener_[1]);
+    rmdir(spool_dir_.c_str());
+  }
+
+  // Returns the writing end of a new connection.
+  int Connect(bool spooled, JobSpooler *spooler) {
+    int fds[2];
+    EXPECT_EQ(0, pipe(fds));
+    if (spooled) {
+      spooler->Receive(fds[0]);
+    } else {
+      EXPECT_TRUE(streamer_.ConnectStream(fds[0], NULL));
+    }
+    return fds[1];
+  }
+
+  void Send(int fd, const char *data) {
+    EXPECT_EQ((ssize_t)strlen(data), write(fd, data, strlen(data)));
+  }
+
+  int SpoolFiles() {
+    int count = 0;
+    DIR *dir = opendir(spool_dir_.c_str());
+    while (struct dirent *entry = readdir(dir)) {
+      if (entry->d_name[0] != '.') ++count;
+    }
+    closedir(dir);
+    return count;
+  }
+
+  void Cycles(int n) {
+    for (int i = 0; i < n; ++i) event_server_.SingleCycle(0);
+  }
+
+  TestMultiplexer event_server_;
+  MoveRecorder recorder_;
+  GCodeParser parser_;
+  GCodeStreamer streamer_;
+  std::string spool_dir_;
+  int listener_[2];
+};
+}  // namespace
+
+TEST_F(JobSpoolerTest, JobsRunBackToBack) {
+  JobSpooler spooler(spool_dir_, &event_server_, &streamer_, NULL, NULL);
+  const int live = Connect(false, &spooler);
+  Send(live, "G1 X1 F100\n");
+  Cycles(2);
+
+  // While the first job is running, two more arrive.
+  const int second = Connect(true, &spooler);
+  const int third = Connect(true, &spooler);
+  EXPECT_EQ(2, spooler.receiving_jobs());
+  Send(third, "G1 X3\n");
+  Send(second, "G1 X2\n");
+  close(third);
+  Cycles(2);
+  Send(second, "G1 X2.5\n");
+  close(second);
+  Cycles(2);
+  EXPECT_EQ(0, spooler.receiving_jobs());
+  EXPECT_EQ(2, spooler.queued_jobs());
+  EXPECT_EQ(2, SpoolFiles());
+
+  close(live);
+  Cycles(10);
+  EXPECT_EQ(0, spooler.queued_jobs());
+  EXPECT_EQ(0, SpoolFiles());
+  EXPECT_FALSE(streamer_.IsStreaming());
+
+  // In order of completion; no end of program in between.
+  const std::vector<float> expected = { 1, 3, 2, 2.5, -1 };
+  EXPECT_EQ(expected, recorder_.events);
+}
+
+TEST_F(JobSpoolerTest, JobStartsWhenIdle) {
+  JobSpooler spooler(spool_dir_, &event_server_, &streamer_, NULL, NULL);
+  const int live = Connect(false, &spooler);
+  const int spooled = Connect(true, &spooler);
+  close(live);
+  Cycles(2);
+  EXPECT_EQ(1u, recorder_.events.size());  // Live job finished.
+  std::vector<std::string> spooled_files;
+  spooler.SetSpooledCallback([&](const std::string &filename) {
+      spooled_files.push_back(filename);
+    });
+  Send(spooled, "G1 X7 F100\n");
+  close(spooled);
+  Cycles(5);
+  ASSERT_EQ(1u, spooled_files.size());
+  EXPECT_EQ(spool_dir_ + "/job-000001.gcode", spooled_files[0]);
+  const std::vector<float> expected = { -1, 7, -1 };
+  EXPECT_EQ(expected, recorder_.events);
+  EXPECT_EQ(0, SpoolFiles());
+}
+
+int main(int argc, char *argv[]) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
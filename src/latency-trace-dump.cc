@@ -0,0 +1,205 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Summarize or export latency traces written by machine-control
+// --latency-trace
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "common/latency-trace.h"
+#include "common/logging.h"
+
+// Histogram buckets: up to 1us, 2us, 4us, ... and the rest.
+#define HISTOGRAM_BUCKETS 24
+
+int usage(const char *prog) {
+  fprintf(stderr, "Usage: %s [options] <latency-trace-file>\n"
+          "Options:\n"
+          "\t-j                : Write Chrome trace JSON (chrome://tracing, "
+          "Perfetto) instead of the summary.\n"
+          "\t-H                : In the summary, also print histograms.\n",
+          prog);
+  return 1;
+}
+
+static void PrintSummaryLine(const char *name, std::vector<uint64_t> *ns) {
+  if (ns->empty()) {
+    printf("%-12s %8d\n", name, 0);
+    return;
+  }
+  std::sort(ns->begin(), ns->end());
+  const size_t n = ns->size();
+  printf("%-12s %8zu %10.1f %10.1f %10.1f %10.1f %10.1f\n", name, n,
+         (*ns)[0] / 1e3, (*ns)[n / 2] / 1e3, (*ns)[n * 9 / 10] / 1e3,
+         (*ns)[n * 99 / 100] / 1e3, (*ns)[n - 1] / 1e3);
+}
+
+static void PrintHistogram(const char *name, const std::vector<uint64_t> &ns) {
+  if (ns.empty()) return;
+  int buckets[HISTOGRAM_BUCKETS] = {0};
+  int max_count = 0;
+  for (uint64_t value : ns) {
+    int b = 0;
+    while (b < HISTOGRAM_BUCKETS - 1 && value > (1000ULL << b))
+      ++b;
+    max_count = std::max(max_count, ++buckets[b]);
+  }
+  printf("\n%s\n", name);
+  for (int b = 0; b < HISTOGRAM_BUCKETS; ++b) {
+    if (buckets[b] == 0) continue;
+    const int bar = (int) (50.0 * buckets[b] / max_count + 0.5);
+    if (b < HISTOGRAM_BUCKETS - 1)
+      printf("  <= %10lluus %8d ", 1ULL << b, buckets[b]);
+    else
+      printf("   > %10lluus %8d ", 1ULL << (b - 1), buckets[b]);
+    printf("%s\n", std::string(bar, '#').c_str());
+  }
+}
+
+struct Event {
+  LatencyStage stage;
+  LatencyEvent event;
+};
+
+// Time from the start of the read the line arrived with to the end of the
+// last PRU enqueue of the segments of that line. Without PRU (dry-run),
+// up to the creation of the last segment.
+static std::vector<uint64_t> EndToEnd(const std::vector<Event> &events) {
+  LatencyStage last_stage = LATENCY_SEGMENT;
+  for (const Event &e : events) {
+    if (e.stage == LATENCY_PRU_WAIT) last_stage = LATENCY_PRU_WAIT;
+  }
+  std::vector<LatencyEvent> receives;       // Sorted by line.
+  std::vector<std::pair<int, uint64_t> > pru_done;   // line -> end
+  for (const Event &e : events) {
+    if (e.stage == LATENCY_RECEIVE)
+      receives.push_back(e.event);
+    else if (e.stage == last_stage && e.event.gcode_line > 0)
+      pru_done.push_back(std::make_pair(e.event.gcode_line,
+                                        e.event.start_ns
+                                        + e.event.duration_ns));
+  }
+  std::vector<uint64_t> result;
+  if (receives.empty()) return result;
+  std::sort(receives.begin(), receives.end(),
+            [](const LatencyEvent &a, const LatencyEvent &b) {
+              return a.gcode_line < b.gcode_line;
+            });
+  // Only the last segment of each line counts.
+  std::sort(pru_done.begin(), pru_done.end());
+  for (size_t i = 0; i < pru_done.size(); ++i) {
+    if (i + 1 < pru_done.size() && pru_done[i+1].first == pru_done[i].first)
+      continue;
+    const int line = pru_done[i].first;
+    // The read that brought this line is the last one starting before it.
+    std::vector<LatencyEvent>::const_iterator it =
+      std::upper_bound(receives.begin(), receives.end(), line,
+                       [](int l, const LatencyEvent &e) {
+                         return l < e.gcode_line;
+                       });
+    if (it == receives.begin()) continue;  // Read is not in the trace anymore.
+    --it;
+    if (pru_done[i].second > it->start_ns)
+      result.push_back(pru_done[i].second - it->start_ns);
+  }
+  return result;
+}
+
+static void PrintSummary(const std::vector<Event> &events, bool histograms) {
+  std::vector<uint64_t> durations[LATENCY_STAGE_COUNT];
+  for (const Event &e : events) {
+    durations[e.stage].push_back(e.event.duration_ns);
+  }
+  std::vector<uint64_t> end_to_end = EndToEnd(events);
+  printf("#%-11s %8s %10s %10s %10s %10s %10s\n", "stage", "count",
+         "min-us", "p50-us", "p90-us", "p99-us", "max-us");
+  for (int s = 0; s < LATENCY_STAGE_COUNT; ++s) {
+    PrintSummaryLine(LatencyStageName((LatencyStage)s), &durations[s]);
+  }
+  PrintSummaryLine("end-to-end", &end_to_end);
+  if (!histograms) return;
+  for (int s = 0; s < LATENCY_STAGE_COUNT; ++s) {
+    PrintHistogram(LatencyStageName((LatencyStage)s), durations[s]);
+  }
+  PrintHistogram("end-to-end", end_to_end);
+}
+
+// One row per stage, in the Chrome trace event format.
+static void PrintChromeTrace(const std::vector<Event> &events) {
+  uint64_t start_ns = UINT64_MAX;
+  for (const Event &e : events) {
+    start_ns = std::min(start_ns, e.event.start_ns);
+  }
+  printf("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+  for (int s = 0; s < LATENCY_STAGE_COUNT; ++s) {
+    printf("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+           "\"args\":{\"name\":\"%s\"}},\n",
+           s, LatencyStageName((LatencyStage)s));
+  }
+  for (size_t i = 0; i < events.size(); ++i) {
+    const Event &e = events[i];
+    printf("{\"name\":\"line %d\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,"
+           "\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}%s\n",
+           e.event.gcode_line, LatencyStageName(e.stage), e.stage,
+           (e.event.start_ns - start_ns) / 1e3, e.event.duration_ns / 1e3,
+           i + 1 < events.size() ? "," : "");
+  }
+  printf("]}\n");
+}
+
+int main(int argc, char *argv[]) {
+  bool chrome_trace = false;
+  bool histograms = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "jH")) != -1) {
+    switch (opt) {
+    case 'j':
+      chrome_trace = true;
+      break;
+    case 'H':
+      histograms = true;
+      break;
+    default:
+      return usage(argv[0]);
+    }
+  }
+  if (optind != argc - 1)
+    return usage(argv[0]);
+  Log_init("/dev/stderr");
+
+  std::vector<Event> events;
+  const bool success = ReadLatencyTrace(
+    argv[optind], [&events](LatencyStage stage, const LatencyEvent &e) {
+      Event event = { stage, e };
+      events.push_back(event);
+    });
+  if (!success)
+    return 1;
+  if (chrome_trace)
+    PrintChromeTrace(events);
+  else
+    PrintSummary(events, histograms);
+  return 0;
+}
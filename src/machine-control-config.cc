@@ -34,14 +34,25 @@ static const char kHomeOrder[] = "ZXY";
 
 MachineControlConfig::MachineControlConfig() {
   speed_factor = 1;
+  max_speed_override = 1;
   acknowledge_lines = true;
   debug_print = false;
   synchronous = false;
   range_check = true;
   require_homing = true;
   enable_pause = false;
+  threaded_planner = false;
+  queue_low_watermark = 0;
+  s_curve_acceleration = false;
+  realtime_priority = 0;
+  lock_memory = false;
+  realtime_cpu = -1;
   home_order = kHomeOrder;
   threshold_angle = -1;
+  junction_deviation = 0.01;
+  lookahead_segments = 64;
+  coalesce_tolerance = 0;
+  arc_chord_error = 0.001;
   auto_motor_disable_seconds = -1;
   auto_fan_disable_seconds = -1;
   auto_fan_pwm = 0;
@@ -82,11 +93,24 @@ public:
       ACCEPT_VALUE("range-check",    Bool,   &config_->range_check);
       ACCEPT_VALUE("synchronous",    Bool,   &config_->synchronous);
       ACCEPT_VALUE("enable-pause",   Bool,   &config_->enable_pause);
+      ACCEPT_VALUE("threaded-planner", Bool, &config_->threaded_planner);
+      ACCEPT_VALUE("queue-low-watermark",
+                   Int,   &config_->queue_low_watermark);
+      ACCEPT_VALUE("s-curve-acceleration",
+                   Bool,  &config_->s_curve_acceleration);
       ACCEPT_VALUE("auto-motor-disable-seconds",
                    Int,   &config_->auto_motor_disable_seconds);
       ACCEPT_VALUE("auto-fan-disable-seconds",
                    Int,  &config_->auto_fan_disable_seconds);
       ACCEPT_VALUE("auto-fan-pwm",   Int,    &config_->auto_fan_pwm);
+      ACCEPT_VALUE("lookahead-segments", Int, &config_->lookahead_segments);
+      ACCEPT_VALUE("realtime-priority", Int, &config_->realtime_priority);
+      ACCEPT_VALUE("lock-memory",    Bool,   &config_->lock_memory);
+      ACCEPT_VALUE("realtime-cpu",   Int,    &config_->realtime_cpu);
+      ACCEPT_EXPR("junction-deviation", &config_->junction_deviation);
+      ACCEPT_EXPR("coalesce-tolerance", &config_->coalesce_tolerance);
+      ACCEPT_EXPR("arc-chord-error", &config_->arc_chord_error);
+      ACCEPT_EXPR("max-speed-override", &config_->max_speed_override);
       return false;
     }
 
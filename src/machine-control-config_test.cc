@@ -45,6 +45,24 @@ TEST(MachineControlConfig, GeneralMapping) {
   EXPECT_EQ(188, config.auto_motor_disable_seconds);
 }
 
+TEST(MachineControlConfig, RealtimeSetup) {
+  MachineControlConfig defaults;
+  EXPECT_EQ(0, defaults.realtime_priority);
+  EXPECT_FALSE(defaults.lock_memory);
+  EXPECT_EQ(-1, defaults.realtime_cpu);
+
+  ConfigParser p;
+  p.SetContent("[ general ]\n"
+               "realtime-priority = 50\n"
+               "lock-memory = yes\n"
+               "realtime-cpu = 1\n");
+  MachineControlConfig config;
+  EXPECT_TRUE(config.ConfigureFromFile(&p));
+  EXPECT_EQ(50, config.realtime_priority);
+  EXPECT_TRUE(config.lock_memory);
+  EXPECT_EQ(1, config.realtime_cpu);
+}
+
 TEST(MachineControlConfig, AxisMapping) {
   ConfigParser p;
   p.SetContent("[ X-Axis ]\n"
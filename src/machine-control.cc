@@ -22,29 +22,44 @@
 #include <fcntl.h>
 #include <getopt.h>
 #include <grp.h>
+#include <malloc.h>
 #include <math.h>
 #include <netinet/in.h>
 #include <pwd.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sched.h>
 #include <strings.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <string>
+#include <vector>
+
 #include "common/fd-mux.h"
+#include "common/latency-trace.h"
 #include "common/logging.h"
+#include "common/metrics.h"
 #include "common/string-util.h"
 #include "config-parser.h"
 #include "gcode-machine-control.h"
 #include "gcode-parser/gcode-parser.h"
+#include "gcode-parser/gcode-resume-index.h"
 #include "gcode-parser/gcode-streamer.h"
 #include "hardware-mapping.h"
+#include "job-spooler.h"
+#include "motion-job.h"
 #include "motion-queue.h"
+#include "motion-trace.h"
 #include "motor-operations.h"
+#include "print-stats-cache.h"
 #include "pru-hardware-interface.h"
+#include "remote-motion-queue.h"
 #include "sim-firmware.h"
 #include "spindle-control.h"
 
@@ -58,7 +73,16 @@ static int usage(const char *prog, const char *msg) {
           "  -c, --config <config-file> : Configuration file. (Required)\n"
           "  -p, --port <port>          : Listen on this TCP port for GCode.\n"
           "  -b, --bind-addr <bind-ip>  : Bind to this IP (Default: 0.0.0.0).\n"
+          "      --spool-dir <dir>      : On --port: while a job runs, receive the next ones into this directory\n"
+          "                               and run them back-to-back (Default: reject connections while busy).\n"
+          "      --ack-window <lines>   : On --port: acknowledge lines in batches with 'ok <n>'; senders may\n"
+          "                               have up to this many lines unacknowledged (Default: 0 = 'ok' per line).\n"
+          "      --metrics-port <port>  : Serve throughput and latency metrics in Prometheus text format on this port.\n"
+          "      --stats-cache <file>   : Log the estimated print time of each job; results are remembered in this\n"
+          "                               file, so jobs that ran before are estimated right away.\n"
           "  -l, --logfile <logfile>    : Logfile to use. If empty, messages go to syslog (Default: /dev/stderr).\n"
+          "      --async-log            : Write log messages from a background thread, so that a slow logfile\n"
+          "                               or syslog can't delay motion.\n"
           "      --param <paramfile>    : Parameter file to use.\n"
           "  -d, --daemon               : Run as daemon.\n"
           "      --priv <uid>[:<gid>]   : After opening GPIO: drop privileges to this (default: daemon:daemon)\n"
@@ -67,9 +91,24 @@ static int usage(const char *prog, const char *msg) {
           "  -f <factor>                : Feedrate speed factor (Default 1.0).\n"
           "  -n                         : Dryrun; don't send to motors, no GPIO or PRU needed (Default: off).\n"
           // -N dry-run with simulation output; mostly for development, so not mentioned here.
+          "      --sim-summary          : Dryrun; print the time the motion takes and the final motor positions.\n"
+          "      --resume-line <line>   : Start the G-code file at this line with the modal state it would have there.\n"
+          "                               The first move goes straight from the current position; make sure the path is clear.\n"
           "  -P                         : Verbose: Show some more debug output (Default: off).\n"
           "  -S                         : Synchronous: don't queue (Default: off).\n"
           "      --allow-m111           : Allow changing the debug level with M111 (Default: off).\n"
+          "\nPrecompiled motion jobs:\n"
+          "     --compile <job-file>    : Don't run the machine, but write the motion of the G-code file to the job file.\n"
+          "     --replay <job-file>     : Run a job file compiled with the same configuration.\n"
+          "                               The machine needs to be in the same position as when compiling.\n"
+          "     --trace <trace-file>    : Record the last segments sent to the motion queue; see motion-trace-dump.\n"
+          "\nPlanning on a different host:\n"
+          "     --motion-server <port>  : On the BeagleBone: don't read G-code, but execute the motion a\n"
+          "                               --remote-queue planner sends to this TCP port.\n"
+          "     --remote-queue <host>:<port> : Send the motion to the --motion-server instead of the PRU.\n"
+          "                               Both need the same configuration. Homing and probing are not available.\n"
+          "     --latency-trace <file>  : At exit, write where lines spent their time on the way to the PRU; see\n"
+          "                               latency-trace-dump. Needs compilation with -DBEAGLEG_LATENCY_TRACE.\n"
           // --threshold-angle specifies threshold angle used for arc segment acceleration.
           "\nConfiguration file overrides:\n"
           "     --homing-required       : Require homing before any moves (require-homing = yes).\n"
@@ -124,14 +163,121 @@ static bool drop_privileges(StringPiece privs) {
   return true;
 }
 
+// Memory touched while locking memory, so that the first use of the stack
+// and heap later on doesn't page fault.
+#define PREFAULT_STACK_BYTES (256 << 10)
+#define PREFAULT_HEAP_BYTES  (8 << 20)
+
+static void prefault_stack() {
+  volatile char buffer[PREFAULT_STACK_BYTES];
+  for (size_t i = 0; i < sizeof(buffer); i += 4096)
+    buffer[i] = 0;
+}
+
+static void prefault_heap() {
+  // Keep the memory in the heap after free() instead of giving it back,
+  // and don't use mmap() for large allocations, which would fault again.
+  mallopt(M_TRIM_THRESHOLD, -1);
+  mallopt(M_MMAP_MAX, 0);
+  char *buffer = (char*) malloc(PREFAULT_HEAP_BYTES);
+  if (!buffer) return;
+  for (size_t i = 0; i < PREFAULT_HEAP_BYTES; i += 4096)
+    buffer[i] = 0;
+  free(buffer);
+}
+
+// Make sure nothing delays enqueuing motions: real-time scheduling, memory
+// that is never swapped out and a CPU of our own. Needs to be called while we
+// still have the privileges. Threads started later inherit these settings.
+static bool setup_realtime(const MachineControlConfig &config) {
+  if (config.lock_memory) {
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+      Log_error("Real-time: can't lock memory: %s", strerror(errno));
+      return false;
+    }
+    prefault_stack();
+    prefault_heap();
+    Log_info("Real-time: memory locked.");
+  }
+
+  if (config.realtime_cpu >= CPU_SETSIZE) {
+    Log_error("Real-time: invalid CPU %d", config.realtime_cpu);
+    return false;
+  }
+  if (config.realtime_cpu >= 0) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(config.realtime_cpu, &cpus);
+    if (sched_setaffinity(0, sizeof(cpus), &cpus) != 0) {
+      Log_error("Real-time: can't run on CPU %d: %s",
+                config.realtime_cpu, strerror(errno));
+      return false;
+    }
+    Log_info("Real-time: running on CPU %d.", config.realtime_cpu);
+  }
+
+  if (config.realtime_priority > 0) {
+    struct sched_param param = {};
+    param.sched_priority = config.realtime_priority;
+    const int min_prio = sched_get_priority_min(SCHED_FIFO);
+    const int max_prio = sched_get_priority_max(SCHED_FIFO);
+    if (param.sched_priority < min_prio || param.sched_priority > max_prio) {
+      Log_error("Real-time: priority %d is not in range %d..%d",
+                param.sched_priority, min_prio, max_prio);
+      return false;
+    }
+    if (sched_setscheduler(0, SCHED_FIFO, &param) != 0) {
+      Log_error("Real-time: can't set SCHED_FIFO priority %d: %s",
+                param.sched_priority, strerror(errno));
+      return false;
+    }
+    Log_info("Real-time: SCHED_FIFO priority %d.", param.sched_priority);
+  }
+  return true;
+}
+
+// Lines between snapshots in the resume index.
+#define RESUME_INDEX_INTERVAL 1000
+
+// Determine where to continue "gcode_filename" at "line" using the sidecar
+// index, which is created or updated if needed.
+static bool find_resume_point(const char *gcode_filename,
+                              const GCodeParser::Config &parser_cfg, int line,
+                              GCodeResumeIndex::Snapshot *resume) {
+  GCodeResumeIndex index;
+  const std::string index_file =
+    GCodeResumeIndex::IndexFilename(gcode_filename);
+  if (!index.Load(index_file.c_str(), gcode_filename)) {
+    Log_info("Indexing %s", gcode_filename);
+    if (!index.Build(gcode_filename, parser_cfg, RESUME_INDEX_INTERVAL))
+      return false;
+    index.Save(index_file.c_str());  // Next time faster; fine if it fails.
+  }
+  return index.Seek(line, parser_cfg, resume);
+}
+
 // Reads the given "gcode_filename" with GCode and operates machine with it.
-// If "loop_count" is >= 0, repeats this number after the first execution.
-static void send_file_to_machine(GCodeMachineControl *machine,
+// If "resume_line" is > 1, starts at that line.
+static bool send_file_to_machine(GCodeMachineControl *machine,
                                  GCodeStreamer *streamer,
-                                 const char *gcode_filename) {
+                                 GCodeParser *parser,
+                                 const GCodeParser::Config &parser_cfg,
+                                 const char *gcode_filename,
+                                 int resume_line) {
   machine->SetMsgOut(stderr);
-  int fd = open(gcode_filename, O_RDONLY);
-  streamer->ConnectStream(fd, stderr);
+  if (resume_line <= 1)
+    return streamer->ConnectFile(gcode_filename, stderr);
+
+  GCodeResumeIndex::Snapshot resume;
+  if (!find_resume_point(gcode_filename, parser_cfg, resume_line, &resume)) {
+    Log_error("Can't resume %s at line %d.", gcode_filename, resume_line);
+    return false;
+  }
+  Log_info("Resuming %s at line %d (byte offset %llu).", gcode_filename,
+           resume_line, (unsigned long long) resume.offset);
+  parser->SetModalState(resume.state);
+  return streamer->ConnectFile(gcode_filename, stderr,
+                               resume.offset, resume_line);
 }
 
 // Open server. Return file-descriptor or -1 if listen fails.
@@ -172,7 +318,7 @@ static int open_server(const char *bind_addr, int port) {
 // are just FYI information for nicer log-messages.
 static void run_gcode_server(int listen_socket, FDMultiplexer *event_server,
                              GCodeMachineControl *machine,
-                             GCodeStreamer *streamer,
+                             GCodeStreamer *streamer, JobSpooler *spooler,
                              const char *bind_addr, int port) {
   if (listen(listen_socket, 2) < 0) {
     Log_error("listen(fd=%d) failed: %s", listen_socket, strerror(errno));
@@ -183,7 +329,7 @@ static void run_gcode_server(int listen_socket, FDMultiplexer *event_server,
            bind_addr ? bind_addr : "0.0.0.0", port);
 
   event_server->RunOnReadable(listen_socket,
-                              [listen_socket,machine,streamer]() {
+                              [listen_socket,machine,streamer,spooler]() {
     struct sockaddr_in client;
     socklen_t socklen = sizeof(client);
     int connection = accept(listen_socket, (struct sockaddr*) &client, &socklen);
@@ -205,6 +351,11 @@ static void run_gcode_server(int listen_socket, FDMultiplexer *event_server,
       return true;
     }
 
+    if (spooler && (streamer->IsStreaming() || spooler->queued_jobs() > 0)) {
+      spooler->Receive(connection);
+      return true;
+    }
+
     if (streamer->IsStreaming()) {
       // For now, only one. Though we could have multiple.
       dprintf(connection, "// Sorry, can only handle one connection at a time."
@@ -225,12 +376,128 @@ static void run_gcode_server(int listen_socket, FDMultiplexer *event_server,
   });
 }
 
+#define STATUS_TICK_MS 10   // Subscribers get updates at multiples of this.
+#define STATUS_SEND_BUFFER 8192  // Backlog before we consider a client slow.
+
+// Pushes status to the subscribed clients of the status server. A snapshot is
+// formatted once per tick and sent to all clients due at that tick; clients
+// that can't keep up are disconnected instead of blocking the event loop.
+class StatusPublisher {
+public:
+  StatusPublisher(FDMultiplexer *event_server, GCodeMachineControl *machine,
+                  MotionQueue *motion_queue)
+    : event_server_(event_server), machine_(machine),
+      motion_queue_(motion_queue), ticking_(false) {}
+
+  // Send status to "fd" "rate_hz" times per second.
+  void Subscribe(int fd, int rate_hz) {
+    Unsubscribe(fd);
+    const int send_buffer = STATUS_SEND_BUFFER;
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &send_buffer, sizeof(send_buffer));
+    Subscriber s;
+    s.fd = fd;
+    s.period_ticks = 1000 / (STATUS_TICK_MS * std::max(1, rate_hz));
+    if (s.period_ticks < 1) s.period_ticks = 1;
+    s.countdown = 0;   // Right away in the next tick.
+    subscribers_.push_back(s);
+    if (!ticking_) {
+      ticking_ = true;
+      event_server_->RunEvery(STATUS_TICK_MS, [this]() { return Tick(); });
+    }
+  }
+
+  void Unsubscribe(int fd) {
+    for (size_t i = 0; i < subscribers_.size(); ++i) {
+      if (subscribers_[i].fd == fd) {
+        subscribers_.erase(subscribers_.begin() + i);
+        return;
+      }
+    }
+  }
+
+private:
+  struct Subscriber {
+    int fd;
+    int period_ticks;
+    int countdown;
+  };
+
+  bool Tick() {
+    std::string snapshot;
+    for (size_t i = 0; i < subscribers_.size(); /**/) {
+      Subscriber &s = subscribers_[i];
+      if (--s.countdown > 0) {
+        ++i;
+        continue;
+      }
+      s.countdown = s.period_ticks;
+      if (snapshot.empty()) snapshot = Snapshot();
+      const ssize_t written = send(s.fd, snapshot.data(), snapshot.size(),
+                                   MSG_DONTWAIT | MSG_NOSIGNAL);
+      if (written == (ssize_t)snapshot.size()) {
+        ++i;
+        continue;
+      }
+      Log_info("Status client too slow; disconnecting.");
+      // The read handler sees EOF and closes the connection.
+      shutdown(s.fd, SHUT_RDWR);
+      subscribers_.erase(subscribers_.begin() + i);
+    }
+    ticking_ = !subscribers_.empty();
+    return ticking_;
+  }
+
+  std::string Snapshot() {
+    GCodeMachineControl::Status status;
+    machine_->GetStatus(&status);
+    return StringPrintf("{\"x_axis\":%.3f, \"y_axis\":%.3f, "
+                        "\"z_axis\":%.3f, \"feedrate\":%.3f, "
+                        "\"queue_depth\":%d, \"aux_bits\":%u, "
+                        "\"line\":%d}\n",
+                        status.position[AXIS_X], status.position[AXIS_Y],
+                        status.position[AXIS_Z], status.feedrate,
+                        motion_queue_->GetPendingElements(NULL),
+                        status.aux_bits, status.gcode_line);
+  }
+
+  FDMultiplexer *const event_server_;
+  GCodeMachineControl *const machine_;
+  MotionQueue *const motion_queue_;
+  std::vector<Subscriber> subscribers_;
+  bool ticking_;
+};
+
+static std::string queue_depth_histogram(const MotionQueueStats &stats) {
+  std::string result;
+  for (int i = 0; i < MOTION_QUEUE_DEPTH_BUCKETS; ++i) {
+    if (i > 0) result += ",";
+    result += StringPrintf("%u", stats.depth_histogram[i]);
+  }
+  return result;
+}
+
+static void log_queue_stats(MotionQueue *motion_queue) {
+  MotionQueueStats stats;
+  if (!motion_queue->GetStats(&stats))
+    return;
+  Log_info("Motion queue: %u segments, %u underruns; %u waits for free slot "
+           "(total %.3fs, max %.3fms); depth histogram [%s]",
+           stats.enqueue_count, stats.underruns, stats.enqueue_waits,
+           stats.enqueue_wait_usec / 1e6, stats.max_enqueue_wait_usec / 1e3,
+           queue_depth_histogram(stats).c_str());
+}
+
 // THIS IS A SAMPLE ONLY at this point. We need to come up with a proper
 // definition first what we want from a status server.
 // At this point: whenever it receives the character 'p' it prints the
-// position as json.
+// position as json, with 'q' the motion queue statistics and with 'f' the
+// progress of the file job. With 's', optionally followed by a rate in Hz
+// (default 10, at most 1000/STATUS_TICK_MS), position, feedrate, queue depth,
+// aux bits and line number are pushed until 'u' is received.
 static void run_status_server(int listen_socket, FDMultiplexer *event_server,
-                              GCodeMachineControl *machine) {
+                              GCodeMachineControl *machine,
+                              MotionQueue *motion_queue,
+                              GCodeStreamer *streamer) {
   if (listen(listen_socket, 2) < 0) {
     Log_error("listen(fd=%d) failed: %s", listen_socket, strerror(errno));
     return;
@@ -238,8 +505,12 @@ static void run_status_server(int listen_socket, FDMultiplexer *event_server,
 
   Log_info("Starting experimental status server");
 
+  // Lives as long as the event server.
+  StatusPublisher *publisher = new StatusPublisher(event_server, machine,
+                                                   motion_queue);
   event_server->RunOnReadable(
-    listen_socket, [listen_socket, machine, event_server]() {
+    listen_socket, [listen_socket, machine, motion_queue, streamer,
+                    event_server, publisher]() {
       struct sockaddr_in client;
       socklen_t socklen = sizeof(client);
       int conn = accept(listen_socket, (struct sockaddr*) &client, &socklen);
@@ -248,18 +519,54 @@ static void run_status_server(int listen_socket, FDMultiplexer *event_server,
         return true;
       }
 
-      event_server->RunOnReadable(conn, [conn, machine]() {
-          char query;
-          if (read(conn, &query, 1) <= 0) {
+      event_server->RunOnReadable(conn, [conn, machine, motion_queue,
+                                         streamer, publisher]() {
+          char buf[64];
+          const ssize_t len = read(conn, buf, sizeof(buf));
+          if (len <= 0) {
+            publisher->Unsubscribe(conn);
             close(conn);
             return false;
           }
-          if (query == 'p') {
-            AxesRegister pos;
-            machine->GetCurrentPosition(&pos);
-            dprintf(conn, "{\"x_axis\":%.3f, \"y_axis\":%.3f, "
-                    "\"z_axis\":%.3f, \"note\":\"experimental\"}\n",
-                    pos[AXIS_X], pos[AXIS_Y], pos[AXIS_Z]);
+          for (ssize_t i = 0; i < len; ++i) {
+            const char query = buf[i];
+            if (query == 's') {
+              // Subscribe; optionally followed by the rate in Hz.
+              int rate_hz = 0;
+              while (i + 1 < len && isdigit(buf[i+1]))
+                rate_hz = 10 * rate_hz + (buf[++i] - '0');
+              publisher->Subscribe(conn, rate_hz > 0 ? rate_hz : 10);
+            }
+            if (query == 'u') {
+              publisher->Unsubscribe(conn);
+            }
+            if (query == 'p') {
+              AxesRegister pos;
+              machine->GetCurrentPosition(&pos);
+              dprintf(conn, "{\"x_axis\":%.3f, \"y_axis\":%.3f, "
+                      "\"z_axis\":%.3f, \"note\":\"experimental\"}\n",
+                      pos[AXIS_X], pos[AXIS_Y], pos[AXIS_Z]);
+            }
+            MotionQueueStats stats;
+            if (query == 'q' && motion_queue->GetStats(&stats)) {
+              dprintf(conn, "{\"segments\":%u, \"underruns\":%u, "
+                      "\"enqueue_waits\":%u, \"enqueue_wait_usec\":%llu, "
+                      "\"max_enqueue_wait_usec\":%u, "
+                      "\"depth_histogram\":[%s]}\n",
+                      stats.enqueue_count, stats.underruns, stats.enqueue_waits,
+                      (unsigned long long) stats.enqueue_wait_usec,
+                      stats.max_enqueue_wait_usec,
+                      queue_depth_histogram(stats).c_str());
+            }
+            uint64_t bytes_done, bytes_total;
+            if (query == 'f' && streamer->GetFileProgress(&bytes_done,
+                                                          &bytes_total)) {
+              dprintf(conn, "{\"bytes_done\":%llu, \"bytes_total\":%llu, "
+                      "\"percent\":%.1f}\n",
+                      (unsigned long long) bytes_done,
+                      (unsigned long long) bytes_total,
+                      100.0 * bytes_done / bytes_total);
+            }
           }
           return true;
         });
@@ -267,6 +574,44 @@ static void run_status_server(int listen_socket, FDMultiplexer *event_server,
     });
 }
 
+// Answers each request with the current metrics, in the text format
+// Prometheus scrapes, and closes the connection. As we don't care about the
+// request itself, this works with a plain HTTP GET or just a newline.
+static void run_metrics_server(int listen_socket,
+                               FDMultiplexer *event_server) {
+  if (listen(listen_socket, 2) < 0) {
+    Log_error("listen(fd=%d) failed: %s", listen_socket, strerror(errno));
+    return;
+  }
+  Log_info("Serving metrics");
+  event_server->RunOnReadable(listen_socket, [listen_socket, event_server]() {
+      int conn = accept(listen_socket, NULL, NULL);
+      if (conn < 0) {
+        Log_error("accept(): %s", strerror(errno));
+        return true;
+      }
+      event_server->RunOnReadable(conn, [conn]() {
+          char buf[1024];
+          if (read(conn, buf, sizeof(buf)) > 0) {
+            const std::string metrics
+              = MetricsRegistry::Global()->RenderText();
+            const std::string response = StringPrintf(
+              "HTTP/1.0 200 OK\r\n"
+              "Content-Type: text/plain; version=0.0.4\r\n"
+              "Content-Length: %zu\r\n\r\n", metrics.size()) + metrics;
+            // Small enough to fit into the socket buffer.
+            if (send(conn, response.data(), response.size(),
+                     MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {
+              Log_debug("Metrics client: %s", strerror(errno));
+            }
+          }
+          close(conn);
+          return false;
+        });
+      return true;
+    });
+}
+
 // Create an absolute filename from a path, without the file not needed
 // to exist (so works where realpath() doesn't)
 static std::string MakeAbsoluteFile(const char *in) {
@@ -280,10 +625,12 @@ int main(int argc, char *argv[]) {
   MachineControlConfig config;
   bool dry_run = false;
   bool simulation_output = false;
+  bool simulation_summary = false;
   const char *logfile = NULL;
   std::string paramfile;
   const char *config_file = NULL;
   bool as_daemon = false;
+  bool async_log = false;
   const char *privs = "daemon:daemon";
 
   // Less common options don't have a short option.
@@ -297,7 +644,20 @@ int main(int argc, char *argv[]) {
     OPT_PRIVS,
     OPT_ENABLE_M111,
     OPT_PARAM_FILE,
-    OPT_STATUS_SERVER
+    OPT_STATUS_SERVER,
+    OPT_COMPILE,
+    OPT_REPLAY,
+    OPT_TRACE,
+    OPT_SIM_SUMMARY,
+    OPT_RESUME_LINE,
+    OPT_ACK_WINDOW,
+    OPT_SPOOL_DIR,
+    OPT_ASYNC_LOG,
+    OPT_METRICS_PORT,
+    OPT_LATENCY_TRACE,
+    OPT_STATS_CACHE,
+    OPT_MOTION_SERVER,
+    OPT_REMOTE_QUEUE
   };
 
   static struct option long_options[] = {
@@ -314,13 +674,26 @@ int main(int argc, char *argv[]) {
     // Optional
     { "port",               required_argument, NULL, 'p'},
     { "bind-addr",          required_argument, NULL, 'b'},
+    { "ack-window",         required_argument, NULL, OPT_ACK_WINDOW },
+    { "spool-dir",          required_argument, NULL, OPT_SPOOL_DIR },
     { "loop",               optional_argument, NULL, OPT_LOOP },
     { "logfile",            required_argument, NULL, 'l'},
+    { "async-log",          no_argument,       NULL, OPT_ASYNC_LOG },
     { "param",              required_argument, NULL, OPT_PARAM_FILE },
     { "daemon",             no_argument,       NULL, 'd'},
     { "priv",               required_argument, NULL, OPT_PRIVS },
     { "allow-m111",         no_argument,       NULL, OPT_ENABLE_M111 },
     { "status-server",      required_argument, NULL, OPT_STATUS_SERVER },
+    { "metrics-port",       required_argument, NULL, OPT_METRICS_PORT },
+    { "stats-cache",        required_argument, NULL, OPT_STATS_CACHE },
+    { "compile",            required_argument, NULL, OPT_COMPILE },
+    { "replay",             required_argument, NULL, OPT_REPLAY },
+    { "trace",              required_argument, NULL, OPT_TRACE },
+    { "latency-trace",      required_argument, NULL, OPT_LATENCY_TRACE },
+    { "motion-server",      required_argument, NULL, OPT_MOTION_SERVER },
+    { "remote-queue",       required_argument, NULL, OPT_REMOTE_QUEUE },
+    { "sim-summary",        no_argument,       NULL, OPT_SIM_SUMMARY },
+    { "resume-line",        required_argument, NULL, OPT_RESUME_LINE },
 
     // possibly deprecated soon.
     { "threshold-angle",    required_argument, NULL, OPT_SET_THRESHOLD_ANGLE },
@@ -330,12 +703,24 @@ int main(int argc, char *argv[]) {
 
   int listen_port = -1;
   int status_server_port = -1;
+  int metrics_port = -1;
   char *bind_addr = NULL;
   bool require_homing = false;
   bool dont_require_homing = false;
   bool disable_range_check = false;
   bool allow_m111 = false;
-  config.threshold_angle = 10;
+  const char *compile_file = NULL;
+  const char *replay_file = NULL;
+  const char *trace_file = NULL;
+  const char *latency_trace_file = NULL;
+  int motion_server_port = -1;
+  std::string remote_host;
+  int remote_port = -1;
+  int resume_line = 1;
+  int ack_window = 0;
+  std::string spool_dir;
+  std::string stats_cache_file;
+  config.threshold_angle = 0;
   int opt;
   while ((opt = getopt_long(argc, argv, "p:b:SPnNf:l:dc:",
                             long_options, NULL)) != -1) {
@@ -364,6 +749,26 @@ int main(int argc, char *argv[]) {
       dry_run = true;
       simulation_output = true;
       break;
+    case OPT_SIM_SUMMARY:
+      dry_run = true;
+      simulation_summary = true;
+      break;
+    case OPT_RESUME_LINE:
+      resume_line = atoi(optarg);
+      if (resume_line < 1)
+        return usage(argv[0], "--resume-line needs a line number >= 1");
+      break;
+    case OPT_SPOOL_DIR:
+      spool_dir = MakeAbsoluteFile(optarg);  // We might chdir() as daemon.
+      break;
+    case OPT_STATS_CACHE:
+      stats_cache_file = MakeAbsoluteFile(optarg);
+      break;
+    case OPT_ACK_WINDOW:
+      ack_window = atoi(optarg);
+      if (ack_window < 0)
+        return usage(argv[0], "--ack-window can't be negative");
+      break;
     case 'P':
       config.debug_print = true;
       break;
@@ -380,12 +785,18 @@ int main(int argc, char *argv[]) {
     case OPT_STATUS_SERVER:
       status_server_port = atoi(optarg);
       break;
+    case OPT_METRICS_PORT:
+      metrics_port = atoi(optarg);
+      break;
     case 'b':
       bind_addr = strdup(optarg);
       break;
     case 'l':
       logfile = strdup(optarg);
       break;
+    case OPT_ASYNC_LOG:
+      async_log = true;
+      break;
     case OPT_PARAM_FILE:
       paramfile = MakeAbsoluteFile(optarg);
       break;
@@ -403,6 +814,28 @@ int main(int argc, char *argv[]) {
     case OPT_ENABLE_M111:
       allow_m111 = true;
       break;
+    case OPT_COMPILE:
+      compile_file = strdup(optarg);
+      break;
+    case OPT_REPLAY:
+      replay_file = strdup(optarg);
+      break;
+    case OPT_TRACE:
+      trace_file = strdup(optarg);
+      break;
+    case OPT_LATENCY_TRACE:
+      latency_trace_file = strdup(optarg);
+      break;
+    case OPT_MOTION_SERVER:
+      motion_server_port = atoi(optarg);
+      break;
+    case OPT_REMOTE_QUEUE: {
+      const char *colon = strrchr(optarg, ':');
+      if (!colon || (remote_port = atoi(colon + 1)) <= 0)
+        return usage(argv[0], "--remote-queue needs <host>:<port>");
+      remote_host.assign(optarg, colon - optarg);
+      break;
+    }
     case OPT_HELP:
       return usage(argv[0], NULL);
     default:
@@ -416,9 +849,42 @@ int main(int argc, char *argv[]) {
   }
 
   const bool has_filename = (optind < argc);
-  if (! (has_filename ^ (listen_port > 0))) {
+  if (motion_server_port > 0) {
+    if (has_filename || listen_port > 0 || compile_file || replay_file
+        || remote_port > 0)
+      return usage(argv[0], "--motion-server only executes remote motion.");
+  } else if (replay_file) {
+    if (has_filename || listen_port > 0 || compile_file)
+      return usage(argv[0], "--replay only runs the job file.");
+  } else if (! (has_filename ^ (listen_port > 0))) {
     return usage(argv[0], "Choose one: <gcode-filename> or --port <port>.");
   }
+  if (remote_port > 0 && (compile_file || dry_run)) {
+    return usage(argv[0], "--remote-queue can't be combined with --compile "
+                 "or dryrun.");
+  }
+  if (compile_file && !has_filename) {
+    return usage(argv[0], "--compile requires a <gcode-filename>.");
+  }
+  if (resume_line > 1 && !has_filename) {
+    return usage(argv[0], "--resume-line requires a <gcode-filename>.");
+  }
+  if (ack_window > 0 && listen_port <= 0) {
+    return usage(argv[0], "--ack-window requires --port.");
+  }
+#ifndef BEAGLEG_LATENCY_TRACE
+  if (latency_trace_file) {
+    return usage(argv[0], "--latency-trace needs a binary compiled with "
+                 "-DBEAGLEG_LATENCY_TRACE.");
+  }
+#endif
+  if (!spool_dir.empty()) {
+    struct stat st;
+    if (listen_port <= 0)
+      return usage(argv[0], "--spool-dir requires --port.");
+    if (stat(spool_dir.c_str(), &st) != 0 || !S_ISDIR(st.st_mode))
+      return usage(argv[0], "--spool-dir needs to be an existing directory.");
+  }
 
   // As daemon, we use whatever the user chose as logfile
   // (including nothing->syslog). Interactive, nothing means stderr.
@@ -426,8 +892,9 @@ int main(int argc, char *argv[]) {
   Log_info("BeagleG " BEAGLEG_VERSION " startup; "
            CAPE_NAME " hardware interface.");
 
-  // If reading from file: don't print 'ok' for every line.
-  config.acknowledge_lines = !has_filename;
+  // If reading from file: don't print 'ok' for every line. With an
+  // ack-window, the streamer acknowledges the lines in batches.
+  config.acknowledge_lines = !has_filename && ack_window == 0;
 
   if (!config_file) {
     Log_error("Expected config file -c <config>");
@@ -467,9 +934,14 @@ int main(int argc, char *argv[]) {
   if (dont_require_homing) config.require_homing = false;
   if (disable_range_check) config.range_check = false;
 
+  const uint32_t job_config_hash = MotionJobConfigHash(config_file, config);
+
   if (as_daemon && daemon(0, 0) != 0) {
     Log_error("Can't become daemon: %s", strerror(errno));
   }
+  if (async_log) {
+    Log_start_async();  // After daemon(): the thread would not survive fork.
+  }
 
   FDMultiplexer event_server;
   // Open socket early, so that we
@@ -477,7 +949,13 @@ int main(int argc, char *argv[]) {
   //      someone is alrady listening (starting as daemon twice?).
   //  (b) open socket while we have not dropped privileges yet.
   int listen_socket = -1;
-  if (!has_filename) {
+  if (motion_server_port > 0) {
+    listen_socket = open_server(bind_addr, motion_server_port);
+    if (listen_socket < 0) {
+      Log_error("Exiting. Couldn't bind to socket to listen.");
+      return 1;
+    }
+  } else if (!has_filename) {
     listen_socket = open_server(bind_addr, listen_port);
     if (listen_socket < 0) {
       Log_error("Exiting. Couldn't bind to socket to listen.");
@@ -489,10 +967,35 @@ int main(int argc, char *argv[]) {
   // just ignore them on dummy.
   MotionQueue *motion_backend;
   PruHardwareInterface *pru_hw_interface = NULL;
-  if (dry_run) {
+  SimFastForwardQueue *sim_summary = NULL;
+  if (compile_file) {
+    MotionJobRecorder *recorder = new MotionJobRecorder(compile_file,
+                                                        job_config_hash);
+    if (!recorder->IsOpen()) {
+      Log_error("Exiting. Can't write job file.");
+      return 1;
+    }
+    motion_backend = recorder;
+  } else if (remote_port > 0) {
+    // Planning here, executing on the motion server.
+    const int fd = RemoteMotionQueue::Connect(remote_host.c_str(),
+                                              remote_port);
+    if (fd < 0) {
+      Log_error("Exiting. Can't reach motion server.");
+      return 1;
+    }
+    RemoteMotionQueue *remote = new RemoteMotionQueue(fd, job_config_hash);
+    if (!remote->IsConnected()) {
+      Log_error("Exiting. Motion server did not accept connection.");
+      return 1;
+    }
+    motion_backend = remote;
+  } else if (dry_run) {
     // The backend
     if (simulation_output) {
       motion_backend = new SimFirmwareQueue(stdout, 3); // TODO: derive from cfg
+    } else if (simulation_summary) {
+      motion_backend = sim_summary = new SimFastForwardQueue();
     } else {
       motion_backend = new DummyMotionQueue();
     }
@@ -506,6 +1009,46 @@ int main(int argc, char *argv[]) {
     motion_backend = new PRUMotionQueue(&hardware_mapping, pru_hw_interface);
   }
 
+  // Optionally record everything that goes to the motion backend.
+  // Opened now, while we still have the privileges to create the file.
+  FILE *latency_trace = NULL;
+  if (latency_trace_file) {
+    latency_trace = fopen(latency_trace_file, "wb");
+    if (latency_trace == NULL) {
+      Log_error("Exiting. Can't create latency trace %s: %s",
+                latency_trace_file, strerror(errno));
+      return 1;
+    }
+  }
+
+  MotionTraceQueue *motion_trace = NULL;
+  if (trace_file) {
+    motion_trace = new MotionTraceQueue(motion_backend, trace_file);
+    if (!motion_trace->IsOpen()) {
+      Log_error("Exiting. Can't create trace file.");
+      return 1;
+    }
+  }
+  MotionQueue *const motion_queue = motion_trace ? motion_trace : motion_backend;
+
+  // Print time estimates run in the background and might still use the
+  // cache at exit, so it is never deleted.
+  PrintStatsCache *stats_cache = NULL;
+  MachineControlConfig stats_config = config;
+  configure_for_print_stats(&stats_config);
+  if (!stats_cache_file.empty()) {
+    stats_cache = new PrintStatsCache(stats_cache_file.c_str());
+    if (!stats_cache->IsOpen()) {
+      Log_error("Exiting. Can't open print stats cache.");
+      return 1;
+    }
+  }
+
+  if (!setup_realtime(config)) {
+    Log_error("Exiting. Could not set up real-time operation.");
+    return 1;
+  }
+
   // Listen port bound, GPIO initialized. Ready to drop privileges.
   if (geteuid() == 0 && strlen(privs) > 0) {
     if (drop_privileges(privs)) {
@@ -517,7 +1060,52 @@ int main(int argc, char *argv[]) {
   }
   Log_info("BeagleG running with PID %d", getpid());
 
-  MotionQueueMotorOperations motor_operations(&hardware_mapping, motion_backend);
+  if (replay_file) {
+    // No parsing or planning involved; straight to the motion backend.
+    const bool success = ReplayMotionJob(replay_file, job_config_hash,
+                                         motion_queue);
+    motion_queue->Shutdown(true);
+    delete motion_trace;
+    delete motion_backend;
+    delete pru_hw_interface;
+    Log_info("Shutdown.");
+    return success ? 0 : 1;
+  }
+
+  if (motion_server_port > 0) {
+    // The planning happens on the client; we only feed its segments to
+    // the motion backend.
+    MotionQueueServer server(motion_queue, job_config_hash, &event_server);
+    if (!server.Listen(listen_socket)) {
+      Log_error("Exiting. Can't listen for motion clients.");
+      return 1;
+    }
+    Log_info("Motion server: waiting for clients on port %d",
+             motion_server_port);
+    event_server.Loop();
+    motion_queue->Shutdown(true);
+    delete motion_trace;
+    delete motion_backend;
+    delete pru_hw_interface;
+    Log_info("Shutdown.");
+    return 0;
+  }
+
+  MotionQueueMotorOperations motor_operations(&hardware_mapping, motion_queue);
+  motor_operations.SetSCurveAcceleration(config.s_curve_acceleration);
+  for (const GCodeParserAxis axis : AllAxes()) {
+    motor_operations.PrecomputeAcceleration(config.acceleration[axis]
+                                            * config.steps_per_mm[axis]);
+  }
+  if (config.queue_low_watermark > 0) {
+    if (config.threaded_planner) {
+      // The planner thread would compete with us for the queue events.
+      Log_info("queue-low-watermark ignored with threaded-planner.");
+    } else if (!motor_operations.FeedFromEventLoop(&event_server,
+                                                   config.queue_low_watermark)) {
+      Log_info("Motion queue does not support low-watermark feeding.");
+    }
+  }
 
   GCodeMachineControl *machine_control
     = GCodeMachineControl::Create(config, &motor_operations,
@@ -536,27 +1124,55 @@ int main(int argc, char *argv[]) {
   GCodeParser *parser = new GCodeParser(parser_cfg,
                                         machine_control->ParseEventReceiver(),
                                         allow_m111);
+  if (motion_trace) {
+    motion_trace->SetLineSource([parser]() { return parser->line_number(); });
+  }
   GCodeStreamer *streamer =
     new GCodeStreamer(&event_server, parser,
                       machine_control->ParseEventReceiver());
+  JobSpooler *spooler = NULL;
   int ret = 0;
+  bool start_failed = false;
   if (has_filename) {
     const char *filename = argv[optind];
-    send_file_to_machine(machine_control, streamer, filename);
+    if (stats_cache) log_print_time_estimate(filename, stats_config,
+                                             stats_cache);
+    start_failed = !send_file_to_machine(machine_control, streamer, parser,
+                                         parser_cfg, filename, resume_line);
   } else {
+    streamer->SetAckWindow(ack_window);
+    if (!spool_dir.empty()) {
+      spooler = new JobSpooler(spool_dir, &event_server, streamer,
+                               machine_control, stderr);
+      if (stats_cache) {
+        spooler->SetSpooledCallback([stats_cache, &stats_config]
+                                    (const std::string &filename) {
+            log_print_time_estimate(filename.c_str(), stats_config,
+                                    stats_cache);
+          });
+      }
+    }
     run_gcode_server(listen_socket, &event_server, machine_control,
-                     streamer,  bind_addr, listen_port);
+                     streamer, spooler, bind_addr, listen_port);
   }
 
-  if (status_server_port) {
+  if (status_server_port > 0) {
     run_status_server(open_server(bind_addr, status_server_port),
-                      &event_server, machine_control);
+                      &event_server, machine_control, motion_queue,
+                      streamer);
+  }
+  if (metrics_port > 0) {
+    run_metrics_server(open_server(bind_addr, metrics_port), &event_server);
   }
 
-  event_server.Loop();  // Run service until Ctrl-C or all sockets closed.
+  if (!start_failed) {
+    event_server.Loop();  // Run service until Ctrl-C or all sockets closed.
+  }
   Log_info("Exiting.");
 
+  delete spooler;
   delete streamer;
+  if (motion_trace) motion_trace->SetLineSource(NULL);
   delete parser;
   delete machine_control;
 
@@ -564,9 +1180,28 @@ int main(int argc, char *argv[]) {
   if (caught_signal) {
     Log_info("Caught signal: immediate exit. "
              "Skipping potential remaining queue.");
+  } else {
+    motor_operations.WaitQueueEmpty();  // Flush what is still on the host.
+  }
+  log_queue_stats(motion_queue);
+  motion_queue->Shutdown(!caught_signal);
+
+  if (sim_summary) {
+    printf("%.6fs; %llu segments; motor steps:",
+           sim_summary->elapsed_seconds(),
+           (unsigned long long) sim_summary->segment_count());
+    for (int i = 0; i < BEAGLEG_NUM_MOTORS; ++i) {
+      printf(" %d", sim_summary->motor_steps(i));
+    }
+    printf("\n");
+  }
+
+  if (latency_trace) {
+    LatencyTraceWrite(latency_trace);
+    fclose(latency_trace);
   }
-  motion_backend->Shutdown(!caught_signal);
 
+  delete motion_trace;
   delete motion_backend;
   delete pru_hw_interface;
 
@@ -575,5 +1210,5 @@ int main(int argc, char *argv[]) {
   parser_cfg.SaveParams();
 
   Log_info("Shutdown.");
-  return ret;
+  return start_failed ? 1 : ret;
 }
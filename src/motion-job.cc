@@ -0,0 +1,220 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "motion-job.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "common/logging.h"
+
+#include "gcode-machine-control.h"
+#include "motor-interface-constants.h"
+
+static const char kMotionJobMagic[8] = { 'B', 'G', 'M', 'O', 'T', 'I', 'O', 'N' };
+
+// File layout: header, followed by header.record_count records.
+struct MotionJobHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t config_hash;
+  uint32_t record_size;      // sizeof(Record), as sanity check.
+  uint32_t record_count;
+} __attribute__((packed));
+
+enum RecordType {
+  RECORD_SEGMENT = 1,        // MotionSegment to enqueue.
+  RECORD_MOTOR_ENABLE = 2,   // Switch motors on or off.
+  RECORD_DWELL = 3,          // Dwell for the given time.
+};
+
+struct MotionJobRecord {
+  uint32_t type;
+  union {
+    MotionSegment segment;
+    uint32_t motor_enable;
+    float dwell_ms;
+  };
+} __attribute__((packed));
+
+// FNV-1a
+static uint32_t HashBytes(uint32_t hash, const void *data, size_t len) {
+  const uint8_t *p = (const uint8_t *) data;
+  for (size_t i = 0; i < len; ++i) {
+    hash ^= p[i];
+    hash *= 16777619;
+  }
+  return hash;
+}
+
+template <typename T>
+static uint32_t HashValue(uint32_t hash, const T &value) {
+  return HashBytes(hash, &value, sizeof(value));
+}
+
+uint32_t MotionJobConfigHash(const char *config_file,
+                             const MachineControlConfig &config) {
+  int fd = open(config_file, O_RDONLY);
+  if (fd < 0)
+    return 0;
+  uint32_t hash = 2166136261U;
+  char buf[4096];
+  ssize_t r;
+  while ((r = read(fd, buf, sizeof(buf))) > 0) {
+    hash = HashBytes(hash, buf, r);
+  }
+  close(fd);
+  hash = HashValue(hash, config.speed_factor);
+  hash = HashValue(hash, config.threshold_angle);
+  hash = HashValue(hash, config.require_homing);
+  hash = HashValue(hash, config.range_check);
+  hash = HashValue(hash, (uint32_t) sizeof(MotionSegment));
+  hash = HashValue(hash, (uint32_t) QUEUE_LEN);
+  return hash;
+}
+
+MotionJobRecorder::MotionJobRecorder(const char *filename, uint32_t config_hash)
+  : out_(fopen(filename, "wb")), config_hash_(config_hash),
+    motors_enabled_(-1), record_count_(0) {
+  if (out_ == NULL) {
+    Log_error("Can't open motion job file %s: %s", filename, strerror(errno));
+    return;
+  }
+  // Write preliminary header; the final record count is known at Shutdown().
+  MotionJobHeader header = {};
+  fwrite(&header, sizeof(header), 1, out_);
+}
+
+MotionJobRecorder::~MotionJobRecorder() {
+  Shutdown(true);
+}
+
+void MotionJobRecorder::Write(const MotionJobRecord &record) {
+  if (out_ == NULL) return;
+  if (fwrite(&record, sizeof(record), 1, out_) != 1) {
+    Log_error("Writing motion job: %s", strerror(errno));
+    return;
+  }
+  ++record_count_;
+}
+
+void MotionJobRecorder::Enqueue(MotionSegment *segment) {
+  MotionJobRecord record = {};
+  record.type = RECORD_SEGMENT;
+  record.segment = *segment;
+  Write(record);
+}
+
+void MotionJobRecorder::MotorEnable(bool on) {
+  if (motors_enabled_ == (int) on)
+    return;  // Motors are enabled before every segment; only record changes.
+  motors_enabled_ = on;
+  MotionJobRecord record = {};
+  record.type = RECORD_MOTOR_ENABLE;
+  record.motor_enable = on;
+  Write(record);
+}
+
+void MotionJobRecorder::Dwell(float milliseconds) {
+  MotionJobRecord record = {};
+  record.type = RECORD_DWELL;
+  record.dwell_ms = milliseconds;
+  Write(record);
+}
+
+void MotionJobRecorder::Shutdown(bool flush_queue) {
+  if (out_ == NULL) return;
+  MotionJobHeader header;
+  memcpy(header.magic, kMotionJobMagic, sizeof(header.magic));
+  header.version = MOTION_JOB_VERSION;
+  header.config_hash = config_hash_;
+  header.record_size = sizeof(MotionJobRecord);
+  header.record_count = record_count_;
+  fseek(out_, 0, SEEK_SET);
+  fwrite(&header, sizeof(header), 1, out_);
+  fclose(out_);
+  out_ = NULL;
+  Log_info("Wrote motion job with %u records.", record_count_);
+}
+
+bool ReplayMotionJob(const char *filename, uint32_t config_hash,
+                     MotionQueue *queue) {
+  typedef MotionJobRecord Record;
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    Log_error("Can't open motion job %s: %s", filename, strerror(errno));
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(MotionJobHeader)) {
+    Log_error("%s: not a motion job file.", filename);
+    close(fd);
+    return false;
+  }
+  void *mapped = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapped == MAP_FAILED) {
+    Log_error("Can't mmap motion job %s: %s", filename, strerror(errno));
+    return false;
+  }
+
+  bool success = false;
+  const MotionJobHeader *header = (const MotionJobHeader *) mapped;
+  const char *records = (const char*) mapped + sizeof(MotionJobHeader);
+  if (memcmp(header->magic, kMotionJobMagic, sizeof(header->magic)) != 0) {
+    Log_error("%s: not a motion job file.", filename);
+  } else if (header->version != MOTION_JOB_VERSION
+             || header->record_size != sizeof(Record)) {
+    Log_error("%s: unsupported motion job version %u.",
+              filename, header->version);
+  } else if (header->config_hash != config_hash) {
+    Log_error("%s: compiled for a different configuration. Please re-compile.",
+              filename);
+  } else if (sizeof(MotionJobHeader) + (uint64_t) header->record_count
+             * sizeof(Record) != (uint64_t) st.st_size) {
+    Log_error("%s: truncated motion job file.", filename);
+  } else {
+    Record record;
+    MotionSegment segment;  // Aligned, unlike the one in the packed record.
+    for (uint32_t i = 0; i < header->record_count; ++i) {
+      // Copy, as the queue is allowed to modify the segment.
+      memcpy(&record, records + i * sizeof(Record), sizeof(record));
+      switch (record.type) {
+      case RECORD_SEGMENT:
+        memcpy(&segment, &record.segment, sizeof(segment));
+        queue->Enqueue(&segment);
+        break;
+      case RECORD_MOTOR_ENABLE: queue->MotorEnable(record.motor_enable); break;
+      case RECORD_DWELL:      queue->Dwell(record.dwell_ms); break;
+      default:
+        Log_error("%s: unknown record type %u at %u", filename, record.type, i);
+        break;
+      }
+    }
+    queue->WaitQueueEmpty();
+    success = true;
+  }
+
+  munmap(mapped, st.st_size);
+  return success;
+}
@@ -0,0 +1,85 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _BEAGLEG_MOTION_JOB_H_
+#define _BEAGLEG_MOTION_JOB_H_
+
+// A precompiled motion job is the sequence of MotionSegments as they would
+// be sent to the MotionQueue, written to a file. Replaying that file does not
+// need any parsing or planning anymore.
+//
+// The job only is valid for the configuration it has been compiled with, so
+// it carries a hash of the configuration that is verified on replay.
+// Homing and probing are not recorded: the machine needs to be in the same
+// position at the start of the replay as it was when compiling.
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "motion-queue.h"
+
+struct MachineControlConfig;
+struct MotionJobRecord;
+
+enum {
+  MOTION_JOB_VERSION = 2
+};
+
+// Determine hash of the configuration file content and of the settings in
+// "config" that can be overridden on the command line and have an influence
+// on the resulting motion segments. Returns 0 if the file can't be read.
+uint32_t MotionJobConfigHash(const char *config_file,
+                             const MachineControlConfig &config);
+
+// A MotionQueue that writes all the segments to a job file instead of
+// executing them.
+class MotionJobRecorder : public MotionQueue {
+public:
+  // Create a recorder writing to "filename". Check IsOpen() for success.
+  MotionJobRecorder(const char *filename, uint32_t config_hash);
+  ~MotionJobRecorder() override;
+
+  bool IsOpen() const { return out_ != NULL; }
+
+  void Enqueue(MotionSegment *segment) final;
+  void WaitQueueEmpty() final {}
+  void MotorEnable(bool on) final;
+  void Dwell(float milliseconds) final;
+  void Shutdown(bool flush_queue) final;
+  int GetPendingElements(uint32_t *head_item_progress) final {
+    if (head_item_progress)
+      *head_item_progress = 0;
+    return 1;
+  }
+
+private:
+  void Write(const struct MotionJobRecord &record);
+
+  FILE *out_;
+  const uint32_t config_hash_;
+  int motors_enabled_;   // Last recorded state; -1 if unknown.
+  uint32_t record_count_;
+};
+
+// Memory map a job file that has been written with the MotionJobRecorder
+// and send it to the given MotionQueue. Refuses to run if the "config_hash"
+// does not match. Returns 'true' if the whole job could be replayed.
+bool ReplayMotionJob(const char *filename, uint32_t config_hash,
+                     MotionQueue *queue);
+
+#endif  // _BEAGLEG_MOTION_JOB_H_
@@ -0,0 +1,100 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * Test for precompiled motion jobs.
+ *
+ * Record a couple of segments and check that the replay sends exactly
+ * the same to the motion queue.
+ */
+#include "motion-job.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "common/logging.h"
+
+// Collects whatever is sent to it.
+class CollectingMotionQueue : public MotionQueue {
+public:
+  CollectingMotionQueue() : enable_calls(0), dwell_ms(0) {}
+  void Enqueue(MotionSegment *segment) final { segments.push_back(*segment); }
+  void WaitQueueEmpty() final {}
+  void MotorEnable(bool on) final { ++enable_calls; }
+  void Dwell(float milliseconds) final { dwell_ms += milliseconds; }
+  void Shutdown(bool flush_queue) final {}
+  int GetPendingElements(uint32_t *head_item_progress) final { return 1; }
+
+  std::vector<MotionSegment> segments;
+  int enable_calls;
+  float dwell_ms;
+};
+
+class MotionJobTest : public ::testing::Test {
+protected:
+  MotionJobTest() {
+    char tmpl[] = "/tmp/motion-job-test.XXXXXX";
+    close(mkstemp(tmpl));
+    filename_ = tmpl;
+  }
+  ~MotionJobTest() { unlink(filename_.c_str()); }
+
+  void RecordJob(uint32_t config_hash) {
+    MotionJobRecorder recorder(filename_.c_str(), config_hash);
+    ASSERT_TRUE(recorder.IsOpen());
+    for (int i = 0; i < 3; ++i) {
+      MotionSegment segment = {};
+      segment.loops_travel = 1000 + i;
+      segment.aux = i;
+      segment.fractions[0] = 0x12345678 + i;
+      recorder.MotorEnable(true);   // Redundant calls are not recorded.
+      recorder.Enqueue(&segment);
+    }
+    recorder.Dwell(42);
+    recorder.MotorEnable(false);
+    recorder.Shutdown(true);
+  }
+
+  std::string filename_;
+};
+
+TEST_F(MotionJobTest, ReplaySendsRecordedSegments) {
+  RecordJob(0xcafe);
+  CollectingMotionQueue queue;
+  EXPECT_TRUE(ReplayMotionJob(filename_.c_str(), 0xcafe, &queue));
+  ASSERT_EQ(3, (int)queue.segments.size());
+  for (int i = 0; i < 3; ++i) {
+    EXPECT_EQ(1000U + i, queue.segments[i].loops_travel);
+    EXPECT_EQ(i, queue.segments[i].aux);
+    EXPECT_EQ(0x12345678U + i, queue.segments[i].fractions[0]);
+  }
+  EXPECT_EQ(2, queue.enable_calls);
+  EXPECT_EQ(42, queue.dwell_ms);
+}
+
+TEST_F(MotionJobTest, RefuseDifferentConfiguration) {
+  RecordJob(0xcafe);
+  CollectingMotionQueue queue;
+  EXPECT_FALSE(ReplayMotionJob(filename_.c_str(), 0xbeef, &queue));
+  EXPECT_EQ(0, (int)queue.segments.size());
+}
+
+TEST_F(MotionJobTest, RefuseTruncatedFile) {
+  RecordJob(0xcafe);
+  FILE *f = fopen(filename_.c_str(), "r+");
+  fseek(f, 0, SEEK_END);
+  ASSERT_EQ(0, ftruncate(fileno(f), ftell(f) - 1));
+  fclose(f);
+  CollectingMotionQueue queue;
+  EXPECT_FALSE(ReplayMotionJob(filename_.c_str(), 0xcafe, &queue));
+}
+
+int main(int argc, char *argv[]) {
+  Log_init("/dev/stderr");
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
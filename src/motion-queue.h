@@ -20,6 +20,7 @@
 #define _BEAGLEG_MOTION_QUEUE_H_
 
 #include <stdint.h>
+#include <unistd.h>
 #include "common/container.h"
 
 #include "pru-hardware-interface.h"
@@ -47,21 +48,26 @@
 // using a microcontroller or FPGA.
 // Also useful for testing.
 
+// A segment with all fractions zero does not step, so with only travel loops
+// it is a timed wait; that is how dwells are executed in line.
 struct MotionSegment {
   // Queue header
   uint8_t state;           // see motor-interface-constants.h STATE_* constants.
 
   uint8_t direction_bits;
+  uint16_t aux;            // all 16 bits can be used
 
   // TravelParameters (needs to match TravelParameters in motor-interface-pru.p)
-  uint16_t loops_accel;    // Phase 1: loops spent in acceleration
-  uint16_t loops_travel;   // Phase 2: lops spent in travel
-  uint16_t loops_decel;    // Phase 3: loops spent in deceleration
-  uint16_t aux;            // all 16 bits can be used
+  // The sum of all loops must be less than 2^24 to fit the status counter.
+  uint32_t loops_accel;    // Phase 1: loops spent in acceleration
+  uint32_t loops_travel;   // Phase 2: lops spent in travel
+  uint32_t loops_decel;    // Phase 3: loops spent in deceleration
   uint32_t accel_series_index;  // index in taylor
 
   uint32_t hires_accel_cycles;  // acceleration delay cycles.
   uint32_t travel_delay_cycles; // travel delay cycles.
+  // With STATE_VELOCITY_PWM_BIT, these also carry the PWM duty for segments
+  // that don't need them otherwise; see motor-interface-constants.h
 
   uint32_t fractions[MOTION_MOTOR_COUNT]; // fixed point fractions to add each step.
 
@@ -73,12 +79,12 @@ struct MotionSegment {
   uint16_t jerk_stop;
   float jerk_motion;
 #endif
-} __attribute__((packed));
+} __attribute__((packed, aligned(4)));
 
 namespace internal {
 // Layout of the status register
 // Assuming atomicity of 32 bit boundaries
-// This 32 bit value will be a copy of the R28 register of the PRU.
+// This 32 bit value will be a copy of the R29 register of the PRU.
 // First 0-23 bits are assigned to the counter, top 24-31 bits to the index.
 // This is an internal implementation detail of the PRUMotionQueue.
 struct QueueStatus {
@@ -89,6 +95,29 @@ struct QueueStatus {
 
 typedef FixedArray<int, MOTION_MOTOR_COUNT> MotorsRegister;
 
+enum {
+  MOTION_QUEUE_DEPTH_BUCKETS = 8
+};
+
+// Statistics on how well the host keeps the motion queue fed.
+struct MotionQueueStats {
+  // Number of times the queue ran empty while the machine was supposed to
+  // continue moving.
+  uint32_t underruns;
+
+  // Number of Enqueue() calls, and how many of these had to wait for a free
+  // slot in the queue, and how long.
+  uint32_t enqueue_count;
+  uint32_t enqueue_waits;
+  uint64_t enqueue_wait_usec;
+  uint32_t max_enqueue_wait_usec;
+
+  // Number of Enqueue() calls by the number of pending elements at that
+  // time. Bucket i counts the queue depths from i * (QUEUE_LEN + 1) /
+  // MOTION_QUEUE_DEPTH_BUCKETS on.
+  uint32_t depth_histogram[MOTION_QUEUE_DEPTH_BUCKETS];
+};
+
 // Low level motion queue operations.
 class MotionQueue {
 public:
@@ -99,12 +128,34 @@ public:
   // Might change values in MotionSegment.
   virtual void Enqueue(MotionSegment *segment) = 0;
 
+  // Like Enqueue(), but never blocks. Returns false, leaving the segment
+  // untouched, if there is no capacity in the queue right now.
+  // Queues that never block can leave the default implementation.
+  virtual bool TryEnqueue(MotionSegment *segment) {
+    Enqueue(segment);
+    return true;
+  }
+
+  // A file descriptor that becomes readable whenever elements of the queue
+  // have been executed, so that there is capacity to TryEnqueue() again.
+  // After it became readable, call AcknowledgeEvent().
+  // Returns -1 if this queue does not provide such notification.
+  virtual int EventFd() { return -1; }
+  virtual void AcknowledgeEvent() {}
+
   // Block and wait for queue to be empty.
   virtual void WaitQueueEmpty() = 0;
 
   // Immediately enable motors, indepenent of queue.
   virtual void MotorEnable(bool on) = 0;
 
+  // Pause for the given time after all queued segments are executed.
+  // By default, this waits for the queue to be empty and sleeps.
+  virtual void Dwell(float milliseconds) {
+    WaitQueueEmpty();
+    usleep((int) (milliseconds * 1000));
+  }
+
   // Shutdown. If !flush_queue: immediate, even if motors are still moving.
   virtual void Shutdown(bool flush_queue) = 0;
 
@@ -115,6 +166,45 @@ public:
   // The return parameter head_item_progress is set to the number
   // of not yet executed loops in the item currenly being executed.
   virtual int GetPendingElements(uint32_t *head_item_progress) = 0;
+
+  // Get statistics about the queue operation since start.
+  // Returns false if this queue does not keep statistics.
+  virtual bool GetStats(MotionQueueStats *stats) { return false; }
+
+  // Watch the input "gpio_def" (as defined in motor-interface-constants.h)
+  // while executing segments with STATE_WATCH_INPUT_BIT set in their state.
+  // Once it reads "level", the segment decelerates to a stop. Call with an
+  // empty queue; this also resets the result of GetInputTrigger().
+  // Returns false if this queue can't watch inputs.
+  virtual bool WatchInput(uint32_t gpio_def, bool level) { return false; }
+
+  // Once the watched segment is executed, tell if the input triggered. If
+  // so, "loops_left" is set to the loops the segment had left, including
+  // the one executing, and "stop_loops" to the loops it did instead.
+  virtual bool GetInputTrigger(uint32_t *loops_left, uint32_t *stop_loops) {
+    return false;
+  }
+
+  // Feed hold: if "hold", slow down along the queued motion until standing
+  // still, keeping the place in the queue; otherwise speed up again to the
+  // planned profile. Each takes "ramp_seconds" from full speed.
+  // Returns false if this queue can't do that.
+  virtual bool FeedHold(bool hold, float ramp_seconds) { return false; }
+
+  // Returns true if a feed hold brought the motion to a stand-still.
+  virtual bool IsHeld() { return false; }
+
+  // Scale the speed of all motion by "factor" from now on, including what
+  // is queued already, getting there in "ramp_seconds" per full speed.
+  // Returns false if this queue can't do that.
+  virtual bool SetSpeedOverride(float factor, float ramp_seconds) {
+    return false;
+  }
+
+  // Start the spindle-speed PWM at 0% duty, to be driven from segments with
+  // STATE_VELOCITY_PWM_BIT. Returns the number of duty ticks of 100% in
+  // "full_ticks" or false if this queue can't do that.
+  virtual bool EnableVelocityPWM(uint32_t *full_ticks) { return false; }
 };
 
 // Standard implementation.
@@ -130,19 +220,33 @@ public:
   ~PRUMotionQueue();
 
   void Enqueue(MotionSegment *segment);
+  bool TryEnqueue(MotionSegment *segment);
+  int EventFd();
+  void AcknowledgeEvent();
   void WaitQueueEmpty();
   void MotorEnable(bool on);
   void Shutdown(bool flush_queue);
   int GetPendingElements(uint32_t *head_item_progress);
+  bool GetStats(MotionQueueStats *stats);
+  bool WatchInput(uint32_t gpio_def, bool level);
+  bool GetInputTrigger(uint32_t *loops_left, uint32_t *stop_loops);
+  bool FeedHold(bool hold, float ramp_seconds);
+  bool IsHeld();
+  bool SetSpeedOverride(float factor, float ramp_seconds);
+  bool EnableVelocityPWM(uint32_t *full_ticks);
 
 private:
   bool Init();
+  void UpdateSpeedTarget(float ramp_seconds);
 
   HardwareMapping *const hardware_mapping_;
   PruHardwareInterface *const pru_interface_;
 
   volatile struct PRUCommunication *pru_data_;
   unsigned int queue_pos_;
+  MotionQueueStats stats_;
+  bool feed_hold_;
+  float speed_override_;
 };
 
 
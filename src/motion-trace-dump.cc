@@ -0,0 +1,109 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Print and replay traces written by machine-control --trace
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "common/logging.h"
+
+#include "motion-trace.h"
+#include "motor-interface-constants.h"
+#include "sim-firmware.h"
+
+int usage(const char *prog) {
+  fprintf(stderr, "Usage: %s [options] <trace-file>\n"
+          "Options:\n"
+          "\t-s                : Replay segments in the firmware simulation "
+          "instead of listing them.\n"
+          "\t-m <motors>       : Number of motors shown in simulation "
+          "(Default: 3)\n", prog);
+  return 1;
+}
+
+static void PrintHeader() {
+  printf("#%9s %12s %10s %6s %4s %8s %8s %8s %8s %10s %10s %6s\n",
+         "seq", "time-ms", "delta-us", "line", "dir", "accel", "travel",
+         "decel", "series", "accel-cyc", "travel-cyc", "aux");
+}
+
+static void PrintRecord(const MotionTraceRecord &record, uint64_t start_ns,
+                        uint64_t *last_ns) {
+  const MotionSegment &s = record.segment;
+  if (s.state == STATE_EXIT) {
+    printf("%10u EXIT\n", record.sequence);
+    return;
+  }
+  printf("%10u %12.3f %10.1f %6d 0x%02x %8u %8u %8u %8u %10u %10u 0x%04x\n",
+         record.sequence,
+         (record.timestamp_ns - start_ns) / 1e6,
+         (record.timestamp_ns - *last_ns) / 1e3,
+         record.gcode_line, s.direction_bits,
+         s.loops_accel, s.loops_travel, s.loops_decel,
+         s.accel_series_index,
+         s.hires_accel_cycles >> DELAY_CYCLE_SHIFT, s.travel_delay_cycles,
+         s.aux);
+  *last_ns = record.timestamp_ns;
+}
+
+int main(int argc, char *argv[]) {
+  bool simulate = false;
+  int motors = 3;
+  int opt;
+  while ((opt = getopt(argc, argv, "sm:")) != -1) {
+    switch (opt) {
+    case 's':
+      simulate = true;
+      break;
+    case 'm':
+      motors = atoi(optarg);
+      if (motors < 1 || motors > MOTION_MOTOR_COUNT) return usage(argv[0]);
+      break;
+    default:
+      return usage(argv[0]);
+    }
+  }
+  if (optind != argc - 1)
+    return usage(argv[0]);
+  const char *filename = argv[optind];
+  Log_init("/dev/stderr");
+
+  bool success;
+  if (simulate) {
+    SimFirmwareQueue sim(stdout, motors);
+    success = ReadMotionTrace(filename, [&sim](const MotionTraceRecord &r) {
+        MotionSegment segment = r.segment;
+        if (segment.state != STATE_EXIT) sim.Enqueue(&segment);
+      });
+  } else {
+    bool is_first = true;
+    uint64_t start_ns = 0, last_ns = 0;
+    PrintHeader();
+    success = ReadMotionTrace(filename, [&](const MotionTraceRecord &r) {
+        if (is_first) {
+          start_ns = last_ns = r.timestamp_ns;
+          is_first = false;
+        }
+        PrintRecord(r, start_ns, &last_ns);
+      });
+  }
+  return success ? 0 : 1;
+}
@@ -0,0 +1,161 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "motion-trace.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common/logging.h"
+
+static const char kMotionTraceMagic[8] = { 'B', 'G', 'T', 'R', 'A', 'C', 'E', '\0' };
+
+// File layout: header, followed by header.capacity records. Record number
+// n is stored at position n % capacity.
+struct MotionTraceHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t record_size;      // sizeof(MotionTraceRecord), as sanity check.
+  uint32_t capacity;
+  uint32_t reserved;
+  volatile uint64_t write_count;  // Number of records written so far.
+} __attribute__((packed, aligned(8)));
+
+MotionTraceQueue::MotionTraceQueue(MotionQueue *delegate, const char *filename,
+                                   int record_count)
+  : delegate_(delegate), header_(NULL), records_(NULL), next_slot_(0),
+    capacity_(record_count), mapped_size_(0) {
+  if (record_count <= 0) {
+    Log_error("Invalid motion trace size %d", record_count);
+    return;
+  }
+  int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    Log_error("Can't open motion trace %s: %s", filename, strerror(errno));
+    return;
+  }
+  const size_t size = sizeof(MotionTraceHeader)
+    + (size_t) record_count * sizeof(MotionTraceRecord);
+  if (ftruncate(fd, size) != 0) {
+    Log_error("Can't allocate motion trace %s: %s", filename, strerror(errno));
+    close(fd);
+    return;
+  }
+  void *mapped = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapped == MAP_FAILED) {
+    Log_error("Can't mmap motion trace %s: %s", filename, strerror(errno));
+    return;
+  }
+  // Touch all pages now, so that recording does not have to page fault.
+  memset(mapped, 0, size);
+  mapped_size_ = size;
+  header_ = (MotionTraceHeader*) mapped;
+  records_ = (MotionTraceRecord*) ((char*) mapped + sizeof(MotionTraceHeader));
+  memcpy(header_->magic, kMotionTraceMagic, sizeof(header_->magic));
+  header_->version = MOTION_TRACE_VERSION;
+  header_->record_size = sizeof(MotionTraceRecord);
+  header_->capacity = record_count;
+  header_->write_count = 0;
+}
+
+MotionTraceQueue::~MotionTraceQueue() {
+  if (header_) munmap(header_, mapped_size_);
+}
+
+void MotionTraceQueue::Record(const MotionSegment &segment) {
+  if (header_ == NULL) return;
+  const uint64_t count = header_->write_count;
+  MotionTraceRecord *record = &records_[next_slot_];
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  record->timestamp_ns = (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+  record->gcode_line = line_source_ ? line_source_() : 0;
+  record->sequence = count;
+  record->segment = segment;
+  // Only count the record once it is complete.
+  header_->write_count = count + 1;
+  if (++next_slot_ == capacity_) next_slot_ = 0;
+}
+
+void MotionTraceQueue::Enqueue(MotionSegment *segment) {
+  Record(*segment);  // Before the delegate is allowed to modify it.
+  delegate_->Enqueue(segment);
+}
+
+bool MotionTraceQueue::TryEnqueue(MotionSegment *segment) {
+  const MotionSegment copy = *segment;
+  if (!delegate_->TryEnqueue(segment))
+    return false;
+  Record(copy);
+  return true;
+}
+
+bool ReadMotionTrace(const char *filename,
+                     const std::function<void(const MotionTraceRecord&)> &callback) {
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    Log_error("Can't open motion trace %s: %s", filename, strerror(errno));
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(MotionTraceHeader)) {
+    Log_error("%s: not a motion trace file.", filename);
+    close(fd);
+    return false;
+  }
+  void *mapped = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapped == MAP_FAILED) {
+    Log_error("Can't mmap motion trace %s: %s", filename, strerror(errno));
+    return false;
+  }
+
+  bool success = false;
+  const MotionTraceHeader *header = (const MotionTraceHeader *) mapped;
+  const MotionTraceRecord *records = (const MotionTraceRecord *)
+    ((const char*) mapped + sizeof(MotionTraceHeader));
+  if (memcmp(header->magic, kMotionTraceMagic, sizeof(header->magic)) != 0) {
+    Log_error("%s: not a motion trace file.", filename);
+  } else if (header->version != MOTION_TRACE_VERSION
+             || header->record_size != sizeof(MotionTraceRecord)) {
+    Log_error("%s: unsupported motion trace version %u.",
+              filename, header->version);
+  } else if (header->capacity == 0
+             || sizeof(MotionTraceHeader) + (uint64_t) header->capacity
+             * sizeof(MotionTraceRecord) != (uint64_t) st.st_size) {
+    Log_error("%s: truncated motion trace file.", filename);
+  } else {
+    const uint64_t written = header->write_count;
+    const uint64_t available = written < header->capacity
+      ? written : header->capacity;
+    for (uint64_t i = written - available; i < written; ++i) {
+      callback(records[i % header->capacity]);
+    }
+    success = true;
+  }
+
+  munmap(mapped, st.st_size);
+  return success;
+}
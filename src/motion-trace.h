@@ -0,0 +1,101 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _BEAGLEG_MOTION_TRACE_H_
+#define _BEAGLEG_MOTION_TRACE_H_
+
+// A trace of the last segments sent to the motion queue, for post-mortem
+// inspection of misbehaving jobs.
+//
+// The trace is a ring of fixed size records in a memory mapped file, so
+// records only need to be copied, and are still there if the process
+// crashes. Once the ring is full, the oldest records are overwritten.
+
+#include <stdint.h>
+
+#include <functional>
+
+#include "motion-queue.h"
+
+enum {
+  MOTION_TRACE_VERSION = 1,
+  MOTION_TRACE_DEFAULT_RECORDS = 65536,
+};
+
+struct MotionTraceRecord {
+  uint64_t timestamp_ns;     // CLOCK_MONOTONIC when the segment was enqueued.
+  int32_t gcode_line;        // Line the parser was at; 0 if unknown.
+  uint32_t sequence;         // Counting up from zero.
+  MotionSegment segment;
+} __attribute__((packed, aligned(8)));
+
+struct MotionTraceHeader;
+
+// A MotionQueue that records all enqueued segments and passes them on to
+// the "delegate" queue. Does not take ownership of the delegate.
+class MotionTraceQueue : public MotionQueue {
+public:
+  // Create the trace in "filename" with space for "record_count" records.
+  // Check IsOpen() for success; if the file could not be created, segments
+  // are still passed on, just not recorded.
+  MotionTraceQueue(MotionQueue *delegate, const char *filename,
+                   int record_count = MOTION_TRACE_DEFAULT_RECORDS);
+  ~MotionTraceQueue() override;
+
+  bool IsOpen() const { return header_ != NULL; }
+
+  // Set a function returning the G-code line currently being processed.
+  // Note, the planner looks ahead a few moves, so this is usually a bit
+  // ahead of the line the segment originates from.
+  void SetLineSource(const std::function<int()> &line_source) {
+    line_source_ = line_source;
+  }
+
+  void Enqueue(MotionSegment *segment) final;
+  bool TryEnqueue(MotionSegment *segment) final;
+  int EventFd() final { return delegate_->EventFd(); }
+  void AcknowledgeEvent() final { delegate_->AcknowledgeEvent(); }
+  void WaitQueueEmpty() final { delegate_->WaitQueueEmpty(); }
+  void MotorEnable(bool on) final { delegate_->MotorEnable(on); }
+  void Dwell(float milliseconds) final { delegate_->Dwell(milliseconds); }
+  void Shutdown(bool flush_queue) final { delegate_->Shutdown(flush_queue); }
+  int GetPendingElements(uint32_t *head_item_progress) final {
+    return delegate_->GetPendingElements(head_item_progress);
+  }
+  bool GetStats(MotionQueueStats *stats) final {
+    return delegate_->GetStats(stats);
+  }
+
+private:
+  void Record(const MotionSegment &segment);
+
+  MotionQueue *const delegate_;
+  std::function<int()> line_source_;
+  MotionTraceHeader *header_;
+  MotionTraceRecord *records_;
+  int next_slot_;
+  const int capacity_;
+  size_t mapped_size_;
+};
+
+// Read a trace written by the MotionTraceQueue and call "callback" for each
+// record, oldest first. Returns 'false' if this is not a readable trace.
+bool ReadMotionTrace(const char *filename,
+                     const std::function<void(const MotionTraceRecord&)> &callback);
+
+#endif  // _BEAGLEG_MOTION_TRACE_H_
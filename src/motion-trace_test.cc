@@ -0,0 +1,107 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * Test for the motion trace.
+ *
+ * Segments pass through to the delegate and the trace keeps the last ones.
+ */
+#include "motion-trace.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+// Collects whatever is sent to it. Refuses TryEnqueue() if "full".
+class CollectingMotionQueue : public MotionQueue {
+public:
+  CollectingMotionQueue() : full(false) {}
+  void Enqueue(MotionSegment *segment) final { segments.push_back(*segment); }
+  bool TryEnqueue(MotionSegment *segment) final {
+    if (full) return false;
+    Enqueue(segment);
+    return true;
+  }
+  void WaitQueueEmpty() final {}
+  void MotorEnable(bool on) final {}
+  void Shutdown(bool flush_queue) final {}
+  int GetPendingElements(uint32_t *head_item_progress) final { return 1; }
+
+  std::vector<MotionSegment> segments;
+  bool full;
+};
+
+class MotionTraceTest : public ::testing::Test {
+protected:
+  MotionTraceTest() {
+    char tmpl[] = "/tmp/motion-trace-test.XXXXXX";
+    close(mkstemp(tmpl));
+    filename_ = tmpl;
+  }
+  ~MotionTraceTest() { unlink(filename_.c_str()); }
+
+  std::vector<MotionTraceRecord> ReadTrace() {
+    std::vector<MotionTraceRecord> result;
+    EXPECT_TRUE(ReadMotionTrace(filename_.c_str(),
+                                [&result](const MotionTraceRecord &r) {
+                                  result.push_back(r);
+                                }));
+    return result;
+  }
+
+  std::string filename_;
+};
+
+TEST_F(MotionTraceTest, KeepsLastSegmentsInOrder) {
+  CollectingMotionQueue queue;
+  {
+    MotionTraceQueue trace(&queue, filename_.c_str(), 4);
+    ASSERT_TRUE(trace.IsOpen());
+    int line = 0;
+    trace.SetLineSource([&line]() { return line; });
+    for (int i = 0; i < 10; ++i) {
+      line = 100 + i;
+      MotionSegment segment = {};
+      segment.loops_travel = 1000 + i;
+      trace.Enqueue(&segment);
+    }
+  }
+  ASSERT_EQ(10, (int)queue.segments.size());
+
+  const std::vector<MotionTraceRecord> records = ReadTrace();
+  ASSERT_EQ(4, (int)records.size());
+  for (int i = 0; i < 4; ++i) {
+    EXPECT_EQ(6U + i, records[i].sequence);
+    EXPECT_EQ(106 + i, records[i].gcode_line);
+    EXPECT_EQ(1006U + i, records[i].segment.loops_travel);
+    if (i > 0) {
+      EXPECT_LE(records[i-1].timestamp_ns, records[i].timestamp_ns);
+    }
+  }
+}
+
+TEST_F(MotionTraceTest, OnlyRecordsAcceptedSegments) {
+  CollectingMotionQueue queue;
+  MotionTraceQueue trace(&queue, filename_.c_str(), 4);
+  MotionSegment segment = {};
+  queue.full = true;
+  EXPECT_FALSE(trace.TryEnqueue(&segment));
+  EXPECT_EQ(0, (int)ReadTrace().size());
+  queue.full = false;
+  EXPECT_TRUE(trace.TryEnqueue(&segment));
+  EXPECT_EQ(1, (int)ReadTrace().size());   // Readable while still recording.
+}
+
+TEST_F(MotionTraceTest, RejectsOtherFiles) {
+  FILE *f = fopen(filename_.c_str(), "w");
+  fprintf(f, "Not a trace, but long enough to contain a header.\n");
+  fclose(f);
+  EXPECT_FALSE(ReadMotionTrace(filename_.c_str(),
+                               [](const MotionTraceRecord &) {}));
+}
+
+int main(int argc, char *argv[]) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -31,7 +31,70 @@
 #define STATE_FILLED 1   // Queue element filled by host, to be picked up by PRU
 #define STATE_EXIT   2   // Filled by host, no parameters; tells PRU to exit.
 
-#define QUEUE_LEN 16
+// Bit set in the state by the host if the motion continues after this
+// segment, i.e. it does not end at standstill. If the PRU then finds the
+// next slot still empty, it counts a queue underrun.
+#define STATE_CONTINUED_BIT 7
+
+// Bit set in the state by the host if the PRU should watch the input
+// configured at QUEUE_WATCH_OFFSET while executing this segment. Once the
+// input has the configured level, the segment decelerates to a stop; the
+// loops left at that moment are recorded at QUEUE_TRIGGER_OFFSET.
+#define STATE_WATCH_INPUT_BIT 6
+
+// Bit set in the state by the host for segments that take a fixed time
+// regardless of the speed scale at QUEUE_SPEED_OFFSET, such as dwells.
+#define STATE_FIXED_TIME_BIT 5
+
+// Bits set in the state by the host for segments during which the PWM timer
+// configured at QUEUE_PWM_OFFSET follows the speed. In ramps, the duty ticks
+// are travel_delay_cycles / current delay: the host stores the ticks at the
+// planned feed times the delay cycles of that feed there. Segments at
+// constant speed also have STATE_CONSTANT_PWM_BIT set and the duty ticks
+// directly in hires_accel_cycles, which they don't need otherwise.
+#define STATE_VELOCITY_PWM_BIT 4
+#define STATE_CONSTANT_PWM_BIT 3
+
+// Location of the status word, underrun counter and, if aux bits are set
+// by PRU1, the aux bits of the current segment in PRU memory. Then the
+// input to watch (address of the GPIO_DATAIN register, bit mask and level)
+// and what happened when it triggered (flag, loops left in the segment at
+// that moment and loops after it to come to a stop). Then the speed scale
+// for feed hold and override: the target set by the host and the current
+// value of the PRU, both as slowdown, i.e. FULL_SPEED_SCALE - speed, so that
+// 0 is the planned speed. The slowdown is a signed 32 bit value, negative for
+// speeds above the planned one. Then the change of speed per delay loop while
+// getting to the target. Then the PWM timer that follows the speed: address
+// of its match register (0: none), the match value for 0% duty and the
+// number of ticks for 100%. The ring buffer follows them.
+#define QUEUE_STATUS_OFFSET   0
+#define QUEUE_UNDERRUN_OFFSET 4
+#define QUEUE_AUX_OFFSET      8
+#define QUEUE_WATCH_OFFSET    12
+#define QUEUE_TRIGGER_OFFSET  24
+#define QUEUE_SPEED_OFFSET    36
+#define QUEUE_SPEED_RATE_OFFSET 44
+#define QUEUE_PWM_OFFSET      48
+#define QUEUE_OFFSET          60
+// End of the ring buffer, where the PRU wraps around. QUEUE_ELEMENT_SIZE is
+// defined by the user of this, from the layout of the segment.
+#define QUEUE_END_OFFSET      (QUEUE_OFFSET + QUEUE_LEN * QUEUE_ELEMENT_SIZE)
+
+// With the speed scaled, the delays are stretched by FULL_SPEED_SCALE / speed.
+// The top bits of the speed, speed >> SPEED_SCALE_SHIFT, are used for the
+// delay loop. The speed can be up to MAX_SPEED_SCALE; bit 31 stays clear to
+// detect an underflow.
+#define FULL_SPEED_SCALE  (1 << 29)
+#define MAX_SPEED_SCALE   (3 * FULL_SPEED_SCALE)
+#define SPEED_SCALE_SHIFT 21
+
+// Number of slots in the ring buffer. With the status words in front, all
+// slots need to fit into the 8k PRU data RAM; with 60 bytes per slot that
+// is at most 135. Can be changed at compile time with
+// make BEAGLEG_QUEUE_LEN=<n>
+#ifndef QUEUE_LEN
+#define QUEUE_LEN 128
+#endif
 
 // In calculation of delay cycles: number of bits shifted
 // for higher resolution.
@@ -28,19 +28,14 @@
 #define CONST_PRUDRAM	   C24
 
 #define QUEUE_ELEMENT_SIZE (SIZE(QueueHeader) + SIZE(TravelParameters))
-#define QUEUE_OFFSET 4
 
 #define PARAM_START r7
-#define PARAM_END  r19
+#define PARAM_END  r20
 .struct TravelParameters
-	// We do at most 2^16 loops to avoid accumulating too much rounding
-	// error in the fraction addition. Longer moves are split into separate
-	// requests by the host.
-	.u16 loops_accel	 // Phase 1: steps spent in acceleration.
-	.u16 loops_travel	 // Phase 2: steps spent in travel.
-	.u16 loops_decel         // Phase 3: steps spent in deceleration.
-
-	.u16 aux		 // all 16 bits can be used
+	// The sum of all loops is less than 2^24, guaranteed by the host.
+	.u32 loops_accel	 // Phase 1: steps spent in acceleration.
+	.u32 loops_travel	 // Phase 2: steps spent in travel.
+	.u32 loops_decel         // Phase 3: steps spent in deceleration.
 
 	.u32 accel_series_index  // index into the taylor series.
 	.u32 hires_accel_cycles  // initial delay cycles, for acceleration
@@ -63,11 +58,12 @@
 .struct QueueHeader
 	.u8 state
 	.u8 direction_bits
+	.u16 aux		 // all 16 bits can be used
 .ends
 
 ;; counter states of the motors
-#define STATE_START r20   	; after PARAM_END
-#define STATE_END r27
+#define STATE_START r21   	; after PARAM_END
+#define STATE_END r28
 .struct MotorState
 	.u32 m1
 	.u32 m2
@@ -172,11 +168,143 @@ DONE_CALCULATE_DELAY:
 ;;; to be performed and then it push it in the PRU DRAM status register.
 .macro UpdateQueueStatus
 	;; Decrease the step counter
-	SUB r28, r28, 1 ; status_loops--
+	SUB r29, r29, 1 ; status_loops--
 	;; Push in DRAM
-	MOV r0, 0
-	SBCO r28, CONST_PRUDRAM, r0, 4
-	SUB r1, r1, (4 / 2) ; Subtract the loops consumed for this macro.
+	SBCO r29, CONST_PRUDRAM, QUEUE_STATUS_OFFSET, 4
+	;; Subtract the loops consumed for this macro, the check for a
+	;; watched input before it and the checks of VelocityPWM and ScaleSpeed
+	;; after it.
+	SUB r1, r1, (4 + 7) / 2
+.endm
+
+;;; For segments with STATE_VELOCITY_PWM_BIT, set the duty cycle of the PWM
+;;; timer configured by the host to follow the speed, e.g. the power of a laser
+;;; that should mark evenly while accelerating. With the delay of this loop
+;;; in r1, the duty ticks are travel_delay_cycles / delay in ramps; at
+;;; constant speed, the host gives them directly in hires_accel_cycles.
+;;; The result is written to the match register of the timer. Uses r4..r6.
+;;; CalculateDelay and UpdateQueueStatus already took their cycles off r1;
+;;; VELOCITY_PWM_DELAY_OFFSET adds them back, about, to get the delay. The
+;;; compensations are about the cycles spent here.
+#define VELOCITY_PWM_DELAY_OFFSET ((IDIV_MACRO_CYCLE_COUNT + 10) / 2 + 5)
+#define VELOCITY_PWM_DIVISION_COMPENSATION ((IDIV_MACRO_CYCLE_COUNT + 5) / 2)
+#define VELOCITY_PWM_WRITE_COMPENSATION (16 / 2)
+.macro VelocityPWM
+	QBBC vpwm_done, r0, STATE_VELOCITY_PWM_BIT
+	MOV r4, travel_params.hires_accel_cycles	; duty ticks
+	QBBS vpwm_clamp, r0, STATE_CONSTANT_PWM_BIT
+	MOV r4, travel_params.travel_delay_cycles	; ticks * delay at feed
+	ADD r5, r1, VELOCITY_PWM_DELAY_OFFSET
+	idiv_macro r4, r5, r6
+	QBGE vpwm_clamp, r1, VELOCITY_PWM_DIVISION_COMPENSATION
+	SUB r1, r1, VELOCITY_PWM_DIVISION_COMPENSATION
+vpwm_clamp:
+	LBCO r5, CONST_PRUDRAM, QUEUE_PWM_OFFSET + 4, 8	; 0% value, 100% ticks
+	QBGE vpwm_in_range, r4, r6
+	MOV r4, r6
+vpwm_in_range:
+	ADD r4, r4, r5
+	LBCO r5, CONST_PRUDRAM, QUEUE_PWM_OFFSET, 4	; match register
+	QBEQ vpwm_done, r5, 0
+	SBBO r4, r5, 0, 4
+	QBGE vpwm_done, r1, VELOCITY_PWM_WRITE_COMPENSATION
+	SUB r1, r1, VELOCITY_PWM_WRITE_COMPENSATION
+vpwm_done:
+.endm
+
+;;; Speed scale for feed hold and feed override. Usually, we run at the
+;;; planned speed and just continue with the delay in r1. Otherwise, the
+;;; delay is stretched by FULL_SPEED_SCALE / speed while the speed changes
+;;; linearly in time towards the target set by the host: 0 for a feed hold,
+;;; or the feed override. We stay on the path and in the queue all the time.
+;;; At speed 0, we wait until the host sets a new target. Segments that take
+;;; a fixed time, such as dwells, are not scaled. Uses r4..r6.
+;;; SPEED_SCALE_COMPENSATION is about the extra cycles spent here.
+#define SPEED_SCALE_COMPENSATION (26 / 2)
+.macro ScaleSpeed
+	LBCO r4, CONST_PRUDRAM, QUEUE_SPEED_OFFSET, 8	; target, slowdown
+	QBNE scale_active, r5, 0
+	QBEQ STEP_DELAY, r4, 0		; Common case: planned speed.
+scale_active:
+	QBBS STEP_DELAY, r0, STATE_FIXED_TIME_BIT
+	MOV r6, FULL_SPEED_SCALE
+	SUB r5, r6, r5			; speed from signed slowdown
+	SUB r4, r6, r4			; same for the target
+	QBNE scale_ramp, r5, 0
+scale_wait:				; Standing still.
+	QBNE scale_ramp, r4, 0
+	LBCO r4, CONST_PRUDRAM, QUEUE_SPEED_OFFSET, 4
+	SUB r4, r6, r4
+	JMP scale_wait
+scale_ramp:
+	LBCO r6, CONST_PRUDRAM, QUEUE_SPEED_RATE_OFFSET, 4
+	QBLT scale_stretch, r5, r4	; Slowing down ...
+	QBNE scale_faster, r4, r5
+	ZERO &r6, 4			; ... staying at the target ...
+	QBA scale_stretch
+scale_faster:
+	RSB r6, r6, 0			; ... or speeding up.
+scale_stretch:
+	QBGE scale_no_compensation, r1, SPEED_SCALE_COMPENSATION
+	SUB r1, r1, SPEED_SCALE_COMPENSATION
+scale_no_compensation:
+	;; Delay loop of four cycles counting r1 down in steps of the speed;
+	;; at full speed (256 after the shift), we need r1 / 2 iterations to
+	;; take as long as the two cycle loop below.
+	LSL r1, r1, 7
+	LSR r4, r5, SPEED_SCALE_SHIFT
+scale_delay:
+	SUB r1, r1, r4
+	SUB r5, r5, r6
+	LSR r4, r5, SPEED_SCALE_SHIFT
+	QBLT scale_delay, r1, r4
+
+	;; Don't go past the target; it might have changed meanwhile.
+	MOV r1, FULL_SPEED_SCALE
+	LBCO r4, CONST_PRUDRAM, QUEUE_SPEED_OFFSET, 4
+	SUB r4, r1, r4			; target speed
+	QBEQ scale_store, r6, 0
+	QBBS scale_was_faster, r6, 31
+	QBBS scale_at_target, r5, 31	; Underflow.
+	QBLT scale_at_target, r4, r5
+	QBA scale_store
+scale_was_faster:
+	QBLT scale_at_target, r5, r4
+	QBA scale_store
+scale_at_target:
+	MOV r5, r4
+scale_store:
+	SUB r5, r1, r5			; store as slowdown
+	SBCO r5, CONST_PRUDRAM, QUEUE_SPEED_OFFSET + 4, 4
+	JMP STEP_GEN
+.endm
+
+;;; If the segment watches an input (r0 has the state of the segment), read
+;;; it and, if it has the level we wait for, come to a stop: decelerate for
+;;; as many loops as we are into the acceleration series. Record the loops
+;;; that were left and the ones it takes now to stop.
+;;; Uses r4..r6; r1 holds the delay for this loop and is left alone.
+.macro WatchInput
+	QBBC watch_done, r0, STATE_WATCH_INPUT_BIT
+	LBCO r4, CONST_PRUDRAM, QUEUE_WATCH_OFFSET, 12  ; address, mask, level
+	LBBO r4, r4, 0, 4
+	AND r4, r4, r5
+	QBNE watch_done, r4, r6
+
+	CLR r0, r0, STATE_WATCH_INPUT_BIT	; Only trigger once.
+	MOV r4, 1
+	MOV r5, r29
+	MOV r5.b3, 0				; loops left, including this one.
+	MOV travel_params.loops_accel, 0
+	MOV travel_params.loops_travel, 0
+	MOV travel_params.loops_decel, travel_params.accel_series_index
+	ADD r6, travel_params.loops_decel, 1	; this one plus deceleration.
+	SBCO r4, CONST_PRUDRAM, QUEUE_TRIGGER_OFFSET, 12
+
+	;; The status counter now counts down the loops to stop.
+	ZERO &r29, 3
+	ADD r29, r29, r6
+watch_done:
 .endm
 
 INIT:
@@ -186,8 +314,8 @@ INIT:
 	SBCO r0, C4, 4, 4
 
 	MOV r2, QUEUE_OFFSET ; Queue address in PRU memory
-	MOV r28, 0           ; Status register in PRU memory,
-	                     ; r28.b3 for current queue position,
+	MOV r29, 0           ; Status register in PRU memory,
+	                     ; r29.b3 for current queue position,
 	                     ; bottom three for the remaining steps of the current slot.
 QUEUE_READ:
 	;;
@@ -195,49 +323,55 @@ QUEUE_READ:
 	;;
 
 	;; Check queue header at our read-position until it contains something.
-	.assign QueueHeader, r1.w0, r1.w0, queue_header
+	.assign QueueHeader, r1, r1, queue_header
 	LBCO queue_header, CONST_PRUDRAM, r2, SIZE(queue_header)
 	QBEQ QUEUE_READ, queue_header.state, STATE_EMPTY ; wait until got data.
 
 	QBEQ FINISH, queue_header.state, STATE_EXIT
+	MOV r0, queue_header.state	; Keep for WatchInput
 
 	;; Set direction bits
 	MOV r3, queue_header.direction_bits
 	CALL SetDirections
 
+	;; Set the Aux bits
+	MOV r3, queue_header.aux
+#ifdef PRU1_AUX
+	;; Only tell PRU1 (io-interface-pru1.p), which sets the GPIOs.
+	SBCO r3, CONST_PRUDRAM, QUEUE_AUX_OFFSET, 4
+#else
+	CALL SetAuxBits
+#endif
+
 	;; queue_header processed, r1 is free to use
 	ADD r1, r2, SIZE(QueueHeader) ; r2 stays at queue pos
 	.assign TravelParameters, PARAM_START, PARAM_END, travel_params
 	LBCO travel_params, CONST_PRUDRAM, r1, SIZE(travel_params)
 
-	;; Set the Aux bits
-	MOV r3, travel_params.aux
-	CALL SetAuxBits
-
 	ZERO &mstate, SIZE(mstate)	; clear the motor states
 	ZERO &r3, 4			; initialize delay calculation state register.
 
 	;; STATUS REGISTER
 	;; ! We are assuming that writing the 4 bytes status register is atomic
 	;; and we guarantee that the bottom three bytes are all zero so we just need
-	;; to sum up the 3 loop counters. The upper bound of this sum will always be
-	;; less than 2^18, thus fit in the lower 24 bits allocated for it.
+	;; to sum up the 3 loop counters. The host guarantees that this sum is
+	;; less than 2^24, thus fits in the lower 24 bits allocated for it.
 	;; At each loop executed this counter is decreased of one unit.
-	ADD r28, r28, travel_params.loops_accel
-	ADD r28, r28, travel_params.loops_travel
-	ADD r28, r28, travel_params.loops_decel
+	ADD r29, r29, travel_params.loops_accel
+	ADD r29, r29, travel_params.loops_travel
+	ADD r29, r29, travel_params.loops_decel
 
-	MOV r0, 0 ; Status register address in PRU memory.
-	SBCO r28, CONST_PRUDRAM, r0, 4
+	SBCO r29, CONST_PRUDRAM, QUEUE_STATUS_OFFSET, 4
 
 	;; Registers
-	;; r0, r1 free for calculation
+	;; r0 = state of the segment, for WatchInput
+	;; r1 free for calculation
 	;; r2 = queue pos
 	;; r3 = state for CalculateDelay
 	;; scratch:           r4..r6
-	;; parameter:         r7..r19
-	;; motor-state:       r20..r27
-	;; status-variable:   r28
+	;; parameter:         r7..r20
+	;; motor-state:       r21..r28
+	;; status-variable:   r29
 	;; call/ret:          r30
 STEP_GEN:
 	;;
@@ -260,7 +394,10 @@ STEP_GEN:
 
 	CalculateDelay r1, travel_params, r3, r5, r6
 	QBEQ DONE_STEP_GEN, r1, 0       ; special value 0: all steps consumed.
+	WatchInput
 	UpdateQueueStatus
+	VelocityPWM
+	ScaleSpeed
 STEP_DELAY:				; Create time delay between steps.
 	SUB r1, r1, 1                   ; two cycles per loop.
 	QBNE STEP_DELAY, r1, 0
@@ -268,6 +405,10 @@ STEP_DELAY:				; Create time delay between steps.
 	JMP STEP_GEN
 
 DONE_STEP_GEN:
+	;; r1 has been used for the delay, so re-read the state of this slot
+	;; to know if the motion is supposed to continue.
+	LBCO r4.b0, CONST_PRUDRAM, r2, 1
+
 	;; We are done with instruction. Mark slot as empty...
 	MOV queue_header.state, STATE_EMPTY
 	SBCO queue_header.state, CONST_PRUDRAM, r2, 1
@@ -275,11 +416,21 @@ DONE_STEP_GEN:
 
 	;; Next position in ring buffer
 	ADD r2, r2, QUEUE_ELEMENT_SIZE
-	ADD r28.b3, r28.b3, 1                  ; add + 1 to the MSB byte
-	MOV r1, QUEUE_LEN * QUEUE_ELEMENT_SIZE ; end-of-queue
-	QBLT QUEUE_READ, r1, r2
+	ADD r29.b3, r29.b3, 1                  ; add + 1 to the MSB byte
+	MOV r1, QUEUE_END_OFFSET ; end-of-queue
+	QBLT CHECK_UNDERRUN, r1, r2
 	MOV r2, QUEUE_OFFSET
-	ZERO &r28, 4
+	ZERO &r29, 4
+
+CHECK_UNDERRUN:
+	;; If the motion should continue, but the host did not provide the
+	;; next segment in time, count an underrun.
+	QBBC QUEUE_READ, r4.b0, STATE_CONTINUED_BIT
+	LBCO r5.b0, CONST_PRUDRAM, r2, 1
+	QBNE QUEUE_READ, r5.b0, STATE_EMPTY
+	LBCO r5, CONST_PRUDRAM, QUEUE_UNDERRUN_OFFSET, 4
+	ADD r5, r5, 1
+	SBCO r5, CONST_PRUDRAM, QUEUE_UNDERRUN_OFFSET, 4
 	JMP QUEUE_READ
 
 FINISH:
@@ -23,49 +23,64 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <math.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <strings.h>
+
+#include <algorithm>
+#include <atomic>
 #include <deque>
 
+#if defined(__ARM_NEON__)
+#  include <arm_neon.h>
+#endif
+
+#include "common/container.h"
+#include "common/fd-mux.h"
+#include "common/latency-trace.h"
 #include "common/logging.h"
+#include "common/metrics.h"
 
 #include "motor-interface-constants.h"
 #include "motion-queue.h"
 #include "hardware-mapping.h"
-
-// We need two loops per motor step (edge up, edge down),
-// So we need to multiply step-counts by 2
-// This could be more, if we wanted to implement sub-step resolution with
-// more than one bit output per step (probably only with hand-built drivers).
-#define LOOPS_PER_STEP (1 << 1)
-
-// If we do more than these number of steps, the fixed point fraction
-// accumulate too much error.
-#define MAX_STEPS_PER_SEGMENT (65535 / LOOPS_PER_STEP)
+#include "segment-timing.h"
+
+// The PRU reports the remaining loops of the current segment in a 24 bit
+// counter, so that is the maximum we can do in one segment. The rounding
+// error of the fixed point fractions stays below one step in that range.
+#define MAX_STEPS_PER_SEGMENT (((1 << 24) - 1) / LOOPS_PER_STEP)
+
+// A dwell is sent as segment without steps that only spends time in the
+// travel phase, so that it is executed in line with the motion. Each of its
+// loops takes 0.1ms; longer dwells are split into several segments.
+#define DWELL_LOOP_CYCLES (TIMER_FREQUENCY / 10000)
+#define MAX_DWELL_LOOPS ((1 << 24) - 1)
+
+static MetricCounter motion_segments_metric(
+  "beagleg_motion_segments_total", "Motion segments sent to the queue.");
+static MetricGauge motion_backlog_metric(
+  "beagleg_motion_backlog_depth",
+  "Segments waiting in the host-side backlog for space in the queue.");
+static MetricCounter accel_cache_hits_metric(
+  "beagleg_accel_cache_hits_total",
+  "Acceleration ramps with pre-calculated constants.");
+static MetricCounter accel_cache_misses_metric(
+  "beagleg_accel_cache_misses_total",
+  "Acceleration ramps whose constants had to be calculated.");
 
 // TODO: don't store this singleton like, but keep in user_data of the MotorOperations
 static float hardware_frequency_limit_ = 1e6;    // Don't go over 1 Mhz
 
-static inline float sq(float x) { return x * x; }  // square a number
 static inline double sqd(double x) { return x * x; }  // square a number
-static inline int round2int(float x) { return (int) roundf(x); }
 
 // Clip speed to maximum we can reach with hardware.
 static float clip_hardware_frequency_limit(float v) {
   return v < hardware_frequency_limit_ ? v : hardware_frequency_limit_;
 }
 
-static float calcAccelerationCurveValueAt(int index, float acceleration) {
-  // counter_freq * sqrt(2 / accleration)
-  const float accel_factor = TIMER_FREQUENCY
-    * (sqrtf(LOOPS_PER_STEP * 2.0f / acceleration)) / LOOPS_PER_STEP;
-  // The approximation is pretty far off in the first step; adjust.
-  const float c0 = (index == 0) ? accel_factor * 0.67605f : accel_factor;
-  return c0 * (sqrtf(index + 1) - sqrtf(index));
-}
-
 #if 0
 // Is acceleration in acceptable range ?
 static char test_acceleration_ok(float acceleration) {
@@ -77,7 +92,7 @@ static char test_acceleration_ok(float acceleration) {
   // Also 2 additional bits headroom because we need to shift it by 2 in the
   // division.
   const float start_accel_cycle_value = (1 << (DELAY_CYCLE_SHIFT + 2))
-    * calcAccelerationCurveValueAt(0, acceleration);
+    * 0.67605f * CalcAccelerationFactor(acceleration);
   if (start_accel_cycle_value > 0xFFFFFFFF) {
     Log_error("Too slow acceleration to deal with. If really needed, "
               "reduce value of #define DELAY_CYCLE_SHIFT\n");
@@ -87,6 +102,97 @@ static char test_acceleration_ok(float acceleration) {
 }
 #endif
 
+// -- Per-motor kernels. These work on all MOTION_MOTOR_COUNT motors at
+// once; with NEON available, four motors per instruction.
+static_assert(MOTION_MOTOR_COUNT % 4 == 0, "Kernels work on 4 motors at a time");
+
+// For the fraction = delta * max_fraction / divisor of each motor we want
+// to avoid 64 bit divisions, which are a library call on the Cortex-A8.
+// With max_fraction = q * divisor + r, and delta <= divisor, this is
+//   delta * q + (delta * r) / divisor
+// with delta * r < divisor^2, which fits in 32 bit for divisors up to
+// MAX_KERNEL_DIVISOR. The remaining division is done by multiplying with the
+// reciprocal, which is at most two off; this is corrected afterwards. So the
+// result is exact. Longer segments are rare enough to take the 64 bit
+// division.
+#define MAX_KERNEL_DIVISOR 0xFFFF
+namespace {
+struct FractionDivider {
+  FractionDivider(uint32_t max_fraction, uint32_t d)
+    : q(max_fraction / d), r(max_fraction % d), divisor(d),
+      reciprocal(d > 1 ? (uint32_t)((1ULL << 32) / d) : 0xFFFFFFFF) {}
+  const uint32_t q, r, divisor, reciprocal;
+};
+}
+
+// Set direction bits for all motors with negative steps, and store the
+// absolute number of steps in "delta".
+static uint32_t CalcNegativeMotors(const int *steps, uint32_t *delta) {
+#if defined(__ARM_NEON__)
+  static const uint32_t kBits[4] = { 1, 2, 4, 8 };
+  const uint32x4_t bits = vld1q_u32(kBits);
+  uint32x4_t negative_bits = vdupq_n_u32(0);
+  for (int i = 0; i < MOTION_MOTOR_COUNT; i += 4) {
+    const int32x4_t s = vld1q_s32(steps + i);
+    const uint32x4_t is_negative = vcltq_s32(s, vdupq_n_s32(0));
+    negative_bits = vorrq_u32(negative_bits,
+                              vshlq_u32(vandq_u32(is_negative, bits),
+                                        vdupq_n_s32(i)));
+    vst1q_u32(delta + i, vreinterpretq_u32_s32(vabsq_s32(s)));
+  }
+  const uint32x2_t folded = vorr_u32(vget_low_u32(negative_bits),
+                                     vget_high_u32(negative_bits));
+  return vget_lane_u32(folded, 0) | vget_lane_u32(folded, 1);
+#else
+  uint32_t negative_bits = 0;
+  for (int i = 0; i < MOTION_MOTOR_COUNT; ++i) {
+    if (steps[i] < 0) negative_bits |= (1 << i);
+    delta[i] = abs(steps[i]);
+  }
+  return negative_bits;
+#endif
+}
+
+static void CalcFractions(const FractionDivider &d, const uint32_t *delta,
+                          uint32_t *fractions) {
+  if (d.divisor > MAX_KERNEL_DIVISOR) {
+    for (int i = 0; i < MOTION_MOTOR_COUNT; ++i) {
+      fractions[i] = delta[i] * d.q
+        + (uint32_t)((uint64_t)delta[i] * d.r / d.divisor);
+    }
+    return;
+  }
+#if defined(__ARM_NEON__)
+  const uint32x4_t q = vdupq_n_u32(d.q);
+  const uint32x4_t r = vdupq_n_u32(d.r);
+  const uint32x4_t divisor = vdupq_n_u32(d.divisor);
+  const uint32x2_t reciprocal = vdup_n_u32(d.reciprocal);
+  for (int i = 0; i < MOTION_MOTOR_COUNT; i += 4) {
+    const uint32x4_t dl = vld1q_u32(delta + i);
+    const uint32x4_t x = vmulq_u32(dl, r);
+    uint32x4_t quot =
+      vcombine_u32(vshrn_n_u64(vmull_u32(vget_low_u32(x), reciprocal), 32),
+                   vshrn_n_u64(vmull_u32(vget_high_u32(x), reciprocal), 32));
+    uint32x4_t rem = vmlsq_u32(x, quot, divisor);
+    uint32x4_t too_low = vcgeq_u32(rem, divisor);   // all ones if true.
+    quot = vsubq_u32(quot, too_low);
+    rem = vsubq_u32(rem, vandq_u32(too_low, divisor));
+    too_low = vcgeq_u32(rem, divisor);
+    quot = vsubq_u32(quot, too_low);
+    vst1q_u32(fractions + i, vmlaq_u32(quot, dl, q));
+  }
+#else
+  for (int i = 0; i < MOTION_MOTOR_COUNT; ++i) {
+    const uint32_t x = delta[i] * d.r;
+    uint32_t quot = ((uint64_t)x * d.reciprocal) >> 32;
+    uint32_t rem = x - quot * d.divisor;
+    if (rem >= d.divisor) { ++quot; rem -= d.divisor; }
+    if (rem >= d.divisor) { ++quot; }
+    fractions[i] = delta[i] * d.q + quot;
+  }
+#endif
+}
+
 // Used to keep track of useful attributes of a motion segment's target move.
 struct HistoryPositionInfo {
   HistoryPositionInfo () : position_steps(0), sign(1) {}
@@ -100,53 +206,230 @@ struct HistoryPositionInfo {
 struct MotionQueueMotorOperations::HistorySegment {
   HistoryPositionInfo pos_info[MOTION_MOTOR_COUNT];
   unsigned short aux_bits;
+  uint32_t loops;     // Total loops of the segment and the time these take.
+  float seconds;
+};
+
+// Acceleration factors of the few accelerations typically used in a job,
+// keyed by the acceleration the planner passes along with the segments.
+// The pre-calculated ones are derived from the configuration in a slightly
+// different way, so we accept a tiny relative difference.
+struct MotionQueueMotorOperations::AccelerationCache {
+  AccelerationCache() : next(0) {
+    for (int i = 0; i < ACCEL_CACHE_SIZE; ++i) acceleration[i] = -1;
+  }
+
+  float Lookup(float accel) {
+    const float tolerance = accel * 1e-5f;
+    for (int i = 0; i < ACCEL_CACHE_SIZE; ++i) {
+      if (fabsf(acceleration[i] - accel) <= tolerance) {
+        accel_cache_hits_metric.Increment();
+        return factor[i];
+      }
+    }
+    accel_cache_misses_metric.Increment();
+    return Insert(accel);
+  }
+
+  float Insert(float accel) {
+    const int slot = next;
+    next = (next + 1) % ACCEL_CACHE_SIZE;
+    acceleration[slot] = accel;
+    factor[slot] = CalcAccelerationFactor(accel);
+    return factor[slot];
+  }
+
+  float acceleration[ACCEL_CACHE_SIZE];
+  float factor[ACCEL_CACHE_SIZE];
+  int next;   // Round-robin replacement.
+};
+
+// Enough for all segments that can be pending in the PRU and the backlog,
+// plus the position we're at when everything is executed.
+enum {
+  SHADOW_QUEUE_SIZE = QUEUE_LEN + MOTION_BACKLOG_SIZE + 2
+};
+// The history is read by GetPhysicalStatus(), which might be called from
+// a different thread than the one enqueuing segments.
+struct MotionQueueMotorOperations::ShadowQueue {
+  ShadowQueue() { pthread_mutex_init(&lock, NULL); }
+  ~ShadowQueue() { pthread_mutex_destroy(&lock); }
+
+  RingDeque<HistorySegment, SHADOW_QUEUE_SIZE + 1> history;
+  pthread_mutex_t lock;
+};
+
+// Segments not yet accepted by the backend.
+struct MotionQueueMotorOperations::Backlog {
+  RingDeque<MotionSegment, MOTION_BACKLOG_SIZE + 1> segments;
+};
+
+// Actions are due once the backend executed all the segments that were sent
+// before the action was queued. Segments are counted when sent; the number
+// executed is what is sent minus what is still pending.
+struct MotionQueueMotorOperations::PendingActions {
+  PendingActions() : segments_sent(0) {
+    pthread_mutex_init(&lock, NULL);
+    pthread_mutex_init(&run_lock, NULL);
+  }
+  ~PendingActions() {
+    pthread_mutex_destroy(&run_lock);
+    pthread_mutex_destroy(&lock);
+  }
+
+  struct Action {
+    uint64_t after_segments;
+    std::function<void()> run;
+  };
+  std::atomic<uint64_t> segments_sent;
+  std::deque<Action> actions;
+  pthread_mutex_t lock;
+  pthread_mutex_t run_lock;   // Held while actions are run to keep order.
 };
 
 MotionQueueMotorOperations::
 MotionQueueMotorOperations(HardwareMapping *hw, MotionQueue *backend)
   : hardware_mapping_(hw),
     backend_(backend),
-    shadow_queue_(new std::deque<struct HistorySegment>()) {
+    shadow_queue_(new ShadowQueue()),
+    backlog_(NULL), backlog_size_(0), s_curve_(false),
+    velocity_pwm_full_ticks_(0), velocity_pwm_duty_(0),
+    accel_cache_(new AccelerationCache()),
+    pending_actions_(new PendingActions()) {
   // Initialize the history queue.
-  shadow_queue_->push_front({});
+  *shadow_queue_->history.append() = {};
 }
 
 MotionQueueMotorOperations::~MotionQueueMotorOperations() {
+  delete pending_actions_;
+  delete accel_cache_;
+  delete backlog_;
   delete shadow_queue_;
 }
 
-void MotionQueueMotorOperations::EnqueueInternal(const LinearSegmentSteps &param,
-                                                 int defining_axis_steps) {
-  struct MotionSegment new_element = {};
-  new_element.direction_bits = 0;
+void MotionQueueMotorOperations::PrecomputeAcceleration(float steps_per_s2) {
+  if (steps_per_s2 > 0) accel_cache_->Lookup(steps_per_s2);
+}
 
-  // The new segment is based on the previous position.
-  struct HistorySegment history_segment = shadow_queue_->front();
+bool MotionQueueMotorOperations::FeedFromEventLoop(FDMultiplexer *event_loop,
+                                                   int low_watermark) {
+  const int fd = backend_->EventFd();
+  if (fd < 0)
+    return false;
+  if (!backlog_) backlog_ = new Backlog();
+  event_loop->RunOnReadable(fd, [this, low_watermark]() {
+      backend_->AcknowledgeEvent();
+      if (backend_->GetPendingElements(NULL) < low_watermark)
+        FeedBacklog(false);
+      RunDueActions();
+      return true;
+    });
+  return true;
+}
 
+// Send segments from the backlog to the backend, either until the backend
+// is full, or, if "may_block", until the backlog is empty.
+void MotionQueueMotorOperations::FeedBacklog(bool may_block) {
+  while (backlog_->segments.size() > 0) {
+    MotionSegment *segment = backlog_->segments[0];
+    if (may_block)
+      backend_->Enqueue(segment);
+    else if (!backend_->TryEnqueue(segment))
+      break;
+    backlog_->segments.pop_front();
+  }
+  backlog_size_ = backlog_->segments.size();
+  motion_backlog_metric.Set(backlog_size_);
+}
+
+void MotionQueueMotorOperations::SendToBackend(MotionSegment *segment) {
+  motion_segments_metric.Increment();
+  pending_actions_->segments_sent++;
+  if (!backlog_) {
+    backend_->Enqueue(segment);
+    return;
+  }
+  // Keep order: only bypass the backlog if it is empty.
+  if (backlog_->segments.size() == 0 && backend_->TryEnqueue(segment))
+    return;
+  if (backlog_->segments.size() >= MOTION_BACKLOG_SIZE) {
+    // Nowhere to put it; we have to wait for the backend.
+    backend_->Enqueue(backlog_->segments[0]);
+    backlog_->segments.pop_front();
+  }
+  *backlog_->segments.append() = *segment;
+  backlog_size_ = backlog_->segments.size();
+  motion_backlog_metric.Set(backlog_size_);
+}
+
+// Called after the corresponding segment has been sent, so that the
+// history always matches what the backend reports as pending.
+void MotionQueueMotorOperations::PushHistory(const HistorySegment &segment) {
+  const int pending = PendingElements();
+  pthread_mutex_lock(&shadow_queue_->lock);
+  // If some backend has more elements pending than we expect, we lose the
+  // oldest. Not accurate, but better than not accepting new ones.
+  if (shadow_queue_->history.size() == SHADOW_QUEUE_SIZE)
+    shadow_queue_->history.pop_front();
+  *shadow_queue_->history.append() = segment;
+  TrimHistory(pending);
+  pthread_mutex_unlock(&shadow_queue_->lock);
+}
+
+// Drop the segments that have been executed already. The oldest remaining
+// is the one currently executing (or, if all is done, the last one).
+// Needs to be called with the shadow queue lock held.
+void MotionQueueMotorOperations::TrimHistory(int pending) {
+  const int keep = pending > 0 ? pending : 1;
+  while ((int)shadow_queue_->history.size() > keep)
+    shadow_queue_->history.pop_front();
+}
+
+// Elements we sent, but that have not been executed yet: these are the
+// ones we need to keep in the shadow queue.
+int MotionQueueMotorOperations::PendingElements() {
+  return backend_->GetPendingElements(NULL)
+    + backlog_size_;
+}
+
+// Set the fractions and directions of "element" and the resulting position
+// in "history" for the steps of "param". Timing is up to the caller.
+void MotionQueueMotorOperations::SetSegmentSteps(const LinearSegmentSteps &param,
+                                                 int defining_axis_steps,
+                                                 MotionSegment *element,
+                                                 HistorySegment *history) {
   // The defining_axis_steps is the number of steps of the axis that requires
   // the most number of steps. All the others are a fraction of the steps.
   //
   // The top bits have LOOPS_PER_STEP states (2 is the minium, as we need two
   // cycles for a 0 1 transition. So in that case we have 31 bit fraction
   // and 1 bit that overflows and toggles for the steps we want to generate.
-  const uint64_t max_fraction = 0xFFFFFFFF / LOOPS_PER_STEP;
+  const uint32_t max_fraction = 0xFFFFFFFF / LOOPS_PER_STEP;
+  uint32_t delta[MOTION_MOTOR_COUNT];
+  uint32_t fractions[MOTION_MOTOR_COUNT];
+  const uint32_t negative_bits = CalcNegativeMotors(param.steps, delta);
+  CalcFractions(FractionDivider(max_fraction, defining_axis_steps),
+                delta, fractions);
+  uint32_t flip_bits = 0;
   for (int i = 0; i < MOTION_MOTOR_COUNT; ++i) {
-    bool flip = hardware_mapping_->IsMotorFlipped(i);
-    if (param.steps[i] < 0) {
-      if (!flip) new_element.direction_bits |= (1 << i);
-      history_segment.pos_info[i].sign = -1;
-    } else {
-      if (flip) new_element.direction_bits |= (1 << i);
-      history_segment.pos_info[i].sign = 1;
-    }
-    history_segment.pos_info[i].position_steps += param.steps[i];
-    const uint64_t delta = abs(param.steps[i]);
-    new_element.fractions[i] = delta * max_fraction / defining_axis_steps;
-    history_segment.pos_info[i].fraction = new_element.fractions[i];
+    if (hardware_mapping_->IsMotorFlipped(i)) flip_bits |= (1 << i);
+    HistoryPositionInfo &pos_info = history->pos_info[i];
+    pos_info.sign = (negative_bits & (1 << i)) ? -1 : 1;
+    pos_info.position_steps += param.steps[i];
+    pos_info.fraction = element->fractions[i] = fractions[i];
   }
+  element->direction_bits = negative_bits ^ flip_bits;
+  history->aux_bits = param.aux_bits;
+}
 
-  history_segment.aux_bits = param.aux_bits;
-  shadow_queue_->push_front(history_segment);
+void MotionQueueMotorOperations::EnqueueInternal(const LinearSegmentSteps &param,
+                                                 int defining_axis_steps) {
+  LATENCY_TRACE_START(trace_start);
+  struct MotionSegment new_element = {};
+
+  // The new segment is based on the previous position.
+  struct HistorySegment history_segment = *shadow_queue_->history.back();
+  SetSegmentSteps(param, defining_axis_steps, &new_element, &history_segment);
 
   // TODO: clamp acceleration to be a minimum value.
   const int total_loops = LOOPS_PER_STEP * defining_axis_steps;
@@ -156,75 +439,133 @@ void MotionQueueMotorOperations::EnqueueInternal(const LinearSegmentSteps &param
     new_element.loops_accel = new_element.loops_decel = 0;
     new_element.loops_travel = total_loops;
     const float travel_speed = clip_hardware_frequency_limit(param.v0);
-    new_element.travel_delay_cycles = round2int(TIMER_FREQUENCY / (LOOPS_PER_STEP * travel_speed));
-  } else if (param.v0 < param.v1) {
-    // acclereate
-    new_element.loops_travel = new_element.loops_decel = new_element.travel_delay_cycles = 0;
-    new_element.loops_accel = total_loops;
-
-    // v1 = v0 + a*t -> t = (v1 - v0)/a
-    // s = a/2 * t^2 + v0 * t; subsitution t from above.
-    // a = (v1^2-v0^2)/(2*s)
-    float acceleration = (sq(param.v1) - sq(param.v0)) / (2.0f * defining_axis_steps);
-    //fprintf(stderr, "M-OP HZ: defining=%d ; accel=%.2f\n", defining_axis_steps, acceleration);
-    // If we accelerated from zero to our first speed, this is how many steps
-    // we needed. We need to go this index into our taylor series.
-    const int accel_loops_from_zero =
-      round2int(LOOPS_PER_STEP * (sq(param.v0 - 0) / (2.0f * acceleration)));
-
-    new_element.accel_series_index = accel_loops_from_zero;
-    new_element.hires_accel_cycles =
-      round2int((1 << DELAY_CYCLE_SHIFT) * calcAccelerationCurveValueAt(new_element.accel_series_index, acceleration));
-  } else {  // v0 > v1
-    // decelerate
-    new_element.loops_travel = new_element.loops_accel = new_element.travel_delay_cycles = 0;
-    new_element.loops_decel = total_loops;
-
-    float acceleration = (sq(param.v0) - sq(param.v1)) / (2.0f * defining_axis_steps);
-    //fprintf(stderr, "M-OP HZ: defining=%d ; decel=%.2f\n", defining_axis_steps, acceleration);
-    // We are into the taylor sequence this value up and reduce from there.
-    const int accel_loops_from_zero =
-      round2int(LOOPS_PER_STEP * (sq(param.v0 - 0) / (2.0f * acceleration)));
-
-    new_element.accel_series_index = accel_loops_from_zero;
-    new_element.hires_accel_cycles =
-      round2int((1 << DELAY_CYCLE_SHIFT) * calcAccelerationCurveValueAt(new_element.accel_series_index, acceleration));
+#if BEAGLEG_FIXED_POINT_TIMING
+    new_element.travel_delay_cycles = CalcTravelDelayCyclesFixed(travel_speed);
+#else
+    new_element.travel_delay_cycles = CalcTravelDelayCycles(travel_speed);
+#endif
+  } else {
+    new_element.loops_travel = new_element.travel_delay_cycles = 0;
+    if (param.v0 < param.v1) {
+      new_element.loops_accel = total_loops;
+      new_element.loops_decel = 0;
+    } else {
+      // When decelerating, we are into the taylor sequence this value up
+      // and reduce from there.
+      new_element.loops_accel = 0;
+      new_element.loops_decel = total_loops;
+    }
+#if BEAGLEG_FIXED_POINT_TIMING
+    const RampTiming ramp = CalcRampTimingFixed(param.v0, param.v1,
+                                                defining_axis_steps);
+#else
+    // With the planned acceleration, the ramp ends within half a step of
+    // the defining axis of where the planner's rounding of steps put it.
+    const float acceleration = (param.acceleration > 0)
+      ? param.acceleration
+      : CalcRampAcceleration(param.v0, param.v1, defining_axis_steps);
+    const float accel_factor = (param.acceleration > 0)
+      ? accel_cache_->Lookup(acceleration)
+      : CalcAccelerationFactor(acceleration);
+    const RampTiming ramp = CalcRampTiming(param.v0, acceleration,
+                                           accel_factor);
+#endif
+    new_element.accel_series_index = ramp.accel_series_index;
+    new_element.hires_accel_cycles = ramp.hires_accel_cycles;
   }
 
+  history_segment.loops = total_loops;
+  history_segment.seconds = (param.v0 + param.v1 > 0)
+    ? 2.0f * defining_axis_steps / (param.v0 + param.v1)
+    : 0;
+
   new_element.aux = param.aux_bits;
   new_element.state = STATE_FILLED;
+  if (param.v1 > 0) new_element.state |= (1 << STATE_CONTINUED_BIT);
+  if (velocity_pwm_full_ticks_ > 0) {
+    // The duty ticks at the requested feed are scaled by the PRU with the
+    // actual speed; at constant speed, we can do that right here.
+    const float feed = param.v_feed > 0 ? param.v_feed
+      : std::max(param.v0, param.v1);
+    const float ticks = (feed > 0)
+      ? velocity_pwm_duty_ * velocity_pwm_full_ticks_ : 0;
+    new_element.state |= (1 << STATE_VELOCITY_PWM_BIT);
+    if (param.v0 == param.v1) {
+      new_element.state |= (1 << STATE_CONSTANT_PWM_BIT);
+      new_element.hires_accel_cycles = ticks * std::min(param.v0 / feed, 1.0f);
+    } else {
+      const double scaled_ticks = (double)ticks
+        * CalcTravelDelayCycles(clip_hardware_frequency_limit(feed));
+      new_element.travel_delay_cycles = std::min(scaled_ticks,
+                                                 (double)UINT32_MAX);
+    }
+  }
   backend_->MotorEnable(true);
-  backend_->Enqueue(&new_element);
+  LATENCY_TRACE_END(LATENCY_SEGMENT, trace_start);
+  SendToBackend(&new_element);
+  PushHistory(history_segment);
 }
 
+// Steps a motor with the given fraction does in "loops". Let's round-up the
+// division, 5.1 is still a toggle, so it's 6 loops.
+static int StepsInLoops(uint64_t loops, uint32_t fraction) {
+  const uint64_t max_fraction = 0xFFFFFFFF / LOOPS_PER_STEP;
+  return (loops / LOOPS_PER_STEP * fraction + max_fraction - 1) / max_fraction;
+}
+
+// This only reads the history, so that it is cheap and can be called from
+// another thread while segments are enqueued.
 bool MotionQueueMotorOperations::GetPhysicalStatus(PhysicalStatus *status) {
-  // Shrink the queue
   uint32_t loops;
-  const int buffer_size = backend_->GetPendingElements(&loops);
-  const int new_size = buffer_size > 0 ? buffer_size : 1;
-  shadow_queue_->resize(new_size);
-
-  // Get the last element
-  const HistorySegment &hs = shadow_queue_->back();
-  const uint64_t max_fraction = 0xFFFFFFFF / LOOPS_PER_STEP;
+  const int pending = backend_->GetPendingElements(&loops)
+    + backlog_size_;
+
+  // The newest 'pending' elements are not done yet; the oldest of these is
+  // the one currently executing.
+  pthread_mutex_lock(&shadow_queue_->lock);
+  const int size = shadow_queue_->history.size();
+  int index = (pending > 0) ? size - pending : size - 1;
+  if (index < 0) index = 0;
+  const HistorySegment hs = *shadow_queue_->history[index];
+  pthread_mutex_unlock(&shadow_queue_->lock);
 
   // NOTE: Assuming MOTION_MOTOR_COUNT == BEAGLEG_NUM_MOTORS
-  uint64_t steps;
   for (int i = 0; i < MOTION_MOTOR_COUNT; ++i) {
     const HistoryPositionInfo pos_info = hs.pos_info[i];
-    // Let's round-up the division, 5.1 is still a toggle, so it's 6 loops.
-    steps = loops / LOOPS_PER_STEP;
-    steps *= pos_info.fraction;
-    steps += max_fraction - 1;
-    steps /= max_fraction;
-    status->pos_steps[i] = pos_info.position_steps - pos_info.sign * (int) steps;
+    status->pos_steps[i] = pos_info.position_steps
+      - pos_info.sign * StepsInLoops(loops, pos_info.fraction);
   }
   status->aux_bits = hs.aux_bits;
   return true;
 }
 
+bool MotionQueueMotorOperations::GetQueuedSeconds(float *seconds) {
+  uint32_t loops;
+  const int pending = backend_->GetPendingElements(&loops)
+    + backlog_size_;
+
+  // Same as in GetPhysicalStatus(): the oldest pending one is executing and
+  // has "loops" left.
+  pthread_mutex_lock(&shadow_queue_->lock);
+  const int size = shadow_queue_->history.size();
+  int index = (pending > 0) ? size - pending : size - 1;
+  if (index < 0) index = 0;
+  const HistorySegment *current = shadow_queue_->history[index];
+  float result = 0;
+  if (current->loops > 0 && loops <= current->loops)
+    result = current->seconds * loops / current->loops;
+  for (int i = index + 1; i < size; ++i) {
+    result += shadow_queue_->history[i]->seconds;
+  }
+  pthread_mutex_unlock(&shadow_queue_->lock);
+  *seconds = result;
+  return true;
+}
+
 void MotionQueueMotorOperations::SetExternalPosition(int axis, int steps) {
-  struct HistorySegment history_segment = shadow_queue_->front();
+  struct HistorySegment history_segment = *shadow_queue_->history.back();
+  history_segment.loops = 0;   // Not a segment to execute.
+  history_segment.seconds = 0;
   if (steps < 0) {
     history_segment.pos_info[axis].sign = -1;
     history_segment.pos_info[axis].position_steps = -steps;
@@ -232,14 +573,7 @@ void MotionQueueMotorOperations::SetExternalPosition(int axis, int steps) {
     history_segment.pos_info[axis].sign = 1;
     history_segment.pos_info[axis].position_steps = steps;
   }
-  shadow_queue_->push_front(history_segment);
-  // Shrink the queue and remove the elements that we are not interested
-  // in anymore.
-  // TODO: We need to find a way to get the maximum number of elements
-  // of the shadow queue (ie backend_->GetQueueStats()?)
-  const int buffer_size = backend_->GetPendingElements(NULL);
-  const int new_size = buffer_size > 0 ? buffer_size : 1;
-  shadow_queue_->resize(new_size);
+  PushHistory(history_segment);
 }
 
 static int get_defining_axis_steps(const LinearSegmentSteps &param) {
@@ -255,19 +589,73 @@ static int get_defining_axis_steps(const LinearSegmentSteps &param) {
 void MotionQueueMotorOperations::Enqueue(const LinearSegmentSteps &param) {
   const int defining_axis_steps = get_defining_axis_steps(param);
 
+  if (s_curve_ && param.v0 != param.v1
+      && defining_axis_steps >= S_CURVE_MIN_STEPS) {
+    EnqueueSCurve(param, defining_axis_steps);
+  } else {
+    EnqueueRamp(param, defining_axis_steps);
+  }
+  RunDueActions();
+}
+
+// Split the ramp into S_CURVE_PIECES of equal duration. Over the
+// normalized time t = 0..1 of the ramp, the speed follows
+//   v(t) = v0 + dv * (3t^2 - 2t^3)
+// so the acceleration starts and ends at zero. Integrating gives the
+// distance traveled, which, as fraction of the whole ramp, is
+//   f(t) = (v0 * t + dv * (t^3 - t^4 / 2)) / (v0 + dv / 2)
+void MotionQueueMotorOperations::EnqueueSCurve(const LinearSegmentSteps &param,
+                                               int defining_axis_steps) {
+  const double v0 = param.v0;
+  const double dv = (double)param.v1 - param.v0;
+  const double total = v0 + dv / 2;
+
+  LinearSegmentSteps piece;
+  piece.aux_bits = param.aux_bits;
+  piece.v_feed = param.v_feed;
+  piece.acceleration = 0;  // Changes from piece to piece.
+  int done_steps[BEAGLEG_NUM_MOTORS] = {0};
+  double previous_speed = param.v0;
+  for (int p = 1; p <= S_CURVE_PIECES; ++p) {
+    const double t = (double) p / S_CURVE_PIECES;
+    const double fraction = (p == S_CURVE_PIECES)
+      ? 1.0
+      : (v0 * t + dv * (t*t*t - t*t*t*t / 2)) / total;
+    bool is_last = true;   // If nothing remains after this piece.
+    for (int i = 0; i < BEAGLEG_NUM_MOTORS; ++i) {
+      const int target = (int) round(param.steps[i] * fraction);
+      piece.steps[i] = target - done_steps[i];
+      done_steps[i] = target;
+      if (target != param.steps[i]) is_last = false;
+    }
+    const int piece_steps = get_defining_axis_steps(piece);
+    if (piece_steps == 0)
+      continue;  // Rounded away; the next piece takes the speed change.
+    piece.v0 = previous_speed;
+    piece.v1 = is_last ? param.v1 : v0 + dv * (3*t*t - 2*t*t*t);
+    EnqueueRamp(piece, piece_steps);
+    if (is_last)
+      break;
+    previous_speed = piece.v1;
+  }
+}
+
+void MotionQueueMotorOperations::EnqueueRamp(const LinearSegmentSteps &param,
+                                             int defining_axis_steps) {
   if (defining_axis_steps == 0) {
     // The new segment is based on the previous position.
-    struct HistorySegment history_segment = shadow_queue_->front();
+    struct HistorySegment history_segment = *shadow_queue_->history.back();
 
     // No move, but we still have to set the bits.
     struct MotionSegment empty_element = {};
     empty_element.aux = param.aux_bits;
     empty_element.state = STATE_FILLED;
+    SendToBackend(&empty_element);
 
     history_segment.aux_bits = param.aux_bits;
-    shadow_queue_->push_front(history_segment);
-
-    backend_->Enqueue(&empty_element);
+    history_segment.loops = 0;
+    history_segment.seconds = 0;
+    PushHistory(history_segment);
   }
   else if (defining_axis_steps > MAX_STEPS_PER_SEGMENT) {
     // We have more steps that we can enqueue in one chunk, so let's cut
@@ -285,6 +673,8 @@ void MotionQueueMotorOperations::Enqueue(const LinearSegmentSteps &param) {
     double previous_speed = param.v0;   // speed calculation in double
 
     output.aux_bits = param.aux_bits;  // use the original Aux bits for all segments
+    output.v_feed = param.v_feed;
+    output.acceleration = param.acceleration;
     for (int d = 0; d < divisions; ++d) {
       for (int i = 0; i < BEAGLEG_NUM_MOTORS; ++i) {
         hires_step_accumulator[i] += hires_steps_per_div[i];
@@ -310,20 +700,196 @@ void MotionQueueMotorOperations::Enqueue(const LinearSegmentSteps &param) {
   } else {
     EnqueueInternal(param, defining_axis_steps);
   }
-  // Shrink the queue and remove the elements that we are not interested
-  // in anymore.
-  // TODO: We need to find a way to get the maximum number of elements
-  // of the shadow queue (ie backend_->GetQueueStats()?)
-  const int buffer_size = backend_->GetPendingElements(NULL);
-  const int new_size = buffer_size > 0 ? buffer_size : 1;
-  shadow_queue_->resize(new_size);
 }
 
 void MotionQueueMotorOperations::MotorEnable(bool on) {
+  if (backlog_) FeedBacklog(true);
   backend_->WaitQueueEmpty();
+  RunDueActions();
   backend_->MotorEnable(on);
 }
 
 void MotionQueueMotorOperations::WaitQueueEmpty() {
+  if (backlog_) FeedBacklog(true);
   backend_->WaitQueueEmpty();
+  RunDueActions();
+}
+
+void MotionQueueMotorOperations::Dwell(float milliseconds) {
+  int64_t loops = llroundf(milliseconds * (TIMER_FREQUENCY / 1000.0f)
+                           / DWELL_LOOP_CYCLES);
+  if (loops <= 0) {
+    WaitQueueEmpty();  // G4 P0 is used to wait for the machine to stop.
+    return;
+  }
+
+  // Standing still at the end of the previous segment.
+  struct HistorySegment history_segment = *shadow_queue_->history.back();
+  for (int i = 0; i < MOTION_MOTOR_COUNT; ++i)
+    history_segment.pos_info[i].fraction = 0;
+
+  while (loops > 0) {
+    struct MotionSegment dwell_element = {};
+    dwell_element.loops_travel = std::min(loops, (int64_t)MAX_DWELL_LOOPS);
+    dwell_element.travel_delay_cycles = DWELL_LOOP_CYCLES;
+    dwell_element.aux = history_segment.aux_bits;
+    dwell_element.state = STATE_FILLED | (1 << STATE_FIXED_TIME_BIT);
+    SendToBackend(&dwell_element);
+    history_segment.loops = dwell_element.loops_travel;
+    history_segment.seconds = (float)dwell_element.loops_travel
+      * DWELL_LOOP_CYCLES / TIMER_FREQUENCY;
+    PushHistory(history_segment);
+    loops -= dwell_element.loops_travel;
+  }
+}
+
+// The whole move is a single segment with acceleration, travel and
+// deceleration, so that the PRU can cut it short at any point once the
+// input triggers: it then decelerates for as many loops as it accelerated.
+bool MotionQueueMotorOperations::MoveUntilInput(const LinearSegmentSteps &param,
+                                                float acceleration,
+                                                uint32_t gpio_def, bool level,
+                                                int *trigger_steps,
+                                                int *total_steps) {
+  WaitQueueEmpty();  // The watch applies to the next segment.
+  if (!backend_->WatchInput(gpio_def, level))
+    return false;
+
+  LinearSegmentSteps move = param;
+  int steps = get_defining_axis_steps(move);
+  if (steps > MAX_STEPS_PER_SEGMENT) {
+    for (int i = 0; i < BEAGLEG_NUM_MOTORS; ++i)
+      move.steps[i] = (int64_t)move.steps[i] * MAX_STEPS_PER_SEGMENT / steps;
+    steps = get_defining_axis_steps(move);
+  }
+  *trigger_steps = -1;
+  *total_steps = 0;
+  if (steps == 0)
+    return true;
+
+  float speed = clip_hardware_frequency_limit(move.v1);
+  int ramp_steps = 0;
+  if (acceleration > 0) {
+    ramp_steps = (int) ceilf(speed * speed / (2 * acceleration));
+    if (2 * ramp_steps > steps) {
+      // Not enough room to reach full speed.
+      ramp_steps = steps / 2;
+      speed = sqrtf(2 * acceleration * ramp_steps);
+    }
+  }
+
+  struct MotionSegment new_element = {};
+  struct HistorySegment history_segment = *shadow_queue_->history.back();
+  SetSegmentSteps(move, steps, &new_element, &history_segment);
+  const uint32_t total_loops = LOOPS_PER_STEP * steps;
+  new_element.loops_accel = new_element.loops_decel
+    = LOOPS_PER_STEP * ramp_steps;
+  new_element.loops_travel = total_loops - 2 * new_element.loops_accel;
+#if BEAGLEG_FIXED_POINT_TIMING
+  new_element.travel_delay_cycles = CalcTravelDelayCyclesFixed(speed);
+#else
+  new_element.travel_delay_cycles = CalcTravelDelayCycles(speed);
+#endif
+  if (ramp_steps > 0) {
+#if BEAGLEG_FIXED_POINT_TIMING
+    const RampTiming ramp = CalcRampTimingFixed(0, speed, ramp_steps);
+#else
+    const float ramp_accel = CalcRampAcceleration(0, speed, ramp_steps);
+    const RampTiming ramp = CalcRampTiming(0, ramp_accel,
+                                           CalcAccelerationFactor(ramp_accel));
+#endif
+    new_element.accel_series_index = ramp.accel_series_index;
+    new_element.hires_accel_cycles = ramp.hires_accel_cycles;
+  }
+  history_segment.loops = total_loops;
+  history_segment.seconds = (float)(steps + 2 * ramp_steps) / speed;
+
+  new_element.aux = move.aux_bits;
+  new_element.state = STATE_FILLED | (1 << STATE_WATCH_INPUT_BIT);
+  backend_->MotorEnable(true);
+  SendToBackend(&new_element);
+  PushHistory(history_segment);
+  WaitQueueEmpty();
+
+  uint32_t loops_left, stop_loops;
+  if (!backend_->GetInputTrigger(&loops_left, &stop_loops)) {
+    *total_steps = steps;
+    return true;
+  }
+  const uint32_t trigger_loops = total_loops - std::min(loops_left, total_loops);
+  const uint32_t stopped_loops = std::min(trigger_loops + stop_loops,
+                                          total_loops);
+  *trigger_steps = trigger_loops / LOOPS_PER_STEP;
+  *total_steps = stopped_loops / LOOPS_PER_STEP;
+
+  // We didn't get to the end of the segment; correct the position by what
+  // was left out.
+  history_segment.loops = 0;
+  history_segment.seconds = 0;
+  for (int i = 0; i < MOTION_MOTOR_COUNT; ++i) {
+    HistoryPositionInfo &pos_info = history_segment.pos_info[i];
+    pos_info.position_steps -= pos_info.sign
+      * StepsInLoops(total_loops - stopped_loops, pos_info.fraction);
+  }
+  PushHistory(history_segment);
+  return true;
+}
+
+bool MotionQueueMotorOperations::FeedHold(bool hold, float ramp_seconds) {
+  return backend_->FeedHold(hold, ramp_seconds);
+}
+
+bool MotionQueueMotorOperations::IsHeld() {
+  return backend_->IsHeld();
+}
+
+bool MotionQueueMotorOperations::SetVelocityPWM(float duty) {
+  if (duty > 0 || !velocity_pwm_full_ticks_) {
+    // (Re-)start the PWM; it might have been stopped with the spindle.
+    uint32_t full_ticks;
+    if (!backend_->EnableVelocityPWM(&full_ticks))
+      return false;
+    velocity_pwm_full_ticks_ = full_ticks;
+  }
+  velocity_pwm_duty_ = std::min(std::max(duty, 0.0f), 1.0f);
+  return true;
+}
+
+bool MotionQueueMotorOperations::SetSpeedOverride(float factor,
+                                                  float ramp_seconds) {
+  return backend_->SetSpeedOverride(factor, ramp_seconds);
+}
+
+void MotionQueueMotorOperations::
+RunAtQueuePosition(const std::function<void()> &action) {
+  pthread_mutex_lock(&pending_actions_->lock);
+  pending_actions_->actions.push_back({pending_actions_->segments_sent,
+                                       action});
+  pthread_mutex_unlock(&pending_actions_->lock);
+  RunDueActions();
+}
+
+void MotionQueueMotorOperations::RunDueActions() {
+  // If another thread or an action calling us is busy running them already,
+  // it will also pick up the ones that became due now.
+  if (pthread_mutex_trylock(&pending_actions_->run_lock) != 0)
+    return;
+  // Read what is sent before what is pending: if segments are enqueued in
+  // between, we only underestimate how far the queue is.
+  const uint64_t sent = pending_actions_->segments_sent;
+  const uint64_t pending = PendingElements();
+  const uint64_t executed = pending < sent ? sent - pending : 0;
+  for (;;) {
+    pthread_mutex_lock(&pending_actions_->lock);
+    std::deque<PendingActions::Action> &actions = pending_actions_->actions;
+    if (actions.empty() || actions.front().after_segments > executed) {
+      pthread_mutex_unlock(&pending_actions_->lock);
+      break;
+    }
+    std::function<void()> run = std::move(actions.front().run);
+    actions.pop_front();
+    pthread_mutex_unlock(&pending_actions_->lock);
+    run();  // Outside the lock: it might queue more actions.
+  }
+  pthread_mutex_unlock(&pending_actions_->run_lock);
 }
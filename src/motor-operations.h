@@ -19,8 +19,12 @@
 #ifndef _BEAGLEG_MOTOR_OPERATIONS_H_
 #define _BEAGLEG_MOTOR_OPERATIONS_H_
 
+#include <stdint.h>
 #include <stdio.h>
-#include <deque>
+#include <unistd.h>
+
+#include <atomic>
+#include <functional>
 
 class MotionQueue;
 
@@ -28,6 +32,24 @@ enum {
   BEAGLEG_NUM_MOTORS = 8
 };
 
+// Maximum number of segments kept on the host when we feed the motion
+// queue from the event loop.
+enum {
+  MOTION_BACKLOG_SIZE = 1024
+};
+
+// Number of constant-acceleration pieces an S-curve ramp is made of. Ramps
+// with fewer than S_CURVE_MIN_STEPS steps are not worth shaping.
+enum {
+  S_CURVE_PIECES = 8,
+  S_CURVE_MIN_STEPS = 4 * S_CURVE_PIECES
+};
+
+// Number of distinct accelerations we keep pre-calculated constants for.
+enum {
+  ACCEL_CACHE_SIZE = 8
+};
+
 // The movement command send to motor operations either changes speed, or
 // provides a steady speed. Already low-level broken down for motors.
 struct LinearSegmentSteps {
@@ -44,6 +66,18 @@ struct LinearSegmentSteps {
   unsigned short aux_bits;   // Aux-bits to switch.
 
   int steps[BEAGLEG_NUM_MOTORS]; // Steps for axis. Negative for reverse.
+
+  // Speed requested for the move this segment is part of; the reference
+  // for a PWM that follows the speed. 0 if not known.
+  float v_feed;
+
+  // Acceleration of the defining axis in steps/s^2 the speed change has
+  // been planned with. Moves with the same acceleration limit carry the
+  // same value, so constants derived from it can be cached. 0 if not
+  // known or if the segment changes speed at another rate, e.g. as it
+  // includes a speed change too short for a segment of its own; then it is
+  // derived from the speeds and steps.
+  float acceleration;
 };
 
 // Struct used to return data about the currently executed steps
@@ -71,36 +105,165 @@ public:
   // Wait, until all elements in the ring-buffer are consumed.
   virtual void WaitQueueEmpty() = 0;
 
+  // Pause for the given time after all queued segments are executed.
+  // By default, this waits for the queue to be empty and sleeps.
+  virtual void Dwell(float milliseconds) {
+    WaitQueueEmpty();
+    usleep((int) (milliseconds * 1000));
+  }
+
   // Get the absolute position and auxes status the motors currently
   // in, and the end of the exeuction queue.
   // Returns 'true' if the status was available and is updated.
+  // Implementations should make this cheap enough to be sampled frequently
+  // and allow to call it from another thread than the one enqueuing.
   virtual bool GetPhysicalStatus(PhysicalStatus *status) = 0;
 
   virtual void SetExternalPosition(int axis, int steps) = 0;
+
+  // Get the time in seconds it takes to execute what is enqueued but not
+  // done yet. Same threading guarantees as GetPhysicalStatus().
+  // Returns 'false' if not known.
+  virtual bool GetQueuedSeconds(float *seconds) { return false; }
+
+  // Call "action" once all segments enqueued so far are executed, e.g. to
+  // switch an output at that position in the path without stopping.
+  // By default, this waits for the queue to be empty and calls it right away.
+  virtual void RunAtQueuePosition(const std::function<void()> &action) {
+    WaitQueueEmpty();
+    action();
+  }
+
+  // Call the actions given to RunAtQueuePosition() that are due by now.
+  // Needs to be called regularly while motion is going on, as the progress
+  // of the queue is not observed otherwise.
+  virtual void RunDueActions() {}
+
+  // Move by the steps of "segment" at speed segment.v1, accelerating with
+  // "acceleration" (steps/s^2 of the defining axis, 0 to start at full
+  // speed), but stop as soon as the input "gpio_def" reads "level": then
+  // decelerate the same way. Waits until the motors stand still.
+  // Stores the steps of the defining axis done until the input triggered
+  // in "trigger_steps" (-1 if it didn't) and in total in "total_steps".
+  // Returns false, without moving, if the input can't be watched while
+  // moving; by default, that is the case.
+  virtual bool MoveUntilInput(const LinearSegmentSteps &segment,
+                              float acceleration,
+                              uint32_t gpio_def, bool level,
+                              int *trigger_steps, int *total_steps) {
+    return false;
+  }
+
+  // Feed hold: if "hold", slow down along the enqueued motion until the
+  // motors stand still, otherwise speed up again to continue as planned.
+  // Each takes "ramp_seconds" from full speed. The queue stays as it is, so
+  // nothing needs to be planned again.
+  // Returns false if this is not supported.
+  virtual bool FeedHold(bool hold, float ramp_seconds) { return false; }
+
+  // Returns true if a feed hold brought the motors to a stand-still.
+  virtual bool IsHeld() { return false; }
+
+  // Speed override: run all motion, including what is enqueued already, at
+  // "factor" times the planned speed. Dwells keep their time. Changes over
+  // "ramp_seconds" per full speed.
+  // Returns false if this is not supported.
+  virtual bool SetSpeedOverride(float factor, float ramp_seconds) {
+    return false;
+  }
+
+  // Velocity PWM, e.g. for the power of a laser: from the next enqueued
+  // segment on, the spindle-speed PWM has the duty cycle "duty" (0..1) at the
+  // requested feed of the moves and proportionally less while the motors are
+  // slower, e.g. in acceleration and deceleration.
+  // Returns false if this is not supported.
+  virtual bool SetVelocityPWM(float duty) { return false; }
 };
 
 class HardwareMapping;
+class FDMultiplexer;
+struct MotionSegment;
 class MotionQueueMotorOperations : public MotorOperations {
 public:
   // Initialize motor operations, sending planned results into the motion backend.
   MotionQueueMotorOperations(HardwareMapping *hw, MotionQueue *backend);
   ~MotionQueueMotorOperations() override;
 
+  // Instead of blocking when the motion backend is full, keep segments in a
+  // backlog and feed them from the event loop whenever the number of pending
+  // elements in the backend falls below "low_watermark". We only block if
+  // the backlog is full as well.
+  // Returns false if the backend does not support event notification.
+  bool FeedFromEventLoop(FDMultiplexer *event_loop, int low_watermark);
+
+  // Shape acceleration and deceleration as S-curve: the speed change of
+  // each ramp follows a smooth curve over time, emitted as a sequence of
+  // constant-acceleration pieces. This limits jerk at the begin and end of
+  // ramps; the peak acceleration in the middle of a ramp is 1.5 times
+  // the average acceleration planned for it.
+  void SetSCurveAcceleration(bool enable) { s_curve_ = enable; }
+
+  // Pre-calculate constants for acceleration ramps with the given
+  // acceleration (in steps/s^2), e.g. the configured one of each axis.
+  void PrecomputeAcceleration(float steps_per_s2);
+
   void Enqueue(const LinearSegmentSteps &segment) final;
   void MotorEnable(bool on) final;
   void WaitQueueEmpty() final;
+  // Doesn't wait: the dwell is enqueued as segment without steps. A dwell
+  // too short for one loop waits until the queue is empty instead.
+  void Dwell(float milliseconds) final;
   bool GetPhysicalStatus(PhysicalStatus *status) final;
   void SetExternalPosition(int axis, int pos) final;
+  bool GetQueuedSeconds(float *seconds) final;
+  void RunAtQueuePosition(const std::function<void()> &action) final;
+  void RunDueActions() final;
+  bool MoveUntilInput(const LinearSegmentSteps &segment, float acceleration,
+                      uint32_t gpio_def, bool level,
+                      int *trigger_steps, int *total_steps) final;
+  bool FeedHold(bool hold, float ramp_seconds) final;
+  bool IsHeld() final;
+  bool SetSpeedOverride(float factor, float ramp_seconds) final;
+  bool SetVelocityPWM(float duty) final;
 
 private:
   void EnqueueInternal(const LinearSegmentSteps &param,
                        int defining_axis_steps);
+  void EnqueueRamp(const LinearSegmentSteps &param, int defining_axis_steps);
+  void EnqueueSCurve(const LinearSegmentSteps &param, int defining_axis_steps);
+  void SendToBackend(MotionSegment *segment);
+  void FeedBacklog(bool may_block);
+  int PendingElements();
 
   HardwareMapping *const hardware_mapping_;
   MotionQueue *backend_;
 
+  // Absolute positions at the end of each segment not executed yet. Oldest
+  // first; the newest one is where the last enqueued segment ends.
   struct HistorySegment;
-  std::deque<struct HistorySegment> *shadow_queue_;
+  struct ShadowQueue;
+  void SetSegmentSteps(const LinearSegmentSteps &param,
+                       int defining_axis_steps,
+                       MotionSegment *element, HistorySegment *history);
+  ShadowQueue *shadow_queue_;
+  void PushHistory(const HistorySegment &segment);
+  void TrimHistory(int pending);
+
+  struct Backlog;
+  Backlog *backlog_;   // Only used when feeding from event loop.
+  std::atomic<int> backlog_size_;  // Segments in backlog_, for any thread.
+
+  bool s_curve_;
+
+  uint32_t velocity_pwm_full_ticks_;  // 0 if velocity PWM is not enabled.
+  float velocity_pwm_duty_;
+
+  struct AccelerationCache;
+  AccelerationCache *accel_cache_;
+
+  // Actions waiting for the queue to reach their position.
+  struct PendingActions;
+  PendingActions *pending_actions_;
 };
 
 #endif  // _BEAGLEG_MOTOR_OPERATIONS_H_
@@ -10,13 +10,21 @@
 #include <stdio.h>
 #include <string.h>
 
+#include <algorithm>
+
 #include <gtest/gtest.h>
 #include <gmock/gmock.h>
 
 #include "common/container.h"
+#include "common/fd-mux.h"
 #include "common/logging.h"
+#include "common/metrics.h"
+#include "gcode-machine-control.h"
 #include "hardware-mapping.h"
+#include "motor-interface-constants.h"
 #include "motor-operations.h"
+#include "planner.h"
+#include "segment-timing.h"
 
 class MockMotionQueue : public MotionQueue {
 public:
@@ -26,6 +34,7 @@ public:
     remaining_loops_ = segment->loops_accel
       + segment->loops_travel + segment->loops_decel;
     queue_size_++;
+    last_segment_ = *segment;
   }
 
   void WaitQueueEmpty() {};
@@ -45,9 +54,12 @@ public:
     queue_size_ = buffer_size;
   }
 
+  const MotionSegment &last_segment() const { return last_segment_; }
+
 private:
   uint32_t remaining_loops_;
   unsigned int queue_size_;
+  MotionSegment last_segment_;
 };
 
 // Check that on init, the initial position is 0.
@@ -176,6 +188,35 @@ TEST(RealtimePosition, sample_pos) {
   }
 }
 
+// Enqueueing more segments does not change the position reported while
+// the head segment is executing.
+TEST(RealtimePosition, sample_while_enqueueing) {
+  HardwareMapping hw;
+  MockMotionQueue motion_backend = MockMotionQueue();
+  MotionQueueMotorOperations motor_operations(&hw, &motion_backend);
+
+  const LinearSegmentSteps kSegment = {
+    0 /* v0 */, 0 /* v1 */, 0 /* aux */,
+    {100, -50, 0, 0, 0, 0, 0, 0} /* steps */
+  };
+  motor_operations.Enqueue(kSegment);
+  motion_backend.SimRun(80, 1);   // 40 of 100 steps left.
+
+  const int expected[BEAGLEG_NUM_MOTORS] = {60, -30, 0, 0, 0, 0, 0, 0};
+  PhysicalStatus status;
+  motor_operations.GetPhysicalStatus(&status);
+  EXPECT_THAT(expected, ::testing::ContainerEq(status.pos_steps));
+
+  // The mock reports the progress of the last enqueued segment; keep that
+  // of the head.
+  for (int i = 0; i < 5; ++i) {
+    motor_operations.Enqueue(kSegment);
+    motion_backend.SimRun(80, i + 2);
+    motor_operations.GetPhysicalStatus(&status);
+    EXPECT_THAT(expected, ::testing::ContainerEq(status.pos_steps));
+  }
+}
+
 // Check that SimRun(0, x) produce the same absolute position as
 // SimRun(MAX_SEGMENT_STEPS, x + 1).
 TEST(RealtimePosition, zero_loops_edge) {
@@ -204,6 +245,471 @@ TEST(RealtimePosition, zero_loops_edge) {
   EXPECT_THAT(expected, ::testing::ContainerEq(status.pos_steps));
 }
 
+// The per-motor fractions and direction bits match the straightforward
+// calculation, for various numbers of steps.
+TEST(MotionSegment, fractions_and_directions) {
+  HardwareMapping hw;
+  MockMotionQueue motion_backend = MockMotionQueue();
+  MotionQueueMotorOperations motor_operations(&hw, &motion_backend);
+
+  const uint64_t max_fraction = 0xFFFFFFFF / 2;
+  for (int defining = 1; defining < 32767; defining = defining * 3 + 1) {
+    LinearSegmentSteps segment = {
+      100, 100, 0,
+      {defining, -defining, defining / 2, -(defining / 3), 1, 0,
+       defining - 1, -(defining * 2 / 3)}
+    };
+    motor_operations.Enqueue(segment);
+    const MotionSegment &result = motion_backend.last_segment();
+    for (int i = 0; i < MOTION_MOTOR_COUNT; ++i) {
+      const uint64_t delta = abs(segment.steps[i]);
+      EXPECT_EQ(delta * max_fraction / defining, result.fractions[i])
+        << "motor " << i << " steps " << segment.steps[i];
+      EXPECT_EQ(segment.steps[i] < 0, (result.direction_bits >> i) & 1)
+        << "motor " << i;
+    }
+  }
+}
+
+// Long moves fit into a single segment.
+TEST(MotionSegment, long_move_not_split) {
+  HardwareMapping hw;
+  MockMotionQueue motion_backend = MockMotionQueue();
+  MotionQueueMotorOperations motor_operations(&hw, &motion_backend);
+
+  const LinearSegmentSteps kLongMove = {
+    10000 /* v0 */, 10000 /* v1 */, 0 /* aux */,
+    {1000000, -300000, 0, 0, 0, 0, 0, 0} /* steps */
+  };
+  motor_operations.Enqueue(kLongMove);
+  uint32_t progress;
+  EXPECT_EQ(1, motion_backend.GetPendingElements(&progress));
+  EXPECT_EQ(2000000u, progress);
+  const uint64_t max_fraction = 0xFFFFFFFF / LOOPS_PER_STEP;
+  EXPECT_EQ(max_fraction, motion_backend.last_segment().fractions[0]);
+  EXPECT_EQ(300000 * max_fraction / 1000000,
+            motion_backend.last_segment().fractions[1]);
+
+  motion_backend.SimRun(0, 0);
+  PhysicalStatus status;
+  motor_operations.GetPhysicalStatus(&status);
+  const int expected[BEAGLEG_NUM_MOTORS] = {1000000, -300000, 0, 0, 0, 0, 0, 0};
+  EXPECT_THAT(expected, ::testing::ContainerEq(status.pos_steps));
+}
+
+// The per-motor fractions of long segments are exact as well.
+TEST(MotionSegment, long_move_fractions) {
+  HardwareMapping hw;
+  const uint64_t max_fraction = 0xFFFFFFFF / LOOPS_PER_STEP;
+  const int kDefiningSteps[] = { 1000, 65535, 65536, 100000, 1000000, 8000000 };
+  for (const int steps : kDefiningSteps) {
+    MockMotionQueue motion_backend;
+    MotionQueueMotorOperations motor_operations(&hw, &motion_backend);
+    const LinearSegmentSteps move = {
+      10000 /* v0 */, 10000 /* v1 */, 0 /* aux */,
+      {steps, -(steps / 3), steps - 1, 7, 0, 0, 0, 0} /* steps */
+    };
+    motor_operations.Enqueue(move);
+    uint32_t progress;
+    ASSERT_EQ(1, motion_backend.GetPendingElements(&progress)) << steps;
+    for (int i = 0; i < BEAGLEG_NUM_MOTORS; ++i) {
+      const uint64_t delta = abs(move.steps[i]);
+      EXPECT_EQ(delta * max_fraction / steps,
+                motion_backend.last_segment().fractions[i])
+        << "motor " << i << " of " << steps << " steps";
+    }
+  }
+}
+
+// S-curve ramps are split into several pieces, but still end up at the
+// same position.
+TEST(RealtimePosition, s_curve_ramp) {
+  HardwareMapping hw;
+  MockMotionQueue motion_backend = MockMotionQueue();
+  MotionQueueMotorOperations motor_operations(&hw, &motion_backend);
+  motor_operations.SetSCurveAcceleration(true);
+
+  const LinearSegmentSteps kAccel = {
+    0 /* v0 */, 10000 /* v1 */, 0 /* aux */,
+    {1000, -500, 0, 0, 0, 0, 0, 0} /* steps */
+  };
+  motor_operations.Enqueue(kAccel);
+  uint32_t progress;
+  EXPECT_LT(S_CURVE_PIECES / 2, motion_backend.GetPendingElements(&progress));
+  EXPECT_GE(S_CURVE_PIECES, motion_backend.GetPendingElements(&progress));
+
+  motion_backend.SimRun(0, 0);
+  PhysicalStatus status;
+  motor_operations.GetPhysicalStatus(&status);
+  const int expected[BEAGLEG_NUM_MOTORS] = {1000, -500, 0, 0, 0, 0, 0, 0};
+  EXPECT_THAT(expected, ::testing::ContainerEq(status.pos_steps));
+}
+
+// A dwell is a segment that doesn't step, but keeps the aux bits.
+TEST(MotionSegment, dwell_in_line) {
+  HardwareMapping hw;
+  MockMotionQueue motion_backend = MockMotionQueue();
+  MotionQueueMotorOperations motor_operations(&hw, &motion_backend);
+
+  const LinearSegmentSteps kSegment = {
+    0 /* v0 */, 0 /* v1 */, 0x3 /* aux */,
+    {100, 0, 0, 0, 0, 0, 0, 0} /* steps */
+  };
+  motor_operations.Enqueue(kSegment);
+  motor_operations.Dwell(1500);
+  uint32_t loops;
+  EXPECT_EQ(2, motion_backend.GetPendingElements(&loops));
+
+  const MotionSegment &dwell = motion_backend.last_segment();
+  EXPECT_EQ(0u, dwell.loops_accel);
+  EXPECT_EQ(0u, dwell.loops_decel);
+  EXPECT_EQ(1.5 * TIMER_FREQUENCY,
+            (double)dwell.loops_travel * dwell.travel_delay_cycles);
+  for (int i = 0; i < MOTION_MOTOR_COUNT; ++i) {
+    EXPECT_EQ(0u, dwell.fractions[i]);
+  }
+  EXPECT_EQ(0x3, dwell.aux);
+
+  // Standing still at the end of the previous segment while dwelling.
+  motion_backend.SimRun(loops / 2, 1);
+  PhysicalStatus status;
+  motor_operations.GetPhysicalStatus(&status);
+  EXPECT_EQ(100, status.pos_steps[0]);
+
+  // Dwells longer than what fits in one segment are split.
+  motor_operations.Dwell(3600 * 1000);
+  EXPECT_EQ(4, motion_backend.GetPendingElements(NULL));
+
+  // A zero dwell only waits for the queue; it doesn't add a segment.
+  motor_operations.Dwell(0);
+  EXPECT_EQ(4, motion_backend.GetPendingElements(NULL));
+}
+
+TEST(RealtimePosition, queued_seconds) {
+  HardwareMapping hw;
+  MockMotionQueue motion_backend = MockMotionQueue();
+  MotionQueueMotorOperations motor_operations(&hw, &motion_backend);
+  float seconds = -1;
+  EXPECT_TRUE(motor_operations.GetQueuedSeconds(&seconds));
+  EXPECT_EQ(0, seconds);
+
+  const LinearSegmentSteps kSegment = {
+    1000 /* v0 */, 1000 /* v1 */, 0 /* aux */,
+    {1000, 0, 0, 0, 0, 0, 0, 0} /* steps */
+  };
+  motor_operations.Enqueue(kSegment);
+  motor_operations.Dwell(500);
+  motion_backend.SimRun(LOOPS_PER_STEP * 1000, 2);  // Move just started.
+  EXPECT_TRUE(motor_operations.GetQueuedSeconds(&seconds));
+  EXPECT_FLOAT_EQ(1.5, seconds);
+
+  // Half way through the move.
+  motion_backend.SimRun(LOOPS_PER_STEP * 500, 2);
+  EXPECT_TRUE(motor_operations.GetQueuedSeconds(&seconds));
+  EXPECT_FLOAT_EQ(1.0, seconds);
+}
+
+TEST(RealtimePosition, action_at_queue_position) {
+  HardwareMapping hw;
+  MockMotionQueue motion_backend = MockMotionQueue();
+  MotionQueueMotorOperations motor_operations(&hw, &motion_backend);
+  int calls = 0;
+  motor_operations.RunAtQueuePosition([&]() { calls++; });
+  EXPECT_EQ(1, calls);   // Nothing queued, so right away.
+
+  const LinearSegmentSteps kSegment = {
+    1000 /* v0 */, 1000 /* v1 */, 0 /* aux */,
+    {1000, 0, 0, 0, 0, 0, 0, 0} /* steps */
+  };
+  motor_operations.Enqueue(kSegment);
+  motor_operations.Enqueue(kSegment);
+  motor_operations.RunAtQueuePosition([&]() { calls++; });
+  motor_operations.Enqueue(kSegment);
+  EXPECT_EQ(1, calls);
+
+  motion_backend.SimRun(LOOPS_PER_STEP * 500, 2);  // Second one executing.
+  motor_operations.RunDueActions();
+  EXPECT_EQ(1, calls);
+
+  motion_backend.SimRun(LOOPS_PER_STEP * 500, 1);  // Third one executing.
+  motor_operations.RunDueActions();
+  EXPECT_EQ(2, calls);
+}
+
+// A motion queue that only has space for a few elements and refuses more
+// in TryEnqueue().
+class SmallMotionQueue : public MotionQueue {
+public:
+  SmallMotionQueue(int capacity)
+    : capacity_(capacity), queue_size_(0), received_(0) {}
+
+  bool TryEnqueue(MotionSegment *segment) {
+    if (queue_size_ >= capacity_) return false;
+    Enqueue(segment);
+    return true;
+  }
+  void Enqueue(MotionSegment *segment) {
+    if (queue_size_ >= capacity_) queue_size_--;  // 'block' until executed.
+    queue_size_++;
+    received_++;
+  }
+  void WaitQueueEmpty() { queue_size_ = 0; }
+  void MotorEnable(bool on) {}
+  void Shutdown(bool flush_queue) {}
+  int GetPendingElements(uint32_t *head_item_progress) {
+    if (head_item_progress) *head_item_progress = 0;
+    return queue_size_;
+  }
+  int EventFd() { return 0; }  // Only registered, never polled in the test.
+
+  int received() const { return received_; }
+
+private:
+  const int capacity_;
+  int queue_size_;
+  int received_;
+};
+
+// When feeding from the event loop, segments not fitting into the backend are
+// kept on the host and flushed with WaitQueueEmpty().
+TEST(MotionBacklog, KeepSegmentsUntilFlushed) {
+  HardwareMapping hw;
+  SmallMotionQueue motion_backend(2);
+  MotionQueueMotorOperations motor_operations(&hw, &motion_backend);
+  FDMultiplexer event_loop;
+  ASSERT_TRUE(motor_operations.FeedFromEventLoop(&event_loop, 1));
+
+  const LinearSegmentSteps kSegment = {
+    0 /* v0 */, 0 /* v1 */, 0 /* aux */,
+    {100, 0, 0, 0, 0, 0, 0, 0} /* steps */
+  };
+  for (int i = 0; i < 5; ++i) {
+    motor_operations.Enqueue(kSegment);
+  }
+  EXPECT_EQ(2, motion_backend.received());  // Did not block.
+
+  // The backend reports the head element to be done, but the backlogged
+  // ones must not be counted yet.
+  PhysicalStatus status;
+  motor_operations.GetPhysicalStatus(&status);
+  EXPECT_EQ(100, status.pos_steps[0]);
+
+  motor_operations.WaitQueueEmpty();
+  EXPECT_EQ(5, motion_backend.received());
+  motor_operations.GetPhysicalStatus(&status);
+  EXPECT_EQ(500, status.pos_steps[0]);
+}
+
+// A motion queue that executes everything in WaitQueueEmpty() and can
+// watch an input, which triggers after a given number of loops.
+class WatchingMotionQueue : public MotionQueue {
+public:
+  WatchingMotionQueue(uint32_t trigger_after_loops)
+    : trigger_after_loops_(trigger_after_loops), watching_(false),
+      triggered_(false), queue_size_(0) {}
+
+  void Enqueue(MotionSegment *segment) {
+    last_segment_ = *segment;
+    queue_size_++;
+  }
+  void WaitQueueEmpty() {
+    const MotionSegment &s = last_segment_;
+    const uint32_t total = s.loops_accel + s.loops_travel + s.loops_decel;
+    if (queue_size_ && watching_ && (s.state & (1 << STATE_WATCH_INPUT_BIT))
+        && trigger_after_loops_ < total) {
+      // Decelerate as many loops as we accelerated so far.
+      triggered_ = true;
+      loops_left_ = total - trigger_after_loops_;
+      stop_loops_ = std::min(trigger_after_loops_, s.loops_accel);
+    }
+    watching_ = false;
+    queue_size_ = 0;
+  }
+  void MotorEnable(bool on) {}
+  void Shutdown(bool flush_queue) {}
+  int GetPendingElements(uint32_t *head_item_progress) {
+    if (head_item_progress) *head_item_progress = 0;
+    return queue_size_;
+  }
+  bool WatchInput(uint32_t gpio_def, bool level) {
+    watching_ = true;
+    triggered_ = false;
+    return true;
+  }
+  bool GetInputTrigger(uint32_t *loops_left, uint32_t *stop_loops) {
+    if (!triggered_) return false;
+    *loops_left = loops_left_;
+    *stop_loops = stop_loops_;
+    return true;
+  }
+
+  const MotionSegment &last_segment() const { return last_segment_; }
+
+private:
+  const uint32_t trigger_after_loops_;
+  bool watching_;
+  bool triggered_;
+  uint32_t loops_left_, stop_loops_;
+  int queue_size_;
+  MotionSegment last_segment_;
+};
+
+// A move until an input triggers is a single segment, stopped with the
+// deceleration mirroring the acceleration; the position is where we stopped.
+TEST(MoveUntilInput, StopsAfterTrigger) {
+  HardwareMapping hw;
+  WatchingMotionQueue motion_backend(4000 * LOOPS_PER_STEP);
+  MotionQueueMotorOperations motor_operations(&hw, &motion_backend);
+
+  const LinearSegmentSteps kSegment = {
+    0 /* v0 */, 1000 /* v1 */, 0 /* aux */,
+    {-10000, 5000, 0, 0, 0, 0, 0, 0} /* steps */
+  };
+  int trigger_steps, total_steps;
+  ASSERT_TRUE(motor_operations.MoveUntilInput(kSegment, 10000, 0, true,
+                                              &trigger_steps, &total_steps));
+  const MotionSegment &segment = motion_backend.last_segment();
+  EXPECT_TRUE(segment.state & (1 << STATE_WATCH_INPUT_BIT));
+  EXPECT_EQ(50u * LOOPS_PER_STEP, segment.loops_accel);   // v^2 / 2a
+  EXPECT_EQ(segment.loops_accel, segment.loops_decel);
+  EXPECT_EQ(10000u * LOOPS_PER_STEP, segment.loops_accel
+            + segment.loops_travel + segment.loops_decel);
+
+  EXPECT_EQ(4000, trigger_steps);
+  EXPECT_EQ(4050, total_steps);
+  PhysicalStatus status;
+  motor_operations.GetPhysicalStatus(&status);
+  EXPECT_EQ(-4050, status.pos_steps[0]);
+  EXPECT_EQ(2025, status.pos_steps[1]);
+}
+
+TEST(MoveUntilInput, NoTrigger) {
+  HardwareMapping hw;
+  WatchingMotionQueue motion_backend(20000 * LOOPS_PER_STEP);
+  MotionQueueMotorOperations motor_operations(&hw, &motion_backend);
+
+  const LinearSegmentSteps kSegment = {
+    0 /* v0 */, 1000 /* v1 */, 0 /* aux */,
+    {10000, 0, 0, 0, 0, 0, 0, 0} /* steps */
+  };
+  int trigger_steps, total_steps;
+  ASSERT_TRUE(motor_operations.MoveUntilInput(kSegment, 10000, 0, true,
+                                              &trigger_steps, &total_steps));
+  EXPECT_EQ(-1, trigger_steps);
+  EXPECT_EQ(10000, total_steps);
+  PhysicalStatus status;
+  motor_operations.GetPhysicalStatus(&status);
+  EXPECT_EQ(10000, status.pos_steps[0]);
+
+  // Backends that can't watch inputs don't move at all.
+  MockMotionQueue plain_backend;
+  MotionQueueMotorOperations plain_operations(&hw, &plain_backend);
+  EXPECT_FALSE(plain_operations.MoveUntilInput(kSegment, 10000, 0, true,
+                                               &trigger_steps, &total_steps));
+  EXPECT_EQ(0, plain_backend.GetPendingElements(NULL));
+}
+
+// A motion queue that can drive a PWM output from the speed of the motors.
+class VelocityPWMMotionQueue : public MockMotionQueue {
+public:
+  bool EnableVelocityPWM(uint32_t *full_ticks) final {
+    *full_ticks = 1000;
+    return true;
+  }
+};
+
+// At constant speed, the duty is computed right away; on ramps, the PRU
+// divides by the current delay.
+TEST(VelocityPWM, DutyFollowsSpeed) {
+  HardwareMapping hw;
+  VelocityPWMMotionQueue motion_backend;
+  MotionQueueMotorOperations motor_operations(&hw, &motion_backend);
+
+  LinearSegmentSteps segment = {
+    500 /* v0 */, 500 /* v1 */, 0 /* aux */,
+    {1000, 0, 0, 0, 0, 0, 0, 0} /* steps */,
+    1000 /* v_feed */
+  };
+  motor_operations.Enqueue(segment);
+  EXPECT_FALSE(motion_backend.last_segment().state
+               & (1 << STATE_VELOCITY_PWM_BIT));   // Not enabled yet.
+
+  ASSERT_TRUE(motor_operations.SetVelocityPWM(0.5));
+  motor_operations.Enqueue(segment);
+  const MotionSegment &travel = motion_backend.last_segment();
+  EXPECT_TRUE(travel.state & (1 << STATE_VELOCITY_PWM_BIT));
+  EXPECT_TRUE(travel.state & (1 << STATE_CONSTANT_PWM_BIT));
+  EXPECT_EQ(250u, travel.hires_accel_cycles);   // Half the feed.
+
+  segment.v1 = 1000;
+  motor_operations.Enqueue(segment);
+  const MotionSegment &ramp = motion_backend.last_segment();
+  EXPECT_TRUE(ramp.state & (1 << STATE_VELOCITY_PWM_BIT));
+  EXPECT_FALSE(ramp.state & (1 << STATE_CONSTANT_PWM_BIT));
+  // Divided by the delay at the feed, this is the full duty of 500 ticks.
+  EXPECT_EQ(500u * CalcTravelDelayCycles(1000), ramp.travel_delay_cycles);
+
+  // Off, but still following the motion.
+  ASSERT_TRUE(motor_operations.SetVelocityPWM(0));
+  motor_operations.Enqueue(segment);
+  EXPECT_TRUE(motion_backend.last_segment().state
+              & (1 << STATE_VELOCITY_PWM_BIT));
+  EXPECT_EQ(0u, motion_backend.last_segment().travel_delay_cycles);
+
+  // Backends without support refuse.
+  MockMotionQueue plain_backend;
+  MotionQueueMotorOperations plain_operations(&hw, &plain_backend);
+  EXPECT_FALSE(plain_operations.SetVelocityPWM(0.5));
+}
+
+#if !BEAGLEG_FIXED_POINT_TIMING
+static uint64_t CounterValue(const char *name) {
+  const Metric *metric = MetricsRegistry::Global()->Find(name);
+  return metric ? static_cast<const MetricCounter*>(metric)->value() : 0;
+}
+
+// Ramps planned with the configured accelerations find their constants
+// pre-calculated, whatever the rounding of their steps.
+TEST(AccelerationCache, PlannedRampsHit) {
+  MachineControlConfig config;
+  HardwareMapping hw;
+  const GCodeParserAxis kAxes[] = { AXIS_X, AXIS_Y };
+  int motor = 1;
+  for (const GCodeParserAxis axis : kAxes) {
+    config.steps_per_mm[axis] = 160;
+    config.max_feedrate[axis] = 1000;
+    config.acceleration[axis] = 1000 * motor;
+    hw.AddMotorMapping(axis, motor++, false);
+  }
+  config.threaded_planner = false;
+
+  MockMotionQueue motion_backend;
+  MotionQueueMotorOperations motor_operations(&hw, &motion_backend);
+  for (const GCodeParserAxis axis : kAxes) {
+    motor_operations.PrecomputeAcceleration(config.acceleration[axis]
+                                            * config.steps_per_mm[axis]);
+  }
+  const uint64_t hits_before = CounterValue("beagleg_accel_cache_hits_total");
+  const uint64_t misses_before =
+    CounterValue("beagleg_accel_cache_misses_total");
+
+  Planner planner(&config, &hw, &motor_operations);
+  AxesRegister pos;
+  for (int i = 0; i < 100; ++i) {
+    // Right angles, so that each move accelerates and decelerates on its
+    // own axis.
+    pos[(i % 2) ? AXIS_Y : AXIS_X] += ((i / 2) % 2 ? -1 : 1) * (1 + i * 0.37);
+    planner.Enqueue(pos, 50 + 7 * i);
+  }
+  planner.BringPathToHalt();
+
+  EXPECT_EQ(0u, CounterValue("beagleg_accel_cache_misses_total")
+            - misses_before);
+  EXPECT_LE(200u, CounterValue("beagleg_accel_cache_hits_total")
+            - hits_before);
+}
+#endif
+
 int main(int argc, char *argv[]) {
   Log_init("/dev/stderr");
   ::testing::InitGoogleTest(&argc, argv);
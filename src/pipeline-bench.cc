@@ -0,0 +1,455 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Benchmark of the host side of the motion pipeline: the real parser,
+// machine control, planner and motor operations, feeding a motion queue
+// that throws the segments away. Shows how many G-code lines and segments
+// per second the host can sustain and where the time goes.
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "common/logging.h"
+#include "common/string-util.h"
+#include "gcode-parser/gcode-parser.h"
+
+#include "config-parser.h"
+#include "determine-print-stats.h"
+#include "gcode-machine-control.h"
+#include "hardware-mapping.h"
+#include "motion-queue.h"
+#include "motor-operations.h"
+#include "spindle-control.h"
+
+static int usage(const char *prog) {
+  fprintf(stderr, "Usage: %s [options] [<gcode-file> ..]\n"
+          "Options:\n"
+          "\t-c <config>       : Machine config (Required)\n"
+          "\t-s                : Also run synthetic stress workloads.\n"
+          "\t-r <repeat>       : Run each workload this many times "
+          "(Default: 1).\n"
+          "\t-q                : Quick: no time measurement per stage, which "
+          "costs a bit itself.\n", prog);
+  return 1;
+}
+
+static int64_t NowNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int64_t CpuNanos() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return ((int64_t)usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000000
+    + ((int64_t)usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1000;
+}
+
+namespace {
+// Time spent in each stage; the outer stages include the inner ones.
+struct StageTimes {
+  int64_t receiver_ns = 0;   // Machine control and everything below.
+  int64_t motor_ns = 0;      // Motor operations and the motion queue.
+  int64_t queue_ns = 0;      // The motion queue.
+  uint64_t segments = 0;
+};
+
+// Measures the time spent in a scope, if enabled.
+class ScopedTimer {
+public:
+  ScopedTimer(bool enabled, int64_t *accumulate)
+    : accumulate_(enabled ? accumulate : NULL),
+      start_(enabled ? NowNanos() : 0) {}
+  ~ScopedTimer() { if (accumulate_) *accumulate_ += NowNanos() - start_; }
+
+private:
+  int64_t *const accumulate_;
+  const int64_t start_;
+};
+
+// Counts and times segments, then throws them away like DummyMotionQueue.
+class TimingMotionQueue : public DummyMotionQueue {
+public:
+  TimingMotionQueue(bool timing, StageTimes *times)
+    : timing_(timing), times_(times) {}
+
+  void Enqueue(MotionSegment *segment) final {
+    ScopedTimer t(timing_, &times_->queue_ns);
+    DummyMotionQueue::Enqueue(segment);
+    ++times_->segments;
+  }
+  void Dwell(float milliseconds) final {}   // No time spent in the machine.
+
+private:
+  const bool timing_;
+  StageTimes *const times_;
+};
+
+// Times the calls into the real motor operations.
+class TimingMotorOperations : public MotorOperations {
+public:
+  TimingMotorOperations(bool timing, StageTimes *times,
+                        MotorOperations *delegatee)
+    : timing_(timing), times_(times), delegatee_(delegatee) {}
+
+  void Enqueue(const LinearSegmentSteps &segment) final {
+    ScopedTimer t(timing_, &times_->motor_ns);
+    delegatee_->Enqueue(segment);
+  }
+  void MotorEnable(bool on) final { delegatee_->MotorEnable(on); }
+  void WaitQueueEmpty() final {
+    ScopedTimer t(timing_, &times_->motor_ns);
+    delegatee_->WaitQueueEmpty();
+  }
+  void Dwell(float milliseconds) final {
+    ScopedTimer t(timing_, &times_->motor_ns);
+    delegatee_->Dwell(milliseconds);
+  }
+  bool GetPhysicalStatus(PhysicalStatus *status) final {
+    return delegatee_->GetPhysicalStatus(status);
+  }
+  void SetExternalPosition(int axis, int pos) final {
+    delegatee_->SetExternalPosition(axis, pos);
+  }
+
+private:
+  const bool timing_;
+  StageTimes *const times_;
+  MotorOperations *const delegatee_;
+};
+
+// Times all calls from the parser into the machine control; the rest is
+// spent in the parser itself.
+class TimingEventDelegator : public GCodeParser::EventReceiver {
+public:
+  TimingEventDelegator(bool timing, StageTimes *times,
+                       GCodeParser::EventReceiver *delegatee)
+    : timing_(timing), times_(times), delegatee_(delegatee) {}
+
+  void gcode_start(GCodeParser *p) final {
+    ScopedTimer t(timing_, &times_->receiver_ns);
+    delegatee_->gcode_start(p);
+  }
+  void gcode_finished(bool end_of_stream) final {
+    ScopedTimer t(timing_, &times_->receiver_ns);
+    delegatee_->gcode_finished(end_of_stream);
+  }
+  void inform_origin_offset(const AxesRegister &offset) final {
+    delegatee_->inform_origin_offset(offset);
+  }
+  void gcode_command_done(char letter, float val) final {
+    ScopedTimer t(timing_, &times_->receiver_ns);
+    delegatee_->gcode_command_done(letter, val);
+  }
+  void input_idle(bool is_first) final {
+    ScopedTimer t(timing_, &times_->receiver_ns);
+    delegatee_->input_idle(is_first);
+  }
+  void go_home(AxisBitmap_t axes) final {
+    ScopedTimer t(timing_, &times_->receiver_ns);
+    delegatee_->go_home(axes);
+  }
+  bool probe_axis(float feed, enum GCodeParserAxis axis,
+                  float *probed_position) final {
+    ScopedTimer t(timing_, &times_->receiver_ns);
+    return delegatee_->probe_axis(feed, axis, probed_position);
+  }
+  void set_speed_factor(float factor) final {
+    delegatee_->set_speed_factor(factor);
+  }
+  void set_fanspeed(float value) final { delegatee_->set_fanspeed(value); }
+  void set_temperature(float c) final { delegatee_->set_temperature(c); }
+  void wait_temperature() final { delegatee_->wait_temperature(); }
+  void dwell(float time_ms) final {
+    ScopedTimer t(timing_, &times_->receiver_ns);
+    delegatee_->dwell(time_ms);
+  }
+  void motors_enable(bool enable) final {
+    ScopedTimer t(timing_, &times_->receiver_ns);
+    delegatee_->motors_enable(enable);
+  }
+  bool coordinated_move(float feed, const AxesRegister &pos) final {
+    ScopedTimer t(timing_, &times_->receiver_ns);
+    return delegatee_->coordinated_move(feed, pos);
+  }
+  bool rapid_move(float feed, const AxesRegister &pos) final {
+    ScopedTimer t(timing_, &times_->receiver_ns);
+    return delegatee_->rapid_move(feed, pos);
+  }
+  bool coordinated_moves(const Move *moves, int count) final {
+    ScopedTimer t(timing_, &times_->receiver_ns);
+    return delegatee_->coordinated_moves(moves, count);
+  }
+  void arc_move(float feed, GCodeParserAxis normal_axis, bool clockwise,
+                const AxesRegister &start, const AxesRegister &center,
+                const AxesRegister &end) final {
+    ScopedTimer t(timing_, &times_->receiver_ns);
+    delegatee_->arc_move(feed, normal_axis, clockwise, start, center, end);
+  }
+  float arc_max_chord_error() final {
+    return delegatee_->arc_max_chord_error();
+  }
+  void spline_move(float feed, const AxesRegister &start,
+                   const AxesRegister &cp1, const AxesRegister &cp2,
+                   const AxesRegister &end) final {
+    ScopedTimer t(timing_, &times_->receiver_ns);
+    delegatee_->spline_move(feed, start, cp1, cp2, end);
+  }
+  const char *unprocessed(char letter, float value, const char *rest) final {
+    ScopedTimer t(timing_, &times_->receiver_ns);
+    return delegatee_->unprocessed(letter, value, rest);
+  }
+
+private:
+  const bool timing_;
+  StageTimes *const times_;
+  GCodeParser::EventReceiver *const delegatee_;
+};
+
+struct Workload {
+  std::string name;
+  std::string gcode_file;
+  bool temporary;
+};
+
+struct Result {
+  int64_t wall_ns = 0;
+  int64_t cpu_ns = 0;
+  uint64_t lines = 0;
+  StageTimes times;
+};
+}  // namespace
+
+// Synthetic workloads stressing different parts of the pipeline.
+static bool WriteSyntheticWorkload(const std::string &kind,
+                                   std::string *filename) {
+  char tmpl[] = "/tmp/pipeline-bench.XXXXXX";
+  const int fd = mkstemp(tmpl);
+  if (fd < 0) return false;
+  FILE *out = fdopen(fd, "w");
+  fprintf(out, "G21 G90 G1 F6000\n");
+  if (kind == "short-segments") {
+    // Tiny segments as from a finely tessellated model; planner-bound.
+    for (int i = 0; i < 200000; ++i) {
+      const float a = i * 0.002;
+      fprintf(out, "G1 X%.4f Y%.4f\n",
+              50 + (20 + a) * cosf(a), 50 + (20 + a) * sinf(a));
+    }
+  } else if (kind == "arcs") {
+    // Many arcs, linearized in the machine control.
+    for (int i = 0; i < 5000; ++i) {
+      fprintf(out, "G%d X%d Y50 I%.1f J0\n", 2 + i % 2, (i % 2) ? 40 : 60,
+              (i % 2) ? -10.0 : 10.0);
+    }
+  } else if (kind == "long-moves") {
+    // Long moves; few segments per line, each with acceleration ramps.
+    for (int i = 0; i < 50000; ++i) {
+      fprintf(out, "G1 X%d Y%d\n", (i % 2) ? 100 : 0, (i / 2) % 100);
+    }
+  } else if (kind == "parse-heavy") {
+    // Comments, expressions and parameters; mostly parser work.
+    fprintf(out, "#1=0\n");
+    for (int i = 0; i < 100000; ++i) {
+      fprintf(out, "G1 X[%d / 1000 + #1] Y%d.%03d ; line %d comment\n",
+              i % 1000, i % 100, i % 1000, i);
+    }
+  }
+  fclose(out);
+  *filename = tmpl;
+  return true;
+}
+
+static bool RunWorkload(const char *gcode_file,
+                        const MachineControlConfig &config,
+                        HardwareMapping *hardware, Spindle *spindle,
+                        bool timing, FILE *msg_out, Result *result) {
+  const int fd = open(gcode_file, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Can't open %s\n", gcode_file);
+    return false;
+  }
+  StageTimes times;
+  TimingMotionQueue motion_queue(timing, &times);
+  MotionQueueMotorOperations motor_operations(hardware, &motion_queue);
+  motor_operations.SetSCurveAcceleration(config.s_curve_acceleration);
+  for (const GCodeParserAxis axis : AllAxes()) {
+    motor_operations.PrecomputeAcceleration(config.acceleration[axis]
+                                            * config.steps_per_mm[axis]);
+  }
+  TimingMotorOperations timed_motor_operations(timing, &times,
+                                               &motor_operations);
+  GCodeMachineControl *machine_control
+    = GCodeMachineControl::Create(config, &timed_motor_operations,
+                                  hardware, spindle, NULL);
+  if (machine_control == NULL) {
+    close(fd);
+    return false;
+  }
+  TimingEventDelegator receiver(timing, &times,
+                                machine_control->ParseEventReceiver());
+  GCodeParser::Config parser_cfg;
+  GCodeParser::Config::ParamMap parameters;
+  parser_cfg.parameters = &parameters;
+  machine_control->GetHomePos(&parser_cfg.machine_origin);
+  GCodeParser parser(parser_cfg, &receiver, false);
+
+  const int64_t start_cpu = CpuNanos();
+  const int64_t start = NowNanos();
+  parser.ParseFile(fd, msg_out, 0);     // Its own thread would blur the stages.
+  result->wall_ns += NowNanos() - start;
+  result->cpu_ns += CpuNanos() - start_cpu;
+  result->lines += parser.line_number();
+  result->times.receiver_ns += times.receiver_ns;
+  result->times.motor_ns += times.motor_ns;
+  result->times.queue_ns += times.queue_ns;
+  result->times.segments += times.segments;
+  delete machine_control;
+  return true;
+}
+
+static void PrintResult(const std::string &name, int name_width,
+                        const Result &r, bool timing) {
+  const double seconds = r.wall_ns / 1e9;
+  printf("%-*s %9llu %10.0f %9llu %10.0f %5.0f%%",
+         name_width, name.c_str(), (unsigned long long) r.lines, r.lines / seconds,
+         (unsigned long long) r.times.segments, r.times.segments / seconds,
+         100.0 * r.cpu_ns / r.wall_ns);
+  if (timing) {
+    const double total = r.wall_ns;
+    printf(" %6.1f%% %6.1f%% %6.1f%% %6.1f%%",
+           100 * (r.wall_ns - r.times.receiver_ns) / total,
+           100 * (r.times.receiver_ns - r.times.motor_ns) / total,
+           100 * (r.times.motor_ns - r.times.queue_ns) / total,
+           100 * r.times.queue_ns / total);
+  }
+  printf("\n");
+}
+
+int main(int argc, char *argv[]) {
+  const char *config_file = NULL;
+  bool synthetic = false;
+  bool timing = true;
+  int repeat = 1;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "c:sr:q")) != -1) {
+    switch (opt) {
+    case 'c':
+      config_file = strdup(optarg);
+      break;
+    case 's':
+      synthetic = true;
+      break;
+    case 'r':
+      repeat = atoi(optarg);
+      if (repeat < 1) return usage(argv[0]);
+      break;
+    case 'q':
+      timing = false;
+      break;
+    default:
+      return usage(argv[0]);
+    }
+  }
+  if (!config_file || (optind >= argc && !synthetic))
+    return usage(argv[0]);
+
+  Log_init("/dev/null");
+
+  ConfigParser config_parser;
+  MachineControlConfig config;
+  HardwareMapping hardware;
+  Spindle spindle;
+  if (!config_parser.SetContentFromFile(config_file)
+      || !config.ConfigureFromFile(&config_parser)
+      || !hardware.ConfigureFromFile(&config_parser)
+      || !spindle.ConfigureFromFile(&config_parser)) {
+    fprintf(stderr, "Cannot read config file '%s'\n", config_file);
+    return 1;
+  }
+  // Not connected to a machine. The planner runs in this thread, so that
+  // its time is attributed to it.
+  configure_for_print_stats(&config);
+
+  std::vector<Workload> workloads;
+  for (int i = optind; i < argc; ++i) {
+    workloads.push_back({ argv[i], argv[i], false });
+  }
+  if (synthetic) {
+    for (const char *kind : { "short-segments", "arcs", "long-moves",
+                              "parse-heavy" }) {
+      Workload w = { std::string("synthetic:") + kind, "", true };
+      if (!WriteSyntheticWorkload(kind, &w.gcode_file)) {
+        fprintf(stderr, "Can't create synthetic workload.\n");
+        return 1;
+      }
+      workloads.push_back(w);
+    }
+  }
+
+  int name_width = strlen("#workload");
+  for (const Workload &w : workloads) {
+    name_width = std::max(name_width, (int)w.name.size());
+  }
+  FILE *msg_out = fopen("/dev/null", "w");
+  printf("%-*s %9s %10s %9s %10s %6s", name_width, "#workload", "lines", "lines/s",
+         "segments", "segments/s", "cpu");
+  if (timing) {
+    printf(" %7s %7s %7s %7s", "parse", "planner", "motor", "queue");
+  }
+  printf("\n");
+  Result total;
+  bool success = true;
+  for (const Workload &w : workloads) {
+    Result result;
+    for (int i = 0; i < repeat && success; ++i) {
+      success = RunWorkload(w.gcode_file.c_str(), config, &hardware, &spindle,
+                            timing, msg_out, &result);
+    }
+    if (!success) break;
+    PrintResult(w.name, name_width, result, timing);
+    total.wall_ns += result.wall_ns;
+    total.cpu_ns += result.cpu_ns;
+    total.lines += result.lines;
+    total.times.receiver_ns += result.times.receiver_ns;
+    total.times.motor_ns += result.times.motor_ns;
+    total.times.queue_ns += result.times.queue_ns;
+    total.times.segments += result.times.segments;
+  }
+  if (success && workloads.size() > 1) {
+    PrintResult("#total", name_width, total, timing);
+  }
+  fclose(msg_out);
+  for (const Workload &w : workloads) {
+    if (w.temporary) unlink(w.gcode_file.c_str());
+  }
+  return success ? 0 : 1;
+}
@@ -0,0 +1,353 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Microbenchmark of the planner alone: moves are handed to
+// Planner::Enqueue() and the resulting segments are only counted, so the
+// time is spent in speed planning and step conversion.
+//
+// With a baseline file, this serves as a performance regression test: the
+// throughput of each workload is compared with the recorded one and the
+// program fails if it dropped by more than a threshold. The baseline is
+// only meaningful on the host it was recorded on.
+
+#include <errno.h>
+#include <getopt.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "common/logging.h"
+#include "gcode-parser/gcode-parser.h"
+
+#include "gcode-machine-control.h"
+#include "hardware-mapping.h"
+#include "motor-operations.h"
+#include "planner.h"
+
+// Default allowed throughput drop in percent before we call it a regression.
+#define DEFAULT_THRESHOLD_PERCENT 25
+
+// Each run feeds the moves of a workload repeatedly for at least this long,
+// so that timer resolution and scheduling noise don't matter.
+#define MIN_RUN_NANOS 200000000
+
+// Configured axes. Only the many-axis workload moves all of them.
+static const GCodeParserAxis kBenchAxes[] = {
+  AXIS_X, AXIS_Y, AXIS_Z, AXIS_A, AXIS_B, AXIS_C
+};
+
+static int usage(const char *prog) {
+  fprintf(stderr, "Usage: %s [options]\n"
+          "Options:\n"
+          "\t-r <repeat>       : Runs per workload; best is reported "
+          "(Default: 5).\n"
+          "\t-b <baseline>     : Compare against baseline file and fail on "
+          "regression.\n"
+          "\t-t <percent>      : Allowed throughput drop against baseline "
+          "(Default: %d).\n"
+          "\t-w <baseline>     : Write results as new baseline file.\n",
+          prog, DEFAULT_THRESHOLD_PERCENT);
+  return 1;
+}
+
+static int64_t NowNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+namespace {
+// Only counts what the planner emits.
+class CountingMotorOperations : public MotorOperations {
+public:
+  CountingMotorOperations() : segments_(0), steps_(0) {}
+
+  void Enqueue(const LinearSegmentSteps &segment) final {
+    ++segments_;
+    for (int i = 0; i < BEAGLEG_NUM_MOTORS; ++i)
+      steps_ += abs(segment.steps[i]);
+  }
+  void MotorEnable(bool on) final {}
+  void WaitQueueEmpty() final {}
+  void Dwell(float milliseconds) final {}
+  bool GetPhysicalStatus(PhysicalStatus *status) final { return false; }
+  void SetExternalPosition(int axis, int steps) final {}
+
+  uint64_t segments() const { return segments_; }
+  uint64_t steps() const { return steps_; }
+
+private:
+  uint64_t segments_;
+  uint64_t steps_;
+};
+
+// Collects the segments of a linearized arc as targets.
+class ArcCollector : public GCodeParser::EventReceiver {
+public:
+  ArcCollector(std::vector<AxesRegister> *targets) : targets_(targets) {}
+
+  void gcode_start(GCodeParser *parser) final {}
+  void go_home(AxisBitmap_t axis_bitmap) final {}
+  void set_speed_factor(float factor) final {}
+  void set_fanspeed(float value) final {}
+  void set_temperature(float degrees_c) final {}
+  void wait_temperature() final {}
+  void dwell(float time_ms) final {}
+  void motors_enable(bool enable) final {}
+  bool coordinated_move(float feed, const AxesRegister &pos) final {
+    targets_->push_back(pos);
+    return true;
+  }
+  bool rapid_move(float feed, const AxesRegister &pos) final { return true; }
+  const char *unprocessed(char letter, float value,
+                          const char *rest_of_line) final {
+    return nullptr;
+  }
+
+private:
+  std::vector<AxesRegister> *const targets_;
+};
+
+struct Workload {
+  const char *name;
+  std::vector<AxesRegister> targets;
+  std::vector<float> feeds;
+};
+
+struct Result {
+  double moves_per_sec;
+  uint64_t segments;  // Of the last run.
+  uint64_t steps;
+};
+}  // namespace
+
+// Long straight runs back and forth; few segments with full ramps.
+static void CreateStraightRuns(Workload *w) {
+  for (int i = 0; i < 20000; ++i) {
+    AxesRegister pos;
+    pos[AXIS_X] = (i % 2) ? 200 : 0;
+    pos[AXIS_Y] = (i / 2) % 100;
+    w->targets.push_back(pos);
+    w->feeds.push_back(200);
+  }
+}
+
+// Short moves with sharp corners; the speed at each joint is planned.
+static void CreateZigZag(Workload *w) {
+  for (int i = 0; i < 100000; ++i) {
+    AxesRegister pos;
+    pos[AXIS_X] = i * 0.5;
+    pos[AXIS_Y] = (i % 2) ? 1 : 0;
+    w->targets.push_back(pos);
+    w->feeds.push_back(100);
+  }
+}
+
+// Circles as linearized by the arc generator; very many tiny segments that
+// are almost collinear.
+static void CreateCircles(Workload *w) {
+  ArcCollector collector(&w->targets);
+  for (int i = 0; i < 50; ++i) {
+    AxesRegister start, center, end;
+    const float radius = 5 + i;
+    start[AXIS_X] = end[AXIS_X] = radius;
+    collector.arc_move(100, AXIS_Z, i % 2, start, center, end);
+    w->targets.push_back(start);
+  }
+  w->feeds.assign(w->targets.size(), 100);
+}
+
+// Moves involving all axes at once, e.g. a 5-axis mill.
+static void CreateManyAxes(Workload *w) {
+  for (int i = 0; i < 50000; ++i) {
+    AxesRegister pos;
+    int a = 0;
+    for (const GCodeParserAxis axis : kBenchAxes) {
+      pos[axis] = 10 * sinf(i * 0.01 + a++);
+    }
+    w->targets.push_back(pos);
+    w->feeds.push_back(100);
+  }
+}
+
+static void InitBenchConfig(MachineControlConfig *config,
+                            HardwareMapping *hardware) {
+  int motor = 1;
+  for (const GCodeParserAxis axis : kBenchAxes) {
+    config->steps_per_mm[axis] = 160;
+    config->max_feedrate[axis] = 1000;
+    config->acceleration[axis] = 2000;
+    hardware->AddMotorMapping(axis, motor++, false);
+  }
+  config->require_homing = false;
+  config->range_check = false;
+  config->threaded_planner = false;  // Measure in this thread.
+}
+
+static Result RunWorkload(const Workload &w, int repeat,
+                          const MachineControlConfig &config,
+                          HardwareMapping *hardware) {
+  Result result = { 0, 0, 0 };
+  for (int r = 0; r < repeat; ++r) {
+    CountingMotorOperations motor_ops;
+    Planner *planner = new Planner(&config, hardware, &motor_ops);
+    const int64_t start = NowNanos();
+    int64_t duration;
+    uint64_t moves = 0;
+    do {
+      planner->Enqueue(w.targets.data(), w.feeds.data(), w.targets.size());
+      moves += w.targets.size();
+      duration = NowNanos() - start;
+    } while (duration < MIN_RUN_NANOS);
+    planner->BringPathToHalt();
+    duration = NowNanos() - start;
+    delete planner;
+    const double moves_per_sec = moves * 1e9 / duration;
+    if (moves_per_sec > result.moves_per_sec) {
+      result.moves_per_sec = moves_per_sec;
+    }
+    result.segments = motor_ops.segments();
+    result.steps = motor_ops.steps();
+  }
+  return result;
+}
+
+// Baseline file: one line per workload, "<name> <moves-per-second>".
+static bool ReadBaseline(const char *filename,
+                         std::map<std::string, double> *baseline) {
+  FILE *in = fopen(filename, "r");
+  if (!in) {
+    fprintf(stderr, "Can't read baseline %s: %s\n", filename, strerror(errno));
+    return false;
+  }
+  char line[256];
+  char name[128];
+  double value;
+  while (fgets(line, sizeof(line), in)) {
+    if (line[0] == '#') continue;
+    if (sscanf(line, "%127s %lf", name, &value) == 2)
+      (*baseline)[name] = value;
+  }
+  fclose(in);
+  return true;
+}
+
+int main(int argc, char *argv[]) {
+  const char *baseline_file = NULL;
+  const char *write_baseline_file = NULL;
+  float threshold = DEFAULT_THRESHOLD_PERCENT;
+  int repeat = 5;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "r:b:t:w:")) != -1) {
+    switch (opt) {
+    case 'r':
+      repeat = atoi(optarg);
+      if (repeat < 1) return usage(argv[0]);
+      break;
+    case 'b':
+      baseline_file = strdup(optarg);
+      break;
+    case 't':
+      threshold = atof(optarg);
+      if (threshold <= 0 || threshold >= 100) return usage(argv[0]);
+      break;
+    case 'w':
+      write_baseline_file = strdup(optarg);
+      break;
+    default:
+      return usage(argv[0]);
+    }
+  }
+  if (optind < argc)
+    return usage(argv[0]);
+
+  Log_init("/dev/null");
+
+  std::map<std::string, double> baseline;
+  if (baseline_file && !ReadBaseline(baseline_file, &baseline))
+    return 1;
+
+  MachineControlConfig config;
+  HardwareMapping hardware;
+  InitBenchConfig(&config, &hardware);
+
+  Workload workloads[4];
+  workloads[0].name = "straight-runs";
+  CreateStraightRuns(&workloads[0]);
+  workloads[1].name = "zig-zag";
+  CreateZigZag(&workloads[1]);
+  workloads[2].name = "circles";
+  CreateCircles(&workloads[2]);
+  workloads[3].name = "many-axes";
+  CreateManyAxes(&workloads[3]);
+
+  FILE *out = NULL;
+  if (write_baseline_file) {
+    out = fopen(write_baseline_file, "w");
+    if (!out) {
+      fprintf(stderr, "Can't write baseline %s: %s\n", write_baseline_file,
+              strerror(errno));
+      return 1;
+    }
+    fprintf(out, "# planner-bench baseline; workload moves/s\n");
+  }
+
+  printf("#%-15s %9s %10s %9s %12s", "workload", "moves", "moves/s",
+         "segments", "steps");
+  if (baseline_file) printf(" %10s %7s", "baseline", "change");
+  printf("\n");
+
+  int regressions = 0;
+  for (const Workload &w : workloads) {
+    const Result r = RunWorkload(w, repeat, config, &hardware);
+    printf("%-16s %9zu %10.0f %9llu %12llu", w.name, w.targets.size(),
+           r.moves_per_sec, (unsigned long long) r.segments,
+           (unsigned long long) r.steps);
+    if (baseline_file) {
+      auto found = baseline.find(w.name);
+      if (found == baseline.end()) {
+        printf(" %10s", "-");
+      } else {
+        const double change = 100.0 * (r.moves_per_sec - found->second)
+          / found->second;
+        const bool regressed = change < -threshold;
+        printf(" %10.0f %+6.1f%%%s", found->second, change,
+               regressed ? " REGRESSION" : "");
+        if (regressed) ++regressions;
+      }
+    }
+    printf("\n");
+    if (out) fprintf(out, "%s %.0f\n", w.name, r.moves_per_sec);
+  }
+  if (out) fclose(out);
+
+  if (regressions) {
+    fprintf(stderr, "%d workload(s) more than %.0f%% slower than baseline.\n",
+            regressions, threshold);
+    return 1;
+  }
+  return 0;
+}
@@ -16,11 +16,22 @@
  * You should have received a copy of the GNU General Public License
  * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
  */
+#include <errno.h>
 #include <math.h>
+#include <pthread.h>
+#include <semaphore.h>
 #include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <functional>
 
 #include "common/logging.h"
 #include "common/container.h"
+#include "common/latency-trace.h"
+#include "common/metrics.h"
 
 #include "planner.h"
 #include "hardware-mapping.h"
@@ -36,6 +47,9 @@
 // The speed is initially the aimed goal; if it cannot be reached, the
 // AxisTarget will be modified to contain the actually reachable value. That is
 // used in planning along the path.
+//
+// All speeds and accelerations are in steps/s and steps/s^2 of the
+// defining axis.
 struct AxisTarget {
   int position_steps[GCODE_NUM_AXES];  // Absolute position at end of segment. In steps.
 
@@ -46,6 +60,16 @@ struct AxisTarget {
   unsigned short aux_bits;             // Auxillary bits in this segment; set with M42
   float dx, dy, dz;                    // 3D delta_steps in real units
   float len;                           // 3D length
+
+  // Look-ahead planning values.
+  float accel;                         // Acceleration for this move.
+  float max_entry_speed;               // Junction limit with previous segment.
+  float entry_speed;                   // Planned speed at begin of segment.
+
+#ifdef BEAGLEG_LATENCY_TRACE
+  int trace_line;                      // G-code line this move came from.
+  uint64_t trace_start_ns;             // When it entered the look-ahead.
+#endif
 };
 
 class Planner::Impl {
@@ -55,24 +79,38 @@ public:
        MotorOperations *motor_backend);
   ~Impl();
 
-  void move_machine_steps(const struct AxisTarget *last_pos,
-                          struct AxisTarget *target_pos,
-                          const struct AxisTarget *upcoming);
+  void move_machine_steps(const struct AxisTarget *target_pos,
+                          float v0, float v1);
 
   void assign_steps_to_motors(struct LinearSegmentSteps *command,
                               enum GCodeParserAxis axis,
                               int steps);
 
+  void plan_speeds();
   void issue_motor_move_if_possible();
-  void machine_move(const AxesRegister &axis, float feedrate);
-  void bring_path_to_halt();
+  void issue_oldest_motor_move();
+  // The aux bits are passed in explicitly, as we might be called from the
+  // planner thread while the hardware mapping is changed already.
+  void machine_move(const AxesRegister &axis, float feedrate,
+                    HardwareMapping::AuxBitmap aux_bits);
+
+  // Like machine_move(), but first collects runs of collinear moves with
+  // the same feedrate and aux bits and emits them as one move.
+  void coalesce_move(const AxesRegister &axis, float feedrate,
+                     HardwareMapping::AuxBitmap aux_bits);
+  void flush_coalesced_run();
+  bool run_within_tolerance(const AxesRegister &end);
+  void bring_path_to_halt(HardwareMapping::AuxBitmap aux_bits);
+  void run_at_path_position(const std::function<void()> &action,
+                            bool when_issued);
+  void hand_over_due_actions();
+
+  HardwareMapping::AuxBitmap current_aux_bits() {
+    return hardware_mapping_->GetAuxBits();
+  }
 
   float acceleration_for_move(const int *axis_steps,
-                              enum GCodeParserAxis defining_axis) {
-    return max_axis_accel_[defining_axis];
-    // TODO: we need to scale the acceleration if one of the other axes could't
-    // deal with it. Look at axis steps for that.
-  }
+                              enum GCodeParserAxis defining_axis);
 
   // Avoid division by zero if there is no config defined for axis.
   float axis_delta_to_mm(const AxisTarget *pos, enum GCodeParserAxis axis) {
@@ -81,10 +119,21 @@ public:
     return 0.0f;
   }
 
+  // Call fn(axis) for each axis taking part in motion. For the common
+  // machines, the number of axes is a template parameter, so the loop is
+  // unrolled.
+  template <typename Fn> void for_active_axes(const Fn &fn) const;
+
   float euclidian_speed(const struct AxisTarget *t);
+  float determine_joining_speed(const struct AxisTarget *from,
+                                const struct AxisTarget *to);
 
   void GetCurrentPosition(AxesRegister *pos);
+  float StoppingTime() const { return stopping_time_; }
   int DirectDrive(GCodeParserAxis axis, float distance, float v0, float v1);
+  bool DirectDriveUntilInput(GCodeParserAxis axis, float distance, float v,
+                             uint32_t gpio_def, bool level,
+                             int *trigger_steps, int *total_steps);
   void SetExternalPosition(GCodeParserAxis axis, float pos);
 
   // Given the desired target speed of the defining axis and the steps to be
@@ -101,8 +150,18 @@ private:
   MotorOperations *const motor_ops_;
 
   // Next buffered positions. Written by incoming gcode, read by outgoing
-  // motor movements.
-  RingDeque<AxisTarget, 4> planning_buffer_;
+  // motor movements. Element [0] is the position we already
+  // committed to the motors, all following ones are still being planned.
+  RingDeque<AxisTarget, PLANNER_MAX_LOOKAHEAD + 3> planning_buffer_;
+  int lookahead_segments_;   // Number of pending segments we plan ahead.
+
+  // Moves collected for coalescing, all starting at run_start_, which is the
+  // last position handed to machine_move().
+  AxesRegister run_start_;
+  FixedArray<AxesRegister, PLANNER_MAX_COALESCE> run_points_;
+  int run_count_;
+  float run_feedrate_;
+  HardwareMapping::AuxBitmap run_aux_bits_;
 
   // Pre-calculated per axis limits in steps, steps/s, steps/s^2
   // All arrays are indexed by axis.
@@ -110,27 +169,40 @@ private:
   AxesRegister max_axis_accel_;   // acceleration hz/s
   float highest_accel_;           // hightest accel of all axes.
 
+  // Axes with steps per mm or a motor; all others never move, so the
+  // per-axis values of moves are only calculated for these.
+  GCodeParserAxis active_axes_[GCODE_NUM_AXES];
+  int active_axis_count_;
+
   HardwareMapping::AuxBitmap last_aux_bits_;  // last enqueued aux bits.
 
   bool path_halted_;
   bool position_known_;
-};
 
-static inline int round2int(float x) { return (int) roundf(x); }
+  // Deceleration time from the exit speed of the last issued move. Read
+  // from other threads.
+  std::atomic<float> stopping_time_;
+
+  // Actions to run at the end of the move with the given number. Moves are
+  // counted as they enter the planning buffer; once issued, the action is
+  // handed to the motor backend to be run at that position in its queue, or
+  // run right away if "when_issued".
+  struct PathAction {
+    uint64_t after_moves;
+    bool when_issued;
+    std::function<void()> run;
+  };
+  std::deque<PathAction> path_actions_;
+  uint64_t moves_planned_;
+  uint64_t moves_issued_;
+};
 
-// Speed relative to defining axis
-static float get_speed_factor_for_axis(const struct AxisTarget *t,
-                                       enum GCodeParserAxis request_axis) {
-  if (t->delta_steps[t->defining_axis] == 0) return 0.0f;
-  return 1.0f * t->delta_steps[request_axis] / t->delta_steps[t->defining_axis];
-}
+static MetricCounter planner_segments_metric(
+  "beagleg_planner_segments_total",
+  "Acceleration, travel and deceleration segments planned.");
 
-// Get the speed for a particular axis. Depending on the direction, this can
-// be positive or negative.
-static float get_speed_for_axis(const struct AxisTarget *target,
-                                enum GCodeParserAxis request_axis) {
-  return target->speed * get_speed_factor_for_axis(target, request_axis);
-}
+static inline int round2int(float x) { return (int) roundf(x); }
+static inline float sq(float x) { return x * x; }  // square a number
 
 // Given that we want to travel "s" steps, start with speed "v0",
 // accelerate peak speed v1 and slow down to "v2" with acceleration "a",
@@ -143,21 +215,20 @@ static float euclid_distance(float x, float y, float z) {
   return sqrtf(x*x + y*y + z*z);
 }
 
-// Number of steps to accelerate or decelerate (negative "a") from speed
-// v0 to speed v1. Modifies v1 if we can't reach the speed with the allocated
-// number of steps.
-static float steps_for_speed_change(float a, float v0, float *v1, int max_steps) {
-  // s = v0 * t + a/2 * t^2
-  // v1 = v0 + a*t
-  const float t = (*v1 - v0) / a;
-  // TODO:
-  if (t < 0) Log_error("Error condition: t=%.1f INSUFFICIENT LOOKAHEAD\n", t);
-  float steps = a/2 * t*t + v0 * t;
-  if (steps <= max_steps) return steps;
-  // Ok, we would need more steps than we have available. We correct the speed to what
-  // we actually can reach.
-  *v1 = sqrtf(v0*v0 + 2 * a * max_steps);
-  return max_steps;
+template <int N, typename Fn>
+static inline void for_axes(const GCodeParserAxis *axes, const Fn &fn) {
+  for (int i = 0; i < N; ++i) fn(axes[i]);
+}
+
+template <typename Fn>
+inline void Planner::Impl::for_active_axes(const Fn &fn) const {
+  switch (active_axis_count_) {
+  case 3: for_axes<3>(active_axes_, fn); break;  // XYZ router, 3D printer.
+  case 4: for_axes<4>(active_axes_, fn); break;  // .. with extruder or A axis.
+  case 5: for_axes<5>(active_axes_, fn); break;  // 5-axis mill.
+  default:
+    for (int i = 0; i < active_axis_count_; ++i) fn(active_axes_[i]);
+  }
 }
 
 // Returns true, if all results in zero movement
@@ -171,68 +242,82 @@ static bool subtract_steps(struct LinearSegmentSteps *value,
   return has_nonzero;
 }
 
-static bool within_acceptable_range(float new_val, float old_val, float fraction) {
-  const float max_diff = fraction * old_val;
-  if (new_val < old_val - max_diff) return false;
-  if (new_val > old_val + max_diff) return false;
-  return true;
-}
-
-// Determine the fraction of the speed that "from" should decelerate
-// to at the end of its travel.
-// The way trapezoidal moves work, be still have to decelerate to zero in
-// most times, which is inconvenient. TODO(hzeller): speed matching is not
-// cutting it :)
-static float determine_joining_speed(const struct AxisTarget *from,
-                                     const struct AxisTarget *to,
-                                     const float threshold) {
-  // the dot product of the vectors
-  const float dot = from->dx*to->dx + from->dy*to->dy + from->dz*to->dz;
-  const float mag = from->len * to->len;
-  if (dot == 0) return 0.0f;        // orthogonal 90 degree, full stop
-  if (dot == mag) return to->speed; // codirectional 0 degree, keep accelerating
-
-  // the angle between the vectors
-  const float rad2deg = 180.0 / M_PI;
-  const float angle = fabsf(acosf(dot / mag) * rad2deg);
-
-  if (angle <= threshold)
-    return to->speed;               // in tolerance, keep accelerating
-  if (angle >= 45.0f)
-    return 0.0f;                    // angle to large, come to full stop
-
-  // The angle between the from and to segments is < 45 degrees but greater
-  // than the threshold. Use the "old" logic to determine the joining speed
-  //
-  // Our goal is to figure out what our from defining speed should
-  // be at the end of the move.
-  bool is_first = true;
-  float from_defining_speed = from->speed;
-  const int from_defining_steps = from->delta_steps[from->defining_axis];
-  for (const GCodeParserAxis axis : AllAxes()) {
+// Determine the speed the "from" segment and the "to" segment can be joined
+// with, in steps/s of the defining axis.
+//
+// This uses the junction deviation model: we imagine the corner to be
+// rounded by a circle that stays within cfg_->junction_deviation of the
+// actual corner point. The highest speed in the junction is the one that
+// does not exceed the centripetal acceleration a = v^2 / r allowed by the
+// axes involved. So a straight line joins at full speed, a reversal in
+// direction at zero, with a continuous transition in between.
+float Planner::Impl::determine_joining_speed(const struct AxisTarget *from,
+                                             const struct AxisTarget *to) {
+  // Axes that are not part of the euclidian space can't corner. If they
+  // start, stop or reverse, we need to come to a full stop.
+  for (int i = 0; i < active_axis_count_; ++i) {
+    const GCodeParserAxis axis = active_axes_[i];
+    if (axis <= AXIS_Z) continue;
     const int from_delta = from->delta_steps[axis];
     const int to_delta = to->delta_steps[axis];
-
-    // Quick integer decisions
     if (from_delta == 0 && to_delta == 0) continue;   // uninteresting: no move.
     if (from_delta == 0 || to_delta == 0) return 0.0f; // accel from/to zero
     if ((from_delta < 0 && to_delta > 0) || (from_delta > 0 && to_delta < 0))
       return 0.0f;  // turing around
-
-    float to_speed = get_speed_for_axis(to, axis);
-    // What would this speed translated to our defining axis be ?
-    float speed_conversion = 1.0f * from_defining_steps / from_delta;
-    float goal = to_speed * speed_conversion;
-    if (goal < 0.0f) return 0.0f;
-    if (is_first || within_acceptable_range(goal, from_defining_speed, 1e-5)) {
-      if (goal < from_defining_speed) from_defining_speed = goal;
-      is_first = false;
-    } else {
-      return 0.0f;  // Too far off.
-    }
   }
 
-  return from_defining_speed;
+  if (from->len == 0 || to->len == 0) return 0.0f;
+
+  // the cosine of the angle between the vectors.
+  const float dot = from->dx*to->dx + from->dy*to->dy + from->dz*to->dz;
+  float cos_angle = dot / (from->len * to->len);
+  if (cos_angle > 1.0f) cos_angle = 1.0f;
+  if (cos_angle < -0.9999f) return 0.0f;  // turning around.
+
+  const float rad2deg = 180.0 / M_PI;
+  const float angle = acosf(cos_angle) * rad2deg;
+  if (cos_angle == 1.0f) return to->speed;  // straight line.
+
+  // Without junction deviation, every corner is a full stop; the threshold
+  // angle then lets shallow corners (such as arc segments) pass at speed.
+  if (cfg_->junction_deviation <= 0)
+    return (angle <= cfg_->threshold_angle) ? to->speed : 0.0f;
+
+  // The acceleration in the junction points in the direction of the change
+  // of the unit vectors. Limit it to what all axes can do in that direction.
+  const float junction[3] = { to->dx / to->len - from->dx / from->len,
+                              to->dy / to->len - from->dy / from->len,
+                              to->dz / to->len - from->dz / from->len };
+  const float junction_len = euclid_distance(junction[0], junction[1],
+                                             junction[2]);
+  if (junction_len == 0) return to->speed;
+  float accel = -1;  // mm/s^2
+  for (int i = AXIS_X; i <= AXIS_Z; ++i) {
+    const GCodeParserAxis axis = (GCodeParserAxis) i;
+    const float fraction = fabsf(junction[i]) / junction_len;
+    if (fraction == 0 || cfg_->steps_per_mm[axis] == 0) continue;
+    const float axis_accel = max_axis_accel_[axis] / cfg_->steps_per_mm[axis];
+    if (accel < 0 || axis_accel / fraction < accel)
+      accel = axis_accel / fraction;
+  }
+  if (accel <= 0) return 0.0f;
+
+  // Radius of the circle touching both segments staying within the
+  // junction deviation of the corner: r = d * sin(theta/2) / (1 - sin(theta/2))
+  // with theta being the angle between the segments, i.e. 180 - angle.
+  const float sin_half_theta = sqrtf(0.5f * (1.0f + cos_angle));
+  if (sin_half_theta >= 1.0f) return to->speed;
+  const float radius = cfg_->junction_deviation * sin_half_theta
+    / (1.0f - sin_half_theta);
+  const float junction_speed = sqrtf(accel * radius);  // mm/s
+
+  // Convert to steps/s of each defining axis; the speed we hand over needs
+  // to be valid for both.
+  const float from_speed = junction_speed
+    * abs(from->delta_steps[from->defining_axis]) / from->len;
+  const float to_speed = junction_speed
+    * abs(to->delta_steps[to->defining_axis]) / to->len;
+  return (from_speed < to_speed) ? from_speed : to_speed;
 }
 
 Planner::Impl::Impl(const MachineControlConfig *config,
@@ -240,7 +325,25 @@ Planner::Impl::Impl(const MachineControlConfig *config,
                     MotorOperations *motor_backend)
   : cfg_(config), hardware_mapping_(hardware_mapping),
     motor_ops_(motor_backend),
-    highest_accel_(-1), path_halted_(true), position_known_(true) {
+    lookahead_segments_(config->lookahead_segments), run_count_(0),
+    run_feedrate_(0), run_aux_bits_(0),
+    highest_accel_(-1), active_axis_count_(0), last_aux_bits_(0),
+    path_halted_(true), position_known_(true), stopping_time_(0),
+    moves_planned_(0), moves_issued_(0) {
+  if (lookahead_segments_ < 1 || lookahead_segments_ > PLANNER_MAX_LOOKAHEAD) {
+    lookahead_segments_ = (lookahead_segments_ < 1) ? 1 : PLANNER_MAX_LOOKAHEAD;
+    Log_info("Look-ahead segments clamped to %d", lookahead_segments_);
+  }
+  for (const GCodeParserAxis axis : AllAxes()) {
+    if (cfg_->steps_per_mm[axis] != 0 || hardware_mapping_->GetMotorMap(axis))
+      active_axes_[active_axis_count_++] = axis;
+  }
+  // The values of the other axes are never written; start them all zero.
+  for (int i = 0; i < PLANNER_MAX_LOOKAHEAD + 3; ++i) {
+    bzero(planning_buffer_.append(), sizeof(AxisTarget));
+    planning_buffer_.pop_front();
+  }
+
   // Initial machine position. We assume the homed position here, which is
   // wherever the endswitch is for each axis.
   struct AxisTarget *init_axis = planning_buffer_.append();
@@ -254,9 +357,14 @@ Planner::Impl::Impl(const MachineControlConfig *config,
   position_known_ = true;
 
   float lowest_accel = cfg_->max_feedrate[AXIS_X] * cfg_->steps_per_mm[AXIS_X];
+  // A real-time speed override scales time. Leave room for the largest one:
+  // speeds scale with it, accelerations with its square.
+  const float override = std::max(1.0f, cfg_->max_speed_override);
   for (const GCodeParserAxis i : AllAxes()) {
-    max_axis_speed_[i] = cfg_->max_feedrate[i] * cfg_->steps_per_mm[i];
-    const float accel = cfg_->acceleration[i] * cfg_->steps_per_mm[i];
+    max_axis_speed_[i] = cfg_->max_feedrate[i] * cfg_->steps_per_mm[i]
+      / override;
+    const float accel = cfg_->acceleration[i] * cfg_->steps_per_mm[i]
+      / (override * override);
     max_axis_accel_[i] = accel;
     if (accel > highest_accel_)
       highest_accel_ = accel;
@@ -266,7 +374,7 @@ Planner::Impl::Impl(const MachineControlConfig *config,
 }
 
 Planner::Impl::~Impl() {
-  bring_path_to_halt();
+  bring_path_to_halt(current_aux_bits());
 }
 
 // Assign steps to all the motors responsible for given axis.
@@ -286,15 +394,35 @@ float Planner::Impl::clamp_to_limits(enum GCodeParserAxis defining_axis,
   float ratio, max_offset = 1, offset;
   const FloatAxisConfig &max_axis_speed = cfg_->max_feedrate;
   const FloatAxisConfig &steps_per_mm = cfg_->steps_per_mm;
-  for (const GCodeParserAxis i : AllAxes()) {
-    ratio = fabs(((float) axis_steps[i] * steps_per_mm[defining_axis])
-            / (axis_steps[defining_axis] * steps_per_mm[i]));
-    offset = ratio > 0 ? max_axis_speed[i] / (target_speed * ratio) : 1;
-    if (offset < max_offset) max_offset = offset;
-  }
+  for_active_axes([&](const GCodeParserAxis i) {
+      ratio = fabs(((float) axis_steps[i] * steps_per_mm[defining_axis])
+                   / (axis_steps[defining_axis] * steps_per_mm[i]));
+      offset = ratio > 0 ? max_axis_speed[i] / (target_speed * ratio) : 1;
+      if (offset < max_offset) max_offset = offset;
+    });
   return target_speed * max_offset;
 }
 
+// Acceleration of the defining axis in steps/s^2 that none of the moving
+// axes exceeds. An axis doing the fraction steps[i] / steps[defining_axis]
+// of the steps also only gets that fraction of the acceleration, so moves
+// mostly along fast axes can use their acceleration even if an axis with
+// a lower limit moves a little as well. Axes without a configured
+// acceleration don't limit.
+float Planner::Impl::acceleration_for_move(const int *axis_steps,
+                                           enum GCodeParserAxis defining_axis) {
+  const float defining_steps = abs(axis_steps[defining_axis]);
+  float accel = max_axis_accel_[defining_axis];
+  for_active_axes([&](const GCodeParserAxis i) {
+      const int steps = abs(axis_steps[i]);
+      if (steps == 0 || i == defining_axis || max_axis_accel_[i] <= 0)
+        return;
+      const float axis_limit = max_axis_accel_[i] * defining_steps / steps;
+      if (accel <= 0 || axis_limit < accel) accel = axis_limit;
+    });
+  return accel;
+}
+
 float Planner::Impl::euclidian_speed(const struct AxisTarget *t) {
   float speed_factor = 1.0;
   if (t->len > 0) {
@@ -306,27 +434,14 @@ float Planner::Impl::euclidian_speed(const struct AxisTarget *t) {
 
 // Move the given number of machine steps for each axis.
 //
-// This will be up to three segments: accelerating from last_pos speed to
-// target speed, regular travel, and decelerating to the speed that the
-// next segment is never forced to decelerate, but stays at speed or accelerate.
+// This will be up to three segments: accelerating from v0 to the target
+// speed, regular travel, and decelerating to v1, the entry speed of the
+// following segment. The look-ahead planning already made sure that v0 and
+// v1 can be joined within the number of steps available in this move.
 //
 // The segments are sent to the motor operations backend.
-//
-// Since we calculate the deceleration, this modifies the speed of target_pos
-// to reflect what the last speed was at the end of the move.
-void Planner::Impl::move_machine_steps(const struct AxisTarget *last_pos,
-                                       struct AxisTarget *target_pos,
-                                       const struct AxisTarget *upcoming) {
-  if (target_pos->delta_steps[target_pos->defining_axis] == 0) {
-    if (last_aux_bits_ != target_pos->aux_bits) {
-      // Special treatment: bits changed since last time, let's push them through.
-      struct LinearSegmentSteps bit_set_command = {};
-      bit_set_command.aux_bits = target_pos->aux_bits;
-      motor_ops_->Enqueue(bit_set_command);
-      last_aux_bits_ = target_pos->aux_bits;
-    }
-    return;
-  }
+void Planner::Impl::move_machine_steps(const struct AxisTarget *target_pos,
+                                       float v0, float v1) {
   struct LinearSegmentSteps accel_command = {};
   struct LinearSegmentSteps move_command = {};
   struct LinearSegmentSteps decel_command = {};
@@ -335,151 +450,177 @@ void Planner::Impl::move_machine_steps(const struct AxisTarget *last_pos,
 
   // Aux bits are set synchronously with what we need.
   move_command.aux_bits = target_pos->aux_bits;
+  move_command.v_feed = target_pos->speed;
   const enum GCodeParserAxis defining_axis = target_pos->defining_axis;
 
   // Common settings.
   memcpy(&accel_command, &move_command, sizeof(accel_command));
   memcpy(&decel_command, &move_command, sizeof(decel_command));
 
-  // Always start from the last steps/sec speed to avoid motion glitches.
-  // The planner will use that speed to determine what the peak speed for
-  // this move is and if we need to accel to reach the desired target speed.
-  const float last_speed = last_pos->speed;
-
-  // We need to arrive at a speed that the upcoming move does not have
-  // to decelerate further (after all, it has a fixed feed-rate it should not
-  // go over).
-  float next_speed = determine_joining_speed(target_pos, upcoming,
-                                             cfg_->threshold_angle);
-  // Clamp the next speed to insure that this segment does not go over.
-  if (next_speed > target_pos->speed)
-    next_speed = target_pos->speed;
-
   const int *axis_steps = target_pos->delta_steps;  // shortcut.
   const int abs_defining_axis_steps = abs(axis_steps[defining_axis]);
-  const float a = acceleration_for_move(axis_steps, defining_axis);
-  const float peak_speed = get_peak_speed(abs_defining_axis_steps,
-                                          last_speed, next_speed, a);
+  assert(abs_defining_axis_steps > 0);
+  const float a = target_pos->accel;
+
+  float peak_speed = get_peak_speed(abs_defining_axis_steps, v0, v1, a);
+  if (peak_speed > target_pos->speed)
+    peak_speed = target_pos->speed;  // Don't go faster than desired v.
+  // Rounding errors might bring us slightly below the speeds to join.
+  if (peak_speed < v0) peak_speed = v0;
+  if (peak_speed < v1) peak_speed = v1;
   assert(peak_speed > 0);
 
   // TODO: if we only have < 5 steps or so, we should not even consider
   // accelerating or decelerating, but just do one speed.
 
-  if (peak_speed < target_pos->speed) {
-    target_pos->speed = peak_speed;  // Don't manage to accelerate to desired v
+  // s = (v1^2 - v0^2) / (2 * a)
+  float accel_fraction = (sq(peak_speed) - sq(v0)) / (2 * a)
+    / abs_defining_axis_steps;
+  float decel_fraction = (sq(peak_speed) - sq(v1)) / (2 * a)
+    / abs_defining_axis_steps;
+  if (accel_fraction + decel_fraction > 1.0f) {
+    // Only possible due to rounding; the planner made sure it fits.
+    const float scale = 1.0f / (accel_fraction + decel_fraction);
+    accel_fraction *= scale;
+    decel_fraction *= scale;
   }
 
-  // Make sure the target feedrate for the move is clamped to what all the
-  // moving axes can reach.
-  float target_feedrate = target_pos->speed / cfg_->steps_per_mm[defining_axis];
-  target_feedrate = clamp_to_limits(defining_axis, target_feedrate, axis_steps);
-  target_pos->speed = target_feedrate * cfg_->steps_per_mm[defining_axis];
-
-  const float accel_fraction =
-    (last_speed < target_pos->speed)
-    ? steps_for_speed_change(a, last_speed, &target_pos->speed,
-                             abs_defining_axis_steps) / abs_defining_axis_steps
-    : 0;
-
-  // We only decelerate if the upcoming speed is _slower_
-  float dummy_next_speed = next_speed;  // Don't care to modify; we don't have
-  const float decel_fraction =
-    (next_speed < target_pos->speed)
-    ? steps_for_speed_change(-a, target_pos->speed, &dummy_next_speed,
-                             abs_defining_axis_steps) / abs_defining_axis_steps
-    : 0;
-
-#if 0
-  // Useful debugging info.
-  // TODO: we get a decel glitch when the last_pos has accelerated to a speed
-  // that is faster than the target can decelerate from.
-  if (dummy_next_speed != next_speed) {
-    fprintf(stderr, "  \033[1m\033[31mGLITCH\033[0m "
-                    "- move too short for full decel (reached v1: %10.2f)\n",
-            dummy_next_speed);
-  }
-#endif
-
-  assert(accel_fraction + decel_fraction <= 1.0 + 1e-3);
-
-#if 0
-  // fudging: if we have tiny acceleration segments, don't do these at all
-  // but only do speed; otherwise we have a lot of rattling due to many little
-  // segments of acceleration/deceleration (e.g. for G2/G3).
-  // This is not optimal. Ideally, we would actually calculate in terms of
-  // jerk and optimize to stay within that constraint.
-  const int accel_decel_steps
-    = (accel_fraction + decel_fraction) * abs_defining_axis_steps;
-  const float accel_decel_mm
-    = (accel_decel_steps / cfg_->steps_per_mm[defining_axis]);
-  const char do_accel = (accel_decel_mm > 2 || accel_decel_steps > 16);
-#else
-  const char do_accel = 1;
-#endif
-
-  bool has_accel = false;
-  bool has_move = false;
-  bool has_decel = false;
-
-  if (do_accel && accel_fraction * abs_defining_axis_steps > 0) {
-    has_accel = true;
-    accel_command.v0 = last_speed;           // Last speed of defining axis
-    accel_command.v1 = target_pos->speed;    // New speed of defining axis
+  // Speed changes that don't even amount to a single step on the defining
+  // axis are folded into the neighboring segment.
+  const bool has_accel = round2int(accel_fraction * abs_defining_axis_steps) > 0;
+  const bool has_decel = round2int(decel_fraction * abs_defining_axis_steps) > 0;
 
+  if (has_accel) {
     // Now map axis steps to actual motor driver
-    for (const GCodeParserAxis a : AllAxes()) {
-      const int accel_steps = round2int(accel_fraction * axis_steps[a]);
-      assign_steps_to_motors(&accel_command, a, accel_steps);
-    }
-  } else {
-    if (last_speed) target_pos->speed = last_speed; // No accel so use the last speed
+    for_active_axes([&](const GCodeParserAxis a) {
+        const int accel_steps = round2int(accel_fraction * axis_steps[a]);
+        assign_steps_to_motors(&accel_command, a, accel_steps);
+      });
   }
 
-  move_command.v0 = target_pos->speed;
-  move_command.v1 = target_pos->speed;
-
-  if (do_accel && decel_fraction * abs_defining_axis_steps > 0) {
-    has_decel = true;
-    decel_command.v0 = target_pos->speed;
-    decel_command.v1 = next_speed;
-    target_pos->speed = next_speed;
-
+  if (has_decel) {
     // Now map axis steps to actual motor driver
-    for (const GCodeParserAxis a : AllAxes()) {
-      const int decel_steps = round2int(decel_fraction * axis_steps[a]);
-      assign_steps_to_motors(&decel_command, a, decel_steps);
-    }
+    for_active_axes([&](const GCodeParserAxis a) {
+        const int decel_steps = round2int(decel_fraction * axis_steps[a]);
+        assign_steps_to_motors(&decel_command, a, decel_steps);
+      });
   }
 
   // Move is everything that hasn't been covered in speed changes.
   // So we start with all steps and subtract steps done in acceleration and
   // deceleration.
-  for (const GCodeParserAxis a : AllAxes()) {
-    assign_steps_to_motors(&move_command, a, axis_steps[a]);
-  }
+  for_active_axes([&](const GCodeParserAxis a) {
+      assign_steps_to_motors(&move_command, a, axis_steps[a]);
+    });
   subtract_steps(&move_command, accel_command);
-  has_move = subtract_steps(&move_command, decel_command);
+  const bool has_move = subtract_steps(&move_command, decel_command);
+
+  // Speeds of defining axis. Make sure the segments we actually emit join
+  // each other without a jump, starting at v0 and ending at v1.
+  accel_command.v0 = v0;
+  accel_command.v1 = (has_move || has_decel) ? peak_speed : v1;
+  move_command.v0 = has_accel ? peak_speed : v0;
+  move_command.v1 = has_decel ? peak_speed : v1;
+  decel_command.v0 = (has_accel || has_move) ? peak_speed : v0;
+  decel_command.v1 = v1;
+
+  // Only ramps between the speeds planned for them change speed with "a".
+  // Speed changes folded into a neighbor are done in fewer steps; their
+  // acceleration is derived from speeds and steps.
+  if (has_move || has_decel) accel_command.acceleration = a;
+  if (has_accel || has_move) decel_command.acceleration = a;
 
   if (cfg_->synchronous) motor_ops_->WaitQueueEmpty();
 
   if (has_accel) motor_ops_->Enqueue(accel_command);
   if (has_move) motor_ops_->Enqueue(move_command);
   if (has_decel) motor_ops_->Enqueue(decel_command);
+  planner_segments_metric.Increment(has_accel + has_move + has_decel);
 
   last_aux_bits_ = target_pos->aux_bits;
 }
 
-// If we have enough data in the queue, issue motor move.
+// Plan the speeds of all the segments in the look-ahead buffer.
+//
+// The newest segment always needs to be able to come to a full stop, as we
+// don't know yet what is coming next. Going backwards from there, each entry
+// speed is raised to the highest value that still allows to decelerate to the
+// entry speed of the following segment (but not above the junction limit).
+// Entry speeds only ever go up while new segments arrive, so as soon as we
+// see an entry speed that does not change, none of the earlier ones will
+// change either and we can stop.
+//
+// A second, forward, pass then limits the entry speeds to what we can
+// actually reach when accelerating through the previous segment.
+//
+// The entry speed of planning_buffer_[1] is fixed: the segment before it
+// has already been sent to the motors.
+void Planner::Impl::plan_speeds() {
+  const int newest = planning_buffer_.size() - 1;
+  float next_entry_speed = 0;  // Newest segment needs to be able to stop.
+  int forward_start = 1;
+  for (int i = newest; i > 1; --i) {
+    struct AxisTarget *t = planning_buffer_[i];
+    float v = sqrtf(sq(next_entry_speed)
+                    + 2 * t->accel * abs(t->delta_steps[t->defining_axis]));
+    if (v > t->max_entry_speed)
+      v = t->max_entry_speed;
+    if (i != newest && v == t->entry_speed) {
+      forward_start = i;
+      break;  // No change; earlier segments stay the same.
+    }
+    t->entry_speed = v;
+    next_entry_speed = v;
+  }
+
+  for (int i = forward_start; i < newest; ++i) {
+    const struct AxisTarget *t = planning_buffer_[i];
+    struct AxisTarget *next = planning_buffer_[i+1];
+    const float reachable = sqrtf(sq(t->entry_speed)
+                                  + 2 * t->accel
+                                  * abs(t->delta_steps[t->defining_axis]));
+    if (next->entry_speed > reachable)
+      next->entry_speed = reachable;
+  }
+}
+
+// Send the oldest planned segment to the motors. It then becomes the
+// established position in planning_buffer_[0].
+void Planner::Impl::issue_oldest_motor_move() {
+  const struct AxisTarget *target = planning_buffer_[1];
+  const float exit_speed = (planning_buffer_.size() > 2)
+    ? planning_buffer_[2]->entry_speed
+    : 0.0f;
+#ifdef BEAGLEG_LATENCY_TRACE
+  LatencyTraceRecord(LATENCY_LOOKAHEAD, target->trace_start_ns,
+                     target->trace_line);
+  // The segments belong to the line of this move, not the one parsed now.
+  const int current_line = LatencyTraceLine();
+  LatencyTraceSetLine(target->trace_line);
+#endif
+  move_machine_steps(target, target->entry_speed, exit_speed);
+  LATENCY_TRACE_SET_LINE(current_line);
+  planning_buffer_.pop_front();
+  ++moves_issued_;
+  hand_over_due_actions();
+  // The next move starts with our exit speed and is planned to be able to
+  // brake with its acceleration.
+  if (planning_buffer_.size() > 1 && planning_buffer_[1]->accel > 0) {
+    stopping_time_ = exit_speed / planning_buffer_[1]->accel;
+  } else {
+    stopping_time_ = 0;
+  }
+}
+
+// If we have more segments than we need for look-ahead, issue motor moves.
 void Planner::Impl::issue_motor_move_if_possible() {
-  if (planning_buffer_.size() >= 3) {
-    move_machine_steps(planning_buffer_[0],  // Current established position.
-                       planning_buffer_[1],  // Position we want to move to.
-                       planning_buffer_[2]); // Next upcoming.
-    planning_buffer_.pop_front();
+  while ((int)planning_buffer_.size() - 1 > lookahead_segments_) {
+    issue_oldest_motor_move();
   }
 }
 
-void Planner::Impl::machine_move(const AxesRegister &axis, float feedrate) {
+void Planner::Impl::machine_move(const AxesRegister &axis, float feedrate,
+                                 HardwareMapping::AuxBitmap aux_bits) {
   assert(position_known_);   // call SetExternalPosition() after DirectDrive()
   // We always have a previous position.
   struct AxisTarget *previous = planning_buffer_.back();
@@ -490,20 +631,20 @@ void Planner::Impl::machine_move(const AxesRegister &axis, float feedrate) {
   // Real world -> machine coordinates. Here, we are rounding to the next full
   // step, but we never accumulate the error, as we always use the absolute
   // position as reference.
-  for (const GCodeParserAxis a : AllAxes()) {
-    new_pos->position_steps[a] = round2int(axis[a] * cfg_->steps_per_mm[a]);
-    new_pos->delta_steps[a] = new_pos->position_steps[a] - previous->position_steps[a];
-
-    // The defining axis is the one that has to travel the most steps. It defines
-    // the frequency to go.
-    // All the other axes are doing a fraction of the defining axis.
-    if (abs(new_pos->delta_steps[a]) > max_steps) {
-      max_steps = abs(new_pos->delta_steps[a]);
-      defining_axis = a;
-    }
-  }
-
-  if (max_steps == 0) {
+  for_active_axes([&](const GCodeParserAxis a) {
+      new_pos->position_steps[a] = round2int(axis[a] * cfg_->steps_per_mm[a]);
+      new_pos->delta_steps[a] = new_pos->position_steps[a] - previous->position_steps[a];
+
+      // The defining axis is the one that has to travel the most steps. It
+      // defines the frequency to go.
+      // All the other axes are doing a fraction of the defining axis.
+      if (abs(new_pos->delta_steps[a]) > max_steps) {
+        max_steps = abs(new_pos->delta_steps[a]);
+        defining_axis = a;
+      }
+    });
+
+  if (max_steps <= 0) {
     // Nothing to do, ignore this move.
     planning_buffer_.pop_back();
     return;
@@ -511,8 +652,12 @@ void Planner::Impl::machine_move(const AxesRegister &axis, float feedrate) {
 
   assert(max_steps > 0);
 
-  new_pos->aux_bits = hardware_mapping_->GetAuxBits();
+  new_pos->aux_bits = aux_bits;
   new_pos->defining_axis = defining_axis;
+#ifdef BEAGLEG_LATENCY_TRACE
+  new_pos->trace_line = LatencyTraceLine();
+  new_pos->trace_start_ns = LatencyTraceNow();
+#endif
 
   // Work out the real units values for the euclidian axes now to avoid
   // having to replicate the calcs later.
@@ -527,29 +672,126 @@ void Planner::Impl::machine_move(const AxesRegister &axis, float feedrate) {
   if (new_pos->speed > max_axis_speed_[defining_axis])
     new_pos->speed = max_axis_speed_[defining_axis];
 
+  // Make sure the target feedrate for the move is clamped to what all the
+  // moving axes can reach.
+  float target_feedrate = new_pos->speed / cfg_->steps_per_mm[defining_axis];
+  target_feedrate = clamp_to_limits(defining_axis, target_feedrate,
+                                    new_pos->delta_steps);
+  new_pos->speed = target_feedrate * cfg_->steps_per_mm[defining_axis];
+
+  new_pos->accel = acceleration_for_move(new_pos->delta_steps, defining_axis);
+
+  if (planning_buffer_.size() == 2) {
+    // The previous segment is already with the motors and comes to a stop.
+    new_pos->max_entry_speed = 0;
+  } else {
+    // The speed we can join the previous segment with. Clamp to make sure
+    // that neither of the segments goes over its speed.
+    float joining_speed = determine_joining_speed(previous, new_pos);
+    if (joining_speed > previous->speed) joining_speed = previous->speed;
+    if (joining_speed > new_pos->speed) joining_speed = new_pos->speed;
+    new_pos->max_entry_speed = joining_speed;
+  }
+  new_pos->entry_speed = new_pos->max_entry_speed;
+  ++moves_planned_;
+
+  plan_speeds();
   issue_motor_move_if_possible();
   path_halted_ = false;
 }
 
-void Planner::Impl::bring_path_to_halt() {
+// Check if all points in the run are within the tolerance of the straight
+// line from the start of the run to the new end point.
+bool Planner::Impl::run_within_tolerance(const AxesRegister &end) {
+  float chord_len2 = 0;
+  for_active_axes([&](const GCodeParserAxis a) {
+      const float d = end[a] - run_start_[a];
+      chord_len2 += d * d;
+    });
+  if (chord_len2 <= 0) return false;
+  const float max_dist2 = cfg_->coalesce_tolerance * cfg_->coalesce_tolerance;
+  for (int i = 0; i < run_count_; ++i) {
+    const AxesRegister &p = run_points_[i];
+    float dot = 0;
+    for_active_axes([&](const GCodeParserAxis a) {
+        dot += (p[a] - run_start_[a]) * (end[a] - run_start_[a]);
+      });
+    // Projection onto the chord; points beyond its ends are measured to
+    // the nearest end point.
+    float t = dot / chord_len2;
+    if (t < 0) t = 0;
+    if (t > 1) t = 1;
+    float dist2 = 0;
+    for_active_axes([&](const GCodeParserAxis a) {
+        const float d = p[a] - (run_start_[a] + t * (end[a] - run_start_[a]));
+        dist2 += d * d;
+      });
+    if (dist2 > max_dist2) return false;
+  }
+  return true;
+}
+
+void Planner::Impl::flush_coalesced_run() {
+  if (run_count_ == 0) return;
+  run_start_ = run_points_[run_count_ - 1];
+  run_count_ = 0;
+  machine_move(run_start_, run_feedrate_, run_aux_bits_);
+}
+
+void Planner::Impl::coalesce_move(const AxesRegister &axis, float feedrate,
+                                  HardwareMapping::AuxBitmap aux_bits) {
+  if (cfg_->coalesce_tolerance <= 0) {
+    machine_move(axis, feedrate, aux_bits);
+    return;
+  }
+  if (run_count_ > 0
+      && (run_count_ == PLANNER_MAX_COALESCE
+          || feedrate != run_feedrate_ || aux_bits != run_aux_bits_
+          || !run_within_tolerance(axis))) {
+    flush_coalesced_run();
+  }
+  run_points_[run_count_++] = axis;
+  run_feedrate_ = feedrate;
+  run_aux_bits_ = aux_bits;
+}
+
+void Planner::Impl::bring_path_to_halt(HardwareMapping::AuxBitmap aux_bits) {
+  flush_coalesced_run();
   if (path_halted_) return;
-  // Enqueue a new position that is the same position as the last
-  // one seen, but zero speed. That will allow the previous segment to
-  // slow down. Enqueue.
-  struct AxisTarget *previous = planning_buffer_.back();
-  struct AxisTarget *new_pos = planning_buffer_.append();
-  for (const GCodeParserAxis a : AllAxes()) {
-    new_pos->position_steps[a] = previous->position_steps[a];
-    new_pos->delta_steps[a] = 0;
+  // The newest segment is always planned to come to a full stop at its end,
+  // so all we need to do is to send out everything we have.
+  while (planning_buffer_.size() > 1) {
+    issue_oldest_motor_move();
+  }
+
+  if (last_aux_bits_ != aux_bits) {
+    // Special treatment: bits changed since last time, let's push them through.
+    struct LinearSegmentSteps bit_set_command = {};
+    bit_set_command.aux_bits = aux_bits;
+    motor_ops_->Enqueue(bit_set_command);
+    last_aux_bits_ = aux_bits;
   }
-  new_pos->defining_axis = AXIS_X;
-  new_pos->speed = 0;
-  new_pos->aux_bits = hardware_mapping_->GetAuxBits();
-  new_pos->dx = new_pos->dy = new_pos->dz = new_pos->len = 0.0;
-  issue_motor_move_if_possible();
   path_halted_ = true;
 }
 
+void Planner::Impl::run_at_path_position(const std::function<void()> &action,
+                                         bool when_issued) {
+  flush_coalesced_run();
+  path_actions_.push_back({moves_planned_, when_issued, action});
+  hand_over_due_actions();
+}
+
+void Planner::Impl::hand_over_due_actions() {
+  while (!path_actions_.empty()
+         && path_actions_.front().after_moves <= moves_issued_) {
+    if (path_actions_.front().when_issued)
+      path_actions_.front().run();
+    else
+      motor_ops_->RunAtQueuePosition(path_actions_.front().run);
+    path_actions_.pop_front();
+  }
+}
+
 void Planner::Impl::GetCurrentPosition(AxesRegister *pos) {
   pos->zero();
   PhysicalStatus physical_status;
@@ -568,7 +810,7 @@ void Planner::Impl::GetCurrentPosition(AxesRegister *pos) {
 
 int Planner::Impl::DirectDrive(GCodeParserAxis axis, float distance,
                                float v0, float v1) {
-  bring_path_to_halt();     // Precondition. Let's just do it for good measure.
+  bring_path_to_halt(current_aux_bits());  // Precondition. Let's just do it for good measure.
   position_known_ = false;
 
   const float steps_per_mm = cfg_->steps_per_mm[axis];
@@ -593,10 +835,32 @@ int Planner::Impl::DirectDrive(GCodeParserAxis axis, float distance,
   return segment_move_steps;
 }
 
+bool Planner::Impl::DirectDriveUntilInput(GCodeParserAxis axis,
+                                          float distance, float v,
+                                          uint32_t gpio_def, bool level,
+                                          int *trigger_steps,
+                                          int *total_steps) {
+  bring_path_to_halt(current_aux_bits());
+  position_known_ = false;
+
+  const float steps_per_mm = cfg_->steps_per_mm[axis];
+
+  struct LinearSegmentSteps move_command = {};
+  move_command.v0 = 0;
+  move_command.v1 = std::min(v * steps_per_mm, (float)max_axis_speed_[axis]);
+  move_command.aux_bits = hardware_mapping_->GetAuxBits();
+  assign_steps_to_motors(&move_command, axis, distance * steps_per_mm);
+
+  return motor_ops_->MoveUntilInput(move_command, max_axis_accel_[axis],
+                                    gpio_def, level,
+                                    trigger_steps, total_steps);
+}
+
 void Planner::Impl::SetExternalPosition(GCodeParserAxis axis, float pos) {
   assert(path_halted_);   // Precondition.
   position_known_ = true;
 
+  run_start_[axis] = pos;
   const int motor_position = pos * cfg_->steps_per_mm[axis];
   planning_buffer_.back()->position_steps[axis] = motor_position;
   planning_buffer_[0]->position_steps[axis] = motor_position;
@@ -608,33 +872,252 @@ void Planner::Impl::SetExternalPosition(GCodeParserAxis axis, float pos) {
   }
 }
 
+// Runs the planner in its own thread. Requests are handed over through a
+// lock-free queue, so the caller only blocks if the queue is full.
+class Planner::Worker {
+public:
+  explicit Worker(Planner::Impl *impl) : impl_(impl), unannounced_(0) {
+    sem_init(&available_, 0, 0);
+    sem_init(&space_, 0, PLANNER_THREAD_QUEUE_SIZE - 1);  // One slot unused.
+    sem_init(&idle_, 0, 0);
+    pthread_create(&thread_, NULL, &ThreadMain, this);
+  }
+
+  ~Worker() {
+    Request quit = {};
+    quit.type = Request::QUIT;
+    Send(quit);
+    pthread_join(thread_, NULL);
+    sem_destroy(&idle_);
+    sem_destroy(&space_);
+    sem_destroy(&available_);
+  }
+
+  void Enqueue(const AxesRegister &target_pos, float speed,
+               HardwareMapping::AuxBitmap aux_bits) {
+    Request move;
+    move.type = Request::MOVE;
+    move.target = target_pos;
+    move.speed = speed;
+    move.aux_bits = aux_bits;
+#ifdef BEAGLEG_LATENCY_TRACE
+    move.trace_line = LatencyTraceLine();
+#endif
+    Send(move);
+  }
+
+  void Enqueue(const AxesRegister *target_pos, const float *speed, int count,
+               HardwareMapping::AuxBitmap aux_bits) {
+    Request move;
+    move.type = Request::MOVE;
+    move.aux_bits = aux_bits;
+#ifdef BEAGLEG_LATENCY_TRACE
+    move.trace_line = LatencyTraceLine();
+#endif
+    for (int i = 0; i < count; ++i) {
+      move.target = target_pos[i];
+      move.speed = speed[i];
+      Push(move);
+    }
+    Announce();
+  }
+
+  void BringPathToHalt(HardwareMapping::AuxBitmap aux_bits) {
+    Request halt = {};
+    halt.type = Request::HALT;
+    halt.aux_bits = aux_bits;
+    Send(halt);
+  }
+
+  void RunAtPathPosition(const std::function<void()> &action,
+                         bool when_issued) {
+    Request run = {};
+    run.type = Request::ACTION;
+    run.action = new std::function<void()>(action);  // Owned by the thread.
+    run.when_issued = when_issued;
+    Send(run);
+  }
+
+  // Wait until all requests sent so far are processed.
+  void WaitIdle() {
+    Request sync = {};
+    sync.type = Request::SYNC;
+    Send(sync);
+    while (sem_wait(&idle_) != 0 && errno == EINTR) {}
+  }
+
+  // The physical position only depends on the motor backend, which allows
+  // reading it while the planner thread is sending segments. So no need to
+  // wait for the planner thread, which might be blocked on a full queue.
+  void GetCurrentPosition(AxesRegister *pos) {
+    impl_->GetCurrentPosition(pos);
+  }
+
+private:
+  struct Request {
+    enum Type { MOVE, HALT, ACTION, SYNC, QUIT } type;
+    AxesRegister target;
+    float speed;
+    HardwareMapping::AuxBitmap aux_bits;
+    std::function<void()> *action;
+    bool when_issued;
+#ifdef BEAGLEG_LATENCY_TRACE
+    int trace_line;
+#endif
+  };
+
+  void Send(const Request &request) {
+    Push(request);
+    Announce();
+  }
+
+  // Push request to the queue without notifying the planner thread yet.
+  void Push(const Request &request) {
+    // If the queue is full, the planner thread needs to know about
+    // everything we pushed so far to make progress, then we wait for it to
+    // take something out.
+    if (sem_trywait(&space_) != 0) {
+      Announce();
+      while (sem_wait(&space_) != 0 && errno == EINTR) {}
+    }
+    const bool pushed = queue_.TryPush(request);
+    assert(pushed);  // We only get here if there is space.
+    (void) pushed;
+    ++unannounced_;
+  }
+
+  // Notify planner thread of all requests pushed.
+  void Announce() {
+    for (/**/; unannounced_ > 0; --unannounced_)
+      sem_post(&available_);
+  }
+
+  static void *ThreadMain(void *arg) {
+    reinterpret_cast<Worker*>(arg)->Run();
+    return NULL;
+  }
+
+  void Run() {
+    Request request;
+    for (;;) {
+      while (sem_wait(&available_) != 0 && errno == EINTR) {}
+      const bool got_request = queue_.TryPop(&request);
+      assert(got_request);  // We only get here after something was pushed.
+      (void) got_request;
+      sem_post(&space_);
+      switch (request.type) {
+      case Request::MOVE:
+        LATENCY_TRACE_SET_LINE(request.trace_line);
+        impl_->coalesce_move(request.target, request.speed, request.aux_bits);
+        break;
+      case Request::HALT:
+        impl_->bring_path_to_halt(request.aux_bits);
+        break;
+      case Request::ACTION:
+        impl_->run_at_path_position(*request.action, request.when_issued);
+        delete request.action;
+        break;
+      case Request::SYNC:
+      case Request::QUIT:
+        break;
+      }
+      if (request.type == Request::SYNC) sem_post(&idle_);
+      if (request.type == Request::QUIT) return;
+    }
+  }
+
+  Planner::Impl *const impl_;
+  SPSCQueue<Request, PLANNER_THREAD_QUEUE_SIZE> queue_;
+  int unannounced_;   // Requests pushed, but not posted to available_ yet.
+  sem_t available_;   // Number of requests available in the queue.
+  sem_t space_;       // Number of free slots in the queue.
+  sem_t idle_;        // Posted when a SYNC request has been processed.
+  pthread_t thread_;
+};
+
 // -- public interface
 
 Planner::Planner(const MachineControlConfig *config,
                  HardwareMapping *hardware_mapping,
                  MotorOperations *motor_backend)
-  : impl_(new Impl(config, hardware_mapping, motor_backend)) {
+  : impl_(new Impl(config, hardware_mapping, motor_backend)),
+    worker_(config->threaded_planner ? new Worker(impl_) : NULL) {
 }
 
-Planner::~Planner() { delete impl_; }
+Planner::~Planner() {
+  delete worker_;
+  delete impl_;
+}
 
 void Planner::Enqueue(const AxesRegister &target_pos, float speed) {
-  impl_->machine_move(target_pos, speed);
+  if (worker_)
+    worker_->Enqueue(target_pos, speed, impl_->current_aux_bits());
+  else
+    impl_->coalesce_move(target_pos, speed, impl_->current_aux_bits());
+}
+
+void Planner::Enqueue(const AxesRegister *target_pos, const float *speed,
+                      int count) {
+  const HardwareMapping::AuxBitmap aux_bits = impl_->current_aux_bits();
+  if (worker_) {
+    worker_->Enqueue(target_pos, speed, count, aux_bits);
+  } else {
+    for (int i = 0; i < count; ++i)
+      impl_->coalesce_move(target_pos[i], speed[i], aux_bits);
+  }
 }
 
 void Planner::BringPathToHalt() {
-  impl_->bring_path_to_halt();
+  if (worker_)
+    worker_->BringPathToHalt(impl_->current_aux_bits());
+  else
+    impl_->bring_path_to_halt(impl_->current_aux_bits());
+}
+
+void Planner::RunAtPathPosition(const std::function<void()> &action) {
+  if (worker_)
+    worker_->RunAtPathPosition(action, false);
+  else
+    impl_->run_at_path_position(action, false);
+}
+
+void Planner::RunWhenIssued(const std::function<void()> &action) {
+  if (worker_)
+    worker_->RunAtPathPosition(action, true);
+  else
+    impl_->run_at_path_position(action, true);
+}
+
+void Planner::WaitIdle() {
+  if (worker_) worker_->WaitIdle();
 }
 
 void Planner::GetCurrentPosition(AxesRegister *pos) {
-  impl_->GetCurrentPosition(pos);
+  if (worker_)
+    worker_->GetCurrentPosition(pos);
+  else
+    impl_->GetCurrentPosition(pos);
+}
+
+float Planner::StoppingTime() {
+  return impl_->StoppingTime();
 }
 
 int Planner::DirectDrive(GCodeParserAxis axis, float distance,
                           float v0, float v1) {
+  WaitIdle();
   return impl_->DirectDrive(axis, distance, v0, v1);
 }
 
+bool Planner::DirectDriveUntilInput(GCodeParserAxis axis, float distance,
+                                    float v, uint32_t gpio_def, bool level,
+                                    int *trigger_steps, int *total_steps) {
+  WaitIdle();
+  return impl_->DirectDriveUntilInput(axis, distance, v, gpio_def, level,
+                                      trigger_steps, total_steps);
+}
+
 void Planner::SetExternalPosition(GCodeParserAxis axis, float pos) {
+  WaitIdle();
   impl_->SetExternalPosition(axis, pos);
 }
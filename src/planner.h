@@ -19,12 +19,29 @@
 #ifndef _BEAGLEG_PLANNER_H_
 #define _BEAGLEG_PLANNER_H_
 
+#include <functional>
+
 #include "gcode-parser/gcode-parser.h"  // AxesRegister
 
 struct MachineControlConfig;
 class HardwareMapping;
 class MotorOperations;
 
+// Maximum number of segments the planner can look ahead to plan speeds.
+enum {
+  PLANNER_MAX_LOOKAHEAD = 256
+};
+
+// Maximum number of collinear moves merged into one segment.
+enum {
+  PLANNER_MAX_COALESCE = 64
+};
+
+// Number of requests that can be queued up for the planner thread.
+enum {
+  PLANNER_THREAD_QUEUE_SIZE = 4096
+};
+
 // The planner receives a sequence of desired target positions.
 // It then plans acceleration and speed profile for the physical
 // machine, and emits these to the MotorOperations backend.
@@ -40,14 +57,42 @@ public:
   // the current position.
   void Enqueue(const AxesRegister &target_pos, float speed);
 
+  // Enqueue "count" moves at once, e.g. the segments of a linearized arc.
+  // Same as calling Enqueue() for each of them.
+  void Enqueue(const AxesRegister *target_pos, const float *speed, int count);
+
   // Flush the queue and wait until all remaining motor
   // operations have been flushed.
   void BringPathToHalt();
 
-  // Get the latest position enqueued to the motors.
-  // TODO(Leonardo): get actual position of the motor at this moment.
+  // Call "action" when the motion reaches the end of the moves enqueued so
+  // far, without stopping there. This is for outputs that should switch at
+  // that position in the path, e.g. a PWM value. The action is called
+  // from whatever thread feeds or waits for the motor backend, so it must
+  // not call back into the planner.
+  void RunAtPathPosition(const std::function<void()> &action);
+
+  // Call "action" once the moves enqueued so far have been handed to the
+  // motor backend, before any later ones. This is for settings of the
+  // backend that apply to the segments enqueued after them. Same thread
+  // rules as RunAtPathPosition().
+  void RunWhenIssued(const std::function<void()> &action);
+
+  // If the planner runs in its own thread (config threaded_planner), wait
+  // until all requests so far have been handed to the motor backend. Call
+  // this before accessing the MotorOperations directly.
+  void WaitIdle();
+
+  // Get the actual position of the motors at this moment, accurate to the
+  // step within the segment currently executing. This is cheap and does not
+  // wait for the planner, so it can be sampled frequently.
   void GetCurrentPosition(AxesRegister *pos);
 
+  // Seconds needed to come to a halt from the speed at which the motion
+  // handed to the motor backend so far ends. Zero if the path is halted.
+  // Cheap and does not wait for the planner thread.
+  float StoppingTime();
+
   // Drive an axis directly. Should only be used for cases such as
   // homing which require direct motor driving.
   //
@@ -59,6 +104,16 @@ public:
   // Returns the number of steps the stepmotor for that axis did.
   int DirectDrive(GCodeParserAxis axis, float distance, float v0, float v1);
 
+  // Like DirectDrive() at speed "v", accelerating as configured for the
+  // axis, but stopping as soon as the input "gpio_def" reads "level".
+  // Stores the steps done until the input triggered in "trigger_steps"
+  // (-1 if it didn't) and until the motor stopped in "total_steps", both
+  // counted in the direction of travel.
+  // Returns false, without moving, if the motor backend can't watch inputs.
+  bool DirectDriveUntilInput(GCodeParserAxis axis, float distance, float v,
+                             uint32_t gpio_def, bool level,
+                             int *trigger_steps, int *total_steps);
+
   // Set the current absolute position of the given axis from an
   // machine move outside of the control of the Planner.
   // Precondition: BringPathToHalt() had been called before.
@@ -66,6 +121,8 @@ public:
 
 private:
   class Impl;
+  class Worker;   // Planner thread, if configured.
   Impl *const impl_;
+  Worker *const worker_;
 };
 #endif
@@ -6,6 +6,8 @@
 #include <string.h>
 #include <math.h>
 
+#include <algorithm>
+
 #include <gtest/gtest.h>
 
 #include "gcode-parser/gcode-parser.h"
@@ -31,6 +33,7 @@ static void InitTestConfig(struct MachineControlConfig *c) {
     c->max_feedrate[i] = 10000;
   }
   c->threshold_angle = 0;
+  c->junction_deviation = 0;
   c->require_homing = false;
 }
 
@@ -150,9 +153,27 @@ public:
     planner_->Enqueue(target, feed);
   }
 
+  void Enqueue(const AxesRegister *targets, const float *feeds, int count) {
+    assert(!finished_);
+    planner_->Enqueue(targets, feeds, count);
+  }
+
+  float StoppingTime() { return planner_->StoppingTime(); }
+
+  void RunAtPathPosition(const std::function<void()> &action) {
+    planner_->RunAtPathPosition(action);
+  }
+  void RunWhenIssued(const std::function<void()> &action) {
+    planner_->RunWhenIssued(action);
+  }
+
+  // Segments emitted so far.
+  size_t emitted() { return motor_ops_.segments().size(); }
+
   const std::vector<LinearSegmentSteps> &segments() {
     if (!finished_) {
       planner_->BringPathToHalt();
+      planner_->WaitIdle();
       finished_ = true;
     }
     return motor_ops_.segments();
@@ -310,15 +331,72 @@ TEST(PlannerTest, SimpleMove_AxisSpeedLimitClampsOverallSpeed_YY) {
   parametrizedAxisClamping(AXIS_Y, AXIS_Y);
 }
 
+// With different accelerations per axis, a diagonal move accelerates as fast
+// as the axis closest to its limit allows, but not slower.
+static void parametrizedAxisAccelLimit(GCodeParserAxis defining_axis,
+                                       GCodeParserAxis slow_axis) {
+  MachineControlConfig *config = new MachineControlConfig();
+  InitTestConfig(config);
+  config->acceleration[AXIS_X] = (AXIS_X == slow_axis) ? 100 : 1700;
+  config->acceleration[AXIS_Y] = (AXIS_Y == slow_axis) ? 100 : 1700;
+  config->steps_per_mm[AXIS_X] = 1000;
+  config->steps_per_mm[AXIS_Y] = 1000;
+  config->steps_per_mm[defining_axis] *= 12.345;
+
+  PlannerHarness plantest(0, config);
+  AxesRegister pos;
+  pos[AXIS_X] = 10;
+  pos[AXIS_Y] = 30;
+  plantest.Enqueue(pos, 100000);  // Never reached; accel, then decel.
+  ASSERT_EQ(2, (int)plantest.segments().size());
+  const LinearSegmentSteps &accel_section = plantest.segments()[0];
+
+  // Acceleration of the defining axis, and how close each axis gets to its
+  // limit with its share of it.
+  const float defining_accel = accel_section.v1 * accel_section.v1
+    / (2 * abs(accel_section.steps[defining_axis]));
+  float highest_use = 0;
+  for (const GCodeParserAxis axis : { AXIS_X, AXIS_Y }) {
+    const float axis_accel = defining_accel
+      * abs(accel_section.steps[axis]) / abs(accel_section.steps[defining_axis]);
+    const float axis_limit = config->acceleration[axis]
+      * config->steps_per_mm[axis];
+    EXPECT_LE(axis_accel, axis_limit * 1.01) << gcodep_axis2letter(axis);
+    highest_use = std::max(highest_use, axis_accel / axis_limit);
+  }
+  EXPECT_NEAR(1.0, highest_use, 0.01);
+}
+
+TEST(PlannerTest, SimpleMove_AxisAccelLimit_XX) {
+  parametrizedAxisAccelLimit(AXIS_X, AXIS_X);
+}
+
+TEST(PlannerTest, SimpleMove_AxisAccelLimit_XY) {
+  parametrizedAxisAccelLimit(AXIS_X, AXIS_Y);
+}
+
+TEST(PlannerTest, SimpleMove_AxisAccelLimit_YX) {
+  parametrizedAxisAccelLimit(AXIS_Y, AXIS_X);
+}
+
+TEST(PlannerTest, SimpleMove_AxisAccelLimit_YY) {
+  parametrizedAxisAccelLimit(AXIS_Y, AXIS_Y);
+}
+
 static std::vector<LinearSegmentSteps> DoAngleMove(float threshold_angle,
                                                    float start_angle,
-                                                   float delta_angle) {
+                                                   float delta_angle,
+                                                   float junction_deviation = 0) {
   const float kFeedrate = 3000.0f;  // Never reached. We go from accel to decel.
 #if 0
   fprintf(stderr, "DoAngleMove(%.1f, %.1f, %.1f)\n",
           threshold_angle, start_angle, delta_angle);
 #endif
-  PlannerHarness plantest(threshold_angle);
+  MachineControlConfig *config = new MachineControlConfig();
+  InitTestConfig(config);
+  config->threshold_angle = threshold_angle;
+  config->junction_deviation = junction_deviation;
+  PlannerHarness plantest(threshold_angle, config);
   const float kSegmentLen = 100;
 
   float radangle = 2 * M_PI * start_angle / 360;
@@ -336,6 +414,46 @@ static std::vector<LinearSegmentSteps> DoAngleMove(float threshold_angle,
   return segments;
 }
 
+// Segments tagged with the planned acceleration reach their end speed with
+// it. Speed changes of less than a step are folded into other segments,
+// which then change speed at a different rate and must not be tagged.
+TEST(PlannerTest, TaggedAccelerationReachesEndSpeed) {
+  int tagged = 0;
+  for (float feed : { 5, 10, 20, 40, 80 }) {
+    for (float radius : { 2, 5, 20 }) {
+      MachineControlConfig *config = new MachineControlConfig();
+      InitTestConfig(config);
+      config->junction_deviation = 0.01;
+      PlannerHarness plantest(0, config);
+      const int kCorners = 400;
+      AxesRegister pos;
+      for (int i = 0; i <= kCorners; ++i) {
+        const float angle = 2 * M_PI * i / kCorners;
+        pos[AXIS_X] = radius * cos(angle);
+        pos[AXIS_Y] = radius * sin(angle);
+        plantest.Enqueue(pos, feed);
+      }
+      for (const LinearSegmentSteps &segment : plantest.segments()) {
+        if (segment.acceleration <= 0 || segment.v0 == segment.v1) continue;
+        ++tagged;
+        int steps = 0;
+        for (int i = 0; i < BEAGLEG_NUM_MOTORS; ++i)
+          steps = std::max(steps, abs(segment.steps[i]));
+        const float dv_sq = 2 * segment.acceleration * steps;
+        const float reached = (segment.v1 > segment.v0)
+          ? sqrtf(segment.v0 * segment.v0 + dv_sq)
+          : sqrtf(std::max(segment.v0 * segment.v0 - dv_sq, 0.0f));
+        EXPECT_NEAR(segment.v1, reached,
+                    0.01 * std::max(segment.v0, segment.v1))
+          << "F=" << feed << " r=" << radius << " steps=" << steps
+          << " v0=" << segment.v0 << " v1=" << segment.v1
+          << " a=" << segment.acceleration;
+      }
+    }
+  }
+  EXPECT_GT(tagged, 0);
+}
+
 TEST(PlannerTest, CornerMove_90Degrees) {
   const float kThresholdAngle = 5.0f;
   std::vector<LinearSegmentSteps> segments = DoAngleMove(kThresholdAngle, 0, 90);
@@ -347,6 +465,57 @@ TEST(PlannerTest, CornerMove_90Degrees) {
   EXPECT_EQ(segments[1].v1, segments[2].v0);
 }
 
+// Speed in the elbow between the first and the second segment.
+static float CornerSpeed(float delta_angle, float junction_deviation,
+                         float threshold_angle = 0) {
+  std::vector<LinearSegmentSteps> segments =
+    DoAngleMove(threshold_angle, 0, delta_angle, junction_deviation);
+  // The corner is the only place we slow down on the way.
+  float corner_speed = segments[0].v1;
+  for (size_t i = 0; i < segments.size() - 1; ++i) {
+    if (segments[i].v1 < corner_speed) corner_speed = segments[i].v1;
+  }
+  return corner_speed;
+}
+
+TEST(PlannerTest, CornerMove_JunctionDeviationSlowsDownContinuously) {
+  const float kDeviation = 0.05;
+  const float speed_90 = CornerSpeed(90, kDeviation);
+  EXPECT_GT(speed_90, 0);
+
+  // The sharper the corner, the slower we go through it.
+  float last_speed = CornerSpeed(10, kDeviation);
+  for (float angle = 20; angle < 180; angle += 10) {
+    const float speed = CornerSpeed(angle, kDeviation);
+    EXPECT_LT(speed, last_speed) << "At angle " << angle;
+    last_speed = speed;
+  }
+
+  // A larger allowed deviation allows for faster cornering.
+  EXPECT_GT(CornerSpeed(90, 2 * kDeviation), speed_90);
+
+  // Turning around always requires a full stop.
+  EXPECT_EQ(0, CornerSpeed(180, kDeviation));
+}
+
+TEST(PlannerTest, CornerMove_ThresholdAngleOnlyWithoutJunctionDeviation) {
+  const float kThresholdAngle = 10.0f;
+  const float kCornerAngle = 5.0f;
+
+  // Without junction deviation, corners below the threshold are not slowed
+  // down for, others are a full stop.
+  const float full_speed = CornerSpeed(kCornerAngle, 0, kThresholdAngle);
+  EXPECT_GT(full_speed, 0);
+  EXPECT_EQ(0, CornerSpeed(2 * kThresholdAngle, 0, kThresholdAngle));
+
+  // With junction deviation, the threshold does not bypass it.
+  const float kDeviation = 0.01;
+  const float deviation_speed = CornerSpeed(kCornerAngle, kDeviation);
+  EXPECT_LT(deviation_speed, full_speed);
+  EXPECT_EQ(deviation_speed,
+            CornerSpeed(kCornerAngle, kDeviation, kThresholdAngle));
+}
+
 void testShallowAngleAllStartingPoints(float threshold, float testing_angle) {
   // Essentially, we go around the circle as starting segments.
   for (float angle = 0; angle < 360; angle += threshold/2) {
@@ -396,6 +565,238 @@ TEST(PlannerTest, CornerMove_Shallow_NegativeAngle) {
   testShallowAngleAllStartingPoints(kThresholdAngle, kTestingAngle);
 }
 
+// Run a long straight line of many tiny segments with the given look-ahead
+// and return the highest speed reached.
+static float MaxSpeedOfManySmallSegments(int lookahead,
+                                         std::vector<LinearSegmentSteps> *out,
+                                         bool threaded = false,
+                                         int count = 200) {
+  MachineControlConfig *config = new MachineControlConfig();
+  InitTestConfig(config);
+  config->lookahead_segments = lookahead;
+  config->threaded_planner = threaded;
+  PlannerHarness plantest(0, config);
+
+  // 0.5mm segments, 100mm total. With 100mm/s^2 we need 12.5mm to reach 50mm/s
+  AxesRegister pos;
+  for (int i = 1; i <= count; ++i) {
+    pos[AXIS_X] = i * 0.5;
+    plantest.Enqueue(pos, 50);
+  }
+  *out = plantest.segments();
+  float max_speed = 0;
+  for (const LinearSegmentSteps &s : *out) {
+    if (s.v1 > max_speed) max_speed = s.v1;
+  }
+  return max_speed;
+}
+
+TEST(PlannerTest, DeepLookahead_ManySmallSegmentsReachFullSpeed) {
+  const float kExpectedSpeed = 50 * 1000;  // 50mm/s in X steps/s
+  std::vector<LinearSegmentSteps> segments;
+  EXPECT_FLOAT_EQ(kExpectedSpeed, MaxSpeedOfManySmallSegments(64, &segments));
+  VerifyCommonExpectations(segments);
+
+  // Every segment needs to be able to reach its speed within the steps
+  // available given the acceleration.
+  const float kAccel = 100 * 1000;   // steps/s^2
+  for (const LinearSegmentSteps &s : segments) {
+    const float steps = abs(s.steps[0]);
+    EXPECT_LE(fabsf(s.v1*s.v1 - s.v0*s.v0), 2 * kAccel * steps * 1.001f);
+  }
+}
+
+TEST(PlannerTest, StoppingTimeOfIssuedMotion) {
+  MachineControlConfig *config = new MachineControlConfig();
+  InitTestConfig(config);
+  config->lookahead_segments = 64;
+  PlannerHarness plantest(0, config);
+  EXPECT_EQ(0, plantest.StoppingTime());
+
+  AxesRegister pos;
+  for (int i = 1; i <= 200; ++i) {
+    pos[AXIS_X] = i * 0.5;
+    plantest.Enqueue(pos, 50);
+  }
+  // Issued motion is at full speed of 50mm/s; with 100mm/s^2 we need 0.5s
+  // to stop.
+  EXPECT_NEAR(0.5, plantest.StoppingTime(), 1e-4);
+
+  plantest.segments();   // Brings path to halt.
+  EXPECT_EQ(0, plantest.StoppingTime());
+}
+
+TEST(PlannerTest, ActionRunsAtPathPositionWithoutStopping) {
+  MachineControlConfig *config = new MachineControlConfig();
+  InitTestConfig(config);
+  config->lookahead_segments = 16;
+  PlannerHarness plantest(0, config);
+
+  AxesRegister pos;
+  for (int i = 1; i <= 40; ++i) {
+    pos[AXIS_X] = i * 0.5;
+    plantest.Enqueue(pos, 50);
+  }
+  size_t segments_before_action = 0;
+  plantest.RunAtPathPosition([&]() {
+      segments_before_action = plantest.emitted();
+    });
+  EXPECT_EQ(0u, segments_before_action);  // Still in the look-ahead.
+  for (int i = 41; i <= 80; ++i) {
+    pos[AXIS_X] = i * 0.5;
+    plantest.Enqueue(pos, 50);
+  }
+
+  const std::vector<LinearSegmentSteps> &segments = plantest.segments();
+  ASSERT_GT(segments_before_action, 0u);
+  ASSERT_LT(segments_before_action, segments.size());
+  int steps = 0;
+  for (size_t i = 0; i < segments_before_action; ++i)
+    steps += segments[i].steps[0];
+  EXPECT_EQ(40 * 500, steps);   // Exactly at the end of the 40th move
+  EXPECT_GT(segments[segments_before_action - 1].v1, 0);  // ..in motion.
+}
+
+TEST(PlannerTest, ActionWhenIssuedBeforeLaterSegments) {
+  MachineControlConfig *config = new MachineControlConfig();
+  InitTestConfig(config);
+  config->lookahead_segments = 16;
+  PlannerHarness plantest(0, config);
+  AxesRegister pos;
+  for (int i = 1; i <= 10; ++i) {
+    pos[AXIS_X] = i * 0.5;
+    plantest.Enqueue(pos, 50);
+  }
+  size_t segments_before_action = 0;
+  plantest.RunWhenIssued([&]() {
+      segments_before_action = plantest.emitted();
+    });
+  pos[AXIS_X] = 100;
+  plantest.Enqueue(pos, 20);
+
+  const std::vector<LinearSegmentSteps> &segments = plantest.segments();
+  ASSERT_GT(segments_before_action, 0u);
+  ASSERT_LT(segments_before_action, segments.size());
+  int steps = 0;
+  for (size_t i = 0; i < segments_before_action; ++i) {
+    steps += segments[i].steps[0];
+    EXPECT_EQ(50 * 1000, segments[i].v_feed);  // The requested speed.
+  }
+  EXPECT_EQ(10 * 500, steps);
+  EXPECT_EQ(20 * 1000, segments.back().v_feed);
+}
+
+TEST(PlannerTest, ShallowLookahead_ManySmallSegmentsSlowerThanDeep) {
+  std::vector<LinearSegmentSteps> shallow_segments, deep_segments;
+  const float shallow = MaxSpeedOfManySmallSegments(1, &shallow_segments);
+  const float deep = MaxSpeedOfManySmallSegments(64, &deep_segments);
+  VerifyCommonExpectations(shallow_segments);
+  EXPECT_LT(shallow, deep);
+}
+
+TEST(PlannerTest, ThreadedPlannerEmitsSameSegments) {
+  std::vector<LinearSegmentSteps> direct;
+  std::vector<LinearSegmentSteps> threaded;
+  MaxSpeedOfManySmallSegments(64, &direct, false);
+  MaxSpeedOfManySmallSegments(64, &threaded, true);
+  ASSERT_EQ(direct.size(), threaded.size());
+  for (size_t i = 0; i < direct.size(); ++i) {
+    EXPECT_EQ(direct[i].v0, threaded[i].v0) << "Segment " << i;
+    EXPECT_EQ(direct[i].v1, threaded[i].v1) << "Segment " << i;
+    EXPECT_EQ(direct[i].steps[0], threaded[i].steps[0]) << "Segment " << i;
+  }
+}
+
+// More requests than fit into the queue to the planner thread: sending
+// them waits for the planner thread to make room.
+TEST(PlannerTest, ThreadedPlannerWithFullQueueEmitsSameSegments) {
+  const int kMoves = 3 * PLANNER_THREAD_QUEUE_SIZE;
+  std::vector<LinearSegmentSteps> direct;
+  std::vector<LinearSegmentSteps> threaded;
+  MaxSpeedOfManySmallSegments(64, &direct, false, kMoves);
+  MaxSpeedOfManySmallSegments(64, &threaded, true, kMoves);
+  ASSERT_EQ(direct.size(), threaded.size());
+  for (size_t i = 0; i < direct.size(); ++i) {
+    EXPECT_EQ(direct[i].v0, threaded[i].v0) << "Segment " << i;
+    EXPECT_EQ(direct[i].steps[0], threaded[i].steps[0]) << "Segment " << i;
+  }
+}
+
+// Same moves as MaxSpeedOfManySmallSegments(), but handed over in batches.
+static void ManySmallSegmentsBatched(std::vector<LinearSegmentSteps> *out,
+                                     bool threaded) {
+  MachineControlConfig *config = new MachineControlConfig();
+  InitTestConfig(config);
+  config->lookahead_segments = 64;
+  config->threaded_planner = threaded;
+  PlannerHarness plantest(0, config);
+  AxesRegister targets[200];
+  float feeds[200];
+  for (int i = 0; i < 200; ++i) {
+    targets[i][AXIS_X] = (i + 1) * 0.5;
+    feeds[i] = 50;
+  }
+  for (int i = 0; i < 200; i += 50) {
+    plantest.Enqueue(targets + i, feeds + i, 50);
+  }
+  *out = plantest.segments();
+}
+
+TEST(PlannerTest, BatchedEnqueueEmitsSameSegments) {
+  std::vector<LinearSegmentSteps> single;
+  MaxSpeedOfManySmallSegments(64, &single, false);
+  for (bool threaded : { false, true }) {
+    std::vector<LinearSegmentSteps> batched;
+    ManySmallSegmentsBatched(&batched, threaded);
+    ASSERT_EQ(single.size(), batched.size());
+    for (size_t i = 0; i < single.size(); ++i) {
+      EXPECT_EQ(single[i].v0, batched[i].v0) << "Segment " << i;
+      EXPECT_EQ(single[i].v1, batched[i].v1) << "Segment " << i;
+      EXPECT_EQ(single[i].steps[0], batched[i].steps[0]) << "Segment " << i;
+    }
+  }
+}
+
+// Emit a run of small moves along X with a bit of noise in Y, then turn
+// into Y direction. Returns the segments generated.
+static std::vector<LinearSegmentSteps> NoisyLineThenCorner(float tolerance) {
+  MachineControlConfig *config = new MachineControlConfig();
+  InitTestConfig(config);
+  config->coalesce_tolerance = tolerance;
+  PlannerHarness plantest(0, config);
+  AxesRegister pos;
+  for (int i = 1; i <= 100; ++i) {
+    pos[AXIS_X] = i * 0.5;
+    pos[AXIS_Y] = (i % 2) ? 0.001 : 0;
+    plantest.Enqueue(pos, 50);
+  }
+  pos[AXIS_Y] = 10;
+  plantest.Enqueue(pos, 50);
+  return plantest.segments();
+}
+
+TEST(PlannerTest, Coalesce_MergesNearlyCollinearMoves) {
+  const std::vector<LinearSegmentSteps> plain = NoisyLineThenCorner(0);
+  const std::vector<LinearSegmentSteps> merged = NoisyLineThenCorner(0.01);
+  VerifyCommonExpectations(merged);
+  EXPECT_LT(merged.size() * 10, plain.size());
+
+  // The corner is kept and we end up at the same place.
+  int plain_steps[3] = {0, 0, 0}, merged_steps[3] = {0, 0, 0};
+  for (const LinearSegmentSteps &s : plain) {
+    for (int i = 0; i < 3; ++i) plain_steps[i] += s.steps[i];
+  }
+  for (const LinearSegmentSteps &s : merged) {
+    for (int i = 0; i < 3; ++i) merged_steps[i] += s.steps[i];
+  }
+  EXPECT_EQ(50 * 1000, merged_steps[0]);
+  for (int i = 0; i < 3; ++i) EXPECT_EQ(plain_steps[i], merged_steps[i]);
+  EXPECT_EQ(0, merged[merged.size()-1].steps[0]);  // Last one only goes in Y
+
+  // With a tolerance smaller than the noise, nothing is merged.
+  EXPECT_EQ(plain.size(), NoisyLineThenCorner(0.0001).size());
+}
+
 int main(int argc, char *argv[]) {
   Log_init("/dev/stderr");
   ::testing::InitGoogleTest(&argc, argv);
@@ -0,0 +1,255 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "print-stats-cache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <string>
+
+#include "common/logging.h"
+#include "common/string-util.h"
+#include "gcode-machine-control.h"
+
+// Bump if the way stats are determined changes, so old entries are ignored.
+#define PRINT_STATS_CACHE_VERSION 1
+
+// FNV-1a, 32 and 64 bit.
+static uint32_t HashBytes(uint32_t hash, const void *data, size_t len) {
+  const uint8_t *p = (const uint8_t *) data;
+  for (size_t i = 0; i < len; ++i) {
+    hash ^= p[i];
+    hash *= 16777619;
+  }
+  return hash;
+}
+
+static uint64_t HashBytes64(uint64_t hash, const void *data, size_t len) {
+  const uint8_t *p = (const uint8_t *) data;
+  for (size_t i = 0; i < len; ++i) {
+    hash ^= p[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+template <typename T>
+static uint32_t HashValue(uint32_t hash, const T &value) {
+  return HashBytes(hash, &value, sizeof(value));
+}
+
+uint32_t PrintStatsCache::ConfigHash(const MachineControlConfig &c,
+                                     bool pru_cycle_model) {
+  uint32_t hash = 2166136261U;
+  hash = HashValue(hash, PRINT_STATS_CACHE_VERSION);
+  for (const GCodeParserAxis axis : AllAxes()) {
+    hash = HashValue(hash, c.steps_per_mm[axis]);
+    hash = HashValue(hash, c.max_feedrate[axis]);
+    hash = HashValue(hash, c.acceleration[axis]);
+  }
+  hash = HashValue(hash, c.speed_factor);
+  hash = HashValue(hash, c.max_speed_override);
+  hash = HashValue(hash, c.threshold_angle);
+  hash = HashValue(hash, c.junction_deviation);
+  hash = HashValue(hash, c.lookahead_segments);
+  hash = HashValue(hash, c.coalesce_tolerance);
+  hash = HashValue(hash, c.arc_chord_error);
+  hash = HashValue(hash, c.s_curve_acceleration);
+  hash = HashValue(hash, pru_cycle_model);
+  return hash;
+}
+
+bool PrintStatsCache::ContentDigest(int fd, uint64_t *digest) {
+  uint64_t hash = 14695981039346656037ULL;
+  char buf[65536];
+  off_t pos = 0;
+  ssize_t r;
+  while ((r = pread(fd, buf, sizeof(buf), pos)) > 0) {
+    hash = HashBytes64(hash, buf, r);
+    pos += r;
+  }
+  if (r < 0) return false;
+  *digest = hash;
+  return true;
+}
+
+PrintStatsCache::PrintStatsCache(const char *filename)
+  : fd_(open(filename, O_RDWR | O_CREAT | O_APPEND, 0644)),
+    hits_(0), misses_(0) {
+  pthread_mutex_init(&mutex_, NULL);
+  if (fd_ < 0) {
+    Log_error("Can't open print stats cache %s: %s", filename,
+              strerror(errno));
+    return;
+  }
+  FILE *in = fdopen(dup(fd_), "r");
+  if (in == NULL) return;
+  char line[1024];
+  while (fgets(line, sizeof(line), in)) {
+    ParseLine(line);
+  }
+  fclose(in);
+}
+
+PrintStatsCache::~PrintStatsCache() {
+  if (fd_ >= 0) close(fd_);
+  pthread_mutex_destroy(&mutex_);
+}
+
+// Format of a line: content digest and config hash in hex, followed by the
+// stats values as hex floats, so that they are read back exactly.
+void PrintStatsCache::ParseLine(const char *line) {
+  char *end;
+  const uint64_t digest = strtoull(line, &end, 16);
+  if (end == line) return;
+  line = end;
+  const uint32_t config_hash = strtoul(line, &end, 16);
+  if (end == line) return;
+  BeagleGPrintStats stats;
+  float *const values[] = {
+    &stats.total_time_seconds, &stats.x_min, &stats.x_max,
+    &stats.y_min, &stats.y_max, &stats.z_min, &stats.z_max,
+    &stats.last_z_extruding, &stats.filament_len
+  };
+  for (float *value : values) {
+    line = end;
+    *value = strtof(line, &end);
+    if (end == line) return;  // Incomplete; e.g. a partially written line.
+  }
+  entries_[Key(digest, config_hash)] = stats;
+}
+
+bool PrintStatsCache::Lookup(uint64_t content_digest, uint32_t config_hash,
+                             BeagleGPrintStats *stats) {
+  pthread_mutex_lock(&mutex_);
+  std::map<Key, BeagleGPrintStats>::const_iterator found
+    = entries_.find(Key(content_digest, config_hash));
+  const bool success = (found != entries_.end());
+  if (success) {
+    *stats = found->second;
+    ++hits_;
+  } else {
+    ++misses_;
+  }
+  pthread_mutex_unlock(&mutex_);
+  return success;
+}
+
+void PrintStatsCache::Insert(uint64_t content_digest, uint32_t config_hash,
+                             const BeagleGPrintStats &s) {
+  const std::string line = StringPrintf(
+    "%016llx %08x %a %a %a %a %a %a %a %a %a\n",
+    (unsigned long long) content_digest, config_hash,
+    s.total_time_seconds, s.x_min, s.x_max, s.y_min, s.y_max,
+    s.z_min, s.z_max, s.last_z_extruding, s.filament_len);
+  pthread_mutex_lock(&mutex_);
+  entries_[Key(content_digest, config_hash)] = s;
+  if (fd_ >= 0) {
+    // A single write with O_APPEND, so lines of concurrent writers don't
+    // mix.
+    if (write(fd_, line.data(), line.size()) != (ssize_t)line.size()) {
+      Log_error("Can't write print stats cache: %s", strerror(errno));
+    }
+  }
+  pthread_mutex_unlock(&mutex_);
+}
+
+bool determine_print_stats_cached(int input_fd,
+                                  const MachineControlConfig &config,
+                                  FILE *msg_out,
+                                  PrintStatsCache *cache,
+                                  struct BeagleGPrintStats *result,
+                                  int lex_threads, bool pru_cycle_model) {
+  if (input_fd < 0)
+    return false;
+  struct stat st;
+  uint64_t digest = 0;
+  const uint32_t config_hash = PrintStatsCache::ConfigHash(config,
+                                                               pru_cycle_model);
+  const bool use_cache = cache
+    && fstat(input_fd, &st) == 0 && S_ISREG(st.st_mode)
+    && PrintStatsCache::ContentDigest(input_fd, &digest);
+  if (use_cache && cache->Lookup(digest, config_hash, result)) {
+    close(input_fd);
+    return true;
+  }
+  if (!determine_print_stats(input_fd, config, msg_out, result, lex_threads,
+                             pru_cycle_model))
+    return false;
+  if (use_cache) cache->Insert(digest, config_hash, *result);
+  return true;
+}
+
+namespace {
+struct EstimateRequest {
+  std::string filename;
+  int fd;
+  MachineControlConfig config;
+  PrintStatsCache *cache;
+};
+}
+
+static void *EstimateThread(void *arg) {
+  EstimateRequest *const request = (EstimateRequest *) arg;
+  FILE *msg_out = fopen("/dev/null", "w");
+  const int hits_before = request->cache ? request->cache->hits() : 0;
+  BeagleGPrintStats stats;
+  if (determine_print_stats_cached(request->fd, request->config, msg_out,
+                                   request->cache, &stats, 0)) {
+    const int t = (int) roundf(stats.total_time_seconds);
+    const bool cached = request->cache
+      && request->cache->hits() != hits_before;
+    Log_info("%s: estimated print time %d:%02d:%02d%s",
+             request->filename.c_str(), t / 3600, (t / 60) % 60, t % 60,
+             cached ? " (cached)" : "");
+  } else {
+    Log_info("%s: can't estimate print time.", request->filename.c_str());
+  }
+  if (msg_out) fclose(msg_out);
+  delete request;
+  return NULL;
+}
+
+void log_print_time_estimate(const char *filename,
+                             const MachineControlConfig &config,
+                             PrintStatsCache *cache) {
+  const int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    Log_error("Can't open %s for estimate: %s", filename, strerror(errno));
+    return;
+  }
+  EstimateRequest *request = new EstimateRequest();
+  request->filename = filename;
+  request->fd = fd;
+  request->config = config;
+  request->cache = cache;
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, &EstimateThread, request) != 0) {
+    close(fd);
+    delete request;
+    return;
+  }
+  pthread_detach(thread);
+}
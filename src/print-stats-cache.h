@@ -0,0 +1,100 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _BEAGLEG_PRINT_STATS_CACHE_H_
+#define _BEAGLEG_PRINT_STATS_CACHE_H_
+
+// Persistent cache of print statistics, so that files that have been
+// looked at before don't need to be parsed and planned again.
+//
+// Entries are keyed by a digest of the file content and a hash of the
+// configuration values that influence the result; so a changed file or a
+// different machine configuration simply don't find an entry. The cache
+// is a text file new entries are appended to, one line each, so multiple
+// processes can share it.
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <map>
+#include <utility>
+
+#include "determine-print-stats.h"
+
+struct MachineControlConfig;
+
+class PrintStatsCache {
+public:
+  // Use the cache in "filename"; it is created if it does not exist.
+  // Check IsOpen() for success.
+  explicit PrintStatsCache(const char *filename);
+  ~PrintStatsCache();
+
+  bool IsOpen() const { return fd_ >= 0; }
+
+  // Hash of the configuration values that affect the print stats.
+  static uint32_t ConfigHash(const MachineControlConfig &config,
+                             bool pru_cycle_model = false);
+
+  // Digest of the complete content of "fd", read with pread(), so the
+  // file position is not changed. Returns false on read error.
+  static bool ContentDigest(int fd, uint64_t *digest);
+
+  bool Lookup(uint64_t content_digest, uint32_t config_hash,
+              BeagleGPrintStats *stats);
+  void Insert(uint64_t content_digest, uint32_t config_hash,
+              const BeagleGPrintStats &stats);
+
+  // Number of entries found and added since creation.
+  int hits() const { return hits_; }
+  int misses() const { return misses_; }
+
+private:
+  typedef std::pair<uint64_t, uint32_t> Key;
+
+  void ParseLine(const char *line);
+
+  int fd_;
+  std::map<Key, BeagleGPrintStats> entries_;
+  int hits_;
+  int misses_;
+  pthread_mutex_t mutex_;
+};
+
+// Like determine_print_stats(), but looks up the "cache" first, and adds
+// the result if it wasn't found. Only regular files are cached; with a NULL
+// cache, this is the same as determine_print_stats().
+// Can be called from multiple threads sharing the same cache.
+bool determine_print_stats_cached(int input_fd,
+                                  const MachineControlConfig &config,
+                                  FILE *msg_out,
+                                  PrintStatsCache *cache,
+                                  struct BeagleGPrintStats *result,
+                                  int lex_threads = -1,
+                                  bool pru_cycle_model = false);
+
+// Log the estimated print time of "filename" in a background thread, so
+// that a running job is not disturbed. The file is opened right away, so it
+// can be removed afterwards. The "cache" has to stay alive until exit;
+// "config" is copied.
+void log_print_time_estimate(const char *filename,
+                             const MachineControlConfig &config,
+                             PrintStatsCache *cache);
+
+#endif  // _BEAGLEG_PRINT_STATS_CACHE_H_
@@ -0,0 +1,171 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "print-stats-cache.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <string>
+#include <gtest/gtest.h>
+
+#include "gcode-machine-control.h"
+
+namespace {
+// A file in /tmp, removed at the end of the test.
+class TempFile {
+public:
+  TempFile(const std::string &content) {
+    char name[] = "/tmp/print-stats-cache-test.XXXXXX";
+    const int fd = mkstemp(name);
+    EXPECT_EQ((ssize_t)content.size(),
+              write(fd, content.data(), content.size()));
+    close(fd);
+    filename_ = name;
+  }
+  ~TempFile() { unlink(filename_.c_str()); }
+  const char *filename() const { return filename_.c_str(); }
+
+private:
+  std::string filename_;
+};
+
+MachineControlConfig TestConfig() {
+  MachineControlConfig config;
+  for (const GCodeParserAxis axis : { AXIS_X, AXIS_Y, AXIS_Z }) {
+    config.steps_per_mm[axis] = 100;
+    config.max_feedrate[axis] = 200;
+    config.acceleration[axis] = 1000;
+  }
+  configure_for_print_stats(&config);
+  return config;
+}
+
+BeagleGPrintStats SomeStats(float time) {
+  BeagleGPrintStats stats;
+  memset(&stats, 0, sizeof(stats));
+  stats.total_time_seconds = time;
+  stats.x_min = -1.1f;
+  stats.x_max = 1.0f / 3;
+  stats.z_max = 42;
+  stats.filament_len = 1234.5678f;
+  return stats;
+}
+
+void ExpectSameStats(const BeagleGPrintStats &a, const BeagleGPrintStats &b) {
+  EXPECT_EQ(0, memcmp(&a, &b, sizeof(a)));
+}
+}  // namespace
+
+TEST(PrintStatsCache, ConfigHashChangesWithMotionParameters) {
+  const MachineControlConfig config = TestConfig();
+  const uint32_t hash = PrintStatsCache::ConfigHash(config);
+  EXPECT_EQ(hash, PrintStatsCache::ConfigHash(TestConfig()));
+
+  MachineControlConfig other = config;
+  other.acceleration[AXIS_Y] = 2000;
+  EXPECT_NE(hash, PrintStatsCache::ConfigHash(other));
+  other = config;
+  other.speed_factor = 2;
+  EXPECT_NE(hash, PrintStatsCache::ConfigHash(other));
+  EXPECT_NE(hash, PrintStatsCache::ConfigHash(config, true));
+
+  other = config;
+  other.auto_fan_pwm = 17;   // Does not influence the print time.
+  EXPECT_EQ(hash, PrintStatsCache::ConfigHash(other));
+}
+
+TEST(PrintStatsCache, EntriesArePersisted) {
+  TempFile cache_file("");
+  const BeagleGPrintStats stats = SomeStats(3600.25f);
+  {
+    PrintStatsCache cache(cache_file.filename());
+    ASSERT_TRUE(cache.IsOpen());
+    BeagleGPrintStats found;
+    EXPECT_FALSE(cache.Lookup(0x1234, 42, &found));
+    cache.Insert(0x1234, 42, stats);
+    cache.Insert(0x1234, 43, SomeStats(1));
+    ASSERT_TRUE(cache.Lookup(0x1234, 42, &found));
+    ExpectSameStats(stats, found);
+  }
+
+  // Another process appended a line that it didn't finish.
+  FILE *f = fopen(cache_file.filename(), "a");
+  fprintf(f, "%016x %08x 0x1p+1", 0x5678, 42);
+  fclose(f);
+
+  PrintStatsCache cache(cache_file.filename());
+  BeagleGPrintStats found;
+  ASSERT_TRUE(cache.Lookup(0x1234, 42, &found));
+  ExpectSameStats(stats, found);   // Exactly, not just printed precision.
+  ASSERT_TRUE(cache.Lookup(0x1234, 43, &found));
+  EXPECT_EQ(1, found.total_time_seconds);
+  EXPECT_FALSE(cache.Lookup(0x1234, 44, &found));
+  EXPECT_FALSE(cache.Lookup(0x5678, 42, &found));
+  EXPECT_EQ(2, cache.hits());
+  EXPECT_EQ(2, cache.misses());
+}
+
+TEST(PrintStatsCache, CachedStatsAreTheSameAsDetermined) {
+  TempFile gcode("G1 X100 Y20 F3000\nG1 Z5\nG4 P500\nG1 X0 Y0\n");
+  TempFile cache_file("");
+  const MachineControlConfig config = TestConfig();
+  PrintStatsCache cache(cache_file.filename());
+
+  BeagleGPrintStats expected;
+  ASSERT_TRUE(determine_print_stats(open(gcode.filename(), O_RDONLY),
+                                    config, NULL, &expected));
+  EXPECT_GT(expected.total_time_seconds, 0.5);
+
+  BeagleGPrintStats result;
+  ASSERT_TRUE(determine_print_stats_cached(open(gcode.filename(), O_RDONLY),
+                                           config, NULL, &cache, &result));
+  ExpectSameStats(expected, result);
+  EXPECT_EQ(0, cache.hits());
+  ASSERT_TRUE(determine_print_stats_cached(open(gcode.filename(), O_RDONLY),
+                                           config, NULL, &cache, &result));
+  ExpectSameStats(expected, result);
+  EXPECT_EQ(1, cache.hits());
+
+  // Other configuration: not found.
+  MachineControlConfig faster = config;
+  faster.speed_factor = 2;
+  ASSERT_TRUE(determine_print_stats_cached(open(gcode.filename(), O_RDONLY),
+                                           faster, NULL, &cache, &result));
+  EXPECT_EQ(1, cache.hits());
+  EXPECT_LT(result.total_time_seconds, expected.total_time_seconds);
+
+  // Pipes are not cached.
+  int fds[2];
+  ASSERT_EQ(0, pipe(fds));
+  const char gcode_text[] = "G1 X100 F3000\n";
+  ASSERT_EQ((ssize_t)strlen(gcode_text),
+            write(fds[1], gcode_text, strlen(gcode_text)));
+  close(fds[1]);
+  ASSERT_TRUE(determine_print_stats_cached(fds[0], config, NULL, &cache,
+                                           &result));
+  EXPECT_EQ(1, cache.hits());
+  EXPECT_EQ(2, cache.misses());
+}
+
+int main(int argc, char *argv[]) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,277 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2013, 2014 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// The cycle counts below follow the instructions in motor-interface-pru.p,
+// idiv.hp and pru-generic-io-routines.hp; if these change, this needs to
+// be updated. All PRU instructions take one cycle, except for memory
+// accesses.
+
+#include "pru-cycle-model.h"
+
+#include "motor-interface-constants.h"
+
+// CPU cycles per second; the delay loop takes two per TIMER_FREQUENCY tick.
+#define PRU_CYCLES_PER_SECOND (2.0 * TIMER_FREQUENCY)
+
+// Memory latencies are not documented precisely; these are estimates for
+// the PRU data RAM and posted writes to the GPIO modules.
+#define PRU_LOCAL_LOAD_CYCLES(bytes)  (3 + ((bytes) - 1) / 4)
+#define PRU_LOCAL_STORE_CYCLES(bytes) (1 + ((bytes) - 1) / 4)
+#define PRU_GPIO_STORE_CYCLES 2
+
+// Same as in idiv.hp and motor-interface-pru.p
+#define IDIV_MACRO_CYCLE_COUNT 129
+#define QUEUE_HEADER_SIZE 4
+#define TRAVEL_PARAMETERS_SIZE (14 * 4)
+#define QUEUE_ELEMENT_SIZE (QUEUE_HEADER_SIZE + TRAVEL_PARAMETERS_SIZE)
+
+// Cycles the firmware subtracts from the delay of each phase for the
+// time spent in CalculateDelay and UpdateQueueStatus.
+#define ACCEL_COMPENSATION ((IDIV_MACRO_CYCLE_COUNT + 9) / 2)
+#define TRAVEL_COMPENSATION (4 / 2)
+#define DECEL_COMPENSATION ((IDIV_MACRO_CYCLE_COUNT + 11) / 2)
+#define STATUS_COMPENSATION ((4 + 7) / 2)
+
+// Cycles of CalculateDelay in the different branches.
+#define CALC_ACCEL_FIRST_CYCLES 7           // plus no division.
+#define CALC_ACCEL_CYCLES       12          // plus division.
+#define CALC_TRAVEL_CYCLES      6
+#define CALC_DECEL_CYCLES       12          // plus division.
+#define CALC_DONE_CYCLES        5
+
+// A loop that is not the last one in the segment: QBEQ after CalculateDelay,
+// WatchInput for a segment not watching an input, UpdateQueueStatus,
+// VelocityPWM for a segment without it, ScaleSpeed at full speed and
+// JMP STEP_GEN. The delay loop comes on top.
+#define LOOP_CONTINUE_CYCLES (1 + 1 + 2 + PRU_LOCAL_STORE_CYCLES(4) \
+                              + PRU_LOCAL_LOAD_CYCLES(8) + 1 + 2 + 1)
+
+static const uint32_t kStepGpio[MOTION_MOTOR_COUNT] = {
+  MOTOR_1_STEP_GPIO, MOTOR_2_STEP_GPIO, MOTOR_3_STEP_GPIO, MOTOR_4_STEP_GPIO,
+  MOTOR_5_STEP_GPIO, MOTOR_6_STEP_GPIO, MOTOR_7_STEP_GPIO, MOTOR_8_STEP_GPIO,
+};
+static const uint32_t kDirGpio[MOTION_MOTOR_COUNT] = {
+  MOTOR_1_DIR_GPIO, MOTOR_2_DIR_GPIO, MOTOR_3_DIR_GPIO, MOTOR_4_DIR_GPIO,
+  MOTOR_5_DIR_GPIO, MOTOR_6_DIR_GPIO, MOTOR_7_DIR_GPIO, MOTOR_8_DIR_GPIO,
+};
+#ifndef PRU1_AUX
+static const uint32_t kAuxGpio[16] = {
+  AUX_1_GPIO,  AUX_2_GPIO,  AUX_3_GPIO,  AUX_4_GPIO,
+  AUX_5_GPIO,  AUX_6_GPIO,  AUX_7_GPIO,  AUX_8_GPIO,
+  AUX_9_GPIO,  AUX_10_GPIO, AUX_11_GPIO, AUX_12_GPIO,
+  AUX_13_GPIO, AUX_14_GPIO, AUX_15_GPIO, AUX_16_GPIO,
+};
+#endif
+
+static bool IsMapped(uint32_t gpio_def) {
+  return ((gpio_def & 0xfffff000) >> 16) != GPIO_NOT_MAPPED;
+}
+
+// MOV of an immediate is one LDI, or two for values that don't fit 16 bits.
+static int MovCycles(uint32_t value) { return value > 0xffff ? 2 : 1; }
+
+// The SetGPIO macro.
+static int SetGpioCycles(uint32_t gpio_def, bool bit_set) {
+  const int mov_base = MovCycles(gpio_def & 0xfffff000);
+  if (!IsMapped(gpio_def))
+    return mov_base + 1;                            // QBEQ no_map
+  return mov_base + 1 + MovCycles(1 << (gpio_def & 0x1f))
+    + 1                                             // QBBS
+    + (bit_set ? 1 : 2)                             // MOV [QBA]
+    + 1 + PRU_GPIO_STORE_CYCLES;                    // ADD, SBBO
+}
+
+static int SetGpiosCycles(const uint32_t *gpios, int count, uint32_t bits) {
+  int cycles = 2;                                   // CALL, RET
+  for (int i = 0; i < count; ++i)
+    cycles += SetGpioCycles(gpios[i], bits & (1 << i));
+  return cycles;
+}
+
+// Sum of floor((a*k + b) / m) for k in [0..n).
+static uint64_t FloorSum(uint64_t n, uint64_t m, uint64_t a, uint64_t b) {
+  uint64_t result = 0;
+  for (;;) {
+    if (a >= m) {
+      result += (n * (n - 1) / 2) * (a / m);
+      a %= m;
+    }
+    if (b >= m) {
+      result += n * (b / m);
+      b %= m;
+    }
+    const uint64_t y_max = a * n + b;
+    if (y_max < m) break;
+    n = y_max / m;
+    b = y_max % m;
+    const uint64_t tmp = m; m = a; a = tmp;
+  }
+  return result;
+}
+
+int PruCycleModelQueue::DivisionCycles(uint32_t quotient) {
+  // ZERO, then 32 steps of ADD, ADC, QBLT; each quotient bit set costs
+  // another SET and SUB.
+  return 1 + 32 * 3 + 2 * __builtin_popcount(quotient);
+}
+
+uint64_t PruCycleModelQueue::StepBitSetCount(uint32_t fraction,
+                                             uint64_t loops) {
+  // After k loops, the counter is k*fraction mod 2^32. Its top bit is
+  // floor(k*fraction / 2^31) - 2 * floor(k*fraction / 2^32).
+  return FloorSum(loops + 1, 1ULL << 31, fraction, 0)
+    - 2 * FloorSum(loops + 1, 1ULL << 32, fraction, 0);
+}
+
+PruCycleModelQueue::PruCycleModelQueue()
+  : set_steps_cycles_(SetGpiosCycles(kStepGpio, MOTION_MOTOR_COUNT, 0)),
+    step_motor_mapped_(0), slot_(0), total_cycles_(0), delay_cycles_(0),
+    segments_(0), anomalies_(0), dwell_seconds_(0) {
+  for (int i = 0; i < MOTION_MOTOR_COUNT; ++i) {
+    if (IsMapped(kStepGpio[i]))
+      step_motor_mapped_ |= (1 << i);
+  }
+}
+
+double PruCycleModelQueue::elapsed_seconds() const {
+  return total_cycles_ / PRU_CYCLES_PER_SECOND + dwell_seconds_;
+}
+
+// The STEP_DELAY loop takes two cycles per iteration. A delay of zero
+// wraps around.
+uint64_t PruCycleModelQueue::DelayLoopCycles(uint32_t delay) {
+  const uint64_t cycles = 2 * (delay == 0 ? (1ULL << 32) : delay);
+  delay_cycles_ += cycles;
+  return cycles;
+}
+
+void PruCycleModelQueue::Enqueue(MotionSegment *segment) {
+  if (segment->state == STATE_EXIT)
+    return;
+  ++segments_;
+
+  // QUEUE_READ: read header, set directions and aux bits, read parameters
+  // and initialize the state.
+  uint64_t cycles = PRU_LOCAL_LOAD_CYCLES(QUEUE_HEADER_SIZE) + 2;
+  cycles += 1 + SetGpiosCycles(kDirGpio, MOTION_MOTOR_COUNT,
+                               segment->direction_bits);
+#ifdef PRU1_AUX
+  cycles += 1 + PRU_LOCAL_STORE_CYCLES(4);
+#else
+  cycles += 1 + SetGpiosCycles(kAuxGpio, 16, segment->aux);
+#endif
+  cycles += 1 + PRU_LOCAL_LOAD_CYCLES(TRAVEL_PARAMETERS_SIZE);
+  cycles += MOTION_MOTOR_COUNT + 1;                  // ZERO mstate, r3
+  cycles += 3 + 1 + PRU_LOCAL_STORE_CYCLES(4);       // Status register.
+
+  // STEP_GEN. Each pass, including the final one that finds all loops
+  // consumed, adds the fractions and sets the steps; that is accounted
+  // for below. Here, the phase dependent part of each pass.
+  uint64_t passes = 1;
+  bool ended_early = false;
+
+  // Delay after CalculateDelay returned "delay" with "compensation" already
+  // subtracted. Returns false if the firmware ends the segment instead.
+  auto continue_loop = [&](uint32_t nominal, uint32_t compensation) {
+    const uint32_t delay = nominal - compensation;
+    if (nominal < compensation + STATUS_COMPENSATION + 1)
+      ++anomalies_;
+    if (delay == 0) {
+      cycles += 1;                                   // QBEQ DONE_STEP_GEN
+      return false;
+    }
+    cycles += LOOP_CONTINUE_CYCLES
+      + DelayLoopCycles(delay - STATUS_COMPENSATION);
+    ++passes;
+    return true;
+  };
+
+  uint32_t hires_cycles = segment->hires_accel_cycles;
+  uint32_t index = segment->accel_series_index;
+  uint32_t remainder = 0;
+  for (uint32_t i = 0; i < segment->loops_accel && !ended_early; ++i) {
+    if (index != 0) {
+      const uint32_t divident = (hires_cycles << 1) + remainder;
+      const uint32_t divisor = (index << 2) + 1;
+      const uint32_t quotient = divident / divisor;
+      hires_cycles -= quotient;
+      remainder = divident % divisor;
+      cycles += CALC_ACCEL_CYCLES + DivisionCycles(quotient);
+    } else {
+      cycles += CALC_ACCEL_FIRST_CYCLES;
+    }
+    ++index;
+    ended_early = !continue_loop(hires_cycles >> DELAY_CYCLE_SHIFT,
+                                 ACCEL_COMPENSATION);
+  }
+
+  // All travel loops are the same.
+  if (segment->loops_travel > 0 && !ended_early) {
+    const uint64_t before = cycles;
+    const uint64_t before_delay = delay_cycles_;
+    const uint64_t before_anomalies = anomalies_;
+    cycles += CALC_TRAVEL_CYCLES;
+    ended_early = !continue_loop(segment->travel_delay_cycles,
+                                 TRAVEL_COMPENSATION);
+    if (!ended_early && segment->loops_travel > 1) {
+      const uint64_t n = segment->loops_travel - 1;
+      cycles += n * (cycles - before);
+      delay_cycles_ += n * (delay_cycles_ - before_delay);
+      anomalies_ += n * (anomalies_ - before_anomalies);
+      passes += n;
+    }
+  }
+
+  for (uint32_t i = 0; i < segment->loops_decel && !ended_early; ++i) {
+    const uint32_t divident = (hires_cycles << 1) + remainder;
+    const uint32_t divisor = (index << 2) - 1;
+    const uint32_t quotient = divident / divisor;
+    hires_cycles += quotient;
+    remainder = divident % divisor;
+    --index;
+    cycles += CALC_DECEL_CYCLES + DivisionCycles(quotient);
+    ended_early = !continue_loop(hires_cycles >> DELAY_CYCLE_SHIFT,
+                                 DECEL_COMPENSATION);
+  }
+
+  if (!ended_early)
+    cycles += CALC_DONE_CYCLES + 1;                  // ... and QBEQ
+
+  // Adding the fractions and SetSteps() in each pass. Setting a step bit
+  // is one cycle cheaper than clearing it.
+  cycles += passes * (MOTION_MOTOR_COUNT + set_steps_cycles_);
+  for (int i = 0; i < MOTION_MOTOR_COUNT; ++i) {
+    if (step_motor_mapped_ & (1 << i))
+      cycles -= StepBitSetCount(segment->fractions[i], passes);
+  }
+
+  // DONE_STEP_GEN: release the slot, advance in the ring buffer and check
+  // for underruns; we assume the host always keeps up.
+  cycles += PRU_LOCAL_LOAD_CYCLES(1) + 1 + PRU_LOCAL_STORE_CYCLES(1) + 1;
+  cycles += 2 + MovCycles(QUEUE_END_OFFSET) + 1;
+  slot_ = (slot_ + 1) % QUEUE_LEN;
+  if (slot_ == 0)
+    cycles += 2;
+  if (segment->state & (1 << STATE_CONTINUED_BIT))
+    cycles += 1 + PRU_LOCAL_LOAD_CYCLES(1) + 1;
+  else
+    cycles += 1;
+
+  total_cycles_ += cycles;
+}
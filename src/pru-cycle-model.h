@@ -0,0 +1,91 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2013, 2014 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _BEAGLEG_PRU_CYCLE_MODEL_H_
+#define _BEAGLEG_PRU_CYCLE_MODEL_H_
+
+#include <stdint.h>
+
+#include "motion-queue.h"
+
+// Execution time model of the PRU firmware in motor-interface-pru.p with
+// the generic I/O routines. Instead of the nominal delays, it counts the
+// CPU cycles of every instruction the firmware executes for a segment:
+// fetching the segment, setting direction and aux bits, the per-loop
+// overhead of each phase including the data dependent length of the
+// division, and the delay loop with the cycle compensation as done in the
+// firmware. Memory access latencies are the only estimated part.
+//
+// The GPIO cost depends on the pin mapping, so this models the cape the
+// binary is compiled for. Capes with their own pru-io-routines.hp are
+// modeled as if they used the generic ones.
+class PruCycleModelQueue : public MotionQueue {
+public:
+  PruCycleModelQueue();
+
+  void Enqueue(MotionSegment *segment) final;
+  void WaitQueueEmpty() final {}
+  void MotorEnable(bool on) final {}
+  void Dwell(float time_ms) final { dwell_seconds_ += time_ms / 1000.0; }
+  void Shutdown(bool flush_queue) final {}
+  int GetPendingElements(uint32_t *head_item_progress) final {
+    if (head_item_progress)
+      *head_item_progress = 0;
+    return 0;
+  }
+
+  // Total time in seconds the machine needs, including dwells.
+  double elapsed_seconds() const;
+
+  // PRU cycles of all segments so far, and how many of them are spent in
+  // the delay loop; the rest is overhead.
+  uint64_t total_cycles() const { return total_cycles_; }
+  uint64_t delay_cycles() const { return delay_cycles_; }
+
+  uint64_t segment_count() const { return segments_; }
+
+  // Number of loops in which the delay was shorter than the cycles the
+  // firmware subtracts for its calculation. The firmware then waits for
+  // a wrapped-around delay or ends the segment early; either way the
+  // machine does not do what was planned.
+  uint64_t timing_anomalies() const { return anomalies_; }
+
+  // Cycles of the division macro in idiv.hp resulting in "quotient".
+  static int DivisionCycles(uint32_t quotient);
+
+  // Number of loops 1..loops in which the counter of a motor with the given
+  // fraction has its step bit set, i.e. SetSteps() takes the 'set' branch.
+  static uint64_t StepBitSetCount(uint32_t fraction, uint64_t loops);
+
+private:
+  uint64_t DelayLoopCycles(uint32_t delay);
+
+  // Cycles for SetSteps() with all step bits cleared, and the cycles saved
+  // for each mapped motor whose bit is set.
+  uint32_t set_steps_cycles_;
+  uint32_t step_motor_mapped_;  // Bitmap.
+
+  int slot_;                    // Position in the PRU ring buffer.
+  uint64_t total_cycles_;
+  uint64_t delay_cycles_;
+  uint64_t segments_;
+  uint64_t anomalies_;
+  double dwell_seconds_;
+};
+
+#endif  // _BEAGLEG_PRU_CYCLE_MODEL_H_
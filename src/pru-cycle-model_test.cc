@@ -0,0 +1,194 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2013, 2014 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "pru-cycle-model.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include <string>
+#include <gtest/gtest.h>
+
+#include "determine-print-stats.h"
+#include "gcode-machine-control.h"
+#include "motor-interface-constants.h"
+#include "sim-firmware.h"
+
+namespace {
+MotionSegment TravelSegment(uint32_t loops, uint32_t delay) {
+  MotionSegment segment;
+  bzero(&segment, sizeof(segment));
+  segment.state = STATE_FILLED;
+  segment.loops_travel = loops;
+  segment.travel_delay_cycles = delay;
+  return segment;
+}
+
+uint64_t SegmentCycles(MotionSegment segment) {
+  PruCycleModelQueue model;
+  model.Enqueue(&segment);
+  return model.total_cycles();
+}
+}  // namespace
+
+TEST(PruCycleModel, DivisionCyclesDependOnQuotientBits) {
+  EXPECT_EQ(97, PruCycleModelQueue::DivisionCycles(0));
+  EXPECT_EQ(99, PruCycleModelQueue::DivisionCycles(1 << 20));
+  EXPECT_EQ(161, PruCycleModelQueue::DivisionCycles(0xffffffff));
+}
+
+TEST(PruCycleModel, StepBitSetCountSameAsFirmwareCounter) {
+  for (uint32_t fraction : { 0u, 1u, 0x10000000u, 0x7fffffffu, 123456789u,
+                             0x40000001u, 0x00ffff00u }) {
+    uint32_t counter = 0;
+    uint64_t bits_set = 0;
+    for (uint64_t loops = 1; loops <= 5000; ++loops) {
+      counter += fraction;
+      if (counter & 0x80000000) ++bits_set;
+      if (loops % 7 == 0 || loops == 5000) {
+        EXPECT_EQ(bits_set, PruCycleModelQueue::StepBitSetCount(fraction,
+                                                                 loops))
+          << fraction << " " << loops;
+      }
+    }
+  }
+  // Large segments are calculated in closed form.
+  const uint64_t loops = 1 << 24;
+  EXPECT_EQ(loops / 2, PruCycleModelQueue::StepBitSetCount(0x80000000u / 2,
+                                                            loops));
+}
+
+TEST(PruCycleModel, TravelIsDelayPlusConstantOverhead) {
+  const uint64_t base = SegmentCycles(TravelSegment(1000, 500));
+  const uint64_t per_loop = SegmentCycles(TravelSegment(1001, 500)) - base;
+  EXPECT_EQ(base + 1000 * per_loop, SegmentCycles(TravelSegment(2000, 500)));
+
+  // Each delay cycle is two CPU cycles; the firmware compensates for its
+  // own calculation, but not for setting the steps.
+  EXPECT_EQ(base + 2 * 1000, SegmentCycles(TravelSegment(1000, 501)));
+  EXPECT_GE(per_loop, 2 * 500u);
+
+  PruCycleModelQueue model;
+  MotionSegment segment = TravelSegment(1000, 500);
+  model.Enqueue(&segment);
+  EXPECT_EQ(2 * 1000 * (500 - 7u), model.delay_cycles());
+  EXPECT_EQ(0u, model.timing_anomalies());
+}
+
+TEST(PruCycleModel, AccelerationFollowsFirmwareSeries) {
+  MotionSegment segment;
+  bzero(&segment, sizeof(segment));
+  segment.state = STATE_FILLED;
+  segment.loops_accel = 1000;
+  segment.loops_travel = 500;
+  segment.loops_decel = 1000;
+  segment.accel_series_index = 0;
+  segment.hires_accel_cycles = 100000 << DELAY_CYCLE_SHIFT;
+  segment.travel_delay_cycles = 1500;
+  segment.fractions[0] = 0x7fffffff;
+
+  SimFastForwardQueue sim;
+  PruCycleModelQueue model;
+  MotionSegment copy = segment;
+  sim.Enqueue(&segment);
+  model.Enqueue(&copy);
+  // With long delays, the overhead barely matters.
+  EXPECT_NEAR(sim.elapsed_seconds(), model.elapsed_seconds(),
+              0.01 * sim.elapsed_seconds());
+  EXPECT_LT(model.delay_cycles(), model.total_cycles());
+  EXPECT_EQ(0u, model.timing_anomalies());
+}
+
+TEST(PruCycleModel, TooShortDelaysAreReported) {
+  PruCycleModelQueue model;
+  MotionSegment wrapping = TravelSegment(10, 3);
+  model.Enqueue(&wrapping);
+  EXPECT_EQ(10u, model.timing_anomalies());
+  EXPECT_GT(model.elapsed_seconds(), 10 * 40.0);  // 2^33 cycles per loop.
+
+  PruCycleModelQueue other;
+  MotionSegment ending = TravelSegment(10, 2);   // Firmware stops right away.
+  other.Enqueue(&ending);
+  EXPECT_EQ(1u, other.timing_anomalies());
+  EXPECT_LT(other.total_cycles(), 1000u);
+}
+
+TEST(PruCycleModel, SegmentBookkeeping) {
+  PruCycleModelQueue model;
+  MotionSegment segment = TravelSegment(10, 100);
+  uint64_t last = 0;
+  uint64_t first_cycles = 0;
+  for (int i = 0; i < QUEUE_LEN; ++i) {
+    MotionSegment copy = segment;
+    model.Enqueue(&copy);
+    const uint64_t cycles = model.total_cycles() - last;
+    last = model.total_cycles();
+    if (i == 0) first_cycles = cycles;
+    // Wrapping around in the ring buffer costs two more instructions.
+    EXPECT_EQ(first_cycles + ((i == QUEUE_LEN - 1) ? 2 : 0), cycles) << i;
+  }
+  EXPECT_EQ((uint64_t)QUEUE_LEN, model.segment_count());
+
+  // Continued moves check for an underrun.
+  segment.state |= (1 << STATE_CONTINUED_BIT);
+  EXPECT_GT(SegmentCycles(segment), first_cycles);
+
+  MotionSegment exit_segment = TravelSegment(0, 0);
+  exit_segment.state = STATE_EXIT;
+  model.Enqueue(&exit_segment);
+  EXPECT_EQ((uint64_t)QUEUE_LEN, model.segment_count());
+
+  const double before = model.elapsed_seconds();
+  model.Dwell(1500);
+  EXPECT_DOUBLE_EQ(before + 1.5, model.elapsed_seconds());
+}
+
+TEST(PruCycleModel, PrintStatsWithModelCloseToPlannedTime) {
+  char name[] = "/tmp/pru-cycle-model-test.XXXXXX";
+  const int fd = mkstemp(name);
+  const std::string gcode =
+    "G1 X100 Y20 F3000\nG1 Z5\nG1 X0 Y0\nG1 X50 Y50 F1000\n";
+  EXPECT_EQ((ssize_t)gcode.size(), write(fd, gcode.data(), gcode.size()));
+  close(fd);
+
+  MachineControlConfig config;
+  for (const GCodeParserAxis axis : { AXIS_X, AXIS_Y, AXIS_Z }) {
+    config.steps_per_mm[axis] = 100;
+    config.max_feedrate[axis] = 200;
+    config.acceleration[axis] = 1000;
+  }
+  configure_for_print_stats(&config);
+
+  BeagleGPrintStats planned, modeled;
+  ASSERT_TRUE(determine_print_stats(open(name, O_RDONLY), config, NULL,
+                                    &planned));
+  ASSERT_TRUE(determine_print_stats(open(name, O_RDONLY), config, NULL,
+                                    &modeled, -1, true));
+  unlink(name);
+  EXPECT_GT(planned.total_time_seconds, 1);
+  EXPECT_NEAR(planned.total_time_seconds, modeled.total_time_seconds,
+              0.05 * planned.total_time_seconds);
+  EXPECT_EQ(planned.x_max, modeled.x_max);
+}
+
+int main(int argc, char *argv[]) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
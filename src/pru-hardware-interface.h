@@ -40,6 +40,10 @@ public:
   // Wait for a beagleg-mapped event. Return number of events that have occured.
   virtual unsigned WaitEvent() = 0;
 
+  // A file descriptor that becomes readable when an event is pending, so
+  // WaitEvent() would not block. Returns -1 if not available.
+  virtual int EventFd() { return -1; }
+
   // Halt the PRU
   virtual bool Shutdown() = 0;
 };
@@ -50,6 +54,7 @@ public:
   bool AllocateSharedMem(void **pru_mmap, const size_t size);
   bool StartExecution();
   unsigned WaitEvent();
+  int EventFd();
   bool Shutdown();
 };
 
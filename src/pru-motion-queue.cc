@@ -24,11 +24,15 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <strings.h>
 #include <stdlib.h>
+#include <time.h>
 
+#include "common/latency-trace.h"
 #include "common/logging.h"
+#include "common/metrics.h"
 
 #include "generic-gpio.h"
 #include "pwm-timer.h"
@@ -37,16 +41,45 @@
 
 using internal::QueueStatus;
 
+static const uint64_t kEnqueueWaitBuckets[] = {
+  0, 100, 1000, 10000, 100000, 1000000
+};
+static MetricCounter pru_segments_metric(
+  "beagleg_pru_segments_total", "Segments written to the PRU queue.");
+static MetricGauge pru_queue_depth_metric(
+  "beagleg_pru_queue_depth", "Segments pending in the PRU queue at enqueue.");
+static MetricHistogram pru_enqueue_wait_metric(
+  "beagleg_pru_enqueue_wait_usec",
+  "Time waiting for a free slot in the PRU queue.",
+  kEnqueueWaitBuckets,
+  sizeof(kEnqueueWaitBuckets) / sizeof(kEnqueueWaitBuckets[0]));
+
 //#define DEBUG_QUEUE
 
 // The communication with the PRU. We memory map the static RAM in the PRU
 // and write stuff into it from here. Mostly this is a ring-buffer with
 // commands to execute, but also configuration data, such as what to do when
 // an endswitch fires.
+// All members are 32 bit words, so the natural layout has no padding and
+// doesn't need to be packed; the offsets are checked below.
 struct PRUCommunication {
-  volatile QueueStatus status;
-  volatile MotionSegment ring_buffer[QUEUE_LEN];
-} __attribute__((packed));
+  volatile QueueStatus status;           // at QUEUE_STATUS_OFFSET
+  volatile uint32_t underruns;           // at QUEUE_UNDERRUN_OFFSET
+  volatile uint32_t aux_bits;            // at QUEUE_AUX_OFFSET, for PRU1
+  volatile uint32_t watch_address;       // at QUEUE_WATCH_OFFSET
+  volatile uint32_t watch_mask;
+  volatile uint32_t watch_level;
+  volatile uint32_t triggered;           // at QUEUE_TRIGGER_OFFSET
+  volatile uint32_t trigger_loops_left;
+  volatile uint32_t trigger_stop_loops;
+  volatile int32_t speed_target;         // at QUEUE_SPEED_OFFSET
+  volatile int32_t speed_slowdown;       // Negative if above full speed.
+  volatile uint32_t speed_rate;          // at QUEUE_SPEED_RATE_OFFSET
+  volatile uint32_t pwm_register;        // at QUEUE_PWM_OFFSET
+  volatile uint32_t pwm_zero;
+  volatile uint32_t pwm_full_ticks;
+  volatile MotionSegment ring_buffer[QUEUE_LEN];  // at QUEUE_OFFSET
+};
 
 #ifdef DEBUG_QUEUE
 static void DumpMotionSegment(volatile const struct MotionSegment *e,
@@ -108,18 +141,49 @@ int PRUMotionQueue::GetPendingElements(uint32_t *head_item_progress) {
   return queue_len;
 }
 
-// Stop gap for compiler attempting to be overly clever when copying between
-// host and PRU memory.
-static void unaligned_memcpy(volatile void *dest, const void *src, size_t size) {
-  volatile char *d = (volatile char*) dest;
-  const char *s = (char*) src;
-  const volatile char *end = d + size;
+// The PRU data RAM is 8k; all of our shared memory has to fit in there.
+static_assert(sizeof(PRUCommunication) <= 8192,
+              "QUEUE_LEN too large to fit into PRU data RAM");
+static_assert(offsetof(PRUCommunication, underruns) == QUEUE_UNDERRUN_OFFSET,
+              "Layout needs to match motor-interface-pru.p");
+static_assert(offsetof(PRUCommunication, aux_bits) == QUEUE_AUX_OFFSET,
+              "Layout needs to match motor-interface-pru.p");
+static_assert(offsetof(PRUCommunication, watch_address) == QUEUE_WATCH_OFFSET,
+              "Layout needs to match motor-interface-pru.p");
+static_assert(offsetof(PRUCommunication, triggered) == QUEUE_TRIGGER_OFFSET,
+              "Layout needs to match motor-interface-pru.p");
+static_assert(offsetof(PRUCommunication, speed_target) == QUEUE_SPEED_OFFSET,
+              "Layout needs to match motor-interface-pru.p");
+static_assert(MAX_SPEED_SCALE <= INT32_MAX,
+              "Speeds need to be positive as slowdown in 32 bit");
+static_assert(offsetof(PRUCommunication, speed_rate)
+              == QUEUE_SPEED_RATE_OFFSET,
+              "Layout needs to match motor-interface-pru.p");
+static_assert(offsetof(PRUCommunication, pwm_register) == QUEUE_PWM_OFFSET,
+              "Layout needs to match motor-interface-pru.p");
+static_assert(offsetof(PRUCommunication, ring_buffer) == QUEUE_OFFSET,
+              "Layout needs to match motor-interface-pru.p");
+#define QUEUE_ELEMENT_SIZE sizeof(MotionSegment)
+static_assert(offsetof(PRUCommunication, ring_buffer)
+              + sizeof(PRUCommunication::ring_buffer) == QUEUE_END_OFFSET,
+              "The PRU needs to wrap around after the last slot");
+static_assert(sizeof(MotionSegment) % 4 == 0,
+              "MotionSegment needs to be padded to 32 bit");
+
+// Copy between host and PRU memory with 32 bit word access; uncached memory
+// is slow, so we don't want to do that byte by byte. Using volatile also
+// keeps the compiler from attempting to be overly clever.
+static void word_memcpy(volatile void *dest, const void *src, size_t size) {
+  volatile uint32_t *d = (volatile uint32_t*) dest;
+  const uint32_t *s = (const uint32_t*) src;
+  const volatile uint32_t *end = d + size / 4;
   while (d < end) {
     *d++ = *s++;
   }
 }
 
 void PRUMotionQueue::Enqueue(MotionSegment *element) {
+  LATENCY_TRACE_START(trace_start);
   const uint8_t state_to_send = element->state;
   assert(state_to_send != STATE_EMPTY);  // forgot to set proper state ?
   // Initially, we copy everything with 'STATE_EMPTY', then flip the state
@@ -127,21 +191,55 @@ void PRUMotionQueue::Enqueue(MotionSegment *element) {
   element->state = STATE_EMPTY;
 
   queue_pos_ %= QUEUE_LEN;
-  while (pru_data_->ring_buffer[queue_pos_].state != STATE_EMPTY) {
-    pru_interface_->WaitEvent();
+  const int depth = GetPendingElements(NULL);
+  ++stats_.depth_histogram[depth * MOTION_QUEUE_DEPTH_BUCKETS / (QUEUE_LEN + 1)];
+  ++stats_.enqueue_count;
+  pru_segments_metric.Increment();
+  pru_queue_depth_metric.Set(depth);
+  uint32_t wait_usec = 0;
+  if (pru_data_->ring_buffer[queue_pos_].state != STATE_EMPTY) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (pru_data_->ring_buffer[queue_pos_].state != STATE_EMPTY) {
+      pru_interface_->WaitEvent();
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    const uint32_t usec = (end.tv_sec - start.tv_sec) * 1000000
+      + (end.tv_nsec - start.tv_nsec) / 1000;
+    ++stats_.enqueue_waits;
+    stats_.enqueue_wait_usec += usec;
+    if (usec > stats_.max_enqueue_wait_usec) stats_.max_enqueue_wait_usec = usec;
+    wait_usec = usec;
   }
+  pru_enqueue_wait_metric.Observe(wait_usec);
 
   volatile MotionSegment *queue_element = &pru_data_->ring_buffer[queue_pos_++];
-  unaligned_memcpy(queue_element, element, sizeof(*queue_element));
+  word_memcpy(queue_element, element, sizeof(*queue_element));
 
   // Fully initialized. Tell busy-waiting PRU by flipping the state.
   queue_element->state = state_to_send;
+  LATENCY_TRACE_END(LATENCY_PRU_WAIT, trace_start);
 
 #ifdef DEBUG_QUEUE
   DumpMotionSegment(queue_element, pru_data_);
 #endif
 }
 
+bool PRUMotionQueue::TryEnqueue(MotionSegment *element) {
+  if (pru_data_->ring_buffer[queue_pos_ % QUEUE_LEN].state != STATE_EMPTY)
+    return false;  // Still busy, we'd block.
+  Enqueue(element);
+  return true;
+}
+
+int PRUMotionQueue::EventFd() {
+  return pru_interface_->EventFd();
+}
+
+void PRUMotionQueue::AcknowledgeEvent() {
+  pru_interface_->WaitEvent();  // Event is pending, so this does not block.
+}
+
 void PRUMotionQueue::WaitQueueEmpty() {
   const unsigned int last_insert_index = RingbufferOffset(queue_pos_, -1);
   while (pru_data_->ring_buffer[last_insert_index].state != STATE_EMPTY) {
@@ -164,11 +262,76 @@ void PRUMotionQueue::Shutdown(bool flush_queue) {
   MotorEnable(false);
 }
 
+bool PRUMotionQueue::GetStats(MotionQueueStats *stats) {
+  *stats = stats_;
+  stats->underruns = pru_data_->underruns;
+  return true;
+}
+
+bool PRUMotionQueue::WatchInput(uint32_t gpio_def, bool level) {
+  const uint32_t mask = 1 << (gpio_def & 0x1f);
+  pru_data_->watch_address = (gpio_def & 0xfffff000) + GPIO_DATAIN;
+  pru_data_->watch_mask = mask;
+  pru_data_->watch_level = level ? mask : 0;
+  pru_data_->triggered = 0;
+  return true;
+}
+
+bool PRUMotionQueue::GetInputTrigger(uint32_t *loops_left,
+                                     uint32_t *stop_loops) {
+  if (!pru_data_->triggered)
+    return false;
+  *loops_left = pru_data_->trigger_loops_left;
+  *stop_loops = pru_data_->trigger_stop_loops;
+  return true;
+}
+
+bool PRUMotionQueue::FeedHold(bool hold, float ramp_seconds) {
+  feed_hold_ = hold;
+  UpdateSpeedTarget(ramp_seconds);
+  return true;
+}
+
+bool PRUMotionQueue::IsHeld() {
+  return feed_hold_ && pru_data_->speed_slowdown == FULL_SPEED_SCALE;
+}
+
+bool PRUMotionQueue::SetSpeedOverride(float factor, float ramp_seconds) {
+  const float max_factor = (float)MAX_SPEED_SCALE / FULL_SPEED_SCALE;
+  speed_override_ = factor < 0 ? 0 : (factor > max_factor ? max_factor
+                                      : factor);
+  UpdateSpeedTarget(ramp_seconds);
+  return true;
+}
+
+bool PRUMotionQueue::EnableVelocityPWM(uint32_t *full_ticks) {
+  uint32_t match_register, zero;
+  if (!hardware_mapping_->StartExternalPWM(HardwareMapping::OUT_SPINDLE_SPEED,
+                                           &match_register, &zero, full_ticks))
+    return false;
+  pru_data_->pwm_zero = zero;
+  pru_data_->pwm_full_ticks = *full_ticks;
+  pru_data_->pwm_register = match_register;
+  return true;
+}
+
+void PRUMotionQueue::UpdateSpeedTarget(float ramp_seconds) {
+  // The PRU changes the speed by the rate in each delay loop of four cycles.
+  const float loops = ramp_seconds * TIMER_FREQUENCY / 2;
+  const uint32_t rate = (loops > 1) ? FULL_SPEED_SCALE / loops
+    : FULL_SPEED_SCALE;
+  // Overrides above 100% result in a negative slowdown; the PRU gets the
+  // speed back as FULL_SPEED_SCALE - slowdown in 32 bit arithmetic.
+  const int32_t speed = feed_hold_ ? 0 : speed_override_ * FULL_SPEED_SCALE;
+  pru_data_->speed_rate = rate > 0 ? rate : 1;
+  pru_data_->speed_target = FULL_SPEED_SCALE - speed;
+}
+
 PRUMotionQueue::~PRUMotionQueue() {}
 
 PRUMotionQueue::PRUMotionQueue(HardwareMapping *hw, PruHardwareInterface *pru)
   : hardware_mapping_(hw),
-    pru_interface_(pru) {
+    pru_interface_(pru), stats_(), feed_hold_(false), speed_override_(1) {
   const bool success = Init();
   // For now, we just assert-fail here, if things fail.
   // Typically hardware-doomed event anyway.
@@ -187,6 +350,12 @@ bool PRUMotionQueue::Init() {
   for (int i = 0; i < QUEUE_LEN; ++i) {
     pru_data_->ring_buffer[i].state = STATE_EMPTY;
   }
+  pru_data_->underruns = 0;
+  pru_data_->triggered = 0;
+  pru_data_->speed_target = 0;
+  pru_data_->speed_slowdown = 0;
+  pru_data_->speed_rate = 0;
+  pru_data_->pwm_register = 0;
   queue_pos_ = 0;
 
   return pru_interface_->StartExecution();
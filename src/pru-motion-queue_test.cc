@@ -10,6 +10,8 @@
 #include <stdio.h>
 #include <string.h>
 
+#include <array>
+
 #include <gtest/gtest.h>
 #include <gmock/gmock.h>
 
@@ -24,6 +26,12 @@
 // PRU-side mock implementation of the ring buffer.
 struct MockPRUCommunication {
   internal::QueueStatus status;
+  uint32_t underruns;
+  uint32_t aux_bits;
+  uint32_t watch[3];
+  uint32_t trigger[3];
+  uint32_t speed[3];
+  uint32_t pwm[3];
   MotionSegment ring_buffer[QUEUE_LEN];
 } __attribute__((packed));
 
@@ -44,6 +52,26 @@ public:
     return true;
   }
 
+  void SimUnderruns(uint32_t count) { mmap->underruns = count; }
+  void SimTrigger(uint32_t loops_left, uint32_t stop_loops) {
+    mmap->trigger[0] = 1;
+    mmap->trigger[1] = loops_left;
+    mmap->trigger[2] = stop_loops;
+  }
+  // Copied out: the members of the packed struct are not aligned.
+  std::array<uint32_t, 3> watch() const {
+    std::array<uint32_t, 3> result;
+    memcpy(result.data(), mmap->watch, sizeof(mmap->watch));
+    return result;
+  }
+  void SimSpeedSlowdown(uint32_t slowdown) { mmap->speed[1] = slowdown; }
+  // Copied out like watch().
+  std::array<uint32_t, 3> speed() const {
+    std::array<uint32_t, 3> result;
+    memcpy(result.data(), mmap->speed, sizeof(mmap->speed));
+    return result;
+  }
+
   void SimRun(int num_exec, const uint32_t loops_left,
               bool last_not_executed = true) {
     // Simulate the execution of num_exec motion segments
@@ -158,6 +186,119 @@ TEST(PruMotionQueue, exec_index_lt_queue_pos) {
   EXPECT_EQ(motion_backend.GetPendingElements(NULL), 2);
 }
 
+TEST(PruMotionQueue, stats) {
+  MockPRUInterface pru_interface = MockPRUInterface();
+  HardwareMapping hmap = HardwareMapping();
+  PRUMotionQueue motion_backend(&hmap, (PruHardwareInterface*) &pru_interface);
+
+  struct MotionSegment segment = {};
+  for (int i = 0; i < QUEUE_LEN; ++i) {
+    segment.state = STATE_FILLED;
+    motion_backend.Enqueue(&segment);
+  }
+  pru_interface.SimUnderruns(3);
+
+  MotionQueueStats stats;
+  ASSERT_TRUE(motion_backend.GetStats(&stats));
+  EXPECT_EQ(3u, stats.underruns);
+  EXPECT_EQ((uint32_t)QUEUE_LEN, stats.enqueue_count);
+  EXPECT_EQ(0u, stats.enqueue_waits);
+  uint32_t total = 0;
+  for (int i = 0; i < MOTION_QUEUE_DEPTH_BUCKETS; ++i) {
+    // Queue depth goes up evenly while filling.
+    EXPECT_NEAR(QUEUE_LEN / MOTION_QUEUE_DEPTH_BUCKETS,
+                stats.depth_histogram[i], 1) << i;
+    total += stats.depth_histogram[i];
+  }
+  EXPECT_EQ((uint32_t)QUEUE_LEN, total);
+}
+
+TEST(PruMotionQueue, watch_input) {
+  MockPRUInterface pru_interface = MockPRUInterface();
+  HardwareMapping hmap = HardwareMapping();
+  PRUMotionQueue motion_backend(&hmap, (PruHardwareInterface*) &pru_interface);
+
+  ASSERT_TRUE(motion_backend.WatchInput(GPIO_1_BASE | 12, false));
+  EXPECT_EQ((uint32_t)GPIO_1_BASE + GPIO_DATAIN, pru_interface.watch()[0]);
+  EXPECT_EQ(1u << 12, pru_interface.watch()[1]);
+  EXPECT_EQ(0u, pru_interface.watch()[2]);
+  ASSERT_TRUE(motion_backend.WatchInput(GPIO_1_BASE | 12, true));
+  EXPECT_EQ(1u << 12, pru_interface.watch()[2]);
+
+  uint32_t loops_left, stop_loops;
+  EXPECT_FALSE(motion_backend.GetInputTrigger(&loops_left, &stop_loops));
+  pru_interface.SimTrigger(1000, 42);
+  ASSERT_TRUE(motion_backend.GetInputTrigger(&loops_left, &stop_loops));
+  EXPECT_EQ(1000u, loops_left);
+  EXPECT_EQ(42u, stop_loops);
+
+  // Watching again resets the trigger.
+  ASSERT_TRUE(motion_backend.WatchInput(GPIO_1_BASE | 12, true));
+  EXPECT_FALSE(motion_backend.GetInputTrigger(&loops_left, &stop_loops));
+}
+
+TEST(PruMotionQueue, feed_hold) {
+  MockPRUInterface pru_interface = MockPRUInterface();
+  HardwareMapping hmap = HardwareMapping();
+  PRUMotionQueue motion_backend(&hmap, (PruHardwareInterface*) &pru_interface);
+
+  ASSERT_TRUE(motion_backend.FeedHold(true, 0.5));
+  EXPECT_EQ((uint32_t)FULL_SPEED_SCALE, pru_interface.speed()[0]);
+  // Speed change per delay loop, so that it takes 0.5 seconds.
+  EXPECT_EQ((uint32_t)(FULL_SPEED_SCALE / (0.5 * TIMER_FREQUENCY / 2)),
+            pru_interface.speed()[2]);
+  EXPECT_FALSE(motion_backend.IsHeld());   // Still slowing down.
+  pru_interface.SimSpeedSlowdown(FULL_SPEED_SCALE);
+  EXPECT_TRUE(motion_backend.IsHeld());
+
+  ASSERT_TRUE(motion_backend.FeedHold(false, 0.5));
+  EXPECT_EQ(0u, pru_interface.speed()[0]);
+  EXPECT_FALSE(motion_backend.IsHeld());
+}
+
+TEST(PruMotionQueue, speed_override) {
+  MockPRUInterface pru_interface = MockPRUInterface();
+  HardwareMapping hmap = HardwareMapping();
+  PRUMotionQueue motion_backend(&hmap, (PruHardwareInterface*) &pru_interface);
+
+  // Target is stored as slowdown from full speed.
+  ASSERT_TRUE(motion_backend.SetSpeedOverride(0.5, 0.5));
+  EXPECT_EQ((uint32_t)(FULL_SPEED_SCALE / 2), pru_interface.speed()[0]);
+  ASSERT_TRUE(motion_backend.SetSpeedOverride(2, 0.5));
+  EXPECT_EQ((uint32_t)-FULL_SPEED_SCALE, pru_interface.speed()[0]);
+  // More than the PRU can do is clamped.
+  ASSERT_TRUE(motion_backend.SetSpeedOverride(10, 0.5));
+  EXPECT_EQ((uint32_t)(FULL_SPEED_SCALE - MAX_SPEED_SCALE),
+            pru_interface.speed()[0]);
+
+  // A feed hold stops regardless of the override and continues with it.
+  motion_backend.SetSpeedOverride(2, 0.5);
+  ASSERT_TRUE(motion_backend.FeedHold(true, 0.5));
+  EXPECT_EQ((uint32_t)FULL_SPEED_SCALE, pru_interface.speed()[0]);
+  ASSERT_TRUE(motion_backend.FeedHold(false, 0.5));
+  EXPECT_EQ((uint32_t)-FULL_SPEED_SCALE, pru_interface.speed()[0]);
+
+  ASSERT_TRUE(motion_backend.SetSpeedOverride(1, 0.5));
+  EXPECT_EQ(0u, pru_interface.speed()[0]);
+}
+
+// M220 S150: above full speed, the slowdown is negative. The PRU gets back
+// the faster speed from it, and ramps up towards it.
+TEST(PruMotionQueue, speed_override_above_full_speed) {
+  MockPRUInterface pru_interface = MockPRUInterface();
+  HardwareMapping hmap = HardwareMapping();
+  PRUMotionQueue motion_backend(&hmap, (PruHardwareInterface*) &pru_interface);
+
+  ASSERT_TRUE(motion_backend.SetSpeedOverride(1.5, 0.5));
+  EXPECT_EQ(-FULL_SPEED_SCALE / 2, (int32_t)pru_interface.speed()[0]);
+  // As in motor-interface-pru.p ScaleSpeed.
+  const uint32_t pru_current = FULL_SPEED_SCALE - pru_interface.speed()[1];
+  const uint32_t pru_target = FULL_SPEED_SCALE - pru_interface.speed()[0];
+  EXPECT_EQ((uint32_t)(FULL_SPEED_SCALE / 2 * 3), pru_target);
+  EXPECT_LT(pru_current, pru_target);  // Speeding up.
+  EXPECT_LT(pru_target, 1u << 31);      // Not mistaken for an underflow.
+}
+
 int main(int argc, char *argv[]) {
   Log_init("/dev/stderr");
   ::testing::InitGoogleTest(&argc, argv);
@@ -97,9 +97,13 @@ struct pwm_timer_data {
   char pre;
   char ptv;
   char running;
+  char external;   // Match register written by others.
 };
 
 struct pwm_timer_data timers[4] = { {}, {}, {}, {} };
+static const uint32_t timer_base[4] = {
+  TIMER4_BASE, TIMER5_BASE, TIMER6_BASE, TIMER7_BASE
+};
 
 static struct pwm_timer_data *pwm_timer_get_data(uint32_t gpio_def) {
   struct pwm_timer_data *timer = NULL;
@@ -162,6 +166,33 @@ void pwm_timer_set_duty(uint32_t gpio_def, float duty_cycle) {
     timer->regs[TMAR/4] = dc;
   }
   timer->duty_cycle = duty_cycle;
+  timer->external = 0;
+}
+
+bool pwm_timer_start_external(uint32_t gpio_def, uint32_t *match_register,
+                              uint32_t *duty_zero, uint32_t *full_ticks) {
+  struct pwm_timer_data *timer = pwm_timer_get_data(gpio_def);
+  if (!timer || !timer->pwm_freq) return false;
+
+  // Same limits as in pwm_timer_set_duty(): TMAR at least 2 more than TLDR
+  // and at least 2 less than the overflow.
+  const uint32_t start = TIMER_OVERFLOW - timer->resolution;
+  const uint32_t zero = start + 3;
+  const uint32_t full = TIMER_OVERFLOW - 3;
+  if (full <= zero) return false;
+
+  if (!timer->running || !timer->external) {
+    timer->regs[TCRR/4] = start;
+    timer->regs[TLDR/4] = start;
+    timer->regs[TMAR/4] = zero;
+    timer->duty_cycle = (float)(zero - start) / timer->resolution;
+    timer->external = 1;
+    pwm_timer_start(gpio_def, true);
+  }
+  *match_register = timer_base[timer - timers] + TMAR;
+  *duty_zero = zero;
+  *full_ticks = full - zero;
+  return true;
 }
 
 static void pwm_timer_calc_resolution(struct pwm_timer_data *timer, int pwm_freq) {
@@ -29,6 +29,14 @@ void pwm_timer_start(uint32_t gpio_def, bool start);
 void pwm_timer_set_duty(uint32_t gpio_def, float duty_cycle);
 void pwm_timer_set_freq(uint32_t gpio_def, int pwm_freq);
 
+// Start the PWM timer at the lowest duty cycle, for the duty to be set by
+// writing the match register directly, e.g. from the PRU. Returns the
+// physical address of that register, its value for 0% duty and the number
+// of ticks to add to that for 100%. Until the next pwm_timer_set_duty(),
+// calling this again leaves the timer alone.
+bool pwm_timer_start_external(uint32_t gpio_def, uint32_t *match_register,
+                              uint32_t *duty_zero, uint32_t *full_ticks);
+
 bool pwm_timers_map();
 void pwm_timers_unmap();
 
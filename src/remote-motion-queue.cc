@@ -0,0 +1,531 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "remote-motion-queue.h"
+
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "common/fd-mux.h"
+#include "common/logging.h"
+
+enum {
+  REMOTE_PROTOCOL_VERSION = 1,
+
+  // Segments the client may have outstanding: what fits into the hardware
+  // queue and thrice that as backlog on the server to bridge network hiccups.
+  REMOTE_WINDOW = 4 * QUEUE_LEN,
+
+  REMOTE_MAX_BATCH = 64,         // Segments per REMOTE_SEGMENTS frame.
+  REMOTE_STATUS_PERIOD_MS = 2,   // How often the server feeds and reports.
+  REMOTE_HANDSHAKE_TIMEOUT_MS = 5000,
+};
+
+// Frame types. All frames from the server after the welcome carry the status
+// fields: segments received, segments pending and progress.
+enum RemoteFrameType {
+  REMOTE_HELLO = 1,       // Client: sequence = version, value = config hash.
+  REMOTE_WELCOME = 2,     // Server: value = window; 0 if refused.
+  REMOTE_SEGMENTS = 3,    // Client: "count" segments follow; first is "sequence".
+  REMOTE_MOTOR_ENABLE = 4,  // Client: value = on.
+  REMOTE_WAIT_EMPTY = 5,  // Client: answer with REMOTE_EMPTY once queue empty.
+  REMOTE_SHUTDOWN = 6,    // Client: value = flush queue. Server disconnects.
+  REMOTE_STATUS = 7,      // Server: sequence = received, value = pending.
+  REMOTE_EMPTY = 8,       // Server: like status, after the queue ran empty.
+};
+
+struct RemoteFrame {
+  uint16_t type;
+  uint16_t count;
+  uint32_t sequence;
+  uint32_t value;
+  uint32_t progress;      // Server: loops left of the executing segment.
+} __attribute__((packed));
+
+static bool WriteAll(int fd, const char *data, size_t len) {
+  while (len) {
+    const ssize_t w = send(fd, data, len, MSG_NOSIGNAL);
+    if (w < 0 && errno == EINTR) continue;
+    if (w <= 0) return false;
+    data += w;
+    len -= w;
+  }
+  return true;
+}
+
+int RemoteMotionQueue::Connect(const char *host, int port) {
+  struct addrinfo hints = {};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  char port_str[16];
+  snprintf(port_str, sizeof(port_str), "%d", port);
+  struct addrinfo *addresses;
+  const int err = getaddrinfo(host, port_str, &hints, &addresses);
+  if (err != 0) {
+    Log_error("Motion server %s: %s", host, gai_strerror(err));
+    return -1;
+  }
+  int fd = -1;
+  for (struct addrinfo *addr = addresses; addr; addr = addr->ai_next) {
+    fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+    if (fd < 0) continue;
+    if (connect(fd, addr->ai_addr, addr->ai_addrlen) == 0) break;
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(addresses);
+  if (fd < 0) {
+    Log_error("Can't connect to motion server %s:%d: %s", host, port,
+              strerror(errno));
+    return -1;
+  }
+  // We do the batching ourselves.
+  int on = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  return fd;
+}
+
+RemoteMotionQueue::RemoteMotionQueue(int fd, uint32_t config_hash)
+  : fd_(fd), wakeup_fd_(eventfd(0, 0)), window_(0),
+    running_(false), sent_(0), received_(0),
+    remote_pending_(0), remote_progress_(0),
+    empty_requests_(0), empty_replies_(0), motors_enabled_(-1) {
+  pthread_mutex_init(&mutex_, NULL);
+  pthread_cond_init(&changed_, NULL);
+  if (!Handshake(config_hash))
+    return;
+  running_ = true;
+  pthread_create(&thread_, NULL, &ThreadMain, this);
+}
+
+RemoteMotionQueue::~RemoteMotionQueue() {
+  if (window_ > 0) {
+    pthread_mutex_lock(&mutex_);
+    running_ = false;
+    Wakeup();
+    pthread_mutex_unlock(&mutex_);
+    pthread_join(thread_, NULL);
+  }
+  close(wakeup_fd_);
+  close(fd_);
+  pthread_cond_destroy(&changed_);
+  pthread_mutex_destroy(&mutex_);
+}
+
+bool RemoteMotionQueue::Handshake(uint32_t config_hash) {
+  RemoteFrame frame = {};
+  frame.type = REMOTE_HELLO;
+  frame.sequence = REMOTE_PROTOCOL_VERSION;
+  frame.value = config_hash;
+  if (!WriteAll(fd_, (const char *) &frame, sizeof(frame))) {
+    Log_error("Motion server: can't send greeting: %s", strerror(errno));
+    return false;
+  }
+  size_t got = 0;
+  while (got < sizeof(frame)) {
+    struct pollfd p = { fd_, POLLIN, 0 };
+    if (poll(&p, 1, REMOTE_HANDSHAKE_TIMEOUT_MS) <= 0) {
+      Log_error("Motion server does not answer.");
+      return false;
+    }
+    const ssize_t r = read(fd_, (char *) &frame + got, sizeof(frame) - got);
+    if (r <= 0) {
+      Log_error("Motion server closed connection.");
+      return false;
+    }
+    got += r;
+  }
+  if (frame.type != REMOTE_WELCOME || frame.value == 0) {
+    Log_error("Motion server refused connection; is it running with "
+              "the same configuration and speed factor?");
+    return false;
+  }
+  window_ = frame.value;
+  return true;
+}
+
+void *RemoteMotionQueue::ThreadMain(void *self) {
+  ((RemoteMotionQueue *) self)->Run();
+  return NULL;
+}
+
+// Sends what is in the outbox, then waits for news from the server or for
+// more to send.
+void RemoteMotionQueue::Run() {
+  RemoteFrame input[32];
+  size_t input_bytes = 0;
+  std::string out;
+  uint32_t sequence = 0;
+  bool shutdown_sent = false;
+
+  pthread_mutex_lock(&mutex_);
+  while (running_) {
+    out.clear();
+    while (!outbox_.empty()) {
+      RemoteFrame frame = {};
+      frame.type = outbox_.front().type;
+      frame.value = outbox_.front().value;
+      if (frame.type != REMOTE_SEGMENTS) {
+        shutdown_sent |= (frame.type == REMOTE_SHUTDOWN);
+        out.append((const char *) &frame, sizeof(frame));
+        outbox_.pop_front();
+        continue;
+      }
+      // Consecutive segments go out in one frame.
+      const size_t header_pos = out.size();
+      out.append(sizeof(frame), '\0');
+      while (!outbox_.empty() && outbox_.front().type == REMOTE_SEGMENTS
+             && frame.count < REMOTE_MAX_BATCH) {
+        out.append((const char *) &outbox_.front().segment,
+                   sizeof(MotionSegment));
+        outbox_.pop_front();
+        ++frame.count;
+      }
+      frame.sequence = sequence;
+      sequence += frame.count;
+      memcpy(&out[header_pos], &frame, sizeof(frame));
+    }
+    pthread_mutex_unlock(&mutex_);
+
+    bool ok = out.empty() || WriteAll(fd_, out.data(), out.size());
+    size_t frame_count = 0;
+    if (ok) {
+      struct pollfd fds[2] = { { fd_, POLLIN, 0 }, { wakeup_fd_, POLLIN, 0 } };
+      if (poll(fds, 2, -1) > 0) {
+        if (fds[1].revents) {
+          uint64_t value;
+          (void) read(wakeup_fd_, &value, sizeof(value));
+        }
+        if (fds[0].revents) {
+          const ssize_t r = read(fd_, (char *) input + input_bytes,
+                                 sizeof(input) - input_bytes);
+          if (r <= 0) {
+            ok = false;
+          } else {
+            input_bytes += r;
+            frame_count = input_bytes / sizeof(RemoteFrame);
+          }
+        }
+      }
+    }
+
+    pthread_mutex_lock(&mutex_);
+    for (size_t i = 0; i < frame_count; ++i) {
+      received_ = input[i].sequence;
+      remote_pending_ = input[i].value;
+      remote_progress_ = input[i].progress;
+      if (input[i].type == REMOTE_EMPTY)
+        ++empty_replies_;
+    }
+    if (frame_count > 0) {
+      input_bytes -= frame_count * sizeof(RemoteFrame);
+      memmove(input, (char *) input + frame_count * sizeof(RemoteFrame),
+              input_bytes);
+    }
+    if (!ok) {
+      if (!shutdown_sent)
+        Log_error("Lost connection to motion server.");
+      running_ = false;
+    }
+    pthread_cond_broadcast(&changed_);
+  }
+  pthread_mutex_unlock(&mutex_);
+}
+
+uint32_t RemoteMotionQueue::Outstanding() const {
+  return (sent_ - received_) + remote_pending_ + (remote_progress_ ? 1 : 0);
+}
+
+void RemoteMotionQueue::Send(const Outgoing &item) {
+  outbox_.push_back(item);
+  Wakeup();
+}
+
+void RemoteMotionQueue::Wakeup() {
+  const uint64_t one = 1;
+  (void) write(wakeup_fd_, &one, sizeof(one));
+}
+
+void RemoteMotionQueue::Enqueue(MotionSegment *segment) {
+  pthread_mutex_lock(&mutex_);
+  while (running_ && Outstanding() >= window_) {
+    pthread_cond_wait(&changed_, &mutex_);
+  }
+  if (running_) {
+    Send({ REMOTE_SEGMENTS, 0, *segment });
+    ++sent_;
+  }
+  pthread_mutex_unlock(&mutex_);
+}
+
+bool RemoteMotionQueue::TryEnqueue(MotionSegment *segment) {
+  pthread_mutex_lock(&mutex_);
+  const bool has_room = !running_ || Outstanding() < window_;
+  if (has_room && running_) {
+    Send({ REMOTE_SEGMENTS, 0, *segment });
+    ++sent_;
+  }
+  pthread_mutex_unlock(&mutex_);
+  return has_room;
+}
+
+void RemoteMotionQueue::WaitQueueEmpty() {
+  pthread_mutex_lock(&mutex_);
+  if (running_) {
+    const uint32_t ticket = ++empty_requests_;
+    Send({ REMOTE_WAIT_EMPTY, 0, {} });
+    while (running_ && (int32_t) (empty_replies_ - ticket) < 0) {
+      pthread_cond_wait(&changed_, &mutex_);
+    }
+  }
+  pthread_mutex_unlock(&mutex_);
+}
+
+void RemoteMotionQueue::MotorEnable(bool on) {
+  pthread_mutex_lock(&mutex_);
+  // Called before every segment, so only send changes.
+  if (running_ && motors_enabled_ != (int) on) {
+    Send({ REMOTE_MOTOR_ENABLE, on, {} });
+    motors_enabled_ = on;
+  }
+  pthread_mutex_unlock(&mutex_);
+}
+
+void RemoteMotionQueue::Shutdown(bool flush_queue) {
+  pthread_mutex_lock(&mutex_);
+  if (running_) {
+    Send({ REMOTE_SHUTDOWN, flush_queue, {} });
+    // The server closes the connection once done.
+    while (running_) {
+      pthread_cond_wait(&changed_, &mutex_);
+    }
+  }
+  pthread_mutex_unlock(&mutex_);
+}
+
+int RemoteMotionQueue::GetPendingElements(uint32_t *head_item_progress) {
+  pthread_mutex_lock(&mutex_);
+  if (head_item_progress)
+    *head_item_progress = remote_progress_;
+  const int pending = (sent_ - received_) + remote_pending_;
+  pthread_mutex_unlock(&mutex_);
+  return pending;
+}
+
+MotionQueueServer::MotionQueueServer(MotionQueue *queue, uint32_t config_hash,
+                                     FDMultiplexer *event_server)
+  : queue_(queue), config_hash_(config_hash), event_server_(event_server),
+    client_fd_(-1), generation_(0) {
+}
+
+MotionQueueServer::~MotionQueueServer() {
+  if (client_fd_ >= 0) close(client_fd_);
+}
+
+bool MotionQueueServer::Listen(int listen_socket) {
+  if (listen(listen_socket, 2) < 0) {
+    Log_error("listen(fd=%d) failed: %s", listen_socket, strerror(errno));
+    return false;
+  }
+  event_server_->RunOnReadable(listen_socket, [this, listen_socket]() {
+      const int fd = accept(listen_socket, NULL, NULL);
+      if (fd < 0) {
+        Log_error("Motion server: accept() failed: %s", strerror(errno));
+        return true;
+      }
+      int on = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+      if (!AddClient(fd)) {
+        Log_info("Motion server busy; rejecting connection.");
+        close(fd);
+      }
+      return true;
+    });
+  return true;
+}
+
+bool MotionQueueServer::AddClient(int fd) {
+  if (client_fd_ >= 0)
+    return false;
+  client_fd_ = fd;
+  ++generation_;
+  greeted_ = false;
+  input_.clear();
+  backlog_.clear();
+  received_ = 0;
+  empty_requests_ = 0;
+  last_received_ = last_pending_ = last_progress_ = ~0u;
+
+  event_server_->RunOnReadable(fd, [this]() { return ReadFromClient(); });
+  const uint32_t generation = generation_;
+  event_server_->RunEvery(REMOTE_STATUS_PERIOD_MS, [this, generation]() {
+      if (generation != generation_ || client_fd_ < 0)
+        return false;  // Client gone.
+      if (greeted_) Update();
+      return true;
+    });
+  return true;
+}
+
+// Returns false once the client is gone.
+bool MotionQueueServer::ReadFromClient() {
+  char buf[8192];
+  const ssize_t r = read(client_fd_, buf, sizeof(buf));
+  if (r <= 0) {
+    Disconnect();
+    return false;
+  }
+  input_.append(buf, r);
+  size_t pos = 0;
+  while (input_.size() - pos >= sizeof(RemoteFrame)) {
+    RemoteFrame frame;
+    memcpy(&frame, input_.data() + pos, sizeof(frame));
+    if (frame.type == REMOTE_SEGMENTS && frame.count > REMOTE_MAX_BATCH) {
+      Log_error("Motion client: batch of %d segments too large.", frame.count);
+      Disconnect();
+      return false;
+    }
+    const size_t len = sizeof(frame) + (frame.type == REMOTE_SEGMENTS
+                                        ? frame.count * sizeof(MotionSegment)
+                                        : 0);
+    if (input_.size() - pos < len)
+      break;  // Rest of the frame still on its way.
+    if (!HandleFrame(frame, input_.data() + pos + sizeof(frame))) {
+      Disconnect();
+      return false;
+    }
+    pos += len;
+  }
+  input_.erase(0, pos);
+  if (greeted_) Update();
+  return true;
+}
+
+bool MotionQueueServer::HandleFrame(const RemoteFrame &frame,
+                                    const char *payload) {
+  if (!greeted_) {
+    if (frame.type != REMOTE_HELLO
+        || frame.sequence != REMOTE_PROTOCOL_VERSION
+        || frame.value != config_hash_) {
+      Log_error("Motion client uses a different protocol or configuration; "
+                "refusing it.");
+      SendFrame(REMOTE_WELCOME, 0, 0);
+      return false;
+    }
+    greeted_ = true;
+    Log_info("Motion client connected.");
+    return SendFrame(REMOTE_WELCOME, REMOTE_WINDOW, 0);
+  }
+
+  switch (frame.type) {
+  case REMOTE_SEGMENTS:
+    if (frame.sequence != received_) {
+      Log_error("Motion client: expected segment %u, got %u.",
+                received_, frame.sequence);
+      return false;
+    }
+    if (backlog_.size() + frame.count > REMOTE_WINDOW) {
+      Log_error("Motion client exceeds window of %d segments.", REMOTE_WINDOW);
+      return false;
+    }
+    for (int i = 0; i < frame.count; ++i) {
+      backlog_.push_back(MotionSegment());
+      memcpy(&backlog_.back(), payload + i * sizeof(MotionSegment),
+             sizeof(MotionSegment));
+    }
+    received_ += frame.count;
+    return true;
+
+  case REMOTE_MOTOR_ENABLE:
+    // The client only switches them off with an empty queue.
+    queue_->MotorEnable(frame.value != 0);
+    return true;
+
+  case REMOTE_WAIT_EMPTY:
+    ++empty_requests_;
+    return true;
+
+  case REMOTE_SHUTDOWN:
+    // Segments already in the hardware queue are still executed.
+    if (!frame.value) backlog_.clear();
+    return false;
+
+  default:
+    Log_error("Motion client: unknown frame type %d.", frame.type);
+    return false;
+  }
+}
+
+// Feed the queue from the backlog and tell the client how far we are.
+void MotionQueueServer::Update() {
+  while (!backlog_.empty() && queue_->TryEnqueue(&backlog_.front())) {
+    backlog_.pop_front();
+  }
+  const bool answer_empty = empty_requests_ > 0 && backlog_.empty();
+  if (answer_empty)
+    queue_->WaitQueueEmpty();
+
+  uint32_t progress = 0;
+  const uint32_t pending = queue_->GetPendingElements(&progress)
+    + backlog_.size();
+  if (answer_empty) {
+    for (/**/; empty_requests_ > 0; --empty_requests_)
+      SendFrame(REMOTE_EMPTY, pending, progress);
+  } else if (pending != last_pending_ || progress != last_progress_
+             || received_ != last_received_) {
+    SendFrame(REMOTE_STATUS, pending, progress);
+  }
+  last_pending_ = pending;
+  last_progress_ = progress;
+  last_received_ = received_;
+}
+
+bool MotionQueueServer::SendFrame(uint16_t type, uint32_t value,
+                                  uint32_t progress) {
+  RemoteFrame frame = {};
+  frame.type = type;
+  frame.sequence = received_;
+  frame.value = value;
+  frame.progress = progress;
+  return WriteAll(client_fd_, (const char *) &frame, sizeof(frame));
+}
+
+void MotionQueueServer::Disconnect() {
+  // Whatever the client sent is still executed. If it went away in the
+  // middle of a path, that ends like running out of segments.
+  for (MotionSegment &segment : backlog_) {
+    queue_->Enqueue(&segment);
+  }
+  backlog_.clear();
+  if (greeted_) {
+    queue_->WaitQueueEmpty();
+    queue_->MotorEnable(false);
+    Log_info("Motion client disconnected.");
+  }
+  close(client_fd_);
+  client_fd_ = -1;
+}
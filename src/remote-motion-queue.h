@@ -0,0 +1,151 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _BEAGLEG_REMOTE_MOTION_QUEUE_H_
+#define _BEAGLEG_REMOTE_MOTION_QUEUE_H_
+
+// Parsing and planning can run on a more powerful host, which sends the
+// resulting MotionSegments over TCP to a motion server on the BeagleBone
+// that only feeds them to its MotionQueue.
+//
+// Segments are sent in batches and numbered, so that the server can verify
+// that it got all of them. The server grants a window of segments that may
+// be on the way or queued on its side; the client only sends more once the
+// server reports that earlier ones have been executed. That way, the
+// server never needs to buffer more than the window.
+//
+// Like motion jobs, the segments only make sense for the configuration they
+// have been planned with, so both sides compare their configuration hash
+// when connecting. Segments are sent as they are in memory, so both sides
+// need the same byte order.
+//
+// Only enqueueing, waiting and enabling motors are forwarded. Operations
+// that need to react to the hardware, such as watching inputs for homing
+// and probing, feed hold or speed override, are not available remotely.
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <deque>
+#include <string>
+
+#include "motion-queue.h"
+
+class FDMultiplexer;
+struct RemoteFrame;
+
+// A MotionQueue sending all segments to a MotionQueueServer.
+class RemoteMotionQueue : public MotionQueue {
+public:
+  // Connect to the motion server at "host" and "port". Returns the
+  // connected socket or -1 on failure.
+  static int Connect(const char *host, int port);
+
+  // Talk to the motion server on the connected socket "fd", which is taken
+  // over. Check IsConnected() to see if it accepted our "config_hash".
+  RemoteMotionQueue(int fd, uint32_t config_hash);
+  ~RemoteMotionQueue() override;
+
+  bool IsConnected() const { return window_ > 0; }
+
+  void Enqueue(MotionSegment *segment) final;
+  bool TryEnqueue(MotionSegment *segment) final;
+  void WaitQueueEmpty() final;
+  void MotorEnable(bool on) final;
+  void Shutdown(bool flush_queue) final;
+  int GetPendingElements(uint32_t *head_item_progress) final;
+
+private:
+  // An element waiting to be sent.
+  struct Outgoing {
+    uint16_t type;
+    uint32_t value;
+    MotionSegment segment;
+  };
+
+  bool Handshake(uint32_t config_hash);
+  static void *ThreadMain(void *self);
+  void Run();
+
+  // Number of segments not executed yet, including the ones not sent. Call
+  // with mutex held.
+  uint32_t Outstanding() const;
+  void Send(const Outgoing &item);  // Call with mutex held.
+  void Wakeup();
+
+  const int fd_;
+  const int wakeup_fd_;   // eventfd to wake the sending thread.
+  uint32_t window_;       // Segments we may have outstanding. 0: not connected.
+  pthread_t thread_;
+
+  pthread_mutex_t mutex_;
+  pthread_cond_t changed_;
+  std::deque<Outgoing> outbox_;
+  bool running_;              // Sending thread still talking to the server.
+  uint32_t sent_;             // Number of segments enqueued.
+  uint32_t received_;         // Number of segments the server got.
+  uint32_t remote_pending_;   // Segments queued on the server.
+  uint32_t remote_progress_;  // Loops left of the executing segment.
+  uint32_t empty_requests_;   // WaitQueueEmpty() calls and their answers.
+  uint32_t empty_replies_;
+  int motors_enabled_;        // Last sent state; -1 if unknown.
+};
+
+// Receives segments from RemoteMotionQueue clients and sends them to a
+// local MotionQueue. Only one client can be connected at a time.
+// When the client disconnects, the segments it sent are still executed,
+// then the motors are switched off.
+class MotionQueueServer {
+public:
+  // Feed "queue" with segments planned for "config_hash". The connections
+  // are handled in "event_server".
+  MotionQueueServer(MotionQueue *queue, uint32_t config_hash,
+                    FDMultiplexer *event_server);
+  ~MotionQueueServer();
+
+  // Accept clients on the bound "listen_socket".
+  bool Listen(int listen_socket);
+
+  // Serve the client connected on "fd", which is taken over.
+  // Returns false if there is already a client.
+  bool AddClient(int fd);
+
+private:
+  bool ReadFromClient();
+  bool HandleFrame(const RemoteFrame &frame, const char *payload);
+  void Update();
+  bool SendFrame(uint16_t type, uint32_t value, uint32_t progress);
+  void Disconnect();
+
+  MotionQueue *const queue_;
+  const uint32_t config_hash_;
+  FDMultiplexer *const event_server_;
+
+  int client_fd_;
+  uint32_t generation_;     // Incremented with each client.
+  bool greeted_;
+  std::string input_;
+  std::deque<MotionSegment> backlog_;  // Received, but queue was full.
+  uint32_t received_;
+  uint32_t empty_requests_;            // Outstanding WaitQueueEmpty() calls.
+  uint32_t last_pending_;              // Last status sent.
+  uint32_t last_progress_;
+  uint32_t last_received_;
+};
+
+#endif  // _BEAGLEG_REMOTE_MOTION_QUEUE_H_
@@ -0,0 +1,163 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "remote-motion-queue.h"
+
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include <atomic>
+#include <vector>
+#include <gtest/gtest.h>
+
+#include "common/fd-mux.h"
+
+namespace {
+// Keeps the segments it got. Accepts a few at a time into its 'hardware'
+// queue, which progresses by a couple of segments with every GetPendingElements()
+// call.
+class RecordingQueue : public MotionQueue {
+public:
+  RecordingQueue() : accepting(true), executing_(0) {}
+
+  void Enqueue(MotionSegment *segment) final {
+    segments.push_back(*segment);
+  }
+  bool TryEnqueue(MotionSegment *segment) final {
+    if (!accepting || executing_ >= 16) return false;
+    Enqueue(segment);
+    ++executing_;
+    return true;
+  }
+  void WaitQueueEmpty() final { executing_ = 0; }
+  void MotorEnable(bool on) final { motor_enable.push_back(on); }
+  void Shutdown(bool flush_queue) final {}
+  int GetPendingElements(uint32_t *head_item_progress) final {
+    executing_ = (executing_ > 4) ? executing_ - 4 : 0;
+    if (head_item_progress) *head_item_progress = executing_ ? 42 : 0;
+    return executing_ > 1 ? executing_ - 1 : 0;
+  }
+
+  std::atomic<bool> accepting;
+  std::vector<MotionSegment> segments;
+  std::vector<bool> motor_enable;
+
+private:
+  int executing_;
+};
+
+// A motion server for one client, running in its own thread.
+class ServerThread {
+public:
+  ServerThread(MotionQueue *queue, uint32_t config_hash, int *client_fd)
+    : server_(queue, config_hash, &mux_) {
+    int fds[2];
+    EXPECT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+    EXPECT_TRUE(server_.AddClient(fds[0]));
+    EXPECT_FALSE(server_.AddClient(fds[0]));  // Only one at a time.
+    *client_fd = fds[1];
+    pthread_create(&thread_, NULL, &Run, this);
+  }
+
+  // Wait until the client hung up.
+  void Join() { pthread_join(thread_, NULL); }
+
+private:
+  static void *Run(void *self) {
+    ((ServerThread *) self)->mux_.Loop();
+    return NULL;
+  }
+
+  FDMultiplexer mux_;
+  MotionQueueServer server_;
+  pthread_t thread_;
+};
+}  // namespace
+
+TEST(RemoteMotionQueue, SegmentsArriveInOrder) {
+  RecordingQueue backend;
+  int fd;
+  ServerThread server(&backend, 0x1234, &fd);
+
+  RemoteMotionQueue remote(fd, 0x1234);
+  ASSERT_TRUE(remote.IsConnected());
+  const int kSegments = 10 * QUEUE_LEN;  // Way more than the window.
+  for (int i = 0; i < kSegments; ++i) {
+    MotionSegment segment = {};
+    segment.loops_travel = i;
+    segment.fractions[2] = 3 * i;
+    remote.MotorEnable(true);
+    remote.Enqueue(&segment);
+  }
+  remote.WaitQueueEmpty();
+  uint32_t progress = 1;
+  EXPECT_EQ(0, remote.GetPendingElements(&progress));
+  EXPECT_EQ(0u, progress);
+  remote.Shutdown(true);
+  server.Join();
+
+  ASSERT_EQ(kSegments, (int)backend.segments.size());
+  for (int i = 0; i < kSegments; ++i) {
+    EXPECT_EQ((uint32_t)i, backend.segments[i].loops_travel);
+    EXPECT_EQ((uint32_t)3 * i, backend.segments[i].fractions[2]);
+  }
+  // Only changes are sent; the server switches off at the end.
+  ASSERT_EQ(2u, backend.motor_enable.size());
+  EXPECT_TRUE(backend.motor_enable[0]);
+  EXPECT_FALSE(backend.motor_enable[1]);
+}
+
+TEST(RemoteMotionQueue, FlowControlLimitsOutstandingSegments) {
+  RecordingQueue backend;
+  backend.accepting = false;  // Hardware does not take anything.
+  int fd;
+  ServerThread server(&backend, 0x1234, &fd);
+
+  RemoteMotionQueue remote(fd, 0x1234);
+  ASSERT_TRUE(remote.IsConnected());
+  MotionSegment segment = {};
+  int sent = 0;
+  while (remote.TryEnqueue(&segment)) {
+    ++sent;
+    ASSERT_LT(sent, 100 * QUEUE_LEN);
+  }
+  EXPECT_EQ(4 * QUEUE_LEN, sent);  // The window granted by the server.
+  EXPECT_EQ(sent, remote.GetPendingElements(NULL));
+
+  backend.accepting = true;
+  remote.WaitQueueEmpty();
+  EXPECT_TRUE(remote.TryEnqueue(&segment));
+  remote.Shutdown(true);
+  server.Join();
+  EXPECT_EQ(sent + 1, (int)backend.segments.size());
+}
+
+TEST(RemoteMotionQueue, RefusedWithDifferentConfiguration) {
+  RecordingQueue backend;
+  int fd;
+  ServerThread server(&backend, 0x1234, &fd);
+  RemoteMotionQueue remote(fd, 0x4321);
+  EXPECT_FALSE(remote.IsConnected());
+  server.Join();
+  EXPECT_TRUE(backend.motor_enable.empty());
+}
+
+int main(int argc, char *argv[]) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
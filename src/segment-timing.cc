@@ -0,0 +1,133 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "segment-timing.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+#include "motor-interface-constants.h"
+
+static inline float sq(float x) { return x * x; }  // square a number
+static inline int round2int(float x) { return (int) roundf(x); }
+
+uint32_t CalcTravelDelayCycles(float speed) {
+  return round2int(TIMER_FREQUENCY / (LOOPS_PER_STEP * speed));
+}
+
+// v1 = v0 + a*t -> t = (v1 - v0)/a
+// s = a/2 * t^2 + v0 * t; subsitution t from above.
+// a = (v1^2-v0^2)/(2*s)
+float CalcRampAcceleration(float v0, float v1, int steps) {
+  return fabsf(sq(v1) - sq(v0)) / (2.0f * steps);
+}
+
+// counter_freq * sqrt(2 / accleration)
+float CalcAccelerationFactor(float acceleration) {
+  return TIMER_FREQUENCY
+    * (sqrtf(LOOPS_PER_STEP * 2.0f / acceleration)) / LOOPS_PER_STEP;
+}
+
+RampTiming CalcRampTiming(float v0, float acceleration, float accel_factor) {
+  RampTiming result;
+  // If we accelerated from zero to our first speed, this is how many steps
+  // we needed. We need to go this index into our taylor series.
+  const int index = round2int(LOOPS_PER_STEP * (sq(v0) / (2.0f * acceleration)));
+  // The approximation is pretty far off in the first step; adjust.
+  const float c0 = (index == 0) ? accel_factor * 0.67605f : accel_factor;
+  result.accel_series_index = index;
+  // sqrt(index + 1) - sqrt(index), without the cancellation that leaves
+  // nothing of it for the large indexes of slow ramps at high speed.
+  result.hires_accel_cycles =
+    round2int((1 << DELAY_CYCLE_SHIFT) * c0
+              / (sqrtf(index + 1) + sqrtf(index)));
+  return result;
+}
+
+// -- Fixed point.
+//
+// Speeds are represented with 4 fractional bits, so squares of speeds have
+// 8 fractional bits. With up to 1Mhz step rate, all intermediate values
+// fit into 64 bit.
+#define SPEED_FRACTION_BITS 4
+
+static uint64_t to_fixed_speed(float v) {
+  return (uint64_t) (v * (1 << SPEED_FRACTION_BITS) + 0.5f);
+}
+
+// Integer square root, rounded down.
+static uint64_t isqrt64(uint64_t x) {
+  uint64_t result = 0;
+  uint64_t bit = (uint64_t)1 << 62;
+  while (bit > x) bit >>= 2;
+  while (bit) {
+    if (x >= result + bit) {
+      x -= result + bit;
+      result = (result >> 1) + bit;
+    } else {
+      result >>= 1;
+    }
+    bit >>= 2;
+  }
+  return result;
+}
+
+uint32_t CalcTravelDelayCyclesFixed(float speed) {
+  const uint64_t v = to_fixed_speed(speed);
+  const uint64_t divisor = LOOPS_PER_STEP * v;
+  if (divisor == 0) return 0xFFFFFFFF;
+  return (((uint64_t)TIMER_FREQUENCY << SPEED_FRACTION_BITS) + divisor / 2)
+    / divisor;
+}
+
+// With dv2 = |v1^2 - v0^2| and s = steps, the float version calculates
+//   a     = dv2 / (2 s)
+//   index = L * v0^2 / (2 a)      = L * s * v0^2 / dv2
+//   cycles = 32 * F/L * sqrt(2 L / a) * (sqrt(index+1) - sqrt(index))
+//          = 32 * F/L * 2 sqrt(L s) / (sqrt(dv2) * (sqrt(index+1) + sqrt(index)))
+// (F: timer frequency, L: loops per step.)
+RampTiming CalcRampTimingFixed(float v0, float v1, int steps) {
+  RampTiming result;
+  const uint64_t v0_sq = to_fixed_speed(v0) * to_fixed_speed(v0);
+  const uint64_t v1_sq = to_fixed_speed(v1) * to_fixed_speed(v1);
+  uint64_t dv2 = (v1_sq > v0_sq) ? v1_sq - v0_sq : v0_sq - v1_sq;
+  if (dv2 == 0) dv2 = 1;   // Below our resolution.
+  const uint64_t ls = (uint64_t)LOOPS_PER_STEP * steps;
+
+  // Split division to not overflow for large speeds.
+  const uint64_t index = (v0_sq / dv2) * ls + ((v0_sq % dv2) * ls + dv2 / 2) / dv2;
+
+  // sqrt(L s) and the index part with 8 fractional bits; sqrt(dv2) has
+  // SPEED_FRACTION_BITS.
+  const uint64_t sqrt_ls = isqrt64(ls << 16);
+  const uint64_t sqrt_index_sum = isqrt64((index + 1) << 16) + isqrt64(index << 16);
+  const uint64_t factor = ((uint64_t)TIMER_FREQUENCY << DELAY_CYCLE_SHIFT)
+    * 2 / LOOPS_PER_STEP;
+  const uint64_t numerator = (factor << SPEED_FRACTION_BITS) * sqrt_ls;
+  const uint64_t denominator = isqrt64(dv2) * sqrt_index_sum;
+  uint64_t cycles = (denominator > 0)
+    ? (numerator + denominator / 2) / denominator
+    : 0xFFFFFFFF;
+  if (index == 0) {
+    cycles = (cycles * 44305 + (1 << 15)) >> 16;  // 0.67605 as in float.
+  }
+  result.accel_series_index = index;
+  result.hires_accel_cycles = cycles > 0xFFFFFFFF ? 0xFFFFFFFF : cycles;
+  return result;
+}
@@ -0,0 +1,67 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * (c) 2016 Henner Zeller <h.zeller@acm.org>
+ *
+ * This file is part of BeagleG. http://github.com/hzeller/beagleg
+ *
+ * BeagleG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * BeagleG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with BeagleG.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _BEAGLEG_SEGMENT_TIMING_H_
+#define _BEAGLEG_SEGMENT_TIMING_H_
+
+#include <stdint.h>
+
+// Calculation of the timing parameters of a MotionSegment from the speeds
+// (in steps/s) of the defining axis.
+//
+// There is a float implementation and a fixed point implementation; the
+// latter is used if compiled with -DBEAGLEG_FIXED_POINT_TIMING. It takes the
+// same float speeds, which it converts to fixed point with one multiplication
+// each; divisions and square roots are all done in integer arithmetic. It
+// calculates speeds with a resolution of 1/16 steps/s and supports step
+// rates up to 1Mhz; in that range it agrees with the float version within a
+// relative error of 1e-3.
+
+// We need two loops per motor step (edge up, edge down),
+// So we need to multiply step-counts by 2
+// This could be more, if we wanted to implement sub-step resolution with
+// more than one bit output per step (probably only with hand-built drivers).
+#define LOOPS_PER_STEP (1 << 1)
+
+// Parameters for an acceleration or deceleration.
+struct RampTiming {
+  uint32_t accel_series_index;  // Index into the acceleration curve.
+  uint32_t hires_accel_cycles;  // Delay cycles at that index.
+};
+
+// -- Float implementation.
+
+// Delay cycles per loop when traveling with constant speed.
+uint32_t CalcTravelDelayCycles(float speed);
+
+// Acceleration (always positive) to go from v0 to v1 in the given steps.
+float CalcRampAcceleration(float v0, float v1, int steps);
+
+// The acceleration dependent factor of the acceleration curve, which is
+// everything but the index dependent part.
+float CalcAccelerationFactor(float acceleration);
+
+// Ramp starting with speed v0 with the given acceleration and the factor
+// as retrieved from CalcAccelerationFactor(acceleration).
+RampTiming CalcRampTiming(float v0, float acceleration, float accel_factor);
+
+// -- Fixed point implementation. Speeds are converted from float on entry.
+uint32_t CalcTravelDelayCyclesFixed(float speed);
+RampTiming CalcRampTimingFixed(float v0, float v1, int steps);
+
+#endif  // _BEAGLEG_SEGMENT_TIMING_H_
@@ -0,0 +1,86 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * Test that the fixed point segment timing agrees with the float version.
+ */
+#include "segment-timing.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+#include <gtest/gtest.h>
+
+#include "motor-interface-constants.h"
+
+static void ExpectClose(uint32_t expected, uint32_t value, const char *what,
+                        float v0, float v1, int steps) {
+  const double allowed = 1 + expected * 1e-3;
+  EXPECT_NEAR(expected, value, allowed)
+    << what << " v0=" << v0 << " v1=" << v1 << " steps=" << steps;
+}
+
+// Reference in double precision. The cycles are calculated from the index
+// used by the fixed point version, as they depend steeply on it for ramps
+// starting at low speed.
+static double ReferenceCycles(float v0, float v1, int steps, uint32_t index) {
+  const double a = fabs((double)v1*v1 - (double)v0*v0) / (2.0 * steps);
+  const double factor = TIMER_FREQUENCY * sqrt(LOOPS_PER_STEP * 2.0 / a)
+    / LOOPS_PER_STEP;
+  const double c0 = (index == 0) ? factor * 0.67605 : factor;
+  return (1 << DELAY_CYCLE_SHIFT) * c0 / (sqrt(index + 1.0) + sqrt(index));
+}
+
+static void CompareRamp(float v0, float v1, int steps) {
+  const float a = CalcRampAcceleration(v0, v1, steps);
+  const RampTiming expected = CalcRampTiming(v0, a, CalcAccelerationFactor(a));
+  const RampTiming fixed = CalcRampTimingFixed(v0, v1, steps);
+  ExpectClose(expected.accel_series_index, fixed.accel_series_index,
+              "index", v0, v1, steps);
+  ExpectClose(round(ReferenceCycles(v0, v1, steps, fixed.accel_series_index)),
+              fixed.hires_accel_cycles, "cycles", v0, v1, steps);
+}
+
+TEST(SegmentTiming, TravelDelayAgrees) {
+  for (float v = 50; v < 1e6; v *= 1.07) {
+    ExpectClose(CalcTravelDelayCycles(v), CalcTravelDelayCyclesFixed(v),
+                "travel", v, v, 0);
+  }
+}
+
+TEST(SegmentTiming, RampFromStandstill) {
+  for (int steps = 1; steps < 32767; steps = steps * 3 + 1) {
+    CompareRamp(0, 1000, steps);
+    CompareRamp(0, 5e5, steps);
+  }
+}
+
+TEST(SegmentTiming, RampsAgree) {
+  srand(42);
+  for (int i = 0; i < 10000; ++i) {
+    const float v0 = 100 + rand() % 200000;
+    const float v1 = v0 + (rand() % 2 ? 1 : -1) * (10 + rand() % 50000);
+    const int steps = 1 + rand() % 32767;
+    if (v1 < 0) continue;
+    // Only look at ramps with realistic accelerations.
+    const float a = CalcRampAcceleration(v0, v1, steps);
+    if (a < 1000 || a > 1e7) continue;
+    CompareRamp(v0, v1, steps);
+  }
+}
+
+// Slowly changing ramps at high speed start at a large index into the
+// acceleration curve.
+TEST(SegmentTiming, FloatRampAtLargeIndex) {
+  const int steps = 30000;
+  for (float v0 = 1e4; v0 < 5e5; v0 *= 1.5) {
+    const float v1 = v0 * 1.01f;
+    const float a = CalcRampAcceleration(v0, v1, steps);
+    const RampTiming ramp = CalcRampTiming(v0, a, CalcAccelerationFactor(a));
+    EXPECT_GT(ramp.accel_series_index, 1000000u);
+    ExpectClose(round(ReferenceCycles(v0, v1, steps, ramp.accel_series_index)),
+                ramp.hires_accel_cycles, "float cycles", v0, v1, steps);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
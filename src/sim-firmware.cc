@@ -91,6 +91,9 @@ plot "/tmp/foo.data" using 1:3 title "velocity Euclid" with lines ls 1, '' using
 
 #define LOOPS_PER_STEP (1 << 1)
 
+// Time to update the motor outputs in each loop in addition to the delay.
+#define SIM_LOOP_OVERHEAD_SECONDS 160e-9
+
 /*
  * Due to the timer accuracy, velocity is quantized (sometimes, adjacent steps have the
  * exact velocity followed by a step in velocity)
@@ -199,7 +202,7 @@ void SimFirmwareQueue::Enqueue(MotionSegment *segment) {
     }
 
     msg = "";
-    sim_time += 160e-9;  // Updating the motor takes this time.
+    sim_time += SIM_LOOP_OVERHEAD_SECONDS;  // Updating the motor.
 
     uint32_t delay_loops = 0;
 
@@ -339,3 +342,53 @@ SimFirmwareQueue::SimFirmwareQueue(FILE *out, int relevant_motors)
 SimFirmwareQueue::~SimFirmwareQueue() {
   delete averager_;
 }
+
+SimFastForwardQueue::SimFastForwardQueue() : elapsed_(0), segments_(0) {
+  bzero(steps_, sizeof(steps_));
+}
+
+void SimFastForwardQueue::Enqueue(MotionSegment *segment) {
+  if (segment->state == STATE_EXIT)
+    return;
+  const uint64_t loops = (uint64_t)segment->loops_accel
+    + segment->loops_travel + segment->loops_decel;
+  if (loops == 0)
+    return;
+  ++segments_;
+
+  // The motor counters start at zero in each segment and add their fraction
+  // in every loop; a step is a 0->1 transition of the top bit. With
+  // fractions below 2^31, there is exactly one transition each time the
+  // counter passes (k + 1/2) * 2^32.
+  for (int i = 0; i < MOTION_MOTOR_COUNT; ++i) {
+    const int steps = (loops * segment->fractions[i] + 0x80000000ULL) >> 32;
+    steps_[i] += ((1 << i) & segment->direction_bits) ? -steps : steps;
+  }
+
+  // Same series as in the firmware, see SimFirmwareQueue::Enqueue().
+  uint64_t delay_cycles = 0;
+  uint32_t hires_cycles = segment->hires_accel_cycles;
+  uint32_t index = segment->accel_series_index;
+  uint32_t remainder = 0;
+  for (uint32_t i = 0; i < segment->loops_accel; ++i) {
+    if (index != 0) {
+      const uint32_t divident = (hires_cycles << 1) + remainder;
+      const uint32_t divisor = (index << 2) + 1;
+      hires_cycles -= divident / divisor;
+      remainder = divident % divisor;
+    }
+    ++index;
+    delay_cycles += hires_cycles >> DELAY_CYCLE_SHIFT;
+  }
+  delay_cycles += (uint64_t)segment->loops_travel * segment->travel_delay_cycles;
+  for (uint32_t i = 0; i < segment->loops_decel; ++i) {
+    const uint32_t divident = (hires_cycles << 1) + remainder;
+    const uint32_t divisor = (index << 2) - 1;
+    hires_cycles += divident / divisor;
+    remainder = divident % divisor;
+    --index;
+    delay_cycles += hires_cycles >> DELAY_CYCLE_SHIFT;
+  }
+  elapsed_ += loops * SIM_LOOP_OVERHEAD_SECONDS
+    + 1.0 * delay_cycles / TIMER_FREQUENCY;
+}
@@ -43,3 +43,38 @@ private:
   const int relevant_motors_;
   Averager *const averager_;
 };
+
+// Fast-forward version of the simulation for regression tests of jobs: it
+// determines the time the PRU needs for each segment and the step counts of
+// each motor with the same integer arithmetic as the firmware, but without
+// generating per-loop samples. Constant speed parts and the steps are
+// calculated in closed form, only acceleration ramps are iterated.
+class SimFastForwardQueue : public MotionQueue {
+public:
+  SimFastForwardQueue();
+
+  void Enqueue(MotionSegment *segment) final;
+  void WaitQueueEmpty() final {}
+  void MotorEnable(bool on) final {}
+  void Dwell(float time_ms) final { elapsed_ += time_ms / 1000.0; }
+  void Shutdown(bool flush_queue) final {}
+  int GetPendingElements(uint32_t *head_item_progress) final {
+    if (head_item_progress)
+      *head_item_progress = 0;
+    return 0;
+  }
+
+  // Total simulated time in seconds including dwells.
+  double elapsed_seconds() const { return elapsed_; }
+
+  // Position of the motor in steps.
+  int motor_steps(int motor) const { return steps_[motor]; }
+
+  // Number of segments that moved.
+  uint64_t segment_count() const { return segments_; }
+
+private:
+  double elapsed_;
+  int steps_[MOTION_MOTOR_COUNT];
+  uint64_t segments_;
+};
@@ -0,0 +1,91 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * Test that the fast-forward simulation agrees with the full simulation.
+ */
+#include "sim-firmware.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <gtest/gtest.h>
+
+#include "hardware-mapping.h"
+#include "motor-operations.h"
+
+static void EnqueueTestMoves(MotionQueue *backend) {
+  HardwareMapping hw;
+  MotionQueueMotorOperations motor_operations(&hw, backend);
+  const LinearSegmentSteps kMoves[] = {
+    { 0,     20000, 0, { 2000,  700, -13, 0, 0, 0, 0, 0 } },
+    { 20000, 20000, 0, { 5000, 1751, -31, 0, 0, 0, 0, 0 } },
+    { 20000, 0,     0, { 2000,  700, -13, 0, 0, 0, 0, 0 } },
+    { 1000,  1000,  0, { 0,     -100, 0,  0, 0, 0, 0, 0 } },
+    { 5000,  5000,  0, { -333,  0,   0,   0, 0, 0, 0, 0 } },
+  };
+  for (const LinearSegmentSteps &move : kMoves) {
+    motor_operations.Enqueue(move);
+  }
+  motor_operations.WaitQueueEmpty();
+}
+
+TEST(SimFastForward, ReachesTargetPosition) {
+  SimFastForwardQueue sim;
+  EnqueueTestMoves(&sim);
+  EXPECT_EQ(2000 + 5000 + 2000 - 333, sim.motor_steps(0));
+  EXPECT_EQ(700 + 1751 + 700 - 100, sim.motor_steps(1));
+  EXPECT_EQ(-13 - 31 - 13, sim.motor_steps(2));
+  EXPECT_EQ(0, sim.motor_steps(3));
+  EXPECT_EQ(5u, sim.segment_count());
+}
+
+TEST(SimFastForward, ElapsedTimeMatchesPhysics) {
+  SimFastForwardQueue sim;
+  HardwareMapping hw;
+  MotionQueueMotorOperations motor_operations(&hw, &sim);
+  const LinearSegmentSteps kTravel = { 10000, 10000, 0, { 10000 } };
+  motor_operations.Enqueue(kTravel);
+  EXPECT_NEAR(1.0, sim.elapsed_seconds(), 0.01);
+
+  // Accelerating from standstill takes twice as long as traveling.
+  const LinearSegmentSteps kAccel = { 0, 10000, 0, { 10000 } };
+  motor_operations.Enqueue(kAccel);
+  EXPECT_NEAR(3.0, sim.elapsed_seconds(), 0.03);
+
+  sim.Dwell(500);
+  EXPECT_NEAR(3.5, sim.elapsed_seconds(), 0.03);
+}
+
+TEST(SimFastForward, SameResultAsFullSimulation) {
+  FILE *samples = tmpfile();
+  ASSERT_TRUE(samples != NULL);
+  SimFirmwareQueue full_sim(samples, 3);
+  EnqueueTestMoves(&full_sim);
+
+  SimFastForwardQueue fast_sim;
+  EnqueueTestMoves(&fast_sim);
+
+  // The last sample contains the total time and the motor positions.
+  char line[1024], last_line[1024] = "";
+  rewind(samples);
+  while (fgets(line, sizeof(line), samples)) {
+    strcpy(last_line, line);
+  }
+  fclose(samples);
+  double time, speed, accel, ignore;
+  int delay;
+  int steps[3];
+  ASSERT_EQ(13, sscanf(last_line, "%lf %d %lf %lf %d %lf %lf %d %lf %lf %d %lf %lf",
+                       &time, &delay, &speed, &accel,
+                       &steps[0], &ignore, &ignore,
+                       &steps[1], &ignore, &ignore,
+                       &steps[2], &ignore, &ignore));
+  // Only differs in the rounding of the accumulated doubles.
+  EXPECT_NEAR(time, fast_sim.elapsed_seconds(), 1e-6);
+  for (int i = 0; i < 3; ++i) {
+    EXPECT_EQ(steps[i], fast_sim.motor_steps(i)) << "motor " << i;
+  }
+}
+
+int main(int argc, char *argv[]) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -22,10 +22,15 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <termios.h>
 #include <time.h>
 #include <errno.h>
 
+#include <algorithm>
+#include <deque>
+#include <functional>
+
 #include "common/logging.h"
 #include "common/string-util.h"
 
@@ -61,6 +66,12 @@ static void sleep_ms(int ms) {
   }
 }
 
+static int64_t now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 Spindle::Spindle() {
   impl_ = NULL;
   type_ = kType;
@@ -70,6 +81,7 @@ Spindle::Spindle() {
   on_delay_ms_ = 0;
   off_delay_ms_ = 0;
   allow_ccw_ = false;
+  velocity_pwm_ = false;
 }
 
 class Spindle::ConfigReader : public ConfigParser::Reader {
@@ -93,6 +105,7 @@ public:
       ACCEPT_VALUE("on-delay-msec",  Int,    &config_->on_delay_ms_);
       ACCEPT_VALUE("off-delay-msec", Int,    &config_->off_delay_ms_);
       ACCEPT_VALUE("allow-ccw",      Bool,   &config_->allow_ccw_);
+      ACCEPT_VALUE("velocity-pwm",   Bool,   &config_->velocity_pwm_);
 
       return false;
     }
@@ -129,21 +142,74 @@ public:
     is_off_ = true;
     is_ccw_ = false;
     duty_cycle_ = 0;
+    schedule_end_ms_ = 0;
+    motion_ready_ms_ = 0;
+    pthread_mutex_init(&schedule_mutex_, NULL);
   }
 
-  virtual ~Impl() {}
+  virtual ~Impl() { pthread_mutex_destroy(&schedule_mutex_); }
 
   virtual bool Init() { return true; }
 
+  // Schedule the output changes to get to the new state. The state members
+  // below already describe where we will be once all of them are done.
   virtual void On(bool ccw, int rpm) = 0;
   virtual void Off() = 0;
 
+  void ScheduleOn(bool ccw, int rpm) {
+    pthread_mutex_lock(&schedule_mutex_);
+    BeginSchedule();
+    const bool speed_change_only = !is_off_ && is_ccw_ == ccw;
+    On(ccw, rpm);
+    if (!speed_change_only) motion_ready_ms_ = schedule_end_ms_;
+    pthread_mutex_unlock(&schedule_mutex_);
+    Update(false);
+  }
+
+  void ScheduleOff() {
+    pthread_mutex_lock(&schedule_mutex_);
+    BeginSchedule();
+    Off();
+    motion_ready_ms_ = schedule_end_ms_;
+    pthread_mutex_unlock(&schedule_mutex_);
+    Update(false);
+  }
+
+  // Apply the changes that are due. Returns milliseconds until all are
+  // done, or, if "for_motion", until motion may continue.
+  int Update(bool for_motion) {
+    pthread_mutex_lock(&schedule_mutex_);
+    const int64_t now = now_ms();
+    while (!schedule_.empty() && schedule_.front().due_ms <= now) {
+      schedule_.front().action();
+      schedule_.pop_front();
+    }
+    const int64_t end = for_motion ? motion_ready_ms_ : schedule_end_ms_;
+    const int remaining = end > now ? end - now : 0;
+    pthread_mutex_unlock(&schedule_mutex_);
+    return remaining;
+  }
+
+  bool IsOn(bool ccw) {
+    pthread_mutex_lock(&schedule_mutex_);
+    const bool result = !is_off_ && is_ccw_ == ccw;
+    pthread_mutex_unlock(&schedule_mutex_);
+    return result;
+  }
+
   void set_output(HardwareMapping::LogicOutput out, bool is_on) {
     hardware_mapping_->UpdateAuxBitmap(out, is_on);
     hardware_mapping_->SetAuxOutputs();
   }
 
 protected:
+  // Run "action" once everything scheduled before is done.
+  void Schedule(const std::function<void()> &action) {
+    schedule_.push_back({schedule_end_ms_, action});
+  }
+  // Let the next scheduled action wait for "ms" more.
+  void Delay(int ms) { if (ms > 0) schedule_end_ms_ += ms; }
+
   HardwareMapping *hardware_mapping_;
 
   int max_rpm_;
@@ -154,50 +220,72 @@ protected:
   bool is_off_;
   bool is_ccw_;
   float duty_cycle_;
+
+private:
+  // A new command continues where the last one ends.
+  void BeginSchedule() {
+    schedule_end_ms_ = std::max(schedule_end_ms_, now_ms());
+  }
+
+  struct ScheduledAction {
+    int64_t due_ms;
+    std::function<void()> action;
+  };
+  pthread_mutex_t schedule_mutex_;
+  std::deque<ScheduledAction> schedule_;
+  int64_t schedule_end_ms_;   // When the spindle reached the state above.
+  // When the last start, reversal or stop is done. Speed changes of the
+  // running spindle don't hold back motion.
+  int64_t motion_ready_ms_;
 };
 
 class PWMSpindle : public Spindle::Impl {
 public:
   PWMSpindle(HardwareMapping *hardware_mapping, int max_rpm,
-             int pwr_delay_ms, int on_delay_ms, int off_delay_ms)
-    : Impl(hardware_mapping, max_rpm, pwr_delay_ms, on_delay_ms, off_delay_ms) {
+             int pwr_delay_ms, int on_delay_ms, int off_delay_ms,
+             bool velocity_pwm)
+    : Impl(hardware_mapping, max_rpm, pwr_delay_ms, on_delay_ms, off_delay_ms),
+      velocity_pwm_(velocity_pwm) {
     Log_debug("PWMSpindle: constructed");
     Log_debug("  max_rpm      : %d", max_rpm);
     Log_debug("  pwr_delay_ms : %d", pwr_delay_ms);
     Log_debug("  on_delay_ms  : %d", on_delay_ms);
     Log_debug("  off_delay_ms : %d", off_delay_ms);
+    Log_debug("  velocity_pwm : %s", velocity_pwm ? "yes" : "no");
   }
 
   void On(bool ccw, int rpm) final {
     // turn on spindle power if necessary
     if (is_off_) {
-      set_output(HardwareMapping::OUT_SPINDLE, true);
-      if (pwr_delay_ms_) sleep_ms(pwr_delay_ms_);
+      Schedule([this]() { set_output(HardwareMapping::OUT_SPINDLE, true); });
+      Delay(pwr_delay_ms_);
     }
 
     // direction change? ramp down spindle
     if (ccw != is_ccw_) ramp_down();
 
     // set the spindle direction
-    set_output(HardwareMapping::OUT_SPINDLE_DIRECTION, ccw);
+    Schedule([this, ccw]() {
+        set_output(HardwareMapping::OUT_SPINDLE_DIRECTION, ccw);
+      });
     is_ccw_ = ccw;
 
     // ramp the spindle to the target speed
     float target = std::min((float)rpm / max_rpm_, 1.0f);
+    if (velocity_pwm_) duty_cycle_ = target;  // Set along with the motion.
     float epsilon = (duty_cycle_ < target) ? kRampEpsilon : -kRampEpsilon;
     while (duty_cycle_ != target) {
       duty_cycle_ += epsilon;
       if ((epsilon < 0 && duty_cycle_ < target) ||
           (epsilon > 0 && duty_cycle_ > target))
         duty_cycle_ = target;
-      hardware_mapping_->SetPWMOutput(HardwareMapping::OUT_SPINDLE_SPEED,
-                                      duty_cycle_);
-      sleep_ms(kRampDelayMs);
+      set_speed(duty_cycle_);
+      Delay(kRampDelayMs);
     }
 
     // optionally delay before continuing
     if (is_off_) {
-      if (on_delay_ms_) sleep_ms(on_delay_ms_);
+      Delay(on_delay_ms_);
       is_off_ = false;
     }
 
@@ -207,24 +295,38 @@ public:
 
   void Off() final {
     ramp_down();
-    if (off_delay_ms_) sleep_ms(off_delay_ms_);
-    set_output(HardwareMapping::OUT_SPINDLE, false);
+    Delay(off_delay_ms_);
+    Schedule([this]() { set_output(HardwareMapping::OUT_SPINDLE, false); });
     is_off_ = true;
     Log_debug("PWMSpindle: off");
   }
 
 private:
   void ramp_down() {
+    if (velocity_pwm_) {
+      // Not ramped; this stops the PWM the motion was driving.
+      duty_cycle_ = 0;
+      set_speed(0);
+      return;
+    }
     while (duty_cycle_ > 0) {
       if (duty_cycle_ >= kRampEpsilon)
         duty_cycle_ -= kRampEpsilon;
       else
         duty_cycle_ = 0;
-      hardware_mapping_->SetPWMOutput(HardwareMapping::OUT_SPINDLE_SPEED,
-                                      duty_cycle_);
-      sleep_ms(kRampDelayMs);
+      set_speed(duty_cycle_);
+      Delay(kRampDelayMs);
     }
   }
+
+  void set_speed(float duty_cycle) {
+    Schedule([this, duty_cycle]() {
+        hardware_mapping_->SetPWMOutput(HardwareMapping::OUT_SPINDLE_SPEED,
+                                        duty_cycle);
+      });
+  }
+
+  const bool velocity_pwm_;
 };
 
 class PololuSMCSpindle : public Spindle::Impl {
@@ -352,7 +454,7 @@ public:
     Log_debug("PololuSMCSpindle: initialized  ProductID:0x%04x  Firmware:%d.%d\n",
            response[0] + 256 * response[1], response[3], response[2]);
 
-    Off();
+    ScheduleOff();
 
     return true;
   }
@@ -361,24 +463,27 @@ public:
     if (fd_ == -1) return;
 
     if (is_off_) {
-      set_output(HardwareMapping::OUT_SPINDLE, true);
-      if (pwr_delay_ms_) sleep_ms(pwr_delay_ms_);
-      exit_safe_start();
+      Schedule([this]() { set_output(HardwareMapping::OUT_SPINDLE, true); });
+      Delay(pwr_delay_ms_);
+      Schedule([this]() { exit_safe_start(); });
     }
 
     // scale the desired RPM to the MAX_SPEED of the SMC
     int speed = std::min(rpm * MAX_SPEED / max_rpm_, (int)MAX_SPEED);
 
-    unsigned char command[3];
-    command[0] = (ccw) ? CMD_MOTOR_REVERSE : CMD_MOTOR_FORWARD;
-    command[1] = speed & 0x1f;
-    command[2] = (speed >> 5) & 0x7f;
-    send(command, sizeof(command));
+    Schedule([this, ccw, speed]() {
+        unsigned char command[3];
+        command[0] = (ccw) ? CMD_MOTOR_REVERSE : CMD_MOTOR_FORWARD;
+        command[1] = speed & 0x1f;
+        command[2] = (speed >> 5) & 0x7f;
+        send(command, sizeof(command));
+      });
 
     if (is_off_) {
-      if (on_delay_ms_) sleep_ms(on_delay_ms_);
+      Delay(on_delay_ms_);
       is_off_ = false;
     }
+    is_ccw_ = ccw;
 
     float duty_cycle = std::min((float)rpm / max_rpm_, 1.0f);
     Log_debug("PololuSMCSpindle: on %s at %d RPM (speed: %d)",
@@ -388,11 +493,13 @@ public:
   void Off() {
     if (fd_ == -1) return;
 
-    const unsigned char command = CMD_STOP_MOTOR;
-    send(&command, 1);
+    Schedule([this]() {
+        const unsigned char command = CMD_STOP_MOTOR;
+        send(&command, 1);
+      });
 
-    if (off_delay_ms_) sleep_ms(off_delay_ms_);
-    set_output(HardwareMapping::OUT_SPINDLE, false);
+    Delay(off_delay_ms_);
+    Schedule([this]() { set_output(HardwareMapping::OUT_SPINDLE, false); });
     is_off_ = true;
     Log_debug("PololuSMCSpindle: off");
   }
@@ -426,15 +533,22 @@ bool Spindle::Init(HardwareMapping *hardware_mapping) {
   std::string line;
   if (type_ == "simple-pwm") {
     impl_ = new PWMSpindle(hardware_mapping, max_rpm_,
-                           pwr_delay_ms_, on_delay_ms_, off_delay_ms_);
+                           pwr_delay_ms_, on_delay_ms_, off_delay_ms_,
+                           velocity_pwm_);
   } else if (type_ == "pololu-smc") {
+    if (velocity_pwm_) {
+      Log_error("Spindle: velocity-pwm needs a simple-pwm spindle");
+      return false;
+    }
     impl_ = new PololuSMCSpindle(hardware_mapping, port_.c_str(), max_rpm_,
                                  pwr_delay_ms_, on_delay_ms_, off_delay_ms_);
   } else {
     return false;
   }
   Log_debug("  allow_ccw : %s", allow_ccw_ ? "yes" : "no");
-  return impl_->Init();
+  if (!impl_->Init()) return false;
+  WaitReady();  // Start in a known state.
+  return true;
 }
 
 void Spindle::On(bool ccw, int rpm) {
@@ -443,9 +557,35 @@ void Spindle::On(bool ccw, int rpm) {
       return;
     }
 
-  if (impl_) impl_->On(ccw, rpm);
+  if (impl_) impl_->ScheduleOn(ccw, rpm);
+}
+
+float Spindle::DutyCycle(int rpm) const {
+  return max_rpm_ > 0 ? std::min(std::max(rpm, 0) / (float)max_rpm_, 1.0f) : 0;
 }
 
 void Spindle::Off() {
-  if (impl_) impl_->Off();
+  if (impl_) impl_->ScheduleOff();
+}
+
+bool Spindle::IsOn(bool ccw) {
+  return impl_ && impl_->IsOn(ccw);
+}
+
+int Spindle::Update() {
+  return impl_ ? impl_->Update(false) : 0;
+}
+
+void Spindle::WaitReady() {
+  int remaining;
+  while ((remaining = Update()) > 0) {
+    sleep_ms(std::min(remaining, kRampDelayMs));
+  }
+}
+
+void Spindle::WaitReadyForMotion() {
+  int remaining;
+  while ((remaining = impl_ ? impl_->Update(true) : 0) > 0) {
+    sleep_ms(std::min(remaining, kRampDelayMs));
+  }
 }
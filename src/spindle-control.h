@@ -35,10 +35,35 @@ public:
    bool Init(HardwareMapping *hardware_mapping);
 
    // Turn spindle on clockwise (M3) or counterclockwise (M4) at speed (Sxx)
+   // This does not block: power-up delay and speed ramp are scheduled and
+   // the outputs are changed by Update() when due.
    void On(bool ccw, int rpm);
-   // Turn spindle off (M5)
+   // Turn spindle off (M5). Does not block either.
    void Off();
 
+   // Returns true if the spindle is commanded to turn in the given direction.
+   bool IsOn(bool ccw);
+
+   // Apply the scheduled output changes that are due. Returns milliseconds
+   // until the spindle reached the last commanded state or 0 if it is there.
+   // Can be called from any thread.
+   int Update();
+
+   // Block until the spindle reached the last commanded state.
+   void WaitReady();
+
+   // Block until motion can continue: the last start, reversal or stop is
+   // done. A speed change of the running spindle is not waited for.
+   void WaitReadyForMotion();
+
+   // With velocity-pwm, the PWM duty cycle is not set here but by the motor
+   // backend, following the speed of the motors (e.g. laser power). See
+   // MotorOperations::SetVelocityPWM().
+   bool HasVelocityPWM() const { return velocity_pwm_; }
+
+   // Duty cycle for the given speed.
+   float DutyCycle(int rpm) const;
+
 // FIXME: why can't this be private?
   class Impl;
   Impl *impl_;
@@ -54,6 +79,7 @@ private:
   int on_delay_ms_;
   int off_delay_ms_;
   bool allow_ccw_;
+  bool velocity_pwm_;
 };
 
 #endif  // BEAGLEG_SPINDLE_CONTROL_
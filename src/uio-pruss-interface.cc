@@ -36,6 +36,12 @@
 // Generated PRU code from motor-interface-pru.p
 #include "motor-interface-pru_bin.h"
 
+#ifdef PRU1_AUX
+// Generated PRU code from io-interface-pru1.p for the other PRU.
+#  include "io-interface-pru1_bin.h"
+#  define IO_PRU_NUM 1
+#endif
+
 // Target PRU
 #define PRU_NUM 0
 
@@ -74,6 +80,12 @@ bool UioPrussInterface::AllocateSharedMem(void **pru_mmap, const size_t size) {
 }
 
 bool UioPrussInterface::StartExecution() {
+#ifdef PRU1_AUX
+  // First the PRU setting the aux bits, so that it is ready for the first
+  // segment.
+  prussdrv_pru_write_memory(PRUSS0_PRU1_IRAM, 0, PRU1code, sizeof(PRU1code));
+  prussdrv_pru_enable(IO_PRU_NUM);
+#endif
   prussdrv_pru_write_memory(PRU_INSTRUCTIONRAM, 0, PRUcode, sizeof(PRUcode));
   prussdrv_pru_enable(PRU_NUM);
   return true;
@@ -85,8 +97,15 @@ unsigned UioPrussInterface::WaitEvent() {
   return num_events;
 }
 
+int UioPrussInterface::EventFd() {
+  return prussdrv_pru_event_fd(PRU_EVTOUT_0);
+}
+
 bool UioPrussInterface::Shutdown() {
   prussdrv_pru_disable(PRU_NUM);
+#ifdef PRU1_AUX
+  prussdrv_pru_disable(IO_PRU_NUM);
+#endif
   prussdrv_exit();
   return true;
 }